@@ -897,6 +897,96 @@ int rioWriteBulkObject(rio *r, robj *obj) {
     }
 }
 
+/* A field written by the BITFIELD command emitted by rewriteBitmapObject(). */
+struct bitmapRewriteField {
+    long long offset;   /* Offset in units of the field width (#offset). */
+    long long value;
+    int bits;           /* 64 (i64) or 8 (u8). */
+};
+
+/* Emit a BITFIELD command setting the 'count' fields. */
+static int rewriteBitmapFields(rio *r, robj *key, struct bitmapRewriteField *f, int count) {
+    char buf[32];
+    int j, len;
+
+    if (rioWriteBulkCount(r,'*',2+count*4) == 0) return 0;
+    if (rioWriteBulkString(r,"BITFIELD",8) == 0) return 0;
+    if (rioWriteBulkObject(r,key) == 0) return 0;
+    for (j = 0; j < count; j++) {
+        len = snprintf(buf,sizeof(buf),"#%lld",f[j].offset);
+        if (rioWriteBulkString(r,"SET",3) == 0) return 0;
+        if (rioWriteBulkString(r,f[j].bits == 64 ? "i64" : "u8",
+                               f[j].bits == 64 ? 3 : 2) == 0) return 0;
+        if (rioWriteBulkString(r,buf,len) == 0) return 0;
+        if (rioWriteBulkLongLong(r,f[j].value) == 0) return 0;
+    }
+    return 1;
+}
+
+/* Emit the commands needed to rebuild a compressed bitmap: a SETBIT creating
+ * the string with its final length, and BITFIELD commands setting the 64 bit
+ * words with some bit set, or the single bytes at the end of the string.
+ * The function returns 0 on error, 1 on success. */
+/* 生成重建压缩位图所需要的命令 */
+int rewriteBitmapObject(rio *r, robj *key, robj *o) {
+    rbm *bm = o->ptr;
+    unsigned char chunk[RBM_CHUNK_BYTES];
+    struct bitmapRewriteField fields[AOF_REWRITE_ITEMS_PER_CMD];
+    uint32_t chunkid, from = 0;
+    uint64_t lastbit;
+    int count = 0;
+
+    if (bm->len == 0) {
+        char cmd[]="*3\r\n$3\r\nSET\r\n";
+        if (rioWrite(r,cmd,sizeof(cmd)-1) == 0) return 0;
+        if (rioWriteBulkObject(r,key) == 0) return 0;
+        return rioWriteBulkString(r,"",0);
+    }
+
+    lastbit = (uint64_t)bm->len*8-1;
+    if (rioWriteBulkCount(r,'*',4) == 0) return 0;
+    if (rioWriteBulkString(r,"SETBIT",6) == 0) return 0;
+    if (rioWriteBulkObject(r,key) == 0) return 0;
+    if (rioWriteBulkLongLong(r,lastbit) == 0) return 0;
+    if (rioWriteBulkLongLong(r,rbmGetBit(bm,lastbit)) == 0) return 0;
+
+    while (rbmNextChunk(bm,from,&chunkid)) {
+        size_t base = (size_t)chunkid*RBM_CHUNK_BYTES, j, k;
+
+        rbmGetChunk(bm,chunkid,chunk);
+        for (j = 0; j < RBM_CHUNK_BYTES && base+j < bm->len; j += 8) {
+            uint64_t word = 0;
+
+            for (k = 0; k < 8; k++) word = (word << 8) | chunk[j+k];
+            if (word == 0) continue;
+            for (k = 0; k < 8; k++) {
+                if (count == AOF_REWRITE_ITEMS_PER_CMD) {
+                    if (rewriteBitmapFields(r,key,fields,count) == 0) return 0;
+                    count = 0;
+                }
+                /* Set the whole word when it is inside the string,
+                 * otherwise byte by byte, not to make it longer. */
+                if (base+j+8 <= bm->len) {
+                    fields[count].offset = (base+j)/8;
+                    fields[count].value = (int64_t)word;
+                    fields[count].bits = 64;
+                    count++;
+                    break;
+                }
+                if (base+j+k >= bm->len) break;
+                if (chunk[j+k] == 0) continue;
+                fields[count].offset = base+j+k;
+                fields[count].value = chunk[j+k];
+                fields[count].bits = 8;
+                count++;
+            }
+        }
+        from = chunkid+1;
+    }
+    if (count && rewriteBitmapFields(r,key,fields,count) == 0) return 0;
+    return 1;
+}
+
 /* Emit the commands needed to rebuild a list object. The function returns 0 on error, 1 on success. */
 int rewriteListObject(rio *r, robj *key, robj *o) {
     long long count = 0, items = listTypeLength(o);
@@ -994,7 +1084,7 @@ int rewriteSetObject(rio *r, robj *key, robj *o) {
 int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
     long long count = 0, items = zsetLength(o);
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = o->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -1002,13 +1092,13 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
         long long vll;
         double score;
 
-        eptr = ziplistIndex(zl,0);
+        eptr = lpFirst(zl);
         serverAssert(eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         while (eptr != NULL) {
-            serverAssert(ziplistGet(eptr,&vstr,&vlen,&vll));
+            serverAssert(lpGetValue(eptr,&vstr,&vlen,&vll));
             score = zzlGetScore(sptr);
 
             if (count == 0) {
@@ -1035,14 +1125,15 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
 				count = 0;
             items--;
         }
-    } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (o->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = o->ptr;
-        dictIterator *di = dictGetIterator(zs->dict);
-        dictEntry *de;
+        zbtPos pos;
 
-        while((de = dictNext(di)) != NULL) {
-            sds ele = dictGetKey(de);
-            double *score = dictGetVal(de);
+        /* Emit the elements in order, so that loading the AOF only appends
+         * them at the end of the B+tree. */
+        zbtFirst(zs->zbt,&pos);
+        while(pos.leaf != NULL) {
+            zbtEntry *e = zbtPosEntry(&pos);
 
             if (count == 0) {
                 int cmd_items = (items > AOF_REWRITE_ITEMS_PER_CMD) ? AOF_REWRITE_ITEMS_PER_CMD : items;
@@ -1054,15 +1145,15 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
                 if (rioWriteBulkObject(r,key) == 0) 
 					return 0;
             }
-            if (rioWriteBulkDouble(r,*score) == 0) 
+            if (rioWriteBulkDouble(r,e->score) == 0) 
 				return 0;
-            if (rioWriteBulkString(r,ele,sdslen(ele)) == 0) 
+            if (rioWriteBulkString(r,e->ele,sdslen(e->ele)) == 0) 
 				return 0;
             if (++count == AOF_REWRITE_ITEMS_PER_CMD) 
 				count = 0;
             items--;
+            zbtNext(&pos);
         }
-        dictReleaseIterator(di);
     } else {
         serverPanic("Unknown sorted zset encoding");
     }
@@ -1076,12 +1167,12 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
  *
  * The function returns 0 on error, non-zero on success. */
 static int rioWriteHashIteratorCursor(rio *r, hashTypeIterator *hi, int what) {
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        hashTypeCurrentFromZiplist(hi, what, &vstr, &vlen, &vll);
+        hashTypeCurrentFromListpack(hi, what, &vstr, &vlen, &vll);
         if (vstr)
             return rioWriteBulkString(r, (char*)vstr, vlen);
         else
@@ -1141,21 +1232,19 @@ int rioWriteBulkStreamID(rio *r,streamID *id) {
 }
 
 /* Helper for rewriteStreamObject(): emit the XCLAIM needed in order to
- * add the message described by 'nack' having the id 'rawid', into the pending
+ * add the message described by 'nack' having the id 'id', into the pending
  * list of the specified consumer. All this in the context of the specified
  * key and group. */
-int rioWriteStreamPendingEntry(rio *r, robj *key, const char *groupname, size_t groupname_len, streamConsumer *consumer, unsigned char *rawid, streamNACK *nack) {
+int rioWriteStreamPendingEntry(rio *r, robj *key, const char *groupname, size_t groupname_len, streamConsumer *consumer, streamID *id, streamNACK *nack) {
      /* XCLAIM <key> <group> <consumer> 0 <id> TIME <milliseconds-unix-time>
                RETRYCOUNT <count> JUSTID FORCE. */
-    streamID id;
-    streamDecodeID(rawid,&id);
     if (rioWriteBulkCount(r,'*',12) == 0) return 0;
     if (rioWriteBulkString(r,"XCLAIM",6) == 0) return 0;
     if (rioWriteBulkObject(r,key) == 0) return 0;
     if (rioWriteBulkString(r,groupname,groupname_len) == 0) return 0;
     if (rioWriteBulkString(r,consumer->name,sdslen(consumer->name)) == 0) return 0;
     if (rioWriteBulkString(r,"0",1) == 0) return 0;
-    if (rioWriteBulkStreamID(r,&id) == 0) return 0;
+    if (rioWriteBulkStreamID(r,id) == 0) return 0;
     if (rioWriteBulkString(r,"TIME",4) == 0) return 0;
     if (rioWriteBulkLongLong(r,nack->delivery_time) == 0) return 0;
     if (rioWriteBulkString(r,"RETRYCOUNT",10) == 0) return 0;
@@ -1240,19 +1329,19 @@ int rewriteStreamObject(rio *r, robj *key, robj *o) {
                 streamConsumer *consumer = ri_cons.data;
                 /* For the current consumer, iterate all the PEL entries
                  * to emit the XCLAIM protocol. */
-                raxIterator ri_pel;
-                raxStart(&ri_pel,consumer->pel);
-                raxSeek(&ri_pel,"^",NULL,0);
-                while(raxNext(&ri_pel)) {
-                    streamNACK *nack = ri_pel.data;
+                streamPELIterator pi;
+                streamNACK *nack;
+                streamID id;
+                streamPELIteratorStart(&pi,group,consumer,NULL);
+                while(streamPELIteratorNext(&pi,&id,&nack)) {
                     if (rioWriteStreamPendingEntry(r,key,(char*)ri.key,
                                                    ri.key_len,consumer,
-                                                   ri_pel.key,nack) == 0)
+                                                   &id,nack) == 0)
                     {
                         return 0;
                     }
                 }
-                raxStop(&ri_pel);
+                streamPELIteratorStop(&pi);
             }
             raxStop(&ri_cons);
         }
@@ -1295,7 +1384,7 @@ ssize_t aofReadDiffFromParent(void) {
 }
 
 int rewriteAppendOnlyFileRio(rio *aof) {
-    dictIterator *di = NULL;
+    dbIterator *di = NULL;
     dictEntry *de;
     size_t processed = 0;
     int j;
@@ -1303,16 +1392,15 @@ int rewriteAppendOnlyFileRio(rio *aof) {
     for (j = 0; j < server.dbnum; j++) {
         char selectcmd[] = "*2\r\n$6\r\nSELECT\r\n";
         redisDb *db = server.db+j;
-        dict *d = db->dict;
-        if (dictSize(d) == 0) continue;
-        di = dictGetSafeIterator(d);
+        if (dbSize(db) == 0) continue;
+        di = dbGetSafeIterator(db);
 
         /* SELECT the new DB */
         if (rioWrite(aof,selectcmd,sizeof(selectcmd)-1) == 0) goto werr;
         if (rioWriteBulkLongLong(aof,j) == 0) goto werr;
 
         /* Iterate this DB writing every entry */
-        while((de = dictNext(di)) != NULL) {
+        while((de = dbNext(di)) != NULL) {
             sds keystr;
             robj key, *o;
             long long expiretime;
@@ -1324,7 +1412,10 @@ int rewriteAppendOnlyFileRio(rio *aof) {
             expiretime = getExpire(db,&key);
 
             /* Save the key and associated value */
-            if (o->type == OBJ_STRING) {
+            if (o->type == OBJ_STRING &&
+                o->encoding == OBJ_ENCODING_ROARING) {
+                if (rewriteBitmapObject(aof,&key,o) == 0) goto werr;
+            } else if (o->type == OBJ_STRING) {
                 /* Emit a SET command */
                 char cmd[]="*3\r\n$3\r\nSET\r\n";
                 if (rioWrite(aof,cmd,sizeof(cmd)-1) == 0) goto werr;
@@ -1359,13 +1450,13 @@ int rewriteAppendOnlyFileRio(rio *aof) {
                 aofReadDiffFromParent();
             }
         }
-        dictReleaseIterator(di);
+        dbReleaseIterator(di);
         di = NULL;
     }
     return C_OK;
 
 werr:
-    if (di) dictReleaseIterator(di);
+    if (di) dbReleaseIterator(di);
     return C_ERR;
 }
 
@@ -36,7 +36,9 @@ time_t bioOlderJobOfType(int type);
 void bioKillThreads(void);
 
 /* Background job opcodes */
-#define BIO_CLOSE_FILE    0 /* Deferred close(2) syscall. */
+#define BIO_CLOSE_FILE    0 /* Deferred close(2) syscall, optionally
+                               preceded by fsync(2). */
 #define BIO_AOF_FSYNC     1 /* Deferred AOF fsync. */
 #define BIO_LAZY_FREE     2 /* Deferred objects freeing. */
-#define BIO_NUM_OPS       3
+#define BIO_SETOPS        3 /* SUNION & co. on huge inputs, see setops.c. */
+#define BIO_NUM_OPS       4
@@ -30,6 +30,193 @@
 
 #include "server.h"
 
+/* -----------------------------------------------------------------------------
+ * Vectorized kernels.
+ *
+ * On x86-64 the inner loops of BITCOUNT, BITPOS and BITOP also have an AVX2
+ * implementation, and the population count an AVX-512 one for the CPUs
+ * having the VPOPCNTDQ extension. The kernels are compiled with the target
+ * attribute, so that the rest of the server is still built for the baseline
+ * instruction set, and are only used after checking at runtime that the
+ * CPU (and the OS) support them. Every kernel processes only whole vectors:
+ * the caller takes care of the remaining bytes with the scalar code.
+ * -------------------------------------------------------------------------- */
+
+#if defined(HAVE_X86_SIMD) && !defined(USE_ALIGNED_ACCESS)
+#define BITOPS_HAVE_SIMD
+#include <immintrin.h>
+#endif
+
+#define BITOP_AND   0
+#define BITOP_OR    1
+#define BITOP_XOR   2
+#define BITOP_NOT   3
+
+#define BITOPS_SIMD_NONE 0
+#define BITOPS_SIMD_AVX2 1
+#define BITOPS_SIMD_AVX512 2
+
+static int bitopsSimd = -1; /* Instruction set to use, -1 if not yet known. */
+
+/* 返回当前CPU可用的向量指令集 只在第一次调用时检测 */
+static int bitopsSimdLevel(void) {
+    if (bitopsSimd != -1) return bitopsSimd;
+    bitopsSimd = BITOPS_SIMD_NONE;
+#ifdef BITOPS_HAVE_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        bitopsSimd = BITOPS_SIMD_AVX2;
+        if (__builtin_cpu_supports("avx512f") &&
+            __builtin_cpu_supports("avx512vpopcntdq"))
+            bitopsSimd = BITOPS_SIMD_AVX512;
+    }
+#endif
+    return bitopsSimd;
+}
+
+#ifdef BITOPS_HAVE_SIMD
+/* Population count of the first count/32 vectors of 'p', using the nibble
+ * lookup table method: every byte is split into its two nibbles, that are
+ * used to index a 16 entries table of bit counts with PSHUFB. The per byte
+ * counts are accumulated for 31 vectors at most, so that they can't
+ * overflow (31*8 = 248), and then summed horizontally with PSADBW. */
+__attribute__((target("avx2")))
+static size_t popcountAvx2(const unsigned char *p, size_t count) {
+    const __m256i lut = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+                                         0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i acc = _mm256_setzero_si256();
+    size_t j = 0;
+
+    while (j+32 <= count) {
+        __m256i partial = _mm256_setzero_si256();
+        int k;
+
+        for (k = 0; k < 31 && j+32 <= count; k++, j += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(p+j));
+            __m256i lo = _mm256_and_si256(v,low);
+            __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v,4),low);
+            partial = _mm256_add_epi8(partial,_mm256_shuffle_epi8(lut,lo));
+            partial = _mm256_add_epi8(partial,_mm256_shuffle_epi8(lut,hi));
+        }
+        acc = _mm256_add_epi64(acc,
+                _mm256_sad_epu8(partial,_mm256_setzero_si256()));
+    }
+    return (size_t)_mm256_extract_epi64(acc,0) +
+           (size_t)_mm256_extract_epi64(acc,1) +
+           (size_t)_mm256_extract_epi64(acc,2) +
+           (size_t)_mm256_extract_epi64(acc,3);
+}
+
+/* Population count of the first count/64 vectors of 'p'. */
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static size_t popcountAvx512(const unsigned char *p, size_t count) {
+    __m512i acc = _mm512_setzero_si512();
+    size_t j;
+
+    for (j = 0; j+64 <= count; j += 64) {
+        __m512i v = _mm512_loadu_si512((const void*)(p+j));
+        acc = _mm512_add_epi64(acc,_mm512_popcnt_epi64(v));
+    }
+    return (size_t)_mm512_reduce_add_epi64(acc);
+}
+
+/* Return the number of bytes at the start of 'p' that can be skipped while
+ * looking for the first bit set to 'bit', that is, the length of the prefix
+ * made of whole vectors all zero (bit 1) or all ones (bit 0). */
+__attribute__((target("avx2")))
+static size_t bitposSkipAvx2(const unsigned char *p, size_t count, int bit) {
+    const __m256i ones = _mm256_set1_epi8(-1);
+    size_t j = 0;
+
+    /* Check four vectors at a time, then one at a time. */
+    if (bit) {
+        for (; j+128 <= count; j += 128) {
+            __m256i v = _mm256_or_si256(
+                _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(p+j)),
+                                _mm256_loadu_si256((const __m256i*)(p+j+32))),
+                _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(p+j+64)),
+                                _mm256_loadu_si256((const __m256i*)(p+j+96))));
+            if (!_mm256_testz_si256(v,v)) break;
+        }
+        for (; j+32 <= count; j += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(p+j));
+            if (!_mm256_testz_si256(v,v)) break;
+        }
+    } else {
+        for (; j+128 <= count; j += 128) {
+            __m256i v = _mm256_and_si256(
+                _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(p+j)),
+                                 _mm256_loadu_si256((const __m256i*)(p+j+32))),
+                _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(p+j+64)),
+                                 _mm256_loadu_si256((const __m256i*)(p+j+96))));
+            if (!_mm256_testc_si256(v,ones)) break;
+        }
+        for (; j+32 <= count; j += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(p+j));
+            if (!_mm256_testc_si256(v,ones)) break;
+        }
+    }
+    return j;
+}
+
+#define BITOP_AVX2_LOOP(intrinsic) do { \
+    for (j = 0; j+32 <= len; j += 32) { \
+        __m256i acc = _mm256_loadu_si256((const __m256i*)(src[0]+j)); \
+        for (i = 1; i < numkeys; i++) \
+            acc = intrinsic(acc,_mm256_loadu_si256((const __m256i*)(src[i]+j))); \
+        _mm256_storeu_si256((__m256i*)(res+j),acc); \
+    } \
+} while(0)
+
+/* Store in 'res' the first len/32 vectors of the result of BITOP 'op'
+ * among the 'numkeys' strings in 'src'. 'res' may be one of the sources. */
+__attribute__((target("avx2")))
+static size_t bitopAvx2(unsigned long op, unsigned char *res,
+                        unsigned char **src, unsigned long numkeys, size_t len)
+{
+    unsigned long i;
+    size_t j;
+
+    /* Different branches per different operations for speed (sorry). */
+    switch(op) {
+    case BITOP_AND: BITOP_AVX2_LOOP(_mm256_and_si256); break;
+    case BITOP_OR:  BITOP_AVX2_LOOP(_mm256_or_si256); break;
+    case BITOP_XOR: BITOP_AVX2_LOOP(_mm256_xor_si256); break;
+    case BITOP_NOT:
+        for (j = 0; j+32 <= len; j += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(src[0]+j));
+            v = _mm256_xor_si256(v,_mm256_set1_epi8(-1));
+            _mm256_storeu_si256((__m256i*)(res+j),v);
+        }
+        break;
+    default: j = 0; break;
+    }
+    return j;
+}
+#endif
+
+/* Compute in 'res' the result of the BITOP 'op' among the first 'len' bytes
+ * of the 'numkeys' strings in 'src' using the vectorized kernels, if
+ * available. Return the number of bytes computed: the remaining ones, if
+ * any, are up to the caller. */
+static size_t bitopVector(unsigned long op, unsigned char *res,
+                          unsigned char **src, unsigned long numkeys,
+                          size_t len)
+{
+#ifdef BITOPS_HAVE_SIMD
+    if (bitopsSimdLevel() != BITOPS_SIMD_NONE)
+        return bitopAvx2(op,res,src,numkeys,len);
+#else
+    UNUSED(op);
+    UNUSED(res);
+    UNUSED(src);
+    UNUSED(numkeys);
+    UNUSED(len);
+#endif
+    return 0;
+}
+
 /* -----------------------------------------------------------------------------
  * Helpers and low level bit functions.
  * -------------------------------------------------------------------------- */
@@ -43,6 +230,24 @@ size_t redisPopcount(void *s, long count) {
     uint32_t *p4;
     static const unsigned char bitsinbyte[256] = {0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,4,5,5,6,5,6,6,7,5,6,6,7,6,7,7,8};
 
+#ifdef BITOPS_HAVE_SIMD
+    /* Count the whole vectors with the best kernel the CPU supports. */
+    if (count >= 64) {
+        int simd = bitopsSimdLevel();
+        size_t done = 0;
+
+        if (simd == BITOPS_SIMD_AVX512) {
+            bits = popcountAvx512(p,count);
+            done = count & ~63L;
+        } else if (simd == BITOPS_SIMD_AVX2) {
+            bits = popcountAvx2(p,count);
+            done = count & ~31L;
+        }
+        p += done;
+        count -= done;
+    }
+#endif
+
     /* Count initial bytes not aligned to 32 bit. */
     while((unsigned long)p & 3 && count) {
         bits += bitsinbyte[*p++];
@@ -132,6 +337,14 @@ long redisBitpos(void *s, unsigned long count, int bit) {
     /* Skip bits with full word step. */
     l = (unsigned long*) c;
     if (!found) {
+#ifdef BITOPS_HAVE_SIMD
+        if (count >= 32 && bitopsSimdLevel() != BITOPS_SIMD_NONE) {
+            size_t skipped = bitposSkipAvx2(c,count,bit);
+            l += skipped/sizeof(*l);
+            count -= skipped;
+            pos += skipped*8;
+        }
+#endif
         skipval = bit ? 0 : ULONG_MAX;
         while (count >= sizeof(*l)) {
             if (*l != skipval) break;
@@ -392,11 +605,6 @@ void printBits(unsigned char *p, unsigned long count) {
  * Bits related string commands: GETBIT, SETBIT, BITCOUNT, BITOP.
  * -------------------------------------------------------------------------- */
 
-#define BITOP_AND   0
-#define BITOP_OR    1
-#define BITOP_XOR   2
-#define BITOP_NOT   3
-
 #define BITFIELDOP_GET 0
 #define BITFIELDOP_SET 1
 #define BITFIELDOP_INCRBY 2
@@ -470,22 +678,95 @@ int getBitfieldTypeFromArgument(client *c, robj *o, int *sign, int *bits) {
     return C_OK;
 }
 
+/* Return true if a bitmap that is going to be 'len' bytes, and is currently
+ * 'curlen' bytes, should be stored compressed: it is longer than
+ * 'bitmap-compress-min-bytes' and it is growing a lot, so it is likely
+ * to be sparse. */
+static int bitmapShouldCompress(size_t len, size_t curlen) {
+    return server.bitmap_compress_min_bytes &&
+           len > server.bitmap_compress_min_bytes && len > curlen*2;
+}
+
+/* Convert the string object 'o', that must not be shared, to the specified
+ * encoding: OBJ_ENCODING_ROARING to compress a raw encoded string, or
+ * OBJ_ENCODING_RAW to get back the plain string of a compressed bitmap. */
+/* 在普通字符串和压缩位图两种编码方式之间进行转换 */
+static void bitmapConvert(robj *o, int encoding) {
+    serverAssert(o->type == OBJ_STRING && o->refcount == 1);
+    if (encoding == OBJ_ENCODING_ROARING) {
+        rbm *r;
+
+        serverAssert(o->encoding == OBJ_ENCODING_RAW);
+        r = rbmFromBuffer(o->ptr,sdslen(o->ptr));
+        sdsfree(o->ptr);
+        o->ptr = r;
+    } else if (encoding == OBJ_ENCODING_RAW) {
+        rbm *r = o->ptr;
+        sds s;
+
+        serverAssert(o->encoding == OBJ_ENCODING_ROARING);
+        s = sdsnewlen(NULL,r->len);
+        rbmToBuffer(r,(unsigned char*)s);
+        rbmFree(r);
+        o->ptr = s;
+    } else {
+        serverPanic("Unknown bitmap encoding");
+    }
+    o->encoding = encoding;
+}
+
+/* Called after a compressed bitmap is modified: it is converted back to a
+ * plain string if it no longer saves memory, or if it's not long enough to
+ * be compressed anymore because the configuration changed. */
+static void bitmapTryDecompress(robj *o) {
+    rbm *r = o->ptr;
+
+    if (o->encoding != OBJ_ENCODING_ROARING) return;
+    if (server.bitmap_compress_min_bytes == 0 ||
+        r->len <= server.bitmap_compress_min_bytes ||
+        rbmMemoryUsage(r) > r->len)
+    {
+        bitmapConvert(o,OBJ_ENCODING_RAW);
+    }
+}
+
 /* This is an helper function for commands implementations that need to write
  * bits to a string object. The command creates or pad with zeroes the string
  * so that the 'maxbit' bit can be addressed. The object is finally
  * returned. Otherwise if the key holds a wrong type NULL is returned and
- * an error is sent to the client. */
+ * an error is sent to the client.
+ *
+ * Long and sparse bitmaps are created compressed (see bitmapShouldCompress()),
+ * so the returned object may be OBJ_ENCODING_ROARING encoded. */
 robj *lookupStringForBitCommand(client *c, size_t maxbit) {
     size_t byte = maxbit >> 3;
     robj *o = lookupKeyWrite(c->db,c->argv[1]);
 
     if (o == NULL) {
-        o = createObject(OBJ_STRING,sdsnewlen(NULL, byte+1));
+        if (bitmapShouldCompress(byte+1,0))
+            o = createRoaringStringObject(rbmNew(byte+1));
+        else
+            o = createObject(OBJ_STRING,sdsnewlen(NULL, byte+1));
         dbAdd(c->db,c->argv[1],o);
     } else {
         if (checkType(c,o,OBJ_STRING)) return NULL;
-        o = dbUnshareStringValue(c->db,c->argv[1],o);
-        o->ptr = sdsgrowzero(o->ptr,byte+1);
+        if (o->encoding == OBJ_ENCODING_ROARING) {
+            if (o->refcount != 1) {
+                o = dupStringObject(o);
+                dbOverwrite(c->db,c->argv[1],o);
+            }
+            rbmGrow(o->ptr,byte+1);
+        } else {
+            int compress = bitmapShouldCompress(byte+1,stringObjectLen(o));
+
+            o = dbUnshareStringValue(c->db,c->argv[1],o);
+            if (compress) {
+                bitmapConvert(o,OBJ_ENCODING_ROARING);
+                rbmGrow(o->ptr,byte+1);
+            } else {
+                o->ptr = sdsgrowzero(o->ptr,byte+1);
+            }
+        }
     }
     return o;
 }
@@ -502,7 +783,9 @@ robj *lookupStringForBitCommand(client *c, size_t maxbit) {
  * the length of such buffer.
  *
  * If the source object is NULL the function is guaranteed to return NULL
- * and set 'len' to 0. */
+ * and set 'len' to 0. For compressed bitmaps NULL is returned as well, but
+ * 'len' is set to the length of the string they represent: the caller
+ * should access them with the rbm*() functions. */
 unsigned char *getObjectReadOnlyString(robj *o, long *len, char *llbuf) {
     serverAssert(o->type == OBJ_STRING);
     unsigned char *p = NULL;
@@ -512,6 +795,8 @@ unsigned char *getObjectReadOnlyString(robj *o, long *len, char *llbuf) {
     if (o && o->encoding == OBJ_ENCODING_INT) {
         p = (unsigned char*) llbuf;
         if (len) *len = ll2string(llbuf,LONG_STR_SIZE,(long)o->ptr);
+    } else if (o && o->encoding == OBJ_ENCODING_ROARING) {
+        if (len) *len = ((rbm*)o->ptr)->len;
     } else if (o) {
         p = (unsigned char*) o->ptr;
         if (len) *len = sdslen(o->ptr);
@@ -544,16 +829,21 @@ void setbitCommand(client *c) {
 
     if ((o = lookupStringForBitCommand(c,bitoffset)) == NULL) return;
 
-    /* Get current values */
-    byte = bitoffset >> 3;
-    byteval = ((uint8_t*)o->ptr)[byte];
-    bit = 7 - (bitoffset & 0x7);
-    bitval = byteval & (1 << bit);
+    if (o->encoding == OBJ_ENCODING_ROARING) {
+        bitval = rbmSetBit(o->ptr,bitoffset,on);
+        bitmapTryDecompress(o);
+    } else {
+        /* Get current values */
+        byte = bitoffset >> 3;
+        byteval = ((uint8_t*)o->ptr)[byte];
+        bit = 7 - (bitoffset & 0x7);
+        bitval = byteval & (1 << bit);
 
-    /* Update byte with new bit value and return original value */
-    byteval &= ~(1 << bit);
-    byteval |= ((on & 0x1) << bit);
-    ((uint8_t*)o->ptr)[byte] = byteval;
+        /* Update byte with new bit value and return original value */
+        byteval &= ~(1 << bit);
+        byteval |= ((on & 0x1) << bit);
+        ((uint8_t*)o->ptr)[byte] = byteval;
+    }
     signalModifiedKey(c->db,c->argv[1]);
     notifyKeyspaceEvent(NOTIFY_STRING,"setbit",c->argv[1],c->db->id);
     server.dirty++;
@@ -579,6 +869,8 @@ void getbitCommand(client *c) {
     if (sdsEncodedObject(o)) {
         if (byte < sdslen(o->ptr))
             bitval = ((uint8_t*)o->ptr)[byte] & (1 << bit);
+    } else if (o->encoding == OBJ_ENCODING_ROARING) {
+        bitval = rbmGetBit(o->ptr,bitoffset);
     } else {
         if (byte < (size_t)ll2string(llbuf,sizeof(llbuf),(long)o->ptr))
             bitval = llbuf[byte] & (1 << bit);
@@ -587,6 +879,82 @@ void getbitCommand(client *c) {
     addReply(c, bitval ? shared.cone : shared.czero);
 }
 
+/* Compute BITOP when at least one of the sources is a compressed bitmap.
+ * The result, 'maxlen' bytes long, is computed and returned compressed, one
+ * chunk of the bitmap at a time, skipping the chunks that can't have bits
+ * set: the ones where all the sources are zero (OR, XOR) or where at least
+ * a source is zero (AND). The sources that are not compressed are passed in
+ * 'src' and 'len' like in bitopCommand(), while src[j] is NULL for the
+ * compressed ones. */
+/* 处理源对象中包含压缩位图的BITOP操作 结果同样以压缩位图的方式返回 */
+static rbm *bitopCompressed(unsigned long op, robj **objects, unsigned char **src,
+                            unsigned long *len, unsigned long numkeys,
+                            unsigned long maxlen)
+{
+    unsigned char *res = zmalloc(RBM_CHUNK_BYTES);
+    unsigned char *chunk = zmalloc(RBM_CHUNK_BYTES);
+    uint64_t *lres = (uint64_t*) res, *lchunk = (uint64_t*) chunk;
+    unsigned long chunks = (maxlen+RBM_CHUNK_BYTES-1)/RBM_CHUNK_BYTES;
+    unsigned long j, i, k;
+    rbm *r = rbmNew(maxlen);
+
+    for (k = 0; k < chunks; k++) {
+        size_t base = k*RBM_CHUNK_BYTES;
+        int found = 0, skip = 0;
+
+        for (j = 0; j < numkeys; j++) {
+            unsigned char *dst = found ? chunk : res;
+            int nonzero;
+
+            if (objects[j] && src[j] == NULL) {
+                nonzero = rbmGetChunk(objects[j]->ptr,k,dst);
+            } else {
+                size_t n = len[j] > base ? len[j]-base : 0;
+
+                if (n > RBM_CHUNK_BYTES) n = RBM_CHUNK_BYTES;
+                nonzero = n != 0;
+                if (n) memcpy(dst,src[j]+base,n);
+                memset(dst+n,0,RBM_CHUNK_BYTES-n);
+            }
+            if (!nonzero) {
+                /* A zero chunk makes the AND zero, and doesn't change
+                 * the OR and the XOR. */
+                if (op == BITOP_AND) {
+                    skip = 1;
+                    break;
+                }
+                if (op != BITOP_NOT) continue;
+            }
+            if (found) {
+                unsigned char *pair[2] = {res,chunk};
+
+                i = bitopVector(op,res,pair,2,RBM_CHUNK_BYTES)/sizeof(uint64_t);
+                for (; i < RBM_CHUNK_BYTES/sizeof(uint64_t); i++) {
+                    switch(op) {
+                    case BITOP_AND: lres[i] &= lchunk[i]; break;
+                    case BITOP_OR:  lres[i] |= lchunk[i]; break;
+                    case BITOP_XOR: lres[i] ^= lchunk[i]; break;
+                    }
+                }
+            }
+            found = 1;
+        }
+        if (skip || !found) continue;
+        if (op == BITOP_NOT) {
+            i = bitopVector(op,res,&res,1,RBM_CHUNK_BYTES)/sizeof(uint64_t);
+            for (; i < RBM_CHUNK_BYTES/sizeof(uint64_t); i++)
+                lres[i] = ~lres[i];
+            /* Don't set bits past the end of the result. */
+            if (maxlen-base < RBM_CHUNK_BYTES)
+                memset(res+(maxlen-base),0,RBM_CHUNK_BYTES-(maxlen-base));
+        }
+        rbmSetChunk(r,k,res);
+    }
+    zfree(res);
+    zfree(chunk);
+    return r;
+}
+
 /* BITOP op_name target_key src_key1 src_key2 src_key3 ... src_keyN */
 void bitopCommand(client *c) {
     char *opname = c->argv[1]->ptr;
@@ -598,6 +966,8 @@ void bitopCommand(client *c) {
                                        and max len. */
     unsigned long minlen = 0;    /* Min len among the input keys. */
     unsigned char *res = NULL; /* Resulting string. */
+    rbm *rbmres = NULL;        /* Resulting compressed bitmap. */
+    int compressed = 0;        /* True if some source is compressed. */
 
     /* Parse the operation name. */
     if ((opname[0] == 'a' || opname[0] == 'A') && !strcasecmp(opname,"and"))
@@ -646,15 +1016,25 @@ void bitopCommand(client *c) {
             zfree(objects);
             return;
         }
-        objects[j] = getDecodedObject(o);
-        src[j] = objects[j]->ptr;
-        len[j] = sdslen(objects[j]->ptr);
+        if (o->encoding == OBJ_ENCODING_ROARING) {
+            incrRefCount(o);
+            objects[j] = o;
+            src[j] = NULL;
+            len[j] = stringObjectLen(o);
+            compressed = 1;
+        } else {
+            objects[j] = getDecodedObject(o);
+            src[j] = objects[j]->ptr;
+            len[j] = sdslen(objects[j]->ptr);
+        }
         if (len[j] > maxlen) maxlen = len[j];
         if (j == 0 || len[j] < minlen) minlen = len[j];
     }
 
     /* Compute the bit operation, if at least one string is not empty. */
-    if (maxlen) {
+    if (maxlen && compressed) {
+        rbmres = bitopCompressed(op,objects,src,len,numkeys,maxlen);
+    } else if (maxlen) {
         res = (unsigned char*) sdsnewlen(NULL,maxlen);
         unsigned char output, byte;
         unsigned long i;
@@ -663,10 +1043,12 @@ void bitopCommand(client *c) {
          * can take a fast path that performs much better than the
          * vanilla algorithm. On ARM we skip the fast path since it will
          * result in GCC compiling the code using multiple-words load/store
-         * operations that are not supported even in ARM >= v6. */
-        j = 0;
+         * operations that are not supported even in ARM >= v6.
+         * When the CPU supports it the vectorized kernel is used instead,
+         * without limits on the number of keys. */
+        j = bitopVector(op,res,src,numkeys,minlen);
         #ifndef USE_ALIGNED_ACCESS
-        if (minlen >= sizeof(unsigned long)*4 && numkeys <= 16) {
+        if (j == 0 && minlen >= sizeof(unsigned long)*4 && numkeys <= 16) {
             unsigned long *lp[16];
             unsigned long *lres = (unsigned long*) res;
 
@@ -753,7 +1135,12 @@ void bitopCommand(client *c) {
 
     /* Store the computed value into the target key */
     if (maxlen) {
-        o = createObject(OBJ_STRING,res);
+        if (rbmres) {
+            o = createRoaringStringObject(rbmres);
+            bitmapTryDecompress(o);
+        } else {
+            o = createObject(OBJ_STRING,res);
+        }
         setKey(c->db,targetkey,o);
         notifyKeyspaceEvent(NOTIFY_STRING,"set",targetkey,c->db->id);
         decrRefCount(o);
@@ -807,6 +1194,8 @@ void bitcountCommand(client *c) {
      * zero can be returned is: start > end. */
     if (start > end) {
         addReply(c,shared.czero);
+    } else if (p == NULL) {
+        addReplyLongLong(c,rbmCount(o->ptr,start,end));
     } else {
         long bytes = end-start+1;
 
@@ -874,7 +1263,14 @@ void bitposCommand(client *c) {
         addReplyLongLong(c, -1);
     } else {
         long bytes = end-start+1;
-        long pos = redisBitpos(p+start,bytes,bit);
+        long pos;
+
+        if (p == NULL) {
+            pos = rbmBitpos(o->ptr,start,end,bit);
+            if (pos != -1) pos -= start*8;
+        } else {
+            pos = redisBitpos(p+start,bytes,bit);
+        }
 
         /* If we are looking for clear bits, and the user specified an exact
          * range with start-end, we can't consider the right of the range as
@@ -1021,6 +1417,17 @@ void bitfieldCommand(client *c) {
             /* SET and INCRBY: We handle both with the same code path
              * for simplicity. SET return value is the previous value so
              * we need fetch & store as well. */
+            unsigned char window[9], *dst = o->ptr;
+            uint64_t offset = thisop->offset;
+            size_t byte = thisop->offset >> 3;
+
+            /* Compressed bitmaps are modified copying the up to 9 bytes
+             * of the field to a local buffer, and writing them back. */
+            if (o->encoding == OBJ_ENCODING_ROARING) {
+                rbmGetBytes(o->ptr,byte,window,sizeof(window));
+                dst = window;
+                offset -= byte*8;
+            }
 
             /* We need two different but very similar code paths for signed
              * and unsigned operations, since the set of functions to get/set
@@ -1029,8 +1436,7 @@ void bitfieldCommand(client *c) {
                 int64_t oldval, newval, wrapped, retval;
                 int overflow;
 
-                oldval = getSignedBitfield(o->ptr,thisop->offset,
-                        thisop->bits);
+                oldval = getSignedBitfield(dst,offset,thisop->bits);
 
                 if (thisop->opcode == BITFIELDOP_INCRBY) {
                     newval = oldval + thisop->i64;
@@ -1050,8 +1456,7 @@ void bitfieldCommand(client *c) {
                  * NULL to signal the condition. */
                 if (!(overflow && thisop->owtype == BFOVERFLOW_FAIL)) {
                     addReplyLongLong(c,retval);
-                    setSignedBitfield(o->ptr,thisop->offset,
-                                      thisop->bits,newval);
+                    setSignedBitfield(dst,offset,thisop->bits,newval);
                 } else {
                     addReply(c,shared.nullbulk);
                 }
@@ -1059,8 +1464,7 @@ void bitfieldCommand(client *c) {
                 uint64_t oldval, newval, wrapped, retval;
                 int overflow;
 
-                oldval = getUnsignedBitfield(o->ptr,thisop->offset,
-                        thisop->bits);
+                oldval = getUnsignedBitfield(dst,offset,thisop->bits);
 
                 if (thisop->opcode == BITFIELDOP_INCRBY) {
                     newval = oldval + thisop->i64;
@@ -1079,12 +1483,12 @@ void bitfieldCommand(client *c) {
                  * NULL to signal the condition. */
                 if (!(overflow && thisop->owtype == BFOVERFLOW_FAIL)) {
                     addReplyLongLong(c,retval);
-                    setUnsignedBitfield(o->ptr,thisop->offset,
-                                        thisop->bits,newval);
+                    setUnsignedBitfield(dst,offset,thisop->bits,newval);
                 } else {
                     addReply(c,shared.nullbulk);
                 }
             }
+            if (dst == window) rbmSetBytes(o->ptr,byte,window,sizeof(window));
             changes++;
         } else {
             /* GET */
@@ -1103,9 +1507,13 @@ void bitfieldCommand(client *c) {
             memset(buf,0,9);
             int i;
             size_t byte = thisop->offset >> 3;
-            for (i = 0; i < 9; i++) {
-                if (src == NULL || i+byte >= (size_t)strlen) break;
-                buf[i] = src[i+byte];
+            if (o != NULL && o->encoding == OBJ_ENCODING_ROARING) {
+                rbmGetBytes(o->ptr,byte,buf,9);
+            } else {
+                for (i = 0; i < 9; i++) {
+                    if (src == NULL || i+byte >= (size_t)strlen) break;
+                    buf[i] = src[i+byte];
+                }
             }
 
             /* Now operate on the copied buffer which is guaranteed
@@ -1123,9 +1531,155 @@ void bitfieldCommand(client *c) {
     }
 
     if (changes) {
+        bitmapTryDecompress(o);
         signalModifiedKey(c->db,c->argv[1]);
         notifyKeyspaceEvent(NOTIFY_STRING,"setbit",c->argv[1],c->db->id);
         server.dirty += changes;
     }
     zfree(ops);
 }
+
+#ifdef REDIS_TEST
+#include <stdio.h>
+
+#define BITOPS_BENCH_BYTES (64*1024*1024)
+
+static const char *bitopsSimdName(int level) {
+    switch(level) {
+    case BITOPS_SIMD_AVX2: return "avx2";
+    case BITOPS_SIMD_AVX512: return "avx512";
+    default: return "scalar";
+    }
+}
+
+static void bitopsReportSpeed(const char *what, int level, size_t bytes,
+                              long long elapsed)
+{
+    if (elapsed <= 0) elapsed = 1;
+    printf("%-10s %-7s %.2f GB/s\n", what, bitopsSimdName(level),
+        (double)bytes/elapsed/1000);
+}
+
+/* 对比向量化实现与标量实现的结果 并测量各个实现的吞吐 */
+int bitopsTest(int argc, char *argv[]) {
+    int maxlevel = bitopsSimdLevel(), level, j, bit;
+    size_t refbits = 0;
+    unsigned char *a = zmalloc(BITOPS_BENCH_BYTES+64);
+    unsigned char *b = zmalloc(BITOPS_BENCH_BYTES+64);
+    unsigned char *res = zmalloc(BITOPS_BENCH_BYTES+64);
+    unsigned char *srcs[2] = {a,b};
+
+    UNUSED(argc);
+    UNUSED(argv);
+
+    for (j = 0; j < BITOPS_BENCH_BYTES+64; j++) {
+        a[j] = rand();
+        b[j] = rand();
+    }
+
+    printf("Best instruction set available: %s\n", bitopsSimdName(maxlevel));
+    for (level = BITOPS_SIMD_NONE; level <= maxlevel; level++) {
+        printf("Kernels %s agree with the reference: ", bitopsSimdName(level));
+        bitopsSimd = level;
+        for (j = 0; j < 20000; j++) {
+            size_t off = rand() % 64, len = rand() % 2048, k, bits = 0;
+            unsigned char *p = a+off, *q = b+off;
+            unsigned long op = rand() % 4, i;
+            size_t done;
+
+            /* BITCOUNT */
+            for (k = 0; k < len; k++) bits += __builtin_popcount(p[k]);
+            serverAssert(redisPopcount(p,len) == bits);
+
+            /* BITPOS: a run of skippable bytes with a single bit flipped. */
+            for (bit = 0; bit <= 1; bit++) {
+                long expected = bit ? -1 : (long)len*8;
+
+                memset(q,bit ? 0 : 0xff,len);
+                if (len && rand() % 4) {
+                    k = rand() % len;
+                    q[k] ^= 1 << (rand() % 8);
+                    expected = k*8 + redisBitpos(q+k,1,bit);
+                }
+                serverAssert(redisBitpos(q,len,bit) == expected);
+            }
+            for (k = 0; k < len; k++) q[k] = rand();
+
+            /* BITOP */
+            srcs[0] = p;
+            srcs[1] = q;
+            done = bitopVector(op,res,srcs,op == BITOP_NOT ? 1 : 2,len);
+            serverAssert(done <= len);
+            serverAssert(level == BITOPS_SIMD_NONE || len-done < 32);
+            for (i = 0; i < done; i++) {
+                unsigned char expected;
+                switch(op) {
+                case BITOP_AND: expected = p[i] & q[i]; break;
+                case BITOP_OR:  expected = p[i] | q[i]; break;
+                case BITOP_XOR: expected = p[i] ^ q[i]; break;
+                default:        expected = ~p[i]; break;
+                }
+                serverAssert(res[i] == expected);
+            }
+        }
+        printf("OK\n");
+    }
+
+    /* Throughput over a bitmap much bigger than the CPU caches. */
+    srcs[0] = a;
+    srcs[1] = b;
+    for (level = BITOPS_SIMD_NONE; level <= maxlevel; level++) {
+        long long start;
+        unsigned long op;
+        size_t bits;
+
+        bitopsSimd = level;
+        start = ustime();
+        bits = redisPopcount(a,BITOPS_BENCH_BYTES);
+        bitopsReportSpeed("BITCOUNT",level,BITOPS_BENCH_BYTES,ustime()-start);
+        if (level == BITOPS_SIMD_NONE) refbits = bits;
+        serverAssert(bits == refbits);
+
+        memset(res,0,BITOPS_BENCH_BYTES);
+        res[BITOPS_BENCH_BYTES-1] = 1;
+        start = ustime();
+        serverAssert(redisBitpos(res,BITOPS_BENCH_BYTES,1) ==
+                     (long)BITOPS_BENCH_BYTES*8-1);
+        bitopsReportSpeed("BITPOS",level,BITOPS_BENCH_BYTES,ustime()-start);
+
+        for (op = BITOP_AND; op <= BITOP_NOT; op++) {
+            const char *names[] = {"AND","OR","XOR","NOT"};
+            char what[16];
+            size_t done;
+
+            start = ustime();
+            if (level == BITOPS_SIMD_NONE) {
+                /* The scalar reference is the word at a time loop. */
+                uint64_t *la = (uint64_t*)a, *lb = (uint64_t*)b,
+                         *lr = (uint64_t*)res;
+                size_t k, words = BITOPS_BENCH_BYTES/sizeof(uint64_t);
+                for (k = 0; k < words; k++) {
+                    switch(op) {
+                    case BITOP_AND: lr[k] = la[k] & lb[k]; break;
+                    case BITOP_OR:  lr[k] = la[k] | lb[k]; break;
+                    case BITOP_XOR: lr[k] = la[k] ^ lb[k]; break;
+                    default:        lr[k] = ~la[k]; break;
+                    }
+                }
+                done = BITOPS_BENCH_BYTES;
+            } else {
+                done = bitopVector(op,res,srcs,op == BITOP_NOT ? 1 : 2,
+                                   BITOPS_BENCH_BYTES);
+            }
+            snprintf(what,sizeof(what),"BITOP %s",names[op]);
+            bitopsReportSpeed(what,level,done,ustime()-start);
+            serverAssert(done == BITOPS_BENCH_BYTES);
+        }
+    }
+    bitopsSimd = maxlevel;
+    zfree(a);
+    zfree(b);
+    zfree(res);
+    return 0;
+}
+#endif
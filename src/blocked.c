@@ -140,6 +140,10 @@ void unblockClient(client *c) {
         unblockClientWaitingReplicas(c);
     } else if (c->btype == BLOCKED_MODULE) {
         unblockClientFromModule(c);
+    } else if (c->btype == BLOCKED_MIGRATE) {
+        unblockClientFromMigrate(c);
+    } else if (c->btype == BLOCKED_SETOPS) {
+        unblockClientFromSetops(c);
     } else {
         serverPanic("Unknown btype in unblockClient().");
     }
@@ -164,6 +168,8 @@ void replyToBlockedClientTimedOut(client *c) {
         addReplyLongLong(c,replicationCountAcksByOffset(c->bpop.reploffset));
     } else if (c->btype == BLOCKED_MODULE) {
         moduleBlockedClientTimedOut(c);
+    } else if (c->btype == BLOCKED_MIGRATE) {
+        replyToMigrateTimedOut(c);
     } else {
         serverPanic("Unknown btype in replyToBlockedClientTimedOut().");
     }
@@ -367,6 +373,17 @@ void handleClientsBlockedOnKeys(void) {
                     listIter li;
                     listRewind(clients,&li);
 
+                    /* Clients blocked without a consumer group, waiting
+                     * for the same ID with the same COUNT, receive exactly
+                     * the same reply: we serialize it just once and link
+                     * the resulting block to the output buffer of every
+                     * such receiver. Usually all the clients blocked on a
+                     * key are waiting for '$', so a single reply is built. */
+                    clientReplyBlock *shared_reply = NULL;
+                    streamID shared_start = {0,0};
+                    size_t shared_count = 0;
+                    int share = listLength(clients) > 1;
+
                     while((ln = listNext(&li))) {
                         client *receiver = listNodeValue(ln);
                         if (receiver->btype != BLOCKED_STREAM) continue;
@@ -403,6 +420,29 @@ void handleClientsBlockedOnKeys(void) {
                             streamID start = *gt;
                             start.seq++; /* Can't overflow, it's an uint64_t */
 
+                            if (share && !receiver->bpop.xread_group) {
+                                size_t count = receiver->bpop.xread_count;
+                                if (shared_reply == NULL ||
+                                    streamCompareID(&start,&shared_start) ||
+                                    count != shared_count)
+                                {
+                                    if (shared_reply)
+                                        releaseSharedReply(shared_reply);
+                                    client *fake = startSharedReply();
+                                    addReplyMultiBulkLen(fake,1);
+                                    addReplyMultiBulkLen(fake,2);
+                                    addReplyBulk(fake,rl->key);
+                                    streamReplyWithRange(fake,s,&start,NULL,
+                                        count,0,NULL,NULL,0,NULL);
+                                    shared_reply = endSharedReply();
+                                    shared_start = start;
+                                    shared_count = count;
+                                }
+                                addReplyShared(receiver,shared_reply);
+                                unblockClient(receiver);
+                                continue;
+                            }
+
                             /* Lookup the consumer for the group, if any. */
                             streamConsumer *consumer = NULL;
                             int noack = 0;
@@ -437,6 +477,7 @@ void handleClientsBlockedOnKeys(void) {
                             unblockClient(receiver);
                         }
                     }
+                    if (shared_reply) releaseSharedReply(shared_reply);
                 }
             }
             server.fixed_time_expire--;
@@ -31,6 +31,7 @@
 #include "server.h"
 #include "cluster.h"
 #include "endianconv.h"
+#include "bio.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -60,12 +61,16 @@ clusterNode *clusterLookupNode(const char *name);
 int clusterNodeAddSlave(clusterNode *master, clusterNode *slave);
 int clusterAddSlot(clusterNode *n, int slot);
 int clusterDelSlot(int slot);
+void clusterRemoveNotOwnedShardChannels(void);
 int clusterDelNodeSlots(clusterNode *node);
 int clusterNodeSetSlotBit(clusterNode *n, int slot);
 void clusterSetMaster(clusterNode *n);
 void clusterHandleSlaveFailover(void);
 void clusterHandleSlaveMigration(int max_slaves);
 int bitmapTestBit(unsigned char *bitmap, int pos);
+void bitmapSetBit(unsigned char *bitmap, int pos);
+int clusterExpandCompactMessage(clusterLink *link);
+void handleLinkIOError(clusterLink *link);
 void clusterDoBeforeSleep(int flags);
 void clusterSendUpdate(clusterLink *link, clusterNode *node);
 void resetManualFailover(void);
@@ -309,15 +314,49 @@ fmterr:
  * new one. Since we have the full payload to write available we can use
  * a single write to write the whole file. If the pre-existing file was
  * bigger we pad our payload with newlines that are anyway ignored and truncate
- * the file afterward. */
+ * the file afterward.
+ *
+ * 'do_fsync' is one of the CLUSTER_CONFIG_... defines: with
+ * CLUSTER_CONFIG_FSYNC_BIO the file is written synchronously, so a crash
+ * of the process can't lose it, but the fsync() (that may take a long time
+ * on a busy disk) is performed by a background thread, that closes the file
+ * afterward. This is what we use when the config is saved in the middle of
+ * a failover, that is latency sensitive.
+ *
+ * However the epochs must be on disk before the other nodes can see them:
+ * a vote granted for lastVoteEpoch, or a currentEpoch / configEpoch bump,
+ * must survive a power failure, otherwise after a restart we could vote
+ * twice in the same epoch or claim an old configEpoch. The messages are
+ * sent by the link write handlers, after the config is saved in
+ * clusterBeforeSleep(), so when one of the epochs changed since the last
+ * fsync() the file is synced before returning even with
+ * CLUSTER_CONFIG_FSYNC_BIO. */
+#define CLUSTER_CONFIG_NO_FSYNC 0   /* Don't fsync the file. */
+#define CLUSTER_CONFIG_FSYNC 1      /* Fsync before returning. */
+#define CLUSTER_CONFIG_FSYNC_BIO 2  /* Fsync in a background thread. */
+
+/* Epochs saved by the last synchronous fsync() of the config. */
+static uint64_t clusterSyncedCurrentEpoch = 0;
+static uint64_t clusterSyncedLastVoteEpoch = 0;
+static uint64_t clusterSyncedConfigEpoch = 0;
+
 int clusterSaveConfig(int do_fsync) {
     sds ci;
     size_t content_size;
     struct stat sb;
     int fd;
+    mstime_t latency;
 
     server.cluster->todo_before_sleep &= ~CLUSTER_TODO_SAVE_CONFIG;
 
+    if (do_fsync == CLUSTER_CONFIG_FSYNC_BIO &&
+        (server.cluster->currentEpoch != clusterSyncedCurrentEpoch ||
+         server.cluster->lastVoteEpoch != clusterSyncedLastVoteEpoch ||
+         myself->configEpoch != clusterSyncedConfigEpoch))
+    {
+        do_fsync = CLUSTER_CONFIG_FSYNC;
+    }
+
     /* Get the nodes description and concatenate our "vars" directive to
      * save currentEpoch and lastVoteEpoch. */
     ci = clusterGenNodesDescription(CLUSTER_NODE_HANDSHAKE);
@@ -336,10 +375,15 @@ int clusterSaveConfig(int do_fsync) {
             memset(ci+content_size,'\n',sb.st_size-content_size);
         }
     }
+    latencyStartMonitor(latency);
     if (write(fd,ci,sdslen(ci)) != (ssize_t)sdslen(ci)) goto err;
-    if (do_fsync) {
+    if (do_fsync == CLUSTER_CONFIG_FSYNC) {
         server.cluster->todo_before_sleep &= ~CLUSTER_TODO_FSYNC_CONFIG;
-        fsync(fd);
+        if (fsync(fd) == 0) {
+            clusterSyncedCurrentEpoch = server.cluster->currentEpoch;
+            clusterSyncedLastVoteEpoch = server.cluster->lastVoteEpoch;
+            clusterSyncedConfigEpoch = myself->configEpoch;
+        }
     }
 
     /* Truncate the file if needed to remove the final \n padding that
@@ -347,7 +391,14 @@ int clusterSaveConfig(int do_fsync) {
     if (content_size != sdslen(ci) && ftruncate(fd,content_size) == -1) {
         /* ftruncate() failing is not a critical error. */
     }
-    close(fd);
+    if (do_fsync == CLUSTER_CONFIG_FSYNC_BIO) {
+        server.cluster->todo_before_sleep &= ~CLUSTER_TODO_FSYNC_CONFIG;
+        bioCreateBackgroundJob(BIO_CLOSE_FILE,(void*)(long)fd,(void*)1,NULL);
+    } else {
+        close(fd);
+    }
+    latencyEndMonitor(latency);
+    latencyAddSampleIfNeeded("cluster-config-save",latency);
     sdsfree(ci);
     return 0;
 
@@ -450,6 +501,9 @@ void clusterInit(void) {
         server.cluster->stats_bus_messages_received[i] = 0;
     }
     server.cluster->stats_pfail_nodes = 0;
+    server.cluster->stats_bus_compact_sent = 0;
+    server.cluster->stats_bus_compact_received = 0;
+    clusterResetSlotStats();
     memset(server.cluster->slots,0, sizeof(server.cluster->slots));
     clusterCloseAllSlots();
 
@@ -469,7 +523,7 @@ void clusterInit(void) {
         clusterAddNode(myself);
         saveconf = 1;
     }
-    if (saveconf) clusterSaveConfigOrDie(1);
+    if (saveconf) clusterSaveConfigOrDie(CLUSTER_CONFIG_FSYNC);
 
     /* We need a listening TCP port for our cluster messaging needs. */
     server.cfd_count = 0;
@@ -501,11 +555,6 @@ void clusterInit(void) {
         }
     }
 
-    /* The slots -> keys map is a radix tree. Initialize it here. */
-    server.cluster->slots_to_keys = raxNew();
-    memset(server.cluster->slots_keys_count,0,
-           sizeof(server.cluster->slots_keys_count));
-
     /* Set myself->port / cport to my listening ports, we'll just need to
      * discover the IP address via MEET messages. */
     myself->port = server.port;
@@ -594,6 +643,11 @@ clusterLink *createClusterLink(clusterNode *node) {
     link->rcvbuf = sdsempty();
     link->node = node;
     link->fd = -1;
+    link->compact = 0;
+    link->slots_sent = 0;
+    link->slots_hash_sent = 0;
+    link->slots_recv = NULL;
+    link->slots_hash_recv = 0;
     return link;
 }
 
@@ -606,6 +660,7 @@ void freeClusterLink(clusterLink *link) {
     }
     sdsfree(link->sndbuf);
     sdsfree(link->rcvbuf);
+    zfree(link->slots_recv);
     if (link->node)
         link->node->link = NULL;
     close(link->fd);
@@ -1084,7 +1139,7 @@ void clusterHandleConfigEpochCollision(clusterNode *sender) {
     /* Get the next ID available at the best of this node knowledge. */
     server.cluster->currentEpoch++;
     myself->configEpoch = server.cluster->currentEpoch;
-    clusterSaveConfigOrDie(1);
+    clusterSaveConfigOrDie(CLUSTER_CONFIG_FSYNC);
     serverLog(LL_VERBOSE,
         "WARNING: configEpoch collision with node %.40s."
         " configEpoch set to %llu",
@@ -1540,6 +1595,7 @@ void clusterUpdateSlotsConfigWith(clusterNode *sender, uint64_t senderConfigEpoc
      * need to delete all the keys in the slots we lost ownership. */
     uint16_t dirty_slots[CLUSTER_SLOTS];
     int dirty_slots_count = 0;
+    int lost_slots = 0; /* True if our shard lost at least one slot. */
 
     /* Here we set curmaster to this node or the node this node
      * replicates to if it's a slave. In the for loop we are
@@ -1579,8 +1635,10 @@ void clusterUpdateSlotsConfigWith(clusterNode *sender, uint64_t senderConfigEpoc
                     dirty_slots_count++;
                 }
 
-                if (server.cluster->slots[j] == curmaster)
+                if (server.cluster->slots[j] == curmaster) {
                     newmaster = sender;
+                    lost_slots = 1;
+                }
                 clusterDelSlot(j);
                 clusterAddSlot(sender,j);
                 clusterDoBeforeSleep(CLUSTER_TODO_SAVE_CONFIG|
@@ -1622,6 +1680,10 @@ void clusterUpdateSlotsConfigWith(clusterNode *sender, uint64_t senderConfigEpoc
         for (j = 0; j < dirty_slots_count; j++)
             delKeysInSlot(dirty_slots[j]);
     }
+
+    /* Subscribers of shard channels in the slots we lost should subscribe
+     * again to the new owner. */
+    if (lost_slots) clusterRemoveNotOwnedShardChannels();
 }
 
 /* When this function is called, there is a packet to process starting
@@ -1647,10 +1709,29 @@ int clusterProcessPacket(clusterLink *link) {
     if (totlen < 16) return 1; /* At least signature, version, totlen, count. */
     if (totlen > sdslen(link->rcvbuf)) return 1;
 
+    /* Turn compact messages into normal ones. If we can't, the sender state
+     * about this link is not in sync with ours: drop the link, so that both
+     * sides will start again from scratch. */
+    if (ntohs(hdr->ver) == CLUSTER_PROTO_VER_COMPACT) {
+        if (clusterExpandCompactMessage(link) == C_ERR) {
+            serverLog(LL_WARNING,
+                "Invalid compact message received from Cluster bus.");
+            handleLinkIOError(link);
+            return 0;
+        }
+        hdr = (clusterMsg*) link->rcvbuf;
+        totlen = ntohl(hdr->totlen);
+        server.cluster->stats_bus_compact_received++;
+    }
+
     if (ntohs(hdr->ver) != CLUSTER_PROTO_VER) {
         /* Can't handle messages of different versions. */
         return 1;
     }
+    if (totlen < CLUSTERMSG_MIN_LEN) return 1;
+
+    /* Remember if the peer is able to receive compact messages. */
+    link->compact = (hdr->mflags[0] & CLUSTERMSG_FLAG0_COMPACT) != 0;
 
     uint16_t flags = ntohs(hdr->flags);
     uint64_t senderCurrentEpoch = 0, senderConfigEpoch = 0;
@@ -1670,7 +1751,9 @@ int clusterProcessPacket(clusterLink *link) {
 
         explen += sizeof(clusterMsgDataFail);
         if (totlen != explen) return 1;
-    } else if (type == CLUSTERMSG_TYPE_PUBLISH) {
+    } else if (type == CLUSTERMSG_TYPE_PUBLISH ||
+               type == CLUSTERMSG_TYPE_PUBLISHSHARD)
+    {
         uint32_t explen = sizeof(clusterMsg)-sizeof(union clusterMsgData);
 
         explen += sizeof(clusterMsgDataPublish) -
@@ -2040,6 +2123,23 @@ int clusterProcessPacket(clusterLink *link) {
             decrRefCount(channel);
             decrRefCount(message);
         }
+    } else if (type == CLUSTERMSG_TYPE_PUBLISHSHARD) {
+        robj *channel, *message;
+        uint32_t channel_len, message_len;
+
+        if (!sender) return 1;  /* We don't know that node. */
+        if (dictSize(server.pubsubshard_channels)) {
+            channel_len = ntohl(hdr->data.publish.msg.channel_len);
+            message_len = ntohl(hdr->data.publish.msg.message_len);
+            channel = createStringObject(
+                        (char*)hdr->data.publish.msg.bulk_data,channel_len);
+            message = createStringObject(
+                        (char*)hdr->data.publish.msg.bulk_data+channel_len,
+                        message_len);
+            pubsubPublishShardMessage(channel,message);
+            decrRefCount(channel);
+            decrRefCount(message);
+        }
     } else if (type == CLUSTERMSG_TYPE_FAILOVER_AUTH_REQUEST) {
         if (!sender) return 1;  /* We don't know that node. */
         clusterSendFailoverAuthIfNeeded(sender,hdr);
@@ -2139,12 +2239,26 @@ void clusterWriteHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
 /* Read data. Try to read the first field of the header first to check the
  * full length of the packet. When a whole packet is in memory this function
  * will call the function to process the packet. And so forth. */
+/* Max number of packets processed every time a link is readable. The
+ * socket is level triggered, so the remaining packets will be processed in
+ * the next event loop cycles: this way a storm of bus messages coming from
+ * a single node (for instance during failovers or when many PUBLISH are
+ * propagated) can't stall the serving of clients for a long time.
+ *
+ * Note that the bus I/O is still performed by the main thread: the links
+ * and every node of the cluster state are created, modified and released
+ * while processing the packets, so only reading the socket in another
+ * thread would save little, and decoding the packets there would need the
+ * whole cluster state to be locked. */
+#define CLUSTER_MAX_PACKETS_PER_READ 16
+
 void clusterReadHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
     char buf[sizeof(clusterMsg)];
     ssize_t nread;
     clusterMsg *hdr;
     clusterLink *link = (clusterLink*) privdata;
     unsigned int readlen, rcvbuflen;
+    int processed = 0;
     UNUSED(el);
     UNUSED(mask);
 
@@ -2161,7 +2275,7 @@ void clusterReadHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
                 /* Perform some sanity check on the message signature
                  * and length. */
                 if (memcmp(hdr->sig,"RCmb",4) != 0 ||
-                    ntohl(hdr->totlen) < CLUSTERMSG_MIN_LEN)
+                    ntohl(hdr->totlen) < CLUSTERMSG_COMPACT_MIN_LEN)
                 {
                     serverLog(LL_WARNING,
                         "Bad message length or signature received "
@@ -2198,10 +2312,166 @@ void clusterReadHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
             } else {
                 return; /* Link no longer valid. */
             }
+            if (++processed == CLUSTER_MAX_PACKETS_PER_READ) return;
         }
     }
 }
 
+/* -----------------------------------------------------------------------------
+ * Compact messages
+ * -------------------------------------------------------------------------- */
+
+/* Encode the slots bitmap as a list of start/end pairs into 'buf', that
+ * must be CLUSTER_SLOTS/8 bytes. Returns the number of ranges, or -1 if the
+ * ranges would not be smaller than the bitmap itself. */
+static int clusterEncodeSlotRanges(unsigned char *slots, unsigned char *buf) {
+    int count = 0, start = -1;
+
+    for (int j = 0; j <= CLUSTER_SLOTS; j++) {
+        int set = (j < CLUSTER_SLOTS) && bitmapTestBit(slots,j);
+
+        if (set && start == -1) start = j;
+        if (!set && start != -1) {
+            uint16_t range[2];
+
+            if ((count+1)*sizeof(range) >= CLUSTER_SLOTS/8) return -1;
+            range[0] = htons(start);
+            range[1] = htons(j-1);
+            memcpy(buf+count*sizeof(range),range,sizeof(range));
+            count++;
+            start = -1;
+        }
+    }
+    return count;
+}
+
+/* Append to the link send buffer the compact version of the normal
+ * message 'msg'. The slots are omitted if the same bitmap was already sent
+ * on this link, otherwise they are sent as ranges or, if that is not
+ * smaller, as a bitmap. The encoding is cached since all the messages we
+ * send carry the same bitmap. */
+static void clusterAppendCompactMessage(clusterLink *link, unsigned char *msg, size_t msglen) {
+    static unsigned char cached_slots[CLUSTER_SLOTS/8];
+    static unsigned char cached_ranges[CLUSTER_SLOTS/8];
+    static int cached_count = -2; /* -2 means nothing cached. */
+    static uint64_t cached_hash;
+    clusterMsg *hdr = (clusterMsg*) msg;
+    size_t prefixlen = offsetof(clusterMsg,myslots);
+    size_t restoff = offsetof(clusterMsg,slaveof);
+    unsigned char prefix[offsetof(clusterMsg,myslots)];
+    unsigned char *payload = NULL;
+    size_t payloadlen = 0;
+    clusterMsgSlotsInfo info;
+
+    if (cached_count == -2 ||
+        memcmp(cached_slots,hdr->myslots,sizeof(cached_slots)) != 0)
+    {
+        memcpy(cached_slots,hdr->myslots,sizeof(cached_slots));
+        cached_hash = crc64(0,cached_slots,sizeof(cached_slots));
+        cached_count = clusterEncodeSlotRanges(cached_slots,cached_ranges);
+    }
+
+    memset(&info,0,sizeof(info));
+    info.hash = htonu64(cached_hash);
+    if (link->slots_sent && link->slots_hash_sent == cached_hash) {
+        info.encoding = htons(CLUSTERMSG_SLOTS_SAME);
+    } else if (cached_count >= 0) {
+        info.encoding = htons(CLUSTERMSG_SLOTS_RANGES);
+        info.count = htons(cached_count);
+        payload = cached_ranges;
+        payloadlen = cached_count*sizeof(uint16_t)*2;
+    } else {
+        info.encoding = htons(CLUSTERMSG_SLOTS_BITMAP);
+        payload = cached_slots;
+        payloadlen = sizeof(cached_slots);
+    }
+    link->slots_sent = 1;
+    link->slots_hash_sent = cached_hash;
+
+    /* Fix the version and length in a copy of the header prefix. */
+    uint16_t ver = htons(CLUSTER_PROTO_VER_COMPACT);
+    uint32_t totlen = htonl(prefixlen+sizeof(info)+payloadlen+
+                            (msglen-restoff));
+    memcpy(prefix,msg,prefixlen);
+    memcpy(prefix+offsetof(clusterMsg,ver),&ver,sizeof(ver));
+    memcpy(prefix+offsetof(clusterMsg,totlen),&totlen,sizeof(totlen));
+
+    link->sndbuf = sdscatlen(link->sndbuf,prefix,prefixlen);
+    link->sndbuf = sdscatlen(link->sndbuf,&info,sizeof(info));
+    if (payloadlen) link->sndbuf = sdscatlen(link->sndbuf,payload,payloadlen);
+    link->sndbuf = sdscatlen(link->sndbuf,msg+restoff,msglen-restoff);
+    server.cluster->stats_bus_compact_sent++;
+}
+
+/* Replace the compact message in the link receive buffer with the
+ * equivalent normal message. Returns C_ERR if the message is malformed or
+ * refers to a slots bitmap we don't have. */
+int clusterExpandCompactMessage(clusterLink *link) {
+    unsigned char *buf = (unsigned char*) link->rcvbuf;
+    uint32_t totlen = ntohl(((clusterMsg*)buf)->totlen);
+    size_t prefixlen = offsetof(clusterMsg,myslots);
+    size_t restoff = offsetof(clusterMsg,slaveof);
+    unsigned char slots[CLUSTER_SLOTS/8];
+    size_t payloadlen = 0;
+    clusterMsgSlotsInfo info;
+
+    if (totlen < CLUSTERMSG_COMPACT_MIN_LEN) return C_ERR;
+    memcpy(&info,buf+prefixlen,sizeof(info));
+
+    uint64_t hash = ntohu64(info.hash);
+    uint16_t encoding = ntohs(info.encoding);
+    unsigned char *payload = buf+prefixlen+sizeof(info);
+
+    if (encoding == CLUSTERMSG_SLOTS_SAME) {
+        if (link->slots_recv == NULL || link->slots_hash_recv != hash)
+            return C_ERR;
+        memcpy(slots,link->slots_recv,sizeof(slots));
+    } else if (encoding == CLUSTERMSG_SLOTS_RANGES) {
+        int count = ntohs(info.count);
+
+        payloadlen = count*sizeof(uint16_t)*2;
+        if (totlen < CLUSTERMSG_COMPACT_MIN_LEN+payloadlen) return C_ERR;
+        memset(slots,0,sizeof(slots));
+        for (int j = 0; j < count; j++) {
+            uint16_t range[2];
+
+            memcpy(range,payload+j*sizeof(range),sizeof(range));
+            int start = ntohs(range[0]), end = ntohs(range[1]);
+            if (start > end || end >= CLUSTER_SLOTS) return C_ERR;
+            for (int slot = start; slot <= end; slot++)
+                bitmapSetBit(slots,slot);
+        }
+    } else if (encoding == CLUSTERMSG_SLOTS_BITMAP) {
+        payloadlen = sizeof(slots);
+        if (totlen < CLUSTERMSG_COMPACT_MIN_LEN+payloadlen) return C_ERR;
+        memcpy(slots,payload,sizeof(slots));
+    } else {
+        return C_ERR;
+    }
+
+    if (encoding != CLUSTERMSG_SLOTS_SAME) {
+        if (crc64(0,slots,sizeof(slots)) != hash) return C_ERR;
+        if (link->slots_recv == NULL) link->slots_recv = zmalloc(sizeof(slots));
+        memcpy(link->slots_recv,slots,sizeof(slots));
+        link->slots_hash_recv = hash;
+    }
+
+    /* Rebuild the normal message. */
+    size_t rest = prefixlen+sizeof(info)+payloadlen;
+    size_t restlen = totlen-rest;
+    sds full = sdsnewlen(NULL,restoff+restlen);
+    memcpy(full,buf,prefixlen);
+    memcpy(full+prefixlen,slots,sizeof(slots));
+    memcpy(full+restoff,buf+rest,restlen);
+
+    clusterMsg *hdr = (clusterMsg*) full;
+    hdr->ver = htons(CLUSTER_PROTO_VER);
+    hdr->totlen = htonl(restoff+restlen);
+    sdsfree(link->rcvbuf);
+    link->rcvbuf = full;
+    return C_OK;
+}
+
 /* Put stuff into the send buffer.
  *
  * It is guaranteed that this function will never have as a side effect
@@ -2212,11 +2482,18 @@ void clusterSendMessage(clusterLink *link, unsigned char *msg, size_t msglen) {
         aeCreateFileEvent(server.el,link->fd,AE_WRITABLE|AE_BARRIER,
                     clusterWriteHandler,link);
 
-    link->sndbuf = sdscatlen(link->sndbuf, msg, msglen);
-
     /* Populate sent messages stats. */
     clusterMsg *hdr = (clusterMsg*) msg;
     uint16_t type = ntohs(hdr->type);
+
+    if (link->compact && server.cluster_compact_messages &&
+        msglen >= CLUSTERMSG_MIN_LEN && ntohs(hdr->ver) == CLUSTER_PROTO_VER)
+    {
+        clusterAppendCompactMessage(link,msg,msglen);
+    } else {
+        link->sndbuf = sdscatlen(link->sndbuf, msg, msglen);
+    }
+
     if (type < CLUSTERMSG_TYPE_COUNT)
         server.cluster->stats_bus_messages_sent[type]++;
 }
@@ -2243,6 +2520,24 @@ void clusterBroadcastMessage(void *buf, size_t len) {
     dictReleaseIterator(di);
 }
 
+/* Send a message to the other nodes of our shard: our master and its
+ * replicas if we are a replica, or our replicas if we are a master. */
+void clusterSendMessageToShard(void *buf, size_t len) {
+    clusterNode *master = nodeIsMaster(myself) ? myself : myself->slaveof;
+    int j;
+
+    if (master == NULL) return;
+    if (master != myself && master->link)
+        clusterSendMessage(master->link,buf,len);
+    for (j = 0; j < master->numslaves; j++) {
+        clusterNode *node = master->slaves[j];
+
+        if (node == myself || !node->link) continue;
+        if (node->flags & CLUSTER_NODE_HANDSHAKE) continue;
+        clusterSendMessage(node->link,buf,len);
+    }
+}
+
 /* Build the message header. hdr must point to a buffer at least
  * sizeof(clusterMsg) in bytes. */
 void clusterBuildMessageHdr(clusterMsg *hdr, int type) {
@@ -2305,6 +2600,8 @@ void clusterBuildMessageHdr(clusterMsg *hdr, int type) {
     /* Set the message flags. */
     if (nodeIsMaster(myself) && server.cluster->mf_end)
         hdr->mflags[0] |= CLUSTERMSG_FLAG0_PAUSED;
+    if (server.cluster_compact_messages)
+        hdr->mflags[0] |= CLUSTERMSG_FLAG0_COMPACT;
 
     /* Compute the message length for certain messages. For other messages
      * this is up to the caller. */
@@ -2513,10 +2810,11 @@ void clusterBroadcastPong(int target) {
     dictReleaseIterator(di);
 }
 
-/* Send a PUBLISH message.
+/* Send a PUBLISH message, or a PUBLISHSHARD message according to 'type'.
  *
- * If link is NULL, then the message is broadcasted to the whole cluster. */
-void clusterSendPublish(clusterLink *link, robj *channel, robj *message) {
+ * If link is NULL, then the message is broadcasted to the whole cluster,
+ * while a PUBLISHSHARD message is only sent to the nodes of our shard. */
+void clusterSendPublish(clusterLink *link, robj *channel, robj *message, uint16_t type) {
     unsigned char buf[sizeof(clusterMsg)], *payload;
     clusterMsg *hdr = (clusterMsg*) buf;
     uint32_t totlen;
@@ -2527,7 +2825,7 @@ void clusterSendPublish(clusterLink *link, robj *channel, robj *message) {
     channel_len = sdslen(channel->ptr);
     message_len = sdslen(message->ptr);
 
-    clusterBuildMessageHdr(hdr,CLUSTERMSG_TYPE_PUBLISH);
+    clusterBuildMessageHdr(hdr,type);
     totlen = sizeof(clusterMsg)-sizeof(union clusterMsgData);
     totlen += sizeof(clusterMsgDataPublish) - 8 + channel_len + message_len;
 
@@ -2549,6 +2847,8 @@ void clusterSendPublish(clusterLink *link, robj *channel, robj *message) {
 
     if (link)
         clusterSendMessage(link,payload,totlen);
+    else if (type == CLUSTERMSG_TYPE_PUBLISHSHARD)
+        clusterSendMessageToShard(payload,totlen);
     else
         clusterBroadcastMessage(payload,totlen);
 
@@ -2644,12 +2944,38 @@ int clusterSendModuleMessageToTarget(const char *target, uint64_t module_id, uin
 /* -----------------------------------------------------------------------------
  * CLUSTER Pub/Sub support
  *
- * For now we do very little, just propagating PUBLISH messages across the whole
- * cluster. In the future we'll try to get smarter and avoiding propagating those
- * messages to hosts without receives for a given channel.
+ * PUBLISH messages are propagated across the whole cluster, since any node
+ * may have subscribers for a given channel. Shard channels (SSUBSCRIBE and
+ * SPUBLISH) hash to a slot instead: subscribers can only live in the nodes
+ * serving that slot, so SPUBLISH is only propagated to the master and the
+ * replicas of the shard, and the bus traffic does not grow with the number
+ * of nodes in the cluster.
  * -------------------------------------------------------------------------- */
 void clusterPropagatePublish(robj *channel, robj *message) {
-    clusterSendPublish(NULL, channel, message);
+    clusterSendPublish(NULL, channel, message, CLUSTERMSG_TYPE_PUBLISH);
+}
+
+void clusterPropagatePublishShard(robj *channel, robj *message) {
+    clusterSendPublish(NULL, channel, message, CLUSTERMSG_TYPE_PUBLISHSHARD);
+}
+
+/* Unsubscribe the clients of the shard channels hashing to slots that are
+ * no longer served by our shard (our master, or ourselves if we are a
+ * master), so that they can subscribe again to the new slot owner. */
+void clusterRemoveNotOwnedShardChannels(void) {
+    clusterNode *curmaster = nodeIsMaster(myself) ? myself : myself->slaveof;
+    unsigned char slots[CLUSTER_SLOTS/8];
+    int j, lost = 0;
+
+    if (dictSize(server.pubsubshard_channels) == 0) return;
+    memset(slots,0,sizeof(slots));
+    for (j = 0; j < CLUSTER_SLOTS; j++) {
+        if (curmaster == NULL || server.cluster->slots[j] != curmaster) {
+            bitmapSetBit(slots,j);
+            lost = 1;
+        }
+    }
+    if (lost) pubsubUnsubscribeShardChannelsInSlots(slots);
 }
 
 /* -----------------------------------------------------------------------------
@@ -2926,7 +3252,7 @@ void clusterFailoverReplaceYourMaster(void) {
 
     /* 3) Update state and save config. */
     clusterUpdateState();
-    clusterSaveConfigOrDie(1);
+    clusterSaveConfigOrDie(CLUSTER_CONFIG_FSYNC_BIO);
 
     /* 4) Pong all the other nodes so that they can update the state
      *    accordingly and detect that we switched to master role. */
@@ -3606,7 +3932,8 @@ void clusterBeforeSleep(void) {
     if (server.cluster->todo_before_sleep & CLUSTER_TODO_SAVE_CONFIG) {
         int fsync = server.cluster->todo_before_sleep &
                     CLUSTER_TODO_FSYNC_CONFIG;
-        clusterSaveConfigOrDie(fsync);
+        clusterSaveConfigOrDie(fsync ? CLUSTER_CONFIG_FSYNC_BIO :
+                                       CLUSTER_CONFIG_NO_FSYNC);
     }
 
     /* Reset our flags (not strictly needed since every single function
@@ -3707,6 +4034,9 @@ int clusterAddSlot(clusterNode *n, int slot) {
     if (server.cluster->slots[slot]) return C_ERR;
     clusterNodeSetSlotBit(n,slot);
     server.cluster->slots[slot] = n;
+    /* The slot stats of our shard start from scratch when we take it. */
+    if (myself && (n == myself || n == myself->slaveof))
+        memset(server.cluster->slot_stats+slot,0,sizeof(clusterSlotStats));
     return C_OK;
 }
 
@@ -3890,7 +4220,7 @@ int verifyClusterConfigWithData(void) {
 
     /* Make sure we only have keys in DB0. */
     for (j = 1; j < server.dbnum; j++) {
-        if (dictSize(server.db[j].dict)) return C_ERR;
+        if (dbSize(&server.db[j])) return C_ERR;
     }
 
     /* Check that all the slots we see populated memory have a corresponding
@@ -3920,7 +4250,7 @@ int verifyClusterConfigWithData(void) {
             server.cluster->importing_slots_from[j] = server.cluster->slots[j];
         }
     }
-    if (update_config) clusterSaveConfigOrDie(1);
+    if (update_config) clusterSaveConfigOrDie(CLUSTER_CONFIG_FSYNC);
     return C_OK;
 }
 
@@ -3946,6 +4276,7 @@ void clusterSetMaster(clusterNode *n) {
     clusterNodeAddSlave(n,myself);
     replicationSetMaster(n->ip, n->port);
     resetManualFailover();
+    clusterRemoveNotOwnedShardChannels();
 }
 
 /* -----------------------------------------------------------------------------
@@ -4099,6 +4430,7 @@ const char *clusterGetMessageTypeString(int type) {
     case CLUSTERMSG_TYPE_UPDATE: return "update";
     case CLUSTERMSG_TYPE_MFSTART: return "mfstart";
     case CLUSTERMSG_TYPE_MODULE: return "module";
+    case CLUSTERMSG_TYPE_PUBLISHSHARD: return "publishshard";
     }
     return "unknown";
 }
@@ -4189,6 +4521,190 @@ void clusterReplyMultiBulkSlots(client *c) {
     setDeferredMultiBulkLength(c, slot_replylen, num_masters);
 }
 
+/* -----------------------------------------------------------------------------
+ * CLUSTER slot statistics
+ *
+ * Resources used by every command are attributed to the slot of its keys,
+ * so that the load of the slots can be inspected with CLUSTER SLOT-STATS and
+ * used to rebalance the cluster by load instead of by number of slots.
+ * -------------------------------------------------------------------------- */
+
+#define SLOT_STATS_KEY_COUNT 0
+#define SLOT_STATS_COMMANDS 1
+#define SLOT_STATS_CPU_USEC 2
+#define SLOT_STATS_NETWORK_BYTES_IN 3
+#define SLOT_STATS_NETWORK_BYTES_OUT 4
+#define SLOT_STATS_MEMORY_BYTES 5
+#define SLOT_STATS_METRICS 6
+
+static char *slotStatsMetricNames[SLOT_STATS_METRICS] = {
+    "key-count", "commands", "cpu-usec", "network-bytes-in",
+    "network-bytes-out", "memory-bytes"
+};
+
+/* Return the slot the command of the client is about, or -1 if the command
+ * has no keys. Commands received from clients were already routed, so the
+ * slot is cached in c->slot, otherwise (for instance for the commands
+ * received from our master) it is the slot of the first key. */
+int clusterSlotStatsGetSlot(client *c) {
+    int *keyindex, numkeys, slot = -1;
+
+    if (c->slot != -1) return c->slot;
+    if (c->cmd->getkeys_proc == NULL && c->cmd->firstkey == 0) return -1;
+    keyindex = getKeysFromCommand(c->cmd,c->argv,c->argc,&numkeys);
+    if (numkeys > 0) {
+        robj *key = c->argv[keyindex[0]];
+        if (sdsEncodedObject(key))
+            slot = keyHashSlot(key->ptr,sdslen(key->ptr));
+    }
+    getKeysFreeResult(keyindex);
+    return slot;
+}
+
+/* Account a command executed against 'slot'. */
+void clusterSlotStatsAddCommand(int slot, long long duration,
+                                size_t bytes_in, size_t bytes_out)
+{
+    clusterSlotStats *stats = server.cluster->slot_stats+slot;
+
+    stats->commands++;
+    stats->cpu_usec += duration;
+    stats->network_bytes_in += bytes_in;
+    stats->network_bytes_out += bytes_out;
+}
+
+void clusterResetSlotStats(void) {
+    memset(server.cluster->slot_stats,0,sizeof(server.cluster->slot_stats));
+}
+
+/* Only the slots served by our shard are reported: the stats of the slots
+ * we don't serve are stale. */
+static int clusterSlotStatsIsOwned(int slot) {
+    clusterNode *master = nodeIsMaster(myself) ? myself : myself->slaveof;
+    return master != NULL && server.cluster->slots[slot] == master;
+}
+
+static unsigned long long clusterSlotStatsGetMetric(int slot, int metric) {
+    clusterSlotStats *stats = server.cluster->slot_stats+slot;
+
+    switch(metric) {
+    case SLOT_STATS_KEY_COUNT: return countKeysInSlot(slot);
+    case SLOT_STATS_COMMANDS: return stats->commands;
+    case SLOT_STATS_CPU_USEC: return stats->cpu_usec;
+    case SLOT_STATS_NETWORK_BYTES_IN: return stats->network_bytes_in;
+    case SLOT_STATS_NETWORK_BYTES_OUT: return stats->network_bytes_out;
+    case SLOT_STATS_MEMORY_BYTES:
+        return estimateMemoryInSlot(slot,CLUSTER_SLOT_STATS_MEM_SAMPLES);
+    }
+    return 0;
+}
+
+static void clusterSlotStatsReplySlot(client *c, int slot) {
+    int j;
+
+    addReplyMultiBulkLen(c,2);
+    addReplyLongLong(c,slot);
+    addReplyMultiBulkLen(c,SLOT_STATS_METRICS*2);
+    for (j = 0; j < SLOT_STATS_METRICS; j++) {
+        addReplyBulkCString(c,slotStatsMetricNames[j]);
+        addReplyLongLong(c,clusterSlotStatsGetMetric(slot,j));
+    }
+}
+
+typedef struct slotStatsEntry {
+    int slot;
+    unsigned long long value;
+} slotStatsEntry;
+
+static int slotStatsEntryCompareAsc(const void *a, const void *b) {
+    const slotStatsEntry *ea = a, *eb = b;
+
+    if (ea->value != eb->value) return (ea->value < eb->value) ? -1 : 1;
+    return ea->slot - eb->slot;
+}
+
+static int slotStatsEntryCompareDesc(const void *a, const void *b) {
+    const slotStatsEntry *ea = a, *eb = b;
+
+    if (ea->value != eb->value) return (ea->value > eb->value) ? -1 : 1;
+    return ea->slot - eb->slot;
+}
+
+/* CLUSTER SLOT-STATS SLOTSRANGE <start> <end>
+ * CLUSTER SLOT-STATS ORDERBY <metric> [LIMIT <count>] [ASC|DESC] */
+void clusterSlotStatsCommand(client *c) {
+    int j;
+
+    if (!strcasecmp(c->argv[2]->ptr,"slotsrange") && c->argc == 5) {
+        int start, end, count = 0;
+        void *replylen;
+
+        if ((start = getSlotOrReply(c,c->argv[3])) == -1 ||
+            (end = getSlotOrReply(c,c->argv[4])) == -1) return;
+        if (start > end) {
+            addReplyError(c,"Start slot number is greater than end slot number");
+            return;
+        }
+        replylen = addDeferredMultiBulkLength(c);
+        for (j = start; j <= end; j++) {
+            if (!clusterSlotStatsIsOwned(j)) continue;
+            clusterSlotStatsReplySlot(c,j);
+            count++;
+        }
+        setDeferredMultiBulkLength(c,replylen,count);
+    } else if (!strcasecmp(c->argv[2]->ptr,"orderby") && c->argc >= 4) {
+        long long limit = CLUSTER_SLOT_STATS_DEFAULT_LIMIT;
+        int metric = -1, desc = 1, count = 0;
+        slotStatsEntry *entries;
+
+        for (j = 0; j < SLOT_STATS_METRICS; j++) {
+            if (!strcasecmp(c->argv[3]->ptr,slotStatsMetricNames[j]))
+                metric = j;
+        }
+        if (metric == -1) {
+            addReplyErrorFormat(c,"Unknown metric '%s'",
+                (char*)c->argv[3]->ptr);
+            return;
+        }
+        for (j = 4; j < c->argc; j++) {
+            int moreargs = (c->argc-1) - j;
+
+            if (!strcasecmp(c->argv[j]->ptr,"limit") && moreargs) {
+                if (getLongLongFromObjectOrReply(c,c->argv[++j],&limit,NULL)
+                    != C_OK) return;
+                if (limit < 1 || limit > CLUSTER_SLOTS) {
+                    addReplyError(c,"Limit has to lie in between 1 and 16384");
+                    return;
+                }
+            } else if (!strcasecmp(c->argv[j]->ptr,"asc")) {
+                desc = 0;
+            } else if (!strcasecmp(c->argv[j]->ptr,"desc")) {
+                desc = 1;
+            } else {
+                addReply(c,shared.syntaxerr);
+                return;
+            }
+        }
+
+        entries = zmalloc(sizeof(*entries)*CLUSTER_SLOTS);
+        for (j = 0; j < CLUSTER_SLOTS; j++) {
+            if (!clusterSlotStatsIsOwned(j)) continue;
+            entries[count].slot = j;
+            entries[count].value = clusterSlotStatsGetMetric(j,metric);
+            count++;
+        }
+        qsort(entries,count,sizeof(*entries),
+              desc ? slotStatsEntryCompareDesc : slotStatsEntryCompareAsc);
+        if (count > limit) count = limit;
+        addReplyMultiBulkLen(c,count);
+        for (j = 0; j < count; j++)
+            clusterSlotStatsReplySlot(c,entries[j].slot);
+        zfree(entries);
+    } else {
+        addReplySubcommandSyntaxError(c);
+    }
+}
+
 void clusterCommand(client *c) {
     if (server.cluster_enabled == 0) {
         addReplyError(c,"This instance has cluster support disabled");
@@ -4209,6 +4725,8 @@ void clusterCommand(client *c) {
 "INFO - Return onformation about the cluster.",
 "KEYSLOT <key> -- Return the hash slot for <key>.",
 "MEET <ip> <port> [bus-port] -- Connect nodes into a working cluster.",
+"MIGRATESLOT <slot> <node-id> [TIMEOUT <ms>] [BATCH <keys>] [REPLACE] [AUTH <password>]",
+"    -- Move all the keys of <slot> to <node-id>, then assign it the slot.",
 "MYID -- Return the node id.",
 "NODES -- Return cluster configuration seen by node. Output format:",
 "    <id> <ip:port> <flags> <master> <pings> <pongs> <epoch> <link> <slot> ... <slot>",
@@ -4219,6 +4737,11 @@ void clusterCommand(client *c) {
 "REPLICAS <node-id> -- Return <node-id> replicas.",
 "SLOTS -- Return information about slots range mappings. Each range is made of:",
 "    start, end, master and replicas IP addresses, ports and ids",
+"SLOT-STATS SLOTSRANGE <start> <end> -- Return the resources used by the slots",
+"    in the range served by this node: key-count, commands, cpu-usec,",
+"    network-bytes-in, network-bytes-out, memory-bytes.",
+"SLOT-STATS ORDERBY <metric> [LIMIT <count>] [ASC|DESC] -- Return the stats of",
+"    the slots served by this node with the highest (or lowest) <metric>.",
 NULL
         };
         addReplyHelp(c, help);
@@ -4266,11 +4789,12 @@ NULL
         clusterReplyMultiBulkSlots(c);
     } else if (!strcasecmp(c->argv[1]->ptr,"flushslots") && c->argc == 2) {
         /* CLUSTER FLUSHSLOTS */
-        if (dictSize(server.db[0].dict) != 0) {
+        if (dbSize(&server.db[0]) != 0) {
             addReplyError(c,"DB must be empty to perform CLUSTER FLUSHSLOTS.");
             return;
         }
         clusterDelNodeSlots(myself);
+        clusterRemoveNotOwnedShardChannels();
         clusterDoBeforeSleep(CLUSTER_TODO_UPDATE_STATE|CLUSTER_TODO_SAVE_CONFIG);
         addReply(c,shared.ok);
     } else if ((!strcasecmp(c->argv[1]->ptr,"addslots") ||
@@ -4320,6 +4844,7 @@ NULL
                 serverAssertWithInfo(c,NULL,retval == C_OK);
             }
         }
+        if (del) clusterRemoveNotOwnedShardChannels();
         zfree(slots);
         clusterDoBeforeSleep(CLUSTER_TODO_UPDATE_STATE|CLUSTER_TODO_SAVE_CONFIG);
         addReply(c,shared.ok);
@@ -4413,6 +4938,7 @@ NULL
             }
             clusterDelSlot(slot);
             clusterAddSlot(n,slot);
+            if (n != myself) clusterRemoveNotOwnedShardChannels();
         } else {
             addReplyError(c,
                 "Invalid CLUSTER SETSLOT action or number of arguments. Try CLUSTER HELP");
@@ -4420,6 +4946,13 @@ NULL
         }
         clusterDoBeforeSleep(CLUSTER_TODO_SAVE_CONFIG|CLUSTER_TODO_UPDATE_STATE);
         addReply(c,shared.ok);
+    } else if (!strcasecmp(c->argv[1]->ptr,"migrateslot") && c->argc >= 4) {
+        /* CLUSTER MIGRATESLOT <slot> <node-id> [options] */
+        if (nodeIsSlave(myself)) {
+            addReplyError(c,"Please use MIGRATESLOT only with masters.");
+            return;
+        }
+        clusterMigrateSlotCommand(c);
     } else if (!strcasecmp(c->argv[1]->ptr,"bumpepoch") && c->argc == 2) {
         /* CLUSTER BUMPEPOCH */
         int retval = clusterBumpConfigEpochWithoutConsensus();
@@ -4497,6 +5030,11 @@ NULL
         }
         info = sdscatprintf(info,
             "cluster_stats_messages_received:%lld\r\n", tot_msg_received);
+        info = sdscatprintf(info,
+            "cluster_stats_messages_compact_sent:%lld\r\n"
+            "cluster_stats_messages_compact_received:%lld\r\n",
+            server.cluster->stats_bus_compact_sent,
+            server.cluster->stats_bus_compact_received);
 
         /* Produce the reply protocol. */
         addReplySds(c,sdscatprintf(sdsempty(),"$%lu\r\n",
@@ -4504,7 +5042,7 @@ NULL
         addReplySds(c,info);
         addReply(c,shared.crlf);
     } else if (!strcasecmp(c->argv[1]->ptr,"saveconfig") && c->argc == 2) {
-        int retval = clusterSaveConfig(1);
+        int retval = clusterSaveConfig(CLUSTER_CONFIG_FSYNC);
 
         if (retval == 0)
             addReply(c,shared.ok);
@@ -4516,6 +5054,9 @@ NULL
         sds key = c->argv[2]->ptr;
 
         addReplyLongLong(c,keyHashSlot(key,sdslen(key)));
+    } else if (!strcasecmp(c->argv[1]->ptr,"slot-stats") && c->argc >= 3) {
+        /* CLUSTER SLOT-STATS (SLOTSRANGE|ORDERBY) ... */
+        clusterSlotStatsCommand(c);
     } else if (!strcasecmp(c->argv[1]->ptr,"countkeysinslot") && c->argc == 3) {
         /* CLUSTER COUNTKEYSINSLOT <slot> */
         long long slot;
@@ -4601,7 +5142,7 @@ NULL
          * slots nor keys to accept to replicate some other node.
          * Slaves can switch to another master without issues. */
         if (nodeIsMaster(myself) &&
-            (myself->numslots != 0 || dictSize(server.db[0].dict) != 0)) {
+            (myself->numslots != 0 || dbSize(&server.db[0]) != 0)) {
             addReplyError(c,
                 "To set a master the node must be empty and "
                 "without assigned slots.");
@@ -4758,7 +5299,7 @@ NULL
 
         /* Slaves can be reset while containing data, but not master nodes
          * that must be empty. */
-        if (nodeIsMaster(myself) && dictSize(c->db->dict) != 0) {
+        if (nodeIsMaster(myself) && dbSize(c->db) != 0) {
             addReplyError(c,"CLUSTER RESET can't be called with "
                             "master nodes containing keys");
             return;
@@ -4942,7 +5483,11 @@ void restoreCommand(client *c) {
  * We take a map between host:ip and a TCP socket that we used to connect
  * to this instance in recent time.
  * This sockets are closed when the max number we cache is reached, and also
- * in serverCron() when they are around for more than a few seconds. */
+ * in serverCron() when they are around for more than a few seconds.
+ *
+ * A cached socket that is owned by an asynchronous MIGRATE in progress is
+ * flagged as 'inuse': it is never handed to another caller nor closed by
+ * the cache maintenance code until the operation releases it. */
 #define MIGRATE_SOCKET_CACHE_ITEMS 64 /* max num of items in the cache. */
 #define MIGRATE_SOCKET_CACHE_TTL 10 /* close cached sockets after 10 sec. */
 
@@ -4950,6 +5495,8 @@ typedef struct migrateCachedSocket {
     int fd;
     long last_dbid;
     time_t last_use_time;
+    sds name;       /* host:port key in the cache, or NULL if not cached. */
+    int inuse;      /* Owned by an asynchronous MIGRATE in progress. */
 } migrateCachedSocket;
 
 /* Return a migrateCachedSocket containing a TCP socket connected with the
@@ -4958,13 +5505,17 @@ typedef struct migrateCachedSocket {
  * This function is responsible of sending errors to the client if a
  * connection can't be established. In this case -1 is returned.
  * Otherwise on success the socket is returned, and the caller should not
- * attempt to free it after usage.
+ * attempt to free it after usage, but just call migrateReleaseSocket().
+ *
+ * If the cached socket for this target is busy serving an asynchronous
+ * MIGRATE, a new connection that is not added to the cache is returned:
+ * migrateReleaseSocket() will close it.
  *
  * If the caller detects an error while using the socket, migrateCloseSocket()
  * should be called so that the connection will be created from scratch
  * the next time. */
 migrateCachedSocket* migrateGetSocket(client *c, robj *host, robj *port, long timeout) {
-    int fd;
+    int fd, cache;
     sds name = sdsempty();
     migrateCachedSocket *cs;
 
@@ -4973,25 +5524,32 @@ migrateCachedSocket* migrateGetSocket(client *c, robj *host, robj *port, long ti
     name = sdscatlen(name,":",1);
     name = sdscatlen(name,port->ptr,sdslen(port->ptr));
     cs = dictFetchValue(server.migrate_cached_sockets,name);
-    if (cs) {
+    if (cs && !cs->inuse) {
         sdsfree(name);
         cs->last_use_time = server.unixtime;
         return cs;
     }
 
     /* No cached socket, create one. */
-    if (dictSize(server.migrate_cached_sockets) == MIGRATE_SOCKET_CACHE_ITEMS) {
-        /* Too many items, drop one at random. */
+    cache = (cs == NULL);
+    if (cache &&
+        dictSize(server.migrate_cached_sockets) == MIGRATE_SOCKET_CACHE_ITEMS)
+    {
+        /* Too many items, drop one at random. If the one we picked is
+         * busy, just don't cache the new socket. */
         dictEntry *de = dictGetRandomKey(server.migrate_cached_sockets);
         cs = dictGetVal(de);
-        close(cs->fd);
-        zfree(cs);
-        dictDelete(server.migrate_cached_sockets,dictGetKey(de));
+        if (cs->inuse) {
+            cache = 0;
+        } else {
+            close(cs->fd);
+            zfree(cs);
+            dictDelete(server.migrate_cached_sockets,dictGetKey(de));
+        }
     }
 
     /* Create the socket */
-    fd = anetTcpNonBlockConnect(server.neterr,c->argv[1]->ptr,
-                                atoi(c->argv[2]->ptr));
+    fd = anetTcpNonBlockConnect(server.neterr,host->ptr,atoi(port->ptr));
     if (fd == -1) {
         sdsfree(name);
         addReplyErrorFormat(c,"Can't connect to target node: %s",
@@ -5014,28 +5572,34 @@ migrateCachedSocket* migrateGetSocket(client *c, robj *host, robj *port, long ti
     cs->fd = fd;
     cs->last_dbid = -1;
     cs->last_use_time = server.unixtime;
-    dictAdd(server.migrate_cached_sockets,name,cs);
+    cs->inuse = 0;
+    if (cache) {
+        cs->name = name;
+        dictAdd(server.migrate_cached_sockets,name,cs);
+    } else {
+        cs->name = NULL;
+        sdsfree(name);
+    }
     return cs;
 }
 
-/* Free a migrate cached connection. */
-void migrateCloseSocket(robj *host, robj *port) {
-    sds name = sdsempty();
-    migrateCachedSocket *cs;
+/* Free a migrate connection, removing it from the cache if needed. */
+void migrateCloseSocket(migrateCachedSocket *cs) {
+    close(cs->fd);
+    if (cs->name) dictDelete(server.migrate_cached_sockets,cs->name);
+    zfree(cs);
+}
 
-    name = sdscatlen(name,host->ptr,sdslen(host->ptr));
-    name = sdscatlen(name,":",1);
-    name = sdscatlen(name,port->ptr,sdslen(port->ptr));
-    cs = dictFetchValue(server.migrate_cached_sockets,name);
-    if (!cs) {
-        sdsfree(name);
+/* Give back a connection obtained with migrateGetSocket() that is still
+ * in a good state: cached sockets stay around for the next MIGRATE, the
+ * others are closed. */
+void migrateReleaseSocket(migrateCachedSocket *cs) {
+    if (cs->name == NULL) {
+        migrateCloseSocket(cs);
         return;
     }
-
-    close(cs->fd);
-    zfree(cs);
-    dictDelete(server.migrate_cached_sockets,name);
-    sdsfree(name);
+    cs->inuse = 0;
+    cs->last_use_time = server.unixtime;
 }
 
 void migrateCloseTimedoutSockets(void) {
@@ -5045,7 +5609,9 @@ void migrateCloseTimedoutSockets(void) {
     while((de = dictNext(di)) != NULL) {
         migrateCachedSocket *cs = dictGetVal(de);
 
-        if ((server.unixtime - cs->last_use_time) > MIGRATE_SOCKET_CACHE_TTL) {
+        if (!cs->inuse &&
+            (server.unixtime - cs->last_use_time) > MIGRATE_SOCKET_CACHE_TTL)
+        {
             close(cs->fd);
             zfree(cs);
             dictDelete(server.migrate_cached_sockets,dictGetKey(de));
@@ -5054,6 +5620,766 @@ void migrateCloseTimedoutSockets(void) {
     dictReleaseIterator(di);
 }
 
+/* Append to 'cmd' the AUTH and SELECT commands if needed, followed by a
+ * RESTORE (RESTORE-ASKING in cluster mode) for every key in 'kv' whose
+ * value is at the same position of 'ov'.
+ *
+ * Keys found non expired by the caller may be expired now, since serializing
+ * large keys may take some time: such keys are skipped, and the two arrays
+ * are compacted in place. The number of RESTORE commands emitted is
+ * returned. */
+int migrateCreateCommands(client *c, rio *cmd, redisDb *db, char *password,
+                          int select, long dbid, robj **kv, robj **ov,
+                          int num_keys, int replace)
+{
+    rio payload;
+    int j, non_expired = 0;
+
+    /* Authentication */
+    if (password) {
+        serverAssertWithInfo(c,NULL,rioWriteBulkCount(cmd,'*',2));
+        serverAssertWithInfo(c,NULL,rioWriteBulkString(cmd,"AUTH",4));
+        serverAssertWithInfo(c,NULL,rioWriteBulkString(cmd,password,
+            sdslen(password)));
+    }
+
+    /* Send the SELECT command if the current DB is not already selected. */
+    if (select) {
+        serverAssertWithInfo(c,NULL,rioWriteBulkCount(cmd,'*',2));
+        serverAssertWithInfo(c,NULL,rioWriteBulkString(cmd,"SELECT",6));
+        serverAssertWithInfo(c,NULL,rioWriteBulkLongLong(cmd,dbid));
+    }
+
+    /* Create RESTORE payload and generate the protocol to call the command. */
+    for (j = 0; j < num_keys; j++) {
+        long long ttl = 0;
+        long long expireat = getExpire(db,kv[j]);
+
+        if (expireat != -1) {
+            ttl = expireat-mstime();
+            if (ttl < 0) {
+                continue;
+            }
+            if (ttl < 1) ttl = 1;
+        }
+
+        /* Relocate valid (non expired) keys into the array in successive
+         * positions to remove holes created by the keys that were present
+         * in the first lookup but are now expired after the second lookup. */
+        kv[non_expired] = kv[j];
+        ov[non_expired] = ov[j];
+        non_expired++;
+
+        serverAssertWithInfo(c,NULL,
+            rioWriteBulkCount(cmd,'*',replace ? 5 : 4));
+
+        if (server.cluster_enabled)
+            serverAssertWithInfo(c,NULL,
+                rioWriteBulkString(cmd,"RESTORE-ASKING",14));
+        else
+            serverAssertWithInfo(c,NULL,rioWriteBulkString(cmd,"RESTORE",7));
+        serverAssertWithInfo(c,NULL,sdsEncodedObject(kv[j]));
+        serverAssertWithInfo(c,NULL,rioWriteBulkString(cmd,kv[j]->ptr,
+                sdslen(kv[j]->ptr)));
+        serverAssertWithInfo(c,NULL,rioWriteBulkLongLong(cmd,ttl));
+
+        /* Emit the payload argument, that is the serialized object using
+         * the DUMP format. */
+        createDumpPayload(&payload,ov[j],kv[j]);
+        serverAssertWithInfo(c,NULL,
+            rioWriteBulkString(cmd,payload.io.buffer.ptr,
+                               sdslen(payload.io.buffer.ptr)));
+        sdsfree(payload.io.buffer.ptr);
+
+        /* Add the REPLACE option to the RESTORE command if it was specified
+         * as a MIGRATE option. */
+        if (replace)
+            serverAssertWithInfo(c,NULL,rioWriteBulkString(cmd,"REPLACE",7));
+    }
+    return non_expired;
+}
+
+/* -----------------------------------------------------------------------------
+ * Asynchronous MIGRATE
+ *
+ * When MIGRATE is called by a normal client (that is, not inside MULTI/EXEC,
+ * a Lua script or a module call) the transfer is driven by the event loop:
+ * the client is blocked with BLOCKED_MIGRATE, the RESTORE commands are
+ * written as the socket becomes writable and the replies of the target are
+ * parsed as they arrive. Other clients are served in the meantime, and every
+ * source key is deleted only once the target acknowledged it.
+ *
+ * While a transfer is in progress its keys are locked into the
+ * db->migrating_keys dictionary: write commands touching them are refused
+ * with -TRYAGAIN (see migrateKeysAreLocked()), so that deleting a key after
+ * the ACK can't discard a write performed in the meantime.
+ *
+ * The same machinery implements CLUSTER MIGRATESLOT, that moves a whole
+ * hash slot in successive rounds of RESTORE commands, see
+ * migrateSlotNextRound().
+ * -------------------------------------------------------------------------- */
+
+typedef struct migrateJob {
+    client *c;              /* Client blocked in MIGRATE. */
+    migrateCachedSocket *cs;/* Connection with the target, or NULL. */
+    robj *host, *port;      /* Target instance. */
+    redisDb *db;            /* Source DB. */
+    long dbid;              /* Target DB. */
+    long timeout;           /* I/O timeout in milliseconds. */
+    int copy, replace;      /* MIGRATE options. */
+    sds password;           /* AUTH password, or NULL. */
+    robj **kv, **ov;        /* Keys and values to transfer. */
+    int num_keys;           /* Number of keys in kv/ov. */
+    robj **skv, **sov;      /* Keys and values actually sent (not expired). */
+    int num_sent;           /* Number of keys in skv/sov. */
+    robj **locked;          /* Keys added to db->migrating_keys. */
+    int num_locked;
+    sds sendbuf;            /* Commands of the current round. */
+    size_t sentlen;         /* Bytes of sendbuf already sent. */
+    sds readbuf;            /* Replies not yet processed. */
+    int select;             /* A SELECT was sent to the target. */
+    int preamble;           /* Replies expected before the RESTORE ones. */
+    int replies;            /* Replies of the current round processed. */
+    int may_retry;          /* Can reconnect on the first socket error. */
+    int error_from_target;  /* An error was already sent to the client. */
+    int preamble_error;     /* AUTH, SELECT or SETSLOT failed. */
+    robj **delargv;         /* DEL command for the acknowledged keys. */
+    int delargc;
+
+    /* CLUSTER MIGRATESLOT state. */
+    int slot;               /* Slot being moved, or -1 for MIGRATE. */
+    char target[CLUSTER_NAMELEN]; /* Name of the node receiving the slot. */
+    int batch;              /* Max number of keys per round. */
+    int final;              /* SETSLOT NODE was sent to the target. */
+    long long moved;        /* Keys moved so far. */
+    long long retry_timer;  /* Timer of a delayed round, or -1. */
+} migrateJob;
+
+/* CLUSTER MIGRATESLOT jobs in progress. */
+static list *migrateSlotJobs = NULL;
+
+void migrateWriteHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+void migrateReadHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+
+/* Number of replies we expect from the target in the current round. */
+static int migrateJobExpectedReplies(migrateJob *job) {
+    return job->preamble + job->num_sent;
+}
+
+/* Stop monitoring the job connection and get rid of it. Unless the
+ * connection is known to be in a clean state (everything sent and every
+ * reply received) it is closed. */
+static void migrateJobDropSocket(migrateJob *job) {
+    migrateCachedSocket *cs = job->cs;
+
+    if (cs == NULL) return;
+    aeDeleteFileEvent(server.el,cs->fd,AE_READABLE|AE_WRITABLE);
+    if (job->sendbuf && job->sentlen == sdslen(job->sendbuf) &&
+        job->replies == migrateJobExpectedReplies(job))
+        migrateReleaseSocket(cs);
+    else
+        migrateCloseSocket(cs);
+    job->cs = NULL;
+}
+
+/* Replicate as a DEL the keys deleted since the last call. */
+static void migrateJobPropagateDeletes(migrateJob *job) {
+    int j;
+
+    if (job->delargc > 1) {
+        job->delargv[0] = shared.del;
+        propagate(server.delCommand,job->db->id,job->delargv,job->delargc,
+                  PROPAGATE_AOF|PROPAGATE_REPL);
+    }
+    for (j = 1; j < job->delargc; j++) decrRefCount(job->delargv[j]);
+    job->delargc = 1;
+}
+
+/* Unlock and release the keys of the job. */
+static void migrateJobReleaseKeys(migrateJob *job) {
+    int j;
+
+    for (j = 0; j < job->num_locked; j++)
+        dictDelete(job->db->migrating_keys,job->locked[j]);
+    for (j = 0; j < job->num_keys; j++) {
+        decrRefCount(job->kv[j]);
+        decrRefCount(job->ov[j]);
+    }
+    job->num_locked = job->num_keys = job->num_sent = 0;
+}
+
+/* Take a reference to the keys (and values) in kv[0..num_keys-1] and lock
+ * them. A key that can't be locked (repeated in the same MIGRATE, or owned
+ * by another job in progress) is removed from kv/ov: the job must only
+ * send, and later delete, the keys it locked. */
+static void migrateJobLockKeys(migrateJob *job) {
+    int j, kept = 0;
+
+    for (j = 0; j < job->num_keys; j++) {
+        if (dictAdd(job->db->migrating_keys,job->kv[j],job) != DICT_OK)
+            continue;
+        incrRefCount(job->kv[j]); /* Reference of migrating_keys. */
+        incrRefCount(job->kv[j]);
+        incrRefCount(job->ov[j]);
+        job->locked[job->num_locked++] = job->kv[j];
+        job->kv[kept] = job->kv[j];
+        job->ov[kept] = job->ov[j];
+        kept++;
+    }
+    job->num_keys = kept;
+}
+
+/* Start sending 'buf' to the target as a new round of commands. The job
+ * takes ownership of the buffer. */
+static int migrateJobSendRound(migrateJob *job, sds buf) {
+    sdsfree(job->sendbuf);
+    job->sendbuf = buf;
+    job->sentlen = 0;
+    job->replies = 0;
+    if (aeCreateFileEvent(server.el,job->cs->fd,AE_WRITABLE,
+            migrateWriteHandler,job) == AE_ERR) return C_ERR;
+    job->c->bpop.timeout = mstime()+job->timeout;
+    return C_OK;
+}
+
+/* Obtain a connection with the target and start the first round: the
+ * serialized keys for MIGRATE, or just the control commands that prepare
+ * the target for CLUSTER MIGRATESLOT. On error a reply is sent to the
+ * client and C_ERR is returned. */
+static int migrateJobConnect(migrateJob *job) {
+    rio cmd;
+
+    job->cs = migrateGetSocket(job->c,job->host,job->port,job->timeout);
+    if (job->cs == NULL) return C_ERR;
+    job->cs->inuse = 1;
+    sdsfree(job->readbuf);
+    job->readbuf = sdsempty();
+    job->preamble_error = 0;
+
+    rioInitWithBuffer(&cmd,sdsempty());
+    job->select = job->cs->last_dbid != job->dbid;
+    job->preamble = (job->password != NULL) + job->select;
+    if (job->slot == -1) {
+        memcpy(job->skv,job->kv,sizeof(robj*)*job->num_keys);
+        memcpy(job->sov,job->ov,sizeof(robj*)*job->num_keys);
+        job->num_sent = migrateCreateCommands(job->c,&cmd,job->db,
+            job->password,job->select,job->dbid,job->skv,job->sov,
+            job->num_keys,job->replace);
+    } else {
+        /* CLUSTER SETSLOT <slot> IMPORTING <myself> */
+        job->num_sent = 0;
+        job->final = 0;
+        migrateCreateCommands(job->c,&cmd,job->db,job->password,job->select,
+            job->dbid,NULL,NULL,0,0);
+        serverAssertWithInfo(job->c,NULL,rioWriteBulkCount(&cmd,'*',5));
+        serverAssertWithInfo(job->c,NULL,rioWriteBulkString(&cmd,"CLUSTER",7));
+        serverAssertWithInfo(job->c,NULL,rioWriteBulkString(&cmd,"SETSLOT",7));
+        serverAssertWithInfo(job->c,NULL,rioWriteBulkLongLong(&cmd,job->slot));
+        serverAssertWithInfo(job->c,NULL,rioWriteBulkString(&cmd,"IMPORTING",9));
+        serverAssertWithInfo(job->c,NULL,
+            rioWriteBulkString(&cmd,myself->name,CLUSTER_NAMELEN));
+        job->preamble++;
+    }
+
+    if (aeCreateFileEvent(server.el,job->cs->fd,AE_READABLE,
+            migrateReadHandler,job) == AE_ERR ||
+        migrateJobSendRound(job,cmd.io.buffer.ptr) == C_ERR)
+    {
+        migrateJobDropSocket(job);
+        addReplyError(job->c,"Can't monitor the MIGRATE target socket");
+        return C_ERR;
+    }
+    return C_OK;
+}
+
+/* Handle a read or write error on the job connection. Like the synchronous
+ * implementation we retry once with a fresh connection if nothing was
+ * acknowledged yet, since it is common for the cached socket to be closed
+ * by the other side. */
+static void migrateJobSocketError(migrateJob *job, int write_error) {
+    int timedout = (errno == ETIMEDOUT);
+
+    migrateJobDropSocket(job);
+    if (!timedout && job->may_retry && job->replies == 0) {
+        job->may_retry = 0;
+        if (migrateJobConnect(job) == C_OK) return;
+        unblockClient(job->c); /* Error already sent. */
+        return;
+    }
+    if (!job->error_from_target) {
+        addReplySds(job->c,
+            sdscatprintf(sdsempty(),
+                "-IOERR error or timeout %s to target instance\r\n",
+                write_error ? "writing" : "reading"));
+    }
+    unblockClient(job->c);
+}
+
+/* Process a single reply line received from the target. */
+static void migrateJobProcessReply(migrateJob *job, char *line) {
+    int j = job->replies++ - job->preamble;
+
+    if (line[0] == '-' || (j >= 0 && job->preamble_error)) {
+        if (j < 0) job->preamble_error = 1;
+        /* On error assume that last_dbid is no longer valid. */
+        if (!job->error_from_target) {
+            job->cs->last_dbid = -1;
+            job->error_from_target = 1;
+            addReplyErrorFormat(job->c,
+                "Target instance replied with error: %s",
+                line[0] == '-' ? line+1 : "AUTH or SELECT failed");
+        }
+        return;
+    }
+    if (j < 0 || job->copy) return;
+
+    /* The target has the key: remove the local one, unless it is no longer
+     * the value we transferred (it may have expired or been deleted and
+     * created again via commands that don't take the lock, like SWAPDB). */
+    robj *key = job->skv[j];
+    dictEntry *de = dbFind(job->db,key->ptr);
+    if (de && dictGetVal(de) == job->sov[j]) {
+        dbDelete(job->db,key);
+        signalModifiedKey(job->db,key);
+        server.dirty++;
+        job->delargv[job->delargc++] = key;
+        incrRefCount(key);
+        job->moved++;
+    }
+}
+
+/* CLUSTER MIGRATESLOT: every key was moved and the target is now the owner
+ * of the slot, so stop serving it. */
+static void migrateSlotSetOwner(migrateJob *job) {
+    clusterNode *n = clusterLookupNode(job->target);
+
+    if (n == NULL) {
+        addReplyErrorFormat(job->c,"Unknown node %.40s",job->target);
+        return;
+    }
+    server.cluster->migrating_slots_to[job->slot] = NULL;
+    if (server.cluster->slots[job->slot] != n) {
+        clusterDelSlot(job->slot);
+        clusterAddSlot(n,job->slot);
+        clusterRemoveNotOwnedShardChannels();
+    }
+    clusterDoBeforeSleep(CLUSTER_TODO_SAVE_CONFIG|CLUSTER_TODO_UPDATE_STATE);
+    serverLog(LL_NOTICE,"Hash slot %d (%lld keys) migrated to %.40s",
+        job->slot, job->moved, job->target);
+    addReply(job->c,shared.ok);
+}
+
+static int migrateSlotNextRound(migrateJob *job);
+
+/* CLUSTER MIGRATESLOT: the keys of the slot were all locked by other
+ * migrations when the previous round was acknowledged, try again. */
+static int migrateSlotRetryRound(struct aeEventLoop *el, long long id,
+                                 void *clientData)
+{
+    migrateJob *job = clientData;
+    UNUSED(el);
+    UNUSED(id);
+
+    job->retry_timer = -1;
+    if (migrateSlotNextRound(job) == C_ERR) unblockClient(job->c);
+    return AE_NOMORE;
+}
+
+/* CLUSTER MIGRATESLOT: the previous round was acknowledged, send the next
+ * batch of keys of the slot. Since the keys acknowledged are deleted, the
+ * next batch is simply the first keys found in the slot: this also picks
+ * the keys written during the transfer. Keys locked by another migration
+ * (an asynchronous MIGRATE) are left to a later round. When the slot is
+ * empty the target is asked to take the ownership of the slot with
+ * SETSLOT NODE. Returns C_ERR if the job is terminated. */
+static int migrateSlotNextRound(migrateJob *job) {
+    rio cmd;
+    int j, busy;
+
+    if (job->final) {
+        if (countKeysInSlot(job->slot) == 0) {
+            migrateSlotSetOwner(job);
+            return C_ERR;
+        }
+        job->final = 0; /* New keys, they must be moved as well. */
+    }
+
+    do {
+        unsigned int numkeys;
+
+        migrateJobReleaseKeys(job);
+        numkeys = getKeysInSlot(job->slot,job->kv,job->batch);
+        busy = 0;
+        for (j = 0; j < (int)numkeys; j++) {
+            robj *o;
+
+            if (dictFind(job->db->migrating_keys,job->kv[j]) != NULL) {
+                decrRefCount(job->kv[j]);
+                busy++;
+                continue;
+            }
+            o = lookupKeyReadWithFlags(job->db,job->kv[j],LOOKUP_NOTOUCH);
+            if (o == NULL) {
+                decrRefCount(job->kv[j]);
+                continue;
+            }
+            job->kv[job->num_keys] = job->kv[j];
+            job->ov[job->num_keys] = o;
+            job->num_keys++;
+        }
+        /* We own a reference of the key names from getKeysInSlot(). */
+        migrateJobLockKeys(job);
+        for (j = 0; j < job->num_keys; j++) decrRefCount(job->kv[j]);
+
+        rioInitWithBuffer(&cmd,sdsempty());
+        job->preamble = 0;
+        if (job->num_keys) {
+            memcpy(job->skv,job->kv,sizeof(robj*)*job->num_keys);
+            memcpy(job->sov,job->ov,sizeof(robj*)*job->num_keys);
+            job->num_sent = migrateCreateCommands(job->c,&cmd,job->db,NULL,0,
+                job->dbid,job->skv,job->sov,job->num_keys,job->replace);
+        } else if (countKeysInSlot(job->slot) == 0) {
+            /* CLUSTER SETSLOT <slot> NODE <target> */
+            serverAssertWithInfo(job->c,NULL,rioWriteBulkCount(&cmd,'*',5));
+            serverAssertWithInfo(job->c,NULL,
+                rioWriteBulkString(&cmd,"CLUSTER",7));
+            serverAssertWithInfo(job->c,NULL,
+                rioWriteBulkString(&cmd,"SETSLOT",7));
+            serverAssertWithInfo(job->c,NULL,
+                rioWriteBulkLongLong(&cmd,job->slot));
+            serverAssertWithInfo(job->c,NULL,
+                rioWriteBulkString(&cmd,"NODE",4));
+            serverAssertWithInfo(job->c,NULL,
+                rioWriteBulkString(&cmd,job->target,CLUSTER_NAMELEN));
+            job->preamble = 1;
+            job->final = 1;
+        }
+        if (migrateJobExpectedReplies(job) == 0) {
+            sdsfree(cmd.io.buffer.ptr);
+            /* The keys found are being moved by other jobs: wait for them
+             * instead of spinning here. */
+            if (busy) {
+                job->retry_timer = aeCreateTimeEvent(server.el,10,
+                    migrateSlotRetryRound,job,NULL);
+                return C_OK;
+            }
+        }
+        /* If no command was emitted every key found expired in the
+         * meantime: try again with the next keys. */
+    } while (migrateJobExpectedReplies(job) == 0);
+
+    if (migrateJobSendRound(job,cmd.io.buffer.ptr) == C_ERR) {
+        addReplyError(job->c,"Can't monitor the MIGRATE target socket");
+        return C_ERR;
+    }
+    return C_OK;
+}
+
+/* Called when every reply of the current round was received. */
+static void migrateJobRoundDone(migrateJob *job) {
+    migrateJobPropagateDeletes(job);
+    if (!job->error_from_target) {
+        /* Success! Update the last_dbid in migrateCachedSocket, so that
+         * we can avoid SELECT the next time if the target DB is the same. */
+        job->cs->last_dbid = job->dbid;
+        if (job->slot != -1) {
+            if (migrateSlotNextRound(job) == C_OK) return;
+        } else {
+            addReply(job->c,shared.ok);
+        }
+    }
+    unblockClient(job->c);
+}
+
+void migrateWriteHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    migrateJob *job = privdata;
+    size_t totwritten = 0;
+    UNUSED(mask);
+
+    while (job->sentlen < sdslen(job->sendbuf)) {
+        size_t towrite = sdslen(job->sendbuf)-job->sentlen;
+        ssize_t nwritten;
+
+        if (towrite > 64*1024) towrite = 64*1024;
+        nwritten = write(fd,job->sendbuf+job->sentlen,towrite);
+        if (nwritten == -1) {
+            if (errno == EAGAIN) break;
+            migrateJobSocketError(job,1);
+            return;
+        }
+        job->sentlen += nwritten;
+        totwritten += nwritten;
+        /* Don't monopolize the event loop with a big payload. */
+        if (totwritten > NET_MAX_WRITES_PER_EVENT) break;
+    }
+    if (totwritten) job->c->bpop.timeout = mstime()+job->timeout;
+    if (job->sentlen == sdslen(job->sendbuf))
+        aeDeleteFileEvent(el,fd,AE_WRITABLE);
+}
+
+void migrateReadHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    migrateJob *job = privdata;
+    size_t len = sdslen(job->readbuf);
+    char *p, *line;
+    ssize_t nread;
+    UNUSED(el);
+    UNUSED(mask);
+
+    job->readbuf = sdsMakeRoomFor(job->readbuf,PROTO_IOBUF_LEN);
+    nread = read(fd,job->readbuf+len,PROTO_IOBUF_LEN);
+    if (nread == -1 && errno == EAGAIN) return;
+    if (nread <= 0) {
+        migrateJobSocketError(job,0);
+        return;
+    }
+    sdsIncrLen(job->readbuf,nread);
+    job->c->bpop.timeout = mstime()+job->timeout;
+
+    /* Consume every complete reply line. */
+    line = job->readbuf;
+    while (job->replies < migrateJobExpectedReplies(job) &&
+           (p = strstr(line,"\r\n")) != NULL)
+    {
+        *p = '\0';
+        migrateJobProcessReply(job,line);
+        line = p+2;
+    }
+    sdsrange(job->readbuf,line-job->readbuf,-1);
+
+    if (job->replies == migrateJobExpectedReplies(job)) {
+        if (job->sentlen != sdslen(job->sendbuf)) {
+            /* Replies for commands we did not send yet? */
+            migrateJobSocketError(job,0);
+            return;
+        }
+        migrateJobRoundDone(job);
+    }
+}
+
+/* Release the job: this is called when the client is unblocked, either
+ * because the transfer completed, failed, timed out, or because the client
+ * was freed. The keys acknowledged so far are propagated as a DEL. */
+void unblockClientFromMigrate(client *c) {
+    migrateJob *job = c->bpop.migrate_job;
+
+    if (job->retry_timer != -1)
+        aeDeleteTimeEvent(server.el,job->retry_timer);
+    migrateJobDropSocket(job);
+    migrateJobPropagateDeletes(job);
+    migrateJobReleaseKeys(job);
+    if (job->slot != -1) {
+        listNode *ln = listSearchKey(migrateSlotJobs,job);
+        if (ln) listDelNode(migrateSlotJobs,ln);
+    }
+    decrRefCount(job->host);
+    decrRefCount(job->port);
+    sdsfree(job->password);
+    sdsfree(job->sendbuf);
+    sdsfree(job->readbuf);
+    zfree(job->kv);
+    zfree(job->ov);
+    zfree(job->skv);
+    zfree(job->sov);
+    zfree(job->locked);
+    zfree(job->delargv);
+    zfree(job);
+    c->bpop.migrate_job = NULL;
+}
+
+/* Reply to a client whose MIGRATE timed out. */
+void replyToMigrateTimedOut(client *c) {
+    migrateJob *job = c->bpop.migrate_job;
+
+    if (job->error_from_target) return;
+    addReplySds(c,
+        sdscatprintf(sdsempty(),
+            "-IOERR error or timeout %s to target instance\r\n",
+            (job->sendbuf && job->sentlen < sdslen(job->sendbuf)) ?
+                "writing" : "reading"));
+}
+
+/* Create a job for the client, with room for 'maxkeys' keys per round. */
+static migrateJob *migrateCreateJob(client *c, robj *host, robj *port,
+                                    long dbid, long timeout, char *password,
+                                    int maxkeys)
+{
+    migrateJob *job = zcalloc(sizeof(*job));
+
+    job->c = c;
+    job->host = host;
+    job->port = port;
+    job->db = c->db;
+    job->dbid = dbid;
+    job->timeout = timeout;
+    job->password = password ? sdsnew(password) : NULL;
+    job->kv = zmalloc(sizeof(robj*)*maxkeys);
+    job->ov = zmalloc(sizeof(robj*)*maxkeys);
+    job->skv = zmalloc(sizeof(robj*)*maxkeys);
+    job->sov = zmalloc(sizeof(robj*)*maxkeys);
+    job->locked = zmalloc(sizeof(robj*)*maxkeys);
+    job->delargv = zmalloc(sizeof(robj*)*(maxkeys+1));
+    job->delargc = 1;
+    job->may_retry = 1;
+    job->slot = -1;
+    job->retry_timer = -1;
+    c->bpop.migrate_job = job;
+    return job;
+}
+
+/* Start an asynchronous MIGRATE of the keys 'kv' with values 'ov'. The
+ * client is blocked until the transfer is completed, unless an error is
+ * returned ASAP. */
+void migrateStartJob(client *c, robj **kv, robj **ov, int num_keys,
+                     long dbid, long timeout, int copy, int replace,
+                     char *password)
+{
+    migrateJob *job;
+
+    incrRefCount(c->argv[1]);
+    incrRefCount(c->argv[2]);
+    job = migrateCreateJob(c,c->argv[1],c->argv[2],dbid,timeout,password,
+                           num_keys);
+    job->copy = copy;
+    job->replace = replace;
+    memcpy(job->kv,kv,sizeof(robj*)*num_keys);
+    memcpy(job->ov,ov,sizeof(robj*)*num_keys);
+    job->num_keys = num_keys;
+
+    /* Lock the keys before serializing them. */
+    migrateJobLockKeys(job);
+
+    if (migrateJobConnect(job) == C_ERR) {
+        unblockClientFromMigrate(c);
+        return;
+    }
+
+    /* Every key expired in the meantime and there is no AUTH / SELECT
+     * reply to wait for: nothing to do. */
+    if (migrateJobExpectedReplies(job) == 0) {
+        addReply(c,shared.ok);
+        unblockClientFromMigrate(c);
+        return;
+    }
+    blockClient(c,BLOCKED_MIGRATE);
+}
+
+/* CLUSTER MIGRATESLOT <slot> <node-id> [TIMEOUT <ms>] [BATCH <keys>]
+ *                     [REPLACE] [AUTH <password>]
+ *
+ * Move every key of the hash slot to the specified master and hand it the
+ * ownership of the slot, without the need for the caller to orchestrate
+ * SETSLOT, GETKEYSINSLOT and MIGRATE calls:
+ *
+ * 1. The slot is set MIGRATING here and IMPORTING in the target, so that
+ *    requests about keys already moved are redirected with -ASK.
+ * 2. The keys are sent in batches of RESTORE-ASKING commands, each key
+ *    being deleted as soon as the target acknowledges it. Keys written
+ *    while the transfer is in progress are moved by the next rounds.
+ * 3. Once the slot is empty the target is assigned the slot with SETSLOT
+ *    NODE (bumping its config epoch), and we do the same locally.
+ *
+ * The client is blocked until the slot is moved. On errors the slot is left
+ * in MIGRATING state and the command can just be called again. */
+void clusterMigrateSlotCommand(client *c) {
+    long long timeout = 5000, batch = 100;
+    char *password = NULL;
+    int slot, replace = 0, j;
+    clusterNode *n;
+    migrateJob *job;
+    listNode *ln;
+    listIter li;
+
+    if ((slot = getSlotOrReply(c,c->argv[2])) == -1) return;
+    for (j = 4; j < c->argc; j++) {
+        int moreargs = j < c->argc-1;
+        if (!strcasecmp(c->argv[j]->ptr,"timeout") && moreargs) {
+            if (getLongLongFromObjectOrReply(c,c->argv[++j],&timeout,NULL)
+                != C_OK) return;
+            if (timeout <= 0) timeout = 1000;
+        } else if (!strcasecmp(c->argv[j]->ptr,"batch") && moreargs) {
+            if (getLongLongFromObjectOrReply(c,c->argv[++j],&batch,NULL)
+                != C_OK) return;
+            if (batch <= 0 || batch > 100000) {
+                addReplyError(c,"BATCH must be between 1 and 100000");
+                return;
+            }
+        } else if (!strcasecmp(c->argv[j]->ptr,"replace")) {
+            replace = 1;
+        } else if (!strcasecmp(c->argv[j]->ptr,"auth") && moreargs) {
+            password = c->argv[++j]->ptr;
+        } else {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+    }
+
+    if (c->flags & (CLIENT_MULTI|CLIENT_LUA|CLIENT_MODULE)) {
+        addReplyError(c,"CLUSTER MIGRATESLOT can't be called from MULTI, "
+                        "scripts or modules");
+        return;
+    }
+    if (server.cluster->slots[slot] != myself) {
+        addReplyErrorFormat(c,"I'm not the owner of hash slot %u",slot);
+        return;
+    }
+    if ((n = clusterLookupNode(c->argv[3]->ptr)) == NULL) {
+        addReplyErrorFormat(c,"I don't know about node %s",
+            (char*)c->argv[3]->ptr);
+        return;
+    }
+    if (n == myself || !nodeIsMaster(n)) {
+        addReplyError(c,"The target node must be a different master");
+        return;
+    }
+    if (migrateSlotJobs == NULL) migrateSlotJobs = listCreate();
+    listRewind(migrateSlotJobs,&li);
+    while((ln = listNext(&li))) {
+        job = listNodeValue(ln);
+        if (job->slot == slot) {
+            addReplyErrorFormat(c,"Hash slot %d is already being migrated",
+                slot);
+            return;
+        }
+    }
+
+    job = migrateCreateJob(c,createStringObject(n->ip,strlen(n->ip)),
+                           createObject(OBJ_STRING,sdsfromlonglong(n->port)),
+                           0,timeout,password,batch);
+    job->replace = replace;
+    job->slot = slot;
+    job->batch = batch;
+    memcpy(job->target,n->name,CLUSTER_NAMELEN);
+    listAddNodeTail(migrateSlotJobs,job);
+
+    if (migrateJobConnect(job) == C_ERR) {
+        unblockClientFromMigrate(c);
+        return;
+    }
+    server.cluster->migrating_slots_to[slot] = n;
+    blockClient(c,BLOCKED_MIGRATE);
+}
+
+/* Return non zero if 'cmd' is a write command that, called with the
+ * specified arguments against 'db', touches a key locked by an asynchronous
+ * MIGRATE in progress. Scripts may write the keys they declare, so they are
+ * checked as well. */
+int migrateKeysAreLocked(redisDb *db, struct redisCommand *cmd, robj **argv, int argc) {
+    int *keys, numkeys, j, locked = 0;
+
+    if (dictSize(db->migrating_keys) == 0) return 0;
+    if (!(cmd->flags & CMD_WRITE) &&
+        cmd->proc != evalCommand && cmd->proc != evalShaCommand) return 0;
+    keys = getKeysFromCommand(cmd,argv,argc,&numkeys);
+    for (j = 0; j < numkeys; j++) {
+        if (dictFind(db->migrating_keys,argv[keys[j]]) != NULL) {
+            locked = 1;
+            break;
+        }
+    }
+    getKeysFreeResult(keys);
+    return locked;
+}
+
 /* MIGRATE host port key dbid timeout [COPY | REPLACE | AUTH password]
  *
  * On in the multiple keys form:
@@ -5069,10 +6395,9 @@ void migrateCommand(client *c) {
     robj **ov = NULL; /* Objects to migrate. */
     robj **kv = NULL; /* Key names. */
     robj **newargv = NULL; /* Used to rewrite the command as DEL ... keys ... */
-    rio cmd, payload;
+    rio cmd;
     int may_retry = 1;
     int write_error = 0;
-    int argv_rewritten = 0;
 
     /* To support the KEYS option we need the following additional state. */
     int first_key = 3; /* Argument index of the first key. */
@@ -5138,6 +6463,15 @@ void migrateCommand(client *c) {
         return;
     }
 
+    /* Clients that can block don't stop the server while the keys are
+     * transferred, see migrateStartJob(). Inside MULTI/EXEC, scripts and
+     * module calls the transfer is performed synchronously. */
+    if (!(c->flags & (CLIENT_MULTI|CLIENT_LUA|CLIENT_MODULE))) {
+        migrateStartJob(c,kv,ov,num_keys,dbid,timeout,copy,replace,password);
+        zfree(ov); zfree(kv);
+        return;
+    }
+
 try_again:
     write_error = 0;
 
@@ -5150,74 +6484,11 @@ try_again:
 
     rioInitWithBuffer(&cmd,sdsempty());
 
-    /* Authentication */
-    if (password) {
-        serverAssertWithInfo(c,NULL,rioWriteBulkCount(&cmd,'*',2));
-        serverAssertWithInfo(c,NULL,rioWriteBulkString(&cmd,"AUTH",4));
-        serverAssertWithInfo(c,NULL,rioWriteBulkString(&cmd,password,
-            sdslen(password)));
-    }
-
-    /* Send the SELECT command if the current DB is not already selected. */
+    /* Emit AUTH, SELECT and RESTORE commands, and fix the actual number of
+     * keys we are migrating. */
     int select = cs->last_dbid != dbid; /* Should we emit SELECT? */
-    if (select) {
-        serverAssertWithInfo(c,NULL,rioWriteBulkCount(&cmd,'*',2));
-        serverAssertWithInfo(c,NULL,rioWriteBulkString(&cmd,"SELECT",6));
-        serverAssertWithInfo(c,NULL,rioWriteBulkLongLong(&cmd,dbid));
-    }
-
-    int non_expired = 0; /* Number of keys that we'll find non expired.
-                            Note that serializing large keys may take some time
-                            so certain keys that were found non expired by the
-                            lookupKey() function, may be expired later. */
-
-    /* Create RESTORE payload and generate the protocol to call the command. */
-    for (j = 0; j < num_keys; j++) {
-        long long ttl = 0;
-        long long expireat = getExpire(c->db,kv[j]);
-
-        if (expireat != -1) {
-            ttl = expireat-mstime();
-            if (ttl < 0) {
-                continue;
-            }
-            if (ttl < 1) ttl = 1;
-        }
-
-        /* Relocate valid (non expired) keys into the array in successive
-         * positions to remove holes created by the keys that were present
-         * in the first lookup but are now expired after the second lookup. */
-        kv[non_expired++] = kv[j];
-
-        serverAssertWithInfo(c,NULL,
-            rioWriteBulkCount(&cmd,'*',replace ? 5 : 4));
-
-        if (server.cluster_enabled)
-            serverAssertWithInfo(c,NULL,
-                rioWriteBulkString(&cmd,"RESTORE-ASKING",14));
-        else
-            serverAssertWithInfo(c,NULL,rioWriteBulkString(&cmd,"RESTORE",7));
-        serverAssertWithInfo(c,NULL,sdsEncodedObject(kv[j]));
-        serverAssertWithInfo(c,NULL,rioWriteBulkString(&cmd,kv[j]->ptr,
-                sdslen(kv[j]->ptr)));
-        serverAssertWithInfo(c,NULL,rioWriteBulkLongLong(&cmd,ttl));
-
-        /* Emit the payload argument, that is the serialized object using
-         * the DUMP format. */
-        createDumpPayload(&payload,ov[j],kv[j]);
-        serverAssertWithInfo(c,NULL,
-            rioWriteBulkString(&cmd,payload.io.buffer.ptr,
-                               sdslen(payload.io.buffer.ptr)));
-        sdsfree(payload.io.buffer.ptr);
-
-        /* Add the REPLACE option to the RESTORE command if it was specified
-         * as a MIGRATE option. */
-        if (replace)
-            serverAssertWithInfo(c,NULL,rioWriteBulkString(&cmd,"REPLACE",7));
-    }
-
-    /* Fix the actual number of keys we are migrating. */
-    num_keys = non_expired;
+    num_keys = migrateCreateCommands(c,&cmd,c->db,password,select,dbid,
+                                     kv,ov,num_keys,replace);
 
     /* Transfer the query to the other node in 64K chunks. */
     errno = 0;
@@ -5304,10 +6575,11 @@ try_again:
         goto socket_err; /* A retry is guaranteed because of tested conditions.*/
     }
 
-    /* On socket errors, close the migration socket now that we still have
-     * the original host/port in the ARGV. Later the original command may be
-     * rewritten to DEL and will be too later. */
-    if (socket_error) migrateCloseSocket(c->argv[1],c->argv[2]);
+    /* On socket errors, close the migration socket now. */
+    if (socket_error) {
+        migrateCloseSocket(cs);
+        cs = NULL;
+    }
 
     if (!copy) {
         /* Translate MIGRATE as DEL for replication/AOF. Note that we do
@@ -5317,7 +6589,6 @@ try_again:
             newargv[0] = createStringObject("DEL",3);
             /* Note that the following call takes ownership of newargv. */
             replaceClientCommandVector(c,del_idx,newargv);
-            argv_rewritten = 1;
         } else {
             /* No key transfer acknowledged, no need to rewrite as DEL. */
             zfree(newargv);
@@ -5346,6 +6617,7 @@ try_again:
         /* On error we already sent it in the for loop above, and set
          * the currently selected socket to -1 to force SELECT the next time. */
     }
+    if (cs) migrateReleaseSocket(cs);
 
     sdsfree(cmd.io.buffer.ptr);
     zfree(ov); zfree(kv); zfree(newargv);
@@ -5359,11 +6631,10 @@ socket_err:
      * Note: Closing the migrate socket will also force SELECT next time. */
     sdsfree(cmd.io.buffer.ptr);
 
-    /* If the command was rewritten as DEL and there was a socket error,
-     * we already closed the socket earlier. While migrateCloseSocket()
-     * is idempotent, the host/port arguments are now gone, so don't do it
-     * again. */
-    if (!argv_rewritten) migrateCloseSocket(c->argv[1],c->argv[2]);
+    /* If the socket error happened after the command was rewritten as DEL,
+     * we already closed the socket earlier. */
+    if (cs) migrateCloseSocket(cs);
+    cs = NULL;
     zfree(newargv);
     newargv = NULL; /* This will get reallocated on retry. */
 
@@ -5457,6 +6728,7 @@ clusterNode *getNodeByQuery(client *c, struct redisCommand *cmd, robj **argv, in
     multiState *ms, _ms;
     multiCmd mc;
     int i, slot = 0, migrating_slot = 0, importing_slot = 0, missing_keys = 0;
+    int pubsubshard_included = 0; /* Shard channels are not keys. */
 
     /* Allow any key to be set if a module disabled cluster redirections. */
     if (server.cluster_module_flags & CLUSTER_MODULE_FLAG_NO_REDIRECTION)
@@ -5498,6 +6770,12 @@ clusterNode *getNodeByQuery(client *c, struct redisCommand *cmd, robj **argv, in
         mcmd = ms->commands[i].cmd;
         margc = ms->commands[i].argc;
         margv = ms->commands[i].argv;
+        if (mcmd->proc == ssubscribeCommand ||
+            mcmd->proc == sunsubscribeCommand ||
+            mcmd->proc == spublishCommand)
+        {
+            pubsubshard_included = 1;
+        }
 
         keyindex = getKeysFromCommand(mcmd,margv,margc,&numkeys);
         for (j = 0; j < numkeys; j++) {
@@ -5553,8 +6831,10 @@ clusterNode *getNodeByQuery(client *c, struct redisCommand *cmd, robj **argv, in
                 }
             }
 
-            /* Migarting / Improrting slot? Count keys we don't have. */
-            if ((migrating_slot || importing_slot) &&
+            /* Migarting / Improrting slot? Count keys we don't have.
+             * Shard channels are not keys: they are served by the source
+             * node until the slot is assigned to the target. */
+            if ((migrating_slot || importing_slot) && !pubsubshard_included &&
                 lookupKeyRead(&server.db[0],thiskey) == NULL)
             {
                 missing_keys++;
@@ -5606,10 +6886,16 @@ clusterNode *getNodeByQuery(client *c, struct redisCommand *cmd, robj **argv, in
 
     /* Handle the read-only client case reading from a slave: if this
      * node is a slave and the request is about an hash slot our master
-     * is serving, we can reply without redirection. */
-    if (c->flags & CLIENT_READONLY &&
-        (cmd->flags & CMD_READONLY || cmd->proc == evalCommand ||
-         cmd->proc == evalShaCommand) &&
+     * is serving, we can reply without redirection. Replicas also receive
+     * the shard channel messages of their master, so they can always
+     * serve SSUBSCRIBE and SUNSUBSCRIBE. */
+    int is_readonly_command = cmd->flags & CMD_READONLY ||
+                              cmd->proc == evalCommand ||
+                              cmd->proc == evalShaCommand;
+    int is_pubsubshard_subscribe = cmd->proc == ssubscribeCommand ||
+                                   cmd->proc == sunsubscribeCommand;
+    if (((c->flags & CLIENT_READONLY && is_readonly_command) ||
+         is_pubsubshard_subscribe) &&
         nodeIsSlave(myself) &&
         myself->slaveof == n)
     {
@@ -17,10 +17,13 @@
 #define CLUSTER_DEFAULT_SLAVE_VALIDITY 10 /* Slave max data age factor. */
 #define CLUSTER_DEFAULT_REQUIRE_FULL_COVERAGE 1
 #define CLUSTER_DEFAULT_SLAVE_NO_FAILOVER 0 /* Failover by default. */
+#define CLUSTER_DEFAULT_COMPACT_MESSAGES 1 /* Use compact bus messages. */
 #define CLUSTER_FAIL_REPORT_VALIDITY_MULT 2 /* Fail report validity. */
 #define CLUSTER_FAIL_UNDO_TIME_MULT 2 /* Undo fail if master is back. */
 #define CLUSTER_FAIL_UNDO_TIME_ADD 10 /* Some additional time. */
 #define CLUSTER_FAILOVER_DELAY 5 /* Seconds */
+#define CLUSTER_SLOT_STATS_MEM_SAMPLES 5 /* Keys sampled to estimate memory. */
+#define CLUSTER_SLOT_STATS_DEFAULT_LIMIT 16 /* SLOT-STATS ORDERBY limit. */
 #define CLUSTER_DEFAULT_MIGRATION_BARRIER 1
 #define CLUSTER_MF_TIMEOUT 5000 /* Milliseconds to do a manual failover. */
 #define CLUSTER_MF_PAUSE_MULT 2 /* Master pause manual failover mult. */
@@ -44,6 +47,12 @@ typedef struct clusterLink {
     sds sndbuf;                 /* Packet send buffer */
     sds rcvbuf;                 /* Packet reception buffer */
     struct clusterNode *node;   /* Node related to this link if any, or NULL */
+    int compact;                /* The peer accepts compact messages. */
+    int slots_sent;             /* True if 'slots_hash_sent' is valid. */
+    uint64_t slots_hash_sent;   /* Hash of the last slots bitmap sent. */
+    unsigned char *slots_recv;  /* Last slots bitmap received in a compact
+                                   message, or NULL. */
+    uint64_t slots_hash_recv;   /* Hash of 'slots_recv'. */
 } clusterLink;
 
 /* Cluster node flags and macros. */
@@ -98,7 +107,8 @@ typedef struct clusterLink {
 #define CLUSTERMSG_TYPE_UPDATE 7        /* Another node slots configuration */
 #define CLUSTERMSG_TYPE_MFSTART 8       /* Pause clients for manual failover */
 #define CLUSTERMSG_TYPE_MODULE 9        /* Module cluster API message. */
-#define CLUSTERMSG_TYPE_COUNT 10        /* Total number of message types. */
+#define CLUSTERMSG_TYPE_PUBLISHSHARD 10 /* Pub/Sub Publish shard propagation */
+#define CLUSTERMSG_TYPE_COUNT 11        /* Total number of message types. */
 
 /* Flags that a module can set in order to prevent certain Redis Cluster
  * features to be enabled. Useful when implementing a different distributed
@@ -140,6 +150,15 @@ typedef struct clusterNode {
     list *fail_reports;         /* List of nodes signaling this as failing */
 } clusterNode;
 
+/* Resources used by the commands executed against a slot, see
+ * CLUSTER SLOT-STATS. */
+typedef struct clusterSlotStats {
+    unsigned long long commands;          /* Commands executed. */
+    unsigned long long cpu_usec;          /* Time spent executing them. */
+    unsigned long long network_bytes_in;  /* Protocol size of the commands. */
+    unsigned long long network_bytes_out; /* Protocol size of the replies. */
+} clusterSlotStats;
+
 typedef struct clusterState {
     clusterNode *myself;  /* This node */
     uint64_t currentEpoch;
@@ -150,8 +169,6 @@ typedef struct clusterState {
     clusterNode *migrating_slots_to[CLUSTER_SLOTS];
     clusterNode *importing_slots_from[CLUSTER_SLOTS];
     clusterNode *slots[CLUSTER_SLOTS];
-    uint64_t slots_keys_count[CLUSTER_SLOTS];
-    rax *slots_to_keys;
     /* The following fields are used to take the slave state on elections. */
     mstime_t failover_auth_time; /* Time of previous or next election. */
     int failover_auth_count;    /* Number of votes received so far. */
@@ -178,6 +195,9 @@ typedef struct clusterState {
     long long stats_bus_messages_received[CLUSTERMSG_TYPE_COUNT];
     long long stats_pfail_nodes;    /* Number of nodes in PFAIL status,
                                        excluding nodes without address. */
+    long long stats_bus_compact_sent;     /* Compact messages sent. */
+    long long stats_bus_compact_received; /* Compact messages received. */
+    clusterSlotStats slot_stats[CLUSTER_SLOTS]; /* Per slot resource usage. */
 } clusterState;
 
 /* Redis cluster messages header */
@@ -248,6 +268,7 @@ union clusterMsgData {
 };
 
 #define CLUSTER_PROTO_VER 1 /* Cluster bus protocol version. */
+#define CLUSTER_PROTO_VER_COMPACT 2 /* Compact messages, see below. */
 
 typedef struct {
     char sig[4];        /* Signature "RCmb" (Redis Cluster message bus). */
@@ -276,11 +297,36 @@ typedef struct {
 
 #define CLUSTERMSG_MIN_LEN (sizeof(clusterMsg)-sizeof(union clusterMsgData))
 
+/* Compact messages.
+ *
+ * Nodes advertise with CLUSTERMSG_FLAG0_COMPACT that they are able to
+ * receive compact messages. On links where the peer advertised it, every
+ * message is sent with version CLUSTER_PROTO_VER_COMPACT: the myslots
+ * bitmap in the header is replaced by the following structure, followed by
+ * the encoded slots (if any), followed by the rest of the message starting
+ * from the 'slaveof' field. Since the bitmap rarely changes, most of the
+ * time the slots are omitted at all, saving 2k per message. The receiver
+ * rebuilds a normal message before processing it. */
+typedef struct {
+    uint64_t hash;      /* crc64 of the slots bitmap. */
+    uint16_t encoding;  /* CLUSTERMSG_SLOTS_... */
+    uint16_t count;     /* Number of ranges for CLUSTERMSG_SLOTS_RANGES. */
+    uint32_t notused1;
+} clusterMsgSlotsInfo;
+
+#define CLUSTERMSG_SLOTS_SAME 0     /* Same as the last sent on this link. */
+#define CLUSTERMSG_SLOTS_RANGES 1   /* 'count' start/end uint16_t pairs. */
+#define CLUSTERMSG_SLOTS_BITMAP 2   /* The full bitmap. */
+
+#define CLUSTERMSG_COMPACT_MIN_LEN (CLUSTERMSG_MIN_LEN - CLUSTER_SLOTS/8 + \
+                                    sizeof(clusterMsgSlotsInfo))
+
 /* Message flags better specify the packet content or are used to
  * provide some information about the node state. */
 #define CLUSTERMSG_FLAG0_PAUSED (1<<0) /* Master paused for manual failover. */
 #define CLUSTERMSG_FLAG0_FORCEACK (1<<1) /* Give ACK to AUTH_REQUEST even if
                                             master is up. */
+#define CLUSTERMSG_FLAG0_COMPACT (1<<2) /* Sender accepts compact messages. */
 
 /* ---------------------- API exported outside cluster.c -------------------- */
 clusterNode *getNodeByQuery(client *c, struct redisCommand *cmd, robj **argv, int argc, int *hashslot, int *ask);
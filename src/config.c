@@ -91,6 +91,12 @@ configEnum aof_fsync_enum[] = {
     {NULL, 0}
 };
 
+configEnum list_compress_codec_enum[] = {
+    {"lzf", QUICKLIST_NODE_ENCODING_LZF},
+    {"lz4", QUICKLIST_NODE_ENCODING_LZ4},
+    {NULL, 0}
+};
+
 /* Output buffer limits presets. */
 clientBufferLimitsConfig clientBufferLimitsDefaults[CLIENT_TYPE_OBUF_COUNT] = {
     {0, 0, 0}, /* normal */
@@ -440,6 +446,14 @@ void loadServerConfigFromString(char *config) {
             if ((server.lazyfree_lazy_server_del = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"setops-offload-threshold") &&
+                   argc == 2)
+        {
+            server.setops_offload_threshold = strtoll(argv[1],NULL,10);
+            if (server.setops_offload_threshold < 0) {
+                err = "setops-offload-threshold can't be negative";
+                goto loaderr;
+            }
         } else if ((!strcasecmp(argv[0],"slave-lazy-flush") ||
                     !strcasecmp(argv[0],"replica-lazy-flush")) && argc == 2)
         {
@@ -588,6 +602,16 @@ void loadServerConfigFromString(char *config) {
             server.stream_node_max_bytes = memtoll(argv[1], NULL);
         } else if (!strcasecmp(argv[0],"stream-node-max-entries") && argc == 2) {
             server.stream_node_max_entries = atoi(argv[1]);
+        } else if (!strcasecmp(argv[0],"stream-node-compact-percent") &&
+                   argc == 2)
+        {
+            server.stream_node_compact_percent = atoi(argv[1]);
+            if (server.stream_node_compact_percent < 0 ||
+                server.stream_node_compact_percent > 100)
+            {
+                err = "stream-node-compact-percent must be between 0 and 100";
+                goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"list-max-ziplist-entries") && argc == 2){
             /* DEAD OPTION */
         } else if (!strcasecmp(argv[0],"list-max-ziplist-value") && argc == 2) {
@@ -596,6 +620,14 @@ void loadServerConfigFromString(char *config) {
             server.list_max_ziplist_size = atoi(argv[1]);
         } else if (!strcasecmp(argv[0],"list-compress-depth") && argc == 2) {
             server.list_compress_depth = atoi(argv[1]);
+        } else if (!strcasecmp(argv[0],"list-compress-codec") && argc == 2) {
+            server.list_compress_codec =
+                configEnumGetValue(list_compress_codec_enum,argv[1]);
+            if (server.list_compress_codec == INT_MIN) {
+                err = "Invalid list compress codec";
+                goto loaderr;
+            }
+            quicklistSetCompressCodec(server.list_compress_codec);
         } else if (!strcasecmp(argv[0],"set-max-intset-entries") && argc == 2) {
             server.set_max_intset_entries = memtoll(argv[1], NULL);
         } else if (!strcasecmp(argv[0],"zset-max-ziplist-entries") && argc == 2) {
@@ -604,6 +636,13 @@ void loadServerConfigFromString(char *config) {
             server.zset_max_ziplist_value = memtoll(argv[1], NULL);
         } else if (!strcasecmp(argv[0],"hll-sparse-max-bytes") && argc == 2) {
             server.hll_sparse_max_bytes = memtoll(argv[1], NULL);
+        } else if (!strcasecmp(argv[0],"shortest-double-format") && argc == 2) {
+            if ((server.shortest_double_format = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+            d2stringSetShortest(server.shortest_double_format);
+        } else if (!strcasecmp(argv[0],"bitmap-compress-min-bytes") && argc == 2) {
+            server.bitmap_compress_min_bytes = memtoll(argv[1], NULL);
         } else if (!strcasecmp(argv[0],"rename-command") && argc == 3) {
             struct redisCommand *cmd = lookupCommand(argv[1]);
             int retval;
@@ -692,6 +731,14 @@ void loadServerConfigFromString(char *config) {
                 err = "argument must be 'yes' or 'no'";
                 goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"cluster-compact-messages") &&
+                   argc == 2)
+        {
+            server.cluster_compact_messages = yesnotoi(argv[1]);
+            if (server.cluster_compact_messages == -1) {
+                err = "argument must be 'yes' or 'no'";
+                goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"lua-time-limit") && argc == 2) {
             server.lua_time_limit = strtoll(argv[1],NULL,10);
         } else if (!strcasecmp(argv[0],"lua-replicate-commands") && argc == 2) {
@@ -1076,6 +1123,8 @@ void configSetCommand(client *c) {
       "cluster-slave-no-failover",server.cluster_slave_no_failover) {
     } config_set_bool_field(
       "cluster-replica-no-failover",server.cluster_slave_no_failover) {
+    } config_set_bool_field(
+      "cluster-compact-messages",server.cluster_compact_messages) {
     } config_set_bool_field(
       "aof-rewrite-incremental-fsync",server.aof_rewrite_incremental_fsync) {
     } config_set_bool_field(
@@ -1129,6 +1178,9 @@ void configSetCommand(client *c) {
       "no-appendfsync-on-rewrite",server.aof_no_fsync_on_rewrite) {
     } config_set_bool_field(
       "dynamic-hz",server.dynamic_hz) {
+    } config_set_bool_field(
+      "shortest-double-format",server.shortest_double_format) {
+        d2stringSetShortest(server.shortest_double_format);
 
     /* Numerical fields.
      * config_set_numerical_field(name,var,min,max) */
@@ -1164,18 +1216,24 @@ void configSetCommand(client *c) {
       "stream-node-max-bytes",server.stream_node_max_bytes,0,LONG_MAX) {
     } config_set_numerical_field(
       "stream-node-max-entries",server.stream_node_max_entries,0,LLONG_MAX) {
+    } config_set_numerical_field(
+      "stream-node-compact-percent",server.stream_node_compact_percent,0,100) {
     } config_set_numerical_field(
       "list-max-ziplist-size",server.list_max_ziplist_size,INT_MIN,INT_MAX) {
     } config_set_numerical_field(
       "list-compress-depth",server.list_compress_depth,0,INT_MAX) {
     } config_set_numerical_field(
       "set-max-intset-entries",server.set_max_intset_entries,0,LONG_MAX) {
+    } config_set_numerical_field(
+      "setops-offload-threshold",server.setops_offload_threshold,0,LLONG_MAX) {
     } config_set_numerical_field(
       "zset-max-ziplist-entries",server.zset_max_ziplist_entries,0,LONG_MAX) {
     } config_set_numerical_field(
       "zset-max-ziplist-value",server.zset_max_ziplist_value,0,LONG_MAX) {
     } config_set_numerical_field(
       "hll-sparse-max-bytes",server.hll_sparse_max_bytes,0,LONG_MAX) {
+    } config_set_numerical_field(
+      "bitmap-compress-min-bytes",server.bitmap_compress_min_bytes,0,LONG_MAX) {
     } config_set_numerical_field(
       "lua-time-limit",server.lua_time_limit,0,LONG_MAX) {
     } config_set_numerical_field(
@@ -1267,6 +1325,9 @@ void configSetCommand(client *c) {
       "maxmemory-policy",server.maxmemory_policy,maxmemory_policy_enum) {
     } config_set_enum_field(
       "appendfsync",server.aof_fsync,aof_fsync_enum) {
+    } config_set_enum_field(
+      "list-compress-codec",server.list_compress_codec,list_compress_codec_enum) {
+        quicklistSetCompressCodec(server.list_compress_codec);
 
     /* Everyhing else is an error... */
     } config_set_else {
@@ -1367,18 +1428,24 @@ void configGetCommand(client *c) {
             server.stream_node_max_bytes);
     config_get_numerical_field("stream-node-max-entries",
             server.stream_node_max_entries);
+    config_get_numerical_field("stream-node-compact-percent",
+            server.stream_node_compact_percent);
     config_get_numerical_field("list-max-ziplist-size",
             server.list_max_ziplist_size);
     config_get_numerical_field("list-compress-depth",
             server.list_compress_depth);
     config_get_numerical_field("set-max-intset-entries",
             server.set_max_intset_entries);
+    config_get_numerical_field("setops-offload-threshold",
+            server.setops_offload_threshold);
     config_get_numerical_field("zset-max-ziplist-entries",
             server.zset_max_ziplist_entries);
     config_get_numerical_field("zset-max-ziplist-value",
             server.zset_max_ziplist_value);
     config_get_numerical_field("hll-sparse-max-bytes",
             server.hll_sparse_max_bytes);
+    config_get_numerical_field("bitmap-compress-min-bytes",
+            server.bitmap_compress_min_bytes);
     config_get_numerical_field("lua-time-limit",server.lua_time_limit);
     config_get_numerical_field("slowlog-log-slower-than",
             server.slowlog_log_slower_than);
@@ -1421,6 +1488,8 @@ void configGetCommand(client *c) {
             server.cluster_slave_no_failover);
     config_get_bool_field("cluster-replica-no-failover",
             server.cluster_slave_no_failover);
+    config_get_bool_field("cluster-compact-messages",
+            server.cluster_compact_messages);
     config_get_bool_field("no-appendfsync-on-rewrite",
             server.aof_no_fsync_on_rewrite);
     config_get_bool_field("slave-serve-stale-data",
@@ -1467,6 +1536,8 @@ void configGetCommand(client *c) {
             server.repl_slave_lazy_flush);
     config_get_bool_field("dynamic-hz",
             server.dynamic_hz);
+    config_get_bool_field("shortest-double-format",
+            server.shortest_double_format);
 
     /* Enum values */
     config_get_enum_field("maxmemory-policy",
@@ -1477,6 +1548,8 @@ void configGetCommand(client *c) {
             server.supervised_mode,supervised_mode_enum);
     config_get_enum_field("appendfsync",
             server.aof_fsync,aof_fsync_enum);
+    config_get_enum_field("list-compress-codec",
+            server.list_compress_codec,list_compress_codec_enum);
     config_get_enum_field("syslog-facility",
             server.syslog_facility,syslog_facility_enum);
 
@@ -2186,6 +2259,7 @@ int rewriteConfig(char *path) {
     rewriteConfigStringOption(state,"cluster-config-file",server.cluster_configfile,CONFIG_DEFAULT_CLUSTER_CONFIG_FILE);
     rewriteConfigYesNoOption(state,"cluster-require-full-coverage",server.cluster_require_full_coverage,CLUSTER_DEFAULT_REQUIRE_FULL_COVERAGE);
     rewriteConfigYesNoOption(state,"cluster-replica-no-failover",server.cluster_slave_no_failover,CLUSTER_DEFAULT_SLAVE_NO_FAILOVER);
+    rewriteConfigYesNoOption(state,"cluster-compact-messages",server.cluster_compact_messages,CLUSTER_DEFAULT_COMPACT_MESSAGES);
     rewriteConfigNumericalOption(state,"cluster-node-timeout",server.cluster_node_timeout,CLUSTER_DEFAULT_NODE_TIMEOUT);
     rewriteConfigNumericalOption(state,"cluster-migration-barrier",server.cluster_migration_barrier,CLUSTER_DEFAULT_MIGRATION_BARRIER);
     rewriteConfigNumericalOption(state,"cluster-replica-validity-factor",server.cluster_slave_validity_factor,CLUSTER_DEFAULT_SLAVE_VALIDITY);
@@ -2197,12 +2271,16 @@ int rewriteConfig(char *path) {
     rewriteConfigNumericalOption(state,"hash-max-ziplist-value",server.hash_max_ziplist_value,OBJ_HASH_MAX_ZIPLIST_VALUE);
     rewriteConfigNumericalOption(state,"stream-node-max-bytes",server.stream_node_max_bytes,OBJ_STREAM_NODE_MAX_BYTES);
     rewriteConfigNumericalOption(state,"stream-node-max-entries",server.stream_node_max_entries,OBJ_STREAM_NODE_MAX_ENTRIES);
+    rewriteConfigNumericalOption(state,"stream-node-compact-percent",server.stream_node_compact_percent,OBJ_STREAM_NODE_COMPACT_PERCENT);
     rewriteConfigNumericalOption(state,"list-max-ziplist-size",server.list_max_ziplist_size,OBJ_LIST_MAX_ZIPLIST_SIZE);
     rewriteConfigNumericalOption(state,"list-compress-depth",server.list_compress_depth,OBJ_LIST_COMPRESS_DEPTH);
+    rewriteConfigEnumOption(state,"list-compress-codec",server.list_compress_codec,list_compress_codec_enum,OBJ_LIST_COMPRESS_CODEC);
     rewriteConfigNumericalOption(state,"set-max-intset-entries",server.set_max_intset_entries,OBJ_SET_MAX_INTSET_ENTRIES);
     rewriteConfigNumericalOption(state,"zset-max-ziplist-entries",server.zset_max_ziplist_entries,OBJ_ZSET_MAX_ZIPLIST_ENTRIES);
     rewriteConfigNumericalOption(state,"zset-max-ziplist-value",server.zset_max_ziplist_value,OBJ_ZSET_MAX_ZIPLIST_VALUE);
     rewriteConfigNumericalOption(state,"hll-sparse-max-bytes",server.hll_sparse_max_bytes,CONFIG_DEFAULT_HLL_SPARSE_MAX_BYTES);
+    rewriteConfigYesNoOption(state,"shortest-double-format",server.shortest_double_format,CONFIG_DEFAULT_SHORTEST_DOUBLE_FORMAT);
+    rewriteConfigNumericalOption(state,"bitmap-compress-min-bytes",server.bitmap_compress_min_bytes,CONFIG_DEFAULT_BITMAP_COMPRESS_MIN_BYTES);
     rewriteConfigYesNoOption(state,"activerehashing",server.activerehashing,CONFIG_DEFAULT_ACTIVE_REHASHING);
     rewriteConfigYesNoOption(state,"activedefrag",server.active_defrag_enabled,CONFIG_DEFAULT_ACTIVE_DEFRAG);
     rewriteConfigYesNoOption(state,"protected-mode",server.protected_mode,CONFIG_DEFAULT_PROTECTED_MODE);
@@ -2216,6 +2294,7 @@ int rewriteConfig(char *path) {
     rewriteConfigYesNoOption(state,"lazyfree-lazy-eviction",server.lazyfree_lazy_eviction,CONFIG_DEFAULT_LAZYFREE_LAZY_EVICTION);
     rewriteConfigYesNoOption(state,"lazyfree-lazy-expire",server.lazyfree_lazy_expire,CONFIG_DEFAULT_LAZYFREE_LAZY_EXPIRE);
     rewriteConfigYesNoOption(state,"lazyfree-lazy-server-del",server.lazyfree_lazy_server_del,CONFIG_DEFAULT_LAZYFREE_LAZY_SERVER_DEL);
+    rewriteConfigNumericalOption(state,"setops-offload-threshold",server.setops_offload_threshold,CONFIG_DEFAULT_SETOPS_OFFLOAD_THRESHOLD);
     rewriteConfigYesNoOption(state,"replica-lazy-flush",server.repl_slave_lazy_flush,CONFIG_DEFAULT_SLAVE_LAZY_FLUSH);
     rewriteConfigYesNoOption(state,"dynamic-hz",server.dynamic_hz,CONFIG_DEFAULT_DYNAMIC_HZ);
 
@@ -2264,6 +2343,7 @@ NULL
     } else if (!strcasecmp(c->argv[1]->ptr,"resetstat") && c->argc == 2) {
         resetServerStats();
         resetCommandTableStats();
+        if (server.cluster_enabled) clusterResetSlotStats();
         addReply(c,shared.ok);
     } else if (!strcasecmp(c->argv[1]->ptr,"rewrite") && c->argc == 2) {
         if (server.configfile == NULL) {
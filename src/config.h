@@ -226,4 +226,12 @@ void setproctitle(const char *fmt, ...);
 #define USE_ALIGNED_ACCESS
 #endif
 
+/* Compiler support for the x86-64 vector kernels. They are compiled with the
+ * target attribute and only called after checking at runtime that the CPU
+ * supports the instructions they use. */
+#if defined(__x86_64__) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 8))
+#define HAVE_X86_SIMD 1
+#endif
+
 #endif
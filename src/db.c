@@ -34,7 +34,7 @@ void updateLFU(robj *val) {
 /* 从redis字典中取出key对象所对应的值对象，如果存在返回值对象，否则返回NULL */
 robj *lookupKey(redisDb *db, robj *key, int flags) {
 	//在数据库中查找key对象，返回保存该key的节点结构指向
-    dictEntry *de = dictFind(db->dict,key->ptr);
+    dictEntry *de = dbFind(db,key->ptr);
 	//检测对应的键值对结构是否存在
     if (de) {
 		//获取对应的键所对应的值对象
@@ -144,16 +144,32 @@ robj *lookupKeyRead(redisDb *db, robj *key) {
     return lookupKeyReadWithFlags(db,key,LOOKUP_NONE);
 }
 
+/* Like lookupKeyWrite(), but the value is returned even if it is read by a
+ * set operation in background: only for commands that write other keys,
+ * like the sources of SUNIONSTORE, and never modify it. */
+/* 以写操作取出key对应的值对象 但不对被后台集合操作读取的值对象进行复制处理 */
+robj *lookupKeyWriteShared(redisDb *db, robj *key) {
+	//触发检测是否有必要进行过期键进行删除操作处理
+    expireIfNeeded(db,key);
+    return lookupKey(db,key,LOOKUP_NONE);
+}
+
 /* Lookup a key for write operations, and as a side effect, if needed, expires
  * the key if its TTL is reached.
  *
  * Returns the linked value object if the key exists or NULL if the key does not exist in the specified DB. */
 /* 以写操作取出key对应的值对象，不更新是否命中的信息 */
 robj *lookupKeyWrite(redisDb *db, robj *key) {
-	//触发检测是否有必要进行过期键进行删除操作处理
-    expireIfNeeded(db,key);
 	//进行查询键对象所对应的值对象
-    return lookupKey(db,key,LOOKUP_NONE);
+    robj *o = lookupKeyWriteShared(db,key);
+    /* A value read by a set operation in background can't be modified in
+     * place while the thread reads it: the jobs reading it are cancelled
+     * first, see setops.c. */
+	//检测对应的值对象是否正在被后台集合操作读取 如果是 取消对应的后台任务
+    if (o && (o->type == OBJ_SET || o->type == OBJ_ZSET) &&
+        setopsObjectIsPinned(o))
+        setopsCancelJobsReading(o);
+    return o;
 }
 
 /* 以读操作取出key的值对象，如果值对象不存在，则发送reply信息，并返回NULL */
@@ -186,17 +202,15 @@ void dbAdd(redisDb *db, robj *key, robj *val) {
 	//复制对应的键对象的字符串数据----->注意对于键对象已经进行了对应的深拷贝处理了
     sds copy = sdsdup(key->ptr);
 	//将对应的键值对对象放置于redis中-->此处是核心部分--->对于键对象是取自参数对象中的字符串,对于值对象是取自于参数部分的值对象
-    int retval = dictAdd(db->dict, copy, val);
+    int didx = dbDictIndex(db,copy);
+    int retval = dictAdd(db->dict[didx], copy, val);
 	//检测是否插入对应的键值对成功
     serverAssertWithInfo(NULL,key,retval == DICT_OK);
+    dbUpdateDictSize(db,didx,1);
 	//特殊检查当前插入的值对象是否是List类型或者Zset类型-------->这个地方可能引发去堵塞操作处理,即堵塞在特定键上的命令客户端
     if (val->type == OBJ_LIST || val->type == OBJ_ZSET)
 		//尝试触发解除堵塞键上的命令
 		signalKeyAsReady(db, key);
-	//检查是否开启了集群模式
-    if (server.cluster_enabled) 
-		//将对应的键添加到对应的槽位中
-		slotToKeyAdd(key);
 }
 
 /* Overwrite an existing key with a new value. Incrementing the reference count of the new value is up to the caller.
@@ -205,7 +219,8 @@ void dbAdd(redisDb *db, robj *key, robj *val) {
 /* 在redis中进行复写对应的键值对,该函数的调用者负责增加key-val的引用计数 */
 void dbOverwrite(redisDb *db, robj *key, robj *val) {
 	//获取键对象对应的键值对结构指向
-    dictEntry *de = dictFind(db->dict,key->ptr);
+    dict *d = dbDictForKey(db,key->ptr);
+    dictEntry *de = dictFind(d,key->ptr);
 	//检测对应的键值对结构是否存在
     serverAssertWithInfo(NULL,key,de != NULL);
 	//获取对应的键值对结构对象 主要是记录老的键值对 方面进行释放值对象的处理
@@ -218,17 +233,17 @@ void dbOverwrite(redisDb *db, robj *key, robj *val) {
         val->lru = old->lru;
     }
 	//设置新的值对象
-    dictSetVal(db->dict, de, val);
+    dictSetVal(d, de, val);
 
 	//检测服务器是否配置了延迟释放对应的对象
     if (server.lazyfree_lazy_server_del) {
 		//将对应的值对象添加到延迟释放的任务中
         freeObjAsync(old);
 		//同时清空老的键值对中值对象的引用关系 即后续不进行释放对应值对象的处理了
-        dictSetVal(db->dict, &auxentry, NULL);
+        dictSetVal(d, &auxentry, NULL);
     }
 	//触发释放值对象的处理
-    dictFreeVal(db->dict, &auxentry);
+    dictFreeVal(d, &auxentry);
 }
 
 /* High level Set operation. This function can be used in order to set
@@ -262,7 +277,7 @@ void setKey(redisDb *db, robj *key, robj *val) {
 /* 检测对应的键对象是否在redis数据库字典中 返回1表示存在 0表示不存在 */
 int dbExists(redisDb *db, robj *key) {
 	//在字典结构中查询对应的键对象
-    return dictFind(db->dict,key->ptr) != NULL;
+    return dbFind(db,key->ptr) != NULL;
 }
 
 /* Return a random key, in form of a Redis object. If there are no keys, NULL is returned.
@@ -273,7 +288,7 @@ robj *dbRandomKey(redisDb *db) {
 	//初始化尝试的最大次数
     int maxtries = 100;
 	//获取所有键对象是否都过期的标记
-    int allvolatile = dictSize(db->dict) == dictSize(db->expires);
+    int allvolatile = dbSize(db) == dictSize(db->expires);
 
 	//循环处理,获取可以使用的随机键对象
     while(1) {
@@ -281,7 +296,7 @@ robj *dbRandomKey(redisDb *db) {
         robj *keyobj;
 	
 		//获取一个随机键对应实体
-        de = dictGetRandomKey(db->dict);
+        de = dbRandomEntry(db);
 		//检测是否有对应的实体对象
         if (de == NULL) 
 			return NULL;
@@ -326,11 +341,10 @@ int dbSyncDelete(redisDb *db, robj *key) {
 		//首先在对应的过期键值对中删除对应的本键值对
 		dictDelete(db->expires,key->ptr);
 	//检测在redis数据库字典中删除对应的键值对是否成功
-    if (dictDelete(db->dict,key->ptr) == DICT_OK) {
-		//检测是否开启了集群模式
-        if (server.cluster_enabled) 
-			//在对应的槽位中删除对应的键
-			slotToKeyDel(key);
+    int didx = dbDictIndex(db,key->ptr);
+    if (dictDelete(db->dict[didx],key->ptr) == DICT_OK) {
+		//更新对应槽位的键数量
+        dbUpdateDictSize(db,didx,-1);
 		//返回删除对应键值对成功标识
         return 1;
     } else {
@@ -404,6 +418,10 @@ robj *dbUnshareStringValue(redisDb *db, robj *key, robj *o) {
 long long emptyDb(int dbnum, int flags, void(callback)(void*)) {
 	//配置是否异步删除操作标识
     int async = (flags & EMPTYDB_ASYNC);
+    /* The lazyfree thread would release the references that the set
+     * operations in background hold on their source objects concurrently
+     * with the main thread: flush synchronously in this case. */
+    if (async && setopsPendingJobs()) async = 0;
     long long removed = 0;
 
 	//检测当前给定的库索引是否合法
@@ -427,25 +445,21 @@ long long emptyDb(int dbnum, int flags, void(callback)(void*)) {
 	//循环删除对应索引库的数据处理
     for (int j = startdb; j <= enddb; j++) {
 		//获取当前索引库对应的元素个数
-        removed += dictSize(server.db[j].dict);
+        removed += dbSize(&server.db[j]);
 		//检测是否是异步删除操作处理
         if (async) {
 			//启动异步删除操作处理
             emptyDbAsync(&server.db[j]);
         } else {
         	//清空所有的键值对
-            dictEmpty(server.db[j].dict,callback);
+            for (int i = 0; i < server.db[j].dict_count; i++)
+                dictEmpty(server.db[j].dict[i],callback);
+            if (server.db[j].slot_sizes)
+                memset(server.db[j].slot_sizes,0,
+                    sizeof(unsigned long long)*(server.db[j].dict_count+1));
 			//清空所有的过期的键值对
             dictEmpty(server.db[j].expires,callback);
         }
-    }
-	//检测是否是开启了集群模式------>此处是进行集群模式的处理
-    if (server.cluster_enabled) {
-        if (async) {
-            slotToKeyFlushAsync();
-        } else {
-            slotToKeyFlush();
-        }
     }
     if (dbnum == -1) 
 		flushSlaveKeysWithExpireList();
@@ -705,16 +719,16 @@ void randomkeyCommand(client *c) {
 }
 
 void keysCommand(client *c) {
-    dictIterator *di;
+    dbIterator *di;
     dictEntry *de;
     sds pattern = c->argv[1]->ptr;
     int plen = sdslen(pattern), allkeys;
     unsigned long numkeys = 0;
     void *replylen = addDeferredMultiBulkLength(c);
 
-    di = dictGetSafeIterator(c->db->dict);
+    di = dbGetSafeIterator(c->db);
     allkeys = (pattern[0] == '*' && pattern[1] == '\0');
-    while((de = dictNext(di)) != NULL) {
+    while((de = dbNext(di)) != NULL) {
         sds key = dictGetKey(de);
         robj *keyobj;
 
@@ -727,7 +741,7 @@ void keysCommand(client *c) {
             decrRefCount(keyobj);
         }
     }
-    dictReleaseIterator(di);
+    dbReleaseIterator(di);
     setDeferredMultiBulkLength(c,replylen,numkeys);
 }
 
@@ -752,7 +766,7 @@ void scanCallback(void *privdata, const dictEntry *de) {
     } else if (o->type == OBJ_ZSET) {
         sds sdskey = dictGetKey(de);
         key = createStringObject(sdskey,sdslen(sdskey));
-        val = createStringObjectFromLongDouble(*(double*)dictGetVal(de),0);
+        val = createStringObjectFromLongDouble(dictGetDoubleVal(de),0);
     } else {
         serverPanic("Type not handled in SCAN callback.");
     }
@@ -834,28 +848,29 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
 
     /* Step 2: Iterate the collection.
      *
-     * Note that if the object is encoded with a ziplist, intset, or any other
+     * Note that if the object is encoded with a listpack, intset, or any other
      * representation that is not a hash table, we are sure that it is also
      * composed of a small number of elements. So to avoid taking state we
      * just return everything inside the object in a single call, setting the
      * cursor to zero to signal the end of the iteration. */
 
-    /* Handle the case of a hash table. */
+    /* Handle the case of a hash table. The keyspace may be composed of
+     * multiple dicts, so it is scanned via dbScan(). */
     ht = NULL;
     if (o == NULL) {
-        ht = c->db->dict;
+        /* Keyspace scan, see below. */
     } else if (o->type == OBJ_SET && o->encoding == OBJ_ENCODING_HT) {
         ht = o->ptr;
     } else if (o->type == OBJ_HASH && o->encoding == OBJ_ENCODING_HT) {
         ht = o->ptr;
         count *= 2; /* We return key / value for this type. */
-    } else if (o->type == OBJ_ZSET && o->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (o->type == OBJ_ZSET && o->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = o->ptr;
         ht = zs->dict;
         count *= 2; /* We return key / value for this type. */
     }
 
-    if (ht) {
+    if (o == NULL || ht) {
         void *privdata[2];
         /* We set the max number of iterations to ten times the specified
          * COUNT, so if the hash table is in a pathological state (very
@@ -869,7 +884,10 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
         privdata[0] = keys;
         privdata[1] = o;
         do {
-            cursor = dictScan(ht, cursor, scanCallback, NULL, privdata);
+            if (o == NULL)
+                cursor = dbScan(c->db, cursor, scanCallback, NULL, privdata);
+            else
+                cursor = dictScan(ht, cursor, scanCallback, NULL, privdata);
         } while (cursor && maxiterations-- && listLength(keys) < (unsigned long)count);
     } else if (o->type == OBJ_SET) {
         int pos = 0;
@@ -879,15 +897,15 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
             listAddNodeTail(keys,createStringObjectFromLongLong(ll));
         cursor = 0;
     } else if (o->type == OBJ_HASH || o->type == OBJ_ZSET) {
-        unsigned char *p = ziplistIndex(o->ptr,0);
+        unsigned char *p = lpFirst(o->ptr);
         unsigned char *vstr;
         unsigned int vlen;
         long long vll;
 
         while(p) {
-            ziplistGet(p,&vstr,&vlen,&vll);
+            lpGetValue(p,&vstr,&vlen,&vll);
             listAddNodeTail(keys, (vstr != NULL) ? createStringObject((char*)vstr,vlen) : createStringObjectFromLongLong(vll));
-            p = ziplistNext(o->ptr,p);
+            p = lpNext(o->ptr,p);
         }
         cursor = 0;
     } else {
@@ -974,7 +992,7 @@ void scanCommand(client *c) {
  */
 void dbsizeCommand(client *c) {
 	//向客户端返回当前库中键值对的数量
-    addReplyLongLong(c,dictSize(c->db->dict));
+    addReplyLongLong(c,dbSize(c->db));
 }
 
 /*
@@ -1300,11 +1318,15 @@ int dbSwapDatabases(int id1, int id2) {
     /* Swap hash tables. Note that we don't swap blocking_keys, ready_keys and watched_keys, since we want clients to remain in the same DB they were. */
     //将第二个索引的数据迁移到第一个索引上 注意这个地方只是迁移了 数据字典数据 和 过期字典数据
     db1->dict = db2->dict;
+    db1->dict_count = db2->dict_count;
+    db1->slot_sizes = db2->slot_sizes;
     db1->expires = db2->expires;
     db1->avg_ttl = db2->avg_ttl;
 
 	//将第一个索引的数据迁移到第二个索引上
     db2->dict = aux.dict;
+    db2->dict_count = aux.dict_count;
+    db2->slot_sizes = aux.slot_sizes;
     db2->expires = aux.expires;
     db2->avg_ttl = aux.avg_ttl;
 
@@ -1374,7 +1396,7 @@ void swapdbCommand(client *c) {
 int removeExpire(redisDb *db, robj *key) {
     /* An expire may only be removed if there is a corresponding entry in the main dict. Otherwise, the key will never be freed. */
 	//首先确认配置的键对象在redis的字典结构中
-	serverAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
+	serverAssertWithInfo(NULL,key,dbFind(db,key->ptr) != NULL);
 	//将带有过期时间的键在过期字典中进行删除处理
     return dictDelete(db->expires,key->ptr) == DICT_OK;
 }
@@ -1387,7 +1409,7 @@ void setExpire(client *c, redisDb *db, robj *key, long long when) {
 
     /* Reuse the sds from the main dict in the expire dict */
 	//在对应的键值对字典结构中获取对应键所对应的节点
-    kde = dictFind(db->dict,key->ptr);
+    kde = dbFind(db,key->ptr);
 	//检测对应的节点是否存在
     serverAssertWithInfo(NULL,key,kde != NULL);
 	//在对应的过期字典结构中找到或者添加对应的键所对应的结构  ---->即有可能以前设置过过期时间
@@ -1414,7 +1436,7 @@ long long getExpire(redisDb *db, robj *key) {
 
     /* The entry was found in the expire dict, this means it should also be present in the main dict (safety check). */
 	//进一步进行安全检测 即在对应的数据存储的内存数据库中也需要存在对应的键值对对象
-    serverAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
+    serverAssertWithInfo(NULL,key,dbFind(db,key->ptr) != NULL);
 	//获取设置的过期时间值--------->需要注意,在过期字典中存储的键值对的内容是 键对象 和 值对象(对应的过期时间)
     return dictGetSignedIntegerVal(de);
 }
@@ -1820,93 +1842,307 @@ int *xreadGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys)
     return keys;
 }
 
-/* Slot to Key API. This is used by Redis Cluster in order to obtain in
- * a fast way a key that belongs to a specified hash slot. This is useful
- * while rehashing the cluster and in other conditions when we need to
- * understand if we have keys for a given hash slot. */
-void slotToKeyUpdateKey(robj *key, int add) {
-    unsigned int hashslot = keyHashSlot(key->ptr,sdslen(key->ptr));
-    unsigned char buf[64];
-    unsigned char *indexed = buf;
-    size_t keylen = sdslen(key->ptr);
-
-    server.cluster->slots_keys_count[hashslot] += add ? 1 : -1;
-    if (keylen+2 > 64) indexed = zmalloc(keylen+2);
-    indexed[0] = (hashslot >> 8) & 0xff;
-    indexed[1] = hashslot & 0xff;
-    memcpy(indexed+2,key->ptr,keylen);
-    if (add) {
-        raxInsert(server.cluster->slots_to_keys,indexed,keylen+2,NULL,NULL);
-    } else {
-        raxRemove(server.cluster->slots_to_keys,indexed,keylen+2,NULL);
+/*-----------------------------------------------------------------------------
+ * Keyspace dicts API
+ *
+ * In cluster mode the keyspace of DB 0 is split into CLUSTER_SLOTS dicts,
+ * one for every hash slot. This way the keys of a given slot can be counted,
+ * enumerated and deleted without keeping a second index of all the keys
+ * (previously a radix tree of slot-prefixed key names), that was costing
+ * memory and an additional insertion/deletion on every write.
+ *
+ * In order to sample random keys with uniform probability across slots, and
+ * to quickly skip empty slots while iterating, the number of keys in every
+ * dict is tracked in a binary indexed tree (Fenwick tree): both the prefix
+ * sums and the "find the dict containing the Nth key" lookups are
+ * O(log(CLUSTER_SLOTS)).
+ *
+ * Outside cluster mode (and for the other DBs, that can't be selected in
+ * cluster mode anyway) there is just a single dict, and all the functions
+ * below reduce to the plain dict calls.
+ *----------------------------------------------------------------------------*/
+
+/* Bits of the SCAN cursor used to store the dict index in cluster mode. */
+#define DB_SCAN_DICT_BITS 14
+
+/* Create the keyspace dicts of 'db'. */
+void dbCreateDicts(redisDb *db, int count) {
+    serverAssert(count == 1 || count == (1<<DB_SCAN_DICT_BITS));
+    db->dict = zmalloc(sizeof(dict*)*count);
+    for (int j = 0; j < count; j++) db->dict[j] = dictCreate(&dbDictType,NULL);
+    db->dict_count = count;
+    db->slot_sizes = (count > 1) ?
+        zcalloc(sizeof(unsigned long long)*(count+1)) : NULL;
+}
+
+/* Release keyspace dicts created with dbCreateDicts(). This is also called
+ * from the lazyfree thread, so it must not touch any global state. */
+void dbReleaseDicts(dict **dicts, int count, unsigned long long *slot_sizes) {
+    for (int j = 0; j < count; j++) dictRelease(dicts[j]);
+    zfree(dicts);
+    zfree(slot_sizes);
+}
+
+/* Return the index of the dict that holds (or would hold) 'key'. */
+int dbDictIndex(redisDb *db, sds key) {
+    if (db->dict_count == 1) return 0;
+    return keyHashSlot(key,(int)sdslen(key));
+}
+
+dict *dbDictForKey(redisDb *db, sds key) {
+    return db->dict[dbDictIndex(db,key)];
+}
+
+dictEntry *dbFind(redisDb *db, sds key) {
+    return dictFind(db->dict[dbDictIndex(db,key)],key);
+}
+
+/* Must be called every time 'delta' keys are added to (or removed from, if
+ * negative) the dict at index 'didx'. */
+void dbUpdateDictSize(redisDb *db, int didx, long long delta) {
+    if (db->slot_sizes == NULL) return;
+    for (int i = didx+1; i <= db->dict_count; i += i & -i)
+        db->slot_sizes[i] += delta;
+}
+
+/* Return the number of keys stored in the dicts from 0 to 'didx'
+ * (inclusive). */
+static unsigned long long dbCumulativeSize(redisDb *db, int didx) {
+    unsigned long long sum = 0;
+    for (int i = didx+1; i > 0; i -= i & -i) sum += db->slot_sizes[i];
+    return sum;
+}
+
+/* Return the index of the dict holding the key of rank 'target', where
+ * keys are ranked from 1 following the order of the dicts. The caller
+ * must make sure 'target' is between 1 and dbSize(). */
+static int dbFindDictIndexByRank(redisDb *db, unsigned long long target) {
+    int pos = 0, step = db->dict_count;
+
+    for (; step > 0; step >>= 1) {
+        if (pos+step <= db->dict_count && db->slot_sizes[pos+step] < target) {
+            pos += step;
+            target -= db->slot_sizes[pos];
+        }
     }
-    if (indexed != buf) zfree(indexed);
+    return pos;
+}
+
+/* Return the index of the first non empty dict after 'didx' (that may be
+ * -1 to start from the first dict), or -1 if there are no more keys. */
+static int dbNextNonEmptyDict(redisDb *db, int didx) {
+    if (db->dict_count == 1)
+        return (didx < 0 && dictSize(db->dict[0])) ? 0 : -1;
+
+    unsigned long long before = (didx < 0) ? 0 : dbCumulativeSize(db,didx);
+    if (before == dbSize(db)) return -1;
+    return dbFindDictIndexByRank(db,before+1);
+}
+
+/* Return the index of a random dict, chosen with a probability that is
+ * proportional to the number of keys it contains. */
+static int dbRandomDictIndex(redisDb *db) {
+    if (db->dict_count == 1) return 0;
+
+    unsigned long long size = dbSize(db);
+    if (size == 0) return 0;
+    unsigned long long r = ((unsigned long long)random() << 31) ^ random();
+    return dbFindDictIndexByRank(db,(r % size)+1);
 }
 
-void slotToKeyAdd(robj *key) {
-    slotToKeyUpdateKey(key,1);
+/* Return the number of keys in the DB. */
+unsigned long long dbSize(redisDb *db) {
+    if (db->dict_count == 1) return dictSize(db->dict[0]);
+    return dbCumulativeSize(db,db->dict_count-1);
 }
 
-void slotToKeyDel(robj *key) {
-    slotToKeyUpdateKey(key,0);
+/* Return the number of hash table buckets allocated for the keyspace. */
+unsigned long long dbBuckets(redisDb *db) {
+    unsigned long long buckets = 0;
+    for (int j = 0; j < db->dict_count; j++)
+        buckets += dictSlots(db->dict[j]);
+    return buckets;
 }
 
-void slotToKeyFlush(void) {
-    raxFree(server.cluster->slots_to_keys);
-    server.cluster->slots_to_keys = raxNew();
-    memset(server.cluster->slots_keys_count,0,sizeof(server.cluster->slots_keys_count));
+/* Expand the keyspace so that it can hold 'size' keys without rehashing.
+ * When the keyspace is split by slot we don't know how the keys are going
+ * to be distributed, so the dicts are left to grow on their own. */
+void dbExpand(redisDb *db, unsigned long size) {
+    if (db->dict_count == 1) dictExpand(db->dict[0],size);
 }
 
+/* Return a random entry of the keyspace, or NULL if the DB is empty. */
+dictEntry *dbRandomEntry(redisDb *db) {
+    return dictGetRandomKey(db->dict[dbRandomDictIndex(db)]);
+}
+
+/* Like dictGetSomeKeys() but sampling the whole keyspace. When there are
+ * multiple dicts, every batch is taken from a dict picked at random with
+ * a probability proportional to its size, so that eviction does not favor
+ * the keys of the less populated slots. */
+unsigned int dbGetSomeKeys(redisDb *db, dictEntry **des, unsigned int count) {
+    unsigned int stored = 0, tries = 0;
+
+    if (db->dict_count == 1) return dictGetSomeKeys(db->dict[0],des,count);
+    if (dbSize(db) == 0) return 0;
+    while (stored < count && tries++ < count) {
+        dict *d = db->dict[dbRandomDictIndex(db)];
+        stored += dictGetSomeKeys(d,des+stored,count-stored);
+    }
+    return stored;
+}
+
+/* Like dictScan() but for the whole keyspace. When the keyspace is split
+ * by slot, the lower DB_SCAN_DICT_BITS of the cursor are the index of the
+ * dict being scanned, and the higher bits are the cursor inside such dict.
+ * This retains the dictScan() guarantees since slots are scanned in order
+ * and keys never move from one slot to another. */
+unsigned long dbScan(redisDb *db, unsigned long cursor, dictScanFunction *fn, dictScanBucketFunction *bucketfn, void *privdata) {
+    if (db->dict_count == 1)
+        return dictScan(db->dict[0],cursor,fn,bucketfn,privdata);
+
+    int didx = cursor & ((1<<DB_SCAN_DICT_BITS)-1);
+    cursor >>= DB_SCAN_DICT_BITS;
+    cursor = dictScan(db->dict[didx],cursor,fn,bucketfn,privdata);
+    if (cursor == 0) {
+        /* This dict is done, move to the next non empty one. */
+        didx = dbNextNonEmptyDict(db,didx);
+        if (didx == -1) return 0;
+    }
+    return (cursor << DB_SCAN_DICT_BITS) | didx;
+}
+
+static dbIterator *dbCreateIterator(redisDb *db, int safe) {
+    dbIterator *it = zmalloc(sizeof(*it));
+    it->db = db;
+    it->didx = -1;
+    it->safe = safe;
+    it->di = NULL;
+    return it;
+}
+
+dbIterator *dbGetIterator(redisDb *db) {
+    return dbCreateIterator(db,0);
+}
+
+/* Like dictGetSafeIterator(): keys can be deleted while iterating. */
+dbIterator *dbGetSafeIterator(redisDb *db) {
+    return dbCreateIterator(db,1);
+}
+
+/* Return the next entry of the keyspace, or NULL when the iteration is
+ * over. Empty dicts are skipped without being visited. */
+dictEntry *dbNext(dbIterator *it) {
+    while(1) {
+        if (it->di == NULL) {
+            if (it->didx >= it->db->dict_count) return NULL;
+            it->didx = dbNextNonEmptyDict(it->db,it->didx);
+            if (it->didx == -1) {
+                it->didx = it->db->dict_count;
+                return NULL;
+            }
+            dict *d = it->db->dict[it->didx];
+            it->di = it->safe ? dictGetSafeIterator(d) : dictGetIterator(d);
+        }
+        dictEntry *de = dictNext(it->di);
+        if (de) return de;
+        dictReleaseIterator(it->di);
+        it->di = NULL;
+    }
+}
+
+void dbReleaseIterator(dbIterator *it) {
+    if (it->di) dictReleaseIterator(it->di);
+    zfree(it);
+}
+
+/* Called by serverCron(): shrink the keyspace dicts that are mostly
+ * empty. */
+void dbTryResizeDicts(redisDb *db) {
+    for (int j = 0; j < db->dict_count; j++) {
+        if (htNeedsResize(db->dict[j])) dictResize(db->dict[j]);
+    }
+}
+
+/* Called by serverCron(): use about a millisecond to incrementally rehash
+ * the keyspace dicts. Returns 1 if some rehashing was performed. */
+int dbIncrementallyRehash(redisDb *db) {
+    long long start = mstime();
+    int rehashed = 0;
+
+    for (int j = 0; j < db->dict_count; j++) {
+        if (!dictIsRehashing(db->dict[j])) continue;
+        dictRehashMilliseconds(db->dict[j],1);
+        rehashed = 1;
+        if (mstime()-start >= 1) break;
+    }
+    return rehashed;
+}
+
+/* Slot to Key API. This is used by Redis Cluster in order to obtain in
+ * a fast way a key that belongs to a specified hash slot. This is useful
+ * while rehashing the cluster and in other conditions when we need to
+ * understand if we have keys for a given hash slot. Since the keyspace of
+ * DB 0 is split by slot, this is just a matter of accessing the right
+ * dict. */
+
 /* Pupulate the specified array of objects with keys in the specified slot.
  * New objects are returned to represent keys, it's up to the caller to
  * decrement the reference count to release the keys names. */
 unsigned int getKeysInSlot(unsigned int hashslot, robj **keys, unsigned int count) {
-    raxIterator iter;
+    dictIterator *di = dictGetIterator(server.db[0].dict[hashslot]);
+    dictEntry *de;
     int j = 0;
-    unsigned char indexed[2];
-
-    indexed[0] = (hashslot >> 8) & 0xff;
-    indexed[1] = hashslot & 0xff;
-    raxStart(&iter,server.cluster->slots_to_keys);
-    raxSeek(&iter,">=",indexed,2);
-    while(count-- && raxNext(&iter)) {
-        if (iter.key[0] != indexed[0] || iter.key[1] != indexed[1]) break;
-        keys[j++] = createStringObject((char*)iter.key+2,iter.key_len-2);
+
+    while(count-- && (de = dictNext(di)) != NULL) {
+        sds key = dictGetKey(de);
+        keys[j++] = createStringObject(key,sdslen(key));
     }
-    raxStop(&iter);
+    dictReleaseIterator(di);
     return j;
 }
 
 /* Remove all the keys in the specified hash slot.
  * The number of removed items is returned. */
 unsigned int delKeysInSlot(unsigned int hashslot) {
-    raxIterator iter;
+    dictIterator *di = dictGetSafeIterator(server.db[0].dict[hashslot]);
+    dictEntry *de;
     int j = 0;
-    unsigned char indexed[2];
 
-    indexed[0] = (hashslot >> 8) & 0xff;
-    indexed[1] = hashslot & 0xff;
-    raxStart(&iter,server.cluster->slots_to_keys);
-    while(server.cluster->slots_keys_count[hashslot]) {
-        raxSeek(&iter,">=",indexed,2);
-        raxNext(&iter);
-
-        robj *key = createStringObject((char*)iter.key+2,iter.key_len-2);
+    while((de = dictNext(di)) != NULL) {
+        sds sdskey = dictGetKey(de);
+        robj *key = createStringObject(sdskey,sdslen(sdskey));
         dbDelete(&server.db[0],key);
         decrRefCount(key);
         j++;
     }
-    raxStop(&iter);
+    dictReleaseIterator(di);
     return j;
 }
 
 unsigned int countKeysInSlot(unsigned int hashslot) {
-    return server.cluster->slots_keys_count[hashslot];
+    return dictSize(server.db[0].dict[hashslot]);
+}
+
+/* Estimate the memory used by the keys of the slot: the average size of
+ * up to 'samples' random keys is multiplied by the number of keys, the
+ * same way MEMORY USAGE estimates aggregated values. */
+unsigned long long estimateMemoryInSlot(unsigned int hashslot, int samples) {
+    dict *d = server.db[0].dict[hashslot];
+    unsigned long count = dictSize(d);
+    dictEntry *des[CLUSTER_SLOT_STATS_MEM_SAMPLES];
+    unsigned int sampled, j;
+    size_t usage = 0;
+
+    if (count == 0) return 0;
+    if (samples > CLUSTER_SLOT_STATS_MEM_SAMPLES)
+        samples = CLUSTER_SLOT_STATS_MEM_SAMPLES;
+    sampled = dictGetSomeKeys(d,des,samples);
+    if (sampled == 0) return 0;
+    for (j = 0; j < sampled; j++) {
+        usage += objectComputeSize(dictGetVal(des[j]),samples);
+        usage += sdsAllocSize(dictGetKey(des[j]));
+        usage += sizeof(dictEntry);
+    }
+    return (unsigned long long)((double)usage/sampled*count);
 }
-
-
-
-
-
-
-
@@ -129,7 +129,9 @@ robj *activeDefragStringOb(robj* ob, long *defragged) {
                 ret->ptr = (void*)((intptr_t)ret + ofs);
                 (*defragged)++;
             }
-        } else if (ob->encoding!=OBJ_ENCODING_INT) {
+        } else if (ob->encoding!=OBJ_ENCODING_INT &&
+                   ob->encoding!=OBJ_ENCODING_ROARING) {
+            /* The containers of compressed bitmaps are not moved. */
             serverPanic("Unknown string encoding");
         }
     }
@@ -186,82 +188,57 @@ long dictDefragTables(dict* d) {
     return defragged;
 }
 
-/* Internal function used by zslDefrag */
-void zslUpdateNode(zskiplist *zsl, zskiplistNode *oldnode, zskiplistNode *newnode, zskiplistNode **update) {
-    int i;
-    for (i = 0; i < zsl->level; i++) {
-        if (update[i]->level[i].forward == oldnode)
-            update[i]->level[i].forward = newnode;
-    }
-    serverAssert(zsl->header!=oldnode);
-    if (newnode->level[0].forward) {
-        serverAssert(newnode->level[0].forward->backward==oldnode);
-        newnode->level[0].forward->backward = newnode;
-    } else {
-        serverAssert(zsl->tail==oldnode);
-        zsl->tail = newnode;
-    }
-}
-
 /* Defrag helper for sorted set.
- * Update the robj pointer, defrag the skiplist struct and return the new score
- * reference. We may not access oldele pointer (not even the pointer stored in
- * the skiplist), as it was already freed. Newele may be null, in which case we
- * only need to defrag the skiplist, but not update the obj pointer.
- * When return value is non-NULL, it is the score reference that must be updated
- * in the dict record. */
-double *zslDefrag(zskiplist *zsl, double score, sds oldele, sds newele) {
-    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x, *newx;
-    int i;
-    sds ele = newele? newele: oldele;
-
-    /* find the skiplist node referring to the object that was moved,
-     * and all pointers that need to be updated if we'll end up moving the skiplist node. */
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward &&
-            x->level[i].forward->ele != oldele && /* make sure not to access the
-                                                     ->obj pointer if it matches
-                                                     oldele */
-            (x->level[i].forward->score < score ||
-                (x->level[i].forward->score == score &&
-                sdscmp(x->level[i].forward->ele,ele) < 0)))
-            x = x->level[i].forward;
-        update[i] = x;
-    }
-
-    /* update the robj pointer inside the skip list record. */
-    x = x->level[0].forward;
-    serverAssert(x && score == x->score && x->ele==oldele);
-    if (newele)
-        x->ele = newele;
-
-    /* try to defrag the skiplist record itself */
-    newx = activeDefragAlloc(x);
-    if (newx) {
-        zslUpdateNode(zsl, x, newx, update);
-        return &newx->score;
-    }
-    return NULL;
-}
-
-/* Defrag helpler for sorted set.
- * Defrag a single dict entry key name, and corresponding skiplist struct */
+ * Defrag a single dict entry key name, and update the B+tree entry sharing
+ * the same SDS string. The entry is looked up before the string is moved,
+ * since the B+tree compares the elements to find it. */
 long activeDefragZsetEntry(zset *zs, dictEntry *de) {
     sds newsds;
-    double* newscore;
     long defragged = 0;
     sds sdsele = dictGetKey(de);
-    if ((newsds = activeDefragSds(sdsele)))
-        defragged++, de->key = newsds;
-    newscore = zslDefrag(zs->zsl, *(double*)dictGetVal(de), sdsele, newsds);
-    if (newscore) {
-        dictSetVal(zs->dict, de, newscore);
+    zbtEntry *e = zbtFind(zs->zbt, dictGetDoubleVal(de), sdsele);
+    serverAssert(e && e->ele == sdsele);
+    if ((newsds = activeDefragSds(sdsele))) {
         defragged++;
+        de->key = newsds;
+        e->ele = newsds;
     }
     return defragged;
 }
 
+/* Defrag helper for sorted set.
+ * Defrag the B+tree node 'node' of the given height, its children and the
+ * lower bounds stored in it. Returns the new pointer of the node, or NULL if
+ * it was not moved, in which case the caller keeps the old one. */
+void *activeDefragZbtNode(zbtree *zbt, void *node, int height, long *defragged) {
+    void *newnode;
+    sds newsds;
+    unsigned int j;
+
+    if (height > 1) {
+        zbtInner *inner = node;
+        for (j = 0; j < inner->count; j++) {
+            void *child = activeDefragZbtNode(zbt, inner->children[j], height-1, defragged);
+            if (child) inner->children[j] = child;
+            /* The lower bound of the first child is not stored. */
+            if (j > 0 && (newsds = activeDefragSds(inner->keys[j].ele)))
+                (*defragged)++, inner->keys[j].ele = newsds;
+        }
+        if ((newnode = activeDefragAlloc(inner)))
+            (*defragged)++;
+        return newnode;
+    }
+
+    /* Leaves are also referenced by their siblings and by the tree. */
+    if ((newnode = activeDefragAlloc(node))) {
+        zbtLeaf *leaf = newnode;
+        (*defragged)++;
+        if (leaf->prev) leaf->prev->next = leaf; else zbt->head = leaf;
+        if (leaf->next) leaf->next->prev = leaf; else zbt->tail = leaf;
+    }
+    return newnode;
+}
+
 #define DEFRAG_SDS_DICT_NO_VAL 0
 #define DEFRAG_SDS_DICT_VAL_IS_SDS 1
 #define DEFRAG_SDS_DICT_VAL_IS_STROB 2
@@ -412,6 +389,9 @@ long activeDefragQuickListNodes(quicklist *ql) {
     quicklistNode *node = ql->head, *newnode;
     long defragged = 0;
     unsigned char *newzl;
+    /* The nodes index and cache reference the nodes we are going to move. */
+    quicklistIndexReset(ql);
+    quicklistNodeCacheReset(ql);
     while (node) {
         if ((newnode = activeDefragAlloc(node))) {
             if (newnode->prev)
@@ -461,7 +441,7 @@ void scanLaterZsetCallback(void *privdata, const dictEntry *_de) {
 }
 
 long scanLaterZset(robj *ob, unsigned long *cursor) {
-    if (ob->type != OBJ_ZSET || ob->encoding != OBJ_ENCODING_SKIPLIST)
+    if (ob->type != OBJ_ZSET || ob->encoding != OBJ_ENCODING_BTREE)
         return 0;
     zset *zs = (zset*)ob->ptr;
     dict *d = zs->dict;
@@ -514,6 +494,8 @@ long defragQuicklist(redisDb *db, dictEntry *kde) {
     long defragged = 0;
     quicklist *ql = ob->ptr, *newql;
     serverAssert(ob->type == OBJ_LIST && ob->encoding == OBJ_ENCODING_QUICKLIST);
+    /* The decompressed nodes cache references the quicklist as well. */
+    quicklistNodeCacheReset(ql);
     if ((newql = activeDefragAlloc(ql)))
         defragged++, ob->ptr = ql = newql;
     if (ql->len > server.active_defrag_max_scan_fields)
@@ -523,23 +505,23 @@ long defragQuicklist(redisDb *db, dictEntry *kde) {
     return defragged;
 }
 
-long defragZsetSkiplist(redisDb *db, dictEntry *kde) {
+long defragZsetBtree(redisDb *db, dictEntry *kde) {
     robj *ob = dictGetVal(kde);
     long defragged = 0;
     zset *zs = (zset*)ob->ptr;
     zset *newzs;
-    zskiplist *newzsl;
+    zbtree *newzbt;
     dict *newdict;
     dictEntry *de;
-    struct zskiplistNode *newheader;
-    serverAssert(ob->type == OBJ_ZSET && ob->encoding == OBJ_ENCODING_SKIPLIST);
+    void *newroot;
+    serverAssert(ob->type == OBJ_ZSET && ob->encoding == OBJ_ENCODING_BTREE);
     if ((newzs = activeDefragAlloc(zs)))
         defragged++, ob->ptr = zs = newzs;
-    if ((newzsl = activeDefragAlloc(zs->zsl)))
-        defragged++, zs->zsl = newzsl;
-    if ((newheader = activeDefragAlloc(zs->zsl->header)))
-        defragged++, zs->zsl->header = newheader;
+    if ((newzbt = activeDefragAlloc(zs->zbt)))
+        defragged++, zs->zbt = newzbt;
     if (dictSize(zs->dict) > server.active_defrag_max_scan_fields)
+        /* Only the elements are defragged later: the B+tree nodes can't
+         * be moved by an incremental scan of the hash table. */
         defragLater(db, kde);
     else {
         dictIterator *di = dictGetIterator(zs->dict);
@@ -547,6 +529,8 @@ long defragZsetSkiplist(redisDb *db, dictEntry *kde) {
             defragged += activeDefragZsetEntry(zs, de);
         }
         dictReleaseIterator(di);
+        newroot = activeDefragZbtNode(zs->zbt, zs->zbt->root, zs->zbt->height, &defragged);
+        if (newroot) zs->zbt->root = newroot;
     }
     /* handle the dict struct */
     if ((newdict = activeDefragAlloc(zs->dict)))
@@ -685,25 +669,21 @@ long defragRadixTree(rax **raxref, int defrag_data, raxDefragFunction *element_c
     return defragged;
 }
 
-typedef struct {
-    streamCG *cg;
-    streamConsumer *c;
-} PendingEntryContext;
-
-void* defragStreamConsumerPendingEntry(raxIterator *ri, void *privdata, long *defragged) {
-    UNUSED(defragged);
-    PendingEntryContext *ctx = privdata;
-    streamNACK *nack = ri->data, *newnack;
-    nack->consumer = ctx->c; /* update nack pointer to consumer */
-    newnack = activeDefragAlloc(nack);
-    if (newnack) {
-        /* update consumer group pointer to the nack */
-        void *prev;
-        raxInsert(ctx->cg->pel, ri->key, ri->key_len, newnack, &prev);
-        serverAssert(prev==nack);
-        /* note: we don't increment 'defragged' that's done by the caller */
+/* Update the consumer pointer of the pending entries of the consumer 'c',
+ * that was moved from the address 'oldc'. */
+void defragStreamConsumerPendingEntries(streamCG *cg, streamConsumer *oldc, streamConsumer *c) {
+    raxIterator ri;
+    raxStart(&ri,c->pel);
+    raxSeek(&ri,"^",NULL,0);
+    while(raxNext(&ri)) {
+        streamPELBlock *b = raxFind(cg->pel,ri.key,ri.key_len);
+        serverAssert(b != raxNotFound);
+        for (uint32_t j = 0; j < b->numruns; j++) {
+            if (b->runs[j].nack.consumer == oldc)
+                b->runs[j].nack.consumer = c;
+        }
     }
-    return newnack;
+    raxStop(&ri);
 }
 
 void* defragStreamConsumer(raxIterator *ri, void *privdata, long *defragged) {
@@ -712,25 +692,38 @@ void* defragStreamConsumer(raxIterator *ri, void *privdata, long *defragged) {
     void *newc = activeDefragAlloc(c);
     if (newc) {
         /* note: we don't increment 'defragged' that's done by the caller */
+        defragStreamConsumerPendingEntries(cg,c,newc);
         c = newc;
     }
     sds newsds = activeDefragSds(c->name);
     if (newsds)
         (*defragged)++, c->name = newsds;
-    if (c->pel) {
-        PendingEntryContext pel_ctx = {cg, c};
-        *defragged += defragRadixTree(&c->pel, 0, defragStreamConsumerPendingEntry, &pel_ctx);
-    }
+    if (c->pel)
+        *defragged += defragRadixTree(&c->pel, 0, NULL, NULL);
     return newc; /* returns NULL if c was not defragged */
 }
 
+void* defragStreamPELBlock(raxIterator *ri, void *privdata, long *defragged) {
+    UNUSED(privdata);
+    streamPELBlock *b = ri->data, *newb;
+    void *newptr;
+    if ((newptr = activeDefragAlloc(b->ids)))
+        (*defragged)++, b->ids = newptr;
+    if ((newptr = activeDefragAlloc(b->runs)))
+        (*defragged)++, b->runs = newptr;
+    newb = activeDefragAlloc(b);
+    /* note: we don't increment 'defragged' for the block itself, that's
+     * done by the caller */
+    return newb;
+}
+
 void* defragStreamConsumerGroup(raxIterator *ri, void *privdata, long *defragged) {
     streamCG *cg = ri->data;
     UNUSED(privdata);
     if (cg->consumers)
         *defragged += defragRadixTree(&cg->consumers, 0, defragStreamConsumer, cg);
     if (cg->pel)
-        *defragged += defragRadixTree(&cg->pel, 0, NULL, NULL);
+        *defragged += defragRadixTree(&cg->pel, 0, defragStreamPELBlock, NULL);
     return NULL;
 }
 
@@ -775,7 +768,7 @@ long defragKey(redisDb *db, dictEntry *de) {
          /* Dirty code:
           * I can't search in db->expires for that key after i already released
           * the pointer it holds it won't be able to do the string compare */
-        uint64_t hash = dictGetHash(db->dict, de->key);
+        uint64_t hash = dictGetHash(db->expires, de->key);
         replaceSateliteDictKeyPtrAndOrDefragDictEntry(db->expires, keysds, newsds, hash, &defragged);
     }
 
@@ -786,6 +779,9 @@ long defragKey(redisDb *db, dictEntry *de) {
         ob = newob;
     }
 
+    /* Values read by a set operation in background can't be moved. */
+    if (setopsObjectIsPinned(ob)) return defragged;
+
     if (ob->type == OBJ_STRING) {
         /* Already handled in activeDefragStringOb. */
     } else if (ob->type == OBJ_LIST) {
@@ -808,16 +804,16 @@ long defragKey(redisDb *db, dictEntry *de) {
             serverPanic("Unknown set encoding");
         }
     } else if (ob->type == OBJ_ZSET) {
-        if (ob->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (ob->encoding == OBJ_ENCODING_LISTPACK) {
             if ((newzl = activeDefragAlloc(ob->ptr)))
                 defragged++, ob->ptr = newzl;
-        } else if (ob->encoding == OBJ_ENCODING_SKIPLIST) {
-            defragged += defragZsetSkiplist(db, de);
+        } else if (ob->encoding == OBJ_ENCODING_BTREE) {
+            defragged += defragZsetBtree(db, de);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
     } else if (ob->type == OBJ_HASH) {
-        if (ob->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (ob->encoding == OBJ_ENCODING_LISTPACK) {
             if ((newzl = activeDefragAlloc(ob->ptr)))
                 defragged++, ob->ptr = newzl;
         } else if (ob->encoding == OBJ_ENCODING_HT) {
@@ -899,7 +895,9 @@ long defragOtherGlobals() {
 int defragLaterItem(dictEntry *de, unsigned long *cursor, long long endtime) {
     if (de) {
         robj *ob = dictGetVal(de);
-        if (ob->type == OBJ_LIST) {
+        if (setopsObjectIsPinned(ob)) {
+            *cursor = 0; /* read by a set operation in background */
+        } else if (ob->type == OBJ_LIST) {
             server.stat_active_defrag_hits += scanLaterList(ob);
             *cursor = 0; /* list has no scan, we must finish it in one go */
         } else if (ob->type == OBJ_SET) {
@@ -953,7 +951,7 @@ int defragLaterStep(redisDb *db, long long endtime) {
         }
 
         /* each time we enter this function we need to fetch the key from the dict again (if it still exists) */
-        dictEntry *de = dictFind(db->dict, current_key);
+        dictEntry *de = dbFind(db, current_key);
         key_defragged = server.stat_active_defrag_hits;
         do {
             int quit = 0;
@@ -1106,7 +1104,7 @@ void activeDefragCycle(void) {
                 break; /* this will exit the function and we'll continue on the next cycle */
             }
 
-            cursor = dictScan(db->dict, cursor, defragScanCallback, defragDictBucketCallback, db);
+            cursor = dbScan(db, cursor, defragScanCallback, defragDictBucketCallback, db);
 
             /* Once in 16 scan iterations, 512 pointer reallocations. or 64 keys
              * (if we have a lot of pointers in one hash bucket or rehasing),
@@ -160,6 +160,10 @@ typedef void (dictScanBucketFunction)(void *privdata, dictEntry **bucketref);
 #define dictSize(d) ((d)->ht[0].used+(d)->ht[1].used)
 //获取当前字典结构是否处于重hash中
 #define dictIsRehashing(d) ((d)->rehashidx != -1)
+//暂停对应字典结构的渐进式重hash操作处理(与安全迭代器的处理方式相同)
+#define dictPauseRehashing(d) ((d)->iterators++)
+//恢复对应字典结构的渐进式重hash操作处理
+#define dictResumeRehashing(d) ((d)->iterators--)
 
 /* API */
 /* 字典结构中提供的相关API函数 */
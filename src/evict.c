@@ -155,13 +155,19 @@ void evictionPoolAlloc(void) {
  *
  * We insert keys on place in ascending order, so keys with the smaller
  * idle time are on the left, and keys with the higher idle time on the
- * right. */
+ * right.
+ *
+ * When 'sampledict' is NULL the keys are sampled from the keyspace of 'db',
+ * otherwise from the specified dict (the expires one). */
 
-void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, struct evictionPoolEntry *pool) {
+void evictionPoolPopulate(int dbid, dict *sampledict, redisDb *db, struct evictionPoolEntry *pool) {
     int j, k, count;
     dictEntry *samples[server.maxmemory_samples];
 
-    count = dictGetSomeKeys(sampledict,samples,server.maxmemory_samples);
+    if (sampledict)
+        count = dictGetSomeKeys(sampledict,samples,server.maxmemory_samples);
+    else
+        count = dbGetSomeKeys(db,samples,server.maxmemory_samples);
     for (j = 0; j < count; j++) {
         unsigned long long idle;
         sds key;
@@ -175,7 +181,7 @@ void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, struct evic
          * dictionary (but the expires one) we need to lookup the key
          * again in the key dictionary to obtain the value object. */
         if (server.maxmemory_policy != MAXMEMORY_VOLATILE_TTL) {
-            if (sampledict != keydict) de = dictFind(keydict, key);
+            if (sampledict) de = dbFind(db, key);
             o = dictGetVal(de);
         }
 
@@ -487,9 +493,10 @@ int freeMemoryIfNeeded(void) {
                 for (i = 0; i < server.dbnum; i++) {
                     db = server.db+i;
                     dict = (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) ?
-                            db->dict : db->expires;
-                    if ((keys = dictSize(dict)) != 0) {
-                        evictionPoolPopulate(i, dict, db->dict, pool);
+                            NULL : db->expires;
+                    keys = dict ? dictSize(dict) : dbSize(db);
+                    if (keys != 0) {
+                        evictionPoolPopulate(i, dict, db, pool);
                         total_keys += keys;
                     }
                 }
@@ -501,8 +508,7 @@ int freeMemoryIfNeeded(void) {
                     bestdbid = pool[k].dbid;
 
                     if (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) {
-                        de = dictFind(server.db[pool[k].dbid].dict,
-                            pool[k].key);
+                        de = dbFind(server.db+pool[k].dbid,pool[k].key);
                     } else {
                         de = dictFind(server.db[pool[k].dbid].expires,
                             pool[k].key);
@@ -536,10 +542,12 @@ int freeMemoryIfNeeded(void) {
             for (i = 0; i < server.dbnum; i++) {
                 j = (++next_db) % server.dbnum;
                 db = server.db+j;
-                dict = (server.maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM) ?
-                        db->dict : db->expires;
-                if (dictSize(dict) != 0) {
-                    de = dictGetRandomKey(dict);
+                if (server.maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM) {
+                    de = dbRandomEntry(db);
+                } else {
+                    de = dictSize(db->expires) ? dictGetRandomKey(db->expires) : NULL;
+                }
+                if (de) {
                     bestkey = dictGetKey(de);
                     bestdbid = j;
                     break;
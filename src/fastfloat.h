@@ -0,0 +1,57 @@
+/* fastfloat -- Fast and exact conversion of decimal strings to doubles.
+ *
+ * fastStrtod() and fastStrtold() are drop-in replacements of strtod(3) and
+ * strtold(3) for the numbers clients send to Redis (scores, increments,
+ * coordinates): plain decimal numbers such as "1", "-0.5" or "1.5e10".
+ * Such numbers are converted without calling into libc, that is slow and
+ * locale aware, and the result is always the correctly rounded one, so
+ * exactly the same value strtod(3) would return. Everything else, like
+ * numbers with more than 19 significant digits, hexadecimal floats, "inf",
+ * "nan", leading spaces, and results that overflow or underflow, is handled
+ * by calling the libc functions, so errno and the end pointer are set
+ * exactly like the libc would do.
+ *
+ * Doubles are computed with the algorithm by Daniel Lemire and Michael
+ * Eisel ("Number Parsing at a Gigabyte per Second", Software: Practice and
+ * Experience 51(8), 2021), that multiplies the decimal significand by a 128
+ * bit approximation of the power of five, and detects the rare cases where
+ * the approximation is not enough to decide the rounding. Long doubles only
+ * use the exact fast path of Clinger, when both the significand and the
+ * power of ten are exactly representable.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __FASTFLOAT_H
+#define __FASTFLOAT_H
+
+double fastStrtod(const char *s, char **eptr);
+long double fastStrtold(const char *s, char **eptr);
+
+#ifdef REDIS_TEST
+int fastfloatTest(int argc, char *argv[]);
+#endif
+
+#endif
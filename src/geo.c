@@ -31,6 +31,7 @@
 #include "geo.h"
 #include "geohash_helper.h"
 #include "debugmacro.h"
+#include <math.h>
 
 /* Things exported from t_zset.c only for geo.c, since it is the only other
  * part of Redis that requires close zset introspection. */
@@ -56,6 +57,19 @@ geoArray *geoArrayCreate(void) {
     ga->array = NULL;
     ga->buckets = 0;
     ga->used = 0;
+    ga->limit = 0;
+    ga->farthest = 0;
+    return ga;
+}
+
+/* Create an array that only keeps the 'limit' nearest points, or the
+ * farthest ones if 'farthest' is true, so that GEORADIUS ... COUNT does not
+ * need to collect and sort all the points in the search area. */
+/* 创建只保存距离最近(或最远)的limit个位置点的数组 */
+geoArray *geoArrayCreateBounded(size_t limit, int farthest) {
+    geoArray *ga = geoArrayCreate();
+    ga->limit = limit;
+    ga->farthest = farthest;
     return ga;
 }
 
@@ -71,6 +85,73 @@ geoPoint *geoArrayAppend(geoArray *ga) {
     return gp;
 }
 
+/* Return true if, in a bounded array, the point 'a' should be discarded
+ * before the point 'b'. */
+static inline int geoArrayWorse(geoArray *ga, geoPoint *a, geoPoint *b) {
+    return ga->farthest ? a->dist < b->dist : a->dist > b->dist;
+}
+
+/* Move the point at 'idx' of a bounded array up or down the heap until the
+ * heap property holds again. Return the new position of the point. */
+static geoPoint *geoArrayHeapFix(geoArray *ga, size_t idx) {
+    geoPoint *h = ga->array, tmp;
+
+    while (idx > 0 && geoArrayWorse(ga,h+idx,h+(idx-1)/2)) {
+        tmp = h[idx];
+        h[idx] = h[(idx-1)/2];
+        h[(idx-1)/2] = tmp;
+        idx = (idx-1)/2;
+    }
+    while (1) {
+        size_t child = idx*2+1;
+
+        if (child >= ga->used) break;
+        if (child+1 < ga->used && geoArrayWorse(ga,h+child+1,h+child))
+            child++;
+        if (!geoArrayWorse(ga,h+child,h+idx)) break;
+        tmp = h[idx];
+        h[idx] = h[child];
+        h[child] = tmp;
+        idx = child;
+    }
+    return h+idx;
+}
+
+/* Add a point at distance 'dist' to the array, returning the entry where
+ * the caller should set the other fields, or NULL if the array is bounded
+ * and already holds 'limit' points all better than this one, so that the
+ * caller does not even need to create the member name. */
+geoPoint *geoArrayAdd(geoArray *ga, double dist) {
+    geoPoint *gp;
+
+    if (ga->limit == 0) {
+        gp = geoArrayAppend(ga);
+        gp->dist = dist;
+        return gp;
+    }
+    if (ga->used < ga->limit) {
+        gp = geoArrayAppend(ga);
+        gp->dist = dist;
+        gp->member = NULL;
+        return geoArrayHeapFix(ga,ga->used-1);
+    }
+
+    /* Full: replace the worst point, that is the root, if we are better. */
+    gp = ga->array;
+    if (ga->farthest ? dist <= gp->dist : dist >= gp->dist) return NULL;
+    sdsfree(gp->member);
+    gp->member = NULL;
+    gp->dist = dist;
+    return geoArrayHeapFix(ga,0);
+}
+
+/* Return true if the array is bounded, full, and all its points are nearer
+ * than 'dist', so that farther points will be discarded anyway. */
+int geoArrayFullAndNearerThan(geoArray *ga, double dist) {
+    return ga->limit && !ga->farthest && ga->used == ga->limit &&
+           ga->array[0].dist < dist;
+}
+
 /* Destroy a geoArray created with geoArrayCreate(). */
 void geoArrayFree(geoArray *ga) {
     size_t i;
@@ -175,10 +256,19 @@ double extractDistanceOrReply(client *c, robj **argv,
  * for returning location distances. "5.2145 meters away" is nicer
  * than "5.2144992818115 meters away." We provide 4 digits after the dot
  * so that the returned value is decently accurate even when the unit is
- * the kilometer. */
+ * the kilometer.
+ *
+ * With 'shortest-double-format' the distance rounded to 4 digits after
+ * the dot is formatted like any other double, so trailing zeroes are not
+ * emitted: "6.7" instead of "6.7000". */
 void addReplyDoubleDistance(client *c, double d) {
     char dbuf[128];
-    int dlen = snprintf(dbuf, sizeof(dbuf), "%.4f", d);
+    int dlen;
+
+    if (server.shortest_double_format)
+        dlen = d2string(dbuf, sizeof(dbuf), round(d*10000)/10000);
+    else
+        dlen = snprintf(dbuf, sizeof(dbuf), "%.4f", d);
     addReplyBulkCBuffer(c, dbuf, dlen);
 }
 
@@ -187,32 +277,34 @@ void addReplyDoubleDistance(client *c, double d) {
  * a radius, appends this entry as a geoPoint into the specified geoArray
  * only if the point is within the search area.
  *
- * returns C_OK if the point is included, or REIDS_ERR if it is outside. */
-int geoAppendIfWithinRadius(geoArray *ga, double lon, double lat, double radius, double score, sds member) {
+ * Returns the new entry, whose member should be set by the caller, or NULL
+ * if the point is outside, or if the array is bounded and the point is not
+ * among the nearest ones. */
+geoPoint *geoAppendIfWithinRadius(geoArray *ga, double lon, double lat, double radius, double score) {
     double distance, xy[2];
 
-    if (!decodeGeohash(score,xy)) return C_ERR; /* Can't decode. */
+    if (!decodeGeohash(score,xy)) return NULL; /* Can't decode. */
     /* Note that geohashGetDistanceIfInRadiusWGS84() takes arguments in
      * reverse order: longitude first, latitude later. */
     if (!geohashGetDistanceIfInRadiusWGS84(lon,lat, xy[0], xy[1],
                                            radius, &distance))
     {
-        return C_ERR;
+        return NULL;
     }
 
     /* Append the new element. */
-    geoPoint *gp = geoArrayAppend(ga);
+    geoPoint *gp = geoArrayAdd(ga,distance);
+    if (gp == NULL) return NULL;
     gp->longitude = xy[0];
     gp->latitude = xy[1];
-    gp->dist = distance;
-    gp->member = member;
     gp->score = score;
-    return C_OK;
+    return gp;
 }
 
 /* Query a Redis sorted set to extract all the elements between 'min' and
  * 'max', appending them into the array of geoPoint structures 'gparray'.
- * The command returns the number of elements added to the array.
+ * The command returns the number of elements added to the array (points
+ * replacing others in a bounded array are not counted).
  *
  * Elements which are farest than 'radius' from the specified 'x' and 'y'
  * coordinates are not included.
@@ -227,9 +319,9 @@ int geoGetPointsInRange(robj *zobj, double min, double max, double lon, double l
     /* That's: min <= val < max */
     zrangespec range = { .min = min, .max = max, .minex = 0, .maxex = 1 };
     size_t origincount = ga->used;
-    sds member;
+    geoPoint *gp;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr = NULL;
@@ -242,7 +334,7 @@ int geoGetPointsInRange(robj *zobj, double min, double max, double lon, double l
             return 0;
         }
 
-        sptr = ziplistNext(zl, eptr);
+        sptr = lpNext(zl, eptr);
         while (eptr) {
             score = zzlGetScore(sptr);
 
@@ -250,34 +342,34 @@ int geoGetPointsInRange(robj *zobj, double min, double max, double lon, double l
             if (!zslValueLteMax(score, &range))
                 break;
 
-            /* We know the element exists. ziplistGet should always succeed */
-            ziplistGet(eptr, &vstr, &vlen, &vlong);
-            member = (vstr == NULL) ? sdsfromlonglong(vlong) :
-                                      sdsnewlen(vstr,vlen);
-            if (geoAppendIfWithinRadius(ga,lon,lat,radius,score,member)
-                == C_ERR) sdsfree(member);
+            gp = geoAppendIfWithinRadius(ga,lon,lat,radius,score);
+            if (gp) {
+                /* We know the element exists. lpGetValue should always
+                 * succeed. */
+                lpGetValue(eptr, &vstr, &vlen, &vlong);
+                gp->member = (vstr == NULL) ? sdsfromlonglong(vlong) :
+                                              sdsnewlen(vstr,vlen);
+            }
             zzlNext(zl, &eptr, &sptr);
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
-        zskiplist *zsl = zs->zsl;
-        zskiplistNode *ln;
+        zbtPos pos;
 
-        if ((ln = zslFirstInRange(zsl, &range)) == NULL) {
+        if (!zbtFirstInRange(zs->zbt, &range, &pos)) {
             /* Nothing exists starting at our min.  No results. */
             return 0;
         }
 
-        while (ln) {
-            sds ele = ln->ele;
-            /* Abort when the node is no longer in range. */
-            if (!zslValueLteMax(ln->score, &range))
+        while (pos.leaf) {
+            zbtEntry *e = zbtPosEntry(&pos);
+            /* Abort when the element is no longer in range. */
+            if (!zslValueLteMax(e->score, &range))
                 break;
 
-            ele = sdsdup(ele);
-            if (geoAppendIfWithinRadius(ga,lon,lat,radius,ln->score,ele)
-                == C_ERR) sdsfree(ele);
-            ln = ln->level[0].forward;
+            gp = geoAppendIfWithinRadius(ga,lon,lat,radius,e->score);
+            if (gp) gp->member = sdsdup(e->ele);
+            zbtNext(&pos);
         }
     }
     return ga->used - origincount;
@@ -380,6 +472,81 @@ int membersOfAllNeighbors(robj *zobj, GeoHashRadius n, double lon, double lat, d
     return count;
 }
 
+/* A box searched by membersOfNearestBoxes(), with the minimum distance
+ * between the search center and its points. */
+typedef struct geoBox {
+    GeoHashBits hash;
+    double mindist;
+} geoBox;
+
+static int sort_box_asc(const void *a, const void *b) {
+    const geoBox *ba = a, *bb = b;
+    if (ba->mindist > bb->mindist)
+        return 1;
+    else if (ba->mindist == bb->mindist)
+        return 0;
+    else
+        return -1;
+}
+
+/* Like membersOfAllNeighbors(), but used when only the ga->limit nearest
+ * points are needed. Every one of the 9 boxes is split into boxes
+ * GEO_SPLIT_STEPS steps smaller, that are searched from the nearest to the
+ * farthest one: when the array already holds ga->limit points all nearer
+ * than the next box, the remaining boxes can't contain better points and
+ * the search stops. With dense areas only the few boxes around the center
+ * are visited, instead of collecting all the points inside the radius. */
+#define GEO_SPLIT_STEPS 2
+int membersOfNearestBoxes(robj *zobj, GeoHashRadius n, double lon, double lat, double radius, geoArray *ga) {
+    GeoHashBits neighbors[9];
+    geoBox boxes[9 << (GEO_SPLIT_STEPS*2)];
+    GeoHashRange long_range, lat_range;
+    unsigned int i, j, count = 0, numboxes = 0, split;
+
+    neighbors[0] = n.hash;
+    neighbors[1] = n.neighbors.north;
+    neighbors[2] = n.neighbors.south;
+    neighbors[3] = n.neighbors.east;
+    neighbors[4] = n.neighbors.west;
+    neighbors[5] = n.neighbors.north_east;
+    neighbors[6] = n.neighbors.north_west;
+    neighbors[7] = n.neighbors.south_east;
+    neighbors[8] = n.neighbors.south_west;
+
+    split = GEO_STEP_MAX - n.hash.step;
+    if (split > GEO_SPLIT_STEPS) split = GEO_SPLIT_STEPS;
+    geohashGetCoordRange(&long_range,&lat_range);
+    for (i = 0; i < 9; i++) {
+        if (HASHISZERO(neighbors[i])) continue;
+
+        /* With huge radiuses adjacent neighbors can be the same box. */
+        for (j = 0; j < i; j++) {
+            if (neighbors[i].bits == neighbors[j].bits &&
+                neighbors[i].step == neighbors[j].step) break;
+        }
+        if (j != i) continue;
+
+        /* The smaller boxes are the ones having the box as prefix. */
+        for (j = 0; j < (1U << (split*2)); j++) {
+            GeoHashArea area;
+            geoBox *box = boxes+numboxes;
+
+            box->hash.bits = (neighbors[i].bits << (split*2)) | j;
+            box->hash.step = neighbors[i].step + split;
+            geohashDecode(long_range,lat_range,box->hash,&area);
+            box->mindist = geohashGetMinDistanceToArea(lon,lat,&area);
+            if (box->mindist <= radius) numboxes++;
+        }
+    }
+    qsort(boxes,numboxes,sizeof(geoBox),sort_box_asc);
+
+    for (i = 0; i < numboxes; i++) {
+        if (geoArrayFullAndNearerThan(ga,boxes[i].mindist)) break;
+        count += membersOfGeoHashBox(zobj,boxes[i].hash,ga,lon,lat,radius);
+    }
+    return count;
+}
+
 /* Sort comparators for qsort() */
 static int sort_gp_asc(const void *a, const void *b) {
     const struct geoPoint *gpa = a, *gpb = b;
@@ -560,9 +727,25 @@ void georadiusGeneric(client *c, int flags) {
     GeoHashRadius georadius =
         geohashGetAreasByRadiusWGS84(xy[0], xy[1], radius_meters);
 
-    /* Search the zset for all matching points */
-    geoArray *ga = geoArrayCreate();
-    membersOfAllNeighbors(zobj, georadius, xy[0], xy[1], radius_meters, ga);
+    /* Search the zset for all matching points. With COUNT only the
+     * requested number of points is kept while searching. The nearest
+     * points are also searched starting from the center, but this requires
+     * many range queries that are only cheap enough on big sorted sets. */
+    geoArray *ga;
+    if (count == 0) {
+        ga = geoArrayCreate();
+    } else {
+        ga = geoArrayCreateBounded(count, sort == SORT_DESC);
+    }
+    if (count != 0 && sort == SORT_ASC &&
+        zobj->encoding == OBJ_ENCODING_BTREE)
+    {
+        membersOfNearestBoxes(zobj, georadius, xy[0], xy[1], radius_meters,
+                              ga);
+    } else {
+        membersOfAllNeighbors(zobj, georadius, xy[0], xy[1], radius_meters,
+                              ga);
+    }
 
     /* If no matching results, the user gets an empty reply. */
     if (ga->used == 0 && storekey == NULL) {
@@ -643,20 +826,18 @@ void georadiusGeneric(client *c, int flags) {
         }
 
         for (i = 0; i < returned_items; i++) {
-            zskiplistNode *znode;
             geoPoint *gp = ga->array+i;
             gp->dist /= conversion; /* Fix according to unit. */
             double score = storedist ? gp->dist : gp->score;
             size_t elelen = sdslen(gp->member);
 
             if (maxelelen < elelen) maxelelen = elelen;
-            znode = zslInsert(zs->zsl,score,gp->member);
-            serverAssert(dictAdd(zs->dict,gp->member,&znode->score) == DICT_OK);
+            zsetInsertElement(zs,score,gp->member);
             gp->member = NULL;
         }
 
         if (returned_items) {
-            zsetConvertToZiplistIfNeeded(zobj,maxelelen);
+            zsetConvertToListpackIfNeeded(zobj,maxelelen);
             setKey(c->db,storekey,zobj);
             decrRefCount(zobj);
             notifyKeyspaceEvent(NOTIFY_ZSET,"georadiusstore",storekey,
@@ -17,6 +17,9 @@ typedef struct geoArray {
     struct geoPoint *array;
     size_t buckets;
     size_t used;
+    size_t limit;   /* If not zero only the 'limit' nearest points are kept,
+                       in a heap having the farthest one as root. */
+    int farthest;   /* With 'limit', keep the farthest points instead. */
 } geoArray;
 
 #endif
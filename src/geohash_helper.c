@@ -233,3 +233,35 @@ int geohashGetDistanceIfInRadiusWGS84(double x1, double y1, double x2,
                                       double *distance) {
     return geohashGetDistanceIfInRadius(x1, y1, x2, y2, radius, distance);
 }
+
+/* Return a lower bound of the distance between the point lon,lat and every
+ * point inside 'area', that is zero if the point is inside the area.
+ *
+ * Every path to the area crosses the parallel of its nearest latitude edge,
+ * so the distance is at least the one along the meridian to that parallel.
+ * Similarly, when the area is on one side of the point, the path crosses
+ * the meridian of its nearest longitude edge, and the distance is at least
+ * the one between the point and the great circle of this meridian, that is
+ * asin(cos(lat)*sin(delta lon)). The bigger of the two is returned. */
+double geohashGetMinDistanceToArea(double lon, double lat,
+                                   const GeoHashArea *area) {
+    double dlat = 0, dlon = 0, latdist, londist = 0;
+
+    if (lat < area->latitude.min)
+        dlat = area->latitude.min - lat;
+    else if (lat > area->latitude.max)
+        dlat = lat - area->latitude.max;
+    latdist = EARTH_RADIUS_IN_METERS * deg_rad(dlat);
+
+    if (lon < area->longitude.min || lon > area->longitude.max) {
+        /* The area may be on the other side of the 180th meridian. */
+        double east = fmod(area->longitude.min - lon + 720, 360);
+        double west = fmod(lon - area->longitude.max + 720, 360);
+        dlon = east < west ? east : west;
+    }
+    if (dlon > 0 && dlon < 90) {
+        londist = EARTH_RADIUS_IN_METERS *
+                  asin(cos(deg_rad(lat)) * sin(deg_rad(dlon)));
+    }
+    return latdist > londist ? latdist : londist;
+}
@@ -66,5 +66,7 @@ int geohashGetDistanceIfInRadius(double x1, double y1,
 int geohashGetDistanceIfInRadiusWGS84(double x1, double y1, double x2,
                                       double y2, double radius,
                                       double *distance);
+double geohashGetMinDistanceToArea(double lon, double lat,
+                                   const GeoHashArea *area);
 
 #endif /* GEOHASH_HELPER_HPP_ */
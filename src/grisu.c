@@ -0,0 +1,381 @@
+/* grisu -- Shortest round-trip conversion of doubles to strings.
+ *
+ * See grisu.h for the API and licensing information.
+ *
+ * A double v = f*2^e is parsed back by strtod(3) from any decimal number
+ * strictly between the midpoints m- and m+ with its neighbors. Grisu2
+ * multiplies v, m- and m+ by a cached power of ten 10^-k chosen so that the
+ * binary exponent of the products falls in [-60,-32]: the integer part of
+ * the scaled m+ then fits 32 bits. The digits of the scaled m+ are generated
+ * one after the other, stopping as soon as the remaining part is less than
+ * the width of the interval, and the last digit is finally lowered while
+ * this moves the result closer to the scaled v. The products are computed
+ * rounding to 64 bits, so the interval is shrunk by one unit on both sides
+ * to make sure the result is still inside it. */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "grisu.h"
+
+#define GRISU_FRACMASK  0x000FFFFFFFFFFFFFULL
+#define GRISU_EXPMASK   0x7FF0000000000000ULL
+#define GRISU_HIDDENBIT 0x0010000000000000ULL
+#define GRISU_SIGNMASK  0x8000000000000000ULL
+#define GRISU_EXPBIAS   (1023+52)
+
+#define GRISU_NPOWERS 87
+#define GRISU_FIRSTPOWER -348   /* Decimal exponent of the first power. */
+#define GRISU_STEPPOWERS 8      /* Decimal exponent step between powers. */
+#define GRISU_EXPMIN -60        /* Binary exponent range of the products. */
+#define GRISU_EXPMAX -32
+
+/* A floating point number with a 64 bit significand: frac*2^exp. */
+typedef struct grisuFp {
+    uint64_t frac;
+    int exp;
+} grisuFp;
+
+/* 10^k for k = -348, -340, ..., 340, with the significand normalized to
+ * have the highest bit set, rounded to nearest. */
+static const grisuFp grisuPowers[GRISU_NPOWERS] = {
+    { 0xfa8fd5a0081c0288ULL, -1220 }, /* 1e-348 */
+    { 0xbaaee17fa23ebf76ULL, -1193 }, /* 1e-340 */
+    { 0x8b16fb203055ac76ULL, -1166 }, /* 1e-332 */
+    { 0xcf42894a5dce35eaULL, -1140 }, /* 1e-324 */
+    { 0x9a6bb0aa55653b2dULL, -1113 }, /* 1e-316 */
+    { 0xe61acf033d1a45dfULL, -1087 }, /* 1e-308 */
+    { 0xab70fe17c79ac6caULL, -1060 }, /* 1e-300 */
+    { 0xff77b1fcbebcdc4fULL, -1034 }, /* 1e-292 */
+    { 0xbe5691ef416bd60cULL, -1007 }, /* 1e-284 */
+    { 0x8dd01fad907ffc3cULL,  -980 }, /* 1e-276 */
+    { 0xd3515c2831559a83ULL,  -954 }, /* 1e-268 */
+    { 0x9d71ac8fada6c9b5ULL,  -927 }, /* 1e-260 */
+    { 0xea9c227723ee8bcbULL,  -901 }, /* 1e-252 */
+    { 0xaecc49914078536dULL,  -874 }, /* 1e-244 */
+    { 0x823c12795db6ce57ULL,  -847 }, /* 1e-236 */
+    { 0xc21094364dfb5637ULL,  -821 }, /* 1e-228 */
+    { 0x9096ea6f3848984fULL,  -794 }, /* 1e-220 */
+    { 0xd77485cb25823ac7ULL,  -768 }, /* 1e-212 */
+    { 0xa086cfcd97bf97f4ULL,  -741 }, /* 1e-204 */
+    { 0xef340a98172aace5ULL,  -715 }, /* 1e-196 */
+    { 0xb23867fb2a35b28eULL,  -688 }, /* 1e-188 */
+    { 0x84c8d4dfd2c63f3bULL,  -661 }, /* 1e-180 */
+    { 0xc5dd44271ad3cdbaULL,  -635 }, /* 1e-172 */
+    { 0x936b9fcebb25c996ULL,  -608 }, /* 1e-164 */
+    { 0xdbac6c247d62a584ULL,  -582 }, /* 1e-156 */
+    { 0xa3ab66580d5fdaf6ULL,  -555 }, /* 1e-148 */
+    { 0xf3e2f893dec3f126ULL,  -529 }, /* 1e-140 */
+    { 0xb5b5ada8aaff80b8ULL,  -502 }, /* 1e-132 */
+    { 0x87625f056c7c4a8bULL,  -475 }, /* 1e-124 */
+    { 0xc9bcff6034c13053ULL,  -449 }, /* 1e-116 */
+    { 0x964e858c91ba2655ULL,  -422 }, /* 1e-108 */
+    { 0xdff9772470297ebdULL,  -396 }, /* 1e-100 */
+    { 0xa6dfbd9fb8e5b88fULL,  -369 }, /* 1e-92 */
+    { 0xf8a95fcf88747d94ULL,  -343 }, /* 1e-84 */
+    { 0xb94470938fa89bcfULL,  -316 }, /* 1e-76 */
+    { 0x8a08f0f8bf0f156bULL,  -289 }, /* 1e-68 */
+    { 0xcdb02555653131b6ULL,  -263 }, /* 1e-60 */
+    { 0x993fe2c6d07b7facULL,  -236 }, /* 1e-52 */
+    { 0xe45c10c42a2b3b06ULL,  -210 }, /* 1e-44 */
+    { 0xaa242499697392d3ULL,  -183 }, /* 1e-36 */
+    { 0xfd87b5f28300ca0eULL,  -157 }, /* 1e-28 */
+    { 0xbce5086492111aebULL,  -130 }, /* 1e-20 */
+    { 0x8cbccc096f5088ccULL,  -103 }, /* 1e-12 */
+    { 0xd1b71758e219652cULL,   -77 }, /* 1e-4 */
+    { 0x9c40000000000000ULL,   -50 }, /* 1e4 */
+    { 0xe8d4a51000000000ULL,   -24 }, /* 1e12 */
+    { 0xad78ebc5ac620000ULL,     3 }, /* 1e20 */
+    { 0x813f3978f8940984ULL,    30 }, /* 1e28 */
+    { 0xc097ce7bc90715b3ULL,    56 }, /* 1e36 */
+    { 0x8f7e32ce7bea5c70ULL,    83 }, /* 1e44 */
+    { 0xd5d238a4abe98068ULL,   109 }, /* 1e52 */
+    { 0x9f4f2726179a2245ULL,   136 }, /* 1e60 */
+    { 0xed63a231d4c4fb27ULL,   162 }, /* 1e68 */
+    { 0xb0de65388cc8ada8ULL,   189 }, /* 1e76 */
+    { 0x83c7088e1aab65dbULL,   216 }, /* 1e84 */
+    { 0xc45d1df942711d9aULL,   242 }, /* 1e92 */
+    { 0x924d692ca61be758ULL,   269 }, /* 1e100 */
+    { 0xda01ee641a708deaULL,   295 }, /* 1e108 */
+    { 0xa26da3999aef774aULL,   322 }, /* 1e116 */
+    { 0xf209787bb47d6b85ULL,   348 }, /* 1e124 */
+    { 0xb454e4a179dd1877ULL,   375 }, /* 1e132 */
+    { 0x865b86925b9bc5c2ULL,   402 }, /* 1e140 */
+    { 0xc83553c5c8965d3dULL,   428 }, /* 1e148 */
+    { 0x952ab45cfa97a0b3ULL,   455 }, /* 1e156 */
+    { 0xde469fbd99a05fe3ULL,   481 }, /* 1e164 */
+    { 0xa59bc234db398c25ULL,   508 }, /* 1e172 */
+    { 0xf6c69a72a3989f5cULL,   534 }, /* 1e180 */
+    { 0xb7dcbf5354e9beceULL,   561 }, /* 1e188 */
+    { 0x88fcf317f22241e2ULL,   588 }, /* 1e196 */
+    { 0xcc20ce9bd35c78a5ULL,   614 }, /* 1e204 */
+    { 0x98165af37b2153dfULL,   641 }, /* 1e212 */
+    { 0xe2a0b5dc971f303aULL,   667 }, /* 1e220 */
+    { 0xa8d9d1535ce3b396ULL,   694 }, /* 1e228 */
+    { 0xfb9b7cd9a4a7443cULL,   720 }, /* 1e236 */
+    { 0xbb764c4ca7a44410ULL,   747 }, /* 1e244 */
+    { 0x8bab8eefb6409c1aULL,   774 }, /* 1e252 */
+    { 0xd01fef10a657842cULL,   800 }, /* 1e260 */
+    { 0x9b10a4e5e9913129ULL,   827 }, /* 1e268 */
+    { 0xe7109bfba19c0c9dULL,   853 }, /* 1e276 */
+    { 0xac2820d9623bf429ULL,   880 }, /* 1e284 */
+    { 0x80444b5e7aa7cf85ULL,   907 }, /* 1e292 */
+    { 0xbf21e44003acdd2dULL,   933 }, /* 1e300 */
+    { 0x8e679c2f5e44ff8fULL,   960 }, /* 1e308 */
+    { 0xd433179d9c8cb841ULL,   986 }, /* 1e316 */
+    { 0x9e19db92b4e31ba9ULL,  1013 }, /* 1e324 */
+    { 0xeb96bf6ebadf77d9ULL,  1039 }, /* 1e332 */
+    { 0xaf87023b9bf0ee6bULL,  1066 }, /* 1e340 */
+};
+
+static const uint64_t grisuTens[] = {
+    10000000000000000000ULL, 1000000000000000000ULL, 100000000000000000ULL,
+    10000000000000000ULL, 1000000000000000ULL, 100000000000000ULL,
+    10000000000000ULL, 1000000000000ULL, 100000000000ULL,
+    10000000000ULL, 1000000000ULL, 100000000ULL,
+    10000000ULL, 1000000ULL, 100000ULL,
+    10000ULL, 1000ULL, 100ULL,
+    10ULL, 1ULL
+};
+
+static grisuFp grisuBuildFp(uint64_t bits) {
+    grisuFp fp;
+
+    fp.frac = bits & GRISU_FRACMASK;
+    fp.exp = (bits & GRISU_EXPMASK) >> 52;
+    if (fp.exp) {
+        fp.frac += GRISU_HIDDENBIT;
+        fp.exp -= GRISU_EXPBIAS;
+    } else {
+        /* Subnormal. */
+        fp.exp = -GRISU_EXPBIAS+1;
+    }
+    return fp;
+}
+
+/* Shift the significand so that its highest bit is set. */
+static void grisuNormalize(grisuFp *fp) {
+    while ((fp->frac & GRISU_HIDDENBIT) == 0) {
+        fp->frac <<= 1;
+        fp->exp--;
+    }
+    fp->frac <<= 64-52-1;
+    fp->exp -= 64-52-1;
+}
+
+/* Set 'lower' and 'upper' to the midpoints between 'fp' and its neighbors,
+ * normalized with the same exponent. */
+static void grisuBoundaries(grisuFp *fp, grisuFp *lower, grisuFp *upper) {
+    int lshift;
+
+    upper->frac = (fp->frac << 1) + 1;
+    upper->exp = fp->exp - 1;
+    while ((upper->frac & (GRISU_HIDDENBIT << 1)) == 0) {
+        upper->frac <<= 1;
+        upper->exp--;
+    }
+    upper->frac <<= 64-52-2;
+    upper->exp -= 64-52-2;
+
+    /* The previous double is closer when 'fp' is a power of two, since
+     * the exponent changes. */
+    lshift = fp->frac == GRISU_HIDDENBIT ? 2 : 1;
+    lower->frac = (fp->frac << lshift) - 1;
+    lower->exp = fp->exp - lshift;
+    lower->frac <<= lower->exp - upper->exp;
+    lower->exp = upper->exp;
+}
+
+/* Return a*b rounded to a 64 bit significand. */
+static grisuFp grisuMultiply(grisuFp *a, grisuFp *b) {
+    const uint64_t lomask = 0x00000000FFFFFFFFULL;
+    uint64_t ah_bl = (a->frac >> 32) * (b->frac & lomask);
+    uint64_t al_bh = (a->frac & lomask) * (b->frac >> 32);
+    uint64_t al_bl = (a->frac & lomask) * (b->frac & lomask);
+    uint64_t ah_bh = (a->frac >> 32) * (b->frac >> 32);
+    uint64_t tmp = (ah_bl & lomask) + (al_bh & lomask) + (al_bl >> 32);
+    grisuFp fp;
+
+    tmp += 1ULL << 31; /* Round. */
+    fp.frac = ah_bh + (ah_bl >> 32) + (al_bh >> 32) + (tmp >> 32);
+    fp.exp = a->exp + b->exp + 64;
+    return fp;
+}
+
+/* Return the cached power of ten 10^k that brings a number with the binary
+ * exponent 'exp' in the [GRISU_EXPMIN,GRISU_EXPMAX] range, and set '*k'. */
+static grisuFp grisuCachedPower(int exp, int *k) {
+    const double one_log_ten = 0.30102999566398114;
+    int approx = -(exp + GRISU_NPOWERS) * one_log_ten;
+    int idx = (approx - GRISU_FIRSTPOWER) / GRISU_STEPPOWERS;
+
+    while (1) {
+        int current = exp + grisuPowers[idx].exp + 64;
+
+        if (current < GRISU_EXPMIN) {
+            idx++;
+        } else if (current > GRISU_EXPMAX) {
+            idx--;
+        } else {
+            *k = GRISU_FIRSTPOWER + idx*GRISU_STEPPOWERS;
+            return grisuPowers[idx];
+        }
+    }
+}
+
+/* Lower the last digit while the remaining part 'rem' stays inside the
+ * interval of width 'delta' and gets closer to 'frac', the distance between
+ * the upper bound and the exact value. 'kappa' is the weight of the digit. */
+static void grisuRoundDigit(char *digits, int ndigits, uint64_t delta,
+                            uint64_t rem, uint64_t kappa, uint64_t frac)
+{
+    while (rem < frac && delta - rem >= kappa &&
+           (rem + kappa < frac || frac - rem > rem + kappa - frac)) {
+        digits[ndigits-1]--;
+        rem += kappa;
+    }
+}
+
+/* Generate the digits of 'upper', the scaled upper bound, until they
+ * represent a number inside (lower,upper). Returns the number of digits,
+ * and adds to '*K' the decimal exponent of the last one. */
+static int grisuGenerateDigits(grisuFp *fp, grisuFp *upper, grisuFp *lower,
+                               char *digits, int *K)
+{
+    uint64_t wfrac = upper->frac - fp->frac;
+    uint64_t delta = upper->frac - lower->frac;
+    int shift = -upper->exp;
+    uint64_t one = 1ULL << shift;
+    uint64_t part1 = upper->frac >> shift;
+    uint64_t part2 = upper->frac & (one - 1);
+    const uint64_t *divp, *unit;
+    int idx = 0, kappa = 10;
+
+    /* The integer part is less than 2^32, so it has up to 10 digits. */
+    for (divp = grisuTens+10; kappa > 0; divp++) {
+        uint64_t div = *divp, tmp;
+        unsigned int digit = part1 / div;
+
+        if (digit || idx) digits[idx++] = digit + '0';
+        part1 -= digit * div;
+        kappa--;
+        tmp = (part1 << shift) + part2;
+        if (tmp <= delta) {
+            *K += kappa;
+            grisuRoundDigit(digits,idx,delta,tmp,div << shift,wfrac);
+            return idx;
+        }
+    }
+
+    /* Fractional part: the interval is scaled as well at every digit. */
+    unit = grisuTens+18;
+    while (1) {
+        unsigned int digit;
+
+        part2 *= 10;
+        delta *= 10;
+        kappa--;
+        digit = part2 >> shift;
+        if (digit || idx) digits[idx++] = digit + '0';
+        part2 &= one - 1;
+        if (part2 < delta) {
+            *K += kappa;
+            grisuRoundDigit(digits,idx,delta,part2,one,wfrac * *unit);
+            return idx;
+        }
+        unit--;
+    }
+}
+
+/* Store in 'digits' the shortest (in most cases) digits D such that
+ * D*10^K is parsed back as 'value', a finite positive double. Returns the
+ * number of digits. */
+static int grisu2(uint64_t bits, char *digits, int *K) {
+    grisuFp w = grisuBuildFp(bits), lower, upper, cp;
+    int k;
+
+    grisuBoundaries(&w,&lower,&upper);
+    grisuNormalize(&w);
+    cp = grisuCachedPower(upper.exp,&k);
+
+    w = grisuMultiply(&w,&cp);
+    upper = grisuMultiply(&upper,&cp);
+    lower = grisuMultiply(&lower,&cp);
+    lower.frac++;
+    upper.frac--;
+
+    *K = -k;
+    return grisuGenerateDigits(&w,&upper,&lower,digits,K);
+}
+
+/* Write in 'buf', that must be at least GRISU_DTOA_BUFLEN bytes, the
+ * shortest representation of 'value' that round-trips, formatted like
+ * "%.17g" would do, and null terminated. Returns the length of the string.
+ * Infinite values are written as "inf" and "-inf", NaN as "nan". */
+int grisuDtoa(double value, char *buf) {
+    char digits[18];
+    uint64_t bits;
+    int ndigits, K, exp, len = 0;
+
+    memcpy(&bits,&value,sizeof(bits));
+    if ((bits & GRISU_EXPMASK) == GRISU_EXPMASK && (bits & GRISU_FRACMASK)) {
+        memcpy(buf,"nan",4);
+        return 3;
+    }
+    if (bits & GRISU_SIGNMASK) buf[len++] = '-';
+    bits &= ~GRISU_SIGNMASK;
+    if (bits == GRISU_EXPMASK) {
+        memcpy(buf+len,"inf",4);
+        return len+3;
+    } else if (bits == 0) {
+        memcpy(buf+len,"0",2);
+        return len+1;
+    }
+
+    ndigits = grisu2(bits,digits,&K);
+    while (ndigits > 1 && digits[ndigits-1] == '0') {
+        ndigits--;
+        K++;
+    }
+
+    /* Decimal exponent of the first digit: choose the notation like "%g"
+     * does with a precision of 17. */
+    exp = ndigits+K-1;
+    if (exp < -4 || exp > 16) {
+        buf[len++] = digits[0];
+        if (ndigits > 1) {
+            buf[len++] = '.';
+            memcpy(buf+len,digits+1,ndigits-1);
+            len += ndigits-1;
+        }
+        buf[len++] = 'e';
+        buf[len++] = exp < 0 ? '-' : '+';
+        if (exp < 0) exp = -exp;
+        if (exp >= 100) buf[len++] = '0' + exp/100;
+        buf[len++] = '0' + (exp/10)%10;
+        buf[len++] = '0' + exp%10;
+    } else if (K >= 0) {
+        /* Integer: the digits followed by K zeroes. */
+        memcpy(buf+len,digits,ndigits);
+        len += ndigits;
+        memset(buf+len,'0',K);
+        len += K;
+    } else if (exp >= 0) {
+        /* The dot is inside the digits. */
+        memcpy(buf+len,digits,exp+1);
+        len += exp+1;
+        buf[len++] = '.';
+        memcpy(buf+len,digits+exp+1,ndigits-exp-1);
+        len += ndigits-exp-1;
+    } else {
+        /* The dot is before the digits, and some zeroes. */
+        buf[len++] = '0';
+        buf[len++] = '.';
+        memset(buf+len,'0',-exp-1);
+        len += -exp-1;
+        memcpy(buf+len,digits,ndigits);
+        len += ndigits;
+    }
+    buf[len] = '\0';
+    return len;
+}
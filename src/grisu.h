@@ -0,0 +1,51 @@
+/* grisu -- Shortest round-trip conversion of doubles to strings.
+ *
+ * grisuDtoa() prints the shortest decimal representation of a double that
+ * is parsed back by strtod(3) into the very same double, so 0.1 is printed
+ * as "0.1" instead of the "0.10000000000000001" of printf("%.17g"). The
+ * digits are computed with the Grisu2 algorithm by Florian Loitsch
+ * ("Printing Floating-Point Numbers Quickly and Accurately with Integers",
+ * PLDI 2010) using only 64 bit integer arithmetic, which is several times
+ * faster than the libc printf family. Grisu2 output always round-trips, and
+ * is the shortest possible for about 99.9% of the doubles: in the remaining
+ * cases it has one digit more than needed.
+ *
+ * The digits are laid out like "%.17g" does, so that the output only
+ * differs from the one of printf in the number of digits: the exponential
+ * notation is used when the decimal exponent is less than -4 or greater
+ * than 16, with a sign and at least two digits for the exponent.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __GRISU_H
+#define __GRISU_H
+
+/* Size of the buffer given to grisuDtoa(), including the null term. */
+#define GRISU_DTOA_BUFLEN 32
+
+int grisuDtoa(double value, char *buf);
+
+#endif
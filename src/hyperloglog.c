@@ -375,6 +375,7 @@ static char *invalid_hll_err = "-INVALIDOBJ Corrupted HLL object detected\r\n";
 #define HLL_SPARSE_VAL_MAX_LEN 4
 #define HLL_SPARSE_ZERO_MAX_LEN 64
 #define HLL_SPARSE_XZERO_MAX_LEN 16384
+#define HLL_SPARSE_BATCH_MIN 8 /* Min PFADD elements for a batch update. */
 #define HLL_SPARSE_VAL_SET(p,val,len) do { \
     *(p) = (((val)-1)<<2|((len)-1))|HLL_SPARSE_VAL_BIT; \
 } while(0)
@@ -515,10 +516,161 @@ int hllDenseAdd(uint8_t *registers, unsigned char *ele, size_t elesize) {
     return hllDenseSet(registers,index,count);
 }
 
+/* ======================= Vectorized dense registers ======================= */
+
+/* With the default 16384 registers of 6 bits, every 24 bytes of the dense
+ * representation hold exactly 32 registers. On x86-64 CPUs with AVX2 such
+ * a block is unpacked in a single vector, one byte per register: PSHUFB
+ * moves every group of 3 bytes (4 registers) in its own 32 bit lane, and
+ * shifts and masks move every register in its own byte. Merging multiple
+ * HLLs is then a matter of PMAXUB, and the histogram is computed from the
+ * unpacked bytes. */
+
+#if defined(HAVE_X86_SIMD) && (HLL_REGISTERS % 32) == 0 && HLL_BITS == 6
+#define HLL_HAVE_SIMD
+#include <immintrin.h>
+#endif
+
+static int hllSimd = -1; /* Use the AVX2 kernels? -1 if not yet known. */
+
+/* 检测当前CPU是否支持AVX2指令集 只在第一次调用时检测 */
+static int hllSimdEnabled(void) {
+    if (hllSimd == -1) {
+        hllSimd = 0;
+#ifdef HLL_HAVE_SIMD
+        __builtin_cpu_init();
+        hllSimd = __builtin_cpu_supports("avx2") != 0;
+#endif
+    }
+    return hllSimd;
+}
+
+#ifdef HLL_HAVE_SIMD
+/* Unpack the 32 registers stored in the 24 bytes at 'p'. The two 16 bytes
+ * loads are at offset 0 and 8, so that nothing past the 24 bytes is read. */
+__attribute__((target("avx2")))
+static inline __m256i hllUnpackAvx2(const uint8_t *p) {
+    const __m256i shuffle = _mm256_setr_epi8(
+        0,1,2,-1,3,4,5,-1,6,7,8,-1,9,10,11,-1,
+        4,5,6,-1,7,8,9,-1,10,11,12,-1,13,14,15,-1);
+    __m256i v = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)p)),
+        _mm_loadu_si128((const __m128i*)(p+8)),1);
+
+    /* Now every lane is 0 | r3 | r2 | r1 | r0, 6 bits per register. */
+    v = _mm256_shuffle_epi8(v,shuffle);
+    return _mm256_or_si256(
+        _mm256_or_si256(
+            _mm256_and_si256(v,_mm256_set1_epi32(0x3f)),
+            _mm256_and_si256(_mm256_slli_epi32(v,2),
+                             _mm256_set1_epi32(0x3f00))),
+        _mm256_or_si256(
+            _mm256_and_si256(_mm256_slli_epi32(v,4),
+                             _mm256_set1_epi32(0x3f0000)),
+            _mm256_and_si256(_mm256_slli_epi32(v,6),
+                             _mm256_set1_epi32(0x3f000000))));
+}
+
+/* Add to 'reghisto' the histogram of the registers obtained computing
+ * MAX(registers[0][i],...,registers[numhll-1][i]) for every register. */
+__attribute__((target("avx2")))
+static void hllDenseMaxHistoAvx2(uint8_t **registers, int numhll,
+                                 int *reghisto)
+{
+    /* Four partial histograms, so that consecutive registers with the
+     * same value don't wait for each other's increment. */
+    int histo[4][HLL_REGISTER_MAX+1];
+    uint8_t regs[32];
+    int j, k;
+
+    memset(histo,0,sizeof(histo));
+    for (j = 0; j < HLL_REGISTERS/32; j++) {
+        __m256i v = hllUnpackAvx2(registers[0]+j*24);
+
+        for (k = 1; k < numhll; k++)
+            v = _mm256_max_epu8(v,hllUnpackAvx2(registers[k]+j*24));
+        if (_mm256_testz_si256(v,v)) {
+            histo[0][0] += 32;
+            continue;
+        }
+        _mm256_storeu_si256((__m256i*)regs,v);
+        for (k = 0; k < 32; k += 4) {
+            histo[0][regs[k]]++;
+            histo[1][regs[k+1]]++;
+            histo[2][regs[k+2]]++;
+            histo[3][regs[k+3]]++;
+        }
+    }
+    for (j = 0; j <= HLL_REGISTER_MAX; j++)
+        reghisto[j] += histo[0][j]+histo[1][j]+histo[2][j]+histo[3][j];
+}
+
+/* Set max[i] to MAX(max[i],registers[i]) for every register. */
+__attribute__((target("avx2")))
+static void hllDenseMergeAvx2(uint8_t *max, uint8_t *registers) {
+    int j;
+
+    for (j = 0; j < HLL_REGISTERS/32; j++) {
+        __m256i m = _mm256_loadu_si256((const __m256i*)(max+j*32));
+        m = _mm256_max_epu8(m,hllUnpackAvx2(registers+j*24));
+        _mm256_storeu_si256((__m256i*)(max+j*32),m);
+    }
+}
+#endif
+
+/* Add to 'reghisto' the histogram of the registers of the union of the
+ * 'numhll' dense HLLs 'registers', without materializing the union. */
+void hllDenseMaxHisto(uint8_t **registers, int numhll, int *reghisto) {
+    int j, k;
+
+#ifdef HLL_HAVE_SIMD
+    if (hllSimdEnabled()) {
+        hllDenseMaxHistoAvx2(registers,numhll,reghisto);
+        return;
+    }
+#endif
+    for (j = 0; j < HLL_REGISTERS; j++) {
+        uint8_t max = 0, val;
+
+        for (k = 0; k < numhll; k++) {
+            HLL_DENSE_GET_REGISTER(val,registers[k],j);
+            if (val > max) max = val;
+        }
+        reghisto[max]++;
+    }
+}
+
+/* Store the HLL_REGISTERS registers of 'raw', one byte each, into the dense
+ * representation 'registers'. */
+void hllDensePack(uint8_t *registers, uint8_t *raw) {
+    int j;
+
+    if (HLL_BITS == 6 && (HLL_REGISTERS % 4) == 0) {
+        /* Every 4 registers fill exactly 3 bytes. */
+        for (j = 0; j < HLL_REGISTERS; j += 4) {
+            registers[0] = raw[0] | raw[1] << 6;
+            registers[1] = raw[1] >> 2 | raw[2] << 4;
+            registers[2] = raw[2] >> 4 | raw[3] << 2;
+            registers += 3;
+            raw += 4;
+        }
+    } else {
+        for (j = 0; j < HLL_REGISTERS; j++)
+            HLL_DENSE_SET_REGISTER(registers,j,raw[j]);
+    }
+}
+
 /* Compute the register histogram in the dense representation. */
 void hllDenseRegHisto(uint8_t *registers, int* reghisto) {
     int j;
 
+#ifdef HLL_HAVE_SIMD
+    if (hllSimdEnabled()) {
+        hllDenseMaxHistoAvx2(&registers,1,reghisto);
+        return;
+    }
+#endif
+
     /* Redis default is to use 16384 registers 6 bits each. The code works
      * with other values by modifying the defines, but for our target value
      * we take a faster path with unrolled loops. */
@@ -907,6 +1059,190 @@ int hllSparseAdd(robj *o, unsigned char *ele, size_t elesize) {
     return hllSparseSet(o,index,count);
 }
 
+/* Sparse representation writer used by hllSparseAddBatch(): runs of
+ * registers are appended with hllSparseWriterRun(), merging adjacent runs
+ * of the same value, and encoded with the shortest opcodes sequence. */
+typedef struct hllSparseWriter {
+    uint8_t *p;         /* Next byte to write. */
+    uint8_t *end;       /* End of the buffer: the size limit. */
+    long runlen;        /* Registers in the pending run. */
+    int runval;         /* Value of the pending run. */
+    int overflow;       /* Set if the buffer was too small. */
+} hllSparseWriter;
+
+/* Encode the pending run of the writer. */
+static void hllSparseWriterFlush(hllSparseWriter *w) {
+    long len = w->runlen;
+
+    while (len > 0 && !w->overflow) {
+        long n;
+
+        if (w->runval == 0) {
+            n = len > HLL_SPARSE_XZERO_MAX_LEN ? HLL_SPARSE_XZERO_MAX_LEN : len;
+            if (n > HLL_SPARSE_ZERO_MAX_LEN) {
+                if (w->end-w->p < 2) break;
+                HLL_SPARSE_XZERO_SET(w->p,n);
+                w->p += 2;
+            } else {
+                if (w->end-w->p < 1) break;
+                HLL_SPARSE_ZERO_SET(w->p,n);
+                w->p++;
+            }
+        } else {
+            n = len > HLL_SPARSE_VAL_MAX_LEN ? HLL_SPARSE_VAL_MAX_LEN : len;
+            if (w->end-w->p < 1) break;
+            HLL_SPARSE_VAL_SET(w->p,w->runval,n);
+            w->p++;
+        }
+        len -= n;
+    }
+    if (len > 0) w->overflow = 1;
+    w->runlen = 0;
+}
+
+/* Append 'len' registers set to 'val' to the writer. */
+static void hllSparseWriterRun(hllSparseWriter *w, int val, long len) {
+    if (len == 0) return;
+    if (w->runlen && w->runval != val) hllSparseWriterFlush(w);
+    w->runval = val;
+    w->runlen += len;
+}
+
+/* Compare the register updates computed by hllSparseAddBatch(). */
+static int hllUpdateCompare(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+/* "Add" the 'numele' elements to the sparse HLL 'o' at once. Calling
+ * hllSparseAdd() for every element rewrites the sparse representation for
+ * almost every element: here all the elements are hashed first, the
+ * resulting updates are sorted by register, and the new representation is
+ * produced in a single pass merging the old opcodes with the updates.
+ *
+ * The size of the new representation is computed while it is produced:
+ * as soon as it exceeds server.hll_sparse_max_bytes, or if a register
+ * requires a value not representable in the sparse representation, the
+ * HLL is promoted to the dense representation and the updates are applied
+ * there instead.
+ *
+ * The return value is the same of hllSparseAdd(): 1 if at least one
+ * register was updated, 0 if no register was updated, -1 if the sparse
+ * representation is invalid. */
+int hllSparseAddBatch(robj *o, robj **elements, int numele) {
+    uint32_t *updates = zmalloc(sizeof(uint32_t)*numele);
+    uint8_t newsparse[HLL_REGISTERS+HLL_SPARSE_VAL_MAX_LEN];
+    uint8_t *p, *end;
+    hllSparseWriter w;
+    int j, u, numupdates, maxcount = 0, updated = 0;
+    long idx, limit;
+
+    /* Hash every element into an update (index << 8 | count), then sort
+     * them so that the updates of the same register are adjacent, with the
+     * greatest count last. */
+    for (j = 0; j < numele; j++) {
+        long index;
+        uint8_t count = hllPatLen(elements[j]->ptr,sdslen(elements[j]->ptr),
+                                  &index);
+
+        updates[j] = ((uint32_t)index << 8) | count;
+        if (count > maxcount) maxcount = count;
+    }
+    qsort(updates,numele,sizeof(uint32_t),hllUpdateCompare);
+    for (j = 0, numupdates = 0; j < numele; j++) {
+        if (j+1 < numele && (updates[j]>>8) == (updates[j+1]>>8)) continue;
+        updates[numupdates++] = updates[j];
+    }
+
+    /* Every group of at most HLL_SPARSE_VAL_MAX_LEN registers takes at
+     * least one byte: if the projected size is already too big, promote
+     * without even trying. */
+    limit = (long)server.hll_sparse_max_bytes - (long)HLL_HDR_SIZE;
+    if (limit > HLL_REGISTERS) limit = HLL_REGISTERS;
+    if (maxcount > HLL_SPARSE_VAL_MAX_VALUE ||
+        numupdates/HLL_SPARSE_VAL_MAX_LEN > limit) goto promote;
+
+    w.p = newsparse;
+    w.end = newsparse + (limit > 0 ? limit : 0);
+    w.runlen = 0;
+    w.runval = 0;
+    w.overflow = 0;
+    p = ((uint8_t*)o->ptr) + HLL_HDR_SIZE;
+    end = ((uint8_t*)o->ptr) + sdslen(o->ptr);
+    idx = 0;
+    u = 0;
+    while (p < end && !w.overflow) {
+        long runlen, first;
+        int regval;
+
+        if (HLL_SPARSE_IS_ZERO(p)) {
+            runlen = HLL_SPARSE_ZERO_LEN(p);
+            regval = 0;
+            p++;
+        } else if (HLL_SPARSE_IS_XZERO(p)) {
+            runlen = HLL_SPARSE_XZERO_LEN(p);
+            regval = 0;
+            p += 2;
+        } else {
+            runlen = HLL_SPARSE_VAL_LEN(p);
+            regval = HLL_SPARSE_VAL_VALUE(p);
+            p++;
+        }
+        if (idx+runlen > HLL_REGISTERS) break; /* Overflow. */
+
+        /* Split the run at every register updated to a greater value. */
+        first = idx;
+        idx += runlen;
+        for (; u < numupdates && (long)(updates[u]>>8) < idx; u++) {
+            long index = updates[u]>>8;
+            int count = updates[u]&0xff;
+
+            if (count <= regval) continue;
+            hllSparseWriterRun(&w,regval,index-first);
+            hllSparseWriterRun(&w,count,1);
+            first = index+1;
+            updated = 1;
+        }
+        hllSparseWriterRun(&w,regval,idx-first);
+    }
+    hllSparseWriterFlush(&w);
+    if (w.overflow) goto promote;
+
+    /* If the sparse representation was valid, we expect to find idx
+     * set to HLL_REGISTERS. */
+    if (idx != HLL_REGISTERS) {
+        zfree(updates);
+        return -1;
+    }
+
+    if (updated) {
+        /* Replace the old opcodes with the new ones. */
+        long delta = (w.p-newsparse) - (long)(sdslen(o->ptr)-HLL_HDR_SIZE);
+
+        if (delta > 0) o->ptr = sdsMakeRoomFor(o->ptr,delta);
+        memcpy(((uint8_t*)o->ptr)+HLL_HDR_SIZE,newsparse,w.p-newsparse);
+        sdsIncrLen(o->ptr,delta);
+        HLL_INVALIDATE_CACHE((struct hllhdr*)o->ptr);
+    }
+    zfree(updates);
+    return updated;
+
+promote: /* Promote to dense representation. */
+    if (hllSparseToDense(o) == C_ERR) {
+        zfree(updates);
+        return -1; /* Corrupted HLL. */
+    }
+    updated = 0;
+    for (u = 0; u < numupdates; u++) {
+        struct hllhdr *hdr = o->ptr;
+
+        if (hllDenseSet(hdr->registers,updates[u]>>8,updates[u]&0xff))
+            updated = 1;
+    }
+    zfree(updates);
+    return updated;
+}
+
 /* Compute the register histogram in the sparse representation. */
 void hllSparseRegHisto(uint8_t *sparse, int sparselen, int *invalid, int* reghisto) {
     int idx = 0, runlen, regval;
@@ -999,6 +1335,27 @@ double hllTau(double x) {
     return z / 3;
 }
 
+/* Return the approximated cardinality given the histogram of the values of
+ * the registers, as computed by the *RegHisto() functions. */
+uint64_t hllEstimate(int *reghisto) {
+    double m = HLL_REGISTERS;
+    double E;
+    int j;
+
+    /* Estimate cardinality form register histogram. See:
+     * "New cardinality estimation algorithms for HyperLogLog sketches"
+     * Otmar Ertl, arXiv:1702.01284 */
+    double z = m * hllTau((m-reghisto[HLL_Q+1])/(double)m);
+    for (j = HLL_Q; j >= 1; --j) {
+        z += reghisto[j];
+        z *= 0.5;
+    }
+    z += m * hllSigma(reghisto[0]/(double)m);
+    E = llroundl(HLL_ALPHA_INF*m*m/z);
+
+    return (uint64_t) E;
+}
+
 /* Return the approximated cardinality of the set based on the harmonic
  * mean of the registers values. 'hdr' points to the start of the SDS
  * representing the String object holding the HLL representation.
@@ -1011,9 +1368,6 @@ double hllTau(double x) {
  * This is useful in order to speedup PFCOUNT when called against multiple
  * keys (no need to work with 6-bit integers encoding). */
 uint64_t hllCount(struct hllhdr *hdr, int *invalid) {
-    double m = HLL_REGISTERS;
-    double E;
-    int j;
     /* Note that reghisto size could be just HLL_Q+2, becuase HLL_Q+1 is
      * the maximum frequency of the "000...1" sequence the hash function is
      * able to return. However it is slow to check for sanity of the
@@ -1032,19 +1386,7 @@ uint64_t hllCount(struct hllhdr *hdr, int *invalid) {
     } else {
         serverPanic("Unknown HyperLogLog encoding in hllCount()");
     }
-
-    /* Estimate cardinality form register histogram. See:
-     * "New cardinality estimation algorithms for HyperLogLog sketches"
-     * Otmar Ertl, arXiv:1702.01284 */
-    double z = m * hllTau((m-reghisto[HLL_Q+1])/(double)m);
-    for (j = HLL_Q; j >= 1; --j) {
-        z += reghisto[j];
-        z *= 0.5;
-    }
-    z += m * hllSigma(reghisto[0]/(double)m);
-    E = llroundl(HLL_ALPHA_INF*m*m/z);
-
-    return (uint64_t) E;
+    return hllEstimate(reghisto);
 }
 
 /* Call hllDenseAdd() or hllSparseAdd() according to the HLL encoding. */
@@ -1072,6 +1414,12 @@ int hllMerge(uint8_t *max, robj *hll) {
     if (hdr->encoding == HLL_DENSE) {
         uint8_t val;
 
+#ifdef HLL_HAVE_SIMD
+        if (hllSimdEnabled()) {
+            hllDenseMergeAvx2(max,hdr->registers);
+            return C_OK;
+        }
+#endif
         for (i = 0; i < HLL_REGISTERS; i++) {
             HLL_DENSE_GET_REGISTER(val,hdr->registers,i);
             if (val > max[i]) max[i] = val;
@@ -1194,18 +1542,30 @@ void pfaddCommand(client *c) {
         if (isHLLObjectOrReply(c,o) != C_OK) return;
         o = dbUnshareStringValue(c->db,c->argv[1],o);
     }
-    /* Perform the low level ADD operation for every element. */
-    for (j = 2; j < c->argc; j++) {
-        int retval = hllAdd(o, (unsigned char*)c->argv[j]->ptr,
-                               sdslen(c->argv[j]->ptr));
-        switch(retval) {
-        case 1:
-            updated++;
-            break;
-        case -1:
+    /* Perform the low level ADD operation for every element. Many elements
+     * added to a sparse HLL are added all together. */
+    hdr = o->ptr;
+    if (hdr->encoding == HLL_SPARSE && c->argc-2 >= HLL_SPARSE_BATCH_MIN) {
+        int retval = hllSparseAddBatch(o,c->argv+2,c->argc-2);
+
+        if (retval == -1) {
             addReplySds(c,sdsnew(invalid_hll_err));
             return;
         }
+        updated += retval;
+    } else {
+        for (j = 2; j < c->argc; j++) {
+            int retval = hllAdd(o, (unsigned char*)c->argv[j]->ptr,
+                                   sdslen(c->argv[j]->ptr));
+            switch(retval) {
+            case 1:
+                updated++;
+                break;
+            case -1:
+                addReplySds(c,sdsnew(invalid_hll_err));
+                return;
+            }
+        }
     }
     hdr = o->ptr;
     if (updated) {
@@ -1229,26 +1589,52 @@ void pfcountCommand(client *c) {
      * the cardinality of the merge of the N HLLs specified. */
     if (c->argc > 2) {
         uint8_t max[HLL_HDR_SIZE+HLL_REGISTERS], *registers;
-        int j;
+        robj **hlls = zmalloc(sizeof(robj*)*(c->argc-1));
+        int j, numhlls = 0, alldense = 1;
 
-        /* Compute an HLL with M[i] = MAX(M[i]_j). */
-        memset(max,0,sizeof(max));
-        hdr = (struct hllhdr*) max;
-        hdr->encoding = HLL_RAW; /* Special internal-only encoding. */
-        registers = max + HLL_HDR_SIZE;
         for (j = 1; j < c->argc; j++) {
             /* Check type and size. */
             robj *o = lookupKeyRead(c->db,c->argv[j]);
             if (o == NULL) continue; /* Assume empty HLL for non existing var.*/
-            if (isHLLObjectOrReply(c,o) != C_OK) return;
+            if (isHLLObjectOrReply(c,o) != C_OK) {
+                zfree(hlls);
+                return;
+            }
+            hdr = o->ptr;
+            if (hdr->encoding != HLL_DENSE) alldense = 0;
+            hlls[numhlls++] = o;
+        }
 
+        /* Fast path: if all the HLLs are dense, compute the histogram of
+         * the union directly from their registers. */
+        if (numhlls && alldense) {
+            uint8_t **dense = zmalloc(sizeof(uint8_t*)*numhlls);
+            int reghisto[64] = {0};
+
+            for (j = 0; j < numhlls; j++)
+                dense[j] = ((struct hllhdr*)hlls[j]->ptr)->registers;
+            hllDenseMaxHisto(dense,numhlls,reghisto);
+            zfree(dense);
+            zfree(hlls);
+            addReplyLongLong(c,hllEstimate(reghisto));
+            return;
+        }
+
+        /* Compute an HLL with M[i] = MAX(M[i]_j). */
+        memset(max,0,sizeof(max));
+        hdr = (struct hllhdr*) max;
+        hdr->encoding = HLL_RAW; /* Special internal-only encoding. */
+        registers = max + HLL_HDR_SIZE;
+        for (j = 0; j < numhlls; j++) {
             /* Merge with this HLL with our 'max' HHL by setting max[i]
              * to MAX(max[i],hll[i]). */
-            if (hllMerge(registers,o) == C_ERR) {
+            if (hllMerge(registers,hlls[j]) == C_ERR) {
+                zfree(hlls);
                 addReplySds(c,sdsnew(invalid_hll_err));
                 return;
             }
         }
+        zfree(hlls);
 
         /* Compute cardinality of the resulting set. */
         addReplyLongLong(c,hllCount(hdr,NULL));
@@ -1360,13 +1746,20 @@ void pfmergeCommand(client *c) {
     }
 
     /* Write the resulting HLL to the destination HLL registers and
-     * invalidate the cached value. */
-    for (j = 0; j < HLL_REGISTERS; j++) {
-        if (max[j] == 0) continue;
-        hdr = o->ptr;
-        switch(hdr->encoding) {
-        case HLL_DENSE: hllDenseSet(hdr->registers,j,max[j]); break;
-        case HLL_SPARSE: hllSparseSet(o,j,max[j]); break;
+     * invalidate the cached value. A dense destination is merged into
+     * 'max' and then written back all at once. */
+    hdr = o->ptr;
+    if (hdr->encoding == HLL_DENSE) {
+        hllMerge(max,o);
+        hllDensePack(hdr->registers,max);
+    } else {
+        for (j = 0; j < HLL_REGISTERS; j++) {
+            if (max[j] == 0) continue;
+            hdr = o->ptr;
+            switch(hdr->encoding) {
+            case HLL_DENSE: hllDenseSet(hdr->registers,j,max[j]); break;
+            case HLL_SPARSE: hllSparseSet(o,j,max[j]); break;
+            }
         }
     }
     hdr = o->ptr; /* o->ptr may be different now, as a side effect of
@@ -1421,7 +1814,57 @@ void pfselftestCommand(client *c) {
         }
     }
 
-    /* Test 2: approximation error.
+    /* Test 2: vectorized kernels.
+     * The histograms and the merge of dense registers computed with the
+     * vectorized kernels must be the same computed by the scalar code, and
+     * packing raw registers must produce the dense representation. */
+    int simd = hllSimdEnabled();
+    uint8_t packed[HLL_DENSE_SIZE-HLL_HDR_SIZE+1]; /* +1 for the GET macro. */
+    uint8_t *dense[2] = {hdr->registers,packed};
+    robj denseobj;
+
+    initStaticStringObject(denseobj,bitcounters);
+    for (j = 0; j < HLL_TEST_CYCLES/10; j++) {
+        uint8_t max[2][HLL_REGISTERS];
+        int histo[2][128], k;
+
+        /* Random registers, with some blocks of zero registers. */
+        for (i = 0; i < HLL_REGISTERS; i++) {
+            unsigned int r = (i/32) % 3 ? rand() & HLL_REGISTER_MAX : 0;
+
+            HLL_DENSE_SET_REGISTER(hdr->registers,i,r);
+            bytecounters[i] = rand() & HLL_REGISTER_MAX;
+        }
+        hllDensePack(packed,bytecounters);
+        for (i = 0; i < HLL_REGISTERS; i++) {
+            unsigned int val;
+
+            HLL_DENSE_GET_REGISTER(val,packed,i);
+            if (val != bytecounters[i]) {
+                addReplyErrorFormat(c,
+                    "TESTFAILED Packed register %d should be %d but is %d",
+                    i, (int) bytecounters[i], (int) val);
+                goto cleanup;
+            }
+        }
+        for (k = 0; k < 2; k++) {
+            hllSimd = k ? simd : 0;
+            memset(histo[k],0,sizeof(histo[k]));
+            hllDenseRegHisto(hdr->registers,histo[k]);
+            hllDenseMaxHisto(dense,2,histo[k]+64);
+            memcpy(max[k],bytecounters,HLL_REGISTERS);
+            hllMerge(max[k],&denseobj);
+        }
+        hllSimd = simd;
+        if (memcmp(histo[0],histo[1],sizeof(histo[0])) ||
+            memcmp(max[0],max[1],sizeof(max[0])))
+        {
+            addReplyError(c, "TESTFAILED vectorized/scalar disagree");
+            goto cleanup;
+        }
+    }
+
+    /* Test 3: approximation error.
      * The test adds unique elements and check that the estimated value
      * is always reasonable bounds.
      *
@@ -11,6 +11,10 @@
 #include "zmalloc.h"
 #include "endianconv.h"
 
+#if defined(__SSE2__) && (BYTE_ORDER == LITTLE_ENDIAN)
+#include <emmintrin.h>
+#endif
+
 /* Note that these encodings are ordered, so: INTSET_ENC_INT16 < INTSET_ENC_INT32 < INTSET_ENC_INT64. */
 /* 对应的整数占据字节个数的宏定义 */
 #define INTSET_ENC_INT16 (sizeof(int16_t))
@@ -100,74 +104,78 @@ static intset *intsetResize(intset *is, uint32_t len) {
     return is;
 }
 
+/* The binary search in intsetSearch() stops once the range is down to this
+ * many elements, that are then scanned linearly: comparing a few adjacent
+ * values, with SIMD instructions where available, is faster than the last
+ * hard to predict steps of the binary search. */
+#define INTSET_LINEAR_SEARCH 16
+
+/* Return how many of the 'count' elements starting at 'pos' are smaller
+ * than 'value'. 'value' must fit the encoding 'enc'. */
+static uint32_t _intsetCountLess(intset *is, uint32_t pos, uint32_t count, int64_t value, uint8_t enc) {
+    uint32_t j = 0, less = 0;
+
+#if defined(__SSE2__) && (BYTE_ORDER == LITTLE_ENDIAN)
+    if (enc == INTSET_ENC_INT16) {
+        const int16_t *p = ((int16_t*)is->contents)+pos;
+        __m128i v = _mm_set1_epi16((int16_t)value);
+        for (; j+8 <= count; j += 8) {
+            __m128i x = _mm_loadu_si128((const __m128i*)(p+j));
+            less += __builtin_popcount(_mm_movemask_epi8(_mm_cmplt_epi16(x,v)))/2;
+        }
+    } else if (enc == INTSET_ENC_INT32) {
+        const int32_t *p = ((int32_t*)is->contents)+pos;
+        __m128i v = _mm_set1_epi32((int32_t)value);
+        for (; j+4 <= count; j += 4) {
+            __m128i x = _mm_loadu_si128((const __m128i*)(p+j));
+            less += __builtin_popcount(_mm_movemask_epi8(_mm_cmplt_epi32(x,v)))/4;
+        }
+    }
+#endif
+	//处理剩余的元素或者不支持SIMD指令的情况
+    for (; j < count; j++)
+        less += _intsetGetEncoded(is,pos+j,enc) < value;
+    return less;
+}
+
 /* Search for the position of "value". Return 1 when the value was found and
  * sets "pos" to the position of the value within the intset. Return 0 when
  * the value is not present in the intset and sets "pos" to the position where "value" can be inserted. */
 /* 在整数集合中查找给定整数是否在整数集合中,如果存在获取其对应的索引位置,如果不存在就获取对应的本元素的插入位置 */
-/* 此处使用的是二分查找法 因为整数集合中的元素是唯一的且按照顺序进行排序的 */
+/* 此处先使用二分查找法缩小范围,然后在少量的元素中进行线性查找 因为整数集合中的元素是唯一的且按照顺序进行排序的 */
 static uint8_t intsetSearch(intset *is, int64_t value, uint32_t *pos) {
-	//首先初始化 最小和最大 以及中间位置的值
-    int min = 0, max = intrev32ifbe(is->length)-1, mid = -1;
-    int64_t cur = -1;
+    uint32_t len = intrev32ifbe(is->length), min = 0, max = len;
+    uint8_t enc = intrev32ifbe(is->encoding);
 
     /* The value can never be found when the set is empty */
 	//特殊处理整数集合中没有元素或者给定的整数大于或者小于整数集合中的所有元素的特殊情况
-    if (intrev32ifbe(is->length) == 0) {
-        if (pos) 
-			//设置需要插入的位置为0索引位置
-			*pos = 0;
-		//返回本整数集合中不存在给定整数的标识
+    if (len == 0) {
+        if (pos) *pos = 0;
         return 0;
     } else {
         /* Check for the case where we know we cannot find the value, but do know the insert position. */
-        if (value > _intsetGet(is,max)) {
-            if (pos) 
-				//设置插入位置为当前整数集合的元素个数 即索引位置就是 最后一个元素的后面
-				*pos = intrev32ifbe(is->length);
-			//返回本整数集合中不存在给定整数的标识
+        if (value > _intsetGetEncoded(is,len-1,enc)) {
+            if (pos) *pos = len;
             return 0;
-        } else if (value < _intsetGet(is,0)) {
-            if (pos) 
-				//设置插入位置为开始位置
-				*pos = 0;
-			//返回本整数集合中不存在给定整数的标识
+        } else if (value < _intsetGetEncoded(is,0,enc)) {
+            if (pos) *pos = 0;
             return 0;
         }
     }
-	
-	//排除上面的特殊情况下 进行二分查找元素是否在集合中,同时获取对应的索引位置
-    while(max >= min) {
-		//获取最新的中间位置
-        mid = ((unsigned int)min + (unsigned int)max) >> 1;
-		//获取对应的中间位置的整数
-        cur = _intsetGet(is,mid);
-	 	//分析比较给定的整数与中间位置整数的大小
-        if (value > cur) {
-			//设置新的最小索引位置
+
+	//二分查找缩小范围 [min,max) 之前的元素都小于给定的整数,之后的元素都大于等于给定的整数
+    while (max-min > INTSET_LINEAR_SEARCH) {
+        uint32_t mid = (min+max) >> 1;
+        if (_intsetGetEncoded(is,mid,enc) < value)
             min = mid+1;
-        } else if (value < cur) {
-        	//设置新的最大索引位置
-            max = mid-1;
-        } else {
-			//此处说明已经找到对应的整数
-            break;
-        }
+        else
+            max = mid;
     }
 
-	//通过检测当前找到的整数与需要查找的整数的大小来进一步确认整数集合中是否存在本整数
-    if (value == cur) {
-        if (pos) 
-			//设置返回找到的索引位置
-			*pos = mid;
-		//返回本整数集合中存在给定整数的标识
-        return 1;
-    } else {
-        if (pos) 
-			//设置返回能够插入本整数的最小索引位置
-			*pos = min;
-		//返回本整数集合中不存在给定整数的标识
-        return 0;
-    }
+	//统计剩余范围内小于给定整数的元素个数,即可得到给定整数应该处于的索引位置
+    min += _intsetCountLess(is,min,max-min,value,enc);
+    if (pos) *pos = min;
+    return min < len && _intsetGetEncoded(is,min,enc) == value;
 }
 
 /* Upgrades the intset to a larger encoding and inserts the given integer. */
@@ -343,6 +351,87 @@ uint8_t intsetGet(intset *is, uint32_t pos, int64_t *value) {
     return 0;
 }
 
+/* When intersecting, the values are searched in the intset galloping if
+ * the intset has more than this many times their number of elements, and
+ * the two are merged otherwise. */
+#define INTSET_GALLOP_RATIO 8
+
+/* Intersect the 'len' sorted and unique values in 'values' with the
+ * intset 'is'. The common values are stored, sorted, at the start of
+ * 'values' itself, and their number returned.
+ *
+ * When the intset is much bigger than 'values', every value is searched
+ * with an exponential search starting at the position of the previous one,
+ * so the cost is O(len*log(intsetLen/len)) instead of the O(len*log(intsetLen))
+ * of independent lookups. Otherwise the two sequences are just merged in
+ * O(len+intsetLen). */
+/* 将给定的有序整数数组与整数集合求交集,交集的结果存储在给定的数组中,返回交集元素的个数 */
+uint32_t intsetIntersect(intset *is, int64_t *values, uint32_t len) {
+    uint32_t islen = intrev32ifbe(is->length), i = 0, j = 0, n = 0;
+    uint8_t enc = intrev32ifbe(is->encoding);
+
+    if (len == 0 || islen == 0) return 0;
+
+    if ((uint64_t)len*INTSET_GALLOP_RATIO < islen) {
+        for (i = 0; i < len && j < islen; i++) {
+            int64_t v = values[i];
+            if (_intsetGetEncoded(is,j,enc) < v) {
+                /* Find 'lo' < 'hi' with is[lo] < v and is[hi] >= v (or
+                 * 'hi' past the end) doubling the step, then search the
+                 * first element >= v between them. */
+                uint32_t lo = j, hi, step = 1;
+                while (lo+step < islen && _intsetGetEncoded(is,lo+step,enc) < v) {
+                    lo += step;
+                    step <<= 1;
+                }
+                hi = (lo+step < islen) ? lo+step : islen;
+                lo++;
+                while (lo < hi) {
+                    uint32_t mid = (lo+hi) >> 1;
+                    if (_intsetGetEncoded(is,mid,enc) < v)
+                        lo = mid+1;
+                    else
+                        hi = mid;
+                }
+                j = lo;
+            }
+            if (j < islen && _intsetGetEncoded(is,j,enc) == v) values[n++] = v;
+        }
+    } else {
+        while (i < len && j < islen) {
+            int64_t v = _intsetGetEncoded(is,j,enc);
+            if (values[i] < v) {
+                i++;
+            } else if (values[i] > v) {
+                j++;
+            } else {
+                values[n++] = v;
+                i++;
+                j++;
+            }
+        }
+    }
+    return n;
+}
+
+/* Create an intset holding the 'len' sorted and unique 'values'. */
+/* 根据给定的有序且唯一的整数数组创建对应的整数集合 */
+intset *intsetNewFromSorted(const int64_t *values, uint32_t len) {
+    intset *is = intsetNew();
+    if (len == 0) return is;
+
+    /* The values are sorted: the first and the last one need the largest
+     * encoding. */
+    uint8_t enc = _intsetValueEncoding(values[0]);
+    if (_intsetValueEncoding(values[len-1]) > enc)
+        enc = _intsetValueEncoding(values[len-1]);
+    is->encoding = intrev32ifbe(enc);
+    is = intsetResize(is,len);
+    for (uint32_t j = 0; j < len; j++) _intsetSet(is,j,values[j]);
+    is->length = intrev32ifbe(len);
+    return is;
+}
+
 /* Return intset length */
 /* 获取给定整数集合中元素的个数 */
 uint32_t intsetLen(const intset *is) {
@@ -545,6 +634,50 @@ int intsetTest(int argc, char **argv) {
                num,size,usec()-start);
     }
 
+    printf("Search boundaries: "); {
+        for (int bits = 8; bits <= 24; bits += 16) {
+            is = createSet(bits,1000);
+            uint32_t len = intsetLen(is), pos;
+            for (uint32_t j = 0; j < len; j++) {
+                int64_t v = _intsetGet(is,j);
+                assert(intsetSearch(is,v,&pos) && pos == j);
+                if (j == 0 || _intsetGet(is,j-1) != v-1) {
+                    assert(!intsetSearch(is,v-1,&pos) && pos == j);
+                }
+            }
+            zfree(is);
+        }
+        ok();
+    }
+
+    printf("Intersection and creation from sorted values: "); {
+        for (int round = 0; round < 100; round++) {
+            intset *a = createSet(12,rand() % 200);
+            intset *b = createSet(12,rand() % 4000);
+            uint32_t alen = intsetLen(a), n, expected = 0;
+            int64_t *values = zmalloc(sizeof(int64_t)*(alen+1));
+            for (uint32_t j = 0; j < alen; j++) {
+                values[j] = _intsetGet(a,j);
+                expected += intsetFind(b,values[j]);
+            }
+            n = intsetIntersect(b,values,alen);
+            assert(n == expected);
+            for (uint32_t j = 0; j < n; j++) {
+                assert(intsetFind(a,values[j]) && intsetFind(b,values[j]));
+                if (j) assert(values[j-1] < values[j]);
+            }
+            values[n++] = 5000000000LL; /* Force the int64 encoding. */
+            intset *c = intsetNewFromSorted(values,n);
+            assert(intsetLen(c) == n && intrev32ifbe(c->encoding) == INTSET_ENC_INT64);
+            checkConsistency(c);
+            zfree(a);
+            zfree(b);
+            zfree(c);
+            zfree(values);
+        }
+        ok();
+    }
+
     printf("Stress add+delete: "); {
         int i, v1, v2;
         is = intsetNew();
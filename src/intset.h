@@ -25,6 +25,8 @@ int64_t intsetRandom(intset *is);//获取整数集合中随机位置的一个整
 uint8_t intsetGet(intset *is, uint32_t pos, int64_t *value);//获取整数集合中给定位置的整数值
 uint32_t intsetLen(const intset *is);//获取给定整数集合中元素的个数
 size_t intsetBlobLen(intset *is);//获取给定整数集合占据的总的字节个数 
+uint32_t intsetIntersect(intset *is, int64_t *values, uint32_t len);//将给定的有序整数数组与整数集合求交集
+intset *intsetNewFromSorted(const int64_t *values, uint32_t len);//根据有序且唯一的整数数组创建整数集合
 
 #ifdef REDIS_TEST
 int intsetTest(int argc, char *argv[]);
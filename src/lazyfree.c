@@ -35,17 +35,27 @@ size_t lazyfreeGetFreeEffort(robj *obj) {
     } else if (obj->type == OBJ_SET && obj->encoding == OBJ_ENCODING_HT) {
         dict *ht = obj->ptr;
         return dictSize(ht);
-    } else if (obj->type == OBJ_ZSET && obj->encoding == OBJ_ENCODING_SKIPLIST){
+    } else if (obj->type == OBJ_ZSET && obj->encoding == OBJ_ENCODING_BTREE){
         zset *zs = obj->ptr;
-        return zs->zsl->length;
+        return zs->zbt->length;
     } else if (obj->type == OBJ_HASH && obj->encoding == OBJ_ENCODING_HT) {
         dict *ht = obj->ptr;
         return dictSize(ht);
+    } else if (obj->type == OBJ_STRING && obj->encoding == OBJ_ENCODING_ROARING) {
+        rbm *r = obj->ptr;
+        return r->count;
     } else {
         return 1; /* Everything else is a single allocation. */
     }
 }
 
+/* Drop the references that global caches of the main thread hold to the
+ * internals of 'o', before it is freed by the lazyfree thread. */
+static void lazyfreeDetachObject(robj *o) {
+    if (o->type == OBJ_LIST && o->encoding == OBJ_ENCODING_QUICKLIST)
+        quicklistNodeCacheReset(o->ptr);
+}
+
 /* Delete a key, value, and associated expiration entry if any, from the DB.
  * If there are enough allocations to free the value object may be put into
  * a lazy free list instead of being freed synchronously. The lazy free list
@@ -60,7 +70,9 @@ int dbAsyncDelete(redisDb *db, robj *key) {
     /* If the value is composed of a few allocations, to free in a lazy way
      * is actually just slower... So under a certain limit we just free
      * the object synchronously. */
-    dictEntry *de = dictUnlink(db->dict,key->ptr);
+    int didx = dbDictIndex(db,key->ptr);
+    dict *d = db->dict[didx];
+    dictEntry *de = dictUnlink(d,key->ptr);
     if (de) {
         robj *val = dictGetVal(de);
         size_t free_effort = lazyfreeGetFreeEffort(val);
@@ -73,18 +85,18 @@ int dbAsyncDelete(redisDb *db, robj *key) {
          * objects, and then call dbDelete(). In this case we'll fall
          * through and reach the dictFreeUnlinkedEntry() call, that will be equivalent to just calling decrRefCount(). */
         if (free_effort > LAZYFREE_THRESHOLD && val->refcount == 1) {
+            lazyfreeDetachObject(val);
             atomicIncr(lazyfree_objects,1);
             bioCreateBackgroundJob(BIO_LAZY_FREE,val,NULL,NULL);
-            dictSetVal(db->dict,de,NULL);
+            dictSetVal(d,de,NULL);
         }
     }
 
     /* Release the key-val pair, or just the key if we set the val
      * field to NULL in order to lazy free it later. */
     if (de) {
-        dictFreeUnlinkedEntry(db->dict,de);
-        if (server.cluster_enabled) 
-			slotToKeyDel(key);
+        dictFreeUnlinkedEntry(d,de);
+        dbUpdateDictSize(db,didx,-1);
         return 1;
     } else {
         return 0;
@@ -95,6 +107,7 @@ int dbAsyncDelete(redisDb *db, robj *key) {
 void freeObjAsync(robj *o) {
     size_t free_effort = lazyfreeGetFreeEffort(o);
     if (free_effort > LAZYFREE_THRESHOLD && o->refcount == 1) {
+        lazyfreeDetachObject(o);
         atomicIncr(lazyfree_objects,1);
         bioCreateBackgroundJob(BIO_LAZY_FREE,o,NULL,NULL);
     } else {
@@ -103,22 +116,20 @@ void freeObjAsync(robj *o) {
 }
 
 /* Empty a Redis DB asynchronously. What the function does actually is to
- * create a new empty set of hash tables and scheduling the old ones for lazy freeing. */
+ * create a new empty set of hash tables and scheduling the old ones for lazy freeing.
+ * The old keyspace dicts are passed to the background thread inside a
+ * copy of the DB structure, since they are more than a single pointer. */
 void emptyDbAsync(redisDb *db) {
-    dict *oldht1 = db->dict, *oldht2 = db->expires;
-    db->dict = dictCreate(&dbDictType,NULL);
+    redisDb *olddb = zmalloc(sizeof(*olddb));
+    olddb->dict = db->dict;
+    olddb->dict_count = db->dict_count;
+    olddb->slot_sizes = db->slot_sizes;
+    olddb->expires = db->expires;
+    atomicIncr(lazyfree_objects,dbSize(olddb));
+    quicklistNodeCacheReset(NULL);
+    dbCreateDicts(db,olddb->dict_count);
     db->expires = dictCreate(&keyptrDictType,NULL);
-    atomicIncr(lazyfree_objects,dictSize(oldht1));
-    bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,oldht1,oldht2);
-}
-
-/* Empty the slots-keys map of Redis CLuster by creating a new empty one and scheduiling the old for lazy freeing. */
-void slotToKeyFlushAsync(void) {
-    rax *old = server.cluster->slots_to_keys;
-    server.cluster->slots_to_keys = raxNew();
-    memset(server.cluster->slots_keys_count,0,sizeof(server.cluster->slots_keys_count));
-    atomicIncr(lazyfree_objects,old->numele);
-    bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,NULL,old);
+    bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,olddb,olddb->expires);
 }
 
 /* Release objects from the lazyfree thread. It's just decrRefCount()
@@ -128,25 +139,17 @@ void lazyfreeFreeObjectFromBioThread(robj *o) {
     atomicDecr(lazyfree_objects,1);
 }
 
-/* Release a database from the lazyfree thread. The 'db' pointer is the
- * database which was substitutied with a fresh one in the main thread
- * when the database was logically deleted. 'sl' is a skiplist used by
- * Redis Cluster in order to take the hash slots -> keys mapping. This
- * may be NULL if Redis Cluster is disabled. */
-void lazyfreeFreeDatabaseFromBioThread(dict *ht1, dict *ht2) {
-    size_t numkeys = dictSize(ht1);
-    dictRelease(ht1);
-    dictRelease(ht2);
+/* Release a database from the lazyfree thread. The 'olddb' pointer is a
+ * copy of the database which was substitutied with a fresh one in the main
+ * thread when the database was logically deleted, holding the old keyspace
+ * dicts, and 'expires' is its old expires dict. */
+void lazyfreeFreeDatabaseFromBioThread(redisDb *olddb, dict *expires) {
+    size_t numkeys = dbSize(olddb);
+    dbReleaseDicts(olddb->dict,olddb->dict_count,olddb->slot_sizes);
+    dictRelease(expires);
+    zfree(olddb);
     atomicDecr(lazyfree_objects,numkeys);
 }
 
-/* Release the skiplist mapping Redis Cluster keys to slots in the
- * lazyfree thread. */
-void lazyfreeFreeSlotsMapFromBioThread(rax *rt) {
-    size_t len = rt->numele;
-    raxFree(rt);
-    atomicDecr(lazyfree_objects,len);
-}
-
 
 
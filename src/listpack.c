@@ -801,3 +801,192 @@ unsigned char *lpSeek(unsigned char *lp, long index) {
     }
 }
 
+
+/* Insert the specified element 'ele' of length 'size' at the head of the
+ * listpack. It is implemented in terms of lpInsert(), so the return value is
+ * the same as lpInsert(). */
+unsigned char *lpPrepend(unsigned char *lp, unsigned char *ele, uint32_t size) {
+    unsigned char *p = lpFirst(lp);
+    if (p == NULL) return lpAppend(lp,ele,size);
+    return lpInsert(lp,ele,size,p,LP_BEFORE,NULL);
+}
+
+/* Get the value of the element pointed by 'p' in the same form ziplistGet()
+ * uses: if the element is a string '*sval' is set to the string (pointing
+ * inside the listpack) and '*slen' to its length, otherwise '*sval' is set to
+ * NULL and the integer value is stored in '*lval'. Returns 0 if 'p' is NULL,
+ * otherwise 1. */
+int lpGetValue(unsigned char *p, unsigned char **sval, unsigned int *slen,
+               long long *lval)
+{
+    int64_t v;
+    unsigned char *s;
+
+    if (p == NULL) return 0;
+    s = lpGet(p,&v,NULL);
+    if (s) {
+        if (sval) *sval = s;
+        if (slen) *slen = v;
+    } else {
+        if (sval) *sval = NULL;
+        if (lval) *lval = v;
+    }
+    return 1;
+}
+
+/* Return 1 if the element pointed by 'p' is equal to the string 's' of
+ * length 'slen', otherwise 0. Integer encoded elements are only equal to
+ * strings that listpack would encode as the same integer. */
+int lpCompare(unsigned char *p, unsigned char *s, uint32_t slen) {
+    int64_t v, sv;
+    unsigned char *vstr = lpGet(p,&v,NULL);
+
+    if (vstr) return (uint32_t)v == slen && memcmp(vstr,s,slen) == 0;
+    if (!lpStringToInt64((const char*)s,slen,&sv)) return 0;
+    return v == sv;
+}
+
+/* Find the element equal to the string 's' of length 'slen' starting the
+ * search from the element pointed by 'p', and return a pointer to it, or
+ * NULL if no such element exists. 'skip' elements are skipped between
+ * every comparison, so that for instance field/value pairs can be searched
+ * just comparing the fields. */
+unsigned char *lpFind(unsigned char *lp, unsigned char *p, unsigned char *s,
+                      uint32_t slen, unsigned int skip)
+{
+    int skipcnt = 0;
+    int sencoding = 0; /* 0: not yet known, 1: integer, -1: string. */
+    int64_t sval = 0, v;
+
+    while (p) {
+        if (skipcnt == 0) {
+            unsigned char *vstr = lpGet(p,&v,NULL);
+            if (vstr) {
+                if ((uint32_t)v == slen && memcmp(vstr,s,slen) == 0)
+                    return p;
+            } else {
+                /* Convert the searched string only once, the first time
+                 * it is compared against an integer element. */
+                if (sencoding == 0) {
+                    sencoding = lpStringToInt64((const char*)s,slen,&sval) ?
+                                1 : -1;
+                }
+                if (sencoding == 1 && v == sval) return p;
+            }
+            skipcnt = skip;
+        } else {
+            skipcnt--;
+        }
+        p = lpNext(lp,p);
+    }
+    return NULL;
+}
+
+/* Delete 'num' consecutive elements starting at the element with the
+ * specified 'index' (see lpSeek() for the index semantics). If there are
+ * less than 'num' elements after the starting one, all the elements up to
+ * the end are deleted. Returns the new listpack pointer. */
+unsigned char *lpDeleteRange(unsigned char *lp, long index, unsigned long num) {
+    unsigned char *first, *tail;
+    uint32_t bytes = lpGetTotalBytes(lp);
+    uint32_t numele = lpGetNumElements(lp);
+    unsigned long deleted = 0;
+
+    if (num == 0 || (first = lpSeek(lp,index)) == NULL) return lp;
+    tail = first;
+    while (deleted < num && tail[0] != LP_EOF) {
+        tail = lpSkip(tail);
+        deleted++;
+    }
+
+    /* Move the tail, including the EOF byte, over the deleted elements. */
+    unsigned long removed = tail-first;
+    memmove(first,tail,(lp+bytes)-tail);
+    bytes -= removed;
+    lpSetTotalBytes(lp,bytes);
+    if (numele != LP_HDR_NUMELE_UNKNOWN) lpSetNumElements(lp,numele-deleted);
+    return lp_realloc(lp,bytes);
+}
+
+/* Merge the listpacks 'first' and 'second' by appending 'second' to
+ * 'first'. The larger of the two listpacks is reallocated to hold the
+ * merged result, while the other one is freed and its pointer set to NULL,
+ * so the caller can tell which one survived, like ziplistMerge() does.
+ *
+ * Returns the merged listpack, or NULL if the arguments are not valid or
+ * the merged listpack would exceed the max allowed size of 2^32-1. */
+unsigned char *lpMerge(unsigned char **first, unsigned char **second) {
+    if (first == NULL || *first == NULL || second == NULL || *second == NULL)
+        return NULL;
+    if (*first == *second) return NULL;
+
+    unsigned char *lp1 = *first, *lp2 = *second;
+    uint32_t lp1_bytes = lpGetTotalBytes(lp1);
+    uint32_t lp2_bytes = lpGetTotalBytes(lp2);
+    uint32_t lp1_numele = lpGetNumElements(lp1);
+    uint32_t lp2_numele = lpGetNumElements(lp2);
+
+    /* The merged listpack has just one header and one EOF byte. */
+    uint64_t bytes = (uint64_t)lp1_bytes+lp2_bytes-LP_HDR_SIZE-1;
+    if (bytes > UINT32_MAX) return NULL;
+    uint32_t numele = LP_HDR_NUMELE_UNKNOWN;
+    if (lp1_numele != LP_HDR_NUMELE_UNKNOWN &&
+        lp2_numele != LP_HDR_NUMELE_UNKNOWN &&
+        lp1_numele+lp2_numele < LP_HDR_NUMELE_UNKNOWN)
+    {
+        numele = lp1_numele+lp2_numele;
+    }
+
+    unsigned char *target;
+    if (lp1_bytes >= lp2_bytes) {
+        /* Append the elements of 'second', with its EOF, to 'first'. */
+        target = lp_realloc(lp1,bytes);
+        memcpy(target+lp1_bytes-1,lp2+LP_HDR_SIZE,lp2_bytes-LP_HDR_SIZE);
+        lp_free(lp2);
+        *first = target;
+        *second = NULL;
+    } else {
+        /* Make room for the elements of 'first' at the head of 'second'
+         * and copy them, with the header, in front. */
+        target = lp_realloc(lp2,bytes);
+        memmove(target+lp1_bytes-1,target+LP_HDR_SIZE,lp2_bytes-LP_HDR_SIZE);
+        memcpy(target,lp1,lp1_bytes-1);
+        lp_free(lp1);
+        *first = NULL;
+        *second = target;
+    }
+    lpSetTotalBytes(target,bytes);
+    lpSetNumElements(target,numele);
+    return target;
+}
+
+/* Print info about the listpack to standard output, mostly for debugging
+ * purposes (see DEBUG LISTPACK). */
+void lpRepr(unsigned char *lp) {
+    unsigned char *p, *vstr;
+    int64_t vlen;
+    unsigned char intbuf[LP_INTBUF_SIZE];
+    int index = 0;
+
+    printf("{total bytes %u} {num entries %u}\n",
+           lpBytes(lp), lpLength(lp));
+    p = lpFirst(lp);
+    while (p) {
+        uint32_t encoded_size = lpCurrentEncodedSize(p);
+        vstr = lpGet(p,&vlen,intbuf);
+        printf("{\n\taddr: 0x%08lx,\n\tindex: %2d,\n\toffset: %5lu,\n"
+               "\tencoded size: %u,\n\tbacklen size: %lu,\n\tvalue: ",
+               (unsigned long)p, index, (unsigned long)(p-lp),
+               encoded_size, lpEncodeBacklen(NULL,encoded_size));
+        if (vlen > 40) {
+            if (fwrite(vstr,40,1,stdout) == 0) perror("fwrite");
+            printf("...");
+        } else if (vlen) {
+            if (fwrite(vstr,vlen,1,stdout) == 0) perror("fwrite");
+        }
+        printf("\n}\n");
+        index++;
+        p = lpNext(lp,p);
+    }
+    printf("{end}\n\n");
+}
@@ -0,0 +1,189 @@
+/* lz4lite -- A small LZ4 block format compressor and decompressor.
+ *
+ * See lz4lite.h for the API and licensing information.
+ *
+ * An LZ4 block is a sequence of sequences, every sequence is:
+ *
+ *   <token> [literal length bytes] <literals> <offset> [match length bytes]
+ *
+ * The high nibble of the token is the number of literals, the low nibble
+ * the length of the match minus 4. A nibble of 15 means that more length
+ * bytes follow, each adding its value, until a byte different than 255.
+ * The offset is a 16 bit little endian distance back in the output. The
+ * last sequence only has literals: the format requires the last 5 bytes
+ * to be literals and the last match to start 12 bytes before the end. */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz4lite.h"
+
+#define LZ4LITE_HASH_LOG 12     /* 4096 entries hash table. */
+#define LZ4LITE_MINMATCH 4
+#define LZ4LITE_MFLIMIT 12      /* No match can start in the last 12 bytes. */
+#define LZ4LITE_LASTLITERALS 5  /* The last 5 bytes are always literals. */
+#define LZ4LITE_MAX_OFFSET 65535
+
+static inline uint32_t lz4liteRead32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v,p,sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz4liteHash(uint32_t v) {
+    return (v * 2654435761U) >> (32-LZ4LITE_HASH_LOG);
+}
+
+/* Emit the extra length bytes of a length that did not fit its nibble. */
+static inline unsigned char *lz4liteWriteLen(unsigned char *op, unsigned int len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+/* Emit a sequence made of 'lit' literals starting at 'anchor', followed,
+ * if 'offset' is not zero, by a match of 'mlen' bytes. Returns the new
+ * output pointer, or NULL if the sequence does not fit. */
+static unsigned char *lz4liteWriteSequence(unsigned char *op, unsigned char *out_end,
+                                           const unsigned char *anchor, unsigned int lit,
+                                           unsigned int offset, unsigned int mlen)
+{
+    /* Worst case size: token, literal length bytes, literals, offset and
+     * match length bytes. */
+    size_t need = 1 + lit/255 + 1 + lit + 2 + mlen/255 + 1;
+    if (need > (size_t)(out_end-op)) return NULL;
+
+    unsigned char *token = op++;
+    if (lit >= 15) {
+        *token = 15 << 4;
+        op = lz4liteWriteLen(op,lit-15);
+    } else {
+        *token = lit << 4;
+    }
+    memcpy(op,anchor,lit);
+    op += lit;
+    if (offset == 0) return op;
+
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    mlen -= LZ4LITE_MINMATCH;
+    if (mlen >= 15) {
+        *token |= 15;
+        op = lz4liteWriteLen(op,mlen-15);
+    } else {
+        *token |= mlen;
+    }
+    return op;
+}
+
+unsigned int lz4liteCompress(const void *in_data, unsigned int in_len,
+                             void *out_data, unsigned int out_len)
+{
+    const unsigned char *in = in_data, *ip = in, *anchor = in;
+    const unsigned char *in_end = in+in_len;
+    unsigned char *out = out_data, *op = out, *out_end = out+out_len;
+
+    /* Inputs too short to hold a match are stored as literals. */
+    if (in_len > LZ4LITE_MFLIMIT) {
+        const unsigned char *ip_limit = in_end-LZ4LITE_MFLIMIT;
+        const unsigned char *match_limit = in_end-LZ4LITE_LASTLITERALS;
+        uint32_t htab[1<<LZ4LITE_HASH_LOG];
+
+        memset(htab,0,sizeof(htab));
+        while (ip < ip_limit) {
+            uint32_t seq = lz4liteRead32(ip);
+            uint32_t h = lz4liteHash(seq);
+            const unsigned char *ref = in+htab[h];
+            htab[h] = ip-in;
+
+            if (ref >= ip || ip-ref > LZ4LITE_MAX_OFFSET ||
+                lz4liteRead32(ref) != seq)
+            {
+                ip++;
+                continue;
+            }
+
+            /* Extend the match backward into the pending literals, and
+             * then forward up to the last literals. */
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const unsigned char *mp = ip+LZ4LITE_MINMATCH;
+            const unsigned char *rp = ref+LZ4LITE_MINMATCH;
+            while (mp < match_limit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+
+            op = lz4liteWriteSequence(op,out_end,anchor,ip-anchor,ip-ref,mp-ip);
+            if (op == NULL) return 0;
+            ip = anchor = mp;
+
+            /* Index a position inside the match as well, it is cheap and
+             * helps with repeated patterns. */
+            if (ip < ip_limit) htab[lz4liteHash(lz4liteRead32(ip-2))] = ip-2-in;
+        }
+    }
+
+    op = lz4liteWriteSequence(op,out_end,anchor,in_end-anchor,0,0);
+    if (op == NULL) return 0;
+    return op-out;
+}
+
+/* Read the extra bytes of a length whose nibble was 15. Returns 0 if the
+ * input ends before the length does. */
+static inline int lz4liteReadLen(const unsigned char **ip, const unsigned char *in_end,
+                                 unsigned int *len)
+{
+    unsigned int b;
+    do {
+        if (*ip >= in_end) return 0;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 1;
+}
+
+unsigned int lz4liteDecompress(const void *in_data, unsigned int in_len,
+                               void *out_data, unsigned int out_len)
+{
+    const unsigned char *ip = in_data, *in_end = ip+in_len;
+    unsigned char *out = out_data, *op = out, *out_end = out+out_len;
+
+    while (ip < in_end) {
+        unsigned int token = *ip++;
+        unsigned int lit = token >> 4;
+
+        if (lit == 15 && !lz4liteReadLen(&ip,in_end,&lit)) return 0;
+        if (lit > (size_t)(in_end-ip) || lit > (size_t)(out_end-op)) return 0;
+        memcpy(op,ip,lit);
+        ip += lit;
+        op += lit;
+        if (ip == in_end) break; /* The last sequence has no match. */
+
+        if (in_end-ip < 2) return 0;
+        unsigned int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op-out)) return 0;
+
+        unsigned int mlen = token & 15;
+        if (mlen == 15 && !lz4liteReadLen(&ip,in_end,&mlen)) return 0;
+        mlen += LZ4LITE_MINMATCH;
+        if (mlen > (size_t)(out_end-op)) return 0;
+
+        const unsigned char *ref = op-offset;
+        if (offset >= mlen) {
+            memcpy(op,ref,mlen);
+            op += mlen;
+        } else {
+            /* Overlapping match: the copy repeats the last 'offset'
+             * bytes, so it must go byte by byte. */
+            while (mlen--) *op++ = *ref++;
+        }
+    }
+    return op-out;
+}
@@ -0,0 +1,45 @@
+/* lz4lite -- A small LZ4 block format compressor and decompressor.
+ *
+ * The compressor is a single pass greedy matcher with a small hash table:
+ * it trades some compression ratio for speed, and its decompression is
+ * considerably faster than LZF. The output is a plain LZ4 block, so it can
+ * be decoded by any LZ4 implementation.
+ *
+ * The API mirrors the LZF one: both functions return the number of bytes
+ * written to 'out_data', or 0 if the output buffer is too small (or, on
+ * decompression, if the input is corrupted).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __LZ4LITE_H
+#define __LZ4LITE_H
+
+unsigned int lz4liteCompress(const void *in_data, unsigned int in_len,
+                             void *out_data, unsigned int out_len);
+unsigned int lz4liteDecompress(const void *in_data, unsigned int in_len,
+                               void *out_data, unsigned int out_len);
+
+#endif
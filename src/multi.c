@@ -94,6 +94,27 @@ void execCommandPropagateMulti(client *c) {
     decrRefCount(multistring);
 }
 
+/* Return true if one of the queued commands of the client touches keys
+ * locked by an asynchronous MIGRATE, see migrateKeysAreLocked(). */
+static int execKeysAreLocked(client *c) {
+    redisDb *db = c->db;
+    int j;
+
+    for (j = 0; j < c->mstate.count; j++) {
+        multiCmd *mc = c->mstate.commands+j;
+
+        /* Follow the SELECTs, the keys are locked per database. */
+        if (mc->cmd->proc == selectCommand) {
+            long long id;
+            if (getLongLongFromObject(mc->argv[1],&id) == C_OK &&
+                id >= 0 && id < server.dbnum) db = server.db+id;
+            continue;
+        }
+        if (migrateKeysAreLocked(db,mc->cmd,mc->argv,mc->argc)) return 1;
+    }
+    return 0;
+}
+
 void execCommand(client *c) {
     int j;
     robj **orig_argv;
@@ -130,6 +151,16 @@ void execCommand(client *c) {
         goto handle_monitor;
     }
 
+    /* Write commands touching keys locked by an asynchronous MIGRATE are
+     * refused when queued, but the migration may have started after that:
+     * refuse the whole transaction, executing only part of it would break
+     * its atomicity. */
+    if (execKeysAreLocked(c)) {
+        addReply(c,shared.migratingkeyerr);
+        discardTransaction(c);
+        goto handle_monitor;
+    }
+
     /* Exec all the queued commands */
     unwatchAllKeys(c); /* Unwatch ASAP otherwise we'll waste CPU cycles */
     orig_argv = c->argv;
@@ -293,7 +324,7 @@ void touchWatchedKeysOnFlush(int dbid) {
 
             /* For every watched key matching the specified DB, if the key exists, mark the client as dirty, as the key will be removed. */
             if (dbid == -1 || wk->db->id == dbid) {
-                if (dictFind(wk->db->dict, wk->key->ptr) != NULL)
+                if (dbFind(wk->db, wk->key->ptr) != NULL)
                     c->flags |= CLIENT_DIRTY_CAS;
             }
         }
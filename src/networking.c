@@ -34,10 +34,13 @@ void *dupClientReplyValue(void *o) {
     clientReplyBlock *old = o;
     clientReplyBlock *buf = zmalloc(sizeof(clientReplyBlock) + old->size);
     memcpy(buf, o, sizeof(clientReplyBlock) + old->size);
+    buf->refcount = 1;
     return buf;
 }
 
 void freeClientReplyValue(void *o) {
+    clientReplyBlock *buf = o;
+    if (buf && --buf->refcount > 0) return;
     zfree(o);
 }
 
@@ -81,6 +84,7 @@ client *createClient(int fd) {
     c->name = NULL;
     c->bufpos = 0;
     c->qb_pos = 0;
+    c->slot = -1;
     c->querybuf = sdsempty();
     c->pending_querybuf = sdsempty();
     c->querybuf_peak = 0;
@@ -105,6 +109,7 @@ client *createClient(int fd) {
     c->slave_capa = SLAVE_CAPA_NONE;
     c->reply = listCreate();
     c->reply_bytes = 0;
+    c->net_output_bytes = 0;
     c->obuf_soft_limit_reached_time = 0;
     listSetFreeMethod(c->reply,freeClientReplyValue);
     listSetDupMethod(c->reply,dupClientReplyValue);
@@ -117,9 +122,12 @@ client *createClient(int fd) {
     c->bpop.xread_group_noack = 0;
     c->bpop.numreplicas = 0;
     c->bpop.reploffset = 0;
+    c->bpop.migrate_job = NULL;
+    c->bpop.setops_job = NULL;
     c->woff = 0;
     c->watched_keys = listCreate();
     c->pubsub_channels = dictCreate(&objectKeyPointerValueDictType,NULL);
+    c->pubsubshard_channels = dictCreate(&objectKeyPointerValueDictType,NULL);
     c->pubsub_patterns = listCreate();
     c->peerid = NULL;
     c->client_list_node = NULL;
@@ -219,6 +227,7 @@ int _addReplyToBuffer(client *c, const char *s, size_t len) {
 
     memcpy(c->buf+c->bufpos,s,len);
     c->bufpos+=len;
+    c->net_output_bytes += len;
     return C_OK;
 }
 
@@ -229,6 +238,8 @@ void _addReplyStringToList(client *c, const char *s, size_t len) {
     listNode *ln = listLast(c->reply);
     clientReplyBlock *tail = ln? listNodeValue(ln): NULL;
 
+    c->net_output_bytes += len;
+
     /* Note that 'tail' may be NULL even if we have a tail node, becuase when
      * addDeferredMultiBulkLength() is used, it sets a dummy node to NULL just
      * fo fill it later, when the size of the bulk length is set. */
@@ -252,6 +263,7 @@ void _addReplyStringToList(client *c, const char *s, size_t len) {
         /* take over the allocation's internal fragmentation */
         tail->size = zmalloc_usable(tail) - sizeof(clientReplyBlock);
         tail->used = len;
+        tail->refcount = 1;
         memcpy(tail->buf, s, len);
         listAddNodeTail(c->reply, tail);
         c->reply_bytes += tail->size;
@@ -279,6 +291,12 @@ void addReply(client *c, robj *obj) {
         size_t len = ll2string(buf,sizeof(buf),(long)obj->ptr);
         if (_addReplyToBuffer(c,buf,len) != C_OK)
             _addReplyStringToList(c,buf,len);
+    } else if (obj->encoding == OBJ_ENCODING_ROARING) {
+        /* Compressed bitmaps are replied as the string they represent. */
+        robj *dec = getDecodedObject(obj);
+        if (_addReplyToBuffer(c,dec->ptr,sdslen(dec->ptr)) != C_OK)
+            _addReplyStringToList(c,dec->ptr,sdslen(dec->ptr));
+        decrRefCount(dec);
     } else {
         serverPanic("Wrong obj->encoding in addReply()");
     }
@@ -407,6 +425,7 @@ void setDeferredMultiBulkLength(client *c, void *node, long length) {
      * we return NULL in addDeferredMultiBulkLength() */
     if (node == NULL) return;
     serverAssert(!listNodeValue(ln));
+    c->net_output_bytes += lenstr_len;
 
     /* Normally we fill this dummy NULL node, added by addDeferredMultiBulkLength(),
      * with a new buffer structure containing the protocol needed to specify
@@ -431,6 +450,7 @@ void setDeferredMultiBulkLength(client *c, void *node, long length) {
         /* Take over the allocation's internal fragmentation */
         buf->size = zmalloc_usable(buf) - sizeof(clientReplyBlock);
         buf->used = lenstr_len;
+        buf->refcount = 1;
         memcpy(buf->buf, lenstr, lenstr_len);
         listNodeValue(ln) = buf;
         c->reply_bytes += buf->size;
@@ -447,8 +467,17 @@ void addReplyDouble(client *c, double d) {
          * different way, so better to handle it in an explicit way. */
         addReplyBulkCString(c, d > 0 ? "inf" : "-inf");
     } else {
-        dlen = snprintf(dbuf,sizeof(dbuf),"%.17g",d);
-        slen = snprintf(sbuf,sizeof(sbuf),"$%d\r\n%s\r\n",dlen,dbuf);
+        /* Format the bulk length and the payload without snprintf(), since
+         * this is called for every score of ZRANGE WITHSCORES. */
+        dlen = d2string(dbuf,sizeof(dbuf),d);
+        sbuf[0] = '$';
+        slen = 1+ll2string(sbuf+1,sizeof(sbuf)-1,dlen);
+        sbuf[slen++] = '\r';
+        sbuf[slen++] = '\n';
+        memcpy(sbuf+slen,dbuf,dlen);
+        slen += dlen;
+        sbuf[slen++] = '\r';
+        sbuf[slen++] = '\n';
         addReplyString(c,sbuf,slen);
     }
 }
@@ -508,6 +537,8 @@ void addReplyBulkLen(client *c, robj *obj) {
 
     if (sdsEncodedObject(obj)) {
         len = sdslen(obj->ptr);
+    } else if (obj->encoding == OBJ_ENCODING_ROARING) {
+        len = stringObjectLen(obj);
     } else {
         long n = (long)obj->ptr;
 
@@ -596,6 +627,21 @@ void addReplySubcommandSyntaxError(client *c) {
     sdsfree(cmd);
 }
 
+/* Return the size of the command 'argv' in the Redis protocol, that is,
+ * the number of bytes read from the client for a multi bulk request. */
+size_t commandProtoLen(robj **argv, int argc) {
+    size_t len = 1+digits10(argc)+2;
+    int j;
+
+    for (j = 0; j < argc; j++) {
+        size_t arglen = sdsEncodedObject(argv[j]) ?
+                        sdslen(argv[j]->ptr) :
+                        (size_t)sdigits10((long)argv[j]->ptr);
+        len += 1+digits10(arglen)+2+arglen+2;
+    }
+    return len;
+}
+
 /* Append 'src' client output buffers into 'dst' client output buffers. This function clears the output buffers of 'src' */
 void AddReplyFromClient(client *dst, client *src) {
     if (prepareClientToWrite(dst) != C_OK)
@@ -608,6 +654,100 @@ void AddReplyFromClient(client *dst, client *src) {
     src->bufpos = 0;
 }
 
+/* -----------------------------------------------------------------------------
+ * Shared replies.
+ *
+ * When the same reply must be sent to many clients, like the entries of a
+ * stream delivered to all the clients blocked in XREAD for the same key, or
+ * a message published to a channel with many subscribers, it is wasteful to
+ * serialize it again for every receiver. Instead the reply is emitted once
+ * into a fake client, as usually via the addReply*() family of functions:
+ *
+ *  client *fake = startSharedReply();
+ *  addReply...(fake,...);
+ *  clientReplyBlock *reply = endSharedReply();
+ *
+ * And the resulting block is appended, as it is, to the output buffers of
+ * all the receivers with addReplyShared(). Finally the caller drops its own
+ * reference with releaseSharedReply(): the block is freed when the last
+ * receiver has written it to the socket.
+ * -------------------------------------------------------------------------- */
+
+static client *sharedReplyClient = NULL;
+
+/* 开始构建一个共享回复 返回用于累积回复内容的伪客户端 */
+client *startSharedReply(void) {
+    if (sharedReplyClient == NULL) {
+        sharedReplyClient = createClient(-1);
+        sharedReplyClient->flags |= CLIENT_MODULE;
+    }
+    serverAssert(!clientHasPendingReplies(sharedReplyClient));
+    return sharedReplyClient;
+}
+
+/* Collect the reply accumulated into the fake client returned by
+ * startSharedReply() into a single block, and reset the fake client so
+ * that it can be used again. The returned block has a refcount of one,
+ * owned by the caller. Note that size is set to the used length, so that
+ * addReply*() calls targeting the receivers will never append data to it
+ * once it is linked into their output buffers. */
+clientReplyBlock *endSharedReply(void) {
+    client *c = sharedReplyClient;
+    size_t len = c->bufpos;
+    listIter li;
+    listNode *ln;
+
+    listRewind(c->reply,&li);
+    while((ln = listNext(&li))) {
+        clientReplyBlock *o = listNodeValue(ln);
+        len += o->used;
+    }
+
+    clientReplyBlock *reply = zmalloc(sizeof(clientReplyBlock) + len);
+    reply->size = reply->used = len;
+    reply->refcount = 1;
+    memcpy(reply->buf,c->buf,c->bufpos);
+    len = c->bufpos;
+    listRewind(c->reply,&li);
+    while((ln = listNext(&li))) {
+        clientReplyBlock *o = listNodeValue(ln);
+        memcpy(reply->buf+len,o->buf,o->used);
+        len += o->used;
+    }
+
+    listEmpty(c->reply);
+    c->reply_bytes = 0;
+    c->bufpos = 0;
+    return reply;
+}
+
+/* Append the shared block 'reply' to the output buffers of the client,
+ * taking a new reference. Replies smaller than PROTO_SHARED_REPLY_MIN_BYTES
+ * are copied instead. */
+void addReplyShared(client *c, clientReplyBlock *reply) {
+    if (prepareClientToWrite(c) != C_OK) return;
+    if (c->flags & CLIENT_CLOSE_AFTER_REPLY) return;
+
+    /* Small replies are just copied: the copy is cheap, and this way they
+     * can be coalesced with other replies into the same write(2) call. */
+    if (reply->used < PROTO_SHARED_REPLY_MIN_BYTES) {
+        if (_addReplyToBuffer(c,reply->buf,reply->used) != C_OK)
+            _addReplyStringToList(c,reply->buf,reply->used);
+        return;
+    }
+
+    reply->refcount++;
+    listAddNodeTail(c->reply,reply);
+    c->reply_bytes += reply->size;
+    c->net_output_bytes += reply->used;
+    asyncCloseClientOnOutputBufferLimitReached(c);
+}
+
+/* Drop the reference obtained with endSharedReply(). */
+void releaseSharedReply(clientReplyBlock *reply) {
+    freeClientReplyValue(reply);
+}
+
 /* Copy 'src' client output buffers into 'dst' client output buffers.
  * The function takes care of freeing the old output buffers of the
  * destination client. */
@@ -854,7 +994,9 @@ void freeClient(client *c) {
     /* Unsubscribe from all the pubsub channels */
     pubsubUnsubscribeAllChannels(c,0);
     pubsubUnsubscribeAllPatterns(c,0);
+    pubsubUnsubscribeShardAllChannels(c,0);
     dictRelease(c->pubsub_channels);
+    dictRelease(c->pubsubshard_channels);
     listRelease(c->pubsub_patterns);
 
     /* Free data structures. */
@@ -1092,6 +1234,7 @@ void resetClient(client *c) {
     c->reqtype = 0;
     c->multibulklen = 0;
     c->bulklen = -1;
+    c->slot = -1;
 
     /* We clear the ASKING flag as well if we are not inside a MULTI, and
      * if what we just executed is not the ASKING command itself. */
@@ -1439,8 +1582,11 @@ void processInputBuffer(client *c) {
                 /* Don't reset the client structure for clients blocked in a
                  * module blocking command, so that the reply callback will
                  * still be able to access the client argv and argc field.
-                 * The client will be reset in unblockClientFromModule(). */
-                if (!(c->flags & CLIENT_BLOCKED) || c->btype != BLOCKED_MODULE)
+                 * The client will be reset in unblockClientFromModule().
+                 * The same for set operations computed in background, that
+                 * execute the command again once completed (see setops.c). */
+                if (!(c->flags & CLIENT_BLOCKED) ||
+                    (c->btype != BLOCKED_MODULE && c->btype != BLOCKED_SETOPS))
                     resetClient(c);
             }
             /* freeMemoryIfNeeded may flush slave output buffers. This may
@@ -1636,7 +1782,7 @@ sds catClientInfoString(sds s, client *client) {
     if (emask & AE_WRITABLE) *p++ = 'w';
     *p = '\0';
     return sdscatfmt(s,
-        "id=%U addr=%s fd=%i name=%s age=%I idle=%I flags=%s db=%i sub=%i psub=%i multi=%i qbuf=%U qbuf-free=%U obl=%U oll=%U omem=%U events=%s cmd=%s",
+        "id=%U addr=%s fd=%i name=%s age=%I idle=%I flags=%s db=%i sub=%i psub=%i ssub=%i multi=%i qbuf=%U qbuf-free=%U obl=%U oll=%U omem=%U events=%s cmd=%s",
         (unsigned long long) client->id,
         getClientPeerId(client),
         client->fd,
@@ -1647,6 +1793,7 @@ sds catClientInfoString(sds s, client *client) {
         client->db->id,
         (int) dictSize(client->pubsub_channels),
         (int) listLength(client->pubsub_patterns),
+        (int) dictSize(client->pubsubshard_channels),
         (client->flags & CLIENT_MULTI) ? client->mstate.count : -1,
         (unsigned long long) sdslen(client->querybuf),
         (unsigned long long) sdsavail(client->querybuf),
@@ -1837,7 +1984,11 @@ NULL
         if (getLongLongFromObjectOrReply(c,c->argv[2],&id,NULL)
             != C_OK) return;
         struct client *target = lookupClientByID(id);
-        if (target && target->flags & CLIENT_BLOCKED) {
+        /* Set operations computed in background are not blocking commands
+         * from the point of view of the user, they can't be interrupted. */
+        if (target && target->flags & CLIENT_BLOCKED &&
+            target->btype != BLOCKED_SETOPS)
+        {
             if (unblock_error)
                 addReplyError(target,
                     "-UNBLOCKED client unblocked via CLIENT UNBLOCK");
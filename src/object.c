@@ -62,6 +62,15 @@ robj *createRawStringObject(const char *ptr, size_t len) {
     return createObject(OBJ_STRING, sdsnewlen(ptr,len));
 }
 
+/* Create a string object with encoding OBJ_ENCODING_ROARING, that is a bitmap
+ * stored in compressed form, see roaring.c. */
+/* 创建一个压缩位图编码的字符串对象 */
+robj *createRoaringStringObject(rbm *r) {
+    robj *o = createObject(OBJ_STRING,r);
+    o->encoding = OBJ_ENCODING_ROARING;
+    return o;
+}
+
 /* Create a string object with encoding OBJ_ENCODING_EMBSTR, that is
  * an object where the sds string is actually an unmodifiable string allocated in the same chunk as the object itself. */
 /* 创建一个embstr编码的字符串对象 */
@@ -227,6 +236,8 @@ robj *dupStringObject(const robj *o) {
 		//直接将对应的整数值放置到对应的指向中------>即对应的整数字符串对象 对应的数值并不是单独开辟空间 而是直接复用对应的指针空间
         d->ptr = o->ptr;
         return d;
+    case OBJ_ENCODING_ROARING:
+        return createRoaringStringObject(rbmDup(o->ptr));
     default:
 		//编码方式不正确
         serverPanic("Wrong encoding.");
@@ -284,19 +295,19 @@ robj *createIntsetObject(void) {
     return o;
 }
 
-/* 创建一个ziplist编码的哈希对象 */
+/* 创建一个listpack编码的哈希对象 */
 robj *createHashObject(void) {
-	//创建一个ziplist结构
-    unsigned char *zl = ziplistNew();
+	//创建一个listpack结构
+    unsigned char *zl = lpNew();
 	//创建一个对象，对象的数据类型为OBJ_HASH
     robj *o = createObject(OBJ_HASH, zl);
-	//对象的编码类型OBJ_ENCODING_ZIPLIST
-    o->encoding = OBJ_ENCODING_ZIPLIST;
+	//对象的编码类型OBJ_ENCODING_LISTPACK
+    o->encoding = OBJ_ENCODING_LISTPACK;
 	//返回对应的对象
     return o;
 }
 
-/* 创建一个skiplist编码的有序集合对象 */
+/* 创建一个B+树编码的有序集合对象 */
 robj *createZsetObject(void) {
 	//创建对应的zset结构
     zset *zs = zmalloc(sizeof(*zs));
@@ -304,24 +315,24 @@ robj *createZsetObject(void) {
 	
 	//创建一个字典结构
     zs->dict = dictCreate(&zsetDictType,NULL);
-	//创建一个跳跃表结构
-    zs->zsl = zslCreate();
+	//创建一个B+树结构
+    zs->zbt = zbtCreate();
 	//创建一个对象，对象的数据类型为OBJ_ZSET
     o = createObject(OBJ_ZSET,zs);
-	//对象的编码类型OBJ_ENCODING_SKIPLIST
-    o->encoding = OBJ_ENCODING_SKIPLIST;
+	//对象的编码类型OBJ_ENCODING_BTREE
+    o->encoding = OBJ_ENCODING_BTREE;
 	//返回对应的对象
     return o;
 }
 
-/* 创建一个ziplist编码的有序集合对象 */
-robj *createZsetZiplistObject(void) {
-	//创建一个ziplist结构
-    unsigned char *zl = ziplistNew();
+/* 创建一个listpack编码的有序集合对象 */
+robj *createZsetListpackObject(void) {
+	//创建一个listpack结构
+    unsigned char *zl = lpNew();
 	//创建一个对象，对象的数据类型为OBJ_ZSET
     robj *o = createObject(OBJ_ZSET,zl);
-	//对象的编码类型OBJ_ENCODING_ZIPLIST
-    o->encoding = OBJ_ENCODING_ZIPLIST;
+	//对象的编码类型OBJ_ENCODING_LISTPACK
+    o->encoding = OBJ_ENCODING_LISTPACK;
 	//返回对应的对象
     return o;
 }
@@ -351,6 +362,8 @@ void freeStringObject(robj *o) {
     if (o->encoding == OBJ_ENCODING_RAW) {
 		//释放对应的数据部分的空间
         sdsfree(o->ptr);
+    } else if (o->encoding == OBJ_ENCODING_ROARING) {
+        rbmFree(o->ptr);
     }
 }
 
@@ -387,16 +400,16 @@ void freeZsetObject(robj *o) {
     zset *zs;
 	//检测有序集合的编码方式
     switch (o->encoding) {
-    case OBJ_ENCODING_SKIPLIST:
+    case OBJ_ENCODING_BTREE:
 		//释放对应的数据部分空间
         zs = o->ptr;
         dictRelease(zs->dict);
-        zslFree(zs->zsl);
+        zbtFree(zs->zbt);
         zfree(zs);
         break;
-    case OBJ_ENCODING_ZIPLIST:
+    case OBJ_ENCODING_LISTPACK:
 		//释放对应的数据部分空间
-        zfree(o->ptr);
+        lpFree(o->ptr);
         break;
     default:
         serverPanic("Unknown sorted set encoding");
@@ -411,9 +424,9 @@ void freeHashObject(robj *o) {
 		//释放对应的数据部分空间
         dictRelease((dict*) o->ptr);
         break;
-    case OBJ_ENCODING_ZIPLIST:
+    case OBJ_ENCODING_LISTPACK:
 		//释放对应的数据部分空间
-        zfree(o->ptr);
+        lpFree(o->ptr);
         break;
     default:
         serverPanic("Unknown hash encoding type");
@@ -682,6 +695,11 @@ robj *getDecodedObject(robj *o) {
         dec = createStringObject(buf,strlen(buf));
 		//返回新创建的字符串类型对象
         return dec;
+    } else if (o->type == OBJ_STRING && o->encoding == OBJ_ENCODING_ROARING) {
+        rbm *r = o->ptr;
+        dec = createObject(OBJ_STRING,sdsnewlen(NULL,r->len));
+        rbmToBuffer(r,dec->ptr);
+        return dec;
     } else {
         serverPanic("Unknown encoding type");
     }
@@ -786,6 +804,8 @@ size_t stringObjectLen(robj *o) {
     if (sdsEncodedObject(o)) {
 		//获取对应的字符串长度值
         return sdslen(o->ptr);
+    } else if (o->encoding == OBJ_ENCODING_ROARING) {
+        return ((rbm*)o->ptr)->len;
     } else {
     	//获取对应的整数类型对应的字符串长度值
         return sdigits10((long)o->ptr);
@@ -810,7 +830,7 @@ int getDoubleFromObject(const robj *o, double *target) {
         if (sdsEncodedObject(o)) {
             errno = 0;
 			//将字符串转换为double类型
-            value = strtod(o->ptr, &eptr);
+            value = fastStrtod(o->ptr, &eptr);
 			//检测转换后的数据是否合法
             if (sdslen(o->ptr) == 0 || isspace(((const char*)o->ptr)[0]) ||
                 (size_t)(eptr-(char*)o->ptr) != sdslen(o->ptr) ||
@@ -821,6 +841,12 @@ int getDoubleFromObject(const robj *o, double *target) {
         } else if (o->encoding == OBJ_ENCODING_INT) {
 			//保存整数值
             value = (long)o->ptr;
+        } else if (o->encoding == OBJ_ENCODING_ROARING) {
+            /* Parse the string the compressed bitmap represents. */
+            robj *dec = getDecodedObject((robj*)o);
+            int retval = getDoubleFromObject(dec,&value);
+            decrRefCount(dec);
+            if (retval != C_OK) return C_ERR;
         } else {
 			//其他类型编码错误
             serverPanic("Unknown string encoding");
@@ -869,7 +895,7 @@ int getLongDoubleFromObject(robj *o, long double *target) {
 		if (sdsEncodedObject(o)) {
             errno = 0;
 			//将字符串转换为long double类型
-            value = strtold(o->ptr, &eptr);
+            value = fastStrtold(o->ptr, &eptr);
 			//检测转换后的数据是否合法
             if (sdslen(o->ptr) == 0 || isspace(((const char*)o->ptr)[0]) ||
                 (size_t)(eptr-(char*)o->ptr) != sdslen(o->ptr) ||
@@ -880,6 +906,11 @@ int getLongDoubleFromObject(robj *o, long double *target) {
         } else if (o->encoding == OBJ_ENCODING_INT) {
 			//整数编码,保存整数值
             value = (long)o->ptr;
+        } else if (o->encoding == OBJ_ENCODING_ROARING) {
+            robj *dec = getDecodedObject(o);
+            int retval = getLongDoubleFromObject(dec,&value);
+            decrRefCount(dec);
+            if (retval != C_OK) return C_ERR;
         } else {
 			//其他类型编码错误
             serverPanic("Unknown string encoding");
@@ -932,6 +963,11 @@ int getLongLongFromObject(robj *o, long long *target) {
         } else if (o->encoding == OBJ_ENCODING_INT) {
          	//直接获取存储的整数数据
             value = (long)o->ptr;
+        } else if (o->encoding == OBJ_ENCODING_ROARING) {
+            robj *dec = getDecodedObject(o);
+            int retval = getLongLongFromObject(dec,&value);
+            decrRefCount(dec);
+            if (retval != C_OK) return C_ERR;
         } else {
 			//其他类型的数据对象错误
             serverPanic("Unknown string encoding");
@@ -1010,12 +1046,18 @@ char *strEncoding(int encoding) {
 		return "quicklist";
     case OBJ_ENCODING_ZIPLIST: 
 		return "ziplist";
+    case OBJ_ENCODING_LISTPACK: 
+		return "listpack";
     case OBJ_ENCODING_INTSET: 
 		return "intset";
     case OBJ_ENCODING_SKIPLIST: 
 		return "skiplist";
+    case OBJ_ENCODING_BTREE: 
+		return "btree";
     case OBJ_ENCODING_EMBSTR: 
 		return "embstr";
+    case OBJ_ENCODING_ROARING:
+		return "roaring";
     default: return "unknown";
     }
 }
@@ -1065,6 +1107,8 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
             asize = sdsAllocSize(o->ptr)+sizeof(*o);
         } else if(o->encoding == OBJ_ENCODING_EMBSTR) {
             asize = sdslen(o->ptr)+2+sizeof(*o);
+        } else if(o->encoding == OBJ_ENCODING_ROARING) {
+            asize = rbmMemoryUsage(o->ptr)+sizeof(*o);
         } else {
             serverPanic("Unknown string encoding");
         }
@@ -1074,10 +1118,11 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
             quicklistNode *node = ql->head;
             asize = sizeof(*o)+sizeof(quicklist);
             do {
-                elesize += sizeof(quicklistNode)+ziplistBlobLen(node->zl);
+                elesize += sizeof(quicklistNode)+lpBytes(node->zl);
                 samples++;
             } while ((node = node->next) && samples < sample_size);
             asize += (double)elesize/samples*ql->len;
+            asize += quicklistNodeCacheBytes(ql);
         } else if (o->encoding == OBJ_ENCODING_ZIPLIST) {
             asize = sizeof(*o)+ziplistBlobLen(o->ptr);
         } else {
@@ -1102,28 +1147,31 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
             serverPanic("Unknown set encoding");
         }
     } else if (o->type == OBJ_ZSET) {
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            asize = sizeof(*o)+(ziplistBlobLen(o->ptr));
-        } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            asize = sizeof(*o)+(lpBytes(o->ptr));
+        } else if (o->encoding == OBJ_ENCODING_BTREE) {
+            zbtree *zbt = ((zset*)o->ptr)->zbt;
+            zbtPos pos;
             d = ((zset*)o->ptr)->dict;
-            zskiplist *zsl = ((zset*)o->ptr)->zsl;
-            zskiplistNode *znode = zsl->header->level[0].forward;
-            asize = sizeof(*o)+sizeof(zset)+sizeof(zskiplist)+sizeof(dict)+
-                    (sizeof(struct dictEntry*)*dictSlots(d))+
-                    zmalloc_size(zsl->header);
-            while(znode != NULL && samples < sample_size) {
-                elesize += sdsAllocSize(znode->ele);
-                elesize += sizeof(struct dictEntry) + zmalloc_size(znode);
+            asize = sizeof(*o)+sizeof(zset)+sizeof(zbtree)+sizeof(dict)+
+                    (sizeof(struct dictEntry*)*dictSlots(d));
+            /* Every element takes its share of the leaf holding it, the
+             * inner nodes are only a small fraction of the leaves. */
+            zbtFirst(zbt,&pos);
+            while(pos.leaf != NULL && samples < sample_size) {
+                elesize += sdsAllocSize(zbtPosEntry(&pos)->ele);
+                elesize += sizeof(struct dictEntry) +
+                           zmalloc_size(pos.leaf)/pos.leaf->count;
                 samples++;
-                znode = znode->level[0].forward;
+                zbtNext(&pos);
             }
             if (samples) asize += (double)elesize/samples*dictSize(d);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
     } else if (o->type == OBJ_HASH) {
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            asize = sizeof(*o)+(ziplistBlobLen(o->ptr));
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            asize = sizeof(*o)+(lpBytes(o->ptr));
         } else if (o->encoding == OBJ_ENCODING_HT) {
             d = o->ptr;
             di = dictGetIterator(d);
@@ -1181,7 +1229,22 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
                 streamCG *cg = ri.data;
                 asize += sizeof(*cg);
                 asize += streamRadixTreeMemoryUsage(cg->pel);
-                asize += sizeof(streamNACK)*raxSize(cg->pel);
+                asize += sizeof(streamPELBlock)*raxSize(cg->pel);
+                asize += sizeof(streamID)*cg->pel_size;
+                /* Estimate the runs of the blocks from the first ones,
+                 * like for the listpacks. */
+                raxIterator bri;
+                size_t runs = 0, bsamples = 0;
+                raxStart(&bri,cg->pel);
+                raxSeek(&bri,"^",NULL,0);
+                while(bsamples < sample_size && raxNext(&bri)) {
+                    streamPELBlock *b = bri.data;
+                    runs += b->numruns;
+                    bsamples++;
+                }
+                raxStop(&bri);
+                if (bsamples)
+                    asize += sizeof(streamPELRun)*runs*raxSize(cg->pel)/bsamples;
 
                 /* For each consumer we also need to add the basic data structures and the PEL memory usage. */
                 raxIterator cri;
@@ -1192,7 +1255,8 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
                     asize += sizeof(*consumer);
                     asize += sdslen(consumer->name);
                     asize += streamRadixTreeMemoryUsage(consumer->pel);
-                    /* Don't count NACKs again, they are shared with the consumer group PEL. */
+                    /* The consumer PEL just references the blocks of the
+                     * consumer group PEL. */
                 }
                 raxStop(&cri);
             }
@@ -1299,9 +1363,13 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
     mh->lua_caches = mem;
     mem_total+=mem;
 
+    mem = quicklistNodeCacheBytes(NULL);
+    mh->quicklist_node_cache = mem;
+    mem_total+=mem;
+
     for (j = 0; j < server.dbnum; j++) {
         redisDb *db = server.db+j;
-        long long keyscount = dictSize(db->dict);
+        long long keyscount = dbSize(db);
         if (keyscount==0) 
 			continue;
 
@@ -1309,7 +1377,7 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
         mh->db = zrealloc(mh->db,sizeof(mh->db[0])*(mh->num_dbs+1));
         mh->db[mh->num_dbs].dbid = j;
 
-        mem = dictSize(db->dict) * sizeof(dictEntry) + dictSlots(db->dict) * sizeof(dictEntry*) + dictSize(db->dict) * sizeof(robj);
+        mem = keyscount * sizeof(dictEntry) + dbBuckets(db) * sizeof(dictEntry*) + keyscount * sizeof(robj);
         mh->db[mh->num_dbs].overhead_ht_main = mem;
         mem_total+=mem;
 
@@ -1487,7 +1555,7 @@ void objectSetLRUOrLFU(robj *val, long long lfu_freq, long long lru_idle, long l
 robj *objectCommandLookup(client *c, robj *key) {
     dictEntry *de;
 	//在redis中数据库中查询对应键所对应的键值对对象
-    if ((de = dictFind(c->db->dict,key->ptr)) == NULL) 
+    if ((de = dbFind(c->db,key->ptr)) == NULL) 
 		return NULL;
 	//获取对应的值对象
     return (robj*) dictGetVal(de);
@@ -1592,7 +1660,7 @@ void memoryCommand(client *c) {
                 return;
             }
         }
-        if ((de = dictFind(c->db->dict,c->argv[2]->ptr)) == NULL) {
+        if ((de = dbFind(c->db,c->argv[2]->ptr)) == NULL) {
             addReply(c, shared.nullbulk);
             return;
         }
@@ -1603,7 +1671,7 @@ void memoryCommand(client *c) {
     } else if (!strcasecmp(c->argv[1]->ptr,"stats") && c->argc == 2) {
         struct redisMemOverhead *mh = getMemoryOverheadData();
 
-        addReplyMultiBulkLen(c,(25+mh->num_dbs)*2);
+        addReplyMultiBulkLen(c,(26+mh->num_dbs)*2);
 
         addReplyBulkCString(c,"peak.allocated");
         addReplyLongLong(c,mh->peak_allocated);
@@ -1629,6 +1697,9 @@ void memoryCommand(client *c) {
         addReplyBulkCString(c,"lua.caches");
         addReplyLongLong(c,mh->lua_caches);
 
+        addReplyBulkCString(c,"quicklist.node.cache");
+        addReplyLongLong(c,mh->quicklist_node_cache);
+
         for (size_t j = 0; j < mh->num_dbs; j++) {
             char dbname[32];
             snprintf(dbname,sizeof(dbname),"db.%zd",mh->db[j].dbid);
@@ -53,22 +53,77 @@ int clientSubscriptionsCount(client *c) {
            listLength(c->pubsub_patterns);
 }
 
+/* Return the number of shard level channels a client is subscribed to. */
+int clientShardSubscriptionsCount(client *c) {
+    return dictSize(c->pubsubshard_channels);
+}
+
+/* Return the total number of subscriptions of the client: while this is
+ * greater than zero the client is in Pub/Sub mode. */
+static int clientTotalSubscriptionsCount(client *c) {
+    return clientSubscriptionsCount(c)+clientShardSubscriptionsCount(c);
+}
+
+static dict *getClientPubSubChannels(client *c) {
+    return c->pubsub_channels;
+}
+
+static dict *getClientPubSubShardChannels(client *c) {
+    return c->pubsubshard_channels;
+}
+
+/* Global channels (SUBSCRIBE / PUBLISH) and shard channels (SSUBSCRIBE /
+ * SPUBLISH) share the same implementation: the difference is only in the
+ * dictionaries used to track the subscriptions and in the reply strings.
+ * In Redis Cluster a global channel message is propagated to every node,
+ * while a shard channel message only reaches the nodes serving the slot
+ * the channel hashes to. */
+typedef struct pubsubtype {
+    int shard;
+    dict *(*clientPubSubChannels)(client*);
+    int (*subscriptionCount)(client*);
+    dict **serverPubSubChannels;
+    robj **subscribeMsg;
+    robj **unsubscribeMsg;
+    robj **messageBulk;
+} pubsubtype;
+
+static pubsubtype pubSubType = {
+    .shard = 0,
+    .clientPubSubChannels = getClientPubSubChannels,
+    .subscriptionCount = clientSubscriptionsCount,
+    .serverPubSubChannels = &server.pubsub_channels,
+    .subscribeMsg = &shared.subscribebulk,
+    .unsubscribeMsg = &shared.unsubscribebulk,
+    .messageBulk = &shared.messagebulk,
+};
+
+static pubsubtype pubSubShardType = {
+    .shard = 1,
+    .clientPubSubChannels = getClientPubSubShardChannels,
+    .subscriptionCount = clientShardSubscriptionsCount,
+    .serverPubSubChannels = &server.pubsubshard_channels,
+    .subscribeMsg = &shared.ssubscribebulk,
+    .unsubscribeMsg = &shared.sunsubscribebulk,
+    .messageBulk = &shared.smessagebulk,
+};
+
 /* Subscribe a client to a channel. Returns 1 if the operation succeeded, or
  * 0 if the client was already subscribed to that channel. */
-int pubsubSubscribeChannel(client *c, robj *channel) {
+static int pubsubSubscribeChannelType(client *c, robj *channel, pubsubtype type) {
     dictEntry *de;
     list *clients = NULL;
     int retval = 0;
 
     /* Add the channel to the client -> channels hash table */
-    if (dictAdd(c->pubsub_channels,channel,NULL) == DICT_OK) {
+    if (dictAdd(type.clientPubSubChannels(c),channel,NULL) == DICT_OK) {
         retval = 1;
         incrRefCount(channel);
         /* Add the client to the channel -> list of clients hash table */
-        de = dictFind(server.pubsub_channels,channel);
+        de = dictFind(*type.serverPubSubChannels,channel);
         if (de == NULL) {
             clients = listCreate();
-            dictAdd(server.pubsub_channels,channel,clients);
+            dictAdd(*type.serverPubSubChannels,channel,clients);
             incrRefCount(channel);
         } else {
             clients = dictGetVal(de);
@@ -77,15 +132,15 @@ int pubsubSubscribeChannel(client *c, robj *channel) {
     }
     /* Notify the client */
     addReply(c,shared.mbulkhdr[3]);
-    addReply(c,shared.subscribebulk);
+    addReply(c,*type.subscribeMsg);
     addReplyBulk(c,channel);
-    addReplyLongLong(c,clientSubscriptionsCount(c));
+    addReplyLongLong(c,type.subscriptionCount(c));
     return retval;
 }
 
 /* Unsubscribe a client from a channel. Returns 1 if the operation succeeded, or
  * 0 if the client was not subscribed to the specified channel. */
-int pubsubUnsubscribeChannel(client *c, robj *channel, int notify) {
+static int pubsubUnsubscribeChannelType(client *c, robj *channel, int notify, pubsubtype type) {
     dictEntry *de;
     list *clients;
     listNode *ln;
@@ -94,10 +149,10 @@ int pubsubUnsubscribeChannel(client *c, robj *channel, int notify) {
     /* Remove the channel from the client -> channels hash table */
     incrRefCount(channel); /* channel may be just a pointer to the same object
                             we have in the hash tables. Protect it... */
-    if (dictDelete(c->pubsub_channels,channel) == DICT_OK) {
+    if (dictDelete(type.clientPubSubChannels(c),channel) == DICT_OK) {
         retval = 1;
         /* Remove the client from the channel -> clients list hash table */
-        de = dictFind(server.pubsub_channels,channel);
+        de = dictFind(*type.serverPubSubChannels,channel);
         serverAssertWithInfo(c,NULL,de != NULL);
         clients = dictGetVal(de);
         ln = listSearchKey(clients,c);
@@ -107,22 +162,28 @@ int pubsubUnsubscribeChannel(client *c, robj *channel, int notify) {
             /* Free the list and associated hash entry at all if this was
              * the latest client, so that it will be possible to abuse
              * Redis PUBSUB creating millions of channels. */
-            dictDelete(server.pubsub_channels,channel);
+            dictDelete(*type.serverPubSubChannels,channel);
         }
     }
     /* Notify the client */
     if (notify) {
         addReply(c,shared.mbulkhdr[3]);
-        addReply(c,shared.unsubscribebulk);
+        addReply(c,*type.unsubscribeMsg);
         addReplyBulk(c,channel);
-        addReplyLongLong(c,dictSize(c->pubsub_channels)+
-                       listLength(c->pubsub_patterns));
-
+        addReplyLongLong(c,type.subscriptionCount(c));
     }
     decrRefCount(channel); /* it is finally safe to release it */
     return retval;
 }
 
+int pubsubSubscribeChannel(client *c, robj *channel) {
+    return pubsubSubscribeChannelType(c,channel,pubSubType);
+}
+
+int pubsubUnsubscribeChannel(client *c, robj *channel, int notify) {
+    return pubsubUnsubscribeChannelType(c,channel,notify,pubSubType);
+}
+
 /* Subscribe a client to a pattern. Returns 1 if the operation succeeded, or 0 if the client was already subscribed to that pattern. */
 int pubsubSubscribePattern(client *c, robj *pattern) {
     int retval = 0;
@@ -175,28 +236,70 @@ int pubsubUnsubscribePattern(client *c, robj *pattern, int notify) {
 
 /* Unsubscribe from all the channels. Return the number of channels the
  * client was subscribed to. */
-int pubsubUnsubscribeAllChannels(client *c, int notify) {
-    dictIterator *di = dictGetSafeIterator(c->pubsub_channels);
+static int pubsubUnsubscribeAllChannelsType(client *c, int notify, pubsubtype type) {
+    dictIterator *di = dictGetSafeIterator(type.clientPubSubChannels(c));
     dictEntry *de;
     int count = 0;
 
     while((de = dictNext(di)) != NULL) {
         robj *channel = dictGetKey(de);
 
-        count += pubsubUnsubscribeChannel(c,channel,notify);
+        count += pubsubUnsubscribeChannelType(c,channel,notify,type);
     }
     /* We were subscribed to nothing? Still reply to the client. */
     if (notify && count == 0) {
         addReply(c,shared.mbulkhdr[3]);
-        addReply(c,shared.unsubscribebulk);
+        addReply(c,*type.unsubscribeMsg);
         addReply(c,shared.nullbulk);
-        addReplyLongLong(c,dictSize(c->pubsub_channels)+
-                       listLength(c->pubsub_patterns));
+        addReplyLongLong(c,type.subscriptionCount(c));
     }
     dictReleaseIterator(di);
     return count;
 }
 
+int pubsubUnsubscribeAllChannels(client *c, int notify) {
+    return pubsubUnsubscribeAllChannelsType(c,notify,pubSubType);
+}
+
+int pubsubUnsubscribeShardAllChannels(client *c, int notify) {
+    return pubsubUnsubscribeAllChannelsType(c,notify,pubSubShardType);
+}
+
+/* Unsubscribe all the clients from the shard channels hashing to one of the
+ * slots set in the 'slots' bitmap (CLUSTER_SLOTS bits). This is used by
+ * Redis Cluster when the slots are no longer served by this node's shard:
+ * the subscribers are notified with a SUNSUBSCRIBE message, so that they
+ * can subscribe again to the new owner. */
+void pubsubUnsubscribeShardChannelsInSlots(unsigned char *slots) {
+    dictIterator *di = dictGetSafeIterator(server.pubsubshard_channels);
+    dictEntry *de;
+
+    while((de = dictNext(di)) != NULL) {
+        robj *channel = dictGetKey(de);
+        int slot = keyHashSlot(channel->ptr,sdslen(channel->ptr));
+        list *clients;
+        listNode *ln;
+        listIter li;
+
+        if (!(slots[slot/8] & (1<<(slot&7)))) continue;
+
+        /* Unsubscribing the last client releases the list and the
+         * dictionary entry: protect the channel while we iterate. */
+        incrRefCount(channel);
+        clients = dictGetVal(de);
+        listRewind(clients,&li);
+        while ((ln = listNext(&li)) != NULL) {
+            client *c = ln->value;
+
+            pubsubUnsubscribeChannelType(c,channel,1,pubSubShardType);
+            if (clientTotalSubscriptionsCount(c) == 0)
+                c->flags &= ~CLIENT_PUBSUB;
+        }
+        decrRefCount(channel);
+    }
+    dictReleaseIterator(di);
+}
+
 /* Unsubscribe from all the patterns. Return the number of patterns the
  * client was subscribed from. */
 int pubsubUnsubscribeAllPatterns(client *c, int notify) {
@@ -221,31 +324,59 @@ int pubsubUnsubscribeAllPatterns(client *c, int notify) {
     return count;
 }
 
-/* Publish a message */
-int pubsubPublishMessage(robj *channel, robj *message) {
+/* Send the message to the clients subscribed to exactly that channel.
+ * Returns the number of clients that received the message. */
+static int pubsubPublishMessageToChannel(robj *channel, robj *message, pubsubtype type) {
     int receivers = 0;
     dictEntry *de;
-    listNode *ln;
-    listIter li;
 
-    /* Send to clients listening for that channel */
-    de = dictFind(server.pubsub_channels,channel);
+    de = dictFind(*type.serverPubSubChannels,channel);
     if (de) {
         list *list = dictGetVal(de);
         listNode *ln;
         listIter li;
+        clientReplyBlock *reply = NULL;
+
+        /* With many subscribers the message is serialized only once, and
+         * the same reply block is linked to the output buffers of all the
+         * receivers. */
+        if (listLength(list) > 1) {
+            client *fake = startSharedReply();
+            addReply(fake,shared.mbulkhdr[3]);
+            addReply(fake,*type.messageBulk);
+            addReplyBulk(fake,channel);
+            addReplyBulk(fake,message);
+            reply = endSharedReply();
+        }
 
         listRewind(list,&li);
         while ((ln = listNext(&li)) != NULL) {
             client *c = ln->value;
 
-            addReply(c,shared.mbulkhdr[3]);
-            addReply(c,shared.messagebulk);
-            addReplyBulk(c,channel);
-            addReplyBulk(c,message);
+            if (reply) {
+                addReplyShared(c,reply);
+            } else {
+                addReply(c,shared.mbulkhdr[3]);
+                addReply(c,*type.messageBulk);
+                addReplyBulk(c,channel);
+                addReplyBulk(c,message);
+            }
             receivers++;
         }
+        if (reply) releaseSharedReply(reply);
     }
+    return receivers;
+}
+
+/* Publish a message */
+int pubsubPublishMessage(robj *channel, robj *message) {
+    int receivers = 0;
+    listNode *ln;
+    listIter li;
+
+    /* Send to clients listening for that channel */
+    receivers += pubsubPublishMessageToChannel(channel,message,pubSubType);
+
     /* Send to clients listening to matching channels */
     if (listLength(server.pubsub_patterns)) {
         listRewind(server.pubsub_patterns,&li);
@@ -270,6 +401,12 @@ int pubsubPublishMessage(robj *channel, robj *message) {
     return receivers;
 }
 
+/* Publish a message to the clients subscribed to a shard channel. Patterns
+ * never match shard channels. */
+int pubsubPublishShardMessage(robj *channel, robj *message) {
+    return pubsubPublishMessageToChannel(channel,message,pubSubShardType);
+}
+
 /*-----------------------------------------------------------------------------
  * Pubsub commands implementation
  *----------------------------------------------------------------------------*/
@@ -291,7 +428,7 @@ void unsubscribeCommand(client *c) {
         for (j = 1; j < c->argc; j++)
             pubsubUnsubscribeChannel(c,c->argv[j],1);
     }
-    if (clientSubscriptionsCount(c) == 0) c->flags &= ~CLIENT_PUBSUB;
+    if (clientTotalSubscriptionsCount(c) == 0) c->flags &= ~CLIENT_PUBSUB;
 }
 
 void psubscribeCommand(client *c) {
@@ -311,7 +448,7 @@ void punsubscribeCommand(client *c) {
         for (j = 1; j < c->argc; j++)
             pubsubUnsubscribePattern(c,c->argv[j],1);
     }
-    if (clientSubscriptionsCount(c) == 0) c->flags &= ~CLIENT_PUBSUB;
+    if (clientTotalSubscriptionsCount(c) == 0) c->flags &= ~CLIENT_PUBSUB;
 }
 
 void publishCommand(client *c) {
@@ -323,6 +460,76 @@ void publishCommand(client *c) {
     addReplyLongLong(c,receivers);
 }
 
+void ssubscribeCommand(client *c) {
+    int j;
+
+    for (j = 1; j < c->argc; j++)
+        pubsubSubscribeChannelType(c,c->argv[j],pubSubShardType);
+    c->flags |= CLIENT_PUBSUB;
+}
+
+void sunsubscribeCommand(client *c) {
+    if (c->argc == 1) {
+        pubsubUnsubscribeShardAllChannels(c,1);
+    } else {
+        int j;
+
+        for (j = 1; j < c->argc; j++)
+            pubsubUnsubscribeChannelType(c,c->argv[j],1,pubSubShardType);
+    }
+    if (clientTotalSubscriptionsCount(c) == 0) c->flags &= ~CLIENT_PUBSUB;
+}
+
+/* SPUBLISH <channel> <message>: unlike PUBLISH, in Redis Cluster the message
+ * is only propagated to the master and the replicas serving the slot the
+ * channel hashes to. The command is redirected to the slot owner like any
+ * other command with a key. */
+void spublishCommand(client *c) {
+    int receivers = pubsubPublishShardMessage(c->argv[1],c->argv[2]);
+    if (server.cluster_enabled)
+        clusterPropagatePublishShard(c->argv[1],c->argv[2]);
+    else
+        forceCommandPropagation(c,PROPAGATE_REPL);
+    addReplyLongLong(c,receivers);
+}
+
+/* Reply with the channels of the given dictionary matching the pattern,
+ * or all the channels if pattern is NULL. */
+static void pubsubReplyChannels(client *c, dict *d, sds pat) {
+    dictIterator *di = dictGetIterator(d);
+    dictEntry *de;
+    long mblen = 0;
+    void *replylen;
+
+    replylen = addDeferredMultiBulkLength(c);
+    while((de = dictNext(di)) != NULL) {
+        robj *cobj = dictGetKey(de);
+        sds channel = cobj->ptr;
+
+        if (!pat || stringmatchlen(pat, sdslen(pat),
+                                   channel, sdslen(channel),0))
+        {
+            addReplyBulk(c,cobj);
+            mblen++;
+        }
+    }
+    dictReleaseIterator(di);
+    setDeferredMultiBulkLength(c,replylen,mblen);
+}
+
+/* Reply with the number of subscribers of every channel in argv[2..]. */
+static void pubsubReplyNumSub(client *c, dict *d) {
+    int j;
+
+    addReplyMultiBulkLen(c,(c->argc-2)*2);
+    for (j = 2; j < c->argc; j++) {
+        list *l = dictFetchValue(d,c->argv[j]);
+
+        addReplyBulk(c,c->argv[j]);
+        addReplyLongLong(c,l ? listLength(l) : 0);
+    }
+}
+
 /* PUBSUB command for Pub/Sub introspection. */
 void pubsubCommand(client *c) {
     if (c->argc == 2 && !strcasecmp(c->argv[1]->ptr,"help")) {
@@ -330,6 +537,8 @@ void pubsubCommand(client *c) {
 "CHANNELS [<pattern>] -- Return the currently active channels matching a pattern (default: all).",
 "NUMPAT -- Return number of subscriptions to patterns.",
 "NUMSUB [channel-1 .. channel-N] -- Returns the number of subscribers for the specified channels (excluding patterns, default: none).",
+"SHARDCHANNELS [<pattern>] -- Return the currently active shard channels matching a pattern (default: all).",
+"SHARDNUMSUB [channel-1 .. channel-N] -- Returns the number of subscribers for the specified shard channels (default: none).",
 NULL
         };
         addReplyHelp(c, help);
@@ -338,36 +547,19 @@ NULL
     {
         /* PUBSUB CHANNELS [<pattern>] */
         sds pat = (c->argc == 2) ? NULL : c->argv[2]->ptr;
-        dictIterator *di = dictGetIterator(server.pubsub_channels);
-        dictEntry *de;
-        long mblen = 0;
-        void *replylen;
-
-        replylen = addDeferredMultiBulkLength(c);
-        while((de = dictNext(di)) != NULL) {
-            robj *cobj = dictGetKey(de);
-            sds channel = cobj->ptr;
-
-            if (!pat || stringmatchlen(pat, sdslen(pat),
-                                       channel, sdslen(channel),0))
-            {
-                addReplyBulk(c,cobj);
-                mblen++;
-            }
-        }
-        dictReleaseIterator(di);
-        setDeferredMultiBulkLength(c,replylen,mblen);
+        pubsubReplyChannels(c,server.pubsub_channels,pat);
     } else if (!strcasecmp(c->argv[1]->ptr,"numsub") && c->argc >= 2) {
         /* PUBSUB NUMSUB [Channel_1 ... Channel_N] */
-        int j;
-
-        addReplyMultiBulkLen(c,(c->argc-2)*2);
-        for (j = 2; j < c->argc; j++) {
-            list *l = dictFetchValue(server.pubsub_channels,c->argv[j]);
-
-            addReplyBulk(c,c->argv[j]);
-            addReplyLongLong(c,l ? listLength(l) : 0);
-        }
+        pubsubReplyNumSub(c,server.pubsub_channels);
+    } else if (!strcasecmp(c->argv[1]->ptr,"shardchannels") &&
+        (c->argc == 2 || c->argc == 3))
+    {
+        /* PUBSUB SHARDCHANNELS [<pattern>] */
+        sds pat = (c->argc == 2) ? NULL : c->argv[2]->ptr;
+        pubsubReplyChannels(c,server.pubsubshard_channels,pat);
+    } else if (!strcasecmp(c->argv[1]->ptr,"shardnumsub") && c->argc >= 2) {
+        /* PUBSUB SHARDNUMSUB [Channel_1 ... Channel_N] */
+        pubsubReplyNumSub(c,server.pubsubshard_channels);
     } else if (!strcasecmp(c->argv[1]->ptr,"numpat") && c->argc == 2) {
         /* PUBSUB NUMPAT */
         addReplyLongLong(c,listLength(server.pubsub_patterns));
@@ -16,11 +16,14 @@
 #include "quicklist.h"
 #include "zmalloc.h"
 #include "ziplist.h"
+#include "listpack.h"
 #include "util.h" /* for ll2string */
 #include "lzf.h"
+#include "lz4lite.h"
 
 #if defined(REDIS_TEST) || defined(REDIS_TEST_VERBOSE)
 #include <stdio.h> /* for printf (debug printing), snprintf (genstr) */
+#include <stdlib.h> /* for rand */
 #endif
 
 #ifndef REDIS_STATIC
@@ -41,6 +44,50 @@ static const size_t optimization_level[] = {4096, 8192, 16384, 32768, 65536};
  * This also prevents us from storing compression if the compression resulted in a larger size than the original data. */
 #define MIN_COMPRESS_IMPROVE 8
 
+/* Node compression codecs, indexed by the node encoding they produce. */
+typedef struct quicklistCodec {
+    unsigned int (*compress)(const void *in_data, unsigned int in_len, void *out_data, unsigned int out_len);
+    unsigned int (*decompress)(const void *in_data, unsigned int in_len, void *out_data, unsigned int out_len);
+} quicklistCodec;
+
+static const quicklistCodec codecs[] = {
+    [QUICKLIST_NODE_ENCODING_LZF] = {lzf_compress, lzf_decompress},
+    [QUICKLIST_NODE_ENCODING_LZ4] = {lz4liteCompress, lz4liteDecompress},
+};
+
+/* Encoding used to compress nodes from now on. Nodes remember the codec
+ * they were compressed with, so it can be changed at any time. */
+static int compress_codec = QUICKLIST_NODE_ENCODING_LZF;
+
+/* Interior nodes that are accessed are decompressed and compressed again
+ * every time. A cache, shared by all the quicklists, keeps the other
+ * representation of the last few nodes that were decompressed: the
+ * compressed data while the node is in use, and the listpack once the node
+ * is compressed again. As long as the node is not modified, going back and
+ * forth is just a pointer swap.
+ *
+ * The cache is global so that its memory is bounded no matter how many
+ * compressed lists there are: at most QUICKLIST_NODE_CACHE_SIZE nodes of up
+ * to QUICKLIST_NODE_CACHE_MAX_BYTES each. */
+#define QUICKLIST_NODE_CACHE_SIZE 32
+
+/* Only nodes up to this size are cached, the cache costs their size. */
+#define QUICKLIST_NODE_CACHE_MAX_BYTES 8192
+
+typedef struct quicklistNodeCacheEntry {
+    quicklist *ql;          /* Quicklist of 'node'. */
+    quicklistNode *node;    /* NULL if the slot is free. */
+    unsigned char *data;    /* Representation 'node' is not using. */
+    int encoding;           /* Encoding of 'data' when it is compressed. */
+} quicklistNodeCacheEntry;
+
+static struct {
+    quicklistNodeCacheEntry entries[QUICKLIST_NODE_CACHE_SIZE];
+    int next;               /* Next slot to evict. */
+    int used;               /* Number of slots in use. */
+    size_t bytes;           /* Memory used by the cached data. */
+} node_cache;
+
 /* If not verbose testing, remove all debug printing. */
 #ifndef REDIS_TEST_VERBOSE
 #define D(...)
@@ -72,6 +119,193 @@ static const size_t optimization_level[] = {4096, 8192, 16384, 32768, 65536};
 #define unlikely(x) (x)
 #endif
 
+/* Quicklists with at least this number of nodes get an order statistics
+ * index over their nodes, so that positional access does not need to walk
+ * the list. Walking a few nodes is faster than maintaining the index. */
+#define QUICKLIST_INDEX_MIN_NODES 64
+
+/* The index is an array of the nodes in list order plus a Fenwick tree of
+ * their counts: the node holding a given element is found in O(log nodes).
+ * The index is built lazily by quicklistIndex() and dropped whenever nodes
+ * are added or removed. Count changes of the head and tail nodes, that is
+ * the common LPUSH/RPUSH/LPOP/RPOP case, update the tree in place. */
+typedef struct quicklistNodeIndex {
+    quicklistNode **nodes;  /* Nodes in list order. */
+    unsigned long *tree;    /* Fenwick tree of node counts, 1-based. */
+    unsigned long len;      /* Number of indexed nodes. */
+} quicklistNodeIndex;
+
+/* Drop the nodes index of 'ql', if any. Must be called every time nodes
+ * are added, removed or moved in memory. */
+void quicklistIndexReset(quicklist *ql) {
+    quicklistNodeIndex *idx = ql->index;
+    if (!idx) return;
+    zfree(idx->nodes);
+    zfree(idx->tree);
+    zfree(idx);
+    ql->index = NULL;
+}
+
+/* Return the nodes index of 'ql', building it if needed, or NULL if the
+ * list is too small to be worth indexing. */
+REDIS_STATIC quicklistNodeIndex *quicklistIndexGet(quicklist *ql) {
+    if (ql->len < QUICKLIST_INDEX_MIN_NODES) return NULL;
+    if (ql->index) return ql->index;
+
+    quicklistNodeIndex *idx = zmalloc(sizeof(*idx));
+    idx->len = ql->len;
+    idx->nodes = zmalloc(sizeof(quicklistNode*)*idx->len);
+    idx->tree = zmalloc(sizeof(unsigned long)*(idx->len+1));
+    idx->tree[0] = 0;
+
+    /* Linear time construction: every slot pushes its partial sum to the
+     * parent slot. */
+    quicklistNode *node = ql->head;
+    for (unsigned long i = 1; i <= idx->len; i++, node = node->next) {
+        idx->nodes[i-1] = node;
+        idx->tree[i] = node->count;
+    }
+    for (unsigned long i = 1; i <= idx->len; i++) {
+        unsigned long parent = i + (i & -i);
+        if (parent <= idx->len) idx->tree[parent] += idx->tree[i];
+    }
+    ql->index = idx;
+    return idx;
+}
+
+/* Account for 'delta' elements added to (or removed from, if negative) the
+ * node 'node' of 'ql'. Only the head and tail positions are known without
+ * a search, changes to other nodes just drop the index. */
+REDIS_STATIC void quicklistIndexUpdate(quicklist *ql, quicklistNode *node, long delta) {
+    quicklistNodeIndex *idx = ql->index;
+    unsigned long i;
+
+    if (!idx) return;
+    if (node == idx->nodes[0]) {
+        i = 1;
+    } else if (node == idx->nodes[idx->len-1]) {
+        i = idx->len;
+    } else {
+        quicklistIndexReset(ql);
+        return;
+    }
+    for (; i <= idx->len; i += i & -i) idx->tree[i] += delta;
+}
+
+/* Find the node holding the element at the zero-based offset 'index' from
+ * the head. The number of elements in the nodes before it is stored into
+ * '*accum'. The index must be in range. */
+REDIS_STATIC quicklistNode *quicklistIndexSeek(quicklistNodeIndex *idx, unsigned long long index, unsigned long long *accum) {
+    unsigned long pos = 0, step = 1;
+    unsigned long long sum = 0;
+
+    while (step*2 <= idx->len) step *= 2;
+    /* Find the last position whose prefix sum is <= index: the element is
+     * in the next node. */
+    for (; step; step /= 2) {
+        if (pos+step <= idx->len && sum+idx->tree[pos+step] <= index) {
+            pos += step;
+            sum += idx->tree[pos];
+        }
+    }
+    *accum = sum;
+    return idx->nodes[pos];
+}
+
+/* Return the cache entry of 'node', or NULL if it has none. The entry
+ * content is valid only if node->cached is set: node->cached is cleared
+ * when the node is modified, and the stale entry dropped later. */
+REDIS_STATIC quicklistNodeCacheEntry *quicklistNodeCacheFind(quicklistNode *node) {
+    if (!node_cache.used) return NULL;
+    for (int j = 0; j < QUICKLIST_NODE_CACHE_SIZE; j++) {
+        if (node_cache.entries[j].node == node) return &node_cache.entries[j];
+    }
+    return NULL;
+}
+
+/* Free the data of the cache entry 'e' and mark the slot as free. */
+REDIS_STATIC void quicklistNodeCacheFreeEntry(quicklistNodeCacheEntry *e) {
+    e->node->cached = 0;
+    e->ql->cached_nodes--;
+    node_cache.bytes -= zmalloc_size(e->data);
+    node_cache.used--;
+    zfree(e->data);
+    e->ql = NULL;
+    e->node = NULL;
+    e->data = NULL;
+}
+
+/* Drop the cache entry of 'node', if any. Must be called before the node
+ * is freed. */
+REDIS_STATIC void quicklistNodeCacheDel(quicklistNode *node) {
+    quicklistNodeCacheEntry *e = quicklistNodeCacheFind(node);
+    if (e) quicklistNodeCacheFreeEntry(e);
+}
+
+/* Remember 'data', the representation 'node' of 'ql' is not using,
+ * evicting an older entry if needed. The node must not already have an
+ * entry. */
+REDIS_STATIC void quicklistNodeCacheAdd(quicklist *ql, quicklistNode *node, unsigned char *data, int encoding) {
+    quicklistNodeCacheEntry *e = &node_cache.entries[node_cache.next];
+    node_cache.next = (node_cache.next + 1) % QUICKLIST_NODE_CACHE_SIZE;
+    if (e->node) quicklistNodeCacheFreeEntry(e);
+    e->ql = ql;
+    e->node = node;
+    e->data = data;
+    e->encoding = encoding;
+    node->cached = 1;
+    ql->cached_nodes++;
+    node_cache.bytes += zmalloc_size(data);
+    node_cache.used++;
+}
+
+/* Swap the representation 'node' is using with the one in its cache entry
+ * 'e', together with their encodings. */
+REDIS_STATIC void quicklistNodeCacheSwap(quicklistNodeCacheEntry *e, quicklistNode *node) {
+    unsigned char *data = node->zl;
+    int encoding = node->encoding;
+    node_cache.bytes -= zmalloc_size(e->data);
+    node_cache.bytes += zmalloc_size(data);
+    node->zl = e->data;
+    node->encoding = e->encoding;
+    e->data = data;
+    e->encoding = encoding;
+}
+
+/* Drop all the cached nodes of 'ql', or the whole cache if 'ql' is NULL.
+ * Must be called when the nodes are moved in memory, and before the
+ * quicklist is freed. Since the cache is global, a quicklist that is going
+ * to be freed by another thread must have its nodes dropped by the main
+ * thread in advance: quicklistRelease() will then not access the cache. */
+void quicklistNodeCacheReset(quicklist *ql) {
+    if (ql ? !ql->cached_nodes : !node_cache.used) return;
+    for (int j = 0; j < QUICKLIST_NODE_CACHE_SIZE; j++) {
+        quicklistNodeCacheEntry *e = &node_cache.entries[j];
+        if (e->node && (ql == NULL || e->ql == ql))
+            quicklistNodeCacheFreeEntry(e);
+    }
+}
+
+/* Return the memory used by the cached nodes of 'ql', or by the whole
+ * cache if 'ql' is NULL. */
+size_t quicklistNodeCacheBytes(const quicklist *ql) {
+    size_t bytes = 0;
+    if (ql == NULL) return node_cache.bytes;
+    if (!ql->cached_nodes) return 0;
+    for (int j = 0; j < QUICKLIST_NODE_CACHE_SIZE; j++) {
+        quicklistNodeCacheEntry *e = &node_cache.entries[j];
+        if (e->node && e->ql == ql) bytes += zmalloc_size(e->data);
+    }
+    return bytes;
+}
+
+/* Set the codec used to compress nodes: QUICKLIST_NODE_ENCODING_LZF or
+ * QUICKLIST_NODE_ENCODING_LZ4. */
+void quicklistSetCompressCodec(int codec) {
+    if (codec == QUICKLIST_NODE_ENCODING_LZF || codec == QUICKLIST_NODE_ENCODING_LZ4)
+        compress_codec = codec;
+}
+
 /* Create a new quicklist. Free with quicklistRelease(). */
 /* 创建对应的quicklist结构,并获取对应的空间指向 */
 quicklist *quicklistCreate(void) {
@@ -84,6 +318,8 @@ quicklist *quicklistCreate(void) {
     quicklist->count = 0;
     quicklist->compress = 0;
     quicklist->fill = -2;
+    quicklist->index = NULL;
+    quicklist->cached_nodes = 0;
 	//返回对应的quicklist结构的指向
     return quicklist;
 }
@@ -163,8 +399,9 @@ REDIS_STATIC quicklistNode *quicklistCreateNode(void) {
     node->sz = 0;
     node->next = node->prev = NULL;
     node->encoding = QUICKLIST_NODE_ENCODING_RAW;
-    node->container = QUICKLIST_NODE_CONTAINER_ZIPLIST;
+    node->container = QUICKLIST_NODE_CONTAINER_LISTPACK;
     node->recompress = 0;
+    node->cached = 0;
 	//返回对应的链表节点指向
     return node;
 }
@@ -178,7 +415,8 @@ unsigned long quicklistCount(const quicklist *ql) { return ql->count; }
 void quicklistRelease(quicklist *quicklist) {
     unsigned long len;
     quicklistNode *current, *next;
-	
+
+    quicklistNodeCacheReset(quicklist);
 	//获取对应的头节点指向
     current = quicklist->head;
 	//获取当前quicklist结构中链表节点元素的数量值
@@ -198,6 +436,7 @@ void quicklistRelease(quicklist *quicklist) {
 		//设置下一个需要遍历的链表结构节点
         current = next;
     }
+    quicklistIndexReset(quicklist);
 	//最后释放对应的quicklist结构占据的空间
     zfree(quicklist);
 }
@@ -211,6 +450,16 @@ REDIS_STATIC int __quicklistCompressNode(quicklistNode *node) {
     node->attempted_compress = 1;
 #endif
 
+    /* The node was not modified since it was decompressed: swap back the
+     * compressed data we kept and keep the listpack instead. */
+    quicklistNodeCacheEntry *e = quicklistNodeCacheFind(node);
+    if (e && node->cached) {
+        quicklistNodeCacheSwap(e, node);
+        node->recompress = 0;
+        return 1;
+    }
+    if (e) quicklistNodeCacheFreeEntry(e);
+
     /* Don't bother compressing small values */
 	//检测需要压缩的链表节点中对应的ziplist的字节数是否比较少----->字节数量少就不进行压缩操作处理了
     if (node->sz < MIN_COMPRESS_BYTES)
@@ -221,8 +470,8 @@ REDIS_STATIC int __quicklistCompressNode(quicklistNode *node) {
 
     /* Cancel if compression fails or doesn't compress small enough */
 	//进行压缩数据处理          如果压缩失败或者不能够压缩到足够小就退出了
-    if (((lzf->sz = lzf_compress(node->zl, node->sz, lzf->compressed, node->sz)) == 0) || lzf->sz + MIN_COMPRESS_IMPROVE >= node->sz) {
-        /* lzf_compress aborts/rejects compression if value not compressable. */
+    if (((lzf->sz = codecs[compress_codec].compress(node->zl, node->sz, lzf->compressed, node->sz)) == 0) || lzf->sz + MIN_COMPRESS_IMPROVE >= node->sz) {
+        /* The codec aborts/rejects compression if value not compressable. */
 		//释放分配的空间
 		zfree(lzf);
 		//返回没有压缩处理的标识
@@ -235,7 +484,7 @@ REDIS_STATIC int __quicklistCompressNode(quicklistNode *node) {
 	//给链表节点设置新的压缩数据之后的结构位置指向
     node->zl = (unsigned char *)lzf;
 	//给链表节点设置进行压缩处理标识
-    node->encoding = QUICKLIST_NODE_ENCODING_LZF;
+    node->encoding = compress_codec;
 	//设置重新进行压缩处理标记
     node->recompress = 0;
 	//返回压缩节点数据成功的标识
@@ -254,25 +503,37 @@ REDIS_STATIC int __quicklistCompressNode(quicklistNode *node) {
 /* Uncompress the ziplist in 'node' and update encoding details.
  * Returns 1 on successful decode, 0 on failure to decode. */
 /* 对给定的链表节点进行解压缩操作处理 */
-REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
+REDIS_STATIC int __quicklistDecompressNode(quicklist *ql, quicklistNode *node) {
 #ifdef REDIS_TEST
     node->attempted_compress = 0;
 #endif
 
+    /* We still have the listpack of this node: swap it in, and keep the
+     * compressed data for when the node is compressed again. */
+    quicklistNodeCacheEntry *e = quicklistNodeCacheFind(node);
+    if (e && node->cached) {
+        quicklistNodeCacheSwap(e, node);
+        return 1;
+    }
+    if (e) quicklistNodeCacheFreeEntry(e);
+
 	//提前给对应的ziplist分配对应的空间
     void *decompressed = zmalloc(node->sz);
 	//获取对应链表节点的压缩数据的节点
     quicklistLZF *lzf = (quicklistLZF *)node->zl;
 	//进行解压缩操作处理
-    if (lzf_decompress(lzf->compressed, lzf->sz, decompressed, node->sz) == 0) {
+    if (codecs[node->encoding].decompress(lzf->compressed, lzf->sz, decompressed, node->sz) == 0) {
         /* Someone requested decompress, but we can't decompress.  Not good. */
 		//解压失败释放已经分配的空间
         zfree(decompressed);
 		//返回进行解压缩操作失败的标识
         return 0;
     }
-	//释放压缩数据占据的空间位置
-    zfree(lzf);
+	//小的链表节点保留压缩数据,再次压缩的时候不需要重新进行压缩操作处理
+    if (node->sz <= QUICKLIST_NODE_CACHE_MAX_BYTES)
+        quicklistNodeCacheAdd(ql, node, (unsigned char *)lzf, node->encoding);
+    else
+        zfree(lzf);
 	//将对应的解压缩操作后的节点设置到对应的链表节点位置指向上
     node->zl = decompressed;
 	//设置链表节点类型为非压缩节点类型
@@ -283,27 +544,28 @@ REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
 
 /* Decompress only compressed nodes. */
 /* 进行对给定的链表节点进行解压缩操作处理的宏 注意此处节点的recompress标记并没有进行改变操作处理 */
-#define quicklistDecompressNode(_node)                                         \
+#define quicklistDecompressNode(_ql, _node)                                    \
     do {                                                                       \
-        if ((_node) && (_node)->encoding == QUICKLIST_NODE_ENCODING_LZF) {     \
-            __quicklistDecompressNode((_node));                                \
+        if ((_node) && quicklistNodeIsCompressed(_node)) {                     \
+            __quicklistDecompressNode((struct quicklist *)(_ql), (_node));     \
         }                                                                      \
     } while (0)
 
 /* Force node to not be immediately re-compresable */
 /* 进行对给定的链表节点进行解压缩操作处理的宏 */
 /* 注意此处节点的recompress标记进行改变操作处理------->可以通过后面的代码来进一步明确recompress标记的意图 */
-#define quicklistDecompressNodeForUse(_node)                                   \
+#define quicklistDecompressNodeForUse(_ql, _node)                              \
     do {                                                                       \
-        if ((_node) && (_node)->encoding == QUICKLIST_NODE_ENCODING_LZF) {     \
-            __quicklistDecompressNode((_node));                                \
+        if ((_node) && quicklistNodeIsCompressed(_node)) {                     \
+            __quicklistDecompressNode((struct quicklist *)(_ql), (_node));     \
             (_node)->recompress = 1;                                           \
         }                                                                      \
     } while (0)
 
-/* Extract the raw LZF data from this quicklistNode.
- * Pointer to LZF data is assigned to '*data'.
- * Return value is the length of compressed LZF data. */
+/* Extract the raw compressed data from this quicklistNode, whatever its
+ * codec is: callers that need LZF data must check node->encoding.
+ * Pointer to compressed data is assigned to '*data'.
+ * Return value is the length of compressed data. */
 /* 获取给定链表节点的压缩数据,同时返回对应的未进行压缩前的总字节数 */
 size_t quicklistGetLzf(const quicklistNode *node, void **data) {
 	//获取给定链表节点的压缩数据的位置指向
@@ -314,6 +576,23 @@ size_t quicklistGetLzf(const quicklistNode *node, void **data) {
     return lzf->sz;
 }
 
+/* Return a copy of the listpack of 'node', decompressing it if needed,
+ * without touching the node itself. The copy must be freed with zfree().
+ * Returns NULL if the node can't be decompressed. */
+unsigned char *quicklistGetListpackCopy(const quicklistNode *node) {
+    unsigned char *lp = zmalloc(node->sz);
+    if (quicklistNodeIsCompressed(node)) {
+        quicklistLZF *lzf = (quicklistLZF *)node->zl;
+        if (codecs[node->encoding].decompress(lzf->compressed, lzf->sz, lp, node->sz) == 0) {
+            zfree(lp);
+            return NULL;
+        }
+    } else {
+        memcpy(lp, node->zl, node->sz);
+    }
+    return lp;
+}
+
 /* 检测给定的quicklist结构是否可以进行压缩操作处理 */
 #define quicklistAllowsCompression(_ql) ((_ql)->compress != 0)
 
@@ -322,7 +601,7 @@ size_t quicklistGetLzf(const quicklistNode *node, void **data) {
  * to our "interior" compress depth then compress the next node we find.
  * If compress depth is larger than the entire list, we return immediately. */
 /* 强制给对应的quicklist结构进行整体的解压缩和压缩操作处理 即在给定的范围内的进行解压缩操作处理,同时处理给定节点的压缩操作处理 */
-REDIS_STATIC void __quicklistCompress(const quicklist *quicklist, quicklistNode *node) {
+REDIS_STATIC void __quicklistCompress(quicklist *quicklist, quicklistNode *node) {
     /* If length is less than our compress depth (from both sides), we can't compress anything. */
 	//首先检测是否允许压缩处理 以及是否达到压缩处理的界限值
     if (!quicklistAllowsCompression(quicklist) || quicklist->len < (unsigned int)(quicklist->compress * 2))
@@ -333,18 +612,18 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist, quicklistNode
     /* Optimized cases for small depth counts */
     if (quicklist->compress == 1) {
         quicklistNode *h = quicklist->head, *t = quicklist->tail;
-        quicklistDecompressNode(h);
-        quicklistDecompressNode(t);
+        quicklistDecompressNode(quicklist, h);
+        quicklistDecompressNode(quicklist, t);
         if (h != node && t != node)
             quicklistCompressNode(node);
         return;
     } else if (quicklist->compress == 2) {
         quicklistNode *h = quicklist->head, *hn = h->next, *hnn = hn->next;
         quicklistNode *t = quicklist->tail, *tp = t->prev, *tpp = tp->prev;
-        quicklistDecompressNode(h);
-        quicklistDecompressNode(hn);
-        quicklistDecompressNode(t);
-        quicklistDecompressNode(tp);
+        quicklistDecompressNode(quicklist, h);
+        quicklistDecompressNode(quicklist, hn);
+        quicklistDecompressNode(quicklist, t);
+        quicklistDecompressNode(quicklist, tp);
         if (h != node && hn != node && t != node && tp != node) {
             quicklistCompressNode(node);
         }
@@ -367,8 +646,8 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist, quicklistNode
 	//循环对两侧的链表节点进行检测压缩操作处理
     while (depth++ < quicklist->compress) {
 		//尝试将两侧的链表节点进行解压缩操作处理----->即不在压缩范围内的不压缩处理
-        quicklistDecompressNode(forward);
-        quicklistDecompressNode(reverse);
+        quicklistDecompressNode(quicklist, forward);
+        quicklistDecompressNode(quicklist, reverse);
 	
 		//检测给定的链表节点是否处于不进行压缩操作处理的范围内
         if (forward == node || reverse == node)
@@ -402,7 +681,7 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist, quicklistNode
         if ((_node)->recompress)                                               \
             quicklistCompressNode((_node));                                    \
         else                                                                   \
-            __quicklistCompress((_ql), (_node));                               \
+            __quicklistCompress((struct quicklist *)(_ql), (_node));           \
     } while (0)
 
 /* If we previously used quicklistDecompressNodeForUse(), just recompress. */
@@ -463,6 +742,7 @@ REDIS_STATIC void __quicklistInsertNode(quicklist *quicklist, quicklistNode *old
 	
 	//添加quicklist结构中的链表节点的数量
     quicklist->len++;
+    quicklistIndexReset(quicklist);
 }
 
 /* Wrappers for node inserting around existing node. */
@@ -510,25 +790,27 @@ REDIS_STATIC int _quicklistNodeAllowInsert(const quicklistNode *node, const int
 		//不存在,直接返回不允许在给定的结构节点上进行元素的插入操作处理
         return 0;
 
-    int ziplist_overhead;
+    int listpack_overhead;
 	//下面进行大体估算出插入本元素节点需要的空间个数
-    /* size of previous offset */
-    if (sz < 254)
-        ziplist_overhead = 1;
+    /* size of the entry encoding header */
+    if (sz < 64)
+        listpack_overhead = 1;
+    else if (likely(sz < 4096))
+        listpack_overhead = 2;
     else
-        ziplist_overhead = 5;
+        listpack_overhead = 5;
 
-    /* size of forward offset */
-    if (sz < 64)
-        ziplist_overhead += 1;
-    else if (likely(sz < 16384))
-        ziplist_overhead += 2;
+    /* size of the backlen, encoding the length of header plus data */
+    if (sz + listpack_overhead <= 127)
+        listpack_overhead += 1;
+    else if (likely(sz + listpack_overhead < 16383))
+        listpack_overhead += 2;
     else
-        ziplist_overhead += 5;
+        listpack_overhead += 5;
 
     /* new_sz overestimates if 'sz' encodes to an integer type */
-	//大体计算出插入本数据节点后ziplist对应的总的字节数量
-    unsigned int new_sz = node->sz + sz + ziplist_overhead;
+	//大体计算出插入本数据节点后listpack对应的总的字节数量
+    unsigned int new_sz = node->sz + sz + listpack_overhead;
 	//此处的判断分为 检测字节大小是否超过范围 总元素个数是否超过范围 等检测操作处理
     if (likely(_quicklistNodeSizeMeetsOptimizationRequirement(new_sz, fill)))
 		//检测计算的字节数量是否在设定的满足范围之内
@@ -551,9 +833,9 @@ REDIS_STATIC int _quicklistNodeAllowMerge(const quicklistNode *a, const quicklis
     if (!a || !b)
         return 0;
 
-    /* approximate merged ziplist size (- 11 to remove one ziplist header/trailer) */
+    /* approximate merged listpack size (- 7 to remove one listpack header/trailer) */
 	//计算合并是需要的总的字节数量----->这个值只是一个大体值
-    unsigned int merge_sz = a->sz + b->sz - 11;
+    unsigned int merge_sz = a->sz + b->sz - 7;
 	//进行检测是否可以进行合并处理------->这个判断处理和上面函数的处理方式相同
     if (likely(_quicklistNodeSizeMeetsOptimizationRequirement(merge_sz, fill)))
 		//检测字节数量是否超过了合并范围
@@ -569,9 +851,12 @@ REDIS_STATIC int _quicklistNodeAllowMerge(const quicklistNode *a, const quicklis
 }
 
 /* 用于更新对应结构节点中记录ziplist字节数量的字段值的宏  */
+/* Every change to a node listpack is followed by this macro, that also
+ * invalidates the compressed data the node cache may hold for the node. */
 #define quicklistNodeUpdateSz(node)                                            \
     do {                                                                       \
-        (node)->sz = ziplistBlobLen((node)->zl);                               \
+        (node)->sz = lpBytes((node)->zl);                                      \
+        (node)->cached = 0;                                                    \
     } while (0)
 
 /* Add new entry to head node of quicklist.
@@ -584,14 +869,14 @@ int quicklistPushHead(quicklist *quicklist, void *value, size_t sz) {
 	//检测是否能够在当前的头链表节点上进行数据插入处理
     if (likely(_quicklistNodeAllowInsert(quicklist->head, quicklist->fill, sz))) {
 		//在原始的头链表结构节点上开始插入对应的数据元素----->数据插入的位置在对应的头部位置
-        quicklist->head->zl = ziplistPush(quicklist->head->zl, value, sz, ZIPLIST_HEAD);
+        quicklist->head->zl = lpPrepend(quicklist->head->zl, value, sz);
 		//更新对应的链表结构节点上记录的ziplist的总字节长度
         quicklistNodeUpdateSz(quicklist->head);
     } else {
 		//创建对应的新的链表结构节点
         quicklistNode *node = quicklistCreateNode();
 		//创建的压缩列表结构并进行插入对应的数据元素----->数据插入的位置在对应的头部位置
-        node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_HEAD);
+        node->zl = lpPrepend(lpNew(), value, sz);
 		//更新对应的链表结构节点上记录的ziplist的总字节长度
         quicklistNodeUpdateSz(node);
 		//将对应的新创建的链表结构节点链接到原始的头结构节点上,即更新了头结构节点
@@ -601,6 +886,7 @@ int quicklistPushHead(quicklist *quicklist, void *value, size_t sz) {
     quicklist->count++;
 	//设置quicklist结构中对应的头结构节点的数据元素个数增加处理
     quicklist->head->count++;
+    quicklistIndexUpdate(quicklist, quicklist->head, 1);
 	//返回头结构节点是否是新创建结构节点的标识
     return (orig_head != quicklist->head);
 }
@@ -613,30 +899,31 @@ int quicklistPushHead(quicklist *quicklist, void *value, size_t sz) {
 int quicklistPushTail(quicklist *quicklist, void *value, size_t sz) {
     quicklistNode *orig_tail = quicklist->tail;
     if (likely(_quicklistNodeAllowInsert(quicklist->tail, quicklist->fill, sz))) {
-        quicklist->tail->zl = ziplistPush(quicklist->tail->zl, value, sz, ZIPLIST_TAIL);
+        quicklist->tail->zl = lpAppend(quicklist->tail->zl, value, sz);
         quicklistNodeUpdateSz(quicklist->tail);
     } else {
         quicklistNode *node = quicklistCreateNode();
-        node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_TAIL);
+        node->zl = lpAppend(lpNew(), value, sz);
         quicklistNodeUpdateSz(node);
         _quicklistInsertNodeAfter(quicklist, quicklist->tail, node);
     }
     quicklist->count++;
     quicklist->tail->count++;
+    quicklistIndexUpdate(quicklist, quicklist->tail, 1);
     return (orig_tail != quicklist->tail);
 }
 
 /* Create new node consisting of a pre-formed ziplist. Used for loading RDBs where entire ziplists have been stored to be retrieved later. */
-/* 将给定的ziplist结构数据链接到quicklist结构的尾链表节点后 */
-void quicklistAppendZiplist(quicklist *quicklist, unsigned char *zl) {
+/* 将给定的listpack结构数据链接到quicklist结构的尾链表节点后 */
+void quicklistAppendListpack(quicklist *quicklist, unsigned char *zl) {
 	//创建对应的链表节点
     quicklistNode *node = quicklistCreateNode();
 	//设置链表节点中元素节点的位置指向
     node->zl = zl;
 	//设置链表节点中总的元素个数
-    node->count = ziplistLen(node->zl);
+    node->count = lpLength(node->zl);
 	//设置链表节点中总占据的空间字节数
-    node->sz = ziplistBlobLen(zl);
+    node->sz = lpBytes(zl);
 	//将新创建的链表节点插入到尾链表节点后
     _quicklistInsertNodeAfter(quicklist, quicklist->tail, node);
 	//更新quicklist结构的总的元素数量
@@ -655,7 +942,7 @@ quicklist *quicklistAppendValuesFromZiplist(quicklist *quicklist, unsigned char
 	
 	//获取ziplist首元素位置指向
     unsigned char *p = ziplistIndex(zl, 0);
-	/循环处理ziplist中的数据,将其插入到quicklist结构尾部
+	//循环处理ziplist中的数据,将其插入到quicklist结构尾部
     while (ziplistGet(p, &value, &sz, &longval)) {
 		//检测在ziplist中获取的元素是否是整数类型
         if (!value) {
@@ -716,12 +1003,14 @@ REDIS_STATIC void __quicklistDelNode(quicklist *quicklist, quicklistNode *node)
 	
 	//减少quicklist结构中记录的数据元素个数
     quicklist->count -= node->count;
+    quicklistNodeCacheDel(node);
 	//释放对应的链表节点中所有数据节点占据的空间
     zfree(node->zl);
 	//释放对应的链表节点占据的空间
     zfree(node);
 	//减少quicklist结构中链表节点的数量
     quicklist->len--;
+    quicklistIndexReset(quicklist);
 }
 
 /* Delete one entry from list given the node for the entry and a pointer to the entry in the node.
@@ -732,9 +1021,10 @@ REDIS_STATIC int quicklistDelIndex(quicklist *quicklist, quicklistNode *node, un
 	//用于记录是否进行删除链表节点的标识
     int gone = 0;
 	//删除对应位置上元素节点
-    node->zl = ziplistDelete(node->zl, p);
+    node->zl = lpDelete(node->zl, *p, p);
 	//链表节点元素个数进行自减处理
     node->count--;
+    quicklistIndexUpdate(quicklist, node, -1);
 	//检测本链表节点上的元素个数总数是否减少为0
     if (node->count == 0) {
 		//设置需要进行删除本链表节点的标识
@@ -795,10 +1085,8 @@ int quicklistReplaceAtIndex(quicklist *quicklist, long index, void *data, int sz
 	//首先检测给定的索引位置是否有对应的节点数据信息
     if (likely(quicklistIndex(quicklist, index, &entry))) {
         /* quicklistIndex provides an uncompressed node */
-		//删除对应位置上的节点数据
-        entry.node->zl = ziplistDelete(entry.node->zl, &entry.zi);
-		//将新的数据插入到本链表节点的数据上
-        entry.node->zl = ziplistInsert(entry.node->zl, entry.zi, data, sz);
+		//原地替换对应位置上的节点数据
+        entry.node->zl = lpInsert(entry.node->zl, data, sz, entry.zi, LP_REPLACE, NULL);
 		//更新链表节点中总的字节数量
         quicklistNodeUpdateSz(entry.node);
 		//尝试进行压缩处理
@@ -827,12 +1115,12 @@ int quicklistReplaceAtIndex(quicklist *quicklist, long index, void *data, int sz
 REDIS_STATIC quicklistNode *_quicklistZiplistMerge(quicklist *quicklist, quicklistNode *a, quicklistNode *b) {
     D("Requested merge (a,b) (%u, %u)", a->count, b->count);
 	//尝试对a链表节点进行解压缩操作处理
-    quicklistDecompressNode(a);
+    quicklistDecompressNode(quicklist, a);
 	//尝试对b链表节点进行解压缩操作处理
-    quicklistDecompressNode(b);
+    quicklistDecompressNode(quicklist, b);
 	//尝试检测合并两个压缩列表处理
-    if ((ziplistMerge(&a->zl, &b->zl))) {
-        /* We merged ziplists! Now remove the unused quicklistNode. */
+    if ((lpMerge(&a->zl, &b->zl))) {
+        /* We merged listpacks! Now remove the unused quicklistNode. */
         quicklistNode *keep = NULL, *nokeep = NULL;
 		//获取进行合并后保留数据节点的结构节点
         if (!a->zl) {
@@ -843,7 +1131,7 @@ REDIS_STATIC quicklistNode *_quicklistZiplistMerge(quicklist *quicklist, quickli
             keep = a;
         }
 		//获取合并后元素节点的数量
-        keep->count = ziplistLen(keep->zl);
+        keep->count = lpLength(keep->zl);
 		//更新链表节点中总的字节数
         quicklistNodeUpdateSz(keep);
 
@@ -975,13 +1263,13 @@ REDIS_STATIC quicklistNode *_quicklistSplitNode(quicklistNode *node, int offset,
     D("After %d (%d); ranges: [%d, %d], [%d, %d]", after, offset, orig_start, orig_extent, new_start, new_extent);
 
 	//最原始链表节点中的压缩列表删除对应范围的值
-    node->zl = ziplistDeleteRange(node->zl, orig_start, orig_extent);
-    node->count = ziplistLen(node->zl);
+    node->zl = lpDeleteRange(node->zl, orig_start, orig_extent);
+    node->count = lpLength(node->zl);
     quicklistNodeUpdateSz(node);
 
 	//在新的链表节点中的压缩列表删除对应范围的值
-    new_node->zl = ziplistDeleteRange(new_node->zl, new_start, new_extent);
-    new_node->count = ziplistLen(new_node->zl);
+    new_node->zl = lpDeleteRange(new_node->zl, new_start, new_extent);
+    new_node->count = lpLength(new_node->zl);
     quicklistNodeUpdateSz(new_node);
 
     D("After split lengths: orig (%d), new (%d)", node->count, new_node->count);
@@ -1006,7 +1294,7 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
 		//创建新的链表节点
         new_node = quicklistCreateNode();
 		//将对应的数据插入新创建的压缩列表中,并将其设置到链表节点上
-        new_node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_HEAD);
+        new_node->zl = lpPrepend(lpNew(), value, sz);
 		//将新创建的链表节点添加到quicklist结构上
         __quicklistInsertNode(quicklist, NULL, new_node, after);
 		//更新链表节点对应的元素数量
@@ -1057,17 +1345,12 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
 		//向本节点中后面插入,且本节点中有足够空间的处理情况
         D("Not full, inserting after current position.");
 		//尝试进行解压缩操作处理
-        quicklistDecompressNodeForUse(node);
-		//获取对应的插入位置
-        unsigned char *next = ziplistNext(node->zl, entry->zi);
-		//根据获取到的插入位置进行数据插入操作处理
-        if (next == NULL) {
-            node->zl = ziplistPush(node->zl, value, sz, ZIPLIST_TAIL);
-        } else {
-            node->zl = ziplistInsert(node->zl, next, value, sz);
-        }
+        quicklistDecompressNodeForUse(quicklist, node);
+		//在对应的元素位置后插入元素
+        node->zl = lpInsert(node->zl, value, sz, entry->zi, LP_AFTER, NULL);
 		//更新链表节点的元素数量
         node->count++;
+        quicklistIndexUpdate(quicklist, node, 1);
 		//更新链表节点中记录的总字节数量
         quicklistNodeUpdateSz(node);
 		//尝试进行压缩操作处理
@@ -1076,11 +1359,12 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
 		//向本节点中前面插入,且本节点中有足够空间的处理情况
         D("Not full, inserting before current position.");
 		//尝试进行解压缩操作处理
-        quicklistDecompressNodeForUse(node);
+        quicklistDecompressNodeForUse(quicklist, node);
 		//在指定的元素位置前插入元素
-        node->zl = ziplistInsert(node->zl, entry->zi, value, sz);
+        node->zl = lpInsert(node->zl, value, sz, entry->zi, LP_BEFORE, NULL);
 		//更新链表节点的元素数量
         node->count++;
+        quicklistIndexUpdate(quicklist, node, 1);
 		//更新链表节点中记录的总字节数量
         quicklistNodeUpdateSz(node);
 		//尝试进行压缩操作处理
@@ -1092,11 +1376,12 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
 		//获取下一个链表节点
         new_node = node->next;
 		//尝试进行解压缩操作处理
-        quicklistDecompressNodeForUse(new_node);
+        quicklistDecompressNodeForUse(quicklist, new_node);
 		//在对应的链表头部插入节点
-        new_node->zl = ziplistPush(new_node->zl, value, sz, ZIPLIST_HEAD);
+        new_node->zl = lpPrepend(new_node->zl, value, sz);
 		//更新链表节点的元素数量
         new_node->count++;
+        quicklistIndexUpdate(quicklist, new_node, 1);
 		//更新链表节点中记录的总字节数量
         quicklistNodeUpdateSz(new_node);
 		//尝试进行压缩操作处理
@@ -1108,11 +1393,12 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
 		//获取前置链表节点
         new_node = node->prev;
 		//尝试进行解压缩操作处理
-        quicklistDecompressNodeForUse(new_node);
+        quicklistDecompressNodeForUse(quicklist, new_node);
 		//在对应的链表尾部插入节点
-        new_node->zl = ziplistPush(new_node->zl, value, sz, ZIPLIST_TAIL);
+        new_node->zl = lpAppend(new_node->zl, value, sz);
 		//更新链表节点的元素数量
         new_node->count++;
+        quicklistIndexUpdate(quicklist, new_node, 1);
 		//更新链表节点中记录的总字节数量
         quicklistNodeUpdateSz(new_node);
 		//尝试进行压缩操作处理
@@ -1124,7 +1410,7 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
 		//重新创建对应的链表节点
         new_node = quicklistCreateNode();
 		//将对应的元素插入到压缩列表中
-        new_node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_HEAD);
+        new_node->zl = lpPrepend(lpNew(), value, sz);
 		//更新链表节点的元素数量
         new_node->count++;
 		//更新链表节点中记录的总字节数量
@@ -1137,11 +1423,12 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
 		//本节点已经没有对应的空间 且在链表节点的中间进行插入元素操作处理----->需要进行拆分操作处理
         D("\tsplitting node...");
 		//尝试进行解压缩操作处理
-        quicklistDecompressNodeForUse(node);
+        quicklistDecompressNodeForUse(quicklist, node);
 		//进行拆分操作处理
         new_node = _quicklistSplitNode(node, entry->offset, after);
 		//将对应的元素插入到链表节点上
-        new_node->zl = ziplistPush(new_node->zl, value, sz, after ? ZIPLIST_HEAD : ZIPLIST_TAIL);
+        new_node->zl = after ? lpPrepend(new_node->zl, value, sz) :
+                               lpAppend(new_node->zl, value, sz);
 		//更新链表节点的元素数量
         new_node->count++;
 		//更新链表节点中记录的总字节数量
@@ -1249,13 +1536,14 @@ int quicklistDelRange(quicklist *quicklist, const long start, const long count)
             __quicklistDelNode(quicklist, node);
         } else {
          	//尝试进行解压缩结构节点中的数据
-            quicklistDecompressNodeForUse(node);
+            quicklistDecompressNodeForUse(quicklist, node);
 			//删除从指定索引位置开始的对应数目的元素
-            node->zl = ziplistDeleteRange(node->zl, entry.offset, del);
+            node->zl = lpDeleteRange(node->zl, entry.offset, del);
 			//更新对应的结构节点的总字节数量
             quicklistNodeUpdateSz(node);
 			//更新链表节点中元素的个数
             node->count -= del;
+            quicklistIndexUpdate(quicklist, node, -(long)del);
 			//更新quicklist结构中总元素的数量
             quicklist->count -= del;
 			//检测有必要是否删除对应的链表节点
@@ -1277,10 +1565,10 @@ int quicklistDelRange(quicklist *quicklist, const long start, const long count)
     return 1;
 }
 
-/* Passthrough to ziplistCompare() */
+/* Passthrough to lpCompare() */
 /* 比较给定的两个字符串数据指向的内容是否相同 */
 int quicklistCompare(unsigned char *p1, unsigned char *p2, int p2_len) {
-    return ziplistCompare(p1, p2, p2_len);
+    return lpCompare(p1, p2, p2_len);
 }
 
 /* Returns a quicklist iterator 'iter'. After the initialization every call to quicklistNext() will return the next element of the quicklist. */
@@ -1399,17 +1687,17 @@ int quicklistNext(quicklistIter *iter, quicklistEntry *entry) {
     if (!iter->zi) {
         /* If !zi, use current index. */
 		//尝试进行解压缩处理
-        quicklistDecompressNodeForUse(iter->current);
+        quicklistDecompressNodeForUse(iter->quicklist, iter->current);
 		//获取对应索引位置处的元素节点指向
-        iter->zi = ziplistIndex(iter->current->zl, iter->offset);
+        iter->zi = lpSeek(iter->current->zl, iter->offset);
     } else {
         /* else, use existing iterator offset and get prev/next as necessary. */
 		//根据遍历方向获取遍历下一个元素的处理函数
         if (iter->direction == AL_START_HEAD) {
-            nextFn = ziplistNext;
+            nextFn = lpNext;
             offset_update = 1;
         } else if (iter->direction == AL_START_TAIL) {
-            nextFn = ziplistPrev;
+            nextFn = lpPrev;
             offset_update = -1;
         }
 		//根据对应的处理函数获取对应的下一个元素指向
@@ -1426,7 +1714,7 @@ int quicklistNext(quicklistIter *iter, quicklistEntry *entry) {
     if (iter->zi) {
         /* Populate value from existing ziplist position */
 		//获取对应位置指向的元素信息
-        ziplistGet(entry->zi, &entry->value, &entry->sz, &entry->longval);
+        lpGetValue(entry->zi, &entry->value, &entry->sz, &entry->longval);
 		//返回找到对应的后续节点的处理
         return 1;
     } else {
@@ -1471,7 +1759,7 @@ quicklist *quicklistDup(quicklist *orig) {
 		//创建对应的链表节点
         quicklistNode *node = quicklistCreateNode();
 		//检测当前链表节点的数据是否处于压缩状态
-        if (current->encoding == QUICKLIST_NODE_ENCODING_LZF) {
+        if (quicklistNodeIsCompressed(current)) {
 			//获取对应的压缩数据指向
             quicklistLZF *lzf = (quicklistLZF *)current->zl;
 			//计算需要开辟的空间个数
@@ -1538,8 +1826,17 @@ int quicklistIndex(const quicklist *quicklist, const long long idx, quicklistEnt
     if (index >= quicklist->count)
         return 0;
 	
+    /* Large lists seek the node using the index instead of walking the
+     * nodes: the offset is computed from the head, and converted back
+     * to the offset from the tail if we were asked a negative index. */
+    quicklistNodeIndex *nidx = quicklistIndexGet((struct quicklist *)quicklist);
+    if (nidx) {
+        n = quicklistIndexSeek(nidx, forward ? index : quicklist->count-index-1, &accum);
+        if (!forward) accum = quicklist->count - accum - n->count;
+    }
+
 	//循环操作处理 找到一个可以查找对应索引的结构节点的位置 即确认从哪个链表节点上进行获取对应索引的元素值
-    while (likely(n)) {
+    while (likely(n) && !nidx) {
 		//检测增加当前结构中元素个数是否超过了对应的索引值
         if ((accum + n->count) > index) {
             break;
@@ -1573,11 +1870,11 @@ int quicklistIndex(const quicklist *quicklist, const long long idx, quicklistEnt
     }
 	
 	//尝试对给定的节点进行解压缩操作处理
-    quicklistDecompressNodeForUse(entry->node);
+    quicklistDecompressNodeForUse(quicklist, entry->node);
 	//获取对应索引位置上节点元素的信息------>即获取到的返回值 就是元素位置指向
-    entry->zi = ziplistIndex(entry->node->zl, entry->offset);
+    entry->zi = lpSeek(entry->node->zl, entry->offset);
 	//获取对应位置上元素的信息,并将对应的信息存储到对应的位置上
-    ziplistGet(entry->zi, &entry->value, &entry->sz, &entry->longval);
+    lpGetValue(entry->zi, &entry->value, &entry->sz, &entry->longval);
     /* The caller will use our result, so we don't re-compress here. The caller can recompress or delete the node as needed. */
 	//返回找到对应索引上元素的信息标记
     return 1;
@@ -1592,13 +1889,13 @@ void quicklistRotate(quicklist *quicklist) {
 
     /* First, get the tail entry */
 	//首先获取尾部链表节点上最后一个元素指向
-    unsigned char *p = ziplistIndex(quicklist->tail->zl, -1);
+    unsigned char *p = lpLast(quicklist->tail->zl);
     unsigned char *value;
     long long longval;
     unsigned int sz;
     char longstr[32] = {0};
 	//获取对应元素位置上的数据
-    ziplistGet(p, &value, &sz, &longval);
+    lpGetValue(p, &value, &sz, &longval);
 
     /* If value found is NULL, then ziplistGet populated longval instead */
 	//检测是否是整数类型的数据
@@ -1618,7 +1915,7 @@ void quicklistRotate(quicklist *quicklist) {
 	//此处就是检查是否有一个链表节点来进一步明确需要删除的最后一个元素的位置
 	if (quicklist->len == 1) {
 		//获取需要删除的最后一个节点的位置指向
-        p = ziplistIndex(quicklist->tail->zl, -1);
+        p = lpLast(quicklist->tail->zl);
     }
 
     /* Remove tail entry. */
@@ -1667,9 +1964,9 @@ int quicklistPopCustom(quicklist *quicklist, int where, unsigned char **data, un
     }
 	
 	//获取对应链表节点上对应位置上的数据元素位置指向
-    p = ziplistIndex(node->zl, pos);
+    p = lpSeek(node->zl, pos);
 	//获取对应位置上元素节点的数据信息
-    if (ziplistGet(p, &vstr, &vlen, &vlong)) {
+    if (lpGetValue(p, &vstr, &vlen, &vlong)) {
 		//检测是否是字符串数据类型
         if (vstr) {
             if (data)
@@ -1792,9 +2089,9 @@ static void ql_info(quicklist *ql) {
     printf("Container length: %lu\n", ql->len);
     printf("Container size: %lu\n", ql->count);
     if (ql->head)
-        printf("\t(zsize head: %d)\n", ziplistLen(ql->head->zl));
+        printf("\t(zsize head: %d)\n", lpLength(ql->head->zl));
     if (ql->tail)
-        printf("\t(zsize tail: %d)\n", ziplistLen(ql->tail->zl));
+        printf("\t(zsize tail: %d)\n", lpLength(ql->tail->zl));
     printf("\n");
 #else
     UNUSED(ql);
@@ -1892,18 +2189,18 @@ static int _ql_verify(quicklist *ql, uint32_t len, uint32_t count,
     }
 
     if (ql->head && head_count != ql->head->count &&
-        head_count != ziplistLen(ql->head->zl)) {
+        head_count != lpLength(ql->head->zl)) {
         yell("quicklist head count wrong: expected %d, "
              "got cached %d vs. actual %d",
-             head_count, ql->head->count, ziplistLen(ql->head->zl));
+             head_count, ql->head->count, lpLength(ql->head->zl));
         errors++;
     }
 
     if (ql->tail && tail_count != ql->tail->count &&
-        tail_count != ziplistLen(ql->tail->zl)) {
+        tail_count != lpLength(ql->tail->zl)) {
         yell("quicklist tail count wrong: expected %d, "
              "got cached %u vs. actual %d",
-             tail_count, ql->tail->count, ziplistLen(ql->tail->zl));
+             tail_count, ql->tail->count, lpLength(ql->tail->zl));
         errors++;
     }
 
@@ -1923,7 +2220,7 @@ static int _ql_verify(quicklist *ql, uint32_t len, uint32_t count,
                     errors++;
                 }
             } else {
-                if (node->encoding != QUICKLIST_NODE_ENCODING_LZF &&
+                if (!quicklistNodeIsCompressed(node) &&
                     !node->attempted_compress) {
                     yell("Incorrect non-compression: node %d is NOT "
                          "compressed at depth %d ((%u, %u); total "
@@ -2958,7 +3255,7 @@ int quicklistTest(int argc, char *argv[]) {
                                     node->sz);
                             }
                         } else {
-                            if (node->encoding != QUICKLIST_NODE_ENCODING_LZF) {
+                            if (!quicklistNodeIsCompressed(node)) {
                                 ERR("Incorrect non-compression: node %d is NOT "
                                     "compressed at depth %d ((%u, %u); total "
                                     "nodes: %u; size: %u; attempted: %d)",
@@ -2974,6 +3271,102 @@ int quicklistTest(int argc, char *argv[]) {
     }
     long long stop = mstime();
 
+    TEST("lz4lite round trip") {
+        unsigned char in[4096], out[4096+64], back[4096];
+        for (int round = 0; round < 200; round++) {
+            unsigned int len = rand() % sizeof(in);
+            int alphabet = 1 + round % 64;
+            for (unsigned int i = 0; i < len; i++)
+                in[i] = (round % 3 == 0) ? rand() : 'a' + rand() % alphabet;
+            unsigned int clen = lz4liteCompress(in, len, out, sizeof(out));
+            if (clen == 0)
+                ERR("Can't compress %u bytes", len);
+            else if (lz4liteDecompress(out, clen, back, len) != len ||
+                     memcmp(in, back, len) != 0)
+                ERR("Round trip of %u bytes failed", len);
+            if (clen > 1 && lz4liteDecompress(out, clen - 1, back, len) == len)
+                ERR("Truncated input of %u bytes decompressed", len);
+        }
+    }
+
+    TEST("compress with lz4 and cache decompressed nodes") {
+        quicklistSetCompressCodec(QUICKLIST_NODE_ENCODING_LZ4);
+        quicklist *ql = quicklistNew(-2, 1);
+        for (int i = 0; i < 2000; i++)
+            quicklistPushTail(ql, genstr("hello", i), 32);
+        quicklistNode *node = ql->head->next;
+        if (node->encoding != QUICKLIST_NODE_ENCODING_LZ4)
+            ERR("Interior node encoding is %d", node->encoding);
+
+        /* Read the same interior element twice: the second time the node
+         * is decompressed from the cache. */
+        quicklistEntry entry;
+        for (int j = 0; j < 2; j++) {
+            quicklistIter *iter = quicklistGetIteratorAtIdx(ql, AL_START_HEAD, 500);
+            quicklistNext(iter, &entry);
+            if (entry.sz != 32 || strncmp((char *)entry.value, genstr("hello", 500), 32))
+                ERR("Wrong value at 500: %.*s", entry.sz, entry.value);
+            quicklistReleaseIterator(iter);
+            if (!quicklistNodeIsCompressed(entry.node) || !entry.node->cached)
+                ERR("Node not compressed and cached after read %d", j);
+        }
+
+        /* Modifying the node must not resurrect the old compressed data. */
+        quicklistReplaceAtIndex(ql, 500, "changed", 7);
+        if (entry.node->cached)
+            ERR("%s", "Modified node still cached");
+        quicklistIndex(ql, 500, &entry);
+        if (entry.sz != 7 || strncmp((char *)entry.value, "changed", 7))
+            ERR("Wrong value after replace: %.*s", entry.sz, entry.value);
+        quicklistCompress(ql, entry.node);
+
+        /* Nodes compressed with LZF can still be read. */
+        quicklistSetCompressCodec(QUICKLIST_NODE_ENCODING_LZF);
+        quicklistReplaceAtIndex(ql, 1000, "lzf", 3);
+        quicklistIndex(ql, 1000, &entry);
+        quicklistCompress(ql, entry.node);
+        if (entry.node->encoding != QUICKLIST_NODE_ENCODING_LZF)
+            ERR("Node encoding is %d after codec change", entry.node->encoding);
+        for (int i = 0; i < 2000; i++) {
+            char *expected = i == 500 ? "changed" : i == 1000 ? "lzf" :
+                             genstr("hello", i);
+            size_t len = i == 500 ? 7 : i == 1000 ? 3 : 32;
+            quicklistIndex(ql, i, &entry);
+            if (entry.sz != len || strncmp((char *)entry.value, expected, len))
+                ERR("Wrong value at %d: %.*s", i, entry.sz, entry.value);
+            quicklistCompress(ql, entry.node);
+        }
+        quicklistRelease(ql);
+    }
+
+    TEST("decompressed nodes cache is global and bounded") {
+        quicklist *lists[8];
+        quicklistEntry entry;
+        for (int l = 0; l < 8; l++) {
+            lists[l] = quicklistNew(-2, 1);
+            for (int i = 0; i < 2000; i++)
+                quicklistPushTail(lists[l], genstr("hello", i), 32);
+        }
+        for (int l = 0; l < 8; l++) {
+            for (int i = 0; i < 2000; i += 50) {
+                quicklistIndex(lists[l], i, &entry);
+                quicklistCompress(lists[l], entry.node);
+            }
+        }
+        size_t total = 0;
+        for (int l = 0; l < 8; l++)
+            total += quicklistNodeCacheBytes(lists[l]);
+        if (total != quicklistNodeCacheBytes(NULL))
+            ERR("Cache bytes %zu, sum of the lists %zu",
+                quicklistNodeCacheBytes(NULL), total);
+        if (total == 0 ||
+            total > QUICKLIST_NODE_CACHE_SIZE * (QUICKLIST_NODE_CACHE_MAX_BYTES + 1024))
+            ERR("Unexpected cache size %zu", total);
+        for (int l = 0; l < 8; l++) quicklistRelease(lists[l]);
+        if (quicklistNodeCacheBytes(NULL) != 0)
+            ERR("Cache not empty after release: %zu", quicklistNodeCacheBytes(NULL));
+    }
+
     printf("\n");
     for (size_t i = 0; i < option_count; i++)
         printf("Test Loop %02d: %0.2f seconds.\n", options[i],
@@ -7,72 +7,84 @@
 
 /* Node, quicklist, and Iterator are the only data structures used currently. */
 
-/* quicklistNode is a 32 byte struct describing a ziplist for a quicklist.
+/* quicklistNode is a 32 byte struct describing a listpack for a quicklist.
  * We use bit fields keep the quicklistNode at 32 bytes.
- * count: 16 bits, max 65536 (max zl bytes is 65k, so max count actually < 32k).
- * encoding: 2 bits, RAW=1, LZF=2.
- * container: 2 bits, NONE=1, ZIPLIST=2.
+ * count: 16 bits, max 65536 (max lp bytes is 65k, so max count actually < 32k).
+ * encoding: 2 bits, RAW=1, LZF=2, LZ4=3.
+ * container: 2 bits, NONE=1, LISTPACK=2.
  * recompress: 1 bit, bool, true if node is temporarry decompressed for usage.
  * attempted_compress: 1 bit, boolean, used for verifying during testing.
- * extra: 10 bits, free for future use; pads out the remainder of 32 bits */
+ * cached: 1 bit, bool, true if the quicklist node cache holds the other
+ *         representation (compressed or not) of the unmodified node.
+ * extra: 9 bits, free for future use; pads out the remainder of 32 bits */
 /* quicklist结构中对应的链表节点结构 */
 typedef struct quicklistNode {
 	//前驱节点指针
     struct quicklistNode *prev;
 	//后继节点指针
     struct quicklistNode *next;
-	//不设置压缩数据参数recompress时指向一个ziplist结构
+	//不设置压缩数据参数recompress时指向一个listpack结构
     //设置压缩数据参数recompress指向quicklistLZF结构
     unsigned char *zl;
-	//压缩列表ziplist的总长度--------------->这个值在进行压缩操作处理是
-    unsigned int sz;             /* ziplist size in bytes */
-	//ziplist中包含的节点数，占16 bits长度
-    unsigned int count : 16;     /* count of items in ziplist */
+	//压缩列表listpack的总长度--------------->这个值在进行压缩操作处理是
+    unsigned int sz;             /* listpack size in bytes */
+	//listpack中包含的节点数，占16 bits长度
+    unsigned int count : 16;     /* count of items in listpack */
 	//表示是否采用了LZF压缩算法压缩quicklist节点，1表示压缩过，2表示没压缩，占2 bits长度
-    unsigned int encoding : 2;   /* RAW==1 or LZF==2 */
-	//表示一个quicklistNode节点是否采用ziplist结构保存数据，2表示压缩了，1表示没压缩，默认是2，占2bits长度
-    unsigned int container : 2;  /* NONE==1 or ZIPLIST==2 */
-	//标记quicklist节点的ziplist之前是否被解压缩过，占1bit长度
+    unsigned int encoding : 2;   /* RAW==1, LZF==2 or LZ4==3 */
+	//表示一个quicklistNode节点是否采用listpack结构保存数据，2表示压缩了，1表示没压缩，默认是2，占2bits长度
+    unsigned int container : 2;  /* NONE==1 or LISTPACK==2 */
+	//标记quicklist节点的listpack之前是否被解压缩过，占1bit长度
 	//如果recompress为1，则等待被再次压缩
     unsigned int recompress : 1; /* was this node previous compressed? */
 	//测试时使用
     unsigned int attempted_compress : 1; /* node can't compress; too small */
-	//额外扩展位，占10bits长度
-    unsigned int extra : 10; /* more bits to steal for future usage */
+	//标记quicklist结构的节点缓存中是否保存了本节点的另外一种数据表示
+    unsigned int cached : 1; /* node cache holds its other representation */
+	//额外扩展位，占9bits长度
+    unsigned int extra : 9; /* more bits to steal for future usage */
 } quicklistNode;
 
 /* quicklistLZF is a 4+N byte struct holding 'sz' followed by 'compressed'.
  * 'sz' is byte length of 'compressed' field.
- * 'compressed' is LZF data with total (compressed) length 'sz'
+ * 'compressed' is LZF data with total (compressed) length 'sz', or LZ4
+ * data if the node encoding is QUICKLIST_NODE_ENCODING_LZ4.
  * NOTE: uncompressed length is stored in quicklistNode->sz.
  * When quicklistNode->zl is compressed, node->zl points to a quicklistLZF */
-/* 当指定使用lzf压缩算法压缩ziplist的entry节点时，quicklistNode结构的zl成员指向quicklistLZF结构 */
+/* 当指定使用lzf压缩算法压缩listpack的entry节点时，quicklistNode结构的zl成员指向quicklistLZF结构 */
 typedef struct quicklistLZF {
-	//表示被LZF算法压缩后的ziplist的大小
+	//表示被LZF算法压缩后的listpack的大小
     unsigned int sz; /* LZF size in bytes*/
-	//保存压缩后的ziplist的数组，柔性数组
+	//保存压缩后的listpack的数组，柔性数组
     char compressed[];
 } quicklistLZF;
 
-/* quicklist is a 40 byte struct (on 64-bit systems) describing a quicklist.
+/* quicklist is a 56 byte struct (on 64-bit systems) describing a quicklist.
  * 'count' is the number of total entries.
  * 'len' is the number of quicklist nodes.
  * 'compress' is: -1 if compression disabled, otherwise it's the number of quicklistNodes to leave uncompressed at ends of quicklist.
- * 'fill' is the user-requested (or default) fill factor. */
+ * 'fill' is the user-requested (or default) fill factor.
+ * 'index' is NULL or an index of the nodes used to seek by position in
+ * O(log len), see quicklistIndex().
+ * 'cached_nodes' is the number of nodes in the decompressed nodes cache. */
 /* quicklist列表结构的结构信息 */
 typedef struct quicklist {
 	//指向头部(最左边)quicklist节点的指针
     quicklistNode *head;
 	//指向尾部(最右边)quicklist节点的指针
     quicklistNode *tail;
-	//ziplist中的entry节点计数器---->即存储的总元素数量
-    unsigned long count;        /* total count of all entries in all ziplists */
+	//listpack中的entry节点计数器---->即存储的总元素数量
+    unsigned long count;        /* total count of all entries in all listpacks */
 	//quicklist的quicklistNode节点计数器
     unsigned long len;          /* number of quicklistNodes */
-	//保存ziplist的大小，配置文件设定，占16bits
+	//保存listpack的大小，配置文件设定，占16bits
     int fill : 16;              /* fill factor for individual nodes */
 	//保存压缩程度值，配置文件设定，占16bits，0表示不压缩
     unsigned int compress : 16; /* depth of end nodes not to compress;0=off */
+	//节点的位置索引,只有在链表节点数量比较多的时候才会创建
+    struct quicklistNodeIndex *index; /* position index of the nodes or NULL */
+	//在解压缩链表节点缓存中的节点数量
+    unsigned long cached_nodes; /* nodes in the decompressed nodes cache */
 } quicklist;
 
 /* quicklist列表结构的迭代器 */
@@ -81,10 +93,10 @@ typedef struct quicklistIter {
     const quicklist *quicklist;
 	//指向当前迭代的quicklist节点的指针
     quicklistNode *current;
-	//指向当前quicklist节点中迭代的ziplist中对应的元素    ---->不是ziplist结构的指向
+	//指向当前quicklist节点中迭代的listpack中对应的元素    ---->不是listpack结构的指向
     unsigned char *zi;
-	//当前ziplist结构中的偏移量
-    long offset; /* offset in current ziplist */
+	//当前listpack结构中的偏移量
+    long offset; /* offset in current listpack */
 	//进行迭代的方向
     int direction;
 } quicklistIter;
@@ -95,15 +107,15 @@ typedef struct quicklistEntry {
     const quicklist *quicklist;
 	//指向所属的quicklistNode节点的指针
     quicklistNode *node;
-	//指向当前ziplist结构的中遍历的节点元素指向 不是ziplist结构的指向
+	//指向当前listpack结构的中遍历的节点元素指向 不是listpack结构的指向
     unsigned char *zi;
-	//指向当前ziplist结构的字符串vlaue成员
+	//指向当前listpack结构的字符串vlaue成员
     unsigned char *value;
-	//指向当前ziplist结构的整数value成员
+	//指向当前listpack结构的整数value成员
     long long longval;
-	//保存当前ziplist结构的字节数大小
+	//保存当前listpack结构的字节数大小
     unsigned int sz;
-	//保存相对ziplist的偏移量
+	//保存相对listpack的偏移量
     int offset;
 } quicklistEntry;
 
@@ -112,20 +124,21 @@ typedef struct quicklistEntry {
 #define QUICKLIST_TAIL -1
 
 /* quicklist node encodings */
-/* 用于表示quicklistNode节点上存储的ziplist数据是否进行压缩操作处理的宏 1 原始类型 2 压缩类型 */
+/* 用于表示quicklistNode节点上存储的listpack数据是否进行压缩操作处理的宏 1 原始类型 2 压缩类型 */
 #define QUICKLIST_NODE_ENCODING_RAW 1
 #define QUICKLIST_NODE_ENCODING_LZF 2
+#define QUICKLIST_NODE_ENCODING_LZ4 3
 
 /* quicklist compression disable */
 #define QUICKLIST_NOCOMPRESS 0
 
 /* quicklist container formats */
-/* 用于表示quicklistNode节点上存储的ziplist数据格式 是ziplist结构 还是压缩后的数据格式 */
+/* 用于表示quicklistNode节点上存储的listpack数据格式 是listpack结构 还是压缩后的数据格式 */
 #define QUICKLIST_NODE_CONTAINER_NONE 1
-#define QUICKLIST_NODE_CONTAINER_ZIPLIST 2
+#define QUICKLIST_NODE_CONTAINER_LISTPACK 2
 
-/* 获取对应的quicklist链表节点对应的数据ziplist是否进行压缩处理 */
-#define quicklistNodeIsCompressed(node) ((node)->encoding == QUICKLIST_NODE_ENCODING_LZF)
+/* 获取对应的quicklist链表节点对应的数据listpack是否进行压缩处理 */
+#define quicklistNodeIsCompressed(node) ((node)->encoding != QUICKLIST_NODE_ENCODING_RAW)
 
 /* Prototypes */
 quicklist *quicklistCreate(void);//创建对应的quicklist结构,并获取对应的空间指向
@@ -134,10 +147,14 @@ void quicklistSetCompressDepth(quicklist *quicklist, int depth);//配置quicklis
 void quicklistSetFill(quicklist *quicklist, int fill);//配置quicklist结构的填充因子
 void quicklistSetOptions(quicklist *quicklist, int fill, int depth);//配置quicklist结构的压缩因子和填充因子
 void quicklistRelease(quicklist *quicklist);//释放对应的quicklist结构中数据占据的空间和结构自身占据的空间
-int quicklistPushHead(quicklist *quicklist, void *value, const size_t sz);//在quicklist结构的头部链表节点上插入一个数据节点  ----->同时数据节点插入到对应的ziplist的头部
-int quicklistPushTail(quicklist *quicklist, void *value, const size_t sz);//在quicklist结构的尾部链表节点上插入一个数据节点  ----->同时数据节点插入到对应的ziplist的尾部
+void quicklistIndexReset(quicklist *ql);//丢弃quicklist结构中链表节点的位置索引
+void quicklistNodeCacheReset(quicklist *ql);//丢弃quicklist结构中缓存的链表节点数据
+size_t quicklistNodeCacheBytes(const quicklist *ql);//获取缓存的链表节点数据占据的内存
+void quicklistSetCompressCodec(int codec);//设置对链表节点进行压缩操作处理使用的压缩算法
+int quicklistPushHead(quicklist *quicklist, void *value, const size_t sz);//在quicklist结构的头部链表节点上插入一个数据节点  ----->同时数据节点插入到对应的listpack的头部
+int quicklistPushTail(quicklist *quicklist, void *value, const size_t sz);//在quicklist结构的尾部链表节点上插入一个数据节点  ----->同时数据节点插入到对应的listpack的尾部
 void quicklistPush(quicklist *quicklist, void *value, const size_t sz, int where);//封装的基于给定参数进行节点数据插入操作的处理---->注意这个地方是插入数据节点
-void quicklistAppendZiplist(quicklist *quicklist, unsigned char *zl);//将给定的ziplist结构数据链接到quicklist结构的尾链表节点后
+void quicklistAppendListpack(quicklist *quicklist, unsigned char *zl);//将给定的listpack结构数据链接到quicklist结构的尾链表节点后
 quicklist *quicklistAppendValuesFromZiplist(quicklist *quicklist, unsigned char *zl);//循环将一个ziplist中的元素插入到quicklist结构的尾部
 quicklist *quicklistCreateFromZiplist(int fill, int compress, unsigned char *zl);//根据给定的压缩参数和填充参数以及存在的ziplist来构建对应的quicklist结构
 void quicklistInsertAfter(quicklist *quicklist, quicklistEntry *node, void *value, const size_t sz);//封装的在给定的节点信息后插入元素
@@ -159,6 +176,7 @@ int quicklistPop(quicklist *quicklist, int where, unsigned char **data, unsigned
 unsigned long quicklistCount(const quicklist *ql);//获取当前quicklist结构中总共多少数据元素节点
 int quicklistCompare(unsigned char *p1, unsigned char *p2, int p2_len);//比较给定的两个字符串数据指向的内容是否相同
 size_t quicklistGetLzf(const quicklistNode *node, void **data);//获取给定链表节点的压缩数据,同时返回对应的未进行压缩前的总字节数
+unsigned char *quicklistGetListpackCopy(const quicklistNode *node);//获取给定链表节点的listpack数据的拷贝,必要时进行解压缩操作处理
 
 #ifdef REDIS_TEST
 int quicklistTest(int argc, char *argv[]);
@@ -58,6 +58,10 @@
  *					  RDB_TYPE_HASH_ZIPLIST     13
  *					  RDB_TYPE_LIST_QUICKLIST   14
  *					  RDB_TYPE_STREAM_LISTPACKS 15
+ *					  RDB_TYPE_HASH_LISTPACK    16
+ *					  RDB_TYPE_ZSET_LISTPACK    17
+ *					  RDB_TYPE_LIST_QUICKLIST_2 18
+ *					  RDB_TYPE_STRING_ROARING   19
  *               4  存储对应的键对象字符串对应的数据到rdb文件中 注意这个地方下面的陈述有问题 对于键字符串对象来说 只有字符串格式类型的 没有 整数编码类型的 这不过处理函数中分类型进行处理了
  *						如果是整数编码方式的键对象    
  *							如果对应的整数能够进行编码整数操作处理 就以编码整数的方式进行存储
@@ -65,9 +69,9 @@
  *						字符串编码方式的键对象                   以写入字符串的方式写入键字符串对象到rdb文件中 
  *               5  核心操作处理 存储值对象的数据 其实在前面已经写入了对应的值对象的编码实现方式
  *						字符串对象 按照键字符串方式进行处理 只不过在值对象是字符串对象时触发检测是否是编码整数方式
- *						列表对象      OBJ_ENCODING_QUICKLIST  能够进行下面操作的本质原因是对应的ziplist占据的空间是连续空间
+ *						列表对象      OBJ_ENCODING_QUICKLIST  能够进行下面操作的本质原因是对应的listpack占据的空间是连续空间
  *							首先存储列表对象总的元素值
- *							循环遍历所有的压缩列表节点 存储节点内指向的ziplist结构
+ *							循环遍历所有的压缩列表节点 存储节点内指向的listpack结构
  *			                    如果节点进行了压缩            以压缩字符串的方式进行存储  -->压缩编码类型-->字符串压缩后占据的空间字节数-->字符串压缩前占据的空间字节数-->压缩后的字符串内容
  *					            如果节点未进行压缩            以正常的字符串方式进行存储--> 走字符串存储的流程 
  *				        集合对象 根据编码方式进行不同的存储策略
@@ -77,15 +81,16 @@
  *							OBJ_ENCODING_INTSET
  *								直接获取对应的整数集合的存储结构 进行存储处理 因为整数集合的空间是连续的
  *						Hash对象 根据编码方式进行不同的存储策略	
- *							OBJ_ENCODING_ZIPLIST
- *								直接将对应的ziplist结构中的数据以字符串格式进行写入
+ *							OBJ_ENCODING_LISTPACK
+ *								直接将对应的listpack结构中的数据以字符串格式进行写入
  *							OBJ_ENCODING_HT
  *								首先写入当前字典结构中元素的数量值
  *								循环遍历所有的字典中的键值对 写入对应的字段字符串数据 然后写入对应的值字符串数据
  *						有序集合对象 根据编码方式进行不同的存储策略
- *							OBJ_ENCODING_ZIPLIST
- *								直接将对应的ziplist结构中的数据以字符串格式进行写入
- *							OBJ_ENCODING_SKIPLIST
+ *							OBJ_ENCODING_LISTPACK
+ *								直接将对应的listpack结构中的数据以字符串格式进行写入
+ *							OBJ_ENCODING_BTREE
+ *								写入元素的数量 然后从大到小依次写入元素和对应的分值
  *						流对象
  *						模块对象
  *						
@@ -876,10 +881,12 @@ int rdbLoadBinaryFloatValue(rio *rdb, float *val) {
 int rdbSaveObjectType(rio *rdb, robj *o) {
     switch (o->type) {
     case OBJ_STRING:
+        if (o->encoding == OBJ_ENCODING_ROARING)
+            return rdbSaveType(rdb,RDB_TYPE_STRING_ROARING);
         return rdbSaveType(rdb,RDB_TYPE_STRING);
     case OBJ_LIST:
         if (o->encoding == OBJ_ENCODING_QUICKLIST)
-            return rdbSaveType(rdb,RDB_TYPE_LIST_QUICKLIST);
+            return rdbSaveType(rdb,RDB_TYPE_LIST_QUICKLIST_2);
         else
             serverPanic("Unknown list encoding");
     case OBJ_SET:
@@ -890,15 +897,15 @@ int rdbSaveObjectType(rio *rdb, robj *o) {
         else
             serverPanic("Unknown set encoding");
     case OBJ_ZSET:
-        if (o->encoding == OBJ_ENCODING_ZIPLIST)
-            return rdbSaveType(rdb,RDB_TYPE_ZSET_ZIPLIST);
-        else if (o->encoding == OBJ_ENCODING_SKIPLIST)
+        if (o->encoding == OBJ_ENCODING_LISTPACK)
+            return rdbSaveType(rdb,RDB_TYPE_ZSET_LISTPACK);
+        else if (o->encoding == OBJ_ENCODING_BTREE)
             return rdbSaveType(rdb,RDB_TYPE_ZSET_2);
         else
             serverPanic("Unknown sorted set encoding");
     case OBJ_HASH:
-        if (o->encoding == OBJ_ENCODING_ZIPLIST)
-            return rdbSaveType(rdb,RDB_TYPE_HASH_ZIPLIST);
+        if (o->encoding == OBJ_ENCODING_LISTPACK)
+            return rdbSaveType(rdb,RDB_TYPE_HASH_LISTPACK);
         else if (o->encoding == OBJ_ENCODING_HT)
             return rdbSaveType(rdb,RDB_TYPE_HASH);
         else
@@ -928,32 +935,36 @@ int rdbLoadObjectType(rio *rdb) {
 }
 
 /* This helper function serializes a consumer group Pending Entries List (PEL)
- * into the RDB file. The 'nacks' argument tells the function if also persist
- * the informations about the not acknowledged message, or if to persist
- * just the IDs: this is useful because for the global consumer group PEL
+ * into the RDB file. If 'consumer' is NULL the whole group PEL is saved
+ * together with the informations about the not acknowledged messages,
+ * otherwise only the IDs of the messages of the specified consumer are
+ * persisted: this is useful because for the global consumer group PEL
  * we serialized the NACKs as well, but when serializing the local consumer
- * PELs we just add the ID, that will be resolved inside the global PEL to put a reference to the same structure. */
-ssize_t rdbSaveStreamPEL(rio *rdb, rax *pel, int nacks) {
+ * PELs we just add the ID, that will be resolved inside the global PEL. */
+ssize_t rdbSaveStreamPEL(rio *rdb, streamCG *cg, streamConsumer *consumer) {
     ssize_t n, nwritten = 0;
+    uint64_t size = consumer ? consumer->pel_size : cg->pel_size;
 
     /* Number of entries in the PEL. */
-    if ((n = rdbSaveLen(rdb,raxSize(pel))) == -1) 
+    if ((n = rdbSaveLen(rdb,size)) == -1) 
 		return -1;
     nwritten += n;
 
     /* Save each entry. */
-    raxIterator ri;
-    raxStart(&ri,pel);
-    raxSeek(&ri,"^",NULL,0);
-    while(raxNext(&ri)) {
+    streamPELIterator pi;
+    streamNACK *nack;
+    streamID id;
+    streamPELIteratorStart(&pi,cg,consumer,NULL);
+    while(streamPELIteratorNext(&pi,&id,&nack)) {
         /* We store IDs in raw form as 128 big big endian numbers, like
-         * they are inside the radix tree key. */
-        if ((n = rdbWriteRaw(rdb,ri.key,sizeof(streamID))) == -1) 
+         * they are inside the radix tree keys. */
+        unsigned char rawid[sizeof(streamID)];
+        streamEncodeID(rawid,&id);
+        if ((n = rdbWriteRaw(rdb,rawid,sizeof(rawid))) == -1) 
 			return -1;
         nwritten += n;
 
-        if (nacks) {
-            streamNACK *nack = ri.data;
+        if (!consumer) {
             if ((n = rdbSaveMillisecondTime(rdb,nack->delivery_time)) == -1)
                 return -1;
             nwritten += n;
@@ -965,7 +976,7 @@ ssize_t rdbSaveStreamPEL(rio *rdb, rax *pel, int nacks) {
              * at loading time. */
         }
     }
-    raxStop(&ri);
+    streamPELIteratorStop(&pi);
     return nwritten;
 }
 
@@ -998,10 +1009,10 @@ size_t rdbSaveStreamConsumers(rio *rdb, streamCG *cg) {
         nwritten += n;
 
         /* Consumer PEL, without the ACKs (see last parameter of the function
-         * passed with value of 0), at loading time we'll lookup the ID
-         * in the consumer group global PEL and will put a reference in the
-         * consumer local PEL. */
-        if ((n = rdbSaveStreamPEL(rdb,consumer->pel,0)) == -1)
+         * passed with the consumer), at loading time we'll lookup the ID
+         * in the consumer group global PEL and will assign it to the
+         * consumer. */
+        if ((n = rdbSaveStreamPEL(rdb,cg,consumer)) == -1)
             return -1;
         nwritten += n;
     }
@@ -1014,7 +1025,16 @@ size_t rdbSaveStreamConsumers(rio *rdb, streamCG *cg) {
 ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
     ssize_t n = 0, nwritten = 0;
 
-    if (o->type == OBJ_STRING) {
+    if (o->type == OBJ_STRING && o->encoding == OBJ_ENCODING_ROARING) {
+        /* Save a compressed bitmap as a single blob. */
+        size_t len;
+        unsigned char *blob = rbmSerialize(o->ptr,&len);
+
+        n = rdbSaveRawString(rdb,blob,len);
+        zfree(blob);
+        if (n == -1) return -1;
+        nwritten += n;
+    } else if (o->type == OBJ_STRING) {
         /* Save a string value */
 		//存储字符串对象的操作处理
 		//触发存储字符串对象操作处理
@@ -1038,7 +1058,7 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
 			//循环处理各个链表节点
             while(node) {
 				//检测当前节点的数据是否是压缩结构
-                if (quicklistNodeIsCompressed(node)) {
+                if (node->encoding == QUICKLIST_NODE_ENCODING_LZF) {
                     void *data;
 					//获取压缩数据的位置指向 同时获取未压缩前总的字节数
                     size_t compress_len = quicklistGetLzf(node, &data);
@@ -1046,8 +1066,17 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
                     if ((n = rdbSaveLzfBlob(rdb,data,compress_len,node->sz)) == -1) 
 						return -1;
                     nwritten += n;
+                } else if (quicklistNodeIsCompressed(node)) {
+                    /* RDB files only know about LZF: nodes compressed with
+                     * other codecs are saved as plain listpacks. */
+                    unsigned char *lp = quicklistGetListpackCopy(node);
+                    if (lp == NULL) return -1;
+                    n = rdbSaveRawString(rdb,lp,node->sz);
+                    zfree(lp);
+                    if (n == -1) return -1;
+                    nwritten += n;
                 } else {
-					//对未压缩的节点数据进行存储               能够这样处理的原因是 ziplist开辟的空间是连续的
+					//对未压缩的节点数据进行存储               能够这样处理的原因是 listpack开辟的空间是连续的
                     if ((n = rdbSaveRawString(rdb,node->zl,node->sz)) == -1) 
 						return -1;
                     nwritten += n;
@@ -1099,36 +1128,39 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
     } else if (o->type == OBJ_ZSET) {
         /* Save a sorted set value */
 		//存储有序集合对象的操作 
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-			//获取压缩列表的总的字节数量
-            size_t l = ziplistBlobLen((unsigned char*)o->ptr);
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+			//获取listpack的总的字节数量
+            size_t l = lpBytes((unsigned char*)o->ptr);
 			//以字符串的方式写入对应的压缩列表数据
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) 
 				return -1;
             nwritten += n;
-        } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
+        } else if (o->encoding == OBJ_ENCODING_BTREE) {
             zset *zs = o->ptr;
-            zskiplist *zsl = zs->zsl;
-            if ((n = rdbSaveLen(rdb,zsl->length)) == -1) 
+            zbtree *zbt = zs->zbt;
+            zbtPos pos;
+            if ((n = rdbSaveLen(rdb,zbt->length)) == -1) 
 				return -1;
             nwritten += n;
 
-            /* We save the skiplist elements from the greatest to the smallest
-             * (that's trivial since the elements are already ordered in the
-             * skiplist): this improves the load process, since the next loaded
-             * element will always be the smaller, so adding to the skiplist
-             * will always immediately stop at the head, making the insertion
-             * O(1) instead of O(log(N)). */
-            zskiplistNode *zn = zsl->tail;
-            while (zn != NULL) {
-                if ((n = rdbSaveRawString(rdb, (unsigned char*)zn->ele,sdslen(zn->ele))) == -1) {
+            /* We save the elements from the greatest to the smallest (that's
+             * trivial since the elements are already ordered in the B+tree):
+             * this improves the load process, since the next loaded element
+             * will always be the smaller, so it is always inserted in the
+             * first leaf, that is split leaving it with a single element
+             * instead of in two halves, so that the leaves of the loaded
+             * tree are full. */
+            zbtLast(zbt,&pos);
+            while (pos.leaf != NULL) {
+                zbtEntry *e = zbtPosEntry(&pos);
+                if ((n = rdbSaveRawString(rdb, (unsigned char*)e->ele,sdslen(e->ele))) == -1) {
                     return -1;
                 }
                 nwritten += n;
-                if ((n = rdbSaveBinaryDoubleValue(rdb,zn->score)) == -1)
+                if ((n = rdbSaveBinaryDoubleValue(rdb,e->score)) == -1)
                     return -1;
                 nwritten += n;
-                zn = zn->backward;
+                zbtPrev(&pos);
             }
         } else {
             serverPanic("Unknown sorted set encoding");
@@ -1136,9 +1168,9 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
     } else if (o->type == OBJ_HASH) {
         /* Save a hash value */
 		//存储Hash对象的操作 
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-			//获取压缩列表的总的字节数量
-            size_t l = ziplistBlobLen((unsigned char*)o->ptr);
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+			//获取listpack的总的字节数量
+            size_t l = lpBytes((unsigned char*)o->ptr);
 			//以字符串的方式写入对应的压缩列表数据
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1)
 				return -1;
@@ -1245,7 +1277,7 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
                 nwritten += n;
 
                 /* Save the global PEL. */
-                if ((n = rdbSaveStreamPEL(rdb,cg->pel,1)) == -1) 
+                if ((n = rdbSaveStreamPEL(rdb,cg,NULL)) == -1) 
 					return -1;
                 nwritten += n;
 
@@ -1484,6 +1516,7 @@ ssize_t rdbSaveSingleModuleAux(rio *rdb, int when, moduleType *mt) {
 /* rdb文件备份的核心处理流程 */
 int rdbSaveRio(rio *rdb, int *error, int flags, rdbSaveInfo *rsi) {
     dictIterator *di = NULL;
+    dbIterator *dbi = NULL;
     dictEntry *de;
     char magic[10];
     int j;
@@ -1512,13 +1545,11 @@ int rdbSaveRio(rio *rdb, int *error, int flags, rdbSaveInfo *rsi) {
     for (j = 0; j < server.dbnum; j++) {
 		//获取当前索引对应的库
         redisDb *db = server.db+j;
-		//获取当前库对应的数据集
-        dict *d = db->dict;
 		//检测当前库中是否有数据需要存储处理
-        if (dictSize(d) == 0) 
+        if (dbSize(db) == 0) 
 			continue;
 		//获取对应的安全迭代器对象
-        di = dictGetSafeIterator(d);
+        dbi = dbGetSafeIterator(db);
 
         /* Write the SELECT DB opcode */
 		//写入选择索引数据库标识类型
@@ -1534,7 +1565,7 @@ int rdbSaveRio(rio *rdb, int *error, int flags, rdbSaveInfo *rsi) {
         uint64_t db_size, expires_size;
 
 		//获取字典元素数量
-        db_size = dictSize(db->dict);
+        db_size = dbSize(db);
 		//获取配置过期时间的字典元素数量
         expires_size = dictSize(db->expires);
 
@@ -1552,7 +1583,7 @@ int rdbSaveRio(rio *rdb, int *error, int flags, rdbSaveInfo *rsi) {
 
         /* Iterate this DB writing every entry */
 		//循环检测对应的字典中的数据
-        while((de = dictNext(di)) != NULL) {
+        while((de = dbNext(dbi)) != NULL) {
 			//获取对应的键结构sds
             sds keystr = dictGetKey(de);
 			//获取对应的值对象
@@ -1578,9 +1609,9 @@ int rdbSaveRio(rio *rdb, int *error, int flags, rdbSaveInfo *rsi) {
             }
         }
 		//循环完成释放对应的迭代器空间
-        dictReleaseIterator(di);
+        dbReleaseIterator(dbi);
 		//置空迭代器指向
-        di = NULL; /* So that we don't release it again on error. */
+        dbi = NULL; /* So that we don't release it again on error. */
     }
 
     /* If we are storing the replication information on disk, persist the script cache as well: on successful PSYNC after a restart, we need
@@ -1613,7 +1644,7 @@ int rdbSaveRio(rio *rdb, int *error, int flags, rdbSaveInfo *rsi) {
     /* CRC64 checksum. It will be zero if checksum computation is disabled, the loading code skips the check in this case. */
 	//通过rio对象获取对应的校验码
 	cksum = rdb->cksum;
-	/进行校验码值处理
+	//进行校验码值处理
     memrev64ifbe(&cksum);
 	//将8字节校验码写入到文件的最后
     if (rioWrite(rdb,&cksum,8) == 0) 
@@ -1626,6 +1657,8 @@ werr:
 		*error = errno;
     if (di) 
 		dictReleaseIterator(di);
+    if (dbi)
+        dbReleaseIterator(dbi);
     return C_ERR;
 }
 
@@ -1873,6 +1906,30 @@ robj *rdbLoadCheckModuleValue(rio *rdb, char *modulename) {
     return createStringObject("module-dummy-value",18);
 }
 
+/* Convert a ziplist blob, as saved for small hashes and sorted sets by
+ * RDB versions older than 10, into a listpack holding the same elements.
+ * The ziplist is freed and the new listpack returned. */
+static unsigned char *rdbZiplistToListpack(unsigned char *zl) {
+    unsigned char *lp = lpNew();
+    unsigned char *p = ziplistIndex(zl,0);
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vll;
+    char buf[LONG_STR_SIZE];
+
+    while (p) {
+        ziplistGet(p,&vstr,&vlen,&vll);
+        if (vstr == NULL) {
+            vlen = ll2string(buf,sizeof(buf),vll);
+            vstr = (unsigned char*)buf;
+        }
+        lp = lpAppend(lp,vstr,vlen);
+        p = ziplistNext(zl,p);
+    }
+    zfree(zl);
+    return lp;
+}
+
 /* Load a Redis object of the specified type from the specified file. On success a newly allocated object is returned, otherwise NULL. */
 /* 从rdb文件中根据给定的类型来加载对应的值对象的数据 */
 robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
@@ -1887,6 +1944,19 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
 			return NULL;
 		//加载完字符串对象之后 进一步尝试进行编码操作处理 目的是节省空间
         o = tryObjectEncoding(o);
+    } else if (rdbtype == RDB_TYPE_STRING_ROARING) {
+        /* Read a compressed bitmap, checking that it is consistent. */
+        size_t bloblen;
+        unsigned char *blob;
+        rbm *r;
+
+        if ((blob = rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,&bloblen)) == NULL)
+            return NULL;
+        r = rbmDeserialize(blob,bloblen);
+        zfree(blob);
+        if (r == NULL)
+            rdbExitReportCorruptRDB("Compressed bitmap integrity check failed.");
+        o = createRoaringStringObject(r);
     } else if (rdbtype == RDB_TYPE_LIST) {
         /* Read list value */
 		//列表值对象       首先加载对应的元素数量
@@ -1986,7 +2056,6 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
         while(zsetlen--) {
             sds sdsele;
             double score;
-            zskiplistNode *znode;
 
             if ((sdsele = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL)) == NULL) 
 				return NULL;
@@ -2003,13 +2072,12 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
             if (sdslen(sdsele) > maxelelen) 
 				maxelelen = sdslen(sdsele);
 
-            znode = zslInsert(zs->zsl,score,sdsele);
-            dictAdd(zs->dict,sdsele,&znode->score);
+            zsetInsertElement(zs,score,sdsele);
         }
 
         /* Convert *after* loading, since sorted sets are not stored ordered. */
         if (zsetLength(o) <= server.zset_max_ziplist_entries && maxelelen <= server.zset_max_ziplist_value)
-            zsetConvert(o,OBJ_ENCODING_ZIPLIST);
+            zsetConvert(o,OBJ_ENCODING_LISTPACK);
     } else if (rdbtype == RDB_TYPE_HASH) {
         uint64_t len;
         int ret;
@@ -2025,8 +2093,8 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
         if (len > server.hash_max_ziplist_entries)
             hashTypeConvert(o, OBJ_ENCODING_HT);
 
-        /* Load every field and value into the ziplist */
-        while (o->encoding == OBJ_ENCODING_ZIPLIST && len > 0) {
+        /* Load every field and value into the listpack */
+        while (o->encoding == OBJ_ENCODING_LISTPACK && len > 0) {
             len--;
             /* Load raw strings */
             if ((field = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL)) == NULL) 
@@ -2034,9 +2102,9 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
             if ((value = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL)) == NULL) 
 				return NULL;
 
-            /* Add pair to ziplist */
-            o->ptr = ziplistPush(o->ptr, (unsigned char*)field, sdslen(field), ZIPLIST_TAIL);
-            o->ptr = ziplistPush(o->ptr, (unsigned char*)value, sdslen(value), ZIPLIST_TAIL);
+            /* Add pair to listpack */
+            o->ptr = lpAppend(o->ptr, (unsigned char*)field, sdslen(field));
+            o->ptr = lpAppend(o->ptr, (unsigned char*)value, sdslen(value));
 
             /* Convert to hash table if size threshold is exceeded */
             if (sdslen(field) > server.hash_max_ziplist_value || sdslen(value) > server.hash_max_ziplist_value) {
@@ -2070,7 +2138,9 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
 
         /* All pairs should be read by now */
         serverAssert(len == 0);
-    } else if (rdbtype == RDB_TYPE_LIST_QUICKLIST) {
+    } else if (rdbtype == RDB_TYPE_LIST_QUICKLIST ||
+               rdbtype == RDB_TYPE_LIST_QUICKLIST_2)
+    {
         if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) 
 			return NULL;
         o = createQuicklistObject();
@@ -2080,9 +2150,12 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
             unsigned char *zl = rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,NULL);
             if (zl == NULL) 
 				return NULL;
-            quicklistAppendZiplist(o->ptr, zl);
+            /* Older RDB files store the nodes as ziplists. */
+            if (rdbtype == RDB_TYPE_LIST_QUICKLIST)
+                zl = rdbZiplistToListpack(zl);
+            quicklistAppendListpack(o->ptr, zl);
         }
-    } else if (rdbtype == RDB_TYPE_HASH_ZIPMAP  || rdbtype == RDB_TYPE_LIST_ZIPLIST || rdbtype == RDB_TYPE_SET_INTSET || rdbtype == RDB_TYPE_ZSET_ZIPLIST || rdbtype == RDB_TYPE_HASH_ZIPLIST) {
+    } else if (rdbtype == RDB_TYPE_HASH_ZIPMAP  || rdbtype == RDB_TYPE_LIST_ZIPLIST || rdbtype == RDB_TYPE_SET_INTSET || rdbtype == RDB_TYPE_ZSET_ZIPLIST || rdbtype == RDB_TYPE_HASH_ZIPLIST || rdbtype == RDB_TYPE_HASH_LISTPACK || rdbtype == RDB_TYPE_ZSET_LISTPACK) {
 		//此处统一处理连续空间的值对象的操作
 		//加载对应的连续空间的数据为字符串数据
 		unsigned char *encoded = rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,NULL);
@@ -2098,9 +2171,9 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
 		//进一步根据类型来初始化值对象的编码属性信息
 		switch(rdbtype) {
             case RDB_TYPE_HASH_ZIPMAP:
-                /* Convert to ziplist encoded hash. This must be deprecated when loading dumps created by Redis 2.4 gets deprecated. */
+                /* Convert to listpack encoded hash. This must be deprecated when loading dumps created by Redis 2.4 gets deprecated. */
                 {
-                    unsigned char *zl = ziplistNew();
+                    unsigned char *zl = lpNew();
                     unsigned char *zi = zipmapRewind(o->ptr);
                     unsigned char *fstr, *vstr;
                     unsigned int flen, vlen;
@@ -2109,14 +2182,14 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
                     while ((zi = zipmapNext(zi, &fstr, &flen, &vstr, &vlen)) != NULL) {
                         if (flen > maxlen) maxlen = flen;
                         if (vlen > maxlen) maxlen = vlen;
-                        zl = ziplistPush(zl, fstr, flen, ZIPLIST_TAIL);
-                        zl = ziplistPush(zl, vstr, vlen, ZIPLIST_TAIL);
+                        zl = lpAppend(zl, fstr, flen);
+                        zl = lpAppend(zl, vstr, vlen);
                     }
 
                     zfree(o->ptr);
                     o->ptr = zl;
                     o->type = OBJ_HASH;
-                    o->encoding = OBJ_ENCODING_ZIPLIST;
+                    o->encoding = OBJ_ENCODING_LISTPACK;
 
                     if (hashTypeLength(o) > server.hash_max_ziplist_entries || maxlen > server.hash_max_ziplist_value){
                         hashTypeConvert(o, OBJ_ENCODING_HT);
@@ -2142,20 +2215,29 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
                     setTypeConvert(o,OBJ_ENCODING_HT);
                 break;
             case RDB_TYPE_ZSET_ZIPLIST:
+                /* Older RDB files store small sorted sets as ziplists:
+                 * convert them to the listpack encoding on load. */
+                o->ptr = rdbZiplistToListpack(o->ptr);
+                /* Fall through. */
+            case RDB_TYPE_ZSET_LISTPACK:
 				//设置为有序集合值对象
                 o->type = OBJ_ZSET;
 				//设置实现的编码方式
-                o->encoding = OBJ_ENCODING_ZIPLIST;
+                o->encoding = OBJ_ENCODING_LISTPACK;
 				//检测是否超过了转换的门限值
                 if (zsetLength(o) > server.zset_max_ziplist_entries)
 					//将其转换成快表方式的有序集合
-                    zsetConvert(o,OBJ_ENCODING_SKIPLIST);
+                    zsetConvert(o,OBJ_ENCODING_BTREE);
                 break;
             case RDB_TYPE_HASH_ZIPLIST:
+                /* Same as above for small hashes. */
+                o->ptr = rdbZiplistToListpack(o->ptr);
+                /* Fall through. */
+            case RDB_TYPE_HASH_LISTPACK:
 				//设置为Hash值对象
                 o->type = OBJ_HASH;
 				//设置编码方式
-                o->encoding = OBJ_ENCODING_ZIPLIST;
+                o->encoding = OBJ_ENCODING_LISTPACK;
 				//检测是否超过了门限值
                 if (hashTypeLength(o) > server.hash_max_ziplist_entries)
 					//转换成对应的字典方式的Hash值对象
@@ -2229,11 +2311,14 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
             size_t pel_size = rdbLoadLen(rdb,NULL);
             while(pel_size--) {
                 unsigned char rawid[sizeof(streamID)];
+                streamID id;
                 rdbLoadRaw(rdb,rawid,sizeof(rawid));
-                streamNACK *nack = streamCreateNACK(NULL);
-                nack->delivery_time = rdbLoadMillisecondTime(rdb,RDB_VERSION);
-                nack->delivery_count = rdbLoadLen(rdb,NULL);
-                if (!raxInsert(cgroup->pel,rawid,sizeof(rawid),nack,NULL))
+                streamDecodeID(rawid,&id);
+                mstime_t delivery_time =
+                    rdbLoadMillisecondTime(rdb,RDB_VERSION);
+                uint64_t delivery_count = rdbLoadLen(rdb,NULL);
+                if (!streamPELAdd(cgroup,&id,NULL,delivery_time,
+                                  delivery_count))
                     rdbExitReportCorruptRDB("Duplicated gobal PEL entry "
                                             "loading stream consumer group");
             }
@@ -2254,20 +2339,23 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
                 pel_size = rdbLoadLen(rdb,NULL);
                 while(pel_size--) {
                     unsigned char rawid[sizeof(streamID)];
+                    streamID id;
                     rdbLoadRaw(rdb,rawid,sizeof(rawid));
-                    streamNACK *nack = raxFind(cgroup->pel,rawid,sizeof(rawid));
-                    if (nack == raxNotFound)
+                    streamDecodeID(rawid,&id);
+                    streamNACK *nack = streamPELFind(cgroup,&id);
+                    if (nack == NULL)
                         rdbExitReportCorruptRDB("Consumer entry not found in "
                                                 "group global PEL");
-
-                    /* Set the NACK consumer, that was left to NULL when
-                     * loading the global PEL. Then set the same shared
-                     * NACK structure also in the consumer-specific PEL. */
-                    nack->consumer = consumer;
-                    if (!raxInsert(consumer->pel,rawid,sizeof(rawid),nack,NULL))
+                    if (nack->consumer != NULL)
                         rdbExitReportCorruptRDB("Duplicated consumer PEL entry "
                                                 " loading a stream consumer "
                                                 "group");
+
+                    /* Set the NACK consumer, that was left to NULL when
+                     * loading the global PEL: this also adds the entry to
+                     * the consumer-specific PEL. */
+                    streamPELAdd(cgroup,&id,consumer,nack->delivery_time,
+                                 nack->delivery_count);
                 }
             }
         }
@@ -2493,7 +2581,7 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi, int loading_aof) {
             if ((expires_size = rdbLoadLen(rdb,NULL)) == RDB_LENERR)
                 goto eoferr;
 			//对当前数据库的字典进行指定扩容操作处理
-            dictExpand(db->dict,db_size);
+            dbExpand(db,db_size);
 			//对当前数据库的过期字典进行指定扩容操作处理
             dictExpand(db->expires,expires_size);
             continue; /* Read next opcode. */
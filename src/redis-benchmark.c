@@ -792,6 +792,17 @@ int main(int argc, const char **argv) {
             free(cmd);
         }
 
+        if (test_is_selected("zadd")) {
+            /* Use a different non integer score for every element when
+             * random keys are enabled, so that the score parsing is
+             * measured as well. */
+            char *score = config.randomkeys ? "0.__rand_int__" : "0.5";
+            len = redisFormatCommand(&cmd,
+                "ZADD myzset %s element:__rand_int__",score);
+            benchmark("ZADD",cmd,len);
+            free(cmd);
+        }
+
         if (test_is_selected("lrange") ||
             test_is_selected("lrange_100") ||
             test_is_selected("lrange_300") ||
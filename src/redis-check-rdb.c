@@ -73,7 +73,11 @@ char *rdb_type_string[] = {
     "zset-ziplist",
     "hash-ziplist",
     "quicklist",
-    "stream"
+    "stream",
+    "hash-listpack",
+    "zset-listpack",
+    "quicklist-listpack",
+    "string-roaring"
 };
 
 /* Show a few stats collected into 'rdbstate' */
@@ -45,6 +45,7 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <math.h>
+#include <poll.h>
 
 #include <hiredis.h>
 #include <sds.h> /* use sds.h from hiredis, so that only one set of sds functions will be present in the binary */
@@ -73,6 +74,9 @@
 #define CLUSTER_MANAGER_SLOTS               16384
 #define CLUSTER_MANAGER_MIGRATE_TIMEOUT     60000
 #define CLUSTER_MANAGER_MIGRATE_PIPELINE    10
+#define CLUSTER_MANAGER_MIGRATE_PIPELINE_MAX 1000
+#define CLUSTER_MANAGER_MIGRATE_BATCH_TIME  20 /* Target ms per MIGRATE */
+#define CLUSTER_MANAGER_MIGRATE_PARALLEL    1
 #define CLUSTER_MANAGER_REBALANCE_THRESHOLD 2
 
 #define CLUSTER_MANAGER_INVALID_HOST_ARG \
@@ -175,7 +179,9 @@ typedef struct clusterManagerCommand {
     int slots;
     int timeout;
     int pipeline;
+    int parallel;   /* Max number of slots migrated at the same time. */
     float threshold;
+    char *weight_by; /* CLUSTER SLOT-STATS metric rebalance weights by. */
 } clusterManagerCommand;
 
 static void createClusterManagerCommand(char *cmdname, int argc, char **argv);
@@ -1368,8 +1374,12 @@ static int parseOptions(int argc, char **argv) {
             config.cluster_manager_command.timeout = atoi(argv[++i]);
         } else if (!strcmp(argv[i],"--cluster-pipeline") && !lastarg) {
             config.cluster_manager_command.pipeline = atoi(argv[++i]);
+        } else if (!strcmp(argv[i],"--cluster-parallel") && !lastarg) {
+            config.cluster_manager_command.parallel = atoi(argv[++i]);
         } else if (!strcmp(argv[i],"--cluster-threshold") && !lastarg) {
             config.cluster_manager_command.threshold = atof(argv[++i]);
+        } else if (!strcmp(argv[i],"--cluster-weight-by") && !lastarg) {
+            config.cluster_manager_command.weight_by = argv[++i];
         } else if (!strcmp(argv[i],"--cluster-yes")) {
             config.cluster_manager_command.flags |=
                 CLUSTER_MANAGER_CMD_FLAG_YES;
@@ -1926,6 +1936,9 @@ typedef struct clusterManagerNode {
     int importing_count; /* Length of the importing array (importing slots*2) */
     float weight;   /* Weight used by rebalance */
     int balance;    /* Used by rebalance */
+    long long load; /* Sum of the slots load, used by rebalance --weight-by */
+    long long load_balance; /* Load to lose (or gain if negative). */
+    int migrate_pipeline; /* Keys per MIGRATE, adapted to its latency. */
 } clusterManagerNode;
 
 /* Data structure used to represent a sequence of cluster nodes. */
@@ -1942,6 +1955,20 @@ typedef struct clusterManagerReshardTableItem {
     int slot;
 } clusterManagerReshardTableItem;
 
+/* Used to move the slots of a reshard table from 'source' to 'target' in
+ * parallel with other migrations, see clusterManagerMoveSlotsParallel(). */
+typedef struct clusterManagerMigration {
+    clusterManagerNode *source;
+    clusterManagerNode *target;
+    redisContext *context; /* Dedicated connection to the source. */
+    list *table;        /* Slots left to move (reshard table items). */
+    int slot;           /* Slot being moved. */
+    redisReply *keys;   /* Keys of the MIGRATE in flight, if any, otherwise
+                         * GETKEYSINSLOT is in flight. */
+    int replace;        /* MIGRATE in flight uses the REPLACE option. */
+    long long start;    /* Time the command in flight was sent (ms). */
+} clusterManagerMigration;
+
 static dictType clusterManagerDictType = {
     dictSdsHash,               /* hash function */
     NULL,                      /* key dup */
@@ -2021,10 +2048,11 @@ clusterManagerCommandDef clusterManagerCommands[] = {
      "search-multiple-owners"},
     {"reshard", clusterManagerCommandReshard, -1, "host:port",
      "from <arg>,to <arg>,slots <arg>,yes,timeout <arg>,pipeline <arg>,"
-     "replace"},
+     "parallel <arg>,replace"},
     {"rebalance", clusterManagerCommandRebalance, -1, "host:port",
      "weight <node1=w1...nodeN=wN>,use-empty-masters,"
-     "timeout <arg>,simulate,pipeline <arg>,threshold <arg>,replace"},
+     "timeout <arg>,simulate,pipeline <arg>,parallel <arg>,threshold <arg>,"
+     "replace,weight-by <metric>"},
     {"add-node", clusterManagerCommandAddNode, 2,
      "new_host:new_port existing_host:existing_port", "slave,master-id <arg>"},
     {"del-node", clusterManagerCommandDeleteNode, 2, "host:port node_id",NULL},
@@ -2191,6 +2219,9 @@ static clusterManagerNode *clusterManagerNewNode(char *ip, int port) {
     node->replicas_count = 0;
     node->weight = 1.0f;
     node->balance = 0;
+    node->load = 0;
+    node->load_balance = 0;
+    node->migrate_pipeline = 0;
     clusterManagerNodeResetSlots(node);
     return node;
 }
@@ -2886,21 +2917,18 @@ static int clusterManagerSetSlotOwner(clusterManagerNode *owner,
     return success;
 }
 
-/* Migrate keys taken from reply->elements. It returns the reply from the
- * MIGRATE command, or NULL if something goes wrong. If the argument 'dots'
- * is not NULL, a dot will be printed for every migrated key. */
-static redisReply *clusterManagerMigrateKeysInReply(clusterManagerNode *source,
-                                                    clusterManagerNode *target,
-                                                    redisReply *reply,
-                                                    int replace, int timeout,
-                                                    char *dots)
+/* Append to the context 'c' a MIGRATE command moving to 'target' the keys
+ * taken from reply->elements. */
+static void clusterManagerAppendMigrateCommand(redisContext *c,
+                                               clusterManagerNode *target,
+                                               redisReply *reply,
+                                               int replace, int timeout)
 {
-    redisReply *migrate_reply = NULL;
     char **argv = NULL;
     size_t *argv_len = NULL;
-    int c = (replace ? 8 : 7);
-    if (config.auth) c += 2;
-    size_t argc = c + reply->elements;
+    int c_args = (replace ? 8 : 7);
+    if (config.auth) c_args += 2;
+    size_t argc = c_args + reply->elements;
     size_t i, offset = 6; // Keys Offset
     argv = zcalloc(argc * sizeof(char *));
     argv_len = zcalloc(argc * sizeof(size_t));
@@ -2940,22 +2968,32 @@ static redisReply *clusterManagerMigrateKeysInReply(clusterManagerNode *source,
         redisReply *entry = reply->element[i];
         size_t idx = i + offset;
         assert(entry->type == REDIS_REPLY_STRING);
-        argv[idx] = (char *) sdsnew(entry->str);
+        argv[idx] = entry->str;
         argv_len[idx] = entry->len;
-        if (dots) dots[i] = '.';
     }
-    if (dots) dots[reply->elements] = '\0';
-    void *_reply = NULL;
-    redisAppendCommandArgv(source->context,argc,
-                           (const char**)argv,argv_len);
-    int success = (redisGetReply(source->context, &_reply) == REDIS_OK);
-    for (i = 0; i < reply->elements; i++) sdsfree(argv[i + offset]);
-    if (!success) goto cleanup;
-    migrate_reply = (redisReply *) _reply;
-cleanup:
+    redisAppendCommandArgv(c,argc,(const char**)argv,argv_len);
     zfree(argv);
     zfree(argv_len);
-    return migrate_reply;
+}
+
+/* Migrate keys taken from reply->elements. It returns the reply from the
+ * MIGRATE command, or NULL if something goes wrong. If the argument 'dots'
+ * is not NULL, a dot will be printed for every migrated key. */
+static redisReply *clusterManagerMigrateKeysInReply(clusterManagerNode *source,
+                                                    clusterManagerNode *target,
+                                                    redisReply *reply,
+                                                    int replace, int timeout,
+                                                    char *dots)
+{
+    void *_reply = NULL;
+    if (dots) {
+        memset(dots, '.', reply->elements);
+        dots[reply->elements] = '\0';
+    }
+    clusterManagerAppendMigrateCommand(source->context, target, reply,
+                                       replace, timeout);
+    if (redisGetReply(source->context, &_reply) != REDIS_OK) return NULL;
+    return (redisReply *) _reply;
 }
 
 /* Migrate all keys in the given slot from source to target.*/
@@ -3045,6 +3083,59 @@ next:
     return success;
 }
 
+/* Set 'slot' as importing in 'target' and as migrating in 'source', so
+ * that keys can be moved with MIGRATE while the slot is still served. */
+static int clusterManagerOpenSlotMigration(clusterManagerNode *source,
+                                           clusterManagerNode *target,
+                                           int slot, char **err)
+{
+    int success = clusterManagerSetSlot(target, source, slot,
+                                        "importing", err);
+    if (!success) return 0;
+    return clusterManagerSetSlot(source, target, slot, "migrating", err);
+}
+
+/* Set the new node as the owner of the slot in all the known masters.
+ * The command is sent to all the masters before reading the replies, so
+ * that closing a migration doesn't cost a round trip per master. */
+static int clusterManagerCloseSlotMigration(clusterManagerNode *target,
+                                            int slot, char **err)
+{
+    listIter li;
+    listNode *ln;
+    int success = 1;
+    listRewind(cluster_manager.nodes, &li);
+    while ((ln = listNext(&li)) != NULL) {
+        clusterManagerNode *n = ln->value;
+        if (n->flags & CLUSTER_MANAGER_FLAG_SLAVE) continue;
+        int done = 0;
+        redisAppendCommand(n->context, "CLUSTER SETSLOT %d %s %s", slot,
+                           "node", target->name);
+        while (!done) {
+            if (redisBufferWrite(n->context, &done) == REDIS_ERR) return 0;
+        }
+    }
+    listRewind(cluster_manager.nodes, &li);
+    while ((ln = listNext(&li)) != NULL) {
+        clusterManagerNode *n = ln->value;
+        if (n->flags & CLUSTER_MANAGER_FLAG_SLAVE) continue;
+        redisReply *r = NULL;
+        /* Read all the replies even after an error, so that the
+         * connections are left in a consistent state. */
+        if (redisGetReply(n->context, (void **) &r) != REDIS_OK) return 0;
+        if (r->type == REDIS_REPLY_ERROR && success) {
+            success = 0;
+            if (err != NULL) {
+                *err = zmalloc((r->len + 1) * sizeof(char));
+                strcpy(*err, r->str);
+                CLUSTER_MANAGER_PRINT_REPLY_ERROR(n, *err);
+            }
+        }
+        freeReplyObject(r);
+    }
+    return success;
+}
+
 /* Move slots between source and target nodes using MIGRATE.
  *
  * Options:
@@ -3070,43 +3161,15 @@ static int clusterManagerMoveSlot(clusterManagerNode *source,
         option_cold = (opts & CLUSTER_MANAGER_OPT_COLD),
         success = 1;
     if (!option_cold) {
-        success = clusterManagerSetSlot(target, source, slot,
-                                        "importing", err);
-        if (!success) return 0;
-        success = clusterManagerSetSlot(source, target, slot,
-                                        "migrating", err);
+        success = clusterManagerOpenSlotMigration(source, target, slot, err);
         if (!success) return 0;
     }
     success = clusterManagerMigrateKeysInSlot(source, target, slot, timeout,
                                               pipeline, print_dots, err);
     if (!(opts & CLUSTER_MANAGER_OPT_QUIET)) printf("\n");
     if (!success) return 0;
-    /* Set the new node as the owner of the slot in all the known nodes. */
-    if (!option_cold) {
-        listIter li;
-        listNode *ln;
-        listRewind(cluster_manager.nodes, &li);
-        while ((ln = listNext(&li)) != NULL) {
-            clusterManagerNode *n = ln->value;
-            if (n->flags & CLUSTER_MANAGER_FLAG_SLAVE) continue;
-            redisReply *r = CLUSTER_MANAGER_COMMAND(n, "CLUSTER "
-                                                    "SETSLOT %d %s %s",
-                                                    slot, "node",
-                                                    target->name);
-            success = (r != NULL);
-            if (!success) return 0;
-            if (r->type == REDIS_REPLY_ERROR) {
-                success = 0;
-                if (err != NULL) {
-                    *err = zmalloc((r->len + 1) * sizeof(char));
-                    strcpy(*err, r->str);
-                    CLUSTER_MANAGER_PRINT_REPLY_ERROR(n, *err);
-                }
-            }
-            freeReplyObject(r);
-            if (!success) return 0;
-        }
-    }
+    if (!option_cold &&
+        !clusterManagerCloseSlotMigration(target, slot, err)) return 0;
     /* Update the node logical config */
     if (opts & CLUSTER_MANAGER_OPT_UPDATE) {
         source->slots[slot] = 0;
@@ -3437,6 +3500,13 @@ int clusterManagerCompareNodeBalance(const void *n1, const void *n2) {
     return node1->balance - node2->balance;
 }
 
+int clusterManagerCompareNodeLoadBalance(const void *n1, const void *n2) {
+    clusterManagerNode *node1 = *((clusterManagerNode **) n1);
+    clusterManagerNode *node2 = *((clusterManagerNode **) n2);
+    if (node1->load_balance == node2->load_balance) return 0;
+    return node1->load_balance < node2->load_balance ? -1 : 1;
+}
+
 static sds clusterManagerGetConfigSignature(clusterManagerNode *node) {
     sds signature = NULL;
     int node_count = 0, i = 0, name_len = 0;
@@ -4474,6 +4544,323 @@ static void clusterManagerReleaseReshardTable(list *table) {
     }
 }
 
+/* Parallel slots migration.
+ *
+ * The slots of a reshard plan are grouped by (source, target) pair, and the
+ * slots of every pair are spread among up to --cluster-parallel migrations.
+ * Up to --cluster-parallel migrations run at the same time, every one using
+ * a dedicated connection to its source node. MIGRATE called by a normal
+ * client is asynchronous, so the source keeps serving other clients while
+ * the keys are transferred, and a node can take part in many migrations at
+ * the same time: even a reshard towards a single target from a single
+ * source moves many slots concurrently.
+ *
+ * A migration that receives no reply for --cluster-timeout milliseconds
+ * aborts the whole operation, like any other error.
+ *
+ * The number of keys moved by every MIGRATE starts from --cluster-pipeline
+ * and adapts to the observed latency: it grows while the batches complete
+ * quickly and shrinks as soon as a batch takes more than
+ * CLUSTER_MANAGER_MIGRATE_BATCH_TIME milliseconds, in order to keep the
+ * nodes responsive while moving as many keys as possible per round trip. */
+
+/* Connect the context used by the migration 'm' to move the slots of its
+ * source node. */
+static int clusterManagerMigrationConnect(clusterManagerMigration *m) {
+    clusterManagerNode *node = m->source;
+    if (m->context != NULL) return 1;
+    redisContext *c = redisConnect(node->ip, node->port);
+    if (c->err) {
+        clusterManagerLogErr("*** Could not connect to %s:%d: %s\n",
+                             node->ip, node->port, c->errstr);
+        redisFree(c);
+        return 0;
+    }
+    anetKeepAlive(NULL, c->fd, REDIS_CLI_KEEPALIVE_INTERVAL);
+    if (config.auth) {
+        redisReply *reply = redisCommand(c,"AUTH %s",config.auth);
+        int ok = clusterManagerCheckRedisReply(node, reply, NULL);
+        if (reply != NULL) freeReplyObject(reply);
+        if (!ok) {
+            redisFree(c);
+            return 0;
+        }
+    }
+    if (node->migrate_pipeline <= 0)
+        node->migrate_pipeline = config.cluster_manager_command.pipeline;
+    m->context = c;
+    return 1;
+}
+
+static clusterManagerMigration *clusterManagerCreateMigration(
+    clusterManagerNode *source, clusterManagerNode *target)
+{
+    clusterManagerMigration *m = zmalloc(sizeof(*m));
+    m->source = source;
+    m->target = target;
+    m->context = NULL;
+    m->table = listCreate();
+    m->slot = -1;
+    m->keys = NULL;
+    m->replace = 0;
+    m->start = 0;
+    return m;
+}
+
+static void clusterManagerReleaseMigration(clusterManagerMigration *m) {
+    clusterManagerReleaseReshardTable(m->table);
+    if (m->keys != NULL) freeReplyObject(m->keys);
+    if (m->context != NULL) redisFree(m->context);
+    zfree(m);
+}
+
+static void clusterManagerReleaseMigrations(list *migrations) {
+    if (migrations == NULL) return;
+    listIter li;
+    listNode *ln;
+    listRewind(migrations, &li);
+    while ((ln = listNext(&li)) != NULL)
+        clusterManagerReleaseMigration(ln->value);
+    listRelease(migrations);
+}
+
+/* Move the items of the reshard 'table' to the migrations towards 'target'
+ * in the 'migrations' list, leaving the table empty. The slots of every
+ * (source, target) pair are spread among up to --cluster-parallel
+ * migrations, so that they can be moved concurrently. The slots are also
+ * assigned to the target in the logical config of the nodes, so that
+ * further reshard tables computed before the migrations are actually
+ * performed will not pick them again. */
+static void clusterManagerQueueReshardTable(list *migrations, list *table,
+                                            clusterManagerNode *target)
+{
+    int parallel = config.cluster_manager_command.parallel;
+    listIter li, mi;
+    listNode *ln, *mn;
+    listRewind(table, &li);
+    while ((ln = listNext(&li)) != NULL) {
+        clusterManagerReshardTableItem *item = ln->value;
+        clusterManagerMigration *m = NULL;
+        int count = 0;
+        listRewind(migrations, &mi);
+        while ((mn = listNext(&mi)) != NULL) {
+            clusterManagerMigration *candidate = mn->value;
+            if (candidate->source != item->source ||
+                candidate->target != target) continue;
+            count++;
+            if (m == NULL ||
+                listLength(candidate->table) < listLength(m->table))
+                m = candidate;
+        }
+        if (m == NULL || count < parallel) {
+            m = clusterManagerCreateMigration(item->source, target);
+            listAddNodeTail(migrations, m);
+        }
+        listAddNodeTail(m->table, item);
+        item->source->slots[item->slot] = 0;
+        target->slots[item->slot] = 1;
+    }
+    listEmpty(table);
+}
+
+/* Send to the source of the migration the next command: MIGRATE if we
+ * have keys to move, otherwise GETKEYSINSLOT to fetch the next batch. */
+static int clusterManagerSendMigrationCommand(clusterManagerMigration *m) {
+    redisContext *c = m->context;
+    int done = 0;
+    if (m->keys != NULL) {
+        clusterManagerAppendMigrateCommand(c, m->target, m->keys, m->replace,
+            config.cluster_manager_command.timeout);
+    } else {
+        redisAppendCommand(c, "CLUSTER GETKEYSINSLOT %d %d", m->slot,
+                           m->source->migrate_pipeline);
+    }
+    m->start = mstime();
+    while (!done) {
+        if (redisBufferWrite(c, &done) == REDIS_ERR) {
+            clusterManagerLogErr("*** Error writing to %s:%d: %s\n",
+                                 m->source->ip, m->source->port, c->errstr);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Start moving the next slot of the migration. */
+static int clusterManagerMigrationNextSlot(clusterManagerMigration *m) {
+    listNode *ln = listFirst(m->table);
+    clusterManagerReshardTableItem *item = ln->value;
+    m->slot = item->slot;
+    zfree(item);
+    listDelNode(m->table, ln);
+    if (!clusterManagerMigrationConnect(m)) return 0;
+    if (!clusterManagerOpenSlotMigration(m->source, m->target, m->slot, NULL))
+        return 0;
+    return clusterManagerSendMigrationCommand(m);
+}
+
+/* Adapt the number of keys moved by every MIGRATE of 'node' to the time
+ * the last batch of 'count' keys took. */
+static void clusterManagerAdaptMigratePipeline(clusterManagerNode *node,
+                                               size_t count,
+                                               long long elapsed)
+{
+    int max = CLUSTER_MANAGER_MIGRATE_PIPELINE_MAX;
+    if (config.cluster_manager_command.pipeline > max)
+        max = config.cluster_manager_command.pipeline;
+    if (elapsed > CLUSTER_MANAGER_MIGRATE_BATCH_TIME) {
+        node->migrate_pipeline /= 2;
+        if (node->migrate_pipeline < 1) node->migrate_pipeline = 1;
+    } else if (elapsed < CLUSTER_MANAGER_MIGRATE_BATCH_TIME / 2 &&
+               count >= (size_t) node->migrate_pipeline)
+    {
+        /* Only full batches tell us the pipeline could be larger. */
+        node->migrate_pipeline *= 2;
+        if (node->migrate_pipeline > max) node->migrate_pipeline = max;
+    }
+}
+
+/* Process the reply to the last command sent to the source of the
+ * migration and send the next one. '*done' is set to 1 when all the slots
+ * of the migration were moved. Returns 0 on errors. */
+static int clusterManagerProcessMigrationReply(clusterManagerMigration *m,
+                                               redisReply *reply, int opts,
+                                               int *done)
+{
+    clusterManagerNode *source = m->source;
+    if (reply->type == REDIS_REPLY_ERROR) {
+        int replace_existing_keys = (config.cluster_manager_command.flags &
+                                     CLUSTER_MANAGER_CMD_FLAG_REPLACE);
+        if (m->keys != NULL && !m->replace && replace_existing_keys &&
+            strstr(reply->str, "BUSYKEY") != NULL)
+        {
+            clusterManagerLogWarn("*** Target key exists. "
+                                  "Replacing it.\n");
+            freeReplyObject(reply);
+            m->replace = 1;
+            return clusterManagerSendMigrationCommand(m);
+        }
+        CLUSTER_MANAGER_PRINT_REPLY_ERROR(source, reply->str);
+        freeReplyObject(reply);
+        return 0;
+    }
+    if (m->keys != NULL) {
+        /* MIGRATE reply: fetch the next batch of keys. */
+        clusterManagerAdaptMigratePipeline(source, m->keys->elements,
+                                           mstime() - m->start);
+        freeReplyObject(m->keys);
+        freeReplyObject(reply);
+        m->keys = NULL;
+        m->replace = 0;
+        return clusterManagerSendMigrationCommand(m);
+    }
+    assert(reply->type == REDIS_REPLY_ARRAY);
+    if (reply->elements > 0) {
+        m->keys = reply;
+        return clusterManagerSendMigrationCommand(m);
+    }
+    /* No keys left in the slot: assign it to the target. */
+    freeReplyObject(reply);
+    if (!clusterManagerCloseSlotMigration(m->target, m->slot, NULL))
+        return 0;
+    if (opts & CLUSTER_MANAGER_OPT_QUIET) {
+        printf("#");
+    } else {
+        printf("Moved slot %d from %s:%d to %s:%d\n", m->slot, source->ip,
+               source->port, m->target->ip, m->target->port);
+    }
+    fflush(stdout);
+    if (listLength(m->table) == 0) {
+        *done = 1;
+        return 1;
+    }
+    return clusterManagerMigrationNextSlot(m);
+}
+
+/* Perform the 'migrations' running up to --cluster-parallel of them at the
+ * same time. The migrations are consumed from the list. If the
+ * CLUSTER_MANAGER_OPT_QUIET option is set a '#' is printed for every slot
+ * moved, otherwise a line is logged. Returns 0 on errors. */
+static int clusterManagerMoveSlotsParallel(list *migrations, int opts) {
+    int parallel = config.cluster_manager_command.parallel, j;
+    int success = 1, active = 0;
+    clusterManagerMigration **running = zcalloc(parallel * sizeof(*running));
+    struct pollfd *fds = zcalloc(parallel * sizeof(*fds));
+    listIter li;
+    listNode *ln;
+    while (success) {
+        /* Start new migrations while there are free slots. */
+        listRewind(migrations, &li);
+        while (active < parallel && (ln = listNext(&li)) != NULL) {
+            clusterManagerMigration *m = ln->value;
+            listDelNode(migrations, ln);
+            for (j = 0; running[j] != NULL; j++);
+            running[j] = m;
+            active++;
+            if (!clusterManagerMigrationNextSlot(m)) {
+                success = 0;
+                break;
+            }
+        }
+        if (!success || active == 0) break;
+
+        for (j = 0; j < parallel; j++) {
+            fds[j].fd = running[j] ? running[j]->context->fd : -1;
+            fds[j].events = POLLIN;
+            fds[j].revents = 0;
+        }
+        if (poll(fds, parallel, 1000) == -1) {
+            if (errno == EINTR) continue;
+            clusterManagerLogErr("*** poll() error: %s\n", strerror(errno));
+            success = 0;
+            break;
+        }
+        long long now = mstime();
+        for (j = 0; j < parallel && success; j++) {
+            clusterManagerMigration *m = running[j];
+            if (m == NULL) continue;
+            if (fds[j].revents == 0) {
+                if (now - m->start > config.cluster_manager_command.timeout) {
+                    clusterManagerLogErr("*** Timeout moving slot %d: no reply "
+                                         "from %s:%d\n", m->slot,
+                                         m->source->ip, m->source->port);
+                    success = 0;
+                }
+                continue;
+            }
+            redisContext *c = m->context;
+            void *reply = NULL;
+            if (redisBufferRead(c) != REDIS_OK ||
+                redisGetReplyFromReader(c, &reply) != REDIS_OK)
+            {
+                clusterManagerLogErr("*** Error reading from %s:%d: %s\n",
+                                     m->source->ip, m->source->port,
+                                     c->errstr);
+                success = 0;
+                break;
+            }
+            if (reply == NULL) continue;
+            int done = 0;
+            success = clusterManagerProcessMigrationReply(m, reply, opts,
+                                                          &done);
+            if (done) {
+                clusterManagerReleaseMigration(m);
+                running[j] = NULL;
+                active--;
+            }
+        }
+    }
+    /* Releasing the migrations also closes their connections, that could
+     * have commands in flight after an error. */
+    for (j = 0; j < parallel; j++) {
+        if (running[j] == NULL) continue;
+        clusterManagerReleaseMigration(running[j]);
+    }
+    zfree(running);
+    zfree(fds);
+    return success;
+}
+
 static void clusterManagerLog(int level, const char* fmt, ...) {
     int use_colors =
         (config.cluster_manager_command.flags & CLUSTER_MANAGER_CMD_FLAG_COLOR);
@@ -5209,6 +5596,13 @@ static int clusterManagerCommandReshard(int argc, char **argv) {
             goto cleanup;
         }
     }
+    if (config.cluster_manager_command.parallel > 1) {
+        list *migrations = listCreate();
+        clusterManagerQueueReshardTable(migrations, table, target);
+        result = clusterManagerMoveSlotsParallel(migrations, 0);
+        clusterManagerReleaseMigrations(migrations);
+        goto cleanup;
+    }
     int opts = CLUSTER_MANAGER_OPT_VERBOSE;
     listRewind(table, &li);
     while ((ln = listNext(&li)) != NULL) {
@@ -5233,11 +5627,288 @@ invalid_args:
     return 0;
 }
 
+/* Move the slots of the reshard table to 'target', printing a '#' for
+ * every slot moved. Returns 0 if a slot could not be moved. If
+ * 'migrations' is not NULL the slots are just queued there, to be moved
+ * later in parallel by clusterManagerRunMigrations(). */
+static int clusterManagerMoveReshardTable(list *table,
+                                          clusterManagerNode *target,
+                                          int simulate, list *migrations)
+{
+    listIter li;
+    listNode *ln;
+    int i, table_len = (int) listLength(table);
+    if (simulate) {
+        for (i = 0; i < table_len; i++) printf("#");
+        return 1;
+    }
+    if (migrations != NULL) {
+        clusterManagerQueueReshardTable(migrations, table, target);
+        return 1;
+    }
+    int opts = CLUSTER_MANAGER_OPT_QUIET | CLUSTER_MANAGER_OPT_UPDATE;
+    listRewind(table, &li);
+    while ((ln = listNext(&li)) != NULL) {
+        clusterManagerReshardTableItem *item = ln->value;
+        if (!clusterManagerMoveSlot(item->source, target, item->slot,
+                                    opts, NULL)) return 0;
+        printf("#");
+        fflush(stdout);
+    }
+    return 1;
+}
+
+/* Return the list where rebalance queues the slots to move when they
+ * should be moved in parallel, or NULL if they are moved one by one. */
+static list *clusterManagerCreateMigrations(int simulate) {
+    if (simulate || config.cluster_manager_command.parallel <= 1) return NULL;
+    return listCreate();
+}
+
+/* Perform the migrations queued by clusterManagerMoveReshardTable(). */
+static int clusterManagerRunMigrations(list *migrations) {
+    int slots = 0;
+    listIter li;
+    listNode *ln;
+    listRewind(migrations, &li);
+    while ((ln = listNext(&li)) != NULL) {
+        clusterManagerMigration *m = ln->value;
+        slots += listLength(m->table);
+    }
+    if (slots == 0) return 1;
+    printf("Moving %d slots, up to %d at a time\n", slots,
+           config.cluster_manager_command.parallel);
+    int success = clusterManagerMoveSlotsParallel(migrations,
+                                                  CLUSTER_MANAGER_OPT_QUIET);
+    printf("\n");
+    return success;
+}
+
+/* Load of every slot for the metric used by rebalance --cluster-weight-by,
+ * as reported by CLUSTER SLOT-STATS. */
+static unsigned long long *clusterManagerSlotsLoad = NULL;
+
+/* Fetch the 'metric' of the slots served by the nodes in 'nodes', filling
+ * clusterManagerSlotsLoad and the 'load' field of every node.
+ * Returns 0 on error. */
+static int clusterManagerFetchSlotsLoad(list *nodes, char *metric) {
+    listIter li;
+    listNode *ln;
+    listRewind(nodes, &li);
+    while ((ln = listNext(&li)) != NULL) {
+        clusterManagerNode *n = ln->value;
+        redisReply *reply = CLUSTER_MANAGER_COMMAND(n,
+            "CLUSTER SLOT-STATS SLOTSRANGE 0 %d", CLUSTER_MANAGER_SLOTS - 1);
+        int success = clusterManagerCheckRedisReply(n, reply, NULL);
+        size_t i, j;
+        if (success && reply->type != REDIS_REPLY_ARRAY) success = 0;
+        n->load = 0;
+        for (i = 0; success && i < reply->elements; i++) {
+            redisReply *entry = reply->element[i], *stats;
+            int found = 0;
+            if (entry->type != REDIS_REPLY_ARRAY || entry->elements != 2 ||
+                entry->element[0]->type != REDIS_REPLY_INTEGER ||
+                entry->element[0]->integer < 0 ||
+                entry->element[0]->integer >= CLUSTER_MANAGER_SLOTS ||
+                entry->element[1]->type != REDIS_REPLY_ARRAY)
+            {
+                success = 0;
+                break;
+            }
+            int slot = (int) entry->element[0]->integer;
+            stats = entry->element[1];
+            for (j = 0; j + 1 < stats->elements; j += 2) {
+                redisReply *name = stats->element[j];
+                if (name->type != REDIS_REPLY_STRING ||
+                    strcasecmp(name->str, metric)) continue;
+                if (stats->element[j+1]->type != REDIS_REPLY_INTEGER) {
+                    success = 0;
+                    break;
+                }
+                clusterManagerSlotsLoad[slot] = stats->element[j+1]->integer;
+                found = 1;
+            }
+            if (!success) break;
+            if (!found) {
+                clusterManagerLogErr("*** Unknown CLUSTER SLOT-STATS "
+                                     "metric '%s'\n", metric);
+                success = 0;
+                break;
+            }
+            n->load += clusterManagerSlotsLoad[slot];
+        }
+        if (reply) freeReplyObject(reply);
+        if (!success) {
+            clusterManagerLogErr("*** Unable to fetch the slots stats "
+                                 "of %s:%d\n", n->ip, n->port);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int clusterManagerCompareSlotLoadDesc(const void *a, const void *b) {
+    int s1 = *((int *) a), s2 = *((int *) b);
+    unsigned long long l1 = clusterManagerSlotsLoad[s1],
+                       l2 = clusterManagerSlotsLoad[s2];
+    if (l1 == l2) return s1 - s2;
+    return l1 > l2 ? -1 : 1;
+}
+
+/* Select the slots of 'source' whose load sums up to at most 'load',
+ * starting from the most loaded slots. Slots without load are never
+ * moved. The selected slots are flagged in 'taken' so that they are not
+ * selected again, and the load they sum up to is returned by reference. */
+static list *clusterManagerComputeLoadReshardTable(clusterManagerNode *source,
+                                                   long long load,
+                                                   uint8_t *taken,
+                                                   long long *moved_load)
+{
+    list *table = listCreate();
+    int *slots = zmalloc(CLUSTER_MANAGER_SLOTS * sizeof(int));
+    int count = 0, j;
+    for (j = 0; j < CLUSTER_MANAGER_SLOTS; j++) {
+        if (source->slots[j] && !taken[j] && clusterManagerSlotsLoad[j] > 0)
+            slots[count++] = j;
+    }
+    qsort(slots, count, sizeof(int), clusterManagerCompareSlotLoadDesc);
+    *moved_load = 0;
+    for (j = 0; j < count; j++) {
+        long long slot_load = (long long) clusterManagerSlotsLoad[slots[j]];
+        if (*moved_load + slot_load > load) continue;
+        clusterManagerReshardTableItem *item = zmalloc(sizeof(*item));
+        item->source = source;
+        item->slot = slots[j];
+        listAddNodeTail(table, item);
+        taken[slots[j]] = 1;
+        *moved_load += slot_load;
+    }
+    zfree(slots);
+    return table;
+}
+
+/* Rebalance with --cluster-weight-by: instead of giving every node the same
+ * number of slots (scaled by its weight), the nodes get the same load
+ * according to a CLUSTER SLOT-STATS metric, moving the hottest slots that
+ * fit the load a node has to give away. */
+static int clusterManagerRebalanceByLoad(list *involved,
+                                         clusterManagerNode **weightedNodes,
+                                         int nodes_involved,
+                                         float total_weight)
+{
+    char *metric = config.cluster_manager_command.weight_by;
+    float threshold = config.cluster_manager_command.threshold;
+    int simulate = config.cluster_manager_command.flags &
+                   CLUSTER_MANAGER_CMD_FLAG_SIMULATE;
+    long long total_load = 0;
+    int result = 1, i = 0, threshold_reached = 0;
+    uint8_t *taken = NULL;
+    list *migrations = NULL;
+    listIter li;
+    listNode *ln;
+    clusterManagerSlotsLoad =
+        zcalloc(CLUSTER_MANAGER_SLOTS * sizeof(unsigned long long));
+    if (!clusterManagerFetchSlotsLoad(involved, metric)) {
+        result = 0;
+        goto cleanup;
+    }
+    listRewind(involved, &li);
+    while ((ln = listNext(&li)) != NULL) {
+        clusterManagerNode *n = ln->value;
+        total_load += n->load;
+        weightedNodes[i++] = n;
+    }
+    if (total_load == 0) {
+        clusterManagerLogWarn("*** No rebalancing needed! No %s load "
+                              "reported by the nodes.\n", metric);
+        goto cleanup;
+    }
+    /* Calculate the load balance for each node, with the same threshold
+     * logic used when balancing the number of slots. */
+    for (i = 0; i < nodes_involved; i++) {
+        clusterManagerNode *n = weightedNodes[i];
+        long long expected = (long long)
+            (((double) total_load / total_weight) * n->weight);
+        n->load_balance = n->load - expected;
+        if (threshold > 0) {
+            if (n->load > 0) {
+                float err_perc = fabs((100-(100.0*expected/n->load)));
+                if (err_perc > threshold) threshold_reached = 1;
+            } else if (expected > 0) {
+                threshold_reached = 1;
+            }
+        }
+    }
+    if (!threshold_reached) {
+        clusterManagerLogWarn("*** No rebalancing needed! "
+                             "All nodes are within the %.2f%% threshold.\n",
+                             threshold);
+        goto cleanup;
+    }
+    qsort(weightedNodes, nodes_involved, sizeof(clusterManagerNode *),
+          clusterManagerCompareNodeLoadBalance);
+    clusterManagerLogInfo(">>> Rebalancing %s across %d nodes. "
+                          "Total weight = %.2f\n",
+                          metric, nodes_involved, total_weight);
+    if (config.verbose) {
+        for (i = 0; i < nodes_involved; i++) {
+            clusterManagerNode *n = weightedNodes[i];
+            printf("%s:%d balance is %lld %s\n", n->ip, n->port,
+                   n->load_balance, metric);
+        }
+    }
+    taken = zcalloc(CLUSTER_MANAGER_SLOTS);
+    migrations = clusterManagerCreateMigrations(simulate);
+    int dst_idx = 0;
+    int src_idx = nodes_involved - 1;
+    while (dst_idx < src_idx) {
+        clusterManagerNode *dst = weightedNodes[dst_idx];
+        clusterManagerNode *src = weightedNodes[src_idx];
+        long long dl = -dst->load_balance, sl = src->load_balance;
+        long long amount = (dl < sl ? dl : sl), moved_load = 0;
+        if (dl <= 0) {
+            dst_idx++;
+            continue;
+        }
+        if (sl <= 0) {
+            src_idx--;
+            continue;
+        }
+        list *table = clusterManagerComputeLoadReshardTable(src, amount,
+                                                            taken,
+                                                            &moved_load);
+        if (listLength(table) > 0) {
+            printf("Moving %d slots (%lld %s) from %s:%d to %s:%d\n",
+                   (int) listLength(table), moved_load, metric,
+                   src->ip, src->port, dst->ip, dst->port);
+            result = clusterManagerMoveReshardTable(table, dst, simulate,
+                                                    migrations);
+            if (result && migrations == NULL) printf("\n");
+        }
+        clusterManagerReleaseReshardTable(table);
+        if (!result) goto cleanup;
+        dst->load_balance += moved_load;
+        src->load_balance -= moved_load;
+        /* The remaining slots of the source don't fit the load this pair
+         * can exchange: go on with the next node on the side that limited
+         * the exchange. */
+        if (dl <= sl) dst_idx++;
+        else src_idx--;
+    }
+    if (migrations != NULL) result = clusterManagerRunMigrations(migrations);
+cleanup:
+    if (taken != NULL) zfree(taken);
+    clusterManagerReleaseMigrations(migrations);
+    zfree(clusterManagerSlotsLoad);
+    clusterManagerSlotsLoad = NULL;
+    return result;
+}
+
 static int clusterManagerCommandRebalance(int argc, char **argv) {
     int port = 0;
     char *ip = NULL;
     clusterManagerNode **weightedNodes = NULL;
-    list *involved = NULL;
+    list *involved = NULL, *migrations = NULL;
     if (!getClusterHostFromCmdArgs(argc, argv, &ip, &port)) goto invalid_args;
     clusterManagerNode *node = clusterManagerNewNode(ip, port);
     if (!clusterManagerLoadInfoFromNode(node, 0)) return 0;
@@ -5292,6 +5963,11 @@ static int clusterManagerCommandRebalance(int argc, char **argv) {
         result = 0;
         goto cleanup;
     }
+    if (config.cluster_manager_command.weight_by != NULL) {
+        result = clusterManagerRebalanceByLoad(involved, weightedNodes,
+                                               nodes_involved, total_weight);
+        goto cleanup;
+    }
     /* Calculate the slots balance for each node. It's the number of
      * slots the node should lose (if positive) or gain (if negative)
      * in order to be balanced. */
@@ -5360,6 +6036,7 @@ static int clusterManagerCommandRebalance(int argc, char **argv) {
     int src_idx = nodes_involved - 1;
     int simulate = config.cluster_manager_command.flags &
                    CLUSTER_MANAGER_CMD_FLAG_SIMULATE;
+    migrations = clusterManagerCreateMigrations(simulate);
     while (dst_idx < src_idx) {
         clusterManagerNode *dst = weightedNodes[dst_idx];
         clusterManagerNode *src = weightedNodes[src_idx];
@@ -5384,25 +6061,10 @@ static int clusterManagerCommandRebalance(int argc, char **argv) {
                 result = 0;
                 goto end_move;
             }
-            if (simulate) {
-                for (i = 0; i < table_len; i++) printf("#");
-            } else {
-                int opts = CLUSTER_MANAGER_OPT_QUIET |
-                           CLUSTER_MANAGER_OPT_UPDATE;
-                listRewind(table, &li);
-                while ((ln = listNext(&li)) != NULL) {
-                    clusterManagerReshardTableItem *item = ln->value;
-                    result = clusterManagerMoveSlot(item->source,
-                                                    dst,
-                                                    item->slot,
-                                                    opts, NULL);
-                    if (!result) goto end_move;
-                    printf("#");
-                    fflush(stdout);
-                }
-
-            }
-            printf("\n");
+            result = clusterManagerMoveReshardTable(table, dst, simulate,
+                                                    migrations);
+            if (!result) goto end_move;
+            if (migrations == NULL) printf("\n");
 end_move:
             clusterManagerReleaseReshardTable(table);
             if (!result) goto cleanup;
@@ -5413,7 +6075,9 @@ end_move:
         if (dst->balance == 0) dst_idx++;
         if (src->balance == 0) src_idx --;
     }
+    if (migrations != NULL) result = clusterManagerRunMigrations(migrations);
 cleanup:
+    clusterManagerReleaseMigrations(migrations);
     if (involved != NULL) listRelease(involved);
     if (weightedNodes != NULL) zfree(weightedNodes);
     return result;
@@ -7047,8 +7711,10 @@ int main(int argc, char **argv) {
     config.cluster_manager_command.slots = 0;
     config.cluster_manager_command.timeout = CLUSTER_MANAGER_MIGRATE_TIMEOUT;
     config.cluster_manager_command.pipeline = CLUSTER_MANAGER_MIGRATE_PIPELINE;
+    config.cluster_manager_command.parallel = CLUSTER_MANAGER_MIGRATE_PARALLEL;
     config.cluster_manager_command.threshold =
         CLUSTER_MANAGER_REBALANCE_THRESHOLD;
+    config.cluster_manager_command.weight_by = NULL;
     pref.hints = 1;
 
     spectrum_palette = spectrum_palette_color;
@@ -0,0 +1,1090 @@
+/* roaring -- Compressed representation of sparse bitmaps.
+ *
+ * See roaring.h for a description of the representation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "roaring.h"
+#include "zmalloc.h"
+
+#define RBM_ARRAY 0
+#define RBM_BITMAP 1
+#define RBM_RUN 2
+
+#define RBM_CHUNK_BITS 65536
+#define RBM_ARRAY_MAX 4096      /* More offsets take more than a bitmap. */
+
+/* ----------------------------------------------------------------------------
+ * Chunks: 8192 bytes in the same layout of the string.
+ * ------------------------------------------------------------------------- */
+
+static inline int chunkGet(const unsigned char *b, uint32_t v) {
+    return (b[v>>3] >> (7-(v&7))) & 1;
+}
+
+static inline void chunkSet(unsigned char *b, uint32_t v) {
+    b[v>>3] |= 0x80 >> (v&7);
+}
+
+/* Set the bits from 'first' to 'last' included. */
+static void chunkSetRange(unsigned char *b, uint32_t first, uint32_t last) {
+    uint32_t fb = first>>3, lb = last>>3;
+    unsigned char fm = 0xff >> (first&7);
+    unsigned char lm = (unsigned char)(0xff << (7-(last&7)));
+
+    if (fb == lb) {
+        b[fb] |= fm & lm;
+        return;
+    }
+    b[fb] |= fm;
+    memset(b+fb+1,0xff,lb-fb-1);
+    b[lb] |= lm;
+}
+
+static uint32_t popcountBytes(const unsigned char *p, size_t count) {
+    uint32_t bits = 0;
+    uint64_t w;
+
+    while (count >= 8) {
+        memcpy(&w,p,sizeof(w));
+        bits += __builtin_popcountll(w);
+        p += 8;
+        count -= 8;
+    }
+    while (count--) bits += __builtin_popcount(*p++);
+    return bits;
+}
+
+static int bytesAreZero(const unsigned char *p, size_t count) {
+    uint64_t w;
+
+    while (count >= 8) {
+        memcpy(&w,p,sizeof(w));
+        if (w) return 0;
+        p += 8;
+        count -= 8;
+    }
+    while (count--) if (*p++) return 0;
+    return 1;
+}
+
+/* Return the number of runs of consecutive set bits in the chunk. A run
+ * starts at every set bit whose previous bit is clear. */
+static uint32_t chunkRuns(const unsigned char *b) {
+    uint32_t runs = 0, prev = 0, j;
+
+    for (j = 0; j < RBM_CHUNK_BYTES; j++) {
+        uint32_t v = b[j];
+        runs += __builtin_popcount(v & ~((v>>1) | (prev<<7)));
+        prev = v & 1;
+    }
+    return runs;
+}
+
+/* ----------------------------------------------------------------------------
+ * Containers
+ * ------------------------------------------------------------------------- */
+
+static size_t cDataBytes(const rbmContainer *c) {
+    return c->type == RBM_BITMAP ? RBM_CHUNK_BYTES : c->alloc*sizeof(uint16_t);
+}
+
+static void cFreeData(rbm *r, rbmContainer *c) {
+    r->bytes -= cDataBytes(c);
+    zfree(c->data);
+    c->data = NULL;
+    c->alloc = 0;
+}
+
+/* Resize the array of an array or run container to 'alloc' 16 bit slots. */
+static void cResize(rbm *r, rbmContainer *c, uint32_t alloc) {
+    r->bytes -= c->alloc*sizeof(uint16_t);
+    c->data = zrealloc(c->data,alloc*sizeof(uint16_t));
+    c->alloc = alloc;
+    r->bytes += c->alloc*sizeof(uint16_t);
+}
+
+/* Return the index of the first offset >= v of an array container. */
+static uint32_t arrayLowerBound(const uint16_t *a, uint32_t n, uint32_t v) {
+    uint32_t lo = 0, hi = n;
+
+    while (lo < hi) {
+        uint32_t mid = (lo+hi)/2;
+        if (a[mid] < v) lo = mid+1; else hi = mid;
+    }
+    return lo;
+}
+
+/* Return the index of the first run ending at an offset >= v. */
+static uint32_t runLowerBound(const uint16_t *runs, uint32_t n, uint32_t v) {
+    uint32_t lo = 0, hi = n;
+
+    while (lo < hi) {
+        uint32_t mid = (lo+hi)/2;
+        if (runs[mid*2+1] < v) lo = mid+1; else hi = mid;
+    }
+    return lo;
+}
+
+/* Fill 'b' with the chunk stored in the container. */
+static void cToChunk(const rbmContainer *c, unsigned char *b) {
+    const uint16_t *a = c->data;
+    uint32_t j;
+
+    if (c->type == RBM_BITMAP) {
+        memcpy(b,c->data,RBM_CHUNK_BYTES);
+        return;
+    }
+    memset(b,0,RBM_CHUNK_BYTES);
+    if (c->type == RBM_ARRAY) {
+        for (j = 0; j < c->n; j++) chunkSet(b,a[j]);
+    } else {
+        for (j = 0; j < c->n; j++) chunkSetRange(b,a[j*2],a[j*2+1]);
+    }
+}
+
+/* Store the chunk 'b', that must have at least one bit set, in the
+ * container, using the representation taking less memory. */
+/* 使用占用内存最少的表示方式将给定的分块保存到容器中 */
+static void cFromChunk(rbm *r, rbmContainer *c, const unsigned char *b) {
+    uint32_t card = popcountBytes(b,RBM_CHUNK_BYTES);
+    uint32_t runs = chunkRuns(b);
+    size_t arraybytes = card <= RBM_ARRAY_MAX ? card*2 : RBM_CHUNK_BYTES+1;
+    uint32_t j, v, n = 0;
+    uint16_t *a;
+
+    cFreeData(r,c);
+    c->card = card;
+    if (runs*4 < arraybytes && runs*4 < RBM_CHUNK_BYTES) {
+        c->type = RBM_RUN;
+        cResize(r,c,runs*2);
+        a = c->data;
+        for (v = 0; v < RBM_CHUNK_BITS; v++) {
+            if (!chunkGet(b,v)) {
+                /* Skip clear bytes at once. */
+                if ((v&7) == 0 && b[v>>3] == 0) v += 7;
+                continue;
+            }
+            a[n*2] = v;
+            while (v+1 < RBM_CHUNK_BITS && chunkGet(b,v+1)) {
+                if (((v+1)&7) == 0 && b[(v+1)>>3] == 0xff) v += 8;
+                else v++;
+            }
+            a[n*2+1] = v;
+            n++;
+        }
+        c->n = n;
+    } else if (card <= RBM_ARRAY_MAX) {
+        c->type = RBM_ARRAY;
+        cResize(r,c,card);
+        a = c->data;
+        for (j = 0; j < RBM_CHUNK_BYTES; j++) {
+            if (b[j] == 0) continue;
+            for (v = j*8; v < j*8+8; v++)
+                if (chunkGet(b,v)) a[n++] = v;
+        }
+        c->n = n;
+    } else {
+        c->type = RBM_BITMAP;
+        c->data = zmalloc(RBM_CHUNK_BYTES);
+        memcpy(c->data,b,RBM_CHUNK_BYTES);
+        r->bytes += RBM_CHUNK_BYTES;
+        c->n = 0;
+    }
+}
+
+/* Switch the container to the representation taking less memory. */
+static void cOptimize(rbm *r, rbmContainer *c) {
+    unsigned char b[RBM_CHUNK_BYTES];
+
+    cToChunk(c,b);
+    cFromChunk(r,c,b);
+}
+
+/* A run container that grew larger than an array or a bitmap with the same
+ * bits is converted. */
+static void cCheckRuns(rbm *r, rbmContainer *c) {
+    size_t best = c->card <= RBM_ARRAY_MAX ? c->card*2 : RBM_CHUNK_BYTES;
+
+    if (c->n*4 > best) cOptimize(r,c);
+}
+
+static int cGet(const rbmContainer *c, uint32_t v) {
+    const uint16_t *a = c->data;
+    uint32_t i;
+
+    switch(c->type) {
+    case RBM_ARRAY:
+        i = arrayLowerBound(a,c->n,v);
+        return i < c->n && a[i] == v;
+    case RBM_BITMAP:
+        return chunkGet(c->data,v);
+    default:
+        i = runLowerBound(a,c->n,v);
+        return i < c->n && a[i*2] <= v;
+    }
+}
+
+/* Set the bit 'v' of the container. Return 1 if the bit was clear. */
+static int cAdd(rbm *r, rbmContainer *c, uint32_t v) {
+    uint16_t *a = c->data;
+    uint32_t i;
+
+    if (c->type == RBM_ARRAY) {
+        i = arrayLowerBound(a,c->n,v);
+        if (i < c->n && a[i] == v) return 0;
+        if (c->n == RBM_ARRAY_MAX) {
+            unsigned char b[RBM_CHUNK_BYTES];
+            cToChunk(c,b);
+            chunkSet(b,v);
+            cFromChunk(r,c,b);
+            return 1;
+        }
+        if (c->n == c->alloc) {
+            uint32_t alloc = c->alloc ? c->alloc*2 : 4;
+            if (alloc > RBM_ARRAY_MAX) alloc = RBM_ARRAY_MAX;
+            cResize(r,c,alloc);
+            a = c->data;
+        }
+        memmove(a+i+1,a+i,(c->n-i)*sizeof(uint16_t));
+        a[i] = v;
+        c->n++;
+        c->card++;
+    } else if (c->type == RBM_BITMAP) {
+        if (chunkGet(c->data,v)) return 0;
+        chunkSet(c->data,v);
+        if (++c->card == RBM_CHUNK_BITS) cOptimize(r,c);
+    } else {
+        int prevadj, nextadj;
+
+        i = runLowerBound(a,c->n,v);
+        if (i < c->n && a[i*2] <= v) return 0;
+        prevadj = i > 0 && (uint32_t)a[(i-1)*2+1]+1 == v;
+        nextadj = i < c->n && a[i*2] == v+1;
+        if (prevadj && nextadj) {
+            /* The bit joins two runs. */
+            a[(i-1)*2+1] = a[i*2+1];
+            memmove(a+i*2,a+i*2+2,(c->n-i-1)*sizeof(uint16_t)*2);
+            c->n--;
+        } else if (prevadj) {
+            a[(i-1)*2+1] = v;
+        } else if (nextadj) {
+            a[i*2] = v;
+        } else {
+            if (c->n*2+2 > c->alloc) {
+                cResize(r,c,c->alloc ? c->alloc*2 : 4);
+                a = c->data;
+            }
+            memmove(a+i*2+2,a+i*2,(c->n-i)*sizeof(uint16_t)*2);
+            a[i*2] = a[i*2+1] = v;
+            c->n++;
+        }
+        c->card++;
+        cCheckRuns(r,c);
+    }
+    return 1;
+}
+
+/* Clear the bit 'v' of the container. Return 1 if the bit was set. The
+ * caller should remove the container once it is empty. */
+static int cRemove(rbm *r, rbmContainer *c, uint32_t v) {
+    uint16_t *a = c->data;
+    uint32_t i;
+
+    if (c->type == RBM_ARRAY) {
+        i = arrayLowerBound(a,c->n,v);
+        if (i == c->n || a[i] != v) return 0;
+        memmove(a+i,a+i+1,(c->n-i-1)*sizeof(uint16_t));
+        c->n--;
+        c->card--;
+        if (c->n && c->n < c->alloc/4) cResize(r,c,c->alloc/2);
+    } else if (c->type == RBM_BITMAP) {
+        unsigned char *b = c->data;
+        if (!chunkGet(b,v)) return 0;
+        b[v>>3] &= ~(0x80 >> (v&7));
+        if (--c->card <= RBM_ARRAY_MAX && c->card) cOptimize(r,c);
+    } else {
+        uint32_t first, last;
+
+        i = runLowerBound(a,c->n,v);
+        if (i == c->n || a[i*2] > v) return 0;
+        first = a[i*2];
+        last = a[i*2+1];
+        if (first == last) {
+            memmove(a+i*2,a+i*2+2,(c->n-i-1)*sizeof(uint16_t)*2);
+            c->n--;
+        } else if (v == first) {
+            a[i*2]++;
+        } else if (v == last) {
+            a[i*2+1]--;
+        } else {
+            /* Split the run in two. */
+            if (c->n*2+2 > c->alloc) {
+                cResize(r,c,c->alloc*2);
+                a = c->data;
+            }
+            memmove(a+i*2+4,a+i*2+2,(c->n-i-1)*sizeof(uint16_t)*2);
+            a[i*2+1] = v-1;
+            a[i*2+2] = v+1;
+            a[i*2+3] = last;
+            c->n++;
+        }
+        if (--c->card) cCheckRuns(r,c);
+    }
+    return 1;
+}
+
+/* Return the first set bit >= 'from', or RBM_CHUNK_BITS if there is none. */
+static uint32_t cNextSet(const rbmContainer *c, uint32_t from) {
+    const uint16_t *a = c->data;
+    const unsigned char *b = c->data;
+    uint32_t i, v;
+
+    switch(c->type) {
+    case RBM_ARRAY:
+        i = arrayLowerBound(a,c->n,from);
+        return i < c->n ? a[i] : RBM_CHUNK_BITS;
+    case RBM_BITMAP:
+        for (v = from; v < RBM_CHUNK_BITS && (v&7); v++)
+            if (chunkGet(b,v)) return v;
+        for (i = v>>3; i < RBM_CHUNK_BYTES; i++)
+            if (b[i]) return i*8+__builtin_clz(b[i])-24;
+        return RBM_CHUNK_BITS;
+    default:
+        i = runLowerBound(a,c->n,from);
+        if (i == c->n) return RBM_CHUNK_BITS;
+        return a[i*2] > from ? a[i*2] : from;
+    }
+}
+
+/* Return the first clear bit >= 'from', or RBM_CHUNK_BITS if there is
+ * none. */
+static uint32_t cNextClear(const rbmContainer *c, uint32_t from) {
+    const uint16_t *a = c->data;
+    const unsigned char *b = c->data;
+    uint32_t i, v;
+
+    switch(c->type) {
+    case RBM_ARRAY:
+        i = arrayLowerBound(a,c->n,from);
+        for (v = from; i < c->n && a[i] == v; i++) v++;
+        return v;
+    case RBM_BITMAP:
+        for (v = from; v < RBM_CHUNK_BITS && (v&7); v++)
+            if (!chunkGet(b,v)) return v;
+        for (i = v>>3; i < RBM_CHUNK_BYTES; i++)
+            if (b[i] != 0xff) return i*8+__builtin_clz(~b[i] & 0xff)-24;
+        return RBM_CHUNK_BITS;
+    default:
+        i = runLowerBound(a,c->n,from);
+        if (i < c->n && a[i*2] <= from) return (uint32_t)a[i*2+1]+1;
+        return from;
+    }
+}
+
+/* Return the number of bits set in the bytes from 'first' to 'last' included
+ * of the chunk. */
+static uint32_t cCountBytes(const rbmContainer *c, uint32_t first, uint32_t last) {
+    const uint16_t *a = c->data;
+    uint32_t lo = first*8, hi = last*8+7, i, count = 0;
+
+    switch(c->type) {
+    case RBM_ARRAY:
+        return arrayLowerBound(a,c->n,hi+1)-arrayLowerBound(a,c->n,lo);
+    case RBM_BITMAP:
+        return popcountBytes((unsigned char*)c->data+first,last-first+1);
+    default:
+        for (i = runLowerBound(a,c->n,lo); i < c->n && a[i*2] <= hi; i++) {
+            uint32_t s = a[i*2] > lo ? a[i*2] : lo;
+            uint32_t e = a[i*2+1] < hi ? a[i*2+1] : hi;
+            count += e-s+1;
+        }
+        return count;
+    }
+}
+
+/* Return the byte 'j' of the chunk. */
+static unsigned char cGetByte(const rbmContainer *c, uint32_t j) {
+    const uint16_t *a = c->data;
+    uint32_t lo = j*8, i;
+    unsigned char byte = 0;
+
+    switch(c->type) {
+    case RBM_ARRAY:
+        for (i = arrayLowerBound(a,c->n,lo); i < c->n && a[i] < lo+8; i++)
+            byte |= 0x80 >> (a[i]&7);
+        return byte;
+    case RBM_BITMAP:
+        return ((unsigned char*)c->data)[j];
+    default:
+        for (i = runLowerBound(a,c->n,lo); i < c->n && a[i*2] < lo+8; i++) {
+            uint32_t s = a[i*2] > lo ? a[i*2] : lo;
+            uint32_t e = a[i*2+1] < lo+7 ? a[i*2+1] : lo+7;
+            for (; s <= e; s++) byte |= 0x80 >> (s&7);
+        }
+        return byte;
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Bitmaps
+ * ------------------------------------------------------------------------- */
+
+/* Search the container of the chunk 'key'. Return 1 if found, in any case
+ * '*idx' is set to the position where it is or should be inserted. */
+static int rbmFindIndex(const rbm *r, uint32_t key, uint32_t *idx) {
+    uint32_t lo = 0, hi = r->count;
+
+    while (lo < hi) {
+        uint32_t mid = (lo+hi)/2;
+        if (r->c[mid].key < key) lo = mid+1; else hi = mid;
+    }
+    *idx = lo;
+    return lo < r->count && r->c[lo].key == key;
+}
+
+static rbmContainer *rbmFind(const rbm *r, uint32_t key) {
+    uint32_t idx;
+    return rbmFindIndex(r,key,&idx) ? r->c+idx : NULL;
+}
+
+/* Insert an empty array container for the chunk 'key' at 'idx'. */
+static rbmContainer *rbmInsert(rbm *r, uint32_t idx, uint32_t key) {
+    rbmContainer *c;
+
+    if (r->count == r->alloc) {
+        r->alloc = r->alloc ? r->alloc*2 : 4;
+        r->c = zrealloc(r->c,sizeof(rbmContainer)*r->alloc);
+    }
+    memmove(r->c+idx+1,r->c+idx,sizeof(rbmContainer)*(r->count-idx));
+    r->count++;
+    c = r->c+idx;
+    c->key = key;
+    c->type = RBM_ARRAY;
+    c->card = 0;
+    c->n = 0;
+    c->alloc = 0;
+    c->data = NULL;
+    return c;
+}
+
+static void rbmRemove(rbm *r, uint32_t idx) {
+    cFreeData(r,r->c+idx);
+    memmove(r->c+idx,r->c+idx+1,sizeof(rbmContainer)*(r->count-idx-1));
+    r->count--;
+}
+
+/* Create an empty bitmap representing a string of 'len' zero bytes. */
+/* 创建一个表示长度为len的全0字符串的压缩位图 */
+rbm *rbmNew(size_t len) {
+    rbm *r = zmalloc(sizeof(*r));
+
+    r->len = len;
+    r->count = 0;
+    r->alloc = 0;
+    r->c = NULL;
+    r->bytes = 0;
+    return r;
+}
+
+void rbmFree(rbm *r) {
+    uint32_t j;
+
+    for (j = 0; j < r->count; j++) zfree(r->c[j].data);
+    zfree(r->c);
+    zfree(r);
+}
+
+rbm *rbmDup(const rbm *r) {
+    rbm *d = rbmNew(r->len);
+    uint32_t j;
+
+    d->count = d->alloc = r->count;
+    d->c = r->count ? zmalloc(sizeof(rbmContainer)*r->count) : NULL;
+    for (j = 0; j < r->count; j++) {
+        size_t bytes = cDataBytes(r->c+j);
+        d->c[j] = r->c[j];
+        d->c[j].data = zmalloc(bytes);
+        memcpy(d->c[j].data,r->c[j].data,bytes);
+    }
+    d->bytes = r->bytes;
+    return d;
+}
+
+/* Pad the represented string with zero bytes so that it is at least 'len'
+ * bytes long. */
+void rbmGrow(rbm *r, size_t len) {
+    if (len > r->len) r->len = len;
+}
+
+/* Return the value of the bit at offset 'bit'. */
+int rbmGetBit(const rbm *r, uint64_t bit) {
+    rbmContainer *c;
+
+    if (bit >= (uint64_t)r->len*8) return 0;
+    c = rbmFind(r,bit>>16);
+    return c ? cGet(c,bit&0xffff) : 0;
+}
+
+/* Set or clear the bit at offset 'bit', growing the string if needed.
+ * Return the previous value of the bit. */
+/* 设置或者清除指定偏移位置的位 返回该位之前的值 */
+int rbmSetBit(rbm *r, uint64_t bit, int on) {
+    uint32_t idx, key = bit>>16, v = bit&0xffff;
+    int found = rbmFindIndex(r,key,&idx);
+    rbmContainer *c = r->c+idx;
+    int old;
+
+    rbmGrow(r,(bit>>3)+1);
+    if (on) {
+        if (!found) c = rbmInsert(r,idx,key);
+        return !cAdd(r,c,v);
+    }
+    if (!found) return 0;
+    old = cRemove(r,c,v);
+    if (c->card == 0) rbmRemove(r,idx);
+    return old;
+}
+
+/* Return the number of bits set from the byte 'start' to the byte 'end'
+ * included. */
+uint64_t rbmCount(const rbm *r, size_t start, size_t end) {
+    uint32_t idx, firstkey, lastkey;
+    uint64_t count = 0;
+
+    if (r->len == 0) return 0;
+    if (end >= r->len) end = r->len-1;
+    if (start > end) return 0;
+    firstkey = start/RBM_CHUNK_BYTES;
+    lastkey = end/RBM_CHUNK_BYTES;
+    rbmFindIndex(r,firstkey,&idx);
+    for (; idx < r->count && r->c[idx].key <= lastkey; idx++) {
+        const rbmContainer *c = r->c+idx;
+        uint32_t first = c->key == firstkey ? start%RBM_CHUNK_BYTES : 0;
+        uint32_t last = c->key == lastkey ? end%RBM_CHUNK_BYTES :
+                                            RBM_CHUNK_BYTES-1;
+
+        if (first == 0 && last == RBM_CHUNK_BYTES-1)
+            count += c->card;
+        else
+            count += cCountBytes(c,first,last);
+    }
+    return count;
+}
+
+/* Return the offset of the first bit set to 'bit' from the byte 'start' to
+ * the byte 'end' included, that must be inside the string. Like
+ * redisBitpos() -1 is returned if no set bit is found, while if no clear bit
+ * is found the offset of the first bit after the range is returned. */
+int64_t rbmBitpos(const rbm *r, size_t start, size_t end, int bit) {
+    uint64_t lo = (uint64_t)start*8, hi = (uint64_t)end*8+7, p;
+    uint32_t idx, v;
+
+    if (bit) {
+        rbmFindIndex(r,lo>>16,&idx);
+        for (; idx < r->count && r->c[idx].key <= (hi>>16); idx++) {
+            const rbmContainer *c = r->c+idx;
+            v = cNextSet(c,c->key == (lo>>16) ? lo&0xffff : 0);
+            if (v < RBM_CHUNK_BITS) {
+                p = ((uint64_t)c->key<<16)|v;
+                return p <= hi ? (int64_t)p : -1;
+            }
+        }
+        return -1;
+    }
+
+    p = lo;
+    while (p <= hi) {
+        const rbmContainer *c = rbmFind(r,p>>16);
+        if (c == NULL) return p;
+        v = cNextClear(c,p&0xffff);
+        if (v < RBM_CHUNK_BITS) {
+            p = ((p>>16)<<16)|v;
+            return p <= hi ? p : hi+1;
+        }
+        p = ((p>>16)+1)<<16;
+    }
+    return hi+1;
+}
+
+/* Copy 'count' bytes of the string starting at 'offset' into 'buf'. The
+ * bytes past the end of the string are zero. */
+void rbmGetBytes(const rbm *r, size_t offset, unsigned char *buf, size_t count) {
+    unsigned char chunk[RBM_CHUNK_BYTES];
+
+    while (count) {
+        size_t key = offset/RBM_CHUNK_BYTES, first = offset%RBM_CHUNK_BYTES;
+        size_t n = RBM_CHUNK_BYTES-first, j;
+        const rbmContainer *c = key < RBM_CHUNK_BITS ? rbmFind(r,key) : NULL;
+
+        if (n > count) n = count;
+        if (c == NULL) {
+            memset(buf,0,n);
+        } else if (c->type == RBM_BITMAP) {
+            memcpy(buf,(unsigned char*)c->data+first,n);
+        } else if (n <= 16) {
+            for (j = 0; j < n; j++) buf[j] = cGetByte(c,first+j);
+        } else {
+            cToChunk(c,chunk);
+            memcpy(buf,chunk+first,n);
+        }
+        buf += n;
+        offset += n;
+        count -= n;
+    }
+}
+
+/* Overwrite 'count' bytes of the string starting at 'offset' with the
+ * content of 'buf'. This is meant for short writes: only the bits that
+ * change are touched, and the string only grows up to the last of them. */
+void rbmSetBytes(rbm *r, size_t offset, const unsigned char *buf, size_t count) {
+    size_t j;
+    int k;
+
+    for (j = 0; j < count; j++) {
+        unsigned char old, diff;
+
+        rbmGetBytes(r,offset+j,&old,1);
+        diff = old ^ buf[j];
+        for (k = 0; k < 8; k++) {
+            if (diff & (0x80 >> k))
+                rbmSetBit(r,(uint64_t)(offset+j)*8+k,(buf[j] >> (7-k)) & 1);
+        }
+    }
+}
+
+/* Set '*chunk' to the first chunk >= 'from' with some bit set. Return 0 if
+ * there is none. */
+int rbmNextChunk(const rbm *r, uint32_t from, uint32_t *chunk) {
+    uint32_t idx;
+
+    rbmFindIndex(r,from,&idx);
+    if (idx == r->count) return 0;
+    *chunk = r->c[idx].key;
+    return 1;
+}
+
+/* Copy the 8192 bytes of the chunk 'chunk' into 'buf'. Return 0 if all the
+ * bits of the chunk are clear. */
+int rbmGetChunk(const rbm *r, uint32_t chunk, unsigned char *buf) {
+    const rbmContainer *c = rbmFind(r,chunk);
+
+    if (c == NULL) {
+        memset(buf,0,RBM_CHUNK_BYTES);
+        return 0;
+    }
+    cToChunk(c,buf);
+    return 1;
+}
+
+/* Replace the chunk 'chunk' with the 8192 bytes of 'buf'. It's up to the
+ * caller to grow the string so that no bit is set past its end. */
+void rbmSetChunk(rbm *r, uint32_t chunk, const unsigned char *buf) {
+    uint32_t idx;
+    int found = rbmFindIndex(r,chunk,&idx);
+
+    if (bytesAreZero(buf,RBM_CHUNK_BYTES)) {
+        if (found) rbmRemove(r,idx);
+        return;
+    }
+    if (!found) rbmInsert(r,idx,chunk);
+    cFromChunk(r,r->c+idx,buf);
+}
+
+/* Write the string represented by the bitmap into 'buf', that must be
+ * r->len bytes. */
+/* 将压缩位图表示的字符串写入到给定的缓冲区中 */
+void rbmToBuffer(const rbm *r, unsigned char *buf) {
+    uint32_t j, k;
+
+    memset(buf,0,r->len);
+    for (j = 0; j < r->count; j++) {
+        const rbmContainer *c = r->c+j;
+        const uint16_t *a = c->data;
+        unsigned char *b = buf+(size_t)c->key*RBM_CHUNK_BYTES;
+        size_t n = r->len-(size_t)c->key*RBM_CHUNK_BYTES;
+
+        /* No bit is set past the end of the string, so only the bitmap
+         * containers need to care about the string length. */
+        if (c->type == RBM_ARRAY) {
+            for (k = 0; k < c->n; k++) chunkSet(b,a[k]);
+        } else if (c->type == RBM_RUN) {
+            for (k = 0; k < c->n; k++) chunkSetRange(b,a[k*2],a[k*2+1]);
+        } else {
+            memcpy(b,c->data,n < RBM_CHUNK_BYTES ? n : RBM_CHUNK_BYTES);
+        }
+    }
+}
+
+/* Create a bitmap representing the 'len' bytes at 'p'. */
+/* 根据给定的字符串创建对应的压缩位图 */
+rbm *rbmFromBuffer(const unsigned char *p, size_t len) {
+    rbm *r = rbmNew(len);
+    unsigned char chunk[RBM_CHUNK_BYTES];
+    size_t offset;
+
+    for (offset = 0; offset < len; offset += RBM_CHUNK_BYTES) {
+        size_t n = len-offset;
+        const unsigned char *b = p+offset;
+
+        if (n > RBM_CHUNK_BYTES) n = RBM_CHUNK_BYTES;
+        if (bytesAreZero(b,n)) continue;
+        if (n < RBM_CHUNK_BYTES) {
+            memcpy(chunk,b,n);
+            memset(chunk+n,0,RBM_CHUNK_BYTES-n);
+            b = chunk;
+        }
+        cFromChunk(r,rbmInsert(r,r->count,offset/RBM_CHUNK_BYTES),b);
+    }
+    return r;
+}
+
+/* Return the bytes allocated for the bitmap, not counting the allocator
+ * overhead. */
+size_t rbmMemoryUsage(const rbm *r) {
+    return sizeof(*r)+sizeof(rbmContainer)*r->alloc+r->bytes;
+}
+
+/* ----------------------------------------------------------------------------
+ * Serialization
+ *
+ * The serialized bitmap is the 32 bit length of the string and the 32 bit
+ * number of containers, followed by the containers. Every container is the
+ * 16 bit chunk number, the 8 bit type, an unused byte, the 32 bit number of
+ * offsets (array), bits set (bitmap) or runs (run), and the data: the 16 bit
+ * offsets, the 8192 bytes of the chunk or the 16 bit first and last offsets
+ * of the runs. All the integers are little endian.
+ * ------------------------------------------------------------------------- */
+
+static unsigned char *put16(unsigned char *p, uint32_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    return p+2;
+}
+
+static unsigned char *put32(unsigned char *p, uint32_t v) {
+    p = put16(p,v & 0xffff);
+    return put16(p,v >> 16);
+}
+
+static uint32_t get16(const unsigned char *p) {
+    return p[0] | ((uint32_t)p[1] << 8);
+}
+
+static uint32_t get32(const unsigned char *p) {
+    return get16(p) | (get16(p+2) << 16);
+}
+
+static size_t cSerializedBytes(const rbmContainer *c) {
+    if (c->type == RBM_BITMAP) return RBM_CHUNK_BYTES;
+    return c->n*sizeof(uint16_t)*(c->type == RBM_RUN ? 2 : 1);
+}
+
+/* Return the serialized bitmap, allocated with zmalloc(), and set '*lenptr'
+ * to its length. */
+unsigned char *rbmSerialize(const rbm *r, size_t *lenptr) {
+    size_t len = 8;
+    unsigned char *buf, *p;
+    uint32_t j, k;
+
+    for (j = 0; j < r->count; j++) len += 8+cSerializedBytes(r->c+j);
+    p = buf = zmalloc(len);
+    p = put32(p,r->len);
+    p = put32(p,r->count);
+    for (j = 0; j < r->count; j++) {
+        const rbmContainer *c = r->c+j;
+        const uint16_t *a = c->data;
+
+        p = put16(p,c->key);
+        *p++ = c->type;
+        *p++ = 0;
+        p = put32(p,c->type == RBM_BITMAP ? c->card : c->n);
+        if (c->type == RBM_BITMAP) {
+            memcpy(p,c->data,RBM_CHUNK_BYTES);
+            p += RBM_CHUNK_BYTES;
+        } else {
+            uint32_t slots = c->type == RBM_RUN ? c->n*2 : c->n;
+            for (k = 0; k < slots; k++) p = put16(p,a[k]);
+        }
+    }
+    *lenptr = len;
+    return buf;
+}
+
+/* Load a bitmap serialized by rbmSerialize(). Return NULL if the payload is
+ * not valid: every container should be in the range of the string, with
+ * sorted offsets and disjoint runs. */
+/* 根据序列化数据加载对应的压缩位图 数据不合法时返回NULL */
+rbm *rbmDeserialize(const unsigned char *p, size_t len) {
+    const unsigned char *end = p+len;
+    uint32_t count, j, k;
+    int64_t lastkey = -1;
+    rbm *r;
+
+    if (len < 8) return NULL;
+    r = rbmNew(get32(p));
+    count = get32(p+4);
+    p += 8;
+    if (count > RBM_CHUNK_BITS) goto invalid;
+    for (j = 0; j < count; j++) {
+        uint32_t key, type, n, maxv, card = 0;
+        uint64_t maxbit;
+        rbmContainer *c;
+        uint16_t *a;
+
+        if (end-p < 8) goto invalid;
+        key = get16(p);
+        type = p[2];
+        n = get32(p+4);
+        p += 8;
+        if ((int64_t)key <= lastkey) goto invalid;
+        if ((uint64_t)key*RBM_CHUNK_BYTES >= r->len) goto invalid;
+        lastkey = key;
+        /* The last offset that can be set without going past the end. */
+        maxbit = (uint64_t)r->len*8-(uint64_t)key*RBM_CHUNK_BITS-1;
+        maxv = maxbit < RBM_CHUNK_BITS ? maxbit : RBM_CHUNK_BITS-1;
+
+        c = rbmInsert(r,r->count,key);
+        if (type == RBM_ARRAY) {
+            if (n == 0 || n > RBM_ARRAY_MAX) goto invalid;
+            if ((size_t)(end-p) < n*2) goto invalid;
+            cResize(r,c,n);
+            a = c->data;
+            for (k = 0; k < n; k++) {
+                a[k] = get16(p+k*2);
+                if (k && a[k] <= a[k-1]) goto invalid;
+            }
+            if (a[n-1] > maxv) goto invalid;
+            p += n*2;
+            c->n = card = n;
+        } else if (type == RBM_BITMAP) {
+            if (end-p < RBM_CHUNK_BYTES) goto invalid;
+            c->type = RBM_BITMAP;
+            c->data = zmalloc(RBM_CHUNK_BYTES);
+            r->bytes += RBM_CHUNK_BYTES;
+            memcpy(c->data,p,RBM_CHUNK_BYTES);
+            p += RBM_CHUNK_BYTES;
+            card = popcountBytes(c->data,RBM_CHUNK_BYTES);
+            if (card == 0 || card != n) goto invalid;
+            if (maxv < RBM_CHUNK_BITS-1 &&
+                cNextSet(c,maxv+1) != RBM_CHUNK_BITS) goto invalid;
+        } else if (type == RBM_RUN) {
+            if (n == 0 || n > RBM_CHUNK_BITS/2) goto invalid;
+            if ((size_t)(end-p) < n*4) goto invalid;
+            c->type = RBM_RUN;
+            cResize(r,c,n*2);
+            a = c->data;
+            for (k = 0; k < n; k++) {
+                a[k*2] = get16(p+k*4);
+                a[k*2+1] = get16(p+k*4+2);
+                if (a[k*2] > a[k*2+1]) goto invalid;
+                if (k && a[k*2] <= (uint32_t)a[k*2-1]+1) goto invalid;
+                card += a[k*2+1]-a[k*2]+1;
+            }
+            if (a[n*2-1] > maxv) goto invalid;
+            p += n*4;
+            c->n = n;
+        } else {
+            goto invalid;
+        }
+        c->card = card;
+    }
+    if (p != end) goto invalid;
+    return r;
+
+invalid:
+    rbmFree(r);
+    return NULL;
+}
+
+#ifdef REDIS_TEST
+#include <stdio.h>
+#include <sys/time.h>
+
+#define UNUSED(x) (void)(x)
+#define assert(_e) ((_e)?(void)0:(_assert(#_e,__FILE__,__LINE__),exit(1)))
+static void _assert(char *estr, char *file, int line) {
+    printf("\n\n=== ASSERTION FAILED ===\n");
+    printf("==> %s:%d '%s' is not true\n",file,line,estr);
+}
+
+/* Check that the bitmap represents exactly the 'len' bytes 'ref', and that
+ * the memory accounting and the containers are consistent. */
+static void rbmCheck(const rbm *r, const unsigned char *ref, size_t len) {
+    unsigned char *buf = zmalloc(len);
+    size_t bytes = 0;
+    uint32_t j;
+
+    assert(r->len == len);
+    rbmToBuffer(r,buf);
+    assert(memcmp(buf,ref,len) == 0);
+    for (j = 0; j < r->count; j++) {
+        const rbmContainer *c = r->c+j;
+        unsigned char chunk[RBM_CHUNK_BYTES];
+
+        if (j) assert(c->key > r->c[j-1].key);
+        assert(c->card > 0);
+        if (c->type == RBM_ARRAY) assert(c->n == c->card && c->n <= RBM_ARRAY_MAX);
+        cToChunk(c,chunk);
+        assert(popcountBytes(chunk,RBM_CHUNK_BYTES) == c->card);
+        bytes += cDataBytes(c);
+    }
+    assert(bytes == r->bytes);
+    zfree(buf);
+}
+
+static int refGetBit(const unsigned char *ref, uint64_t bit) {
+    return (ref[bit>>3] >> (7-(bit&7))) & 1;
+}
+
+int roaringTest(int argc, char **argv) {
+    size_t len = 1024*1024, j;
+    unsigned char *ref = zcalloc(len), *ser;
+    size_t serlen;
+    rbm *r = rbmNew(len), *d;
+    int iter;
+
+    UNUSED(argc);
+    UNUSED(argv);
+
+    printf("Random set and clear: ");
+    for (iter = 0; iter < 400000; iter++) {
+        uint64_t bit;
+        int on = rand() & 1;
+
+        /* Sparse bits everywhere, dense bits in a few chunks, and long runs
+         * of bits in another one, so that every container type is used. */
+        switch(rand() % 4) {
+        case 0: bit = ((uint64_t)rand()*rand()) % (len*8); break;
+        case 1: bit = 3*RBM_CHUNK_BITS + rand() % RBM_CHUNK_BITS; break;
+        case 2: bit = 5*RBM_CHUNK_BITS + (iter/4) % RBM_CHUNK_BITS;
+                on = (iter/4/RBM_CHUNK_BITS) % 2 == 0; break;
+        default: bit = 7*RBM_CHUNK_BITS + rand() % 8000; break;
+        }
+        assert(rbmSetBit(r,bit,on) == refGetBit(ref,bit));
+        if (on) ref[bit>>3] |= 0x80 >> (bit&7);
+        else ref[bit>>3] &= ~(0x80 >> (bit&7));
+        assert(rbmGetBit(r,bit) == on);
+        if (iter % 20000 == 0) rbmCheck(r,ref,len);
+    }
+    rbmCheck(r,ref,len);
+    printf("OK\n");
+
+    printf("BITCOUNT and BITPOS ranges: ");
+    for (iter = 0; iter < 2000; iter++) {
+        size_t start = rand() % len, end = start + rand() % (len/8);
+        uint64_t count = 0;
+        int64_t pos1 = -1, pos0 = -1;
+
+        if (end >= len) end = len-1;
+        for (j = start; j <= end; j++) {
+            count += __builtin_popcount(ref[j]);
+            if (pos1 == -1 && ref[j] != 0)
+                pos1 = j*8+__builtin_clz(ref[j])-24;
+            if (pos0 == -1 && ref[j] != 0xff)
+                pos0 = j*8+__builtin_clz(~ref[j] & 0xff)-24;
+        }
+        if (pos0 == -1) pos0 = (end+1)*8;
+        assert(rbmCount(r,start,end) == count);
+        assert(rbmBitpos(r,start,end,1) == pos1);
+        assert(rbmBitpos(r,start,end,0) == pos0);
+    }
+    printf("OK\n");
+
+    printf("Read and write bytes: ");
+    for (iter = 0; iter < 20000; iter++) {
+        unsigned char buf[64];
+        size_t offset = rand() % (len-64), count = 1 + rand() % 64;
+
+        rbmGetBytes(r,offset,buf,count);
+        assert(memcmp(buf,ref+offset,count) == 0);
+        for (j = 0; j < count; j++) buf[j] = rand() & rand();
+        rbmSetBytes(r,offset,buf,count);
+        memcpy(ref+offset,buf,count);
+    }
+    rbmCheck(r,ref,len);
+    printf("OK\n");
+
+    printf("Chunks: ");
+    {
+        unsigned char chunk[RBM_CHUNK_BYTES];
+        uint32_t key = 0, next;
+
+        while (rbmNextChunk(r,key,&next)) {
+            assert(rbmGetChunk(r,next,chunk) == 1);
+            assert(memcmp(chunk,ref+(size_t)next*RBM_CHUNK_BYTES,
+                          RBM_CHUNK_BYTES) == 0);
+            for (j = 0; j < RBM_CHUNK_BYTES; j++) chunk[j] = ~chunk[j];
+            rbmSetChunk(r,next,chunk);
+            memcpy(ref+(size_t)next*RBM_CHUNK_BYTES,chunk,RBM_CHUNK_BYTES);
+            key = next+1;
+        }
+        rbmCheck(r,ref,len);
+    }
+    printf("OK\n");
+
+    printf("Serialization and copies: ");
+    ser = rbmSerialize(r,&serlen);
+    d = rbmDeserialize(ser,serlen);
+    assert(d != NULL);
+    rbmCheck(d,ref,len);
+    rbmFree(d);
+    d = rbmDup(r);
+    rbmCheck(d,ref,len);
+    rbmFree(d);
+    d = rbmFromBuffer(ref,len);
+    rbmCheck(d,ref,len);
+    rbmFree(d);
+    for (j = 0; j < serlen; j += 1+rand()%512) {
+        assert(rbmDeserialize(ser,j) == NULL);
+    }
+    for (iter = 0; iter < 2000; iter++) {
+        unsigned char *bad = zmalloc(serlen);
+        memcpy(bad,ser,serlen);
+        bad[rand() % serlen] ^= 1 << (rand() % 8);
+        d = rbmDeserialize(bad,serlen);
+        if (d) rbmFree(d);
+        zfree(bad);
+    }
+    zfree(ser);
+    printf("OK\n");
+
+    printf("Sparse bitmap memory: ");
+    rbmFree(r);
+    r = rbmNew(0);
+    for (j = 0; j < 10000; j++)
+        rbmSetBit(r,((uint64_t)j*429497)%((uint64_t)512*1024*1024*8),1);
+    assert(r->len > 500*1024*1024);
+    assert(rbmMemoryUsage(r) < 2*1024*1024);
+    printf("OK (%zu bytes for %zu bytes)\n",rbmMemoryUsage(r),r->len);
+
+    rbmFree(r);
+    zfree(ref);
+    return 0;
+}
+#endif
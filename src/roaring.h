@@ -0,0 +1,96 @@
+/* roaring -- Compressed representation of sparse bitmaps.
+ *
+ * A string used as a bitmap is split into chunks of 65536 bits (8192 bytes),
+ * and only the chunks having at least one bit set are stored, each one in
+ * a "container" using the most compact of three representations:
+ *
+ * ARRAY:  sorted array of the 16 bit offsets of the set bits, used when
+ *         there are at most 4096 bits set.
+ * BITMAP: the 8192 bytes of the chunk, exactly as they are in the string.
+ * RUN:    sorted array of (first,last) pairs of 16 bit offsets, one for
+ *         every run of consecutive set bits.
+ *
+ * This is the scheme described by Lemire et al. in "Roaring Bitmaps:
+ * Implementation of an Optimized Software Library", 2018, adapted to the
+ * Redis bit numbering: bit 0 is the most significant bit of the first byte.
+ *
+ * The bitmap also remembers the length in bytes of the string it represents,
+ * so that it is possible to convert it back to the same string at any time:
+ * there are never bits set past such length.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __ROARING_H
+#define __ROARING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define RBM_CHUNK_BYTES 8192        /* Bytes of the string in a container. */
+
+/* 压缩位图中的一个容器 保存一个8192字节分块中被设置的位 */
+typedef struct rbmContainer {
+    uint16_t key;       /* Chunk number: high 16 bits of the bit offsets. */
+    uint8_t type;       /* RBM_ARRAY, RBM_BITMAP or RBM_RUN. */
+    uint32_t card;      /* Number of bits set, from 1 to 65536. */
+    uint32_t n;         /* Offsets of an array, or pairs of a run container. */
+    uint32_t alloc;     /* Allocated 16 bit slots of an array or run. */
+    void *data;
+} rbmContainer;
+
+/* 压缩位图的存储表示结构 */
+typedef struct rbm {
+    size_t len;         /* Length in bytes of the string represented. */
+    uint32_t count;     /* Number of containers. */
+    uint32_t alloc;     /* Allocated containers. */
+    rbmContainer *c;    /* Containers sorted by key. */
+    size_t bytes;       /* Bytes allocated for the containers data. */
+} rbm;
+
+rbm *rbmNew(size_t len);
+void rbmFree(rbm *r);
+rbm *rbmDup(const rbm *r);
+void rbmGrow(rbm *r, size_t len);
+int rbmGetBit(const rbm *r, uint64_t bit);
+int rbmSetBit(rbm *r, uint64_t bit, int on);
+uint64_t rbmCount(const rbm *r, size_t start, size_t end);
+int64_t rbmBitpos(const rbm *r, size_t start, size_t end, int bit);
+void rbmGetBytes(const rbm *r, size_t offset, unsigned char *buf, size_t count);
+void rbmSetBytes(rbm *r, size_t offset, const unsigned char *buf, size_t count);
+int rbmNextChunk(const rbm *r, uint32_t from, uint32_t *chunk);
+int rbmGetChunk(const rbm *r, uint32_t chunk, unsigned char *buf);
+void rbmSetChunk(rbm *r, uint32_t chunk, const unsigned char *buf);
+void rbmToBuffer(const rbm *r, unsigned char *buf);
+rbm *rbmFromBuffer(const unsigned char *p, size_t len);
+size_t rbmMemoryUsage(const rbm *r);
+unsigned char *rbmSerialize(const rbm *r, size_t *lenptr);
+rbm *rbmDeserialize(const unsigned char *p, size_t len);
+
+#ifdef REDIS_TEST
+int roaringTest(int argc, char *argv[]);
+#endif
+
+#endif
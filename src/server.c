@@ -245,6 +245,9 @@ struct redisCommand redisCommandTable[] = {
     {"psubscribe",psubscribeCommand,-2,"pslt",0,NULL,0,0,0,0,0},
     {"punsubscribe",punsubscribeCommand,-1,"pslt",0,NULL,0,0,0,0,0},
     {"publish",publishCommand,3,"pltF",0,NULL,0,0,0,0,0},
+    {"ssubscribe",ssubscribeCommand,-2,"pslt",0,NULL,1,-1,1,0,0},
+    {"sunsubscribe",sunsubscribeCommand,-1,"pslt",0,NULL,1,-1,1,0,0},
+    {"spublish",spublishCommand,3,"pltF",0,NULL,1,1,1,0,0},
     {"pubsub",pubsubCommand,-2,"pltR",0,NULL,0,0,0,0,0},
     {"watch",watchCommand,-2,"sF",0,NULL,1,-1,1,0,0},
     {"unwatch",unwatchCommand,1,"sF",0,NULL,0,0,0,0,0},
@@ -572,13 +575,13 @@ dictType setDictType = {
     NULL                       /* val destructor */
 };
 
-/* Sorted sets hash (note: a skiplist is used in addition to the hash table) */
+/* Sorted sets hash (note: a B+tree is used in addition to the hash table) */
 dictType zsetDictType = {
     dictSdsHash,               /* hash function */
     NULL,                      /* key dup */
     NULL,                      /* val dup */
     dictSdsKeyCompare,         /* key compare */
-    NULL,                      /* Note: SDS string shared & freed by skiplist */
+    NULL,                      /* Note: SDS string shared & freed by B+tree */
     NULL                       /* val destructor */
 };
 
@@ -622,7 +625,7 @@ dictType commandTableDictType = {
     NULL                        /* val destructor */
 };
 
-/* Hash type hash table (note that small hashes are represented with ziplists) */
+/* Hash type hash table (note that small hashes are represented with listpacks) */
 dictType hashDictType = {
     dictSdsHash,                /* hash function */
     NULL,                       /* key dup */
@@ -715,8 +718,7 @@ int htNeedsResize(dict *dict) {
 /* If the percentage of used slots in the HT reaches HASHTABLE_MIN_FILL
  * we resize the hash table to save memory */
 void tryResizeHashTables(int dbid) {
-    if (htNeedsResize(server.db[dbid].dict))
-        dictResize(server.db[dbid].dict);
+    dbTryResizeDicts(&server.db[dbid]);
     if (htNeedsResize(server.db[dbid].expires))
         dictResize(server.db[dbid].expires);
 }
@@ -730,10 +732,8 @@ void tryResizeHashTables(int dbid) {
  * is returned. */
 int incrementallyRehash(int dbid) {
     /* Keys dictionary */
-    if (dictIsRehashing(server.db[dbid].dict)) {
-        dictRehashMilliseconds(server.db[dbid].dict,1);
+    if (dbIncrementallyRehash(&server.db[dbid]))
         return 1; /* already used our millisecond for this loop... */
-    }
     /* Expires */
     if (dictIsRehashing(server.db[dbid].expires)) {
         dictRehashMilliseconds(server.db[dbid].expires,1);
@@ -1176,8 +1176,8 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
         for (j = 0; j < server.dbnum; j++) {
             long long size, used, vkeys;
 
-            size = dictSlots(server.db[j].dict);
-            used = dictSize(server.db[j].dict);
+            size = dbBuckets(&server.db[j]);
+            used = dbSize(&server.db[j]);
             vkeys = dictSize(server.db[j].expires);
             if (used || vkeys) {
                 serverLog(LL_VERBOSE,"DB %d: %lld keys (%lld volatile) in %lld slots HT.",j,used,vkeys,size);
@@ -1388,6 +1388,9 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
      * blocking commands. */
     moduleHandleBlockedClients();
 
+    /* Serve the clients whose set operation was computed in background. */
+    setopsHandleCompletedJobs();
+
     /* Try to process pending commands for clients that were just unblocked. */
     if (listLength(server.unblocked_clients))
         processUnblockedClients();
@@ -1449,6 +1452,7 @@ void createSharedObjects(void) {
     shared.execaborterr = createObject(OBJ_STRING,sdsnew("-EXECABORT Transaction discarded because of previous errors.\r\n"));
     shared.noreplicaserr = createObject(OBJ_STRING,sdsnew("-NOREPLICAS Not enough good replicas to write.\r\n"));
     shared.busykeyerr = createObject(OBJ_STRING,sdsnew("-BUSYKEY Target key name already exists.\r\n"));
+    shared.migratingkeyerr = createObject(OBJ_STRING,sdsnew("-TRYAGAIN Key is being migrated, please try again later\r\n"));
     shared.space = createObject(OBJ_STRING,sdsnew(" "));
     shared.colon = createObject(OBJ_STRING,sdsnew(":"));
     shared.plus = createObject(OBJ_STRING,sdsnew("+"));
@@ -1470,6 +1474,9 @@ void createSharedObjects(void) {
     shared.unsubscribebulk = createStringObject("$11\r\nunsubscribe\r\n",18);
     shared.psubscribebulk = createStringObject("$10\r\npsubscribe\r\n",17);
     shared.punsubscribebulk = createStringObject("$12\r\npunsubscribe\r\n",19);
+    shared.smessagebulk = createStringObject("$8\r\nsmessage\r\n",14);
+    shared.ssubscribebulk = createStringObject("$10\r\nssubscribe\r\n",17);
+    shared.sunsubscribebulk = createStringObject("$12\r\nsunsubscribe\r\n",19);
 
 	//创建常用的命令字符串对象
     shared.del = createStringObject("DEL",3);
@@ -1592,12 +1599,16 @@ void initServerConfig(void) {
     server.hash_max_ziplist_value = OBJ_HASH_MAX_ZIPLIST_VALUE;
     server.list_max_ziplist_size = OBJ_LIST_MAX_ZIPLIST_SIZE;
     server.list_compress_depth = OBJ_LIST_COMPRESS_DEPTH;
+    server.list_compress_codec = OBJ_LIST_COMPRESS_CODEC;
     server.set_max_intset_entries = OBJ_SET_MAX_INTSET_ENTRIES;
     server.zset_max_ziplist_entries = OBJ_ZSET_MAX_ZIPLIST_ENTRIES;
     server.zset_max_ziplist_value = OBJ_ZSET_MAX_ZIPLIST_VALUE;
     server.hll_sparse_max_bytes = CONFIG_DEFAULT_HLL_SPARSE_MAX_BYTES;
+    server.shortest_double_format = CONFIG_DEFAULT_SHORTEST_DOUBLE_FORMAT;
+    server.bitmap_compress_min_bytes = CONFIG_DEFAULT_BITMAP_COMPRESS_MIN_BYTES;
     server.stream_node_max_bytes = OBJ_STREAM_NODE_MAX_BYTES;
     server.stream_node_max_entries = OBJ_STREAM_NODE_MAX_ENTRIES;
+    server.stream_node_compact_percent = OBJ_STREAM_NODE_COMPACT_PERCENT;
     server.shutdown_asap = 0;
     server.cluster_enabled = 0;
     server.cluster_node_timeout = CLUSTER_DEFAULT_NODE_TIMEOUT;
@@ -1605,6 +1616,7 @@ void initServerConfig(void) {
     server.cluster_slave_validity_factor = CLUSTER_DEFAULT_SLAVE_VALIDITY;
     server.cluster_require_full_coverage = CLUSTER_DEFAULT_REQUIRE_FULL_COVERAGE;
     server.cluster_slave_no_failover = CLUSTER_DEFAULT_SLAVE_NO_FAILOVER;
+    server.cluster_compact_messages = CLUSTER_DEFAULT_COMPACT_MESSAGES;
     server.cluster_configfile = zstrdup(CONFIG_DEFAULT_CLUSTER_CONFIG_FILE);
     server.cluster_announce_ip = CONFIG_DEFAULT_CLUSTER_ANNOUNCE_IP;
     server.cluster_announce_port = CONFIG_DEFAULT_CLUSTER_ANNOUNCE_PORT;
@@ -1616,6 +1628,8 @@ void initServerConfig(void) {
     server.lazyfree_lazy_eviction = CONFIG_DEFAULT_LAZYFREE_LAZY_EVICTION;
     server.lazyfree_lazy_expire = CONFIG_DEFAULT_LAZYFREE_LAZY_EXPIRE;
     server.lazyfree_lazy_server_del = CONFIG_DEFAULT_LAZYFREE_LAZY_SERVER_DEL;
+    server.setops_offload_threshold = CONFIG_DEFAULT_SETOPS_OFFLOAD_THRESHOLD;
+    server.setops_debug_delay = 0;
     server.always_show_logo = CONFIG_DEFAULT_ALWAYS_SHOW_LOGO;
     server.lua_time_limit = LUA_SCRIPT_TIME_LIMIT;
 
@@ -1981,6 +1995,10 @@ void resetServerStats(void) {
     server.stat_active_defrag_key_hits = 0;
     server.stat_active_defrag_key_misses = 0;
     server.stat_active_defrag_scanned = 0;
+    server.stat_setops_offloaded = 0;
+    server.stat_setops_recomputed = 0;
+    server.stat_stream_nodes_compacted = 0;
+    server.stat_stream_compacted_bytes = 0;
     server.stat_fork_time = 0;
     server.stat_fork_rate = 0;
     server.stat_rejected_conn = 0;
@@ -2065,17 +2083,20 @@ void initServer(void) {
 
     /* Create the Redis databases, and initialize other internal state. */
     for (j = 0; j < server.dbnum; j++) {
-        server.db[j].dict = dictCreate(&dbDictType,NULL);
+        dbCreateDicts(&server.db[j],
+            (server.cluster_enabled && j == 0) ? CLUSTER_SLOTS : 1);
         server.db[j].expires = dictCreate(&keyptrDictType,NULL);
         server.db[j].blocking_keys = dictCreate(&keylistDictType,NULL);
         server.db[j].ready_keys = dictCreate(&objectKeyPointerValueDictType,NULL);
         server.db[j].watched_keys = dictCreate(&keylistDictType,NULL);
+        server.db[j].migrating_keys = dictCreate(&objectKeyPointerValueDictType,NULL);
         server.db[j].id = j;
         server.db[j].avg_ttl = 0;
         server.db[j].defrag_later = listCreate();
     }
     evictionPoolAlloc(); /* Initialize the LRU keys pool. */
     server.pubsub_channels = dictCreate(&keylistDictType,NULL);
+    server.pubsubshard_channels = dictCreate(&keylistDictType,NULL);
     server.pubsub_patterns = listCreate();
     listSetFreeMethod(server.pubsub_patterns,freePubsubPattern);
     listSetMatchMethod(server.pubsub_patterns,listMatchPubsubPattern);
@@ -2139,6 +2160,9 @@ void initServer(void) {
                 "blocked clients subsystem.");
     }
 
+    /* Set operations computed in background. */
+    setopsInit();
+
     /* Open the AOF file if needed. */
     if (server.aof_state == AOF_ON) {
         server.aof_fd = open(server.aof_filename,
@@ -2443,6 +2467,8 @@ void call(client *c, int flags) {
     ustime_t start, duration;
     int client_old_flags = c->flags;
     struct redisCommand *real_cmd = c->cmd;
+    int slot = -1;
+    size_t bytes_in = 0, bytes_out = 0;
 
     server.fixed_time_expire++;
 
@@ -2461,6 +2487,18 @@ void call(client *c, int flags) {
     redisOpArray prev_also_propagate = server.also_propagate;
     redisOpArrayInit(&server.also_propagate);
 
+    /* In cluster mode account the resources used by the command to the
+     * slot of its keys. Commands called by scripts are accounted as part of
+     * the EVAL caller. EXEC itself is not accounted: every command of the
+     * transaction is accounted on its own, to the slot of its keys. */
+    if (server.cluster_enabled && flags & CMD_CALL_STATS &&
+        !(c->flags & CLIENT_LUA) && c->cmd->proc != execCommand &&
+        (slot = clusterSlotStatsGetSlot(c)) != -1)
+    {
+        bytes_in = commandProtoLen(c->argv,c->argc);
+        bytes_out = c->net_output_bytes;
+    }
+
     /* Call the command. */
     dirty = server.dirty;
     updateCachedTime(0);
@@ -2475,6 +2513,13 @@ void call(client *c, int flags) {
     if (server.loading && c->flags & CLIENT_LUA)
         flags &= ~(CMD_CALL_SLOWLOG | CMD_CALL_STATS);
 
+    /* A set operation computed in background is accounted only once, when
+     * it is called again with the result, see setops.c. */
+    if (c->flags & CLIENT_BLOCKED && c->btype == BLOCKED_SETOPS) {
+        flags &= ~(CMD_CALL_SLOWLOG | CMD_CALL_STATS);
+        slot = -1;
+    }
+
     /* If the caller is Lua, we want to force the EVAL caller to propagate
      * the script if the command flag or client flag are forcing the
      * propagation. */
@@ -2500,6 +2545,10 @@ void call(client *c, int flags) {
         real_cmd->microseconds += duration;
         real_cmd->calls++;
     }
+    if (slot != -1) {
+        clusterSlotStatsAddCommand(slot,duration,bytes_in,
+                                   c->net_output_bytes-bytes_out);
+    }
 
     /* Propagate the command into the AOF and replication link */
     if (flags & CMD_CALL_PROPAGATE &&
@@ -2625,7 +2674,7 @@ int processCommand(client *c) {
         !(c->cmd->getkeys_proc == NULL && c->cmd->firstkey == 0 &&
           c->cmd->proc != execCommand))
     {
-        int hashslot;
+        int hashslot = -1;
         int error_code;
         clusterNode *n = getNodeByQuery(c,c->cmd,c->argv,c->argc,
                                         &hashslot,&error_code);
@@ -2638,6 +2687,18 @@ int processCommand(client *c) {
             clusterRedirectClient(c,n,hashslot,error_code);
             return C_OK;
         }
+        c->slot = hashslot;
+    }
+
+    /* Writes against keys that an asynchronous MIGRATE is transferring are
+     * refused: the keys are going to be deleted once the target acknowledges
+     * them. This is checked before executing anything, so that a MULTI
+     * block is refused as a whole (EXEC checks again the queued commands)
+     * and a script can't fail after performing some of its writes. */
+    if (migrateKeysAreLocked(c->db,c->cmd,c->argv,c->argc)) {
+        flagTransaction(c);
+        addReply(c,shared.migratingkeyerr);
+        return C_OK;
     }
 
     /* Handle the maxmemory directive.
@@ -2712,8 +2773,10 @@ int processCommand(client *c) {
         c->cmd->proc != subscribeCommand &&
         c->cmd->proc != unsubscribeCommand &&
         c->cmd->proc != psubscribeCommand &&
-        c->cmd->proc != punsubscribeCommand) {
-        addReplyError(c,"only (P)SUBSCRIBE / (P)UNSUBSCRIBE / PING / QUIT allowed in this context");
+        c->cmd->proc != punsubscribeCommand &&
+        c->cmd->proc != ssubscribeCommand &&
+        c->cmd->proc != sunsubscribeCommand) {
+        addReplyError(c,"only (P|S)SUBSCRIBE / (P|S)UNSUBSCRIBE / PING / QUIT allowed in this context");
         return C_OK;
     }
 
@@ -3286,6 +3349,7 @@ sds genRedisInfoString(char *section) {
             "mem_clients_slaves:%zu\r\n"
             "mem_clients_normal:%zu\r\n"
             "mem_aof_buffer:%zu\r\n"
+            "mem_quicklist_node_cache:%zu\r\n"
             "mem_allocator:%s\r\n"
             "active_defrag_running:%d\r\n"
             "lazyfree_pending_objects:%zu\r\n",
@@ -3326,6 +3390,7 @@ sds genRedisInfoString(char *section) {
             mh->clients_slaves,
             mh->clients_normal,
             mh->aof_buffer,
+            mh->quicklist_node_cache,
             ZMALLOC_LIB,
             server.active_defrag_running,
             lazyfreeGetPendingObjectsCount()
@@ -3447,13 +3512,18 @@ sds genRedisInfoString(char *section) {
             "keyspace_misses:%lld\r\n"
             "pubsub_channels:%ld\r\n"
             "pubsub_patterns:%lu\r\n"
+            "pubsubshard_channels:%lu\r\n"
             "latest_fork_usec:%lld\r\n"
             "migrate_cached_sockets:%ld\r\n"
             "slave_expires_tracked_keys:%zu\r\n"
             "active_defrag_hits:%lld\r\n"
             "active_defrag_misses:%lld\r\n"
             "active_defrag_key_hits:%lld\r\n"
-            "active_defrag_key_misses:%lld\r\n",
+            "active_defrag_key_misses:%lld\r\n"
+            "setops_offloaded:%lld\r\n"
+            "setops_recomputed:%lld\r\n"
+            "stream_nodes_compacted:%lld\r\n"
+            "stream_compacted_bytes:%lld\r\n",
             server.stat_numconnections,
             server.stat_numcommands,
             getInstantaneousMetric(STATS_METRIC_COMMAND),
@@ -3473,13 +3543,18 @@ sds genRedisInfoString(char *section) {
             server.stat_keyspace_misses,
             dictSize(server.pubsub_channels),
             listLength(server.pubsub_patterns),
+            dictSize(server.pubsubshard_channels),
             server.stat_fork_time,
             dictSize(server.migrate_cached_sockets),
             getSlaveKeyWithExpireCount(),
             server.stat_active_defrag_hits,
             server.stat_active_defrag_misses,
             server.stat_active_defrag_key_hits,
-            server.stat_active_defrag_key_misses);
+            server.stat_active_defrag_key_misses,
+            server.stat_setops_offloaded,
+            server.stat_setops_recomputed,
+            server.stat_stream_nodes_compacted,
+            server.stat_stream_compacted_bytes);
     }
 
     /* Replication */
@@ -3661,7 +3736,7 @@ sds genRedisInfoString(char *section) {
         for (j = 0; j < server.dbnum; j++) {
             long long keys, vkeys;
 
-            keys = dictSize(server.db[j].dict);
+            keys = dbSize(&server.db[j]);
             vkeys = dictSize(server.db[j].expires);
             if (keys || vkeys) {
                 info = sdscatprintf(info,
@@ -4069,6 +4144,12 @@ int main(int argc, char **argv) {
             return crc64Test(argc, argv);
         } else if (!strcasecmp(argv[2], "zmalloc")) {
             return zmalloc_test(argc, argv);
+        } else if (!strcasecmp(argv[2], "fastfloat")) {
+            return fastfloatTest(argc, argv);
+        } else if (!strcasecmp(argv[2], "roaring")) {
+            return roaringTest(argc, argv);
+        } else if (!strcasecmp(argv[2], "bitops")) {
+            return bitopsTest(argc, argv);
         }
         return -1; /* test not found */
     }
@@ -34,9 +34,12 @@ typedef long long ustime_t; /* microsecond time type. */
 #include "zmalloc.h" /* total memory usage aware version of malloc/free */
 #include "anet.h"    /* Networking the easy way */
 #include "ziplist.h" /* Compact list data structure */
+#include "listpack.h" /* Compact list data structure, for hashes and zsets */
 #include "intset.h"  /* Compact integer set structure */
+#include "roaring.h" /* Compressed bitmaps */
 #include "version.h" /* Version macro */
 #include "util.h"    /* Misc functions useful in many places */
+#include "fastfloat.h" /* Fast string to double conversion */
 #include "latency.h" /* Latency monitor API */
 #include "sparkline.h" /* ASCII graphs API */
 #include "quicklist.h"  /* Lists are encoded as linked lists of
@@ -134,6 +137,7 @@ typedef long long ustime_t; /* microsecond time type. */
 #define CONFIG_DEFAULT_LAZYFREE_LAZY_EVICTION 0
 #define CONFIG_DEFAULT_LAZYFREE_LAZY_EXPIRE 0
 #define CONFIG_DEFAULT_LAZYFREE_LAZY_SERVER_DEL 0
+#define CONFIG_DEFAULT_SETOPS_OFFLOAD_THRESHOLD 1000000
 #define CONFIG_DEFAULT_ALWAYS_SHOW_LOGO 0
 #define CONFIG_DEFAULT_ACTIVE_DEFRAG 0
 #define CONFIG_DEFAULT_DEFRAG_THRESHOLD_LOWER 10 /* don't defrag when fragmentation is below 10% */
@@ -161,6 +165,7 @@ typedef long long ustime_t; /* microsecond time type. */
 #define PROTO_MAX_QUERYBUF_LEN  (1024*1024*1024) /* 1GB max query buffer. */
 #define PROTO_IOBUF_LEN         (1024*16)  /* Generic I/O buffer size */
 #define PROTO_REPLY_CHUNK_BYTES (16*1024) /* 16k output buffer */
+#define PROTO_SHARED_REPLY_MIN_BYTES 1024 /* Smaller shared replies are copied */
 #define PROTO_INLINE_MAX_SIZE   (1024*64) /* Max size of inline reads */
 #define PROTO_MBULK_BIG_ARG     (1024*32)
 #define LONG_STR_SIZE      21          /* Bytes needed for long -> str + '\0' */
@@ -245,7 +250,9 @@ typedef long long ustime_t; /* microsecond time type. */
 #define BLOCKED_MODULE 3  /* Blocked by a loadable module. */
 #define BLOCKED_STREAM 4  /* XREAD. */
 #define BLOCKED_ZSET 5    /* BZPOP et al. */
-#define BLOCKED_NUM 6     /* Number of blocked states. */
+#define BLOCKED_MIGRATE 6 /* Asynchronous MIGRATE. */
+#define BLOCKED_SETOPS 7  /* SUNION & co. computed in background. */
+#define BLOCKED_NUM 8     /* Number of blocked states. */
 
 /* Client request types */
 #define PROTO_REQ_INLINE 1
@@ -325,8 +332,9 @@ typedef long long ustime_t; /* microsecond time type. */
 /* Anti-warning macro... */
 #define UNUSED(V) ((void) V)
 
-#define ZSKIPLIST_MAXLEVEL 64 /* Should be enough for 2^64 elements */
-#define ZSKIPLIST_P 0.25      /* Skiplist P = 1/4 */
+#define ZBTREE_LEAF_ENTRIES 62 /* Max (score,element) pairs in a leaf. */
+#define ZBTREE_FANOUT 31       /* Max children of an inner node. */
+#define ZBTREE_MAXHEIGHT 16    /* Way more than enough for 2^64 elements. */
 
 /* Append only defines */
 #define AOF_FSYNC_NO 0
@@ -342,13 +350,17 @@ typedef long long ustime_t; /* microsecond time type. */
 #define OBJ_ZSET_MAX_ZIPLIST_VALUE 64
 #define OBJ_STREAM_NODE_MAX_BYTES 4096
 #define OBJ_STREAM_NODE_MAX_ENTRIES 100
+#define OBJ_STREAM_NODE_COMPACT_PERCENT 50
 
 /* List defaults */
 #define OBJ_LIST_MAX_ZIPLIST_SIZE -2
 #define OBJ_LIST_COMPRESS_DEPTH 0
+#define OBJ_LIST_COMPRESS_CODEC QUICKLIST_NODE_ENCODING_LZF
 
 /* HyperLogLog defines */
 #define CONFIG_DEFAULT_HLL_SPARSE_MAX_BYTES 3000
+#define CONFIG_DEFAULT_SHORTEST_DOUBLE_FORMAT 1
+#define CONFIG_DEFAULT_BITMAP_COMPRESS_MIN_BYTES 4096
 
 /* Sets operations codes */
 #define SET_OP_UNION 0
@@ -578,10 +590,13 @@ typedef struct RedisModuleDigest {
 #define OBJ_ENCODING_LINKEDLIST 4 /* No longer used: old list encoding. */
 #define OBJ_ENCODING_ZIPLIST 5 /* Encoded as ziplist */
 #define OBJ_ENCODING_INTSET 6  /* Encoded as intset */
-#define OBJ_ENCODING_SKIPLIST 7  /* Encoded as skiplist */
+#define OBJ_ENCODING_SKIPLIST 7  /* No longer used: old zset encoding. */
 #define OBJ_ENCODING_EMBSTR 8  /* Embedded sds string encoding */
 #define OBJ_ENCODING_QUICKLIST 9 /* Encoded as linked list of ziplists */
 #define OBJ_ENCODING_STREAM 10 /* Encoded as a radix tree of listpacks */
+#define OBJ_ENCODING_LISTPACK 11 /* Encoded as a listpack */
+#define OBJ_ENCODING_BTREE 12 /* Encoded as B+tree + hash table */
+#define OBJ_ENCODING_ROARING 13 /* Encoded as compressed bitmap */
 
 #define LRU_BITS 24
 #define LRU_CLOCK_MAX ((1<<LRU_BITS)-1) /* Max value of obj->lru */
@@ -613,9 +628,14 @@ typedef struct redisObject {
 struct evictionPoolEntry; /* Defined in evict.c */
 
 /* This structure is used in order to represent the output buffer of a client,
- * which is actually a linked list of blocks like that, that is: client->reply. */
+ * which is actually a linked list of blocks like that, that is: client->reply.
+ *
+ * A block may be shared by the output buffers of many clients when the same
+ * reply is sent to all of them (see addReplyShared()): in that case refcount
+ * is greater than one and size == used, so nothing is ever appended to it. */
 typedef struct clientReplyBlock {
     size_t size, used;
+    int refcount;
     char buf[];
 } clientReplyBlock;
 
@@ -623,11 +643,19 @@ typedef struct clientReplyBlock {
  * by integers from 0 (the default database) up to the max configured
  * database. The database number is the 'id' field in the structure. */
 typedef struct redisDb {
-    dict *dict;                 /* The keyspace for this DB */
+    dict **dict;                /* The keyspace for this DB. In cluster mode
+                                   DB 0 is split into one dict per hash slot,
+                                   otherwise there is a single dict. */
+    int dict_count;             /* Number of dicts in the 'dict' array. */
+    unsigned long long *slot_sizes; /* Binary indexed tree of the number of
+                                       keys in every dict, used for random
+                                       sampling across slots. NULL when
+                                       dict_count is 1. */
     dict *expires;              /* Timeout of keys with a timeout set */
     dict *blocking_keys;        /* Keys with clients waiting for data (BLPOP)*/
     dict *ready_keys;           /* Blocked keys that received a PUSH */
     dict *watched_keys;         /* WATCHED keys for MULTI/EXEC CAS */
+    dict *migrating_keys;       /* Keys locked by an asynchronous MIGRATE */
     int id;                     /* Database ID */
     long long avg_ttl;          /* Average TTL, just for stats */
     list *defrag_later;         /* List of key names to attempt to defrag one by one, gradually. */
@@ -670,6 +698,12 @@ typedef struct blockingState {
 
     /* BLOCKED_MODULE */
     void *module_blocked_handle; /* RedisModuleBlockedClient structure. which is opaque for the Redis core, only handled in module.c. */
+
+    /* BLOCKED_MIGRATE */
+    void *migrate_job;      /* migrateJob structure, only handled in cluster.c. */
+
+    /* BLOCKED_SETOPS */
+    struct setopsJob *setops_job; /* Background set operation, see setops.c. */
 } blockingState;
 
 /* The following structure represents a node in the server.ready_keys list,
@@ -705,11 +739,14 @@ typedef struct client {
     int argc;               /* Num of arguments of current command. */
     robj **argv;            /* Arguments of current command. */
     struct redisCommand *cmd, *lastcmd;  /* Last command executed. */
+    int slot;               /* Cluster hash slot of the current command keys,
+                               or -1 if not known. */
     int reqtype;            /* Request protocol type: PROTO_REQ_* */
     int multibulklen;       /* Number of multi bulk arguments left to read. */
     long bulklen;           /* Length of bulk argument in multi bulk request. */
     list *reply;            /* List of reply objects to send to the client. */
     unsigned long long reply_bytes; /* Tot bytes of objects in reply list. */
+    unsigned long long net_output_bytes; /* Tot bytes of replies produced. */
     size_t sentlen;         /* Amount of bytes already sent in the current
                                buffer or object being sent. */
     time_t ctime;           /* Client creation time. */
@@ -742,6 +779,7 @@ typedef struct client {
     list *watched_keys;     /* Keys WATCHED for MULTI/EXEC CAS */
     dict *pubsub_channels;  /* channels a client is interested in (SUBSCRIBE) */
     list *pubsub_patterns;  /* patterns a client is interested in (SUBSCRIBE) */
+    dict *pubsubshard_channels; /* shard channels a client is interested in (SSUBSCRIBE) */
     sds peerid;             /* Cached peer ID. */
     listNode *client_list_node; /* list node in client list */
 
@@ -767,8 +805,9 @@ struct sharedObjectsStruct {
     *emptymultibulk, *wrongtypeerr, *nokeyerr, *syntaxerr, *sameobjecterr,
     *outofrangeerr, *noscripterr, *loadingerr, *slowscripterr, *bgsaveerr,
     *masterdownerr, *roslaveerr, *execaborterr, *noautherr, *noreplicaserr,
-    *busykeyerr, *oomerr, *plus, *messagebulk, *pmessagebulk, *subscribebulk,
-    *unsubscribebulk, *psubscribebulk, *punsubscribebulk, *del, *unlink,
+    *busykeyerr, *migratingkeyerr, *oomerr, *plus, *messagebulk, *pmessagebulk, *subscribebulk,
+    *unsubscribebulk, *psubscribebulk, *punsubscribebulk, *smessagebulk,
+    *ssubscribebulk, *sunsubscribebulk, *del, *unlink,
     *rpop, *lpop, *lpush, *rpoplpush, *zpopmin, *zpopmax, *emptyscan,
     *select[PROTO_SHARED_SELECT_CMDS],
     *integers[OBJ_SHARED_INTEGERS],
@@ -777,26 +816,49 @@ struct sharedObjectsStruct {
     sds minstring, maxstring;
 };
 
-/* ZSETs use a specialized version of Skiplists */
-typedef struct zskiplistNode {
-    sds ele;
+/* ZSETs use a specialized version of B+trees: the (score,element) pairs are
+ * stored ordered into arrays, the leaves, that are linked together. The inner
+ * nodes remember how many elements every child subtree holds, in order to
+ * compute ranks. See t_zset.c for more information. */
+typedef struct zbtEntry {
     double score;
-    struct zskiplistNode *backward;
-    struct zskiplistLevel {
-        struct zskiplistNode *forward;
-        unsigned long span;
-    } level[];
-} zskiplistNode;
-
-typedef struct zskiplist {
-    struct zskiplistNode *header, *tail;
+    sds ele;
+} zbtEntry;
+
+typedef struct zbtLeaf {
+    struct zbtLeaf *prev, *next;
+    unsigned int count;
+    zbtEntry entries[ZBTREE_LEAF_ENTRIES];
+} zbtLeaf;
+
+typedef struct zbtInner {
+    unsigned int count;                   /* Number of children. */
+    zbtEntry keys[ZBTREE_FANOUT];         /* keys[i] <= elements of child i.
+                                             keys[0] is not used. */
+    unsigned long sizes[ZBTREE_FANOUT];   /* Elements in every child. */
+    void *children[ZBTREE_FANOUT];        /* zbtInner, or zbtLeaf at the
+                                             last level. */
+} zbtInner;
+
+typedef struct zbtree {
+    void *root;
+    zbtLeaf *head, *tail;
     unsigned long length;
-    int level;
-} zskiplist;
+    int height;                 /* 1 when the root is a leaf. */
+} zbtree;
+
+/* An element of the tree: entry 'idx' of 'leaf', or no element if 'leaf'
+ * is NULL. Valid only until the tree is modified. */
+typedef struct zbtPos {
+    zbtLeaf *leaf;
+    unsigned int idx;
+} zbtPos;
+
+#define zbtPosEntry(p) (&(p)->leaf->entries[(p)->idx])
 
 typedef struct zset {
-    dict *dict;
-    zskiplist *zsl;
+    dict *dict;                 /* Element -> score. */
+    zbtree *zbt;
 } zset;
 
 typedef struct clientBufferLimitsConfig {
@@ -842,6 +904,7 @@ struct redisMemOverhead {
     size_t clients_normal;
     size_t aof_buffer;
     size_t lua_caches;
+    size_t quicklist_node_cache;
     size_t overhead_total;
     size_t dataset;
     size_t total_keys;
@@ -993,6 +1056,10 @@ struct redisServer {
     long long stat_active_defrag_key_hits;  /* number of keys with moved allocations */
     long long stat_active_defrag_key_misses;/* number of keys scanned and not moved */
     long long stat_active_defrag_scanned;   /* number of dictEntries scanned */
+    long long stat_setops_offloaded;  /* Set operations computed in background */
+    long long stat_setops_recomputed; /* ... computed again: sources modified */
+    long long stat_stream_nodes_compacted; /* Stream nodes rewritten by XDEL */
+    long long stat_stream_compacted_bytes; /* ... and bytes reclaimed. */
     size_t stat_peak_memory;        /* Max used memory record */
 	//用于统计执行一次fork操作需要的时间值
     long long stat_fork_time;       /* Time needed to perform latest fork() */
@@ -1202,9 +1269,13 @@ struct redisServer {
     size_t hll_sparse_max_bytes;
     size_t stream_node_max_bytes;
     int64_t stream_node_max_entries;
+    int stream_node_compact_percent; /* Compact nodes with more deleted. */
+    int shortest_double_format; /* Reply doubles with the shortest digits. */
+    size_t bitmap_compress_min_bytes; /* Compress longer bitmaps. */
     /* List parameters */
     int list_max_ziplist_size;
     int list_compress_depth;
+    int list_compress_codec;    /* QUICKLIST_NODE_ENCODING_LZF or _LZ4. */
     /* time cache */
     time_t unixtime;    /* Unix time sampled every cron cycle. */
     time_t timezone;    /* Cached timezone. As set by tzset(). */
@@ -1214,6 +1285,7 @@ struct redisServer {
     /* Pubsub */
     dict *pubsub_channels;  /* Map channels to list of subscribed clients */
     list *pubsub_patterns;  /* A list of pubsub_patterns */
+    dict *pubsubshard_channels; /* Map shard channels to list of subscribed clients */
     int notify_keyspace_events; /* Events to propagate via Pub/Sub. This is an
                                    xor of NOTIFY_... flags. */
     /* Cluster */
@@ -1227,6 +1299,8 @@ struct redisServer {
                                           there is at least an uncovered slot.*/
     int cluster_slave_no_failover;  /* Prevent slave from starting a failover
                                        if the master is in failure state. */
+    int cluster_compact_messages;   /* Omit the slots bitmap from bus messages
+                                       when possible. */
     char *cluster_announce_ip;  /* IP address to announce on cluster bus. */
     int cluster_announce_port;     /* base port to announce on cluster bus. */
     int cluster_announce_bus_port; /* bus port to announce on cluster bus. */
@@ -1258,6 +1332,9 @@ struct redisServer {
     int lazyfree_lazy_eviction;
     int lazyfree_lazy_expire;    //redis服务 进行同步删除或者异步删除过期键的配置标识
     int lazyfree_lazy_server_del;
+    /* Set operations in background */
+    long long setops_offload_threshold; /* Min input size, 0 = disabled. */
+    mstime_t setops_debug_delay;    /* DEBUG SETOPS-DELAY, for tests. */
     /* Latency monitor */
     long long latency_monitor_threshold;
     dict *latency_events;
@@ -1414,6 +1491,9 @@ void getRandomBytes(unsigned char *p, size_t len);
 uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l);
 void exitFromChild(int retcode);
 size_t redisPopcount(void *s, long count);
+#ifdef REDIS_TEST
+int bitopsTest(int argc, char *argv[]);
+#endif
 void redisSetProcTitle(char *title);
 
 /* networking.c -- Networking and Client related operations */
@@ -1433,6 +1513,10 @@ void acceptUnixHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask);
 void addReplyString(client *c, const char *s, size_t len);
 void AddReplyFromClient(client *c, client *src);
+client *startSharedReply(void);
+clientReplyBlock *endSharedReply(void);
+void addReplyShared(client *c, clientReplyBlock *reply);
+void releaseSharedReply(clientReplyBlock *reply);
 void addReplyBulk(client *c, robj *obj);
 void addReplyBulkCString(client *c, const char *s);
 void addReplyBulkCBuffer(client *c, const void *p, size_t len);
@@ -1448,6 +1532,7 @@ void addReplyLongLong(client *c, long long ll);
 void addReplyMultiBulkLen(client *c, long length);
 void addReplyHelp(client *c, const char **help);
 void addReplySubcommandSyntaxError(client *c);
+size_t commandProtoLen(robj **argv, int argc);
 void copyClientOutputBuffer(client *dst, client *src);
 size_t sdsZmallocSize(sds s);
 size_t getStringObjectSdsUsedMemory(robj *o);
@@ -1532,6 +1617,7 @@ void freeHashObject(robj *o);
 robj *createObject(int type, void *ptr);
 robj *createStringObject(const char *ptr, size_t len);
 robj *createRawStringObject(const char *ptr, size_t len);
+robj *createRoaringStringObject(rbm *r);
 robj *createEmbeddedStringObject(const char *ptr, size_t len);
 robj *dupStringObject(const robj *o);
 int isSdsRepresentableAsLongLong(sds s, long long *llval);
@@ -1548,7 +1634,7 @@ robj *createSetObject(void);
 robj *createIntsetObject(void);
 robj *createHashObject(void);
 robj *createZsetObject(void);
-robj *createZsetZiplistObject(void);
+robj *createZsetListpackObject(void);
 robj *createStreamObject(void);
 robj *createModuleObject(moduleType *mt, void *value);
 int getLongFromObjectOrReply(client *c, robj *o, long *target, const char *msg);
@@ -1667,13 +1753,20 @@ typedef struct {
     int minex, maxex; /* are min or max exclusive? */
 } zlexrangespec;
 
-zskiplist *zslCreate(void);
-void zslFree(zskiplist *zsl);
-zskiplistNode *zslInsert(zskiplist *zsl, double score, sds ele);
+zbtree *zbtCreate(void);
+void zbtFree(zbtree *zbt);
+void zbtInsert(zbtree *zbt, double score, sds ele);
 unsigned char *zzlInsert(unsigned char *zl, sds ele, double score);
-int zslDelete(zskiplist *zsl, double score, sds ele, zskiplistNode **node);
-zskiplistNode *zslFirstInRange(zskiplist *zsl, zrangespec *range);
-zskiplistNode *zslLastInRange(zskiplist *zsl, zrangespec *range);
+int zbtDelete(zbtree *zbt, double score, sds ele, sds *deleted);
+void zbtUpdateScore(zbtree *zbt, double curscore, sds ele, double newscore);
+zbtEntry *zbtFind(zbtree *zbt, double score, sds ele);
+int zbtFirst(zbtree *zbt, zbtPos *pos);
+int zbtLast(zbtree *zbt, zbtPos *pos);
+int zbtNext(zbtPos *pos);
+int zbtPrev(zbtPos *pos);
+int zbtFirstInRange(zbtree *zbt, zrangespec *range, zbtPos *pos);
+int zbtLastInRange(zbtree *zbt, zrangespec *range, zbtPos *pos);
+int zbtGetElementByRank(zbtree *zbt, unsigned long rank, zbtPos *pos);
 double zzlGetScore(unsigned char *sptr);
 void zzlNext(unsigned char *zl, unsigned char **eptr, unsigned char **sptr);
 void zzlPrev(unsigned char *zl, unsigned char **eptr, unsigned char **sptr);
@@ -1681,22 +1774,23 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range);
 unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range);
 unsigned long zsetLength(const robj *zobj);
 void zsetConvert(robj *zobj, int encoding);
-void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen);
+void zsetConvertToListpackIfNeeded(robj *zobj, size_t maxelelen);
+void zsetInsertElement(zset *zs, double score, sds ele);
 int zsetScore(robj *zobj, sds member, double *score);
-unsigned long zslGetRank(zskiplist *zsl, double score, sds o);
+unsigned long zbtGetRank(zbtree *zbt, double score, sds ele);
 int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore);
 long zsetRank(robj *zobj, sds ele, int reverse);
 int zsetDel(robj *zobj, sds ele);
 void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey, robj *countarg);
-sds ziplistGetObject(unsigned char *sptr);
+sds lpGetObject(unsigned char *sptr);
 int zslValueGteMin(double value, zrangespec *spec);
 int zslValueLteMax(double value, zrangespec *spec);
 void zslFreeLexRange(zlexrangespec *spec);
 int zslParseLexRange(robj *min, robj *max, zlexrangespec *spec);
 unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range);
 unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range);
-zskiplistNode *zslFirstInLexRange(zskiplist *zsl, zlexrangespec *range);
-zskiplistNode *zslLastInLexRange(zskiplist *zsl, zlexrangespec *range);
+int zbtFirstInLexRange(zbtree *zbt, zlexrangespec *range, zbtPos *pos);
+int zbtLastInLexRange(zbtree *zbt, zlexrangespec *range, zbtPos *pos);
 int zzlLexValueGteMin(unsigned char *p, zlexrangespec *spec);
 int zzlLexValueLteMax(unsigned char *p, zlexrangespec *spec);
 int zslLexValueGteMin(sds value, zlexrangespec *spec);
@@ -1779,7 +1873,7 @@ unsigned long hashTypeLength(const robj *o);
 hashTypeIterator *hashTypeInitIterator(robj *subject);
 void hashTypeReleaseIterator(hashTypeIterator *hi);
 int hashTypeNext(hashTypeIterator *hi);
-void hashTypeCurrentFromZiplist(hashTypeIterator *hi, int what,
+void hashTypeCurrentFromListpack(hashTypeIterator *hi, int what,
                                 unsigned char **vstr,
                                 unsigned int *vlen,
                                 long long *vll);
@@ -1793,9 +1887,12 @@ int hashTypeSet(robj *o, sds field, sds value, int flags);
 /* Pub / Sub */
 int pubsubUnsubscribeAllChannels(client *c, int notify);
 int pubsubUnsubscribeAllPatterns(client *c, int notify);
+int pubsubUnsubscribeShardAllChannels(client *c, int notify);
+void pubsubUnsubscribeShardChannelsInSlots(unsigned char *slots);
 void freePubsubPattern(void *p);
 int listMatchPubsubPattern(void *a, void *b);
 int pubsubPublishMessage(robj *channel, robj *message);
+int pubsubPublishShardMessage(robj *channel, robj *message);
 
 /* Keyspace events notification */
 void notifyKeyspaceEvent(int type, char *event, robj *key, int dbid);
@@ -1819,11 +1916,13 @@ void setExpire(client *c, redisDb *db, robj *key, long long when);
 robj *lookupKey(redisDb *db, robj *key, int flags);
 robj *lookupKeyRead(redisDb *db, robj *key);
 robj *lookupKeyWrite(redisDb *db, robj *key);
+robj *lookupKeyWriteShared(redisDb *db, robj *key);
 robj *lookupKeyReadOrReply(client *c, robj *key, robj *reply);
 robj *lookupKeyWriteOrReply(client *c, robj *key, robj *reply);
 robj *lookupKeyReadWithFlags(redisDb *db, robj *key, int flags);
 robj *objectCommandLookup(client *c, robj *key);
 robj *objectCommandLookupOrReply(client *c, robj *key, robj *reply);
+size_t objectComputeSize(robj *o, size_t sample_size);
 void objectSetLRUOrLFU(robj *val, long long lfu_freq, long long lru_idle, long long lru_clock);
 
 #define LOOKUP_NONE 0
@@ -1846,19 +1945,81 @@ void signalModifiedKey(redisDb *db, robj *key);
 void signalFlushedDb(int dbid);
 unsigned int getKeysInSlot(unsigned int hashslot, robj **keys, unsigned int count);
 unsigned int countKeysInSlot(unsigned int hashslot);
+unsigned long long estimateMemoryInSlot(unsigned int hashslot, int samples);
 unsigned int delKeysInSlot(unsigned int hashslot);
 int verifyClusterConfigWithData(void);
 void scanGenericCommand(client *c, robj *o, unsigned long cursor);
 int parseScanCursorOrReply(client *c, robj *o, unsigned long *cursor);
-void slotToKeyAdd(robj *key);
-void slotToKeyDel(robj *key);
-void slotToKeyFlush(void);
 int dbAsyncDelete(redisDb *db, robj *key);
 void emptyDbAsync(redisDb *db);
-void slotToKeyFlushAsync(void);
 size_t lazyfreeGetPendingObjectsCount(void);
 void freeObjAsync(robj *o);
 
+/* Set operations computed in background, see setops.c. */
+typedef struct setopsJob {
+    client *c;              /* Blocked client, NULL if it was freed. */
+    void (*proc)(struct setopsJob *job); /* Computes 'result' from 'sets'. */
+    robj **objs;            /* Source objects (NULL for missing keys). */
+    robj **sets;            /* Copies of 'objs' headers, read by 'proc'. */
+    robj *copies;           /* Storage for the copies. */
+    int numsets;
+    int op;                 /* SET_OP_* operation. */
+    int aggregate;          /* ZUNIONSTORE/ZINTERSTORE aggregate function. */
+    double *weights;        /* ZUNIONSTORE/ZINTERSTORE weights, or NULL. */
+    robj *result;           /* Set by 'proc'. */
+    int done;               /* 'proc' was called, 'result' is valid. */
+    int state;              /* SETOPS_JOB_*, protected by a mutex. */
+    int cancelled;          /* A source was modified, 'proc' should stop. */
+    int unpinned;           /* setopsUnpinJob() was called. */
+    mstime_t delay;         /* Artificial delay, see DEBUG SETOPS-DELAY. */
+} setopsJob;
+
+/* setopsJob states. */
+#define SETOPS_JOB_QUEUED 0     /* Not yet processed by the thread. */
+#define SETOPS_JOB_RUNNING 1    /* The thread is reading the sources. */
+#define SETOPS_JOB_FINISHED 2   /* The sources are no longer read. */
+
+void setopsInit(void);
+int setopsShouldOffload(client *c, unsigned long long work);
+setopsJob *setopsCreateJob(client *c, robj **objs, int numsets);
+void setopsStartJob(setopsJob *job, void (*proc)(setopsJob *job));
+robj *setopsTakeResult(client *c, robj **objs, int numsets);
+void setopsHandleCompletedJobs(void);
+void unblockClientFromSetops(client *c);
+int setopsObjectIsPinned(robj *o);
+void setopsCancelJobsReading(robj *o);
+int setopsJobCancelled(setopsJob *job);
+int setopsPendingJobs(void);
+
+/* Keyspace access API. A DB keyspace may be composed of multiple dicts
+ * (one per hash slot in cluster mode), so code outside db.c should never
+ * access db->dict directly but use the functions below. */
+typedef struct dbIterator {
+    redisDb *db;
+    int didx;               /* Index of the dict we are iterating. */
+    int safe;               /* Use safe dict iterators. */
+    dictIterator *di;       /* Iterator of the current dict, or NULL. */
+} dbIterator;
+
+void dbCreateDicts(redisDb *db, int count);
+void dbReleaseDicts(dict **dicts, int count, unsigned long long *slot_sizes);
+void dbUpdateDictSize(redisDb *db, int didx, long long delta);
+int dbDictIndex(redisDb *db, sds key);
+dict *dbDictForKey(redisDb *db, sds key);
+dictEntry *dbFind(redisDb *db, sds key);
+unsigned long long dbSize(redisDb *db);
+unsigned long long dbBuckets(redisDb *db);
+void dbExpand(redisDb *db, unsigned long size);
+dictEntry *dbRandomEntry(redisDb *db);
+unsigned int dbGetSomeKeys(redisDb *db, dictEntry **des, unsigned int count);
+unsigned long dbScan(redisDb *db, unsigned long cursor, dictScanFunction *fn, dictScanBucketFunction *bucketfn, void *privdata);
+dbIterator *dbGetIterator(redisDb *db);
+dbIterator *dbGetSafeIterator(redisDb *db);
+dictEntry *dbNext(dbIterator *it);
+void dbReleaseIterator(dbIterator *it);
+void dbTryResizeDicts(redisDb *db);
+int dbIncrementallyRehash(redisDb *db);
+
 /* API to get key arguments from commands */
 int *getKeysFromCommand(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 void getKeysFreeResult(int *result);
@@ -1875,7 +2036,15 @@ unsigned short crc16(const char *buf, int len);
 unsigned int keyHashSlot(char *key, int keylen);
 void clusterCron(void);
 void clusterPropagatePublish(robj *channel, robj *message);
+void clusterPropagatePublishShard(robj *channel, robj *message);
+int clusterSlotStatsGetSlot(client *c);
+void clusterSlotStatsAddCommand(int slot, long long duration, size_t bytes_in, size_t bytes_out);
+void clusterResetSlotStats(void);
 void migrateCloseTimedoutSockets(void);
+void clusterMigrateSlotCommand(client *c);
+int migrateKeysAreLocked(redisDb *db, struct redisCommand *cmd, robj **argv, int argc);
+void unblockClientFromMigrate(client *c);
+void replyToMigrateTimedOut(client *c);
 void clusterBeforeSleep(void);
 int clusterSendModuleMessageToTarget(const char *target, uint64_t module_id, uint8_t type, unsigned char *payload, uint32_t len);
 
@@ -2075,6 +2244,9 @@ void unsubscribeCommand(client *c);
 void psubscribeCommand(client *c);
 void punsubscribeCommand(client *c);
 void publishCommand(client *c);
+void ssubscribeCommand(client *c);
+void sunsubscribeCommand(client *c);
+void spublishCommand(client *c);
 void pubsubCommand(client *c);
 void watchCommand(client *c);
 void unwatchCommand(client *c);
@@ -0,0 +1,392 @@
+/* Set operations on huge inputs computed in background.
+ *
+ * SUNION, SINTER, SDIFF (and their STORE variants), ZUNIONSTORE and
+ * ZINTERSTORE may take seconds when the inputs have millions of elements.
+ * When the inputs are at least 'setops-offload-threshold' elements and the
+ * command is called by a normal client (not inside MULTI/EXEC, a Lua script,
+ * a module, or by our master) the result is computed by the BIO_SETOPS
+ * thread while the client is blocked with BLOCKED_SETOPS, so that the main
+ * thread can keep serving the other clients.
+ *
+ * The thread reads the source objects while the main thread may serve
+ * commands about the same keys, so while a job is running its sources are
+ * "pinned":
+ *
+ * 1. They are referenced by the job, so they are not freed if the keys are
+ *    deleted or overwritten.
+ * 2. The incremental rehashing of their hash tables is paused, so that the
+ *    lookups performed by the main thread don't move entries around.
+ * 3. Before a write command can modify one of them in place, lookupKeyWrite()
+ *    cancels the jobs reading it, see setopsCancelJobsReading(): the thread
+ *    checks the cancellation while iterating the sources, so this only waits
+ *    for a few elements to be processed, and the job is unpinned. Active
+ *    defrag skips the pinned objects.
+ * 4. The thread only reads copies of the object headers, since the 'lru'
+ *    field of the original ones is updated by the lookups.
+ *
+ * Once the job is completed the command is executed again for the client,
+ * that still has its arguments. Its keys are checked again like
+ * processCommand() does, since their slot may have been migrated, or they
+ * may have been locked by an asynchronous MIGRATE, meanwhile. Then it goes
+ * through call() to be accounted and propagated as usual. If the job was not
+ * cancelled and every source key still holds the same object the job was
+ * started with, the command uses the computed result to reply or to store
+ * it. Otherwise the result is discarded and the command is computed again,
+ * in background again if the inputs are still big enough.
+ */
+
+#include "server.h"
+#include "bio.h"
+#include "cluster.h"
+#include "atomicvar.h"
+
+static list *setopsJobs;            /* Jobs not yet handled by the main thread. */
+static list *setopsCompletedJobs;   /* Jobs completed by the thread. */
+static pthread_mutex_t setopsCompletedJobsMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t setopsJobFinishedCond = PTHREAD_COND_INITIALIZER;
+static int setopsPipe[2];           /* Used to awake the event loop. */
+
+/* The event loop is awaken when a job is completed, the jobs are then
+ * handled in beforeSleep(), so there is nothing to do here. */
+static void setopsPipeReadable(aeEventLoop *el, int fd, void *privdata, int mask) {
+    UNUSED(el);
+    UNUSED(fd);
+    UNUSED(privdata);
+    UNUSED(mask);
+}
+
+/* 初始化后台集合操作处理的相关数据结构 */
+void setopsInit(void) {
+    setopsJobs = listCreate();
+    setopsCompletedJobs = listCreate();
+    if (pipe(setopsPipe) == -1) {
+        serverLog(LL_WARNING,
+            "Can't create the pipe for set operations in background: %s",
+            strerror(errno));
+        exit(1);
+    }
+    anetNonBlock(NULL,setopsPipe[0]);
+    anetNonBlock(NULL,setopsPipe[1]);
+    if (aeCreateFileEvent(server.el,setopsPipe[0],AE_READABLE,
+        setopsPipeReadable,NULL) == AE_ERR)
+    {
+        serverPanic("Error registering the readable event for the set "
+                    "operations in background.");
+    }
+}
+
+/* Return true if an operation whose cost is proportional to 'work' should
+ * be computed in background for the client 'c'. */
+/* 检测是否需要将对应的集合操作放到后台线程中进行处理 */
+int setopsShouldOffload(client *c, unsigned long long work) {
+    if (server.setops_offload_threshold == 0 ||
+        work < (unsigned long long)server.setops_offload_threshold)
+        return 0;
+    if (c->fd == -1 || server.loading) return 0;
+    return !(c->flags & (CLIENT_MULTI|CLIENT_LUA|CLIENT_MODULE|CLIENT_MASTER));
+}
+
+/* Return the hash table of the object that the main thread could rehash
+ * while the job reads it, or NULL. */
+static dict *setopsObjectDict(robj *o) {
+    if (o->type == OBJ_SET && o->encoding == OBJ_ENCODING_HT)
+        return o->ptr;
+    if (o->type == OBJ_ZSET && o->encoding == OBJ_ENCODING_BTREE)
+        return ((zset*)o->ptr)->dict;
+    return NULL;
+}
+
+/* Create a job for the client 'c' reading the 'numsets' objects 'objs'
+ * (that may contain NULLs for missing keys). The objects are pinned until
+ * the job is completed. The caller should then set the command specific
+ * fields of the job and call setopsStartJob(). */
+/* 创建对应的后台集合操作任务 同时固定对应的源对象 */
+setopsJob *setopsCreateJob(client *c, robj **objs, int numsets) {
+    setopsJob *job = zcalloc(sizeof(*job));
+    int j, k;
+
+    job->c = c;
+    job->numsets = numsets;
+    job->objs = zmalloc(sizeof(robj*)*numsets);
+    job->sets = zmalloc(sizeof(robj*)*numsets);
+    job->copies = zmalloc(sizeof(robj)*numsets);
+    for (j = 0; j < numsets; j++) {
+        robj *o = objs[j];
+        dict *d;
+
+        job->objs[j] = o;
+        job->sets[j] = NULL;
+        if (o == NULL) continue;
+
+        /* The commands detect the same key given multiple times comparing
+         * the objects pointers: use the same copy for the same object. */
+        for (k = 0; k < j; k++) if (objs[k] == o) break;
+        if (k != j) {
+            job->sets[j] = job->sets[k];
+            continue;
+        }
+        incrRefCount(o);
+        if ((d = setopsObjectDict(o)) != NULL) dictPauseRehashing(d);
+        job->copies[j] = *o;
+        job->sets[j] = job->copies+j;
+    }
+    job->delay = server.setops_debug_delay;
+    return job;
+}
+
+/* Resume the rehashing of the hash tables paused by setopsCreateJob(): the
+ * objects are no longer read by the thread. */
+static void setopsUnpinJob(setopsJob *job) {
+    int j;
+    dict *d;
+
+    if (job->unpinned) return;
+    job->unpinned = 1;
+    for (j = 0; j < job->numsets; j++) {
+        if (job->sets[j] != job->copies+j) continue;
+        if ((d = setopsObjectDict(job->objs[j])) != NULL)
+            dictResumeRehashing(d);
+    }
+}
+
+static void setopsFreeJob(setopsJob *job) {
+    int j;
+
+    for (j = 0; j < job->numsets; j++) {
+        if (job->sets[j] == job->copies+j) decrRefCount(job->objs[j]);
+    }
+    if (job->result) decrRefCount(job->result);
+    zfree(job->objs);
+    zfree(job->sets);
+    zfree(job->copies);
+    zfree(job->weights);
+    zfree(job);
+}
+
+/* Block the client of the job and queue the job for the background thread,
+ * that will call 'proc' to compute job->result. */
+/* 阻塞对应的客户端 并将对应的任务添加到后台线程中进行处理 */
+void setopsStartJob(setopsJob *job, void (*proc)(setopsJob *job)) {
+    client *c = job->c;
+
+    job->proc = proc;
+    listAddNodeTail(setopsJobs,job);
+    c->bpop.setops_job = job;
+    c->bpop.timeout = 0;
+    blockClient(c,BLOCKED_SETOPS);
+    server.stat_setops_offloaded++;
+    bioCreateBackgroundJob(BIO_SETOPS,job,NULL,NULL);
+}
+
+/* Return true if the job was cancelled by setopsCancelJobsReading(). Called
+ * by the 'proc' of the jobs while iterating the sources, so that they stop
+ * ASAP. 'job' is NULL when the command is computed by the main thread. */
+int setopsJobCancelled(setopsJob *job) {
+    int cancelled;
+
+    if (job == NULL) return 0;
+    atomicGet(job->cancelled,cancelled);
+    return cancelled;
+}
+
+/* Called by the BIO_SETOPS thread. */
+void setopsProcessJobFromBioThread(setopsJob *job) {
+    mstime_t delay = job->delay;
+    int cancelled;
+
+    pthread_mutex_lock(&setopsCompletedJobsMutex);
+    atomicGet(job->cancelled,cancelled);
+    if (!cancelled) job->state = SETOPS_JOB_RUNNING;
+    pthread_mutex_unlock(&setopsCompletedJobsMutex);
+
+    if (!cancelled) {
+        while (delay > 0 && !setopsJobCancelled(job)) {
+            usleep(1000);
+            delay--;
+        }
+        if (!setopsJobCancelled(job)) job->proc(job);
+    }
+
+    pthread_mutex_lock(&setopsCompletedJobsMutex);
+    job->state = SETOPS_JOB_FINISHED;
+    listAddNodeTail(setopsCompletedJobs,job);
+    if (write(setopsPipe[1],"A",1) != 1) {
+        /* Ignore the error, this is best-effort. */
+    }
+    pthread_cond_broadcast(&setopsJobFinishedCond);
+    pthread_mutex_unlock(&setopsCompletedJobsMutex);
+}
+
+/* Called by the command implementations after looking up their source keys
+ * 'objs': if the client is executing again its command after a job
+ * completed, and the job was started with the same objects, the result of
+ * the job is returned and it's up to the caller to release it. Otherwise
+ * NULL is returned, and the command should compute the result itself.
+ * The job is released by setopsResumeClient(). */
+/* 获取对应客户端后台任务的计算结果 如果源对象已经被修改过 返回NULL */
+robj *setopsTakeResult(client *c, robj **objs, int numsets) {
+    setopsJob *job = c->bpop.setops_job;
+    robj *result = NULL;
+    int j;
+
+    if (job == NULL || !job->done) return NULL;
+    c->bpop.setops_job = NULL;
+
+    if (!job->cancelled && job->numsets == numsets) {
+        for (j = 0; j < numsets; j++)
+            if (job->objs[j] != objs[j]) break;
+        if (j == numsets) {
+            result = job->result;
+            job->result = NULL;
+        }
+    }
+    if (result == NULL) server.stat_setops_recomputed++;
+    return result;
+}
+
+/* Execute again the command of a client whose job was completed, so that it
+ * can use the result with setopsTakeResult(). The keys may have been
+ * migrated to another node, or locked by an asynchronous MIGRATE, meanwhile,
+ * so they are checked again before the command goes through call() like
+ * any other one. */
+/* 重新执行任务已经完成的客户端的命令 以便使用后台计算的结果 */
+static void setopsResumeClient(client *c) {
+    setopsJob *job = c->bpop.setops_job;
+
+    int refused = 0;
+
+    unblockClient(c);
+
+    /* Repeat the checks processCommand() performs before executing a
+     * command about its keys. */
+    if (server.cluster_enabled) {
+        int hashslot, error_code;
+        clusterNode *n = getNodeByQuery(c,c->cmd,c->argv,c->argc,
+                                        &hashslot,&error_code);
+        if (n == NULL || n != server.cluster->myself) {
+            clusterRedirectClient(c,n,hashslot,error_code);
+            refused = 1;
+        }
+    }
+    if (!refused && migrateKeysAreLocked(c->db,c->cmd,c->argv,c->argc)) {
+        addReply(c,shared.migratingkeyerr);
+        refused = 1;
+    }
+    if (refused) {
+        c->bpop.setops_job = NULL;
+        setopsFreeJob(job);
+        resetClient(c);
+        return;
+    }
+
+    call(c,CMD_CALL_FULL);
+    c->woff = server.master_repl_offset;
+
+    /* The command may return before looking for the result, for instance
+     * if one of the keys is no longer of the right type. */
+    if (c->bpop.setops_job == job) c->bpop.setops_job = NULL;
+    setopsFreeJob(job);
+
+    /* Unless the command was started again in background, it is done. */
+    if (!(c->flags & CLIENT_BLOCKED)) resetClient(c);
+    if (listLength(server.ready_keys)) handleClientsBlockedOnKeys();
+}
+
+/* Handle the jobs completed by the thread. Called in beforeSleep(). */
+/* 处理后台线程已经完成的集合操作任务 */
+void setopsHandleCompletedJobs(void) {
+    listNode *ln;
+    setopsJob *job;
+    char buf[1];
+
+    if (setopsJobs == NULL || listLength(setopsJobs) == 0) return;
+
+    pthread_mutex_lock(&setopsCompletedJobsMutex);
+    while (read(setopsPipe[0],buf,1) == 1);
+    while (listLength(setopsCompletedJobs)) {
+        ln = listFirst(setopsCompletedJobs);
+        job = ln->value;
+        listDelNode(setopsCompletedJobs,ln);
+        pthread_mutex_unlock(&setopsCompletedJobsMutex);
+
+        ln = listSearchKey(setopsJobs,job);
+        serverAssert(ln != NULL);
+        listDelNode(setopsJobs,ln);
+        setopsUnpinJob(job);
+        job->done = 1;
+
+        if (job->c)
+            setopsResumeClient(job->c);
+        else
+            setopsFreeJob(job);
+
+        pthread_mutex_lock(&setopsCompletedJobsMutex);
+    }
+    pthread_mutex_unlock(&setopsCompletedJobsMutex);
+}
+
+/* Called by unblockClient(). If the job is still running the client is
+ * being freed or disconnected: the job is detached, and will be released
+ * once completed. */
+void unblockClientFromSetops(client *c) {
+    setopsJob *job = c->bpop.setops_job;
+
+    if (job->done) return;
+    job->c = NULL;
+    c->bpop.setops_job = NULL;
+    /* Like for modules, the client was not reset when it blocked. */
+    resetClient(c);
+}
+
+/* Return true if the job reads the object 'o'. */
+static int setopsJobReads(setopsJob *job, robj *o) {
+    int j;
+
+    if (job->unpinned) return 0;
+    for (j = 0; j < job->numsets; j++)
+        if (job->objs[j] == o) return 1;
+    return 0;
+}
+
+/* Return true if the object is read by a job in background. */
+int setopsObjectIsPinned(robj *o) {
+    listIter li;
+    listNode *ln;
+
+    if (setopsJobs == NULL || listLength(setopsJobs) == 0) return 0;
+    listRewind(setopsJobs,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        if (setopsJobReads(ln->value,o)) return 1;
+    }
+    return 0;
+}
+
+/* Cancel the jobs reading the pinned object 'o', that is going to be
+ * modified in place. Copying a huge object would block the main thread
+ * for as long as the operation itself: instead we wait for the thread to
+ * notice the cancellation, which takes a few elements, and unpin the jobs.
+ * Their clients will compute the command again once resumed. */
+/* 取消正在读取对应值对象的后台任务 以便可以原地修改该值对象 */
+void setopsCancelJobsReading(robj *o) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(setopsJobs,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        setopsJob *job = ln->value;
+
+        if (!setopsJobReads(job,o)) continue;
+        pthread_mutex_lock(&setopsCompletedJobsMutex);
+        atomicSet(job->cancelled,1);
+        while (job->state == SETOPS_JOB_RUNNING)
+            pthread_cond_wait(&setopsJobFinishedCond,
+                              &setopsCompletedJobsMutex);
+        pthread_mutex_unlock(&setopsCompletedJobsMutex);
+        setopsUnpinJob(job);
+    }
+}
+
+/* Return the number of jobs not yet handled. */
+int setopsPendingJobs(void) {
+    return setopsJobs ? listLength(setopsJobs) : 0;
+}
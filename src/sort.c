@@ -33,8 +33,6 @@
 #include "pqsort.h" /* Partial qsort for SORT+LIMIT */
 #include <math.h> /* isnan() */
 
-zskiplistNode* zslGetElementByRank(zskiplist *zsl, unsigned long rank);
-
 redisSortOperation *createSortOperation(int type, robj *pattern) {
     redisSortOperation *so = zmalloc(sizeof(*so));
     so->type = type;
@@ -119,8 +117,12 @@ robj *lookupKeyByPattern(redisDb *db, robj *pattern, robj *subst) {
         if (o->type != OBJ_STRING) goto noobj;
 
         /* Every object that this function returns needs to have its refcount
-         * increased. sortCommand decreases it again. */
-        incrRefCount(o);
+         * increased. sortCommand decreases it again. Compressed bitmaps
+         * are returned as the plain string they represent. */
+        if (o->encoding == OBJ_ENCODING_ROARING)
+            o = getDecodedObject(o);
+        else
+            incrRefCount(o);
     }
     decrRefCount(keyobj);
     if (fieldobj) decrRefCount(fieldobj);
@@ -303,7 +305,7 @@ void sortCommand(client *c) {
 
     /* Destructively convert encoded sorted sets for SORT. */
     if (sortval->type == OBJ_ZSET)
-        zsetConvert(sortval, OBJ_ENCODING_SKIPLIST);
+        zsetConvert(sortval, OBJ_ENCODING_BTREE);
 
     /* Objtain the length of the object to sort. */
     switch(sortval->type) {
@@ -397,8 +399,8 @@ void sortCommand(client *c) {
          * way, just getting the required range, as an optimization. */
 
         zset *zs = sortval->ptr;
-        zskiplist *zsl = zs->zsl;
-        zskiplistNode *ln;
+        zbtree *zbt = zs->zbt;
+        zbtPos pos;
         sds sdsele;
         int rangelen = vectorlen;
 
@@ -406,23 +408,23 @@ void sortCommand(client *c) {
         if (desc) {
             long zsetlen = dictSize(((zset*)sortval->ptr)->dict);
 
-            ln = zsl->tail;
+            zbtLast(zbt,&pos);
             if (start > 0)
-                ln = zslGetElementByRank(zsl,zsetlen-start);
+                zbtGetElementByRank(zbt,zsetlen-start,&pos);
         } else {
-            ln = zsl->header->level[0].forward;
+            zbtFirst(zbt,&pos);
             if (start > 0)
-                ln = zslGetElementByRank(zsl,start+1);
+                zbtGetElementByRank(zbt,start+1,&pos);
         }
 
         while(rangelen--) {
-            serverAssertWithInfo(c,sortval,ln != NULL);
-            sdsele = ln->ele;
+            serverAssertWithInfo(c,sortval,pos.leaf != NULL);
+            sdsele = zbtPosEntry(&pos)->ele;
             vector[j].obj = createStringObject(sdsele,sdslen(sdsele));
             vector[j].u.score = 0;
             vector[j].u.cmpobj = NULL;
             j++;
-            ln = desc ? ln->backward : ln->level[0].forward;
+            if (desc) zbtPrev(&pos); else zbtNext(&pos);
         }
         /* Fix start/end: output code is not aware of this optimization. */
         end -= start;
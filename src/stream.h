@@ -55,9 +55,12 @@ typedef struct streamCG {
     rax *pel;               /* Pending entries list. This is a radix tree that
                                has every message delivered to consumers (without
                                the NOACK option) that was yet not acknowledged
-                               as processed. The key of the radix tree is the
-                               ID as a 64 bit big endian number, while the
-                               associated value is a streamNACK structure.*/
+                               as processed. The messages are stored in blocks
+                               of consecutive IDs: the key of the radix tree is
+                               the starting ID of the block as a 128 bit big
+                               endian number, while the associated value is a
+                               streamPELBlock structure. */
+    uint64_t pel_size;      /* Number of messages in the PEL. */
     rax *consumers;         /* A radix tree representing the consumers by name
                                and their associated representation in the form
                                of streamConsumer structures. */
@@ -69,13 +72,14 @@ typedef struct streamConsumer {
     sds name;                   /* Consumer name. This is how the consumer
                                    will be identified in the consumer group
                                    protocol. Case sensitive. */
-    rax *pel;                   /* Consumer specific pending entries list: all
-                                   the pending messages delivered to this
+    rax *pel;                   /* Consumer specific pending entries list:
+                                   the blocks of the "pel" of the consumer
+                                   group having messages delivered to this
                                    consumer not yet acknowledged. Keys are
-                                   big endian message IDs, while values are
-                                   the same streamNACK structure referenced
-                                   in the "pel" of the conumser group structure
-                                   itself, so the value is shared. */
+                                   the same keys of the group PEL, while
+                                   values are the number of messages of this
+                                   consumer inside the block. */
+    uint64_t pel_size;          /* Number of pending messages. */
 } streamConsumer;
 
 /* Pending (yet not acknowledged) message in a consumer group. */
@@ -86,6 +90,35 @@ typedef struct streamNACK {
                                    in the last delivery. */
 } streamNACK;
 
+/* A run of consecutive pending messages with the same delivery info. */
+typedef struct streamPELRun {
+    streamNACK nack;            /* Delivery info shared by the messages. */
+    uint32_t len;               /* Number of consecutive messages. */
+} streamPELRun;
+
+/* A block of consecutive pending messages of a group PEL. */
+typedef struct streamPELBlock {
+    streamID start;             /* Key of the block in the group PEL. All the
+                                   IDs in the block are >= start, and smaller
+                                   than the start of the next block. */
+    uint32_t count;             /* Number of messages in the block. */
+    uint32_t numruns;           /* Number of runs. */
+    streamID *ids;              /* Sorted IDs of the messages. */
+    streamPELRun *runs;         /* Delivery info: the first run is about the
+                                   first 'len' IDs, and so forth. */
+} streamPELBlock;
+
+/* Iterator of the messages of a PEL, in ascending ID order. */
+typedef struct streamPELIterator {
+    streamCG *cg;               /* Consumer group. */
+    streamConsumer *consumer;   /* Only messages of this consumer, if any. */
+    raxIterator ri;             /* Iterator of the group or consumer PEL. */
+    streamPELBlock *block;      /* Current block. */
+    uint32_t idx;               /* Next message inside the block. */
+    uint32_t run;               /* Run of the next message... */
+    uint32_t runpos;            /* ...and its position inside the run. */
+} streamPELIterator;
+
 /* Stream propagation informations, passed to functions in order to propagate
  * XCLAIM commands to AOF and slaves. */
 typedef struct sreamPropInfo {
@@ -106,7 +139,14 @@ void streamIteratorStop(streamIterator *si);
 streamCG *streamLookupCG(stream *s, sds groupname);
 streamConsumer *streamLookupConsumer(streamCG *cg, sds name, int create);
 streamCG *streamCreateCG(stream *s, char *name, size_t namelen, streamID *id);
-streamNACK *streamCreateNACK(streamConsumer *consumer);
+streamNACK *streamPELFind(streamCG *cg, streamID *id);
+int streamPELAdd(streamCG *cg, streamID *id, streamConsumer *consumer, mstime_t delivery_time, uint64_t delivery_count);
+int streamPELDelete(streamCG *cg, streamID *id);
+void streamPELIteratorStart(streamPELIterator *pi, streamCG *cg, streamConsumer *consumer, streamID *start);
+int streamPELIteratorNext(streamPELIterator *pi, streamID *id, streamNACK **nack);
+void streamPELIteratorStop(streamPELIterator *pi);
+void streamPELBlockFree(streamPELBlock *b);
+void streamEncodeID(void *buf, streamID *id);
 void streamDecodeID(void *buf, streamID *id);
 int streamCompareID(streamID *a, streamID *b);
 
@@ -13,14 +13,14 @@
  * Hash对象结构中的相关函数
  *----------------------------------------------------------------------------*/
 
-/* Check the length of a number of objects to see if we need to convert a ziplist to a real hash. 
+/* Check the length of a number of objects to see if we need to convert a listpack to a real hash. 
  * Note that we only check string encoded objects as their string length can be queried in constant time. */
 /* 检测新引入的字段和值是否会引起hash对象底层实现结构的变化---->主要是检测给定的字段和值的长度是否超过了预设值 */
 void hashTypeTryConversion(robj *o, robj **argv, int start, int end) {
     int i;
 	
-	//检测当前hash对象的编码是否是ziplist形式
-    if (o->encoding != OBJ_ENCODING_ZIPLIST) 
+	//检测当前hash对象的编码是否是listpack形式
+    if (o->encoding != OBJ_ENCODING_LISTPACK) 
 		return;
 	
 	//循环检测输入的字段和值的内容长度是否超出了预设值
@@ -34,28 +34,28 @@ void hashTypeTryConversion(robj *o, robj **argv, int start, int end) {
     }
 }
 
-/* Get the value from a ziplist encoded hash, identified by field. Returns -1 when the field cannot be found. */
-/* 检测对应的字段是否在ziplist实现的hash对象中 */
-int hashTypeGetFromZiplist(robj *o, sds field, unsigned char **vstr, unsigned int *vlen, long long *vll) {
+/* Get the value from a listpack encoded hash, identified by field. Returns -1 when the field cannot be found. */
+/* 检测对应的字段是否在listpack实现的hash对象中 */
+int hashTypeGetFromListpack(robj *o, sds field, unsigned char **vstr, unsigned int *vlen, long long *vll) {
     unsigned char *zl, *fptr = NULL, *vptr = NULL;
     int ret;
 
     //检测对应的类型是否是压缩列表结构的实现
-    serverAssert(o->encoding == OBJ_ENCODING_ZIPLIST);
+    serverAssert(o->encoding == OBJ_ENCODING_LISTPACK);
 	
-	//获取对象中ziplist指向
+	//获取对象中listpack指向
     zl = o->ptr;
 	//获取对应的头元素节点位置指向
-    fptr = ziplistIndex(zl, ZIPLIST_HEAD);
+    fptr = lpFirst(zl);
 	//检测对应的头节点是否存在
     if (fptr != NULL) {
 		//从头结点开始想后进行查询,注意每次进行跳过一个元素,原因是字段和值分别占据一个位置,因此需要跳过对应的值的位置
-        fptr = ziplistFind(fptr, (unsigned char*)field, sdslen(field), 1);
+        fptr = lpFind(zl, fptr, (unsigned char*)field, sdslen(field), 1);
 		//检测是否找到对应的节点位置--->上述函数的返回值是对应的找到位置的指向
 		if (fptr != NULL) {
             /* Grab pointer to the value (fptr points to the field) */
 			//获取对应字段所对应的值的指向
-            vptr = ziplistNext(zl, fptr);
+            vptr = lpNext(zl, fptr);
             serverAssert(vptr != NULL);
         }
     }
@@ -63,7 +63,7 @@ int hashTypeGetFromZiplist(robj *o, sds field, unsigned char **vstr, unsigned in
 	//检测是否找到对应字段的值内容节点的指向
     if (vptr != NULL) {
 		//获取对应的值的内容指向
-        ret = ziplistGet(vptr, vstr, vlen, vll);
+        ret = lpGetValue(vptr, vstr, vlen, vll);
         serverAssert(ret);
 		//返回本字段存在的标识
         return 0;
@@ -100,10 +100,10 @@ sds hashTypeGetFromHashTable(robj *o, sds field) {
 /* 在对应的hash对象中查找对应字段所对应的值的信息 */
 int hashTypeGetValue(robj *o, sds field, unsigned char **vstr, unsigned int *vlen, long long *vll) {
 	//根据hash对象的底层不同实现进行区分处理
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         *vstr = NULL;
-		//在对应的ziplist中获取对应的字段所对应的值
-        if (hashTypeGetFromZiplist(o, field, vstr, vlen, vll) == 0)
+		//在对应的listpack中获取对应的字段所对应的值
+        if (hashTypeGetFromListpack(o, field, vstr, vlen, vll) == 0)
 			//返回找到对应的字段所对应的值的成功标识
             return C_OK;
     } else if (o->encoding == OBJ_ENCODING_HT) {
@@ -150,13 +150,13 @@ robj *hashTypeGetValueObject(robj *o, sds field) {
 size_t hashTypeGetValueLength(robj *o, sds field) {
 	//初始化对应的长度值
     size_t len = 0;
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 		
-		//在ziplist中获取对应的字段所对应的值数据信息
-        if (hashTypeGetFromZiplist(o, field, &vstr, &vlen, &vll) == 0)
+		//在listpack中获取对应的字段所对应的值数据信息
+        if (hashTypeGetFromListpack(o, field, &vstr, &vlen, &vll) == 0)
 			//计算对应的长度值---->如果是整数的时候,返回的是对应的10进制对应的字符串长度值
             len = vstr ? vlen : sdigits10(vll);
     } else if (o->encoding == OBJ_ENCODING_HT) {
@@ -177,13 +177,13 @@ size_t hashTypeGetValueLength(robj *o, sds field) {
 /* 测试对应的字段是否在hash对象中 */
 int hashTypeExists(robj *o, sds field) {
 	//根据hash对象底层的不同实现方式进行相应的检测处理
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 		
 		//检测对应的字段是否在压缩列表结构中
-        if (hashTypeGetFromZiplist(o, field, &vstr, &vlen, &vll) == 0) 
+        if (hashTypeGetFromListpack(o, field, &vstr, &vlen, &vll) == 0) 
 			return 1;
     } else if (o->encoding == OBJ_ENCODING_HT) {
     	//检测对应的字段是否在字典结构中
@@ -217,47 +217,43 @@ int hashTypeExists(robj *o, sds field) {
 int hashTypeSet(robj *o, sds field, sds value, int flags) {
     int update = 0;
 	//根据hash对象的不同编码方式来进行区分对待
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl, *fptr, *vptr;
-		//获取hash对象对应的ziplist指向
+		//获取hash对象对应的listpack指向
         zl = o->ptr;
 		//获取对应的头节点位置指向
-        fptr = ziplistIndex(zl, ZIPLIST_HEAD);
+        fptr = lpFirst(zl);
 		//检测对应的头节点是否存在
         if (fptr != NULL) {
 			//从头结点开始向后查询是否有对应的字段值
-            fptr = ziplistFind(fptr, (unsigned char*)field, sdslen(field), 1);
+            fptr = lpFind(zl, fptr, (unsigned char*)field, sdslen(field), 1);
 			//检测是否找到对应的字段值对应的节点
             if (fptr != NULL) {
                 /* Grab pointer to the value (fptr points to the field) */
 				//获取对应的值节点的指向
-                vptr = ziplistNext(zl, fptr);
+                vptr = lpNext(zl, fptr);
                 serverAssert(vptr != NULL);
 				//设置为进行更新操作标识
                 update = 1;
 
-                /* Delete value */
-				//进行删除对应的原始值节点内容 注意删除元素可能导致压缩列表的抖动
-                zl = ziplistDelete(zl, &vptr);
-
-                /* Insert new value */
-				//将新的值节点内容设置到ziplist中 注意添加元素可能导致压缩列表的抖动
-                zl = ziplistInsert(zl, vptr, (unsigned char*)value, sdslen(value));
+                /* Replace value */
+				//原地替换对应的值节点内容 listpack中没有连锁更新的问题
+                zl = lpInsert(zl, (unsigned char*)value, sdslen(value), vptr, LP_REPLACE, NULL);
             }
         }
 		
 		//检测是否是更新操作------>不是就说明是需要进行插入操作处理了
         if (!update) {
-            /* Push new field/value pair onto the tail of the ziplist */
+            /* Push new field/value pair onto the tail of the listpack */
 		 	//插入对应的字段
-            zl = ziplistPush(zl, (unsigned char*)field, sdslen(field), ZIPLIST_TAIL);
+            zl = lpAppend(zl, (unsigned char*)field, sdslen(field));
 			//插入对应的值
-            zl = ziplistPush(zl, (unsigned char*)value, sdslen(value), ZIPLIST_TAIL);
+            zl = lpAppend(zl, (unsigned char*)value, sdslen(value));
         }
-		//重新设置hash对象中ziplist的指向
+		//重新设置hash对象中listpack的指向
         o->ptr = zl;
 
-        /* Check if the ziplist needs to be converted to a hash table */
+        /* Check if the listpack needs to be converted to a hash table */
 		//检测新添加的字段和值是否引起了hash对象元素数量大于预设值
         if (hashTypeLength(o) > server.hash_max_ziplist_entries)
 			//进行结构变化操作处理
@@ -308,7 +304,7 @@ int hashTypeSet(robj *o, sds field, sds value, int flags) {
 
     /* Free SDS strings we did not referenced elsewhere if the flags want this function to be responsible. */
 	//根据配置参数来进一步确定是否需要进行字符串空间的释放操作处理
-	//注意这里的处理好像只有在ziplist中才回引发处理------>如果是对应的hash表,内部已经做了处理
+	//注意这里的处理好像只有在listpack中才回引发处理------>如果是对应的hash表,内部已经做了处理
     if (flags & HASH_SET_TAKE_FIELD && field) 
 		sdsfree(field);
     if (flags & HASH_SET_TAKE_VALUE && value) 
@@ -323,23 +319,23 @@ int hashTypeDelete(robj *o, sds field) {
     int deleted = 0;
 	
 	//根据hash对象的编码方式进行分别处理
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl, *fptr;
 		
-		//获取ziplist结构指向
+		//获取listpack结构指向
         zl = o->ptr;
 		//获取压缩列表对应的头节点元素指向
-        fptr = ziplistIndex(zl, ZIPLIST_HEAD);
+        fptr = lpFirst(zl);
 		//检测是否存在对应的头节点指向
         if (fptr != NULL) {
 			//从头节点开始向后遍历,查找对应字段相同的节点
-            fptr = ziplistFind(fptr, (unsigned char*)field, sdslen(field), 1);
+            fptr = lpFind(zl, fptr, (unsigned char*)field, sdslen(field), 1);
 			//检测是否找到对应的字段节点
             if (fptr != NULL) {
 				//删除对应的字段节点
-                zl = ziplistDelete(zl,&fptr); /* Delete the key. */
+                zl = lpDelete(zl,fptr,&fptr); /* Delete the key. */
 				//删除字段对应的值内容节点
-                zl = ziplistDelete(zl,&fptr); /* Delete the value. */
+                zl = lpDelete(zl,fptr,&fptr); /* Delete the value. */
 				//重新给hash对象设置真实数据的指向位置
                 o->ptr = zl;
 				//设置进行删除操作标记
@@ -370,9 +366,9 @@ unsigned long hashTypeLength(const robj *o) {
     unsigned long length = ULONG_MAX;
 	
 	//根据hash对象的不同实现来获取对应的元素数量值
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
 		//获取hash对象对应的压缩列表实现类型对应的元素数量值 此处除以2 是分开键值对
-        length = ziplistLen(o->ptr) / 2;
+        length = lpLength(o->ptr) / 2;
     } else if (o->encoding == OBJ_ENCODING_HT) {
     	//获取hash对象对应的字典实现类型对应的元素数量值
         length = dictSize((const dict*)o->ptr);
@@ -393,7 +389,7 @@ hashTypeIterator *hashTypeInitIterator(robj *subject) {
     hi->encoding = subject->encoding;
 	
 	//根据编码方式不同初始化对应的参数
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         hi->fptr = NULL;
         hi->vptr = NULL;
     } else if (hi->encoding == OBJ_ENCODING_HT) {
@@ -419,11 +415,11 @@ void hashTypeReleaseIterator(hashTypeIterator *hi) {
 /* 根据给定的迭代器对象在hash对象中获取下一个需要进行遍历的元素 */
 int hashTypeNext(hashTypeIterator *hi) {
 	//根据编码方式来进行分别处理
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl;
         unsigned char *fptr, *vptr;
 	
-		//获取对应的ziplist指向
+		//获取对应的listpack指向
         zl = hi->subject->ptr;
 		//通过迭代器获取对应的上一次遍历的字段和值对应的指向
         fptr = hi->fptr;
@@ -433,12 +429,12 @@ int hashTypeNext(hashTypeIterator *hi) {
             /* Initialize cursor */
             serverAssert(vptr == NULL);
 			//设置本指针指向第一个需要遍历的元素
-            fptr = ziplistIndex(zl, 0);
+            fptr = lpFirst(zl);
         } else {
             /* Advance cursor */
             serverAssert(vptr != NULL);
 			//获取下一个需要进行遍历的元素
-            fptr = ziplistNext(zl, vptr);
+            fptr = lpNext(zl, vptr);
         }
 		//检测是否还有能够进行遍历的元素
         if (fptr == NULL) 
@@ -446,7 +442,7 @@ int hashTypeNext(hashTypeIterator *hi) {
 
         /* Grab pointer to the value (fptr points to the field) */
 		//在有对应的元素能够遍历的情况下,获取对应的值的指向
-        vptr = ziplistNext(zl, fptr);
+        vptr = lpNext(zl, fptr);
         serverAssert(vptr != NULL);
 
         /* fptr, vptr now point to the first or next pair */
@@ -465,19 +461,19 @@ int hashTypeNext(hashTypeIterator *hi) {
     return C_OK;
 }
 
-/* Get the field or value at iterator cursor, for an iterator on a hash value encoded as a ziplist. Prototype is similar to `hashTypeGetFromZiplist`. */
-/* 根据提供的迭代器状态从对应的ziplist中获取对应的当前需要遍历的节点信息 */
-void hashTypeCurrentFromZiplist(hashTypeIterator *hi, int what, unsigned char **vstr, unsigned int *vlen, long long *vll) {
+/* Get the field or value at iterator cursor, for an iterator on a hash value encoded as a listpack. Prototype is similar to `hashTypeGetFromListpack`. */
+/* 根据提供的迭代器状态从对应的listpack中获取对应的当前需要遍历的节点信息 */
+void hashTypeCurrentFromListpack(hashTypeIterator *hi, int what, unsigned char **vstr, unsigned int *vlen, long long *vll) {
     int ret;
 	//检测对应的类型是否是压缩列表实现方式
-    serverAssert(hi->encoding == OBJ_ENCODING_ZIPLIST);
+    serverAssert(hi->encoding == OBJ_ENCODING_LISTPACK);
     if (what & OBJ_HASH_KEY) {
 		//获取对应的字段的数据
-        ret = ziplistGet(hi->fptr, vstr, vlen, vll);
+        ret = lpGetValue(hi->fptr, vstr, vlen, vll);
         serverAssert(ret);
     } else {
 		//获取字段对应的值的数据
-        ret = ziplistGet(hi->vptr, vstr, vlen, vll);
+        ret = lpGetValue(hi->vptr, vstr, vlen, vll);
         serverAssert(ret);
     }
 }
@@ -507,10 +503,10 @@ sds hashTypeCurrentFromHashTable(hashTypeIterator *hi, int what) {
 /* 根据提供的迭代器来获取当前位置上的字段或者字段对应的值的数据 */
 void hashTypeCurrentObject(hashTypeIterator *hi, int what, unsigned char **vstr, unsigned int *vlen, long long *vll) {
 	//根据当前的编码类型来触发不同的获取数据方式
-	if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+	if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         *vstr = NULL;
-		//获取对应的ziplist上的数据
-        hashTypeCurrentFromZiplist(hi, what, vstr, vlen, vll);
+		//获取对应的listpack上的数据
+        hashTypeCurrentFromListpack(hi, what, vstr, vlen, vll);
     } else if (hi->encoding == OBJ_ENCODING_HT) {
 		//获取对应的字典结构上对应的数据
         sds ele = hashTypeCurrentFromHashTable(hi, what);
@@ -560,12 +556,12 @@ robj *hashTypeLookupWriteOrCreate(client *c, robj *key) {
     return o;
 }
 
-/* 实现将ziplist结构数据转化成对应的字典结构类型 */
-void hashTypeConvertZiplist(robj *o, int enc) {
+/* 实现将listpack结构数据转化成对应的字典结构类型 */
+void hashTypeConvertListpack(robj *o, int enc) {
 	//检测类型是否是压缩列表类型的
-    serverAssert(o->encoding == OBJ_ENCODING_ZIPLIST);
+    serverAssert(o->encoding == OBJ_ENCODING_LISTPACK);
 
-    if (enc == OBJ_ENCODING_ZIPLIST) {
+    if (enc == OBJ_ENCODING_LISTPACK) {
         /* Nothing to do... */
 		//不能从字典类型的转换成压缩列表类型的  即不需要做任何操作
     } else if (enc == OBJ_ENCODING_HT) {
@@ -578,7 +574,7 @@ void hashTypeConvertZiplist(robj *o, int enc) {
 		//创建对应的字典结构
         dict = dictCreate(&hashDictType, NULL);
 
-		//循环遍历老数据,将ziplist结构中的数据转化成字典结构上的数据
+		//循环遍历老数据,将listpack结构中的数据转化成字典结构上的数据
         while (hashTypeNext(hi) != C_ERR) {
             sds key, value;
 			//获取对应的字段值
@@ -589,13 +585,13 @@ void hashTypeConvertZiplist(robj *o, int enc) {
             ret = dictAdd(dict, key, value);
 			//检测是否进行插入数据成功
             if (ret != DICT_OK) {
-                serverLogHexDump(LL_WARNING,"ziplist with dup elements dump", o->ptr, ziplistBlobLen(o->ptr));
-                serverPanic("Ziplist corruption detected");
+                serverLogHexDump(LL_WARNING,"listpack with dup elements dump", o->ptr, lpBytes(o->ptr));
+                serverPanic("Listpack corruption detected");
             }
         }
 		//操作完成后,是否迭代器占据的空间
         hashTypeReleaseIterator(hi);
-		//释放hash对象中元素存储ziplist结构的数据空间
+		//释放hash对象中元素存储listpack结构的数据空间
         zfree(o->ptr);
 		//设置hash对象新的编码方式为字典结构
         o->encoding = OBJ_ENCODING_HT;
@@ -606,11 +602,11 @@ void hashTypeConvertZiplist(robj *o, int enc) {
     }
 }
 
-/* 将对应的ziplist结构的hash对象转换成字典结构的hash对象 */
+/* 将对应的listpack结构的hash对象转换成字典结构的hash对象 */
 void hashTypeConvert(robj *o, int enc) {
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-		//实现从ziplist转换成字典类型的结构变化
-        hashTypeConvertZiplist(o, enc);
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
+		//实现从listpack转换成字典类型的结构变化
+        hashTypeConvertListpack(o, enc);
     } else if (o->encoding == OBJ_ENCODING_HT) {
         serverPanic("Not implemented");
     } else {
@@ -638,7 +634,7 @@ void hsetnxCommand(client *c) {
 	//检测键所对应的hash对象是否存在并进行创建操作处理--->即在对应的redis数据库字典中查询是否有对应的键值对对象 如果没有就创建对应的键对象
     if ((o = hashTypeLookupWriteOrCreate(c,c->argv[1])) == NULL) 
 		return;
-	//检测新引入的字段和值的内容是否引起本hash对象底层实现的变换----->即ziplist结构转换成字典结构
+	//检测新引入的字段和值的内容是否引起本hash对象底层实现的变换----->即listpack结构转换成字典结构
     hashTypeTryConversion(o,c->argv,2,3);
 	
 	//检测对应的字段是否已经在hash结构对象中
@@ -722,7 +718,7 @@ void hsetCommand(client *c) {
  * 返回值
  *     执行 HINCRBY 命令之后，哈希表中字段的值
  *
- *   通过分析对应的处理过程,发现在这个命令中出现了两次进行遍历处理(如果是ziplist的话,效率会比较低,所以数据元素多了的话,需要升级为字典结构)
+ *   通过分析对应的处理过程,发现在这个命令中出现了两次进行遍历处理(如果是listpack的话,效率会比较低,所以数据元素多了的话,需要升级为字典结构)
  *         1 首先查找对应字段所对应的老值
  *         2 将新值再次插入到hash对象中
  */
@@ -878,13 +874,13 @@ static void addHashFieldToReply(client *c, robj *o, sds field) {
     }
 
 	//根据hash对象的不同编码方式进行获取给定字段所对应的值
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 		
-		//在ziplist找查找对应字段对应的值
-        ret = hashTypeGetFromZiplist(o, field, &vstr, &vlen, &vll);
+		//在listpack找查找对应字段对应的值
+        ret = hashTypeGetFromListpack(o, field, &vstr, &vlen, &vll);
 		//检测是否查找到对应的字段
         if (ret < 0) {
 			//向客户端返回不存在的响应
@@ -1048,18 +1044,18 @@ void hstrlenCommand(client *c) {
 /* 根据对应的迭代器和标识来获取迭代器中记录的需要遍历的数据 */
 static void addHashIteratorCursorToReply(client *c, hashTypeIterator *hi, int what) {
 	//根据编码方式进行区分操作
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
-		//在ziplist中获取当前迭代器指向的数据
-        hashTypeCurrentFromZiplist(hi, what, &vstr, &vlen, &vll);
+		//在listpack中获取当前迭代器指向的数据
+        hashTypeCurrentFromListpack(hi, what, &vstr, &vlen, &vll);
 		//检测对应的数据是字符串类型还是整数类型
         if (vstr)
 			//将字符串类型数据填充到响应集合中
             addReplyBulkCBuffer(c, vstr, vlen);
         else
-			//将整数类型数据填充到响应集合中------>因为在ziplist中实现了进行将可以进行整数编码处理的字符串数据进行了整数编码处理
+			//将整数类型数据填充到响应集合中------>因为在listpack中实现了进行将可以进行整数编码处理的字符串数据进行了整数编码处理
             addReplyBulkLongLong(c, vll);
     } else if (hi->encoding == OBJ_ENCODING_HT) {
     	//在字典结构中获取当前迭代器指向的数据
@@ -1097,7 +1093,7 @@ void genericHgetallCommand(client *c, int flags) {
     hi = hashTypeInitIterator(o);
 	//循环遍历hash对象中所有的元素
     while (hashTypeNext(hi) != C_ERR) {
-		/获取迭代上对应的字段信息
+		//获取迭代上对应的字段信息
         if (flags & OBJ_HASH_KEY) {
             addHashIteratorCursorToReply(c, hi, OBJ_HASH_KEY);
             count++;
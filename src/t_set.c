@@ -756,61 +756,61 @@ int qsortCompareSetsByRevCardinality(const void *s1, const void *s2) {
     return 0;
 }
 
-void sinterGenericCommand(client *c, robj **setkeys, unsigned long setnum, robj *dstkey) {
-    robj **sets = zmalloc(sizeof(robj*)*setnum);
+/* SINTER/SINTERSTORE fast path for intsets, 'sets' sorted by cardinality.
+ * The values of the smallest set are copied into an array, that is then
+ * intersected in place with all the other sets with intsetIntersect().
+ * If 'dstset' is NULL the result is sent to the client, otherwise it is
+ * stored into 'dstset', without going through one setTypeAdd() call per
+ * element. Returns the cardinality of the intersection. */
+/* 所有集合都是整数集合时进行求交集操作处理的快速路径 */
+static unsigned long sinterIntsets(client *c, robj **sets, unsigned long setnum, robj *dstset) {
+    uint32_t len = intsetLen(sets[0]->ptr), i;
+    int64_t *values = zmalloc(sizeof(int64_t)*len);
+    unsigned long j;
+
+    for (i = 0; i < len; i++) intsetGet(sets[0]->ptr,i,values+i);
+    for (j = 1; j < setnum && len; j++) {
+        if (sets[j] == sets[0]) continue;
+        len = intsetIntersect(sets[j]->ptr,values,len);
+    }
+
+    if (!dstset) {
+        for (i = 0; i < len; i++) addReplyBulkLongLong(c,values[i]);
+    } else {
+        zfree(dstset->ptr);
+        dstset->ptr = intsetNewFromSorted(values,len);
+        if (len > server.set_max_intset_entries)
+            setTypeConvert(dstset,OBJ_ENCODING_HT);
+    }
+    zfree(values);
+    return len;
+}
+
+/* Intersect the 'setnum' sets, sorted by cardinality. If 'dstset' is NULL
+ * the elements are sent to the client, otherwise they are added to
+ * 'dstset' and 'c' is not used. Returns the cardinality of the
+ * intersection. 'job' is the background job computing it, if any: the
+ * iteration stops as soon as it is cancelled. */
+/* 计算多个集合的交集 根据dstset是否为空 决定是返回给客户端还是存储到dstset中 */
+static unsigned long sinterSets(client *c, robj **sets, unsigned long setnum, robj *dstset, setopsJob *job) {
     setTypeIterator *si;
-    robj *dstset = NULL;
     sds elesds;
     int64_t intobj;
-    void *replylen = NULL;
     unsigned long j, cardinality = 0;
     int encoding;
 
-    for (j = 0; j < setnum; j++) {
-        robj *setobj = dstkey ?
-            lookupKeyWrite(c->db,setkeys[j]) :
-            lookupKeyRead(c->db,setkeys[j]);
-        if (!setobj) {
-            zfree(sets);
-            if (dstkey) {
-                if (dbDelete(c->db,dstkey)) {
-                    signalModifiedKey(c->db,dstkey);
-                    server.dirty++;
-                }
-                addReply(c,shared.czero);
-            } else {
-                addReply(c,shared.emptymultibulk);
-            }
-            return;
-        }
-        if (checkType(c,setobj,OBJ_SET)) {
-            zfree(sets);
-            return;
-        }
-        sets[j] = setobj;
-    }
-    /* Sort sets from the smallest to largest, this will improve our
-     * algorithm's performance */
-    qsort(sets,setnum,sizeof(robj*),qsortCompareSetsByCardinality);
-
-    /* The first thing we should output is the total number of elements...
-     * since this is a multi-bulk write, but at this stage we don't know
-     * the intersection set size, so we use a trick, append an empty object
-     * to the output list and save the pointer to later modify it with the
-     * right length */
-    if (!dstkey) {
-        replylen = addDeferredMultiBulkLength(c);
-    } else {
-        /* If we have a target key where to store the resulting set
-         * create this key with an empty set inside */
-        dstset = createIntsetObject();
-    }
+    /* When all the sets are intsets, intersect their sorted arrays of
+     * integers directly. */
+    for (j = 0; j < setnum; j++)
+        if (sets[j]->encoding != OBJ_ENCODING_INTSET) break;
+    if (j == setnum) return sinterIntsets(c,sets,setnum,dstset);
 
     /* Iterate all the elements of the first (smallest) set, and test
      * the element against all the other sets, if at least one set does
      * not include the element it is discarded */
     si = setTypeInitIterator(sets[0]);
     while((encoding = setTypeNext(si,&elesds,&intobj)) != -1) {
+        if (setopsJobCancelled(job)) break;
         for (j = 1; j < setnum; j++) {
             if (sets[j] == sets[0]) continue;
             if (encoding == OBJ_ENCODING_INTSET) {
@@ -835,12 +835,11 @@ void sinterGenericCommand(client *c, robj **setkeys, unsigned long setnum, robj
 
         /* Only take action when all sets contain the member */
         if (j == setnum) {
-            if (!dstkey) {
+            if (!dstset) {
                 if (encoding == OBJ_ENCODING_HT)
                     addReplyBulkCBuffer(c,elesds,sdslen(elesds));
                 else
                     addReplyBulkLongLong(c,intobj);
-                cardinality++;
             } else {
                 if (encoding == OBJ_ENCODING_INTSET) {
                     elesds = sdsfromlonglong(intobj);
@@ -850,9 +849,106 @@ void sinterGenericCommand(client *c, robj **setkeys, unsigned long setnum, robj
                     setTypeAdd(dstset,elesds);
                 }
             }
+            cardinality++;
         }
     }
     setTypeReleaseIterator(si);
+    return cardinality;
+}
+
+/* Reply with all the elements of 'set'. */
+static void addReplySetMembers(client *c, robj *set) {
+    setTypeIterator *si;
+    sds ele;
+
+    addReplyMultiBulkLen(c,setTypeSize(set));
+    si = setTypeInitIterator(set);
+    while((ele = setTypeNextObject(si)) != NULL) {
+        addReplyBulkCBuffer(c,ele,sdslen(ele));
+        sdsfree(ele);
+    }
+    setTypeReleaseIterator(si);
+}
+
+/* SINTER/SINTERSTORE computed by the BIO_SETOPS thread, see setops.c. */
+/* 后台线程中计算集合交集的处理函数 */
+static void sinterJobProc(setopsJob *job) {
+    robj **sets = zmalloc(sizeof(robj*)*job->numsets);
+
+    /* job->sets must keep the order of the keys. */
+    memcpy(sets,job->sets,sizeof(robj*)*job->numsets);
+    qsort(sets,job->numsets,sizeof(robj*),qsortCompareSetsByCardinality);
+    job->result = createIntsetObject();
+    sinterSets(NULL,sets,job->numsets,job->result,job);
+    zfree(sets);
+}
+
+void sinterGenericCommand(client *c, robj **setkeys, unsigned long setnum, robj *dstkey) {
+    robj **sets = zmalloc(sizeof(robj*)*setnum);
+    robj *dstset = NULL;
+    void *replylen = NULL;
+    unsigned long j, cardinality = 0, minsize = ULONG_MAX;
+
+    for (j = 0; j < setnum; j++) {
+        robj *setobj = dstkey ?
+            lookupKeyWriteShared(c->db,setkeys[j]) :
+            lookupKeyRead(c->db,setkeys[j]);
+        if (!setobj) {
+            zfree(sets);
+            if (dstkey) {
+                if (dbDelete(c->db,dstkey)) {
+                    signalModifiedKey(c->db,dstkey);
+                    server.dirty++;
+                }
+                addReply(c,shared.czero);
+            } else {
+                addReply(c,shared.emptymultibulk);
+            }
+            return;
+        }
+        if (checkType(c,setobj,OBJ_SET)) {
+            zfree(sets);
+            return;
+        }
+        sets[j] = setobj;
+        if (setTypeSize(setobj) < minsize) minsize = setTypeSize(setobj);
+    }
+
+    /* Every element of the smallest set is looked up into all the other
+     * sets: compute huge intersections in background. */
+    dstset = setopsTakeResult(c,sets,setnum);
+    if (dstset == NULL &&
+        setopsShouldOffload(c,(unsigned long long)minsize*setnum))
+    {
+        setopsStartJob(setopsCreateJob(c,sets,setnum),sinterJobProc);
+        zfree(sets);
+        return;
+    }
+
+    if (dstset == NULL) {
+        /* Sort sets from the smallest to largest, this will improve our
+         * algorithm's performance */
+        qsort(sets,setnum,sizeof(robj*),qsortCompareSetsByCardinality);
+
+        /* The first thing we should output is the total number of
+         * elements... since this is a multi-bulk write, but at this stage
+         * we don't know the intersection set size, so we use a trick,
+         * append an empty object to the output list and save the pointer
+         * to later modify it with the right length */
+        if (!dstkey) {
+            replylen = addDeferredMultiBulkLength(c);
+            cardinality = sinterSets(c,sets,setnum,NULL,NULL);
+            setDeferredMultiBulkLength(c,replylen,cardinality);
+        } else {
+            /* If we have a target key where to store the resulting set
+             * create this key with an empty set inside */
+            dstset = createIntsetObject();
+            sinterSets(NULL,sets,setnum,dstset,NULL);
+        }
+    } else if (!dstkey) {
+        addReplySetMembers(c,dstset);
+        decrRefCount(dstset);
+    }
 
     if (dstkey) {
         /* Store the resulting set into the target, if the intersection
@@ -872,8 +968,6 @@ void sinterGenericCommand(client *c, robj **setkeys, unsigned long setnum, robj
         }
         signalModifiedKey(c->db,dstkey);
         server.dirty++;
-    } else {
-        setDeferredMultiBulkLength(c,replylen,cardinality);
     }
     zfree(sets);
 }
@@ -890,30 +984,18 @@ void sinterstoreCommand(client *c) {
 #define SET_OP_DIFF 1
 #define SET_OP_INTER 2
 
-void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
-                              robj *dstkey, int op) {
-    robj **sets = zmalloc(sizeof(robj*)*setnum);
+/* Compute the union or the difference of the 'setnum' sets, where NULL
+ * stands for a missing key, into a new set object that is returned.
+ * Note that the sets to subtract may be reordered. The computation stops
+ * early if the background 'job' computing it (if any) is cancelled. */
+/* 计算多个集合的并集或者差集 返回对应的结果集合对象 */
+static robj *sunionDiffCompute(robj **sets, int setnum, int op, setopsJob *job) {
     setTypeIterator *si;
-    robj *dstset = NULL;
+    robj *dstset;
     sds ele;
     int j, cardinality = 0;
     int diff_algo = 1;
 
-    for (j = 0; j < setnum; j++) {
-        robj *setobj = dstkey ?
-            lookupKeyWrite(c->db,setkeys[j]) :
-            lookupKeyRead(c->db,setkeys[j]);
-        if (!setobj) {
-            sets[j] = NULL;
-            continue;
-        }
-        if (checkType(c,setobj,OBJ_SET)) {
-            zfree(sets);
-            return;
-        }
-        sets[j] = setobj;
-    }
-
     /* Select what DIFF algorithm to use.
      *
      * Algorithm 1 is O(N*M) where N is the size of the element first set
@@ -947,9 +1029,9 @@ void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
         }
     }
 
-    /* We need a temp set object to store our union. If the dstkey
-     * is not NULL (that is, we are inside an SUNIONSTORE operation) then
-     * this set object will be the resulting object to set into the target key*/
+    /* We need a temp set object to store our union. If we are inside an
+     * SUNIONSTORE operation this set object will be the resulting object to
+     * set into the target key*/
     dstset = createIntsetObject();
 
     if (op == SET_OP_UNION) {
@@ -960,6 +1042,10 @@ void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
 
             si = setTypeInitIterator(sets[j]);
             while((ele = setTypeNextObject(si)) != NULL) {
+                if (setopsJobCancelled(job)) {
+                    sdsfree(ele);
+                    break;
+                }
                 if (setTypeAdd(dstset,ele)) cardinality++;
                 sdsfree(ele);
             }
@@ -976,6 +1062,10 @@ void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
          * the first set, and M the number of sets. */
         si = setTypeInitIterator(sets[0]);
         while((ele = setTypeNextObject(si)) != NULL) {
+            if (setopsJobCancelled(job)) {
+                sdsfree(ele);
+                break;
+            }
             for (j = 1; j < setnum; j++) {
                 if (!sets[j]) continue; /* no key is an empty set. */
                 if (sets[j] == sets[0]) break; /* same set! */
@@ -1002,6 +1092,10 @@ void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
 
             si = setTypeInitIterator(sets[j]);
             while((ele = setTypeNextObject(si)) != NULL) {
+                if (setopsJobCancelled(job)) {
+                    sdsfree(ele);
+                    break;
+                }
                 if (j == 0) {
                     if (setTypeAdd(dstset,ele)) cardinality++;
                 } else {
@@ -1017,15 +1111,59 @@ void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
         }
     }
 
+    return dstset;
+}
+
+/* SUNION/SDIFF and their STORE variants computed by the BIO_SETOPS thread,
+ * see setops.c. */
+/* 后台线程中计算集合并集或者差集的处理函数 */
+static void sunionDiffJobProc(setopsJob *job) {
+    robj **sets = zmalloc(sizeof(robj*)*job->numsets);
+
+    /* job->sets must keep the order of the keys. */
+    memcpy(sets,job->sets,sizeof(robj*)*job->numsets);
+    job->result = sunionDiffCompute(sets,job->numsets,job->op,job);
+    zfree(sets);
+}
+
+void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
+                              robj *dstkey, int op) {
+    robj **sets = zmalloc(sizeof(robj*)*setnum);
+    robj *dstset = NULL;
+    unsigned long long work = 0;
+    int j;
+
+    for (j = 0; j < setnum; j++) {
+        robj *setobj = dstkey ?
+            lookupKeyWriteShared(c->db,setkeys[j]) :
+            lookupKeyRead(c->db,setkeys[j]);
+        if (!setobj) {
+            sets[j] = NULL;
+            continue;
+        }
+        if (checkType(c,setobj,OBJ_SET)) {
+            zfree(sets);
+            return;
+        }
+        sets[j] = setobj;
+        work += setTypeSize(setobj);
+    }
+
+    /* Compute huge unions and differences in background. */
+    dstset = setopsTakeResult(c,sets,setnum);
+    if (dstset == NULL && setopsShouldOffload(c,work)) {
+        setopsJob *job = setopsCreateJob(c,sets,setnum);
+
+        job->op = op;
+        setopsStartJob(job,sunionDiffJobProc);
+        zfree(sets);
+        return;
+    }
+    if (dstset == NULL) dstset = sunionDiffCompute(sets,setnum,op,NULL);
+
     /* Output the content of the resulting set, if not in STORE mode */
     if (!dstkey) {
-        addReplyMultiBulkLen(c,cardinality);
-        si = setTypeInitIterator(dstset);
-        while((ele = setTypeNextObject(si)) != NULL) {
-            addReplyBulkCBuffer(c,ele,sdslen(ele));
-            sdsfree(ele);
-        }
-        setTypeReleaseIterator(si);
+        addReplySetMembers(c,dstset);
         decrRefCount(dstset);
     } else {
         /* If we have a target key where to store the resulting set
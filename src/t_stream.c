@@ -7,6 +7,8 @@
 #include "stream.h"
 
 #define STREAM_BYTES_PER_LISTPACK 2048
+/* Nodes with at most this number of entries are never compacted. */
+#define STREAM_COMPACT_MIN_ENTRIES 10
 
 /* Every stream item inside the listpack, has a flags field that is used to
  * mark the entry as deleted, or having the same field as the "master"
@@ -16,8 +18,7 @@
 #define STREAM_ITEM_FLAG_SAMEFIELDS (1<<1)  /* Same fields as master entry. */
 
 void streamFreeCG(streamCG *cg);
-void streamFreeNACK(streamNACK *na);
-size_t streamReplyWithRangeFromConsumerPEL(client *c, stream *s, streamID *start, streamID *end, size_t count, streamConsumer *consumer);
+size_t streamReplyWithRangeFromConsumerPEL(client *c, stream *s, streamID *start, streamID *end, size_t count, streamCG *group, streamConsumer *consumer);
 
 /* -----------------------------------------------------------------------
  * Low level stream encoding: a radix tree of listpacks.
@@ -335,6 +336,83 @@ int streamAppendItem(stream *s, robj **argv, int64_t numfields, streamID *added_
     return C_OK;
 }
 
+/* Rewrite the listpack 'lp' of a stream node without the entries flagged
+ * as deleted, returning the new listpack. The old one is freed. The master
+ * entry is copied as it is, except for the deleted counter that becomes
+ * zero, so the IDs and the compressed fields of the entries still refer
+ * to it and the live entries can be copied verbatim. */
+unsigned char *streamCompactListpack(unsigned char *lp) {
+    unsigned char buf[LP_INTBUF_SIZE], *e;
+    int64_t e_len;
+    unsigned char *new = lpNew();
+    unsigned char *p = lpFirst(lp);
+
+    /* Master entry: count, deleted, num-fields, fields..., zero. */
+    new = lpAppendInteger(new,lpGetInteger(p));
+    p = lpNext(lp,p);
+    new = lpAppendInteger(new,0);
+    p = lpNext(lp,p);
+    int64_t master_fields_count = lpGetInteger(p);
+    for (int64_t j = 0; j < master_fields_count+2; j++) {
+        e = lpGet(p,&e_len,buf);
+        new = lpAppend(new,e,e_len);
+        p = lpNext(lp,p);
+    }
+
+    /* Copy all the entries not flagged as deleted, including their
+     * final lp-count field. */
+    while(p) {
+        int flags = lpGetInteger(p);
+        unsigned char *q = p;
+        int64_t to_copy;
+
+        q = lpNext(lp,q); /* Skip ID ms delta. */
+        q = lpNext(lp,q); /* Skip ID seq delta. */
+        q = lpNext(lp,q); /* Seek num-fields or values (if compressed). */
+        if (flags & STREAM_ITEM_FLAG_SAMEFIELDS)
+            to_copy = master_fields_count;
+        else
+            to_copy = 1+lpGetInteger(q)*2;
+        to_copy += 4; /* flags + ms-diff + seq-diff + lp-count. */
+
+        while(to_copy--) {
+            if (!(flags & STREAM_ITEM_FLAG_DELETED)) {
+                e = lpGet(p,&e_len,buf);
+                new = lpAppend(new,e,e_len);
+            }
+            p = lpNext(lp,p);
+        }
+    }
+    lpFree(lp);
+    return new;
+}
+
+/* 当节点中被删除条目的比例超过阈值时 重写节点的listpack回收空间 */
+/* Compact the listpack 'lp' of a stream node having 'valid' live entries
+ * and 'deleted' entries flagged as deleted, if the deleted entries are at
+ * least the 'stream-node-compact-percent' of the total. Deleted entries are
+ * only flagged, so without this a stream used as a queue with XDEL keeps
+ * the memory of its deleted entries until all the entries of the node
+ * are gone. Since after the rewrite the node has no deleted entries, the
+ * work done is amortized on the deletions that made the node eligible.
+ *
+ * The function returns the listpack to store in the node, that is 'lp'
+ * itself if the node was not compacted. */
+unsigned char *streamCompactNodeIfNeeded(unsigned char *lp, int64_t valid,
+                                         int64_t deleted)
+{
+    if (server.stream_node_compact_percent == 0 ||
+        valid + deleted <= STREAM_COMPACT_MIN_ENTRIES ||
+        deleted*100 < (valid+deleted)*server.stream_node_compact_percent)
+        return lp;
+
+    size_t oldbytes = lpBytes(lp);
+    lp = streamCompactListpack(lp);
+    server.stat_stream_nodes_compacted++;
+    server.stat_stream_compacted_bytes += oldbytes - lpBytes(lp);
+    return lp;
+}
+
 /* Trim the stream 's' to have no more than maxlen elements, and return the
  * number of elements removed from the stream. The 'approx' option, if non-zero,
  * specifies that the trimming must be performed in a approximated way in
@@ -423,13 +501,11 @@ int64_t streamTrimByLength(stream *s, size_t maxlen, int approx) {
             p = lpNext(lp,p); /* Skip the final lp-count field. */
         }
 
-        /* Here we should perform garbage collection in case at this point
-         * there are too many entries deleted inside the listpack. */
+        /* Reclaim the space of the deleted entries if there are too many
+         * of them inside the listpack. */
         entries -= to_delete;
         marked_deleted += to_delete;
-        if (entries + marked_deleted > 10 && marked_deleted > entries/2) {
-            /* TODO: perform a garbage collection. */
-        }
+        lp = streamCompactNodeIfNeeded(lp,entries,marked_deleted);
 
         /* Update the listpack with the new pointer. */
         raxInsert(s->rax,ri.key,ri.key_len,lp,NULL);
@@ -699,11 +775,15 @@ void streamIteratorRemoveEntry(streamIterator *si, streamID *current) {
         raxRemove(si->stream->rax,si->ri.key,si->ri.key_len,NULL);
     } else {
         /* In the base case we alter the counters of valid/deleted entries. */
-        lp = lpReplaceInteger(lp,&p,aux-1);
+        int64_t valid = aux-1;
+        lp = lpReplaceInteger(lp,&p,valid);
         p = lpNext(lp,p); /* Seek deleted field. */
         aux = lpGetInteger(p);
         lp = lpReplaceInteger(lp,&p,aux+1);
 
+        /* Reclaim the space of the deleted entries if needed. */
+        lp = streamCompactNodeIfNeeded(lp,valid,aux+1);
+
         /* Update the listpack with the new pointer. */
         if (si->lp != lp)
             raxInsert(si->stream->rax,si->ri.key,si->ri.key_len,lp,NULL);
@@ -723,9 +803,6 @@ void streamIteratorRemoveEntry(streamIterator *si, streamID *current) {
     }
     streamIteratorStop(si);
     streamIteratorStart(si,si->stream,&start,&end,si->rev);
-
-    /* TODO: perform a garbage collection here if the ration between
-     * deleted and valid goes over a certain limit. */
 }
 
 /* Stop the stream iterator. The only cleanup we need is to free the rax
@@ -880,6 +957,9 @@ size_t streamReplyWithRange(client *c, stream *s, streamID *start, streamID *end
     int64_t numfields;
     streamID id;
     int propagate_last_id = 0;
+    /* All the entries delivered by the same call share the delivery time,
+     * so that they are stored in the same run of the PEL. */
+    mstime_t now = group ? mstime() : 0;
 
     /* If the client is asking for some history, we serve it using a
      * different function, so that we return entries *solely* from its
@@ -888,7 +968,7 @@ size_t streamReplyWithRange(client *c, stream *s, streamID *start, streamID *end
      * as delivered. */
     if (group && (flags & STREAM_RWR_HISTORY)) {
         return streamReplyWithRangeFromConsumerPEL(c,s,start,end,count,
-                                                   consumer);
+                                                   group,consumer);
     }
 
     if (!(flags & STREAM_RWR_RAWENTRIES))
@@ -926,40 +1006,17 @@ size_t streamReplyWithRange(client *c, stream *s, streamID *start, streamID *end
          * a NACK for the entry, we need to associate it to the new
          * consumer. */
         if (group && !(flags & STREAM_RWR_NOACK)) {
-            unsigned char buf[sizeof(streamID)];
-            streamEncodeID(buf,&id);
-
-            /* Try to add a new NACK. Most of the time this will work and
-             * will not require extra lookups. We'll fix the problem later
-             * if we find that there is already a entry for this ID. */
-            streamNACK *nack = streamCreateNACK(consumer);
-            int group_inserted =
-                raxTryInsert(group->pel,buf,sizeof(buf),nack,NULL);
-            int consumer_inserted =
-                raxTryInsert(consumer->pel,buf,sizeof(buf),nack,NULL);
-
-            /* Now we can check if the entry was already busy, and
-             * in that case reassign the entry to the new consumer,
-             * or update it if the consumer is the same as before. */
-            if (group_inserted == 0) {
-                streamFreeNACK(nack);
-                nack = raxFind(group->pel,buf,sizeof(buf));
-                serverAssert(nack != raxNotFound);
-                raxRemove(nack->consumer->pel,buf,sizeof(buf),NULL);
-                /* Update the consumer and NACK metadata. */
-                nack->consumer = consumer;
-                nack->delivery_time = mstime();
-                nack->delivery_count = 1;
-                /* Add the entry in the new consumer local PEL. */
-                raxInsert(consumer->pel,buf,sizeof(buf),nack,NULL);
-            } else if (group_inserted == 1 && consumer_inserted == 0) {
-                serverPanic("NACK half-created. Should not be possible.");
-            }
+            /* Add the entry to the PEL. If it was already there, it is
+             * reassigned to the new consumer, or updated if the consumer
+             * is the same as before. */
+            streamNACK nack = {now, 1, consumer};
+            streamPELAdd(group,&id,consumer,nack.delivery_time,
+                         nack.delivery_count);
 
             /* Propagate as XCLAIM. */
             if (spi) {
                 robj *idarg = createObjectFromStreamID(&id);
-                streamPropagateXCLAIM(c,spi->keyname,group,spi->groupname,idarg,nack);
+                streamPropagateXCLAIM(c,spi->keyname,group,spi->groupname,idarg,&nack);
                 decrRefCount(idarg);
             }
         } else {
@@ -988,21 +1045,20 @@ size_t streamReplyWithRange(client *c, stream *s, streamID *start, streamID *end
  * seek into the radix tree of the messages in order to emit the full message
  * to the client. However clients only reach this code path when they are
  * fetching the history of already retrieved messages, which is rare. */
-size_t streamReplyWithRangeFromConsumerPEL(client *c, stream *s, streamID *start, streamID *end, size_t count, streamConsumer *consumer) {
-    raxIterator ri;
-    unsigned char startkey[sizeof(streamID)];
-    unsigned char endkey[sizeof(streamID)];
-    streamEncodeID(startkey,start);
-    if (end) streamEncodeID(endkey,end);
+size_t streamReplyWithRangeFromConsumerPEL(client *c, stream *s, streamID *start, streamID *end, size_t count, streamCG *group, streamConsumer *consumer) {
+    streamPELIterator pi;
+    streamNACK *nack;
+    streamID thisid, static_ids[16], *ids = static_ids;
+    uint64_t static_counts[16], *counts = static_counts;
+    size_t alloc = 16, updated = 0;
 
     size_t arraylen = 0;
     void *arraylen_ptr = addDeferredMultiBulkLength(c);
-    raxStart(&ri,consumer->pel);
-    raxSeek(&ri,">=",startkey,sizeof(startkey));
-    while(raxNext(&ri) && (!count || arraylen < count)) {
-        if (end && memcmp(ri.key,end,ri.key_len) > 0) break;
-        streamID thisid;
-        streamDecodeID(ri.key,&thisid);
+    streamPELIteratorStart(&pi,group,consumer,start);
+    while((!count || arraylen < count) &&
+          streamPELIteratorNext(&pi,&thisid,&nack))
+    {
+        if (end && streamCompareID(&thisid,end) > 0) break;
         if (streamReplyWithRange(c,s,&thisid,&thisid,1,0,NULL,NULL,
                                  STREAM_RWR_RAWENTRIES,NULL) == 0)
         {
@@ -1011,18 +1067,38 @@ size_t streamReplyWithRangeFromConsumerPEL(client *c, stream *s, streamID *start
              * by the user by other means. In that case we signal it emitting
              * the ID but then a NULL entry for the fields. */
             addReplyMultiBulkLen(c,2);
-            streamID id;
-            streamDecodeID(ri.key,&id);
-            addReplyStreamID(c,&id);
+            addReplyStreamID(c,&thisid);
             addReply(c,shared.nullmultibulk);
         } else {
-            streamNACK *nack = ri.data;
-            nack->delivery_time = mstime();
-            nack->delivery_count++;
+            /* The PEL can't be modified while iterating it, so remember
+             * the delivered entries and update them later. */
+            if (updated == alloc) {
+                alloc *= 2;
+                if (ids == static_ids) {
+                    ids = zmalloc(sizeof(streamID)*alloc);
+                    counts = zmalloc(sizeof(uint64_t)*alloc);
+                    memcpy(ids,static_ids,sizeof(static_ids));
+                    memcpy(counts,static_counts,sizeof(static_counts));
+                } else {
+                    ids = zrealloc(ids,sizeof(streamID)*alloc);
+                    counts = zrealloc(counts,sizeof(uint64_t)*alloc);
+                }
+            }
+            ids[updated] = thisid;
+            counts[updated++] = nack->delivery_count;
         }
         arraylen++;
     }
-    raxStop(&ri);
+    streamPELIteratorStop(&pi);
+
+    /* Update the delivery time and count of the delivered entries. */
+    mstime_t now = mstime();
+    for (size_t j = 0; j < updated; j++)
+        streamPELAdd(group,&ids[j],consumer,now,counts[j]+1);
+    if (ids != static_ids) {
+        zfree(ids);
+        zfree(counts);
+    }
     setDeferredMultiBulkLength(c,arraylen_ptr,arraylen);
     return arraylen;
 }
@@ -1569,33 +1645,532 @@ cleanup: /* Cleanup. */
 }
 
 /* -----------------------------------------------------------------------
- * Low level implementation of consumer groups
+ * Pending entries list (PEL) of consumer groups
  * ----------------------------------------------------------------------- */
 
-/* Create a NACK entry setting the delivery count to 1 and the delivery
- * time to the current time. The NACK consumer will be set to the one
- * specified as argument of the function. */
-streamNACK *streamCreateNACK(streamConsumer *consumer) {
-    streamNACK *nack = zmalloc(sizeof(*nack));
-    nack->delivery_time = mstime();
-    nack->delivery_count = 1;
-    nack->consumer = consumer;
-    return nack;
+/* Instead of allocating a NACK structure for every pending message, and
+ * referencing it in two radix trees (the group and the consumer PEL), the
+ * pending messages of a group are stored in blocks of up to
+ * STREAM_PEL_BLOCK_MAX consecutive IDs. Messages delivered together by the
+ * same XREADGROUP call share the same consumer, delivery time and count, so
+ * every block stores a sorted array of IDs, and an array of "runs" of
+ * messages having the same delivery info.
+ *
+ * The group PEL maps the start ID of every block to the block, while the
+ * consumer PEL just maps the start ID of the blocks having messages of the
+ * consumer, to the number of such messages. Note that the start ID of a
+ * block is not changed when its first message is acknowledged, so that
+ * the keys of the consumer PELs remain valid.
+ *
+ * Full blocks are split in two halves when messages are inserted in the
+ * middle, and a block with less than STREAM_PEL_BLOCK_LOW messages left
+ * after an acknowledge is merged with one of its neighbours if they fit in a
+ * single block, so that a PEL acknowledged out of order does not end as
+ * many almost empty blocks. */
+
+#define STREAM_PEL_BLOCK_MAX 128
+#define STREAM_PEL_BLOCK_LOW (STREAM_PEL_BLOCK_MAX/4)
+
+static int streamNACKCompare(streamNACK *a, streamNACK *b) {
+    return a->consumer == b->consumer &&
+           a->delivery_time == b->delivery_time &&
+           a->delivery_count == b->delivery_count;
+}
+
+/* Create a new empty PEL block having the specified start ID. */
+static streamPELBlock *streamPELBlockNew(streamID *start) {
+    streamPELBlock *b = zmalloc(sizeof(*b));
+    b->start = *start;
+    b->count = 0;
+    b->numruns = 0;
+    b->ids = NULL;
+    b->runs = NULL;
+    return b;
+}
+
+/* Free a PEL block. */
+void streamPELBlockFree(streamPELBlock *b) {
+    zfree(b->ids);
+    zfree(b->runs);
+    zfree(b);
+}
+
+/* Return the index of the run having the message at index 'idx' of the
+ * block, storing in '*pos' the index of the first message of the run. */
+static uint32_t streamPELBlockRunAt(streamPELBlock *b, uint32_t idx,
+                                    uint32_t *pos)
+{
+    uint32_t r = 0, p = 0;
+    while(p + b->runs[r].len <= idx) p += b->runs[r++].len;
+    *pos = p;
+    return r;
+}
+
+/* Insert a run of 'len' messages with the delivery info 'nack' at the
+ * index 'r' of the runs of the block. */
+static void streamPELBlockInsertRun(streamPELBlock *b, uint32_t r,
+                                    streamNACK *nack, uint32_t len)
+{
+    b->runs = zrealloc(b->runs,sizeof(streamPELRun)*(b->numruns+1));
+    memmove(b->runs+r+1,b->runs+r,sizeof(streamPELRun)*(b->numruns-r));
+    b->runs[r].nack = *nack;
+    b->runs[r].len = len;
+    b->numruns++;
+}
+
+/* Remove the run at index 'r' of the runs of the block. */
+static void streamPELBlockRemoveRun(streamPELBlock *b, uint32_t r) {
+    memmove(b->runs+r,b->runs+r+1,sizeof(streamPELRun)*(b->numruns-r-1));
+    b->numruns--;
+    if (b->numruns) {
+        b->runs = zrealloc(b->runs,sizeof(streamPELRun)*b->numruns);
+    } else {
+        zfree(b->runs);
+        b->runs = NULL;
+    }
+}
+
+/* Split the run having the message at index 'idx' so that a run starts at
+ * such message, and return the index of this run. If 'idx' is the number
+ * of messages of the block, the number of runs is returned. */
+static uint32_t streamPELBlockSplit(streamPELBlock *b, uint32_t idx) {
+    if (idx == b->count) return b->numruns;
+
+    uint32_t pos, r = streamPELBlockRunAt(b,idx,&pos);
+    if (pos == idx) return r;
+    streamNACK nack = b->runs[r].nack;
+    streamPELBlockInsertRun(b,r+1,&nack,b->runs[r].len-(idx-pos));
+    b->runs[r].len = idx-pos;
+    return r+1;
+}
+
+/* Merge the run at index 'r' with the adjacent runs if they have the same
+ * delivery info. */
+static void streamPELBlockMerge(streamPELBlock *b, uint32_t r) {
+    if (r+1 < b->numruns &&
+        streamNACKCompare(&b->runs[r].nack,&b->runs[r+1].nack))
+    {
+        b->runs[r].len += b->runs[r+1].len;
+        streamPELBlockRemoveRun(b,r+1);
+    }
+    if (r > 0 && r < b->numruns &&
+        streamNACKCompare(&b->runs[r-1].nack,&b->runs[r].nack))
+    {
+        b->runs[r-1].len += b->runs[r].len;
+        streamPELBlockRemoveRun(b,r);
+    }
+}
+
+/* Search the ID 'id' in the block. Returns 1 if found, 0 otherwise. In both
+ * cases '*idx' is set to the index of the first ID >= 'id'. */
+static int streamPELBlockSearch(streamPELBlock *b, streamID *id,
+                                uint32_t *idx)
+{
+    uint32_t lo = 0, hi = b->count;
+
+    /* Most of the times messages are added at the end. */
+    if (b->count && streamCompareID(&b->ids[b->count-1],id) < 0) {
+        *idx = b->count;
+        return 0;
+    }
+    while(lo < hi) {
+        uint32_t mid = lo+(hi-lo)/2;
+        if (streamCompareID(&b->ids[mid],id) < 0)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    *idx = lo;
+    return lo < b->count && streamCompareID(&b->ids[lo],id) == 0;
+}
+
+/* Insert the message 'id' at index 'idx' of the block. */
+static void streamPELBlockInsert(streamPELBlock *b, uint32_t idx,
+                                 streamID *id, streamNACK *nack)
+{
+    uint32_t r = streamPELBlockSplit(b,idx);
+    streamPELBlockInsertRun(b,r,nack,1);
+    b->ids = zrealloc(b->ids,sizeof(streamID)*(b->count+1));
+    memmove(b->ids+idx+1,b->ids+idx,sizeof(streamID)*(b->count-idx));
+    b->ids[idx] = *id;
+    b->count++;
+    streamPELBlockMerge(b,r);
+}
+
+/* Remove the message at index 'idx' of the block. */
+static void streamPELBlockRemove(streamPELBlock *b, uint32_t idx) {
+    uint32_t r = streamPELBlockSplit(b,idx);
+    streamPELBlockSplit(b,idx+1);
+    streamPELBlockRemoveRun(b,r);
+    memmove(b->ids+idx,b->ids+idx+1,sizeof(streamID)*(b->count-idx-1));
+    b->count--;
+    if (b->count) {
+        b->ids = zrealloc(b->ids,sizeof(streamID)*b->count);
+        if (r > 0) streamPELBlockMerge(b,r-1);
+    } else {
+        zfree(b->ids);
+        b->ids = NULL;
+    }
+}
+
+/* Set the delivery info of the message at index 'idx' of the block. */
+static void streamPELBlockSet(streamPELBlock *b, uint32_t idx,
+                              streamNACK *nack)
+{
+    uint32_t r = streamPELBlockSplit(b,idx);
+    streamPELBlockSplit(b,idx+1);
+    b->runs[r].nack = *nack;
+    streamPELBlockMerge(b,r);
+}
+
+/* Add 'delta' to the number of messages of 'consumer' inside the block
+ * with the specified start ID, updating the consumer PEL. */
+static void streamPELConsumerIncr(streamConsumer *consumer, streamID *start,
+                                  int64_t delta)
+{
+    if (consumer == NULL) return; /* Messages loaded but not yet owned. */
+
+    unsigned char buf[sizeof(streamID)];
+    streamEncodeID(buf,start);
+    void *count = raxFind(consumer->pel,buf,sizeof(buf));
+    uintptr_t n = (count == raxNotFound) ? 0 : (uintptr_t)count;
+    n += delta;
+    if (n)
+        raxInsert(consumer->pel,buf,sizeof(buf),(void*)n,NULL);
+    else
+        raxRemove(consumer->pel,buf,sizeof(buf),NULL);
+    consumer->pel_size += delta;
+}
+
+/* Move the runs of the block 'b' starting at index 'r' to the block 'dst',
+ * that is empty or only has smaller IDs. */
+static void streamPELBlockMoveRuns(streamPELBlock *b, uint32_t r,
+                                   streamPELBlock *dst)
+{
+    uint32_t pos = 0, moved = 0;
+    for (uint32_t j = 0; j < r; j++) pos += b->runs[j].len;
+    for (uint32_t j = r; j < b->numruns; j++) {
+        streamPELRun *run = &b->runs[j];
+        streamPELConsumerIncr(run->nack.consumer,&b->start,
+                              -(int64_t)run->len);
+        streamPELConsumerIncr(run->nack.consumer,&dst->start,run->len);
+        streamPELBlockInsertRun(dst,dst->numruns,&run->nack,run->len);
+        moved += run->len;
+    }
+    dst->ids = zrealloc(dst->ids,sizeof(streamID)*(dst->count+moved));
+    memcpy(dst->ids+dst->count,b->ids+pos,sizeof(streamID)*moved);
+    dst->count += moved;
+    b->count -= moved;
+    b->numruns = r;
+    if (b->count) {
+        b->ids = zrealloc(b->ids,sizeof(streamID)*b->count);
+        b->runs = zrealloc(b->runs,sizeof(streamPELRun)*b->numruns);
+    } else {
+        zfree(b->ids);
+        zfree(b->runs);
+        b->ids = NULL;
+        b->runs = NULL;
+    }
+}
+
+/* Move all the messages of the block 'src' at the end of the block 'dst',
+ * that only has smaller IDs. The caller should then remove 'src' from the
+ * group PEL. */
+static void streamPELBlockAppend(streamPELBlock *dst, streamPELBlock *src) {
+    uint32_t r = dst->numruns;
+    streamPELBlockMoveRuns(src,0,dst);
+    if (r > 0) streamPELBlockMerge(dst,r);
+}
+
+/* Merge the block 'b', that has less than STREAM_PEL_BLOCK_LOW messages,
+ * with the previous or the next block of the group PEL if the messages of
+ * both fit in a single block. */
+static void streamPELBlockCompact(streamCG *cg, streamPELBlock *b) {
+    unsigned char buf[sizeof(streamID)];
+    streamPELBlock *prev = NULL, *next = NULL;
+    raxIterator ri;
+
+    streamEncodeID(buf,&b->start);
+    raxStart(&ri,cg->pel);
+    raxSeek(&ri,"<",buf,sizeof(buf));
+    if (raxNext(&ri)) prev = ri.data;
+    raxSeek(&ri,">",buf,sizeof(buf));
+    if (raxNext(&ri)) next = ri.data;
+    raxStop(&ri);
+
+    if (prev && prev->count + b->count <= STREAM_PEL_BLOCK_MAX) {
+        streamPELBlockAppend(prev,b);
+        raxRemove(cg->pel,buf,sizeof(buf),NULL);
+        streamPELBlockFree(b);
+    } else if (next && b->count + next->count <= STREAM_PEL_BLOCK_MAX) {
+        streamPELBlockAppend(b,next);
+        streamEncodeID(buf,&next->start);
+        raxRemove(cg->pel,buf,sizeof(buf),NULL);
+        streamPELBlockFree(next);
+    }
+}
+
+/* Return the block of the group PEL that should contain 'id', that is the
+ * one with the greatest start ID <= 'id', or NULL if there is no such
+ * block. */
+static streamPELBlock *streamPELLookupBlock(streamCG *cg, streamID *id) {
+    unsigned char buf[sizeof(streamID)];
+    streamPELBlock *b = NULL;
+    raxIterator ri;
+
+    streamEncodeID(buf,id);
+    raxStart(&ri,cg->pel);
+    raxSeek(&ri,"<=",buf,sizeof(buf));
+    if (raxNext(&ri)) b = ri.data;
+    raxStop(&ri);
+    return b;
+}
+
+/* Return the delivery info of the pending message 'id' of the group, or
+ * NULL if the message is not pending. The returned structure is shared with
+ * other messages and is only valid until the PEL is modified. */
+streamNACK *streamPELFind(streamCG *cg, streamID *id) {
+    streamPELBlock *b = streamPELLookupBlock(cg,id);
+    uint32_t idx, pos;
+    if (b == NULL || !streamPELBlockSearch(b,id,&idx)) return NULL;
+    return &b->runs[streamPELBlockRunAt(b,idx,&pos)].nack;
+}
+
+/* Add the message 'id' to the group PEL, delivered to 'consumer' at the
+ * specified time and with the specified count. If the message is already
+ * pending, its delivery info is updated, and it is moved to the PEL of
+ * 'consumer' if needed. The consumer can be NULL when loading the PEL,
+ * but it must be set later with another call.
+ *
+ * Returns 1 if the message was added, 0 if it was already pending. */
+int streamPELAdd(streamCG *cg, streamID *id, streamConsumer *consumer,
+                 mstime_t delivery_time, uint64_t delivery_count)
+{
+    streamNACK nack = {delivery_time, delivery_count, consumer};
+    streamPELBlock *b = streamPELLookupBlock(cg,id);
+    uint32_t idx;
+
+    if (b && streamPELBlockSearch(b,id,&idx)) {
+        uint32_t pos;
+        streamNACK *old = &b->runs[streamPELBlockRunAt(b,idx,&pos)].nack;
+        if (old->consumer != consumer) {
+            streamPELConsumerIncr(old->consumer,&b->start,-1);
+            streamPELConsumerIncr(consumer,&b->start,1);
+        }
+        streamPELBlockSet(b,idx,&nack);
+        return 0;
+    }
+
+    unsigned char buf[sizeof(streamID)];
+    if (b == NULL) {
+        /* The ID is smaller than the start of all the blocks: we can
+         * change the start of the first block if it has room, otherwise
+         * we create a new block. */
+        raxIterator ri;
+        raxStart(&ri,cg->pel);
+        raxSeek(&ri,"^",NULL,0);
+        if (raxNext(&ri) &&
+            ((streamPELBlock*)ri.data)->count < STREAM_PEL_BLOCK_MAX)
+        {
+            streamPELBlock *first = ri.data;
+            b = streamPELBlockNew(id);
+            streamPELBlockMoveRuns(first,0,b);
+            raxRemove(cg->pel,ri.key,ri.key_len,NULL);
+            streamPELBlockFree(first);
+        } else {
+            b = streamPELBlockNew(id);
+        }
+        raxStop(&ri);
+        streamEncodeID(buf,id);
+        raxInsert(cg->pel,buf,sizeof(buf),b,NULL);
+        idx = 0;
+    } else if (b->count == STREAM_PEL_BLOCK_MAX) {
+        /* The block is full. If the ID is the greatest one we just start
+         * a new block, so that blocks filled in order remain full,
+         * otherwise we split the block in two halves. */
+        streamPELBlock *nb;
+        if (idx == b->count) {
+            nb = streamPELBlockNew(id);
+            idx = 0;
+        } else {
+            uint32_t half = b->count/2;
+            nb = streamPELBlockNew(&b->ids[half]);
+            streamPELBlockMoveRuns(b,streamPELBlockSplit(b,half),nb);
+        }
+        streamEncodeID(buf,&nb->start);
+        raxInsert(cg->pel,buf,sizeof(buf),nb,NULL);
+
+        /* Note that an ID inserted just before the start of the new
+         * block goes at the end of the old one. */
+        if (idx > b->count) {
+            idx -= b->count;
+            b = nb;
+        } else if (nb->count == 0) {
+            b = nb;
+        }
+    }
+    streamPELBlockInsert(b,idx,id,&nack);
+    streamPELConsumerIncr(consumer,&b->start,1);
+    cg->pel_size++;
+    return 1;
+}
+
+/* Remove the message 'id' from the group PEL and from the PEL of its
+ * consumer. Returns 1 if the message was pending, 0 otherwise. */
+int streamPELDelete(streamCG *cg, streamID *id) {
+    streamPELBlock *b = streamPELLookupBlock(cg,id);
+    uint32_t idx, pos;
+    if (b == NULL || !streamPELBlockSearch(b,id,&idx)) return 0;
+
+    streamConsumer *consumer =
+        b->runs[streamPELBlockRunAt(b,idx,&pos)].nack.consumer;
+    streamPELBlockRemove(b,idx);
+    streamPELConsumerIncr(consumer,&b->start,-1);
+    if (b->count == 0) {
+        unsigned char buf[sizeof(streamID)];
+        streamEncodeID(buf,&b->start);
+        raxRemove(cg->pel,buf,sizeof(buf),NULL);
+        streamPELBlockFree(b);
+    } else if (b->count < STREAM_PEL_BLOCK_LOW) {
+        streamPELBlockCompact(cg,b);
+    }
+    cg->pel_size--;
+    return 1;
 }
 
-/* Free a NACK entry. */
-void streamFreeNACK(streamNACK *na) {
-    zfree(na);
+/* Remove all the pending messages of 'consumer' from the group PEL. The
+ * consumer PEL is left as it is, since this is only used when deleting
+ * the consumer. */
+static void streamPELDeleteConsumer(streamCG *cg, streamConsumer *consumer) {
+    raxIterator ri;
+    raxStart(&ri,consumer->pel);
+    raxSeek(&ri,"^",NULL,0);
+    while(raxNext(&ri)) {
+        streamPELBlock *b = raxFind(cg->pel,ri.key,ri.key_len);
+        serverAssert(b != raxNotFound);
+
+        /* Compact the IDs and the runs not about the consumer, merging
+         * the runs that become adjacent. */
+        uint32_t src = 0, dst = 0, w = 0;
+        for (uint32_t r = 0; r < b->numruns; r++) {
+            streamPELRun run = b->runs[r];
+            if (run.nack.consumer != consumer) {
+                memmove(b->ids+dst,b->ids+src,sizeof(streamID)*run.len);
+                if (w && streamNACKCompare(&b->runs[w-1].nack,&run.nack))
+                    b->runs[w-1].len += run.len;
+                else
+                    b->runs[w++] = run;
+                dst += run.len;
+            }
+            src += run.len;
+        }
+        cg->pel_size -= b->count-dst;
+        b->count = dst;
+        b->numruns = w;
+
+        if (b->count == 0) {
+            raxRemove(cg->pel,ri.key,ri.key_len,NULL);
+            streamPELBlockFree(b);
+        } else {
+            b->ids = zrealloc(b->ids,sizeof(streamID)*b->count);
+            b->runs = zrealloc(b->runs,sizeof(streamPELRun)*b->numruns);
+        }
+    }
+    raxStop(&ri);
+    consumer->pel_size = 0;
 }
 
+/* Load the block at the current position of the PEL iterator. */
+static void streamPELIteratorLoadBlock(streamPELIterator *pi) {
+    if (pi->consumer) {
+        pi->block = raxFind(pi->cg->pel,pi->ri.key,pi->ri.key_len);
+        serverAssert(pi->block != raxNotFound);
+    } else {
+        pi->block = pi->ri.data;
+    }
+    pi->idx = pi->run = pi->runpos = 0;
+}
+
+/* Initialize an iterator of the pending messages of the group 'cg' with
+ * ID >= 'start', or all of them if 'start' is NULL. If 'consumer' is not
+ * NULL, only the messages of such consumer are returned. The PEL must not
+ * be modified while iterating it. */
+void streamPELIteratorStart(streamPELIterator *pi, streamCG *cg,
+                            streamConsumer *consumer, streamID *start)
+{
+    pi->cg = cg;
+    pi->consumer = consumer;
+    pi->block = NULL;
+    raxStart(&pi->ri,consumer ? consumer->pel : cg->pel);
+    if (start) {
+        unsigned char buf[sizeof(streamID)];
+        streamEncodeID(buf,start);
+        raxSeek(&pi->ri,"<=",buf,sizeof(buf));
+        if (raxNext(&pi->ri)) {
+            /* Skip the IDs of the block smaller than 'start'. */
+            streamPELIteratorLoadBlock(pi);
+            streamPELBlockSearch(pi->block,start,&pi->idx);
+            if (pi->idx < pi->block->count) {
+                uint32_t pos;
+                pi->run = streamPELBlockRunAt(pi->block,pi->idx,&pos);
+                pi->runpos = pi->idx-pos;
+            }
+            return;
+        }
+    }
+    raxSeek(&pi->ri,"^",NULL,0);
+}
+
+/* Emit the next pending message of the iterator, storing its ID in '*id'
+ * and its delivery info in '*nack'. Returns 0 when there are no more
+ * messages, 1 otherwise. */
+int streamPELIteratorNext(streamPELIterator *pi, streamID *id,
+                          streamNACK **nack)
+{
+    while(1) {
+        streamPELBlock *b = pi->block;
+        if (b == NULL || pi->idx == b->count) {
+            if (!raxNext(&pi->ri)) return 0;
+            streamPELIteratorLoadBlock(pi);
+            continue;
+        }
+
+        streamPELRun *run = &b->runs[pi->run];
+        if (pi->consumer && run->nack.consumer != pi->consumer) {
+            /* Skip the whole run. */
+            pi->idx += run->len - pi->runpos;
+            pi->run++;
+            pi->runpos = 0;
+            continue;
+        }
+        *id = b->ids[pi->idx];
+        if (nack) *nack = &run->nack;
+        pi->idx++;
+        if (++pi->runpos == run->len) {
+            pi->run++;
+            pi->runpos = 0;
+        }
+        return 1;
+    }
+}
+
+/* Stop the PEL iterator. */
+void streamPELIteratorStop(streamPELIterator *pi) {
+    raxStop(&pi->ri);
+}
+
+/* -----------------------------------------------------------------------
+ * Low level implementation of consumer groups
+ * ----------------------------------------------------------------------- */
+
 /* Free a consumer and associated data structures. Note that this function
  * will not reassign the pending messages associated with this consumer
  * nor will delete them from the stream, so when this function is called
  * to delete a consumer, and not when the whole stream is destroyed, the caller
  * should do some work before. */
 void streamFreeConsumer(streamConsumer *sc) {
-    raxFree(sc->pel); /* No value free callback: the PEL entries are shared
-                         between the consumer and the main stream PEL. */
+    raxFree(sc->pel); /* No value free callback: the values are just the
+                         number of entries of the blocks of the group PEL. */
     sdsfree(sc->name);
     zfree(sc);
 }
@@ -1611,6 +2186,7 @@ streamCG *streamCreateCG(stream *s, char *name, size_t namelen, streamID *id) {
 
     streamCG *cg = zmalloc(sizeof(*cg));
     cg->pel = raxNew();
+    cg->pel_size = 0;
     cg->consumers = raxNew();
     cg->last_id = *id;
     raxInsert(s->cgroups,(unsigned char*)name,namelen,cg,NULL);
@@ -1619,7 +2195,7 @@ streamCG *streamCreateCG(stream *s, char *name, size_t namelen, streamID *id) {
 
 /* Free a consumer group and all its associated data. */
 void streamFreeCG(streamCG *cg) {
-    raxFreeWithCallback(cg->pel,(void(*)(void*))streamFreeNACK);
+    raxFreeWithCallback(cg->pel,(void(*)(void*))streamPELBlockFree);
     raxFreeWithCallback(cg->consumers,(void(*)(void*))streamFreeConsumer);
     zfree(cg);
 }
@@ -1645,6 +2221,7 @@ streamConsumer *streamLookupConsumer(streamCG *cg, sds name, int create) {
         consumer = zmalloc(sizeof(*consumer));
         consumer->name = sdsdup(name);
         consumer->pel = raxNew();
+        consumer->pel_size = 0;
         raxInsert(cg->consumers,(unsigned char*)name,sdslen(name),
                   consumer,NULL);
     }
@@ -1659,19 +2236,10 @@ uint64_t streamDelConsumer(streamCG *cg, sds name) {
     streamConsumer *consumer = streamLookupConsumer(cg,name,0);
     if (consumer == NULL) return 0;
 
-    uint64_t retval = raxSize(consumer->pel);
+    uint64_t retval = consumer->pel_size;
 
-    /* Iterate all the consumer pending messages, deleting every corresponding
-     * entry from the global entry. */
-    raxIterator ri;
-    raxStart(&ri,consumer->pel);
-    raxSeek(&ri,"^",NULL,0);
-    while(raxNext(&ri)) {
-        streamNACK *nack = ri.data;
-        raxRemove(cg->pel,ri.key,ri.key_len,NULL);
-        streamFreeNACK(nack);
-    }
-    raxStop(&ri);
+    /* Delete all the consumer pending messages from the group PEL. */
+    streamPELDeleteConsumer(cg,consumer);
 
     /* Deallocate the consumer. */
     raxRemove(cg->consumers,(unsigned char*)name,sdslen(name),NULL);
@@ -1877,18 +2445,11 @@ void xackCommand(client *c) {
     int acknowledged = 0;
     for (int j = 3; j < c->argc; j++) {
         streamID id;
-        unsigned char buf[sizeof(streamID)];
         if (streamParseStrictIDOrReply(c,c->argv[j],&id,0) != C_OK) return;
-        streamEncodeID(buf,&id);
-
-        /* Lookup the ID in the group PEL: it will have a reference to the
-         * NACK structure that will have a reference to the consumer, so that
-         * we are able to remove the entry from both PELs. */
-        streamNACK *nack = raxFind(group->pel,buf,sizeof(buf));
-        if (nack != raxNotFound) {
-            raxRemove(group->pel,buf,sizeof(buf),NULL);
-            raxRemove(nack->consumer->pel,buf,sizeof(buf),NULL);
-            streamFreeNACK(nack);
+
+        /* Remove the ID from the group PEL, and from the PEL of the
+         * consumer owning it. */
+        if (streamPELDelete(group,&id)) {
             acknowledged++;
             server.dirty++;
         }
@@ -1950,26 +2511,27 @@ void xpendingCommand(client *c) {
     if (justinfo) {
         addReplyMultiBulkLen(c,4);
         /* Total number of messages in the PEL. */
-        addReplyLongLong(c,raxSize(group->pel));
+        addReplyLongLong(c,group->pel_size);
         /* First and last IDs. */
-        if (raxSize(group->pel) == 0) {
+        if (group->pel_size == 0) {
             addReply(c,shared.nullbulk); /* Start. */
             addReply(c,shared.nullbulk); /* End. */
             addReply(c,shared.nullmultibulk); /* Clients. */
         } else {
             /* Start. */
             raxIterator ri;
+            streamPELBlock *b;
             raxStart(&ri,group->pel);
             raxSeek(&ri,"^",NULL,0);
             raxNext(&ri);
-            streamDecodeID(ri.key,&startid);
-            addReplyStreamID(c,&startid);
+            b = ri.data;
+            addReplyStreamID(c,&b->ids[0]);
 
             /* End. */
             raxSeek(&ri,"$",NULL,0);
             raxNext(&ri);
-            streamDecodeID(ri.key,&endid);
-            addReplyStreamID(c,&endid);
+            b = ri.data;
+            addReplyStreamID(c,&b->ids[b->count-1]);
             raxStop(&ri);
 
             /* Consumers with pending messages. */
@@ -1979,10 +2541,10 @@ void xpendingCommand(client *c) {
             size_t arraylen = 0;
             while(raxNext(&ri)) {
                 streamConsumer *consumer = ri.data;
-                if (raxSize(consumer->pel) == 0) continue;
+                if (consumer->pel_size == 0) continue;
                 addReplyMultiBulkLen(c,2);
                 addReplyBulkCBuffer(c,ri.key,ri.key_len);
-                addReplyBulkLongLong(c,raxSize(consumer->pel));
+                addReplyBulkLongLong(c,consumer->pel_size);
                 arraylen++;
             }
             setDeferredMultiBulkLength(c,arraylen_ptr,arraylen);
@@ -2002,29 +2564,23 @@ void xpendingCommand(client *c) {
             return;
         }
 
-        rax *pel = consumer ? consumer->pel : group->pel;
-        unsigned char startkey[sizeof(streamID)];
-        unsigned char endkey[sizeof(streamID)];
-        raxIterator ri;
+        streamPELIterator pi;
+        streamNACK *nack;
+        streamID id;
         mstime_t now = mstime();
 
-        streamEncodeID(startkey,&startid);
-        streamEncodeID(endkey,&endid);
-        raxStart(&ri,pel);
-        raxSeek(&ri,">=",startkey,sizeof(startkey));
+        streamPELIteratorStart(&pi,group,consumer,&startid);
         void *arraylen_ptr = addDeferredMultiBulkLength(c);
         size_t arraylen = 0;
 
-        while(count && raxNext(&ri) && memcmp(ri.key,endkey,ri.key_len) <= 0) {
-            streamNACK *nack = ri.data;
-
+        while(count && streamPELIteratorNext(&pi,&id,&nack) &&
+              streamCompareID(&id,&endid) <= 0)
+        {
             arraylen++;
             count--;
             addReplyMultiBulkLen(c,4);
 
             /* Entry ID. */
-            streamID id;
-            streamDecodeID(ri.key,&id);
             addReplyStreamID(c,&id);
 
             /* Consumer name. */
@@ -2039,7 +2595,7 @@ void xpendingCommand(client *c) {
             /* Number of deliveries. */
             addReplyLongLong(c,nack->delivery_count);
         }
-        raxStop(&ri);
+        streamPELIteratorStop(&pi);
         setDeferredMultiBulkLength(c,arraylen_ptr,arraylen);
     }
 }
@@ -2213,20 +2769,18 @@ void xclaimCommand(client *c) {
     size_t arraylen = 0;
     for (int j = 5; j <= last_id_arg; j++) {
         streamID id;
-        unsigned char buf[sizeof(streamID)];
         if (streamParseStrictIDOrReply(c,c->argv[j],&id,0) != C_OK)
             serverPanic("StreamID invalid after check. Should not be possible.");
-        streamEncodeID(buf,&id);
 
         /* Lookup the ID in the group PEL. */
-        streamNACK *nack = raxFind(group->pel,buf,sizeof(buf));
+        streamNACK *found_nack = streamPELFind(group,&id), nack;
 
         /* If FORCE is passed, let's check if at least the entry
          * exists in the Stream. In such case, we'll crate a new
          * entry in the PEL from scratch, so that XCLAIM can also
          * be used to create entries in the PEL. Useful for AOF
          * and replication of consumer groups. */
-        if (force && nack == raxNotFound) {
+        if (force && found_nack == NULL) {
             streamIterator myiterator;
             streamIteratorStart(&myiterator,o->ptr,&id,&id,0);
             int64_t numfields;
@@ -2238,39 +2792,38 @@ void xclaimCommand(client *c) {
             /* Item must exist for us to create a NACK for it. */
             if (!found) continue;
 
-            /* Create the NACK. */
-            nack = streamCreateNACK(NULL);
-            raxInsert(group->pel,buf,sizeof(buf),nack,NULL);
+            /* The NACK will be created below, as if it was delivered
+             * now for the first time. Note that in this case there
+             * was no pre-existing entry and minidle should be ignored,
+             * so we leave the consumer NULL. */
+            nack.consumer = NULL;
+            nack.delivery_time = now;
+            nack.delivery_count = 1;
+            found_nack = &nack;
         }
 
-        if (nack != raxNotFound) {
+        if (found_nack != NULL) {
             /* We need to check if the minimum idle time requested
-             * by the caller is satisfied by this entry.
-             *
-             * Note that the nack could be created by FORCE, in this
-             * case there was no pre-existing entry and minidle should
-             * be ignored, but in that case nick->consumer is NULL. */
-            if (nack->consumer && minidle) {
-                mstime_t this_idle = now - nack->delivery_time;
+             * by the caller is satisfied by this entry. */
+            nack = *found_nack;
+            if (nack.consumer && minidle) {
+                mstime_t this_idle = now - nack.delivery_time;
                 if (this_idle < minidle) continue;
             }
-            /* Remove the entry from the old consumer.
-             * Note that nack->consumer is NULL if we created the
-             * NACK above because of the FORCE option. */
-            if (nack->consumer)
-                raxRemove(nack->consumer->pel,buf,sizeof(buf),NULL);
             /* Update the consumer and idle time. */
-            nack->consumer = consumer;
-            nack->delivery_time = deliverytime;
+            nack.consumer = consumer;
+            nack.delivery_time = deliverytime;
             /* Set the delivery attempts counter if given, otherwise 
              * autoincrement unless JUSTID option provided */
             if (retrycount >= 0) {
-                nack->delivery_count = retrycount;
+                nack.delivery_count = retrycount;
             } else if (!justid) {
-                nack->delivery_count++;
+                nack.delivery_count++;
             }
-            /* Add the entry in the new consumer local PEL. */
-            raxInsert(consumer->pel,buf,sizeof(buf),nack,NULL);
+            /* Add or update the entry in the group PEL, moving it to
+             * the new consumer local PEL. */
+            streamPELAdd(group,&id,consumer,nack.delivery_time,
+                         nack.delivery_count);
             /* Send the reply for this entry. */
             if (justid) {
                 addReplyStreamID(c,&id);
@@ -2282,7 +2835,7 @@ void xclaimCommand(client *c) {
             arraylen++;
 
             /* Propagate this change. */
-            streamPropagateXCLAIM(c,c->argv[1],group,c->argv[2],c->argv[j],nack);
+            streamPropagateXCLAIM(c,c->argv[1],group,c->argv[2],c->argv[j],&nack);
             propagate_last_id = 0; /* Will be propagated by XCLAIM itself. */
             server.dirty++;
         }
@@ -2470,7 +3023,7 @@ NULL
             addReplyBulkCString(c,"name");
             addReplyBulkCBuffer(c,consumer->name,sdslen(consumer->name));
             addReplyBulkCString(c,"pending");
-            addReplyLongLong(c,raxSize(consumer->pel));
+            addReplyLongLong(c,consumer->pel_size);
             addReplyBulkCString(c,"idle");
             addReplyLongLong(c,idle);
         }
@@ -2494,7 +3047,7 @@ NULL
             addReplyBulkCString(c,"consumers");
             addReplyLongLong(c,raxSize(cg->consumers));
             addReplyBulkCString(c,"pending");
-            addReplyLongLong(c,raxSize(cg->pel));
+            addReplyLongLong(c,cg->pel_size);
             addReplyBulkCString(c,"last-delivered-id");
             addReplyStreamID(c,&cg->last_id);
         }
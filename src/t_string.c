@@ -351,6 +351,10 @@ void getrangeCommand(client *c) {
         str = llbuf;
 		//将对应的整数类型转换成对应的字符串形式
         strlen = ll2string(llbuf,sizeof(llbuf),(long)o->ptr);
+    } else if (o->encoding == OBJ_ENCODING_ROARING) {
+        /* Only the requested range of compressed bitmaps is decoded. */
+        str = NULL;
+        strlen = stringObjectLen(o);
     } else {
 		//获取对应的字符串数据指向位置
         str = o->ptr;
@@ -384,6 +388,10 @@ void getrangeCommand(client *c) {
 	if (start > end || strlen == 0) {
 		//向客户端返回空对象
         addReply(c,shared.emptybulk);
+    } else if (str == NULL) {
+        sds range = sdsnewlen(NULL,end-start+1);
+        rbmGetBytes(o->ptr,start,(unsigned char*)range,end-start+1);
+        addReplyBulkSds(c,range);
     } else {
     	//向客户端返回指定长度的字符串内容
         addReplyBulkCBuffer(c,(char*)str+start,end-start+1);
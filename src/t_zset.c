@@ -4,266 +4,594 @@
  * data structure.
  *
  * The elements are added to a hash table mapping Redis objects to scores.
- * At the same time the elements are added to a skip list mapping scores
+ * At the same time the elements are added to a B+tree mapping scores
  * to Redis objects (so objects are sorted by scores in this "view").
  *
  * Note that the SDS string representing the element is the same in both
- * the hash table and skiplist in order to save memory. What we do in order
+ * the hash table and B+tree in order to save memory. What we do in order
  * to manage the shared SDS string more easily is to free the SDS string
- * only in zslFreeNode(). The dictionary has no value free method set.
- * So we should always remove an element from the dictionary, and later from
- * the skiplist.
+ * only when it is removed from the B+tree. The dictionary has no key free
+ * method set, and the scores are stored as the values of the hash table
+ * entries. So we should always remove an element from the dictionary, and
+ * later from the B+tree.
  *
- * This skiplist implementation is almost a C translation of the original
- * algorithm described by William Pugh in "Skip Lists: A Probabilistic
- * Alternative to Balanced Trees", modified in three ways:
- * a) this implementation allows for repeated scores.
- * b) the comparison is not just by key (our 'score') but by satellite data.
- * c) there is a back pointer, so it's a doubly linked list with the back
- * pointers being only at "level 1". This allows to traverse the list
- * from tail to head, useful for ZREVRANGE. */
+ * The B+tree stores up to ZBTREE_LEAF_ENTRIES (score,element) pairs in
+ * every leaf, ordered by score and then lexicographically by element, with
+ * the leaves linked in both directions for ZRANGE and ZREVRANGE. The inner
+ * nodes hold up to ZBTREE_FANOUT children, the lower bound of every child
+ * (a private copy of an element, so that it survives the element), and the
+ * number of elements of every child subtree, so that the rank of an element
+ * and the element with a given rank are found descending the tree, like
+ * the spans of a skiplist allow to. Compared to a skiplist, that needs an
+ * allocation and a cache miss per element and level, the elements are
+ * scanned sequentially inside wide nodes. */
 
 #include "server.h"
 #include <math.h>
 
 /*-----------------------------------------------------------------------------
- * Skiplist implementation of the low level API
+ * B+tree implementation of the low level API
  *----------------------------------------------------------------------------*/
 
 int zslLexValueGteMin(sds value, zlexrangespec *spec);
 int zslLexValueLteMax(sds value, zlexrangespec *spec);
 
-/* Create a skiplist node with the specified number of levels.
- * The SDS string 'ele' is referenced by the node after the call. */
-zskiplistNode *zslCreateNode(int level, double score, sds ele) {
-    zskiplistNode *zn =
-        zmalloc(sizeof(*zn)+level*sizeof(struct zskiplistLevel));
-    zn->score = score;
-    zn->ele = ele;
-    return zn;
+/* The inner nodes crossed descending from the root to a leaf, and the child
+ * followed in every one of them. */
+typedef struct zbtPath {
+    int depth;                              /* Number of inner nodes. */
+    zbtInner *node[ZBTREE_MAXHEIGHT];
+    unsigned int slot[ZBTREE_MAXHEIGHT];
+} zbtPath;
+
+/* A monotonic condition on the elements: false for the first elements of
+ * the tree, and true from some element to the last one. */
+typedef int zbtPredicate(zbtEntry *e, void *arg);
+
+/* Compare two elements: the elements are ordered by score, and elements
+ * with the same score lexicographically. */
+static inline int zbtCompare(double score1, sds ele1, double score2, sds ele2) {
+    if (score1 < score2) return -1;
+    if (score1 > score2) return 1;
+    return sdscmp(ele1,ele2);
+}
+
+static zbtLeaf *zbtCreateLeaf(void) {
+    zbtLeaf *leaf = zmalloc(sizeof(*leaf));
+    leaf->prev = leaf->next = NULL;
+    leaf->count = 0;
+    return leaf;
+}
+
+static zbtInner *zbtCreateInner(void) {
+    zbtInner *inner = zmalloc(sizeof(*inner));
+    inner->count = 0;
+    inner->keys[0].ele = NULL;
+    return inner;
+}
+
+/* Create a new B+tree, made of an empty leaf. */
+zbtree *zbtCreate(void) {
+    zbtree *zbt = zmalloc(sizeof(*zbt));
+    zbt->root = zbt->head = zbt->tail = zbtCreateLeaf();
+    zbt->length = 0;
+    zbt->height = 1;
+    return zbt;
+}
+
+/* Free the subtree 'node' of the given height (1 for a leaf), including the
+ * SDS strings of the elements it references. */
+static void zbtFreeNode(void *node, int height) {
+    unsigned int j;
+
+    if (height == 1) {
+        zbtLeaf *leaf = node;
+        for (j = 0; j < leaf->count; j++) sdsfree(leaf->entries[j].ele);
+    } else {
+        zbtInner *inner = node;
+        for (j = 0; j < inner->count; j++) {
+            if (j) sdsfree(inner->keys[j].ele);
+            zbtFreeNode(inner->children[j],height-1);
+        }
+    }
+    zfree(node);
 }
 
-/* Create a new skiplist. */
-zskiplist *zslCreate(void) {
-    int j;
-    zskiplist *zsl;
-
-    zsl = zmalloc(sizeof(*zsl));
-    zsl->level = 1;
-    zsl->length = 0;
-    zsl->header = zslCreateNode(ZSKIPLIST_MAXLEVEL,0,NULL);
-    for (j = 0; j < ZSKIPLIST_MAXLEVEL; j++) {
-        zsl->header->level[j].forward = NULL;
-        zsl->header->level[j].span = 0;
-    }
-    zsl->header->backward = NULL;
-    zsl->tail = NULL;
-    return zsl;
-}
-
-/* Free the specified skiplist node. The referenced SDS string representation
- * of the element is freed too, unless node->ele is set to NULL before calling
- * this function. */
-void zslFreeNode(zskiplistNode *node) {
-    sdsfree(node->ele);
-    zfree(node);
+/* Free a whole B+tree. */
+void zbtFree(zbtree *zbt) {
+    zbtFreeNode(zbt->root,zbt->height);
+    zfree(zbt);
 }
 
-/* Free a whole skiplist. */
-void zslFree(zskiplist *zsl) {
-    zskiplistNode *node = zsl->header->level[0].forward, *next;
+/* Number of entries of a leaf, or of children of an inner node. */
+static inline unsigned int zbtNodeCount(void *node, int height) {
+    return height == 1 ? ((zbtLeaf*)node)->count : ((zbtInner*)node)->count;
+}
 
-    zfree(zsl->header);
-    while(node) {
-        next = node->level[0].forward;
-        zslFreeNode(node);
-        node = next;
-    }
-    zfree(zsl);
+static inline int zbtNodeIsFull(void *node, int height) {
+    return zbtNodeCount(node,height) ==
+           (height == 1 ? ZBTREE_LEAF_ENTRIES : ZBTREE_FANOUT);
 }
 
-/* Returns a random level for the new skiplist node we are going to create.
- * The return value of this function is between 1 and ZSKIPLIST_MAXLEVEL
- * (both inclusive), with a powerlaw-alike distribution where higher
- * levels are less likely to be returned. */
-int zslRandomLevel(void) {
-    int level = 1;
-    while ((random()&0xFFFF) < (ZSKIPLIST_P * 0xFFFF))
-        level += 1;
-    return (level<ZSKIPLIST_MAXLEVEL) ? level : ZSKIPLIST_MAXLEVEL;
+/* Return the child of 'inner' where (score,ele) belongs: the last one whose
+ * lower bound is <= (score,ele). */
+static unsigned int zbtInnerSlot(zbtInner *inner, double score, sds ele) {
+    unsigned int lo = 1, hi = inner->count;
+
+    while (lo < hi) {
+        unsigned int mid = (lo+hi)/2;
+        if (zbtCompare(inner->keys[mid].score,inner->keys[mid].ele,
+                       score,ele) <= 0)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo-1;
 }
 
-/* Insert a new node in the skiplist. Assumes the element does not already
- * exist (up to the caller to enforce that). The skiplist takes ownership
- * of the passed SDS string 'ele'. */
-zskiplistNode *zslInsert(zskiplist *zsl, double score, sds ele) {
-    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
-    unsigned int rank[ZSKIPLIST_MAXLEVEL];
-    int i, level;
+/* Return the position of the first entry of 'leaf' >= (score,ele). */
+static unsigned int zbtLeafSlot(zbtLeaf *leaf, double score, sds ele) {
+    unsigned int lo = 0, hi = leaf->count;
+
+    while (lo < hi) {
+        unsigned int mid = (lo+hi)/2;
+        if (zbtCompare(leaf->entries[mid].score,leaf->entries[mid].ele,
+                       score,ele) < 0)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Descend to the leaf where (score,ele) belongs, remembering the path. */
+static zbtLeaf *zbtSeekLeaf(zbtree *zbt, double score, sds ele, zbtPath *path) {
+    void *node = zbt->root;
+    int level;
+
+    path->depth = zbt->height-1;
+    for (level = 0; level < path->depth; level++) {
+        zbtInner *inner = node;
+        unsigned int slot = zbtInnerSlot(inner,score,ele);
+        path->node[level] = inner;
+        path->slot[level] = slot;
+        node = inner->children[slot];
+    }
+    return node;
+}
+
+/* Descend to the element with the specified 1-based rank, that must exist,
+ * remembering the path. Its position in the leaf is stored in *idx. */
+static zbtLeaf *zbtSeekRank(zbtree *zbt, unsigned long rank, zbtPath *path, unsigned int *idx) {
+    void *node = zbt->root;
+    int level;
+
+    rank--;
+    path->depth = zbt->height-1;
+    for (level = 0; level < path->depth; level++) {
+        zbtInner *inner = node;
+        unsigned int slot = 0;
+        while (slot < inner->count-1 && rank >= inner->sizes[slot])
+            rank -= inner->sizes[slot++];
+        path->node[level] = inner;
+        path->slot[level] = slot;
+        node = inner->children[slot];
+    }
+    *idx = rank;
+    return node;
+}
+
+/* Split the full child 'slot' of 'parent', whose height is 'height', in two
+ * nodes: the second one becomes the child 'slot+1'. The parent must not be
+ * full. (score,ele) is the element that is going to be inserted: when it is
+ * past the end (or before the start) of the last (or first) leaf, most of
+ * the entries are left in the full leaf, so that sorted insertions, like the
+ * ones of RDB loading, leave the leaves full. */
+static void zbtSplitChild(zbtree *zbt, zbtInner *parent, unsigned int slot, int height, double score, sds ele) {
+    unsigned int half, j;
+    unsigned long size = 0;
+    zbtEntry key;
+    void *right;
+
+    if (height == 1) {
+        zbtLeaf *l = parent->children[slot], *r = zbtCreateLeaf();
+        zbtEntry *last = l->entries+l->count-1;
+
+        if (l->next == NULL &&
+            zbtCompare(last->score,last->ele,score,ele) < 0)
+            half = l->count-1;
+        else if (l->prev == NULL &&
+                 zbtCompare(l->entries[0].score,l->entries[0].ele,score,ele) > 0)
+            half = 1;
+        else
+            half = l->count/2;
+        r->count = l->count-half;
+        memcpy(r->entries,l->entries+half,sizeof(zbtEntry)*r->count);
+        l->count = half;
+        r->prev = l;
+        r->next = l->next;
+        if (l->next) l->next->prev = r; else zbt->tail = r;
+        l->next = r;
+        /* The lower bound of the new leaf is a private copy of its first
+         * element, so that it survives the deletion of the element. */
+        key.score = r->entries[0].score;
+        key.ele = sdsdup(r->entries[0].ele);
+        size = r->count;
+        right = r;
+    } else {
+        zbtInner *l = parent->children[slot], *r = zbtCreateInner();
+
+        half = l->count/2;
+        r->count = l->count-half;
+        memcpy(r->keys,l->keys+half,sizeof(zbtEntry)*r->count);
+        memcpy(r->sizes,l->sizes+half,sizeof(unsigned long)*r->count);
+        memcpy(r->children,l->children+half,sizeof(void*)*r->count);
+        l->count = half;
+        /* The lower bound of the first child moves to the parent. */
+        key = r->keys[0];
+        r->keys[0].ele = NULL;
+        for (j = 0; j < r->count; j++) size += r->sizes[j];
+        right = r;
+    }
+
+    j = parent->count-slot-1;
+    memmove(parent->keys+slot+2,parent->keys+slot+1,sizeof(zbtEntry)*j);
+    memmove(parent->sizes+slot+2,parent->sizes+slot+1,sizeof(unsigned long)*j);
+    memmove(parent->children+slot+2,parent->children+slot+1,sizeof(void*)*j);
+    parent->keys[slot+1] = key;
+    parent->sizes[slot+1] = size;
+    parent->children[slot+1] = right;
+    parent->sizes[slot] -= size;
+    parent->count++;
+}
+
+/* Insert a new element in the B+tree. Assumes the element does not already
+ * exist (up to the caller to enforce that). The B+tree takes ownership of
+ * the passed SDS string 'ele'.
+ *
+ * The full nodes met descending the tree are split in advance, so that
+ * there is always room in the parent for the new node. */
+void zbtInsert(zbtree *zbt, double score, sds ele) {
+    void *node;
+    zbtLeaf *leaf;
+    unsigned int idx;
+    int height;
 
     serverAssert(!isnan(score));
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        /* store rank that is crossed to reach the insert position */
-        rank[i] = i == (zsl->level-1) ? 0 : rank[i+1];
-        while (x->level[i].forward &&
-                (x->level[i].forward->score < score ||
-                    (x->level[i].forward->score == score &&
-                    sdscmp(x->level[i].forward->ele,ele) < 0)))
-        {
-            rank[i] += x->level[i].span;
-            x = x->level[i].forward;
-        }
-        update[i] = x;
-    }
-    /* we assume the element is not already inside, since we allow duplicated
-     * scores, reinserting the same element should never happen since the
-     * caller of zslInsert() should test in the hash table if the element is
-     * already inside or not. */
-    level = zslRandomLevel();
-    if (level > zsl->level) {
-        for (i = zsl->level; i < level; i++) {
-            rank[i] = 0;
-            update[i] = zsl->header;
-            update[i]->level[i].span = zsl->length;
+    if (zbtNodeIsFull(zbt->root,zbt->height)) {
+        zbtInner *root = zbtCreateInner();
+
+        serverAssert(zbt->height < ZBTREE_MAXHEIGHT);
+        root->count = 1;
+        root->sizes[0] = zbt->length;
+        root->children[0] = zbt->root;
+        zbt->root = root;
+        zbt->height++;
+        zbtSplitChild(zbt,root,0,zbt->height-1,score,ele);
+    }
+
+    node = zbt->root;
+    for (height = zbt->height; height > 1; height--) {
+        zbtInner *inner = node;
+        unsigned int slot = zbtInnerSlot(inner,score,ele);
+
+        if (zbtNodeIsFull(inner->children[slot],height-1)) {
+            zbtSplitChild(zbt,inner,slot,height-1,score,ele);
+            if (zbtCompare(inner->keys[slot+1].score,inner->keys[slot+1].ele,
+                           score,ele) <= 0) slot++;
+        }
+        inner->sizes[slot]++;
+        node = inner->children[slot];
+    }
+
+    leaf = node;
+    idx = zbtLeafSlot(leaf,score,ele);
+    memmove(leaf->entries+idx+1,leaf->entries+idx,
+            sizeof(zbtEntry)*(leaf->count-idx));
+    leaf->entries[idx].score = score;
+    leaf->entries[idx].ele = ele;
+    leaf->count++;
+    zbt->length++;
+}
+
+/* Remove the child 'slot' of 'inner', without freeing it. The lower bound
+ * of the child is not freed either. */
+static void zbtRemoveSlot(zbtInner *inner, unsigned int slot) {
+    unsigned int j = inner->count-slot-1;
+
+    memmove(inner->keys+slot,inner->keys+slot+1,sizeof(zbtEntry)*j);
+    memmove(inner->sizes+slot,inner->sizes+slot+1,sizeof(unsigned long)*j);
+    memmove(inner->children+slot,inner->children+slot+1,sizeof(void*)*j);
+    inner->count--;
+    inner->keys[0].ele = NULL;
+}
+
+/* Move entries between the sibling leaves 'slot' and 'slot+1' of 'parent'
+ * so that they have the same number of entries. */
+static void zbtBalanceLeaves(zbtInner *parent, unsigned int slot) {
+    zbtLeaf *l = parent->children[slot], *r = parent->children[slot+1];
+    unsigned int half = (l->count+r->count)/2, n;
+
+    if (l->count < half) {
+        n = half-l->count;
+        memcpy(l->entries+l->count,r->entries,sizeof(zbtEntry)*n);
+        memmove(r->entries,r->entries+n,sizeof(zbtEntry)*(r->count-n));
+        l->count += n;
+        r->count -= n;
+    } else {
+        n = l->count-half;
+        memmove(r->entries+n,r->entries,sizeof(zbtEntry)*r->count);
+        memcpy(r->entries,l->entries+half,sizeof(zbtEntry)*n);
+        l->count -= n;
+        r->count += n;
+    }
+    parent->sizes[slot] = l->count;
+    parent->sizes[slot+1] = r->count;
+    sdsfree(parent->keys[slot+1].ele);
+    parent->keys[slot+1].score = r->entries[0].score;
+    parent->keys[slot+1].ele = sdsdup(r->entries[0].ele);
+}
+
+/* Merge the child 'slot+1' of 'parent' into the child 'slot', both of the
+ * given height, and free it. */
+static void zbtMergeChildren(zbtree *zbt, zbtInner *parent, unsigned int slot, int height) {
+    if (height == 1) {
+        zbtLeaf *l = parent->children[slot], *r = parent->children[slot+1];
+
+        memcpy(l->entries+l->count,r->entries,sizeof(zbtEntry)*r->count);
+        l->count += r->count;
+        l->next = r->next;
+        if (r->next) r->next->prev = l; else zbt->tail = l;
+        sdsfree(parent->keys[slot+1].ele);
+        zfree(r);
+    } else {
+        zbtInner *l = parent->children[slot], *r = parent->children[slot+1];
+
+        /* The lower bound of the right node becomes the one of its first
+         * child. */
+        r->keys[0] = parent->keys[slot+1];
+        memcpy(l->keys+l->count,r->keys,sizeof(zbtEntry)*r->count);
+        memcpy(l->sizes+l->count,r->sizes,sizeof(unsigned long)*r->count);
+        memcpy(l->children+l->count,r->children,sizeof(void*)*r->count);
+        l->count += r->count;
+        zfree(r);
+    }
+    parent->sizes[slot] += parent->sizes[slot+1];
+    zbtRemoveSlot(parent,slot+1);
+}
+
+/* Fix the nodes of 'path' after entries were removed from its leaf:
+ * empty nodes are removed, and small nodes are merged with a sibling when
+ * possible. Small leaves that can't be merged take entries from a sibling
+ * instead, so that leaves are at least 1/4 full. */
+static void zbtRebalance(zbtree *zbt, zbtPath *path) {
+    int level;
+
+    for (level = path->depth-1; level >= 0; level--) {
+        zbtInner *parent = path->node[level];
+        unsigned int slot = path->slot[level];
+        int height = zbt->height-1-level;
+        void *child = parent->children[slot];
+        unsigned int count = zbtNodeCount(child,height);
+        unsigned int cap = height == 1 ? ZBTREE_LEAF_ENTRIES : ZBTREE_FANOUT;
+
+        if (count == 0) {
+            if (height == 1) {
+                zbtLeaf *leaf = child;
+                if (leaf->prev) leaf->prev->next = leaf->next;
+                else zbt->head = leaf->next;
+                if (leaf->next) leaf->next->prev = leaf->prev;
+                else zbt->tail = leaf->prev;
+            }
+            if (slot == 0) {
+                if (parent->count > 1) sdsfree(parent->keys[1].ele);
+            } else {
+                sdsfree(parent->keys[slot].ele);
+            }
+            zfree(child);
+            zbtRemoveSlot(parent,slot);
+        } else if (count < cap/4 && parent->count > 1) {
+            unsigned int sibling = slot+1 < parent->count ? slot+1 : slot-1;
+            unsigned int left = sibling < slot ? sibling : slot;
+
+            if (count+zbtNodeCount(parent->children[sibling],height) <= cap) {
+                zbtMergeChildren(zbt,parent,left,height);
+            } else {
+                if (height == 1) zbtBalanceLeaves(parent,left);
+                break;
+            }
+        } else {
+            break;
         }
-        zsl->level = level;
     }
-    x = zslCreateNode(level,score,ele);
-    for (i = 0; i < level; i++) {
-        x->level[i].forward = update[i]->level[i].forward;
-        update[i]->level[i].forward = x;
 
-        /* update span covered by update[i] as x is inserted here */
-        x->level[i].span = update[i]->level[i].span - (rank[0] - rank[i]);
-        update[i]->level[i].span = (rank[0] - rank[i]) + 1;
+    /* Remove the roots with a single child. */
+    while (zbt->height > 1 && ((zbtInner*)zbt->root)->count == 1) {
+        zbtInner *root = zbt->root;
+        zbt->root = root->children[0];
+        zbt->height--;
+        zfree(root);
     }
+}
 
-    /* increment span for untouched levels */
-    for (i = level; i < zsl->level; i++) {
-        update[i]->level[i].span++;
-    }
+/* Remove 'n' entries from 'leaf' starting at 'idx'. The SDS strings of the
+ * elements are not freed. 'path' is the path of the leaf. */
+static void zbtRemoveEntries(zbtree *zbt, zbtPath *path, zbtLeaf *leaf, unsigned int idx, unsigned int n) {
+    int level;
 
-    x->backward = (update[0] == zsl->header) ? NULL : update[0];
-    if (x->level[0].forward)
-        x->level[0].forward->backward = x;
-    else
-        zsl->tail = x;
-    zsl->length++;
-    return x;
-}
+    memmove(leaf->entries+idx,leaf->entries+idx+n,
+            sizeof(zbtEntry)*(leaf->count-idx-n));
+    leaf->count -= n;
+    zbt->length -= n;
+    for (level = 0; level < path->depth; level++)
+        path->node[level]->sizes[path->slot[level]] -= n;
 
-/* Internal function used by zslDelete, zslDeleteByScore and zslDeleteByRank */
-void zslDeleteNode(zskiplist *zsl, zskiplistNode *x, zskiplistNode **update) {
-    int i;
-    for (i = 0; i < zsl->level; i++) {
-        if (update[i]->level[i].forward == x) {
-            update[i]->level[i].span += x->level[i].span - 1;
-            update[i]->level[i].forward = x->level[i].forward;
-        } else {
-            update[i]->level[i].span -= 1;
-        }
-    }
-    if (x->level[0].forward) {
-        x->level[0].forward->backward = x->backward;
+    if (zbt->length == 0 && zbt->height > 1) {
+        /* Start again from an empty leaf. */
+        zbtFreeNode(zbt->root,zbt->height);
+        zbt->root = zbt->head = zbt->tail = zbtCreateLeaf();
+        zbt->height = 1;
     } else {
-        zsl->tail = x->backward;
+        zbtRebalance(zbt,path);
     }
-    while(zsl->level > 1 && zsl->header->level[zsl->level-1].forward == NULL)
-        zsl->level--;
-    zsl->length--;
 }
 
-/* Delete an element with matching score/element from the skiplist.
- * The function returns 1 if the node was found and deleted, otherwise
+/* Return the entry matching score/element, or NULL if there is none. */
+zbtEntry *zbtFind(zbtree *zbt, double score, sds ele) {
+    zbtPath path;
+    zbtLeaf *leaf = zbtSeekLeaf(zbt,score,ele,&path);
+    unsigned int idx = zbtLeafSlot(leaf,score,ele);
+
+    if (idx < leaf->count && leaf->entries[idx].score == score &&
+        sdscmp(leaf->entries[idx].ele,ele) == 0)
+        return leaf->entries+idx;
+    return NULL;
+}
+
+/* Delete an element with matching score/element from the B+tree.
+ * The function returns 1 if the element was found and deleted, otherwise
  * 0 is returned.
  *
- * If 'node' is NULL the deleted node is freed by zslFreeNode(), otherwise
- * it is not freed (but just unlinked) and *node is set to the node pointer,
- * so that it is possible for the caller to reuse the node (including the
- * referenced SDS string at node->ele). */
-int zslDelete(zskiplist *zsl, double score, sds ele, zskiplistNode **node) {
-    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
-    int i;
+ * If 'deleted' is NULL the SDS string of the element is freed, otherwise
+ * it is not freed and *deleted is set to it, so that it is possible for the
+ * caller to reuse it. */
+int zbtDelete(zbtree *zbt, double score, sds ele, sds *deleted) {
+    zbtPath path;
+    zbtLeaf *leaf = zbtSeekLeaf(zbt,score,ele,&path);
+    unsigned int idx = zbtLeafSlot(leaf,score,ele);
+
+    if (idx == leaf->count || leaf->entries[idx].score != score ||
+        sdscmp(leaf->entries[idx].ele,ele) != 0) return 0; /* not found */
+    if (deleted)
+        *deleted = leaf->entries[idx].ele;
+    else
+        sdsfree(leaf->entries[idx].ele);
+    zbtRemoveEntries(zbt,&path,leaf,idx,1);
+    return 1;
+}
 
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward &&
-                (x->level[i].forward->score < score ||
-                    (x->level[i].forward->score == score &&
-                     sdscmp(x->level[i].forward->ele,ele) < 0)))
-        {
-            x = x->level[i].forward;
-        }
-        update[i] = x;
+/* Update the score of an element inside the B+tree.
+ * Note that the element must exist and must match 'curscore'.
+ * This function does not update the score in the hash table side, the
+ * caller should take care of it.
+ *
+ * When the element stays inside the same leaf, not as its first or last
+ * entry (so that the bounds of the leaf in the inner nodes are still
+ * valid), the leaf is just updated in place. Otherwise the element is
+ * removed and inserted again, which is more costly. */
+void zbtUpdateScore(zbtree *zbt, double curscore, sds ele, double newscore) {
+    zbtPath path;
+    zbtLeaf *leaf = zbtSeekLeaf(zbt,curscore,ele,&path);
+    unsigned int idx = zbtLeafSlot(leaf,curscore,ele), newidx;
+
+    /* Note that this function assumes that the element with the matching
+     * score exists. */
+    serverAssert(idx < leaf->count && leaf->entries[idx].score == curscore &&
+                 sdscmp(leaf->entries[idx].ele,ele) == 0);
+    /* From now on use the SDS string owned by the B+tree, 'ele' may be a
+     * different copy of the same element. */
+    ele = leaf->entries[idx].ele;
+
+    /* Position of the element among the other entries of the leaf. */
+    newidx = zbtLeafSlot(leaf,newscore,ele);
+    if (newidx > idx) newidx--;
+    if (newidx > 0 && newidx < leaf->count-1) {
+        if (newidx > idx)
+            memmove(leaf->entries+idx,leaf->entries+idx+1,
+                    sizeof(zbtEntry)*(newidx-idx));
+        else if (newidx < idx)
+            memmove(leaf->entries+newidx+1,leaf->entries+newidx,
+                    sizeof(zbtEntry)*(idx-newidx));
+        leaf->entries[newidx].score = newscore;
+        leaf->entries[newidx].ele = ele;
+        return;
     }
-    /* We may have multiple elements with the same score, what we need
-     * is to find the element with both the right score and object. */
-    x = x->level[0].forward;
-    if (x && score == x->score && sdscmp(x->ele,ele) == 0) {
-        zslDeleteNode(zsl, x, update);
-        if (!node)
-            zslFreeNode(x);
-        else
-            *node = x;
+
+    /* No way to reuse the old position: remove the entry and insert the
+     * same SDS string again. */
+    zbtRemoveEntries(zbt,&path,leaf,idx,1);
+    zbtInsert(zbt,newscore,ele);
+}
+
+/* Set 'pos' to the first element of the tree. Returns 0 if it is empty. */
+int zbtFirst(zbtree *zbt, zbtPos *pos) {
+    pos->leaf = zbt->length ? zbt->head : NULL;
+    pos->idx = 0;
+    return pos->leaf != NULL;
+}
+
+/* Set 'pos' to the last element of the tree. Returns 0 if it is empty. */
+int zbtLast(zbtree *zbt, zbtPos *pos) {
+    pos->leaf = zbt->length ? zbt->tail : NULL;
+    pos->idx = pos->leaf ? pos->leaf->count-1 : 0;
+    return pos->leaf != NULL;
+}
+
+/* Move 'pos' to the next element. Returns 0 (and 'pos' no longer refers
+ * to an element) if it was the last one. */
+int zbtNext(zbtPos *pos) {
+    if (++pos->idx < pos->leaf->count) return 1;
+    pos->leaf = pos->leaf->next;
+    pos->idx = 0;
+    return pos->leaf != NULL;
+}
+
+/* Move 'pos' to the previous element. Returns 0 (and 'pos' no longer
+ * refers to an element) if it was the first one. */
+int zbtPrev(zbtPos *pos) {
+    if (pos->idx > 0) {
+        pos->idx--;
         return 1;
     }
-    return 0; /* not found */
+    pos->leaf = pos->leaf->prev;
+    pos->idx = pos->leaf ? pos->leaf->count-1 : 0;
+    return pos->leaf != NULL;
 }
 
-/* Update the score of an elmenent inside the sorted set skiplist.
- * Note that the element must exist and must match 'score'.
- * This function does not update the score in the hash table side, the
- * caller should take care of it.
- *
- * Note that this function attempts to just update the node, in case after
- * the score update, the node would be exactly at the same position.
- * Otherwise the skiplist is modified by removing and re-adding a new
- * element, which is more costly.
+/* Set 'pos' to the first element for which 'pass' is true, and return the
+ * number of elements before it. If there is no such element, pos->leaf is
+ * set to NULL and the length of the tree is returned.
  *
- * The function returns the updated element skiplist node pointer. */
-zskiplistNode *zslUpdateScore(zskiplist *zsl, double curscore, sds ele, double newscore) {
-    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
-    int i;
+ * The bounds of the inner nodes are compared with 'pass' as well: all the
+ * elements of a child are >= its bound, so if the bound passes the element
+ * can't be in the previous children. */
+static unsigned long zbtSeekFirst(zbtree *zbt, zbtPredicate *pass, void *arg, zbtPos *pos) {
+    void *node = zbt->root;
+    unsigned long rank = 0;
+    unsigned int lo, hi, j;
+    int height;
+    zbtLeaf *leaf;
 
-    /* We need to seek to element to update to start: this is useful anyway,
-     * we'll have to update or remove it. */
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward &&
-                (x->level[i].forward->score < curscore ||
-                    (x->level[i].forward->score == curscore &&
-                     sdscmp(x->level[i].forward->ele,ele) < 0)))
-        {
-            x = x->level[i].forward;
+    for (height = zbt->height; height > 1; height--) {
+        zbtInner *inner = node;
+
+        lo = 1;
+        hi = inner->count;
+        while (lo < hi) {
+            unsigned int mid = (lo+hi)/2;
+            if (pass(inner->keys+mid,arg)) hi = mid; else lo = mid+1;
         }
-        update[i] = x;
+        for (j = 0; j < lo-1; j++) rank += inner->sizes[j];
+        node = inner->children[lo-1];
     }
 
-    /* Jump to our element: note that this function assumes that the
-     * element with the matching score exists. */
-    x = x->level[0].forward;
-    serverAssert(x && curscore == x->score && sdscmp(x->ele,ele) == 0);
-
-    /* If the node, after the score update, would be still exactly
-     * at the same position, we can just update the score without
-     * actually removing and re-inserting the element in the skiplist. */
-    if ((x->backward == NULL || x->backward->score < newscore) &&
-        (x->level[0].forward == NULL || x->level[0].forward->score > newscore))
-    {
-        x->score = newscore;
-        return x;
+    leaf = node;
+    lo = 0;
+    hi = leaf->count;
+    while (lo < hi) {
+        unsigned int mid = (lo+hi)/2;
+        if (pass(leaf->entries+mid,arg)) hi = mid; else lo = mid+1;
     }
-
-    /* No way to reuse the old node: we need to remove and insert a new
-     * one at a different place. */
-    zslDeleteNode(zsl, x, update);
-    zskiplistNode *newnode = zslInsert(zsl,newscore,x->ele);
-    /* We reused the old node x->ele SDS string, free the node now
-     * since zslInsert created a new one. */
-    x->ele = NULL;
-    zslFreeNode(x);
-    return newnode;
+    rank += lo;
+    /* When no element of the leaf passes, the first element of the next
+     * leaf does, since it is past the next bound. */
+    if (lo == leaf->count) {
+        leaf = leaf->next;
+        lo = 0;
+    }
+    pos->leaf = leaf;
+    pos->idx = lo;
+    return rank;
 }
 
 int zslValueGteMin(double value, zrangespec *spec) {
@@ -274,213 +602,152 @@ int zslValueLteMax(double value, zrangespec *spec) {
     return spec->maxex ? (value < spec->max) : (value <= spec->max);
 }
 
-/* Returns if there is a part of the zset is in range. */
-int zslIsInRange(zskiplist *zsl, zrangespec *range) {
-    zskiplistNode *x;
+static int zbtPassGteMin(zbtEntry *e, void *range) {
+    return zslValueGteMin(e->score,range);
+}
+
+static int zbtFailLteMax(zbtEntry *e, void *range) {
+    return !zslValueLteMax(e->score,range);
+}
+
+static int zbtPassLexGteMin(zbtEntry *e, void *range) {
+    return zslLexValueGteMin(e->ele,range);
+}
 
+static int zbtFailLexLteMax(zbtEntry *e, void *range) {
+    return !zslLexValueLteMax(e->ele,range);
+}
+
+/* Returns if there is a part of the zset is in range. */
+int zbtIsInRange(zbtree *zbt, zrangespec *range) {
     /* Test for ranges that will always be empty. */
     if (range->min > range->max ||
             (range->min == range->max && (range->minex || range->maxex)))
         return 0;
-    x = zsl->tail;
-    if (x == NULL || !zslValueGteMin(x->score,range))
-        return 0;
-    x = zsl->header->level[0].forward;
-    if (x == NULL || !zslValueLteMax(x->score,range))
+    if (zbt->length == 0 ||
+        !zslValueGteMin(zbt->tail->entries[zbt->tail->count-1].score,range) ||
+        !zslValueLteMax(zbt->head->entries[0].score,range))
         return 0;
     return 1;
 }
 
-/* Find the first node that is contained in the specified range.
- * Returns NULL when no element is contained in the range. */
-zskiplistNode *zslFirstInRange(zskiplist *zsl, zrangespec *range) {
-    zskiplistNode *x;
-    int i;
-
-    /* If everything is out of range, return early. */
-    if (!zslIsInRange(zsl,range)) return NULL;
+/* Set 'pos' to the first element that is contained in the specified range.
+ * Returns 0 when no element is contained in the range. */
+int zbtFirstInRange(zbtree *zbt, zrangespec *range, zbtPos *pos) {
+    pos->leaf = NULL;
+    if (!zbtIsInRange(zbt,range)) return 0;
+    zbtSeekFirst(zbt,zbtPassGteMin,range,pos);
 
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        /* Go forward while *OUT* of range. */
-        while (x->level[i].forward &&
-            !zslValueGteMin(x->level[i].forward->score,range))
-                x = x->level[i].forward;
-    }
-
-    /* This is an inner range, so the next node cannot be NULL. */
-    x = x->level[0].forward;
-    serverAssert(x != NULL);
+    /* This is an inner range, so the element can't be missing. */
+    serverAssert(pos->leaf != NULL);
 
     /* Check if score <= max. */
-    if (!zslValueLteMax(x->score,range)) return NULL;
-    return x;
+    if (!zslValueLteMax(zbtPosEntry(pos)->score,range)) pos->leaf = NULL;
+    return pos->leaf != NULL;
 }
 
-/* Find the last node that is contained in the specified range.
- * Returns NULL when no element is contained in the range. */
-zskiplistNode *zslLastInRange(zskiplist *zsl, zrangespec *range) {
-    zskiplistNode *x;
-    int i;
-
-    /* If everything is out of range, return early. */
-    if (!zslIsInRange(zsl,range)) return NULL;
+/* Set 'pos' to the last element that is contained in the specified range.
+ * Returns 0 when no element is contained in the range. */
+int zbtLastInRange(zbtree *zbt, zrangespec *range, zbtPos *pos) {
+    pos->leaf = NULL;
+    if (!zbtIsInRange(zbt,range)) return 0;
 
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        /* Go forward while *IN* range. */
-        while (x->level[i].forward &&
-            zslValueLteMax(x->level[i].forward->score,range))
-                x = x->level[i].forward;
-    }
+    /* The element before the first one past the range. */
+    zbtSeekFirst(zbt,zbtFailLteMax,range,pos);
+    if (pos->leaf == NULL) zbtLast(zbt,pos); else zbtPrev(pos);
 
-    /* This is an inner range, so this node cannot be NULL. */
-    serverAssert(x != NULL);
+    /* This is an inner range, so the element can't be missing. */
+    serverAssert(pos->leaf != NULL);
 
     /* Check if score >= min. */
-    if (!zslValueGteMin(x->score,range)) return NULL;
-    return x;
+    if (!zslValueGteMin(zbtPosEntry(pos)->score,range)) pos->leaf = NULL;
+    return pos->leaf != NULL;
 }
 
-/* Delete all the elements with score between min and max from the skiplist.
- * Min and max are inclusive, so a score >= min || score <= max is deleted.
+/* Delete all the elements with rank between start and end from the B+tree.
+ * Start and end are inclusive. Note that start and end need to be 1-based.
  * Note that this function takes the reference to the hash table view of the
  * sorted set, in order to remove the elements from the hash table too. */
-unsigned long zslDeleteRangeByScore(zskiplist *zsl, zrangespec *range, dict *dict) {
-    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
+unsigned long zbtDeleteRangeByRank(zbtree *zbt, unsigned long start, unsigned long end, dict *dict) {
     unsigned long removed = 0;
-    int i;
-
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward && (range->minex ?
-            x->level[i].forward->score <= range->min :
-            x->level[i].forward->score < range->min))
-                x = x->level[i].forward;
-        update[i] = x;
-    }
 
-    /* Current node is the last with score < or <= min. */
-    x = x->level[0].forward;
+    if (end > zbt->length) end = zbt->length;
+    while (start <= end-removed) {
+        zbtPath path;
+        unsigned int idx, n, j;
+        zbtLeaf *leaf = zbtSeekRank(zbt,start,&path,&idx);
 
-    /* Delete nodes while in range. */
-    while (x &&
-           (range->maxex ? x->score < range->max : x->score <= range->max))
-    {
-        zskiplistNode *next = x->level[0].forward;
-        zslDeleteNode(zsl,x,update);
-        dictDelete(dict,x->ele);
-        zslFreeNode(x); /* Here is where x->ele is actually released. */
-        removed++;
-        x = next;
+        /* Delete the run of elements of this leaf at once: the next ones
+         * take their ranks. */
+        n = leaf->count-idx;
+        if (n > end-removed-start+1) n = end-removed-start+1;
+        for (j = idx; j < idx+n; j++) {
+            dictDelete(dict,leaf->entries[j].ele);
+            sdsfree(leaf->entries[j].ele);
+        }
+        zbtRemoveEntries(zbt,&path,leaf,idx,n);
+        removed += n;
     }
     return removed;
 }
 
-unsigned long zslDeleteRangeByLex(zskiplist *zsl, zlexrangespec *range, dict *dict) {
-    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
-    unsigned long removed = 0;
-    int i;
-
-
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward &&
-            !zslLexValueGteMin(x->level[i].forward->ele,range))
-                x = x->level[i].forward;
-        update[i] = x;
-    }
-
-    /* Current node is the last with score < or <= min. */
-    x = x->level[0].forward;
+/* Delete all the elements with score between min and max from the B+tree.
+ * Min and max are inclusive or exclusive according to 'range'. */
+unsigned long zbtDeleteRangeByScore(zbtree *zbt, zrangespec *range, dict *dict) {
+    zbtPos pos;
+    unsigned long start, end;
 
-    /* Delete nodes while in range. */
-    while (x && zslLexValueLteMax(x->ele,range)) {
-        zskiplistNode *next = x->level[0].forward;
-        zslDeleteNode(zsl,x,update);
-        dictDelete(dict,x->ele);
-        zslFreeNode(x); /* Here is where x->ele is actually released. */
-        removed++;
-        x = next;
-    }
-    return removed;
+    start = zbtSeekFirst(zbt,zbtPassGteMin,range,&pos)+1;
+    end = zbtSeekFirst(zbt,zbtFailLteMax,range,&pos);
+    if (start > end) return 0;
+    return zbtDeleteRangeByRank(zbt,start,end,dict);
 }
 
-/* Delete all the elements with rank between start and end from the skiplist.
- * Start and end are inclusive. Note that start and end need to be 1-based */
-unsigned long zslDeleteRangeByRank(zskiplist *zsl, unsigned int start, unsigned int end, dict *dict) {
-    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
-    unsigned long traversed = 0, removed = 0;
-    int i;
+unsigned long zbtDeleteRangeByLex(zbtree *zbt, zlexrangespec *range, dict *dict) {
+    zbtPos pos;
+    unsigned long start, end;
 
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward && (traversed + x->level[i].span) < start) {
-            traversed += x->level[i].span;
-            x = x->level[i].forward;
-        }
-        update[i] = x;
-    }
-
-    traversed++;
-    x = x->level[0].forward;
-    while (x && traversed <= end) {
-        zskiplistNode *next = x->level[0].forward;
-        zslDeleteNode(zsl,x,update);
-        dictDelete(dict,x->ele);
-        zslFreeNode(x);
-        removed++;
-        traversed++;
-        x = next;
-    }
-    return removed;
+    start = zbtSeekFirst(zbt,zbtPassLexGteMin,range,&pos)+1;
+    end = zbtSeekFirst(zbt,zbtFailLexLteMax,range,&pos);
+    if (start > end) return 0;
+    return zbtDeleteRangeByRank(zbt,start,end,dict);
 }
 
 /* Find the rank for an element by both score and key.
  * Returns 0 when the element cannot be found, rank otherwise.
- * Note that the rank is 1-based due to the span of zsl->header to the
- * first element. */
-unsigned long zslGetRank(zskiplist *zsl, double score, sds ele) {
-    zskiplistNode *x;
+ * Note that the rank is 1-based. */
+unsigned long zbtGetRank(zbtree *zbt, double score, sds ele) {
+    void *node = zbt->root;
     unsigned long rank = 0;
-    int i;
-
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward &&
-            (x->level[i].forward->score < score ||
-                (x->level[i].forward->score == score &&
-                sdscmp(x->level[i].forward->ele,ele) <= 0))) {
-            rank += x->level[i].span;
-            x = x->level[i].forward;
-        }
-
-        /* x might be equal to zsl->header, so test if obj is non-NULL */
-        if (x->ele && sdscmp(x->ele,ele) == 0) {
-            return rank;
-        }
-    }
+    unsigned int slot, j;
+    int height;
+    zbtLeaf *leaf;
+
+    for (height = zbt->height; height > 1; height--) {
+        zbtInner *inner = node;
+        slot = zbtInnerSlot(inner,score,ele);
+        for (j = 0; j < slot; j++) rank += inner->sizes[j];
+        node = inner->children[slot];
+    }
+    leaf = node;
+    slot = zbtLeafSlot(leaf,score,ele);
+    if (slot < leaf->count && leaf->entries[slot].score == score &&
+        sdscmp(leaf->entries[slot].ele,ele) == 0)
+        return rank+slot+1;
     return 0;
 }
 
-/* Finds an element by its rank. The rank argument needs to be 1-based. */
-zskiplistNode* zslGetElementByRank(zskiplist *zsl, unsigned long rank) {
-    zskiplistNode *x;
-    unsigned long traversed = 0;
-    int i;
+/* Set 'pos' to the element with the specified rank. The rank argument
+ * needs to be 1-based. Returns 0 if there is no such element. */
+int zbtGetElementByRank(zbtree *zbt, unsigned long rank, zbtPos *pos) {
+    zbtPath path;
 
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward && (traversed + x->level[i].span) <= rank)
-        {
-            traversed += x->level[i].span;
-            x = x->level[i].forward;
-        }
-        if (traversed == rank) {
-            return x;
-        }
+    if (rank == 0 || rank > zbt->length) {
+        pos->leaf = NULL;
+        return 0;
     }
-    return NULL;
+    pos->leaf = zbtSeekRank(zbt,rank,&path,&pos->idx);
+    return 1;
 }
 
 /* Populate the rangespec according to the objects min and max. */
@@ -496,11 +763,11 @@ static int zslParseRange(robj *min, robj *max, zrangespec *spec) {
         spec->min = (long)min->ptr;
     } else {
         if (((char*)min->ptr)[0] == '(') {
-            spec->min = strtod((char*)min->ptr+1,&eptr);
+            spec->min = fastStrtod((char*)min->ptr+1,&eptr);
             if (eptr[0] != '\0' || isnan(spec->min)) return C_ERR;
             spec->minex = 1;
         } else {
-            spec->min = strtod((char*)min->ptr,&eptr);
+            spec->min = fastStrtod((char*)min->ptr,&eptr);
             if (eptr[0] != '\0' || isnan(spec->min)) return C_ERR;
         }
     }
@@ -508,11 +775,11 @@ static int zslParseRange(robj *min, robj *max, zrangespec *spec) {
         spec->max = (long)max->ptr;
     } else {
         if (((char*)max->ptr)[0] == '(') {
-            spec->max = strtod((char*)max->ptr+1,&eptr);
+            spec->max = fastStrtod((char*)max->ptr+1,&eptr);
             if (eptr[0] != '\0' || isnan(spec->max)) return C_ERR;
             spec->maxex = 1;
         } else {
-            spec->max = strtod((char*)max->ptr,&eptr);
+            spec->max = fastStrtod((char*)max->ptr,&eptr);
             if (eptr[0] != '\0' || isnan(spec->max)) return C_ERR;
         }
     }
@@ -615,75 +882,51 @@ int zslLexValueLteMax(sds value, zlexrangespec *spec) {
 }
 
 /* Returns if there is a part of the zset is in the lex range. */
-int zslIsInLexRange(zskiplist *zsl, zlexrangespec *range) {
-    zskiplistNode *x;
-
+int zbtIsInLexRange(zbtree *zbt, zlexrangespec *range) {
     /* Test for ranges that will always be empty. */
     int cmp = sdscmplex(range->min,range->max);
     if (cmp > 0 || (cmp == 0 && (range->minex || range->maxex)))
         return 0;
-    x = zsl->tail;
-    if (x == NULL || !zslLexValueGteMin(x->ele,range))
-        return 0;
-    x = zsl->header->level[0].forward;
-    if (x == NULL || !zslLexValueLteMax(x->ele,range))
+    if (zbt->length == 0 ||
+        !zslLexValueGteMin(zbt->tail->entries[zbt->tail->count-1].ele,range) ||
+        !zslLexValueLteMax(zbt->head->entries[0].ele,range))
         return 0;
     return 1;
 }
 
-/* Find the first node that is contained in the specified lex range.
- * Returns NULL when no element is contained in the range. */
-zskiplistNode *zslFirstInLexRange(zskiplist *zsl, zlexrangespec *range) {
-    zskiplistNode *x;
-    int i;
+/* Set 'pos' to the first element that is contained in the specified lex
+ * range. Returns 0 when no element is contained in the range. */
+int zbtFirstInLexRange(zbtree *zbt, zlexrangespec *range, zbtPos *pos) {
+    pos->leaf = NULL;
+    if (!zbtIsInLexRange(zbt,range)) return 0;
+    zbtSeekFirst(zbt,zbtPassLexGteMin,range,pos);
 
-    /* If everything is out of range, return early. */
-    if (!zslIsInLexRange(zsl,range)) return NULL;
+    /* This is an inner range, so the element can't be missing. */
+    serverAssert(pos->leaf != NULL);
 
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        /* Go forward while *OUT* of range. */
-        while (x->level[i].forward &&
-            !zslLexValueGteMin(x->level[i].forward->ele,range))
-                x = x->level[i].forward;
-    }
-
-    /* This is an inner range, so the next node cannot be NULL. */
-    x = x->level[0].forward;
-    serverAssert(x != NULL);
-
-    /* Check if score <= max. */
-    if (!zslLexValueLteMax(x->ele,range)) return NULL;
-    return x;
+    /* Check if the element <= max. */
+    if (!zslLexValueLteMax(zbtPosEntry(pos)->ele,range)) pos->leaf = NULL;
+    return pos->leaf != NULL;
 }
 
-/* Find the last node that is contained in the specified range.
- * Returns NULL when no element is contained in the range. */
-zskiplistNode *zslLastInLexRange(zskiplist *zsl, zlexrangespec *range) {
-    zskiplistNode *x;
-    int i;
-
-    /* If everything is out of range, return early. */
-    if (!zslIsInLexRange(zsl,range)) return NULL;
-
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        /* Go forward while *IN* range. */
-        while (x->level[i].forward &&
-            zslLexValueLteMax(x->level[i].forward->ele,range))
-                x = x->level[i].forward;
-    }
+/* Set 'pos' to the last element that is contained in the specified lex
+ * range. Returns 0 when no element is contained in the range. */
+int zbtLastInLexRange(zbtree *zbt, zlexrangespec *range, zbtPos *pos) {
+    pos->leaf = NULL;
+    if (!zbtIsInLexRange(zbt,range)) return 0;
+    zbtSeekFirst(zbt,zbtFailLexLteMax,range,pos);
+    if (pos->leaf == NULL) zbtLast(zbt,pos); else zbtPrev(pos);
 
-    /* This is an inner range, so this node cannot be NULL. */
-    serverAssert(x != NULL);
+    /* This is an inner range, so the element can't be missing. */
+    serverAssert(pos->leaf != NULL);
 
-    /* Check if score >= min. */
-    if (!zslLexValueGteMin(x->ele,range)) return NULL;
-    return x;
+    /* Check if the element >= min. */
+    if (!zslLexValueGteMin(zbtPosEntry(pos)->ele,range)) pos->leaf = NULL;
+    return pos->leaf != NULL;
 }
 
 /*-----------------------------------------------------------------------------
- * Ziplist-backed sorted set API
+ * Listpack-backed sorted set API
  *----------------------------------------------------------------------------*/
 
 double zzlGetScore(unsigned char *sptr) {
@@ -694,12 +937,12 @@ double zzlGetScore(unsigned char *sptr) {
     double score;
 
     serverAssert(sptr != NULL);
-    serverAssert(ziplistGet(sptr,&vstr,&vlen,&vlong));
+    serverAssert(lpGetValue(sptr,&vstr,&vlen,&vlong));
 
     if (vstr) {
         memcpy(buf,vstr,vlen);
         buf[vlen] = '\0';
-        score = strtod(buf,NULL);
+        score = fastStrtod(buf,NULL);
     } else {
         score = vlong;
     }
@@ -707,14 +950,14 @@ double zzlGetScore(unsigned char *sptr) {
     return score;
 }
 
-/* Return a ziplist element as an SDS string. */
-sds ziplistGetObject(unsigned char *sptr) {
+/* Return a listpack element as an SDS string. */
+sds lpGetObject(unsigned char *sptr) {
     unsigned char *vstr;
     unsigned int vlen;
     long long vlong;
 
     serverAssert(sptr != NULL);
-    serverAssert(ziplistGet(sptr,&vstr,&vlen,&vlong));
+    serverAssert(lpGetValue(sptr,&vstr,&vlen,&vlong));
 
     if (vstr) {
         return sdsnewlen((char*)vstr,vlen);
@@ -731,7 +974,7 @@ int zzlCompareElements(unsigned char *eptr, unsigned char *cstr, unsigned int cl
     unsigned char vbuf[32];
     int minlen, cmp;
 
-    serverAssert(ziplistGet(eptr,&vstr,&vlen,&vlong));
+    serverAssert(lpGetValue(eptr,&vstr,&vlen,&vlong));
     if (vstr == NULL) {
         /* Store string representation of long long in buf. */
         vlen = ll2string((char*)vbuf,sizeof(vbuf),vlong);
@@ -745,7 +988,7 @@ int zzlCompareElements(unsigned char *eptr, unsigned char *cstr, unsigned int cl
 }
 
 unsigned int zzlLength(unsigned char *zl) {
-    return ziplistLen(zl)/2;
+    return lpLength(zl)/2;
 }
 
 /* Move to next entry based on the values in eptr and sptr. Both are set to
@@ -754,9 +997,9 @@ void zzlNext(unsigned char *zl, unsigned char **eptr, unsigned char **sptr) {
     unsigned char *_eptr, *_sptr;
     serverAssert(*eptr != NULL && *sptr != NULL);
 
-    _eptr = ziplistNext(zl,*sptr);
+    _eptr = lpNext(zl,*sptr);
     if (_eptr != NULL) {
-        _sptr = ziplistNext(zl,_eptr);
+        _sptr = lpNext(zl,_eptr);
         serverAssert(_sptr != NULL);
     } else {
         /* No next entry. */
@@ -773,9 +1016,9 @@ void zzlPrev(unsigned char *zl, unsigned char **eptr, unsigned char **sptr) {
     unsigned char *_eptr, *_sptr;
     serverAssert(*eptr != NULL && *sptr != NULL);
 
-    _sptr = ziplistPrev(zl,*eptr);
+    _sptr = lpPrev(zl,*eptr);
     if (_sptr != NULL) {
-        _eptr = ziplistPrev(zl,_sptr);
+        _eptr = lpPrev(zl,_sptr);
         serverAssert(_eptr != NULL);
     } else {
         /* No previous entry. */
@@ -797,13 +1040,13 @@ int zzlIsInRange(unsigned char *zl, zrangespec *range) {
             (range->min == range->max && (range->minex || range->maxex)))
         return 0;
 
-    p = ziplistIndex(zl,-1); /* Last score. */
+    p = lpSeek(zl,-1); /* Last score. */
     if (p == NULL) return 0; /* Empty sorted set */
     score = zzlGetScore(p);
     if (!zslValueGteMin(score,range))
         return 0;
 
-    p = ziplistIndex(zl,1); /* First score. */
+    p = lpSeek(zl,1); /* First score. */
     serverAssert(p != NULL);
     score = zzlGetScore(p);
     if (!zslValueLteMax(score,range))
@@ -815,14 +1058,14 @@ int zzlIsInRange(unsigned char *zl, zrangespec *range) {
 /* Find pointer to the first element contained in the specified range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
     double score;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInRange(zl,range)) return NULL;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         score = zzlGetScore(sptr);
@@ -834,7 +1077,7 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
         }
 
         /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
+        eptr = lpNext(zl,sptr);
     }
 
     return NULL;
@@ -843,14 +1086,14 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
 /* Find pointer to the last element contained in the specified range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,-2), *sptr;
+    unsigned char *eptr = lpSeek(zl,-2), *sptr;
     double score;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInRange(zl,range)) return NULL;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         score = zzlGetScore(sptr);
@@ -863,9 +1106,9 @@ unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
 
         /* Move to previous element by moving to the score of previous element.
          * When this returns NULL, we know there also is no element. */
-        sptr = ziplistPrev(zl,eptr);
+        sptr = lpPrev(zl,eptr);
         if (sptr != NULL)
-            serverAssert((eptr = ziplistPrev(zl,sptr)) != NULL);
+            serverAssert((eptr = lpPrev(zl,sptr)) != NULL);
         else
             eptr = NULL;
     }
@@ -874,14 +1117,14 @@ unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
 }
 
 int zzlLexValueGteMin(unsigned char *p, zlexrangespec *spec) {
-    sds value = ziplistGetObject(p);
+    sds value = lpGetObject(p);
     int res = zslLexValueGteMin(value,spec);
     sdsfree(value);
     return res;
 }
 
 int zzlLexValueLteMax(unsigned char *p, zlexrangespec *spec) {
-    sds value = ziplistGetObject(p);
+    sds value = lpGetObject(p);
     int res = zslLexValueLteMax(value,spec);
     sdsfree(value);
     return res;
@@ -897,12 +1140,12 @@ int zzlIsInLexRange(unsigned char *zl, zlexrangespec *range) {
     if (cmp > 0 || (cmp == 0 && (range->minex || range->maxex)))
         return 0;
 
-    p = ziplistIndex(zl,-2); /* Last element. */
+    p = lpSeek(zl,-2); /* Last element. */
     if (p == NULL) return 0;
     if (!zzlLexValueGteMin(p,range))
         return 0;
 
-    p = ziplistIndex(zl,0); /* First element. */
+    p = lpSeek(zl,0); /* First element. */
     serverAssert(p != NULL);
     if (!zzlLexValueLteMax(p,range))
         return 0;
@@ -913,7 +1156,7 @@ int zzlIsInLexRange(unsigned char *zl, zlexrangespec *range) {
 /* Find pointer to the first element contained in the specified lex range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInLexRange(zl,range)) return NULL;
@@ -927,9 +1170,9 @@ unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
         }
 
         /* Move to next element. */
-        sptr = ziplistNext(zl,eptr); /* This element score. Skip it. */
+        sptr = lpNext(zl,eptr); /* This element score. Skip it. */
         serverAssert(sptr != NULL);
-        eptr = ziplistNext(zl,sptr); /* Next element. */
+        eptr = lpNext(zl,sptr); /* Next element. */
     }
 
     return NULL;
@@ -938,7 +1181,7 @@ unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
 /* Find pointer to the last element contained in the specified lex range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,-2), *sptr;
+    unsigned char *eptr = lpSeek(zl,-2), *sptr;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInLexRange(zl,range)) return NULL;
@@ -953,9 +1196,9 @@ unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
 
         /* Move to previous element by moving to the score of previous element.
          * When this returns NULL, we know there also is no element. */
-        sptr = ziplistPrev(zl,eptr);
+        sptr = lpPrev(zl,eptr);
         if (sptr != NULL)
-            serverAssert((eptr = ziplistPrev(zl,sptr)) != NULL);
+            serverAssert((eptr = lpPrev(zl,sptr)) != NULL);
         else
             eptr = NULL;
     }
@@ -964,32 +1207,31 @@ unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
 }
 
 unsigned char *zzlFind(unsigned char *zl, sds ele, double *score) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
-        if (ziplistCompare(eptr,(unsigned char*)ele,sdslen(ele))) {
+        if (lpCompare(eptr,(unsigned char*)ele,sdslen(ele))) {
             /* Matching element, pull out score. */
             if (score != NULL) *score = zzlGetScore(sptr);
             return eptr;
         }
 
         /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
+        eptr = lpNext(zl,sptr);
     }
     return NULL;
 }
 
-/* Delete (element,score) pair from ziplist. Use local copy of eptr because we
+/* Delete (element,score) pair from listpack. Use local copy of eptr because we
  * don't want to modify the one given as argument. */
 unsigned char *zzlDelete(unsigned char *zl, unsigned char *eptr) {
     unsigned char *p = eptr;
 
-    /* TODO: add function to ziplist API to delete N elements from offset. */
-    zl = ziplistDelete(zl,&p);
-    zl = ziplistDelete(zl,&p);
+    zl = lpDelete(zl,p,&p);
+    zl = lpDelete(zl,p,NULL);
     return zl;
 }
 
@@ -997,33 +1239,30 @@ unsigned char *zzlInsertAt(unsigned char *zl, unsigned char *eptr, sds ele, doub
     unsigned char *sptr;
     char scorebuf[128];
     int scorelen;
-    size_t offset;
 
     scorelen = d2string(scorebuf,sizeof(scorebuf),score);
     if (eptr == NULL) {
-        zl = ziplistPush(zl,(unsigned char*)ele,sdslen(ele),ZIPLIST_TAIL);
-        zl = ziplistPush(zl,(unsigned char*)scorebuf,scorelen,ZIPLIST_TAIL);
+        zl = lpAppend(zl,(unsigned char*)ele,sdslen(ele));
+        zl = lpAppend(zl,(unsigned char*)scorebuf,scorelen);
     } else {
-        /* Keep offset relative to zl, as it might be re-allocated. */
-        offset = eptr-zl;
-        zl = ziplistInsert(zl,eptr,(unsigned char*)ele,sdslen(ele));
-        eptr = zl+offset;
+        /* Insert the element before 'eptr': lpInsert() returns the address
+         * of the new element, that may be moved by the reallocation. */
+        zl = lpInsert(zl,(unsigned char*)ele,sdslen(ele),eptr,LP_BEFORE,&sptr);
 
         /* Insert score after the element. */
-        serverAssert((sptr = ziplistNext(zl,eptr)) != NULL);
-        zl = ziplistInsert(zl,sptr,(unsigned char*)scorebuf,scorelen);
+        zl = lpInsert(zl,(unsigned char*)scorebuf,scorelen,sptr,LP_AFTER,NULL);
     }
     return zl;
 }
 
-/* Insert (element,score) pair in ziplist. This function assumes the element is
+/* Insert (element,score) pair in listpack. This function assumes the element is
  * not yet present in the list. */
 unsigned char *zzlInsert(unsigned char *zl, sds ele, double score) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
     double s;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
         s = zzlGetScore(sptr);
 
@@ -1042,7 +1281,7 @@ unsigned char *zzlInsert(unsigned char *zl, sds ele, double score) {
         }
 
         /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
+        eptr = lpNext(zl,sptr);
     }
 
     /* Push on tail of list when it was not yet inserted. */
@@ -1061,14 +1300,14 @@ unsigned char *zzlDeleteRangeByScore(unsigned char *zl, zrangespec *range, unsig
     eptr = zzlFirstInRange(zl,range);
     if (eptr == NULL) return zl;
 
-    /* When the tail of the ziplist is deleted, eptr will point to the sentinel
-     * byte and ziplistNext will return NULL. */
-    while ((sptr = ziplistNext(zl,eptr)) != NULL) {
+    /* When the tail of the listpack is deleted, lpDelete() sets eptr to
+     * NULL. */
+    while (eptr && (sptr = lpNext(zl,eptr)) != NULL) {
         score = zzlGetScore(sptr);
         if (zslValueLteMax(score,range)) {
             /* Delete both the element and the score. */
-            zl = ziplistDelete(zl,&eptr);
-            zl = ziplistDelete(zl,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
             num++;
         } else {
             /* No longer in range. */
@@ -1089,13 +1328,13 @@ unsigned char *zzlDeleteRangeByLex(unsigned char *zl, zlexrangespec *range, unsi
     eptr = zzlFirstInLexRange(zl,range);
     if (eptr == NULL) return zl;
 
-    /* When the tail of the ziplist is deleted, eptr will point to the sentinel
-     * byte and ziplistNext will return NULL. */
-    while ((sptr = ziplistNext(zl,eptr)) != NULL) {
+    /* When the tail of the listpack is deleted, lpDelete() sets eptr to
+     * NULL. */
+    while (eptr && (sptr = lpNext(zl,eptr)) != NULL) {
         if (zzlLexValueLteMax(eptr,range)) {
             /* Delete both the element and the score. */
-            zl = ziplistDelete(zl,&eptr);
-            zl = ziplistDelete(zl,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
             num++;
         } else {
             /* No longer in range. */
@@ -1112,7 +1351,7 @@ unsigned char *zzlDeleteRangeByLex(unsigned char *zl, zlexrangespec *range, unsi
 unsigned char *zzlDeleteRangeByRank(unsigned char *zl, unsigned int start, unsigned int end, unsigned long *deleted) {
     unsigned int num = (end-start)+1;
     if (deleted) *deleted = num;
-    zl = ziplistDeleteRange(zl,2*(start-1),2*num);
+    zl = lpDeleteRange(zl,2*(start-1),2*num);
     return zl;
 }
 
@@ -1122,97 +1361,102 @@ unsigned char *zzlDeleteRangeByRank(unsigned char *zl, unsigned int start, unsig
 
 unsigned long zsetLength(const robj *zobj) {
     unsigned long length = 0;
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         length = zzlLength(zobj->ptr);
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
-        length = ((const zset*)zobj->ptr)->zsl->length;
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        length = ((const zset*)zobj->ptr)->zbt->length;
     } else {
         serverPanic("Unknown sorted set encoding");
     }
     return length;
 }
 
+/* Add a new element to the hash table and to the B+tree of 'zs'. The
+ * element must not already exist, and the sorted set takes ownership of the
+ * SDS string 'ele'. */
+/* 向B+树编码的有序集合中添加一个不存在的新元素 */
+void zsetInsertElement(zset *zs, double score, sds ele) {
+    dictEntry *de = dictAddRaw(zs->dict,ele,NULL);
+
+    serverAssert(de != NULL);
+    dictSetDoubleVal(de,score);
+    zbtInsert(zs->zbt,score,ele);
+}
+
 void zsetConvert(robj *zobj, int encoding) {
     zset *zs;
-    zskiplistNode *node, *next;
+    zbtPos pos;
     sds ele;
     double score;
 
     if (zobj->encoding == encoding) return;
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
         unsigned int vlen;
         long long vlong;
 
-        if (encoding != OBJ_ENCODING_SKIPLIST)
+        if (encoding != OBJ_ENCODING_BTREE)
             serverPanic("Unknown target encoding");
 
         zs = zmalloc(sizeof(*zs));
         zs->dict = dictCreate(&zsetDictType,NULL);
-        zs->zsl = zslCreate();
+        zs->zbt = zbtCreate();
 
-        eptr = ziplistIndex(zl,0);
+        eptr = lpSeek(zl,0);
         serverAssertWithInfo(NULL,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssertWithInfo(NULL,zobj,sptr != NULL);
 
         while (eptr != NULL) {
             score = zzlGetScore(sptr);
-            serverAssertWithInfo(NULL,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            serverAssertWithInfo(NULL,zobj,lpGetValue(eptr,&vstr,&vlen,&vlong));
             if (vstr == NULL)
                 ele = sdsfromlonglong(vlong);
             else
                 ele = sdsnewlen((char*)vstr,vlen);
 
-            node = zslInsert(zs->zsl,score,ele);
-            serverAssert(dictAdd(zs->dict,ele,&node->score) == DICT_OK);
+            zsetInsertElement(zs,score,ele);
             zzlNext(zl,&eptr,&sptr);
         }
 
         zfree(zobj->ptr);
         zobj->ptr = zs;
-        zobj->encoding = OBJ_ENCODING_SKIPLIST;
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
-        unsigned char *zl = ziplistNew();
+        zobj->encoding = OBJ_ENCODING_BTREE;
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        unsigned char *zl = lpNew();
 
-        if (encoding != OBJ_ENCODING_ZIPLIST)
+        if (encoding != OBJ_ENCODING_LISTPACK)
             serverPanic("Unknown target encoding");
 
-        /* Approach similar to zslFree(), since we want to free the skiplist at
-         * the same time as creating the ziplist. */
         zs = zobj->ptr;
         dictRelease(zs->dict);
-        node = zs->zsl->header->level[0].forward;
-        zfree(zs->zsl->header);
-        zfree(zs->zsl);
-
-        while (node) {
-            zl = zzlInsertAt(zl,NULL,node->ele,node->score);
-            next = node->level[0].forward;
-            zslFreeNode(node);
-            node = next;
+        if (zbtFirst(zs->zbt,&pos)) {
+            do {
+                zbtEntry *e = zbtPosEntry(&pos);
+                zl = zzlInsertAt(zl,NULL,e->ele,e->score);
+            } while (zbtNext(&pos));
         }
-
+        zbtFree(zs->zbt);
         zfree(zs);
         zobj->ptr = zl;
-        zobj->encoding = OBJ_ENCODING_ZIPLIST;
+        zobj->encoding = OBJ_ENCODING_LISTPACK;
     } else {
         serverPanic("Unknown sorted set encoding");
     }
 }
 
-/* Convert the sorted set object into a ziplist if it is not already a ziplist
+/* Convert the sorted set object into a listpack if it is not already a listpack
  * and if the number of elements and the maximum element size is within the
  * expected ranges. */
-void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen) {
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) return;
+void zsetConvertToListpackIfNeeded(robj *zobj, size_t maxelelen) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) return;
     zset *zset = zobj->ptr;
 
-    if (zset->zsl->length <= server.zset_max_ziplist_entries &&
+    if (zset->zbt->length <= server.zset_max_ziplist_entries &&
         maxelelen <= server.zset_max_ziplist_value)
-            zsetConvert(zobj,OBJ_ENCODING_ZIPLIST);
+            zsetConvert(zobj,OBJ_ENCODING_LISTPACK);
 }
 
 /* Return (by reference) the score of the specified member of the sorted set
@@ -1222,13 +1466,13 @@ void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen) {
 int zsetScore(robj *zobj, sds member, double *score) {
     if (!zobj || !member) return C_ERR;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         if (zzlFind(zobj->ptr, member, score) == NULL) return C_ERR;
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
         dictEntry *de = dictFind(zs->dict, member);
         if (de == NULL) return C_ERR;
-        *score = *(double*)dictGetVal(de);
+        *score = dictGetDoubleVal(de);
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -1272,7 +1516,7 @@ int zsetScore(robj *zobj, sds member, double *score) {
  * start.
  *
  * The commad as a side effect of adding a new element may convert the sorted
- * set internal encoding from ziplist to hashtable+skiplist.
+ * set internal encoding from listpack to hashtable+B+tree.
  *
  * Memory managemnet of 'ele':
  *
@@ -1293,7 +1537,7 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
     }
 
     /* Update the sorted set according to its encoding. */
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *eptr;
 
         if ((eptr = zzlFind(zobj->ptr,ele,&curscore)) != NULL) {
@@ -1326,7 +1570,7 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
             zobj->ptr = zzlInsert(zobj->ptr,ele,score);
             if (zzlLength(zobj->ptr) > server.zset_max_ziplist_entries ||
                 sdslen(ele) > server.zset_max_ziplist_value)
-                zsetConvert(zobj,OBJ_ENCODING_SKIPLIST);
+                zsetConvert(zobj,OBJ_ENCODING_BTREE);
             if (newscore) *newscore = score;
             *flags |= ZADD_ADDED;
             return 1;
@@ -1334,9 +1578,8 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
             *flags |= ZADD_NOP;
             return 1;
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
-        zskiplistNode *znode;
         dictEntry *de;
 
         de = dictFind(zs->dict,ele);
@@ -1346,7 +1589,7 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
                 *flags |= ZADD_NOP;
                 return 1;
             }
-            curscore = *(double*)dictGetVal(de);
+            curscore = dictGetDoubleVal(de);
 
             /* Prepare the score for the increment if needed. */
             if (incr) {
@@ -1360,18 +1603,16 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
 
             /* Remove and re-insert when score changes. */
             if (score != curscore) {
-                znode = zslUpdateScore(zs->zsl,curscore,ele,score);
+                zbtUpdateScore(zs->zbt,curscore,ele,score);
                 /* Note that we did not removed the original element from
                  * the hash table representing the sorted set, so we just
                  * update the score. */
-                dictGetVal(de) = &znode->score; /* Update score ptr. */
+                dictSetDoubleVal(de,score);
                 *flags |= ZADD_UPDATED;
             }
             return 1;
         } else if (!xx) {
-            ele = sdsdup(ele);
-            znode = zslInsert(zs->zsl,score,ele);
-            serverAssert(dictAdd(zs->dict,ele,&znode->score) == DICT_OK);
+            zsetInsertElement(zs,score,sdsdup(ele));
             *flags |= ZADD_ADDED;
             if (newscore) *newscore = score;
             return 1;
@@ -1388,32 +1629,32 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
 /* Delete the element 'ele' from the sorted set, returning 1 if the element
  * existed and was deleted, 0 otherwise (the element was not there). */
 int zsetDel(robj *zobj, sds ele) {
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *eptr;
 
         if ((eptr = zzlFind(zobj->ptr,ele,NULL)) != NULL) {
             zobj->ptr = zzlDelete(zobj->ptr,eptr);
             return 1;
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
         dictEntry *de;
         double score;
 
         de = dictUnlink(zs->dict,ele);
         if (de != NULL) {
-            /* Get the score in order to delete from the skiplist later. */
-            score = *(double*)dictGetVal(de);
+            /* Get the score in order to delete from the B+tree later. */
+            score = dictGetDoubleVal(de);
 
-            /* Delete from the hash table and later from the skiplist.
-             * Note that the order is important: deleting from the skiplist
+            /* Delete from the hash table and later from the B+tree.
+             * Note that the order is important: deleting from the B+tree
              * actually releases the SDS string representing the element,
-             * which is shared between the skiplist and the hash table, so
-             * we need to delete from the skiplist as the final step. */
+             * which is shared between the B+tree and the hash table, so
+             * we need to delete from the B+tree as the final step. */
             dictFreeUnlinkedEntry(zs->dict,de);
 
-            /* Delete from skiplist. */
-            int retval = zslDelete(zs->zsl,score,ele,NULL);
+            /* Delete from the B+tree. */
+            int retval = zbtDelete(zs->zbt,score,ele,NULL);
             serverAssert(retval);
 
             if (htNeedsResize(zs->dict)) dictResize(zs->dict);
@@ -1442,18 +1683,18 @@ long zsetRank(robj *zobj, sds ele, int reverse) {
 
     llen = zsetLength(zobj);
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
 
-        eptr = ziplistIndex(zl,0);
+        eptr = lpSeek(zl,0);
         serverAssert(eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         rank = 1;
         while(eptr != NULL) {
-            if (ziplistCompare(eptr,(unsigned char*)ele,sdslen(ele)))
+            if (lpCompare(eptr,(unsigned char*)ele,sdslen(ele)))
                 break;
             rank++;
             zzlNext(zl,&eptr,&sptr);
@@ -1467,16 +1708,15 @@ long zsetRank(robj *zobj, sds ele, int reverse) {
         } else {
             return -1;
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
-        zskiplist *zsl = zs->zsl;
         dictEntry *de;
         double score;
 
         de = dictFind(zs->dict,ele);
         if (de != NULL) {
-            score = *(double*)dictGetVal(de);
-            rank = zslGetRank(zsl,score,ele);
+            score = dictGetDoubleVal(de);
+            rank = zbtGetRank(zs->zbt,score,ele);
             /* Existing elements always have a rank. */
             serverAssert(rank != 0);
             if (reverse)
@@ -1571,7 +1811,7 @@ void zaddGenericCommand(client *c, int flags) {
         {
             zobj = createZsetObject();
         } else {
-            zobj = createZsetZiplistObject();
+            zobj = createZsetListpackObject();
         }
         dbAdd(c->db,key,zobj);
     } else {
@@ -1704,7 +1944,7 @@ void zremrangeGenericCommand(client *c, int rangetype) {
     }
 
     /* Step 3: Perform the range deletion operation. */
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         switch(rangetype) {
         case ZRANGE_RANK:
             zobj->ptr = zzlDeleteRangeByRank(zobj->ptr,start+1,end+1,&deleted);
@@ -1720,17 +1960,17 @@ void zremrangeGenericCommand(client *c, int rangetype) {
             dbDelete(c->db,key);
             keyremoved = 1;
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
         switch(rangetype) {
         case ZRANGE_RANK:
-            deleted = zslDeleteRangeByRank(zs->zsl,start+1,end+1,zs->dict);
+            deleted = zbtDeleteRangeByRank(zs->zbt,start+1,end+1,zs->dict);
             break;
         case ZRANGE_SCORE:
-            deleted = zslDeleteRangeByScore(zs->zsl,&range,zs->dict);
+            deleted = zbtDeleteRangeByScore(zs->zbt,&range,zs->dict);
             break;
         case ZRANGE_LEX:
-            deleted = zslDeleteRangeByLex(zs->zsl,&lexrange,zs->dict);
+            deleted = zbtDeleteRangeByLex(zs->zbt,&lexrange,zs->dict);
             break;
         }
         if (htNeedsResize(zs->dict)) dictResize(zs->dict);
@@ -1797,8 +2037,8 @@ typedef struct {
             } zl;
             struct {
                 zset *zs;
-                zskiplistNode *node;
-            } sl;
+                zbtPos pos;
+            } bt;
         } zset;
     } iter;
 } zsetopsrc;
@@ -1846,16 +2086,16 @@ void zuiInitIterator(zsetopsrc *op) {
         }
     } else if (op->type == OBJ_ZSET) {
         iterzset *it = &op->iter.zset;
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             it->zl.zl = op->subject->ptr;
-            it->zl.eptr = ziplistIndex(it->zl.zl,0);
+            it->zl.eptr = lpSeek(it->zl.zl,0);
             if (it->zl.eptr != NULL) {
-                it->zl.sptr = ziplistNext(it->zl.zl,it->zl.eptr);
+                it->zl.sptr = lpNext(it->zl.zl,it->zl.eptr);
                 serverAssert(it->zl.sptr != NULL);
             }
-        } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
-            it->sl.zs = op->subject->ptr;
-            it->sl.node = it->sl.zs->zsl->header->level[0].forward;
+        } else if (op->encoding == OBJ_ENCODING_BTREE) {
+            it->bt.zs = op->subject->ptr;
+            zbtFirst(it->bt.zs->zbt,&it->bt.pos);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -1879,9 +2119,9 @@ void zuiClearIterator(zsetopsrc *op) {
         }
     } else if (op->type == OBJ_ZSET) {
         iterzset *it = &op->iter.zset;
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             UNUSED(it); /* skip */
-        } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
+        } else if (op->encoding == OBJ_ENCODING_BTREE) {
             UNUSED(it); /* skip */
         } else {
             serverPanic("Unknown sorted set encoding");
@@ -1905,11 +2145,11 @@ unsigned long zuiLength(zsetopsrc *op) {
             serverPanic("Unknown set encoding");
         }
     } else if (op->type == OBJ_ZSET) {
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             return zzlLength(op->subject->ptr);
-        } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
+        } else if (op->encoding == OBJ_ENCODING_BTREE) {
             zset *zs = op->subject->ptr;
-            return zs->zsl->length;
+            return zs->zbt->length;
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -1955,23 +2195,23 @@ int zuiNext(zsetopsrc *op, zsetopval *val) {
         }
     } else if (op->type == OBJ_ZSET) {
         iterzset *it = &op->iter.zset;
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             /* No need to check both, but better be explicit. */
             if (it->zl.eptr == NULL || it->zl.sptr == NULL)
                 return 0;
-            serverAssert(ziplistGet(it->zl.eptr,&val->estr,&val->elen,&val->ell));
+            serverAssert(lpGetValue(it->zl.eptr,&val->estr,&val->elen,&val->ell));
             val->score = zzlGetScore(it->zl.sptr);
 
             /* Move to next element. */
             zzlNext(it->zl.zl,&it->zl.eptr,&it->zl.sptr);
-        } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
-            if (it->sl.node == NULL)
+        } else if (op->encoding == OBJ_ENCODING_BTREE) {
+            if (it->bt.pos.leaf == NULL)
                 return 0;
-            val->ele = it->sl.node->ele;
-            val->score = it->sl.node->score;
+            val->ele = zbtPosEntry(&it->bt.pos)->ele;
+            val->score = zbtPosEntry(&it->bt.pos)->score;
 
             /* Move to next element. */
-            it->sl.node = it->sl.node->level[0].forward;
+            zbtNext(&it->bt.pos);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -2073,18 +2313,18 @@ int zuiFind(zsetopsrc *op, zsetopval *val, double *score) {
     } else if (op->type == OBJ_ZSET) {
         zuiSdsFromValue(val);
 
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             if (zzlFind(op->subject->ptr,val->ele,score) != NULL) {
                 /* Score is already set by zzlFind. */
                 return 1;
             } else {
                 return 0;
             }
-        } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
+        } else if (op->encoding == OBJ_ENCODING_BTREE) {
             zset *zs = op->subject->ptr;
             dictEntry *de;
             if ((de = dictFind(zs->dict,val->ele)) != NULL) {
-                *score = *(double*)dictGetVal(de);
+                *score = dictGetDoubleVal(de);
                 return 1;
             } else {
                 return 0;
@@ -2139,97 +2379,18 @@ dictType setAccumulatorDictType = {
     NULL                       /* val destructor */
 };
 
-void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
+/* Compute the union or the intersection of the 'setnum' inputs 'src', that
+ * are reordered, into a new sorted set object that is returned. The
+ * computation stops early if the background 'job' computing it (if any) is
+ * cancelled. */
+/* 计算多个有序集合的并集或者交集 返回对应的结果有序集合对象 */
+static robj *zunionInterCompute(zsetopsrc *src, long setnum, int op, int aggregate, setopsJob *job) {
     int i, j;
-    long setnum;
-    int aggregate = REDIS_AGGR_SUM;
-    zsetopsrc *src;
     zsetopval zval;
     sds tmp;
     size_t maxelelen = 0;
     robj *dstobj;
     zset *dstzset;
-    zskiplistNode *znode;
-    int touched = 0;
-
-    /* expect setnum input keys to be given */
-    if ((getLongFromObjectOrReply(c, c->argv[2], &setnum, NULL) != C_OK))
-        return;
-
-    if (setnum < 1) {
-        addReplyError(c,
-            "at least 1 input key is needed for ZUNIONSTORE/ZINTERSTORE");
-        return;
-    }
-
-    /* test if the expected number of keys would overflow */
-    if (setnum > c->argc-3) {
-        addReply(c,shared.syntaxerr);
-        return;
-    }
-
-    /* read keys to be used for input */
-    src = zcalloc(sizeof(zsetopsrc) * setnum);
-    for (i = 0, j = 3; i < setnum; i++, j++) {
-        robj *obj = lookupKeyWrite(c->db,c->argv[j]);
-        if (obj != NULL) {
-            if (obj->type != OBJ_ZSET && obj->type != OBJ_SET) {
-                zfree(src);
-                addReply(c,shared.wrongtypeerr);
-                return;
-            }
-
-            src[i].subject = obj;
-            src[i].type = obj->type;
-            src[i].encoding = obj->encoding;
-        } else {
-            src[i].subject = NULL;
-        }
-
-        /* Default all weights to 1. */
-        src[i].weight = 1.0;
-    }
-
-    /* parse optional extra arguments */
-    if (j < c->argc) {
-        int remaining = c->argc - j;
-
-        while (remaining) {
-            if (remaining >= (setnum + 1) &&
-                !strcasecmp(c->argv[j]->ptr,"weights"))
-            {
-                j++; remaining--;
-                for (i = 0; i < setnum; i++, j++, remaining--) {
-                    if (getDoubleFromObjectOrReply(c,c->argv[j],&src[i].weight,
-                            "weight value is not a float") != C_OK)
-                    {
-                        zfree(src);
-                        return;
-                    }
-                }
-            } else if (remaining >= 2 &&
-                       !strcasecmp(c->argv[j]->ptr,"aggregate"))
-            {
-                j++; remaining--;
-                if (!strcasecmp(c->argv[j]->ptr,"sum")) {
-                    aggregate = REDIS_AGGR_SUM;
-                } else if (!strcasecmp(c->argv[j]->ptr,"min")) {
-                    aggregate = REDIS_AGGR_MIN;
-                } else if (!strcasecmp(c->argv[j]->ptr,"max")) {
-                    aggregate = REDIS_AGGR_MAX;
-                } else {
-                    zfree(src);
-                    addReply(c,shared.syntaxerr);
-                    return;
-                }
-                j++; remaining--;
-            } else {
-                zfree(src);
-                addReply(c,shared.syntaxerr);
-                return;
-            }
-        }
-    }
 
     /* sort sets from the smallest to largest, this will improve our
      * algorithm's performance */
@@ -2248,6 +2409,7 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
             while (zuiNext(&src[0],&zval)) {
                 double score, value;
 
+                if (setopsJobCancelled(job)) break;
                 score = src[0].weight * zval.score;
                 if (isnan(score)) score = 0;
 
@@ -2268,8 +2430,7 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
                 /* Only continue when present in every input. */
                 if (j == setnum) {
                     tmp = zuiNewSdsFromValue(&zval);
-                    znode = zslInsert(dstzset->zsl,score,tmp);
-                    dictAdd(dstzset->dict,tmp,&znode->score);
+                    zsetInsertElement(dstzset,score,tmp);
                     if (sdslen(tmp) > maxelelen) maxelelen = sdslen(tmp);
                 }
             }
@@ -2294,6 +2455,8 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
 
             zuiInitIterator(&src[i]);
             while (zuiNext(&src[i],&zval)) {
+                if (setopsJobCancelled(job)) break;
+
                 /* Initialize value */
                 score = src[i].weight * zval.score;
                 if (isnan(score)) score = 0;
@@ -2304,7 +2467,7 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
                 if (!existing) {
                     tmp = zuiNewSdsFromValue(&zval);
                     /* Remember the longest single element encountered,
-                     * to understand if it's possible to convert to ziplist
+                     * to understand if it's possible to convert to listpack
                      * at the end. */
                      if (sdslen(tmp) > maxelelen) maxelelen = sdslen(tmp);
                     /* Update the element with its initial score. */
@@ -2334,8 +2497,7 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
         while((de = dictNext(di)) != NULL) {
             sds ele = dictGetKey(de);
             score = dictGetDoubleVal(de);
-            znode = zslInsert(dstzset->zsl,score,ele);
-            dictAdd(dstzset->dict,ele,&znode->score);
+            zsetInsertElement(dstzset,score,ele);
         }
         dictReleaseIterator(di);
         dictRelease(accumulator);
@@ -2343,10 +2505,146 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
         serverPanic("Unknown operator");
     }
 
+    /* The iteration stopped early if the job was cancelled. */
+    if (zval.flags & OPVAL_DIRTY_SDS) sdsfree(zval.ele);
+
+    if (dstzset->zbt->length) zsetConvertToListpackIfNeeded(dstobj,maxelelen);
+    return dstobj;
+}
+
+/* ZUNIONSTORE/ZINTERSTORE computed by the BIO_SETOPS thread, see setops.c. */
+/* 后台线程中计算有序集合并集或者交集的处理函数 */
+static void zunionInterJobProc(setopsJob *job) {
+    zsetopsrc *src = zcalloc(sizeof(zsetopsrc) * job->numsets);
+    int i;
+
+    for (i = 0; i < job->numsets; i++) {
+        robj *obj = job->sets[i];
+
+        if (obj != NULL) {
+            src[i].subject = obj;
+            src[i].type = obj->type;
+            src[i].encoding = obj->encoding;
+        }
+        src[i].weight = job->weights[i];
+    }
+    job->result = zunionInterCompute(src,job->numsets,job->op,job->aggregate,job);
+    zfree(src);
+}
+
+void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
+    int i, j;
+    long setnum;
+    int aggregate = REDIS_AGGR_SUM;
+    zsetopsrc *src;
+    robj **objs, *dstobj;
+    unsigned long long work = 0;
+    int touched = 0;
+
+    /* expect setnum input keys to be given */
+    if ((getLongFromObjectOrReply(c, c->argv[2], &setnum, NULL) != C_OK))
+        return;
+
+    if (setnum < 1) {
+        addReplyError(c,
+            "at least 1 input key is needed for ZUNIONSTORE/ZINTERSTORE");
+        return;
+    }
+
+    /* test if the expected number of keys would overflow */
+    if (setnum > c->argc-3) {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+
+    /* read keys to be used for input */
+    src = zcalloc(sizeof(zsetopsrc) * setnum);
+    for (i = 0, j = 3; i < setnum; i++, j++) {
+        robj *obj = lookupKeyWriteShared(c->db,c->argv[j]);
+        if (obj != NULL) {
+            if (obj->type != OBJ_ZSET && obj->type != OBJ_SET) {
+                zfree(src);
+                addReply(c,shared.wrongtypeerr);
+                return;
+            }
+
+            src[i].subject = obj;
+            src[i].type = obj->type;
+            src[i].encoding = obj->encoding;
+        } else {
+            src[i].subject = NULL;
+        }
+
+        /* Default all weights to 1. */
+        src[i].weight = 1.0;
+    }
+
+    /* parse optional extra arguments */
+    if (j < c->argc) {
+        int remaining = c->argc - j;
+
+        while (remaining) {
+            if (remaining >= (setnum + 1) &&
+                !strcasecmp(c->argv[j]->ptr,"weights"))
+            {
+                j++; remaining--;
+                for (i = 0; i < setnum; i++, j++, remaining--) {
+                    if (getDoubleFromObjectOrReply(c,c->argv[j],&src[i].weight,
+                            "weight value is not a float") != C_OK)
+                    {
+                        zfree(src);
+                        return;
+                    }
+                }
+            } else if (remaining >= 2 &&
+                       !strcasecmp(c->argv[j]->ptr,"aggregate"))
+            {
+                j++; remaining--;
+                if (!strcasecmp(c->argv[j]->ptr,"sum")) {
+                    aggregate = REDIS_AGGR_SUM;
+                } else if (!strcasecmp(c->argv[j]->ptr,"min")) {
+                    aggregate = REDIS_AGGR_MIN;
+                } else if (!strcasecmp(c->argv[j]->ptr,"max")) {
+                    aggregate = REDIS_AGGR_MAX;
+                } else {
+                    zfree(src);
+                    addReply(c,shared.syntaxerr);
+                    return;
+                }
+                j++; remaining--;
+            } else {
+                zfree(src);
+                addReply(c,shared.syntaxerr);
+                return;
+            }
+        }
+    }
+
+    /* Compute huge unions and intersections in background. */
+    objs = zmalloc(sizeof(robj*) * setnum);
+    for (i = 0; i < setnum; i++) {
+        objs[i] = src[i].subject;
+        work += zuiLength(&src[i]);
+    }
+    dstobj = setopsTakeResult(c,objs,setnum);
+    if (dstobj == NULL && setopsShouldOffload(c,work)) {
+        setopsJob *job = setopsCreateJob(c,objs,setnum);
+
+        job->op = op;
+        job->aggregate = aggregate;
+        job->weights = zmalloc(sizeof(double) * setnum);
+        for (i = 0; i < setnum; i++) job->weights[i] = src[i].weight;
+        setopsStartJob(job,zunionInterJobProc);
+        zfree(objs);
+        zfree(src);
+        return;
+    }
+    zfree(objs);
+    if (dstobj == NULL) dstobj = zunionInterCompute(src,setnum,op,aggregate,NULL);
+
     if (dbDelete(c->db,dstkey))
         touched = 1;
-    if (dstzset->zsl->length) {
-        zsetConvertToZiplistIfNeeded(dstobj,maxelelen);
+    if (zsetLength(dstobj)) {
         dbAdd(c->db,dstkey,dstobj);
         addReplyLongLong(c,zsetLength(dstobj));
         signalModifiedKey(c->db,dstkey);
@@ -2414,7 +2712,7 @@ void zrangeGenericCommand(client *c, int reverse) {
     /* Return the result in form of a multi-bulk reply */
     addReplyMultiBulkLen(c, withscores ? (rangelen*2) : rangelen);
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -2422,16 +2720,16 @@ void zrangeGenericCommand(client *c, int reverse) {
         long long vlong;
 
         if (reverse)
-            eptr = ziplistIndex(zl,-2-(2*start));
+            eptr = lpSeek(zl,-2-(2*start));
         else
-            eptr = ziplistIndex(zl,2*start);
+            eptr = lpSeek(zl,2*start);
 
         serverAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
 
         while (rangelen--) {
             serverAssertWithInfo(c,zobj,eptr != NULL && sptr != NULL);
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            serverAssertWithInfo(c,zobj,lpGetValue(eptr,&vstr,&vlen,&vlong));
             if (vstr == NULL)
                 addReplyBulkLongLong(c,vlong);
             else
@@ -2446,30 +2744,32 @@ void zrangeGenericCommand(client *c, int reverse) {
                 zzlNext(zl,&eptr,&sptr);
         }
 
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
-        zskiplist *zsl = zs->zsl;
-        zskiplistNode *ln;
-        sds ele;
+        zbtree *zbt = zs->zbt;
+        zbtPos pos;
+        zbtEntry *e;
 
         /* Check if starting point is trivial, before doing log(N) lookup. */
         if (reverse) {
-            ln = zsl->tail;
             if (start > 0)
-                ln = zslGetElementByRank(zsl,llen-start);
+                zbtGetElementByRank(zbt,llen-start,&pos);
+            else
+                zbtLast(zbt,&pos);
         } else {
-            ln = zsl->header->level[0].forward;
             if (start > 0)
-                ln = zslGetElementByRank(zsl,start+1);
+                zbtGetElementByRank(zbt,start+1,&pos);
+            else
+                zbtFirst(zbt,&pos);
         }
 
         while(rangelen--) {
-            serverAssertWithInfo(c,zobj,ln != NULL);
-            ele = ln->ele;
-            addReplyBulkCBuffer(c,ele,sdslen(ele));
+            serverAssertWithInfo(c,zobj,pos.leaf != NULL);
+            e = zbtPosEntry(&pos);
+            addReplyBulkCBuffer(c,e->ele,sdslen(e->ele));
             if (withscores)
-                addReplyDouble(c,ln->score);
-            ln = reverse ? ln->backward : ln->level[0].forward;
+                addReplyDouble(c,e->score);
+            if (reverse) zbtPrev(&pos); else zbtNext(&pos);
         }
     } else {
         serverPanic("Unknown sorted set encoding");
@@ -2539,7 +2839,7 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
     if ((zobj = lookupKeyReadOrReply(c,key,shared.emptymultibulk)) == NULL ||
         checkType(c,zobj,OBJ_ZSET)) return;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -2562,7 +2862,7 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
 
         /* Get score pointer for the first element. */
         serverAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
 
         /* We don't know in advance how many matching elements there are in the
          * list, so we push this object that will represent the multi-bulk
@@ -2589,8 +2889,8 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
                 if (!zslValueLteMax(score,&range)) break;
             }
 
-            /* We know the element exists, so ziplistGet should always succeed */
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            /* We know the element exists, so lpGetValue should always succeed */
+            serverAssertWithInfo(c,zobj,lpGetValue(eptr,&vstr,&vlen,&vlong));
 
             rangelen++;
             if (vstr == NULL) {
@@ -2610,20 +2910,21 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
                 zzlNext(zl,&eptr,&sptr);
             }
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
-        zskiplist *zsl = zs->zsl;
-        zskiplistNode *ln;
+        zbtree *zbt = zs->zbt;
+        zbtPos pos;
+        zbtEntry *e;
 
-        /* If reversed, get the last node in range as starting point. */
+        /* If reversed, get the last element in range as starting point. */
         if (reverse) {
-            ln = zslLastInRange(zsl,&range);
+            zbtLastInRange(zbt,&range,&pos);
         } else {
-            ln = zslFirstInRange(zsl,&range);
+            zbtFirstInRange(zbt,&range,&pos);
         }
 
         /* No "first" element in the specified interval. */
-        if (ln == NULL) {
+        if (pos.leaf == NULL) {
             addReply(c, shared.emptymultibulk);
             return;
         }
@@ -2633,36 +2934,44 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
          * length in the output buffer, and will "fix" it later */
         replylen = addDeferredMultiBulkLength(c);
 
-        /* If there is an offset, just traverse the number of elements without
-         * checking the score because that is done in the next loop. */
-        while (ln && offset--) {
+        /* If there is an offset, jump directly to the element having the
+         * rank of the first one plus the offset, without checking the score
+         * because that is done in the next loop. */
+        if (offset > 0) {
+            unsigned long rank;
+
+            e = zbtPosEntry(&pos);
+            rank = zbtGetRank(zbt,e->score,e->ele);
             if (reverse) {
-                ln = ln->backward;
+                rank = (unsigned long)offset < rank ? rank-offset : 0;
             } else {
-                ln = ln->level[0].forward;
+                rank += offset;
             }
+            zbtGetElementByRank(zbt,rank,&pos);
         }
 
-        while (ln && limit--) {
-            /* Abort when the node is no longer in range. */
+        while (pos.leaf && limit--) {
+            e = zbtPosEntry(&pos);
+
+            /* Abort when the element is no longer in range. */
             if (reverse) {
-                if (!zslValueGteMin(ln->score,&range)) break;
+                if (!zslValueGteMin(e->score,&range)) break;
             } else {
-                if (!zslValueLteMax(ln->score,&range)) break;
+                if (!zslValueLteMax(e->score,&range)) break;
             }
 
             rangelen++;
-            addReplyBulkCBuffer(c,ln->ele,sdslen(ln->ele));
+            addReplyBulkCBuffer(c,e->ele,sdslen(e->ele));
 
             if (withscores) {
-                addReplyDouble(c,ln->score);
+                addReplyDouble(c,e->score);
             }
 
-            /* Move to next node */
+            /* Move to next element */
             if (reverse) {
-                ln = ln->backward;
+                zbtPrev(&pos);
             } else {
-                ln = ln->level[0].forward;
+                zbtNext(&pos);
             }
         }
     } else {
@@ -2700,7 +3009,7 @@ void zcountCommand(client *c) {
     if ((zobj = lookupKeyReadOrReply(c, key, shared.czero)) == NULL ||
         checkType(c, zobj, OBJ_ZSET)) return;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         double score;
@@ -2715,7 +3024,7 @@ void zcountCommand(client *c) {
         }
 
         /* First element is in range */
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         score = zzlGetScore(sptr);
         serverAssertWithInfo(c,zobj,zslValueLteMax(score,&range));
 
@@ -2731,29 +3040,17 @@ void zcountCommand(client *c) {
                 zzlNext(zl,&eptr,&sptr);
             }
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
-        zskiplist *zsl = zs->zsl;
-        zskiplistNode *zn;
-        unsigned long rank;
-
-        /* Find first element in range */
-        zn = zslFirstInRange(zsl, &range);
-
-        /* Use rank of first element, if any, to determine preliminary count */
-        if (zn != NULL) {
-            rank = zslGetRank(zsl, zn->score, zn->ele);
-            count = (zsl->length - (rank - 1));
-
-            /* Find last element in range */
-            zn = zslLastInRange(zsl, &range);
-
-            /* Use rank of last element, if any, to determine the actual count */
-            if (zn != NULL) {
-                rank = zslGetRank(zsl, zn->score, zn->ele);
-                count -= (zsl->length - rank);
-            }
-        }
+        zbtPos pos;
+        unsigned long first, last;
+
+        /* The count is the difference between the number of elements
+         * before the first one past the range and the number of elements
+         * before the first one in range. */
+        first = zbtSeekFirst(zs->zbt,zbtPassGteMin,&range,&pos);
+        last = zbtSeekFirst(zs->zbt,zbtFailLteMax,&range,&pos);
+        if (last > first) count = last-first;
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -2781,7 +3078,7 @@ void zlexcountCommand(client *c) {
         return;
     }
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
 
@@ -2796,7 +3093,7 @@ void zlexcountCommand(client *c) {
         }
 
         /* First element is in range */
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssertWithInfo(c,zobj,zzlLexValueLteMax(eptr,&range));
 
         /* Iterate over elements in range */
@@ -2809,29 +3106,17 @@ void zlexcountCommand(client *c) {
                 zzlNext(zl,&eptr,&sptr);
             }
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
-        zskiplist *zsl = zs->zsl;
-        zskiplistNode *zn;
-        unsigned long rank;
-
-        /* Find first element in range */
-        zn = zslFirstInLexRange(zsl, &range);
-
-        /* Use rank of first element, if any, to determine preliminary count */
-        if (zn != NULL) {
-            rank = zslGetRank(zsl, zn->score, zn->ele);
-            count = (zsl->length - (rank - 1));
-
-            /* Find last element in range */
-            zn = zslLastInLexRange(zsl, &range);
-
-            /* Use rank of last element, if any, to determine the actual count */
-            if (zn != NULL) {
-                rank = zslGetRank(zsl, zn->score, zn->ele);
-                count -= (zsl->length - rank);
-            }
-        }
+        zbtPos pos;
+        unsigned long first, last;
+
+        /* The count is the difference between the number of elements
+         * before the first one past the range and the number of elements
+         * before the first one in range. */
+        first = zbtSeekFirst(zs->zbt,zbtPassLexGteMin,&range,&pos);
+        last = zbtSeekFirst(zs->zbt,zbtFailLexLteMax,&range,&pos);
+        if (last > first) count = last-first;
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -2894,7 +3179,7 @@ void genericZrangebylexCommand(client *c, int reverse) {
         return;
     }
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -2917,7 +3202,7 @@ void genericZrangebylexCommand(client *c, int reverse) {
 
         /* Get score pointer for the first element. */
         serverAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
 
         /* We don't know in advance how many matching elements there are in the
          * list, so we push this object that will represent the multi-bulk
@@ -2942,9 +3227,9 @@ void genericZrangebylexCommand(client *c, int reverse) {
                 if (!zzlLexValueLteMax(eptr,&range)) break;
             }
 
-            /* We know the element exists, so ziplistGet should always
+            /* We know the element exists, so lpGetValue should always
              * succeed. */
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            serverAssertWithInfo(c,zobj,lpGetValue(eptr,&vstr,&vlen,&vlong));
 
             rangelen++;
             if (vstr == NULL) {
@@ -2960,20 +3245,21 @@ void genericZrangebylexCommand(client *c, int reverse) {
                 zzlNext(zl,&eptr,&sptr);
             }
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
-        zskiplist *zsl = zs->zsl;
-        zskiplistNode *ln;
+        zbtree *zbt = zs->zbt;
+        zbtPos pos;
+        zbtEntry *e;
 
-        /* If reversed, get the last node in range as starting point. */
+        /* If reversed, get the last element in range as starting point. */
         if (reverse) {
-            ln = zslLastInLexRange(zsl,&range);
+            zbtLastInLexRange(zbt,&range,&pos);
         } else {
-            ln = zslFirstInLexRange(zsl,&range);
+            zbtFirstInLexRange(zbt,&range,&pos);
         }
 
         /* No "first" element in the specified interval. */
-        if (ln == NULL) {
+        if (pos.leaf == NULL) {
             addReply(c, shared.emptymultibulk);
             zslFreeLexRange(&range);
             return;
@@ -2984,32 +3270,40 @@ void genericZrangebylexCommand(client *c, int reverse) {
          * length in the output buffer, and will "fix" it later */
         replylen = addDeferredMultiBulkLength(c);
 
-        /* If there is an offset, just traverse the number of elements without
-         * checking the score because that is done in the next loop. */
-        while (ln && offset--) {
+        /* If there is an offset, jump directly to the element having the
+         * rank of the first one plus the offset, without checking the range
+         * because that is done in the next loop. */
+        if (offset > 0) {
+            unsigned long rank;
+
+            e = zbtPosEntry(&pos);
+            rank = zbtGetRank(zbt,e->score,e->ele);
             if (reverse) {
-                ln = ln->backward;
+                rank = (unsigned long)offset < rank ? rank-offset : 0;
             } else {
-                ln = ln->level[0].forward;
+                rank += offset;
             }
+            zbtGetElementByRank(zbt,rank,&pos);
         }
 
-        while (ln && limit--) {
-            /* Abort when the node is no longer in range. */
+        while (pos.leaf && limit--) {
+            e = zbtPosEntry(&pos);
+
+            /* Abort when the element is no longer in range. */
             if (reverse) {
-                if (!zslLexValueGteMin(ln->ele,&range)) break;
+                if (!zslLexValueGteMin(e->ele,&range)) break;
             } else {
-                if (!zslLexValueLteMax(ln->ele,&range)) break;
+                if (!zslLexValueLteMax(e->ele,&range)) break;
             }
 
             rangelen++;
-            addReplyBulkCBuffer(c,ln->ele,sdslen(ln->ele));
+            addReplyBulkCBuffer(c,e->ele,sdslen(e->ele));
 
-            /* Move to next node */
+            /* Move to next element */
             if (reverse) {
-                ln = ln->backward;
+                zbtPrev(&pos);
             } else {
-                ln = ln->level[0].forward;
+                zbtNext(&pos);
             }
         }
     } else {
@@ -3141,7 +3435,7 @@ void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey
 
     /* Remove the element. */
     do {
-        if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
             unsigned char *zl = zobj->ptr;
             unsigned char *eptr, *sptr;
             unsigned char *vstr;
@@ -3149,30 +3443,32 @@ void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey
             long long vlong;
 
             /* Get the first or last element in the sorted set. */
-            eptr = ziplistIndex(zl,where == ZSET_MAX ? -2 : 0);
+            eptr = lpSeek(zl,where == ZSET_MAX ? -2 : 0);
             serverAssertWithInfo(c,zobj,eptr != NULL);
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            serverAssertWithInfo(c,zobj,lpGetValue(eptr,&vstr,&vlen,&vlong));
             if (vstr == NULL)
                 ele = sdsfromlonglong(vlong);
             else
                 ele = sdsnewlen(vstr,vlen);
 
             /* Get the score. */
-            sptr = ziplistNext(zl,eptr);
+            sptr = lpNext(zl,eptr);
             serverAssertWithInfo(c,zobj,sptr != NULL);
             score = zzlGetScore(sptr);
-        } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+        } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
             zset *zs = zobj->ptr;
-            zskiplist *zsl = zs->zsl;
-            zskiplistNode *zln;
+            zbtPos pos;
+            zbtEntry *e;
 
             /* Get the first or last element in the sorted set. */
-            zln = (where == ZSET_MAX ? zsl->tail : zsl->header->level[0].forward);
+            if (where == ZSET_MAX) zbtLast(zs->zbt,&pos);
+            else zbtFirst(zs->zbt,&pos);
 
             /* There must be an element in the sorted set. */
-            serverAssertWithInfo(c,zobj,zln != NULL);
-            ele = sdsdup(zln->ele);
-            score = zln->score;
+            serverAssertWithInfo(c,zobj,pos.leaf != NULL);
+            e = zbtPosEntry(&pos);
+            ele = sdsdup(e->ele);
+            score = e->score;
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -43,6 +43,12 @@
 
 #include "util.h"
 #include "sha1.h"
+#include "grisu.h"
+#include "fastfloat.h"
+
+/* When true d2string() uses the shortest representation that round-trips,
+ * otherwise the digits printed by "%.17g". */
+static int d2string_shortest = 1;
 
 /* Glob-style pattern matching. */
 int stringmatchlen(const char *pattern, int patternLen,
@@ -456,7 +462,7 @@ int string2ld(const char *s, size_t slen, long double *dp) {
     buf[slen] = '\0';
 
     errno = 0;
-    value = strtold(buf, &eptr);
+    value = fastStrtold(buf, &eptr);
     if (isspace(buf[0]) || eptr[0] != '\0' ||
         (errno == ERANGE &&
             (value == HUGE_VAL || value == -HUGE_VAL || value == 0)) ||
@@ -471,8 +477,12 @@ int string2ld(const char *s, size_t slen, long double *dp) {
 /* Convert a double to a string representation. Returns the number of bytes
  * required. The representation should always be parsable by strtod(3).
  * This function does not support human-friendly formatting like ld2string
- * does. It is intended mainly to be used inside t_zset.c when writing scores
- * into a ziplist representing a sorted set. */
+ * does. It is used to write scores into a listpack representing a sorted
+ * set, and to format the doubles sent to clients and to the AOF.
+ *
+ * Unless disabled with d2stringSetShortest(), non integer values are
+ * printed with the shortest digits that are parsed back into the same
+ * double, with the same layout of "%.17g" (see grisu.c). */
 int d2string(char *buf, size_t len, double value) {
     if (isnan(value)) {
         len = snprintf(buf,len,"nan");
@@ -504,12 +514,22 @@ int d2string(char *buf, size_t len, double value) {
             len = ll2string(buf,len,(long long)value);
         else
 #endif
+        if (d2string_shortest && len >= GRISU_DTOA_BUFLEN)
+            len = grisuDtoa(value,buf);
+        else
             len = snprintf(buf,len,"%.17g",value);
     }
 
     return len;
 }
 
+/* Select the representation used by d2string(): the shortest one if
+ * 'shortest' is true, the old "%.17g" one otherwise. */
+/* 设置d2string使用的浮点数格式化方式 */
+void d2stringSetShortest(int shortest) {
+    d2string_shortest = shortest;
+}
+
 /* Convert a long double into a string. If humanfriendly is non-zero
  * it does not use exponential format and trims trailing zeroes at the end,
  * however this results in loss of precision. Otherwise exp format is used
@@ -843,6 +863,45 @@ static void test_ll2string(void) {
     assert(!strcmp(buf, "9223372036854775807"));
 }
 
+static void test_d2string(void) {
+    char buf[128];
+    double v, back;
+    int sz, j;
+
+    sz = d2string(buf, sizeof buf, 0.1);
+    assert(sz == 3);
+    assert(!strcmp(buf, "0.1"));
+
+    sz = d2string(buf, sizeof buf, -2.5);
+    assert(sz == 4);
+    assert(!strcmp(buf, "-2.5"));
+
+    /* Same notation of "%.17g". */
+    d2string(buf, sizeof buf, 0.00001);
+    assert(!strcmp(buf, "1e-05"));
+    d2string(buf, sizeof buf, 1.5e300);
+    assert(!strcmp(buf, "1.5e+300"));
+    d2string(buf, sizeof buf, 123456789012345678.0);
+    assert(!strcmp(buf, "1.2345678901234568e+17"));
+    d2string(buf, sizeof buf, 5e-324);
+    assert(!strcmp(buf, "5e-324"));
+
+    /* Every value is parsed back into the same double. */
+    for (j = 0; j < 100000; j++) {
+        v = (double)rand()/RAND_MAX * pow(10,rand()%40-20);
+        if (rand() & 1) v = -v;
+        d2string(buf, sizeof buf, v);
+        back = strtod(buf, NULL);
+        assert(back == v);
+        assert(strlen(buf) <= 24);
+    }
+
+    d2stringSetShortest(0);
+    d2string(buf, sizeof buf, 0.1);
+    assert(!strcmp(buf, "0.10000000000000001"));
+    d2stringSetShortest(1);
+}
+
 #define UNUSED(x) (void)(x)
 int utilTest(int argc, char **argv) {
     UNUSED(argc);
@@ -851,6 +910,7 @@ int utilTest(int argc, char **argv) {
     test_string2ll();
     test_string2l();
     test_ll2string();
+    test_d2string();
     return 0;
 }
 #endif
@@ -0,0 +1,78 @@
+# Test CLUSTER MIGRATESLOT.
+
+source "../tests/includes/init-tests.tcl"
+
+test "Create a 3 nodes cluster" {
+    create_cluster 3 0
+}
+
+test "Cluster is up" {
+    assert_cluster_state ok
+}
+
+set numkeys 5000
+set slot [R 0 cluster keyslot "{migrateslot}"]
+
+# Return the instance ID of the master (among the first three) claiming
+# to own 'slot'.
+proc slot_owner {slot} {
+    for {set id 0} {$id < 3} {incr id} {
+        foreach range [dict get [get_myself $id] slots] {
+            set range [split $range -]
+            set start [lindex $range 0]
+            set end [lindex $range end]
+            if {$slot >= $start && $slot <= $end} {return $id}
+        }
+    }
+    return -1
+}
+
+test "Populate the slot" {
+    set owner [slot_owner $slot]
+    for {set j 0} {$j < $numkeys} {incr j} {
+        R $owner set "{migrateslot}:$j" $j
+    }
+    R $owner rpush "{migrateslot}:list" {*}[lrepeat 1000 abcdefghij]
+    assert {[R $owner cluster countkeysinslot $slot] == $numkeys+1}
+}
+
+test "CLUSTER MIGRATESLOT moves keys and ownership of the slot" {
+    set source [slot_owner $slot]
+    set target [expr {($source+1) % 3}]
+    set target_id [dict get [get_myself $target] id]
+
+    assert_equal OK [R $source cluster migrateslot $slot $target_id batch 64]
+    assert {[R $source cluster countkeysinslot $slot] == 0}
+    assert {[R $target cluster countkeysinslot $slot] == $numkeys+1}
+    assert {[slot_owner $slot] == $target}
+    catch {R $source get "{migrateslot}:0"} err
+    assert_match "MOVED $slot *" $err
+}
+
+test "The new owner is propagated to the whole cluster" {
+    set target [slot_owner $slot]
+    foreach_redis_id id {
+        wait_for_condition 1000 50 {
+            [catch {R $id get "{migrateslot}:1"} reply] == 0 ||
+            [string match "MOVED $slot *:[get_instance_attrib redis $target port]" $reply]
+        } else {
+            fail "Node #$id does not know about the new slot owner"
+        }
+    }
+}
+
+test "Keys are readable in the new owner" {
+    set owner [slot_owner $slot]
+    for {set j 0} {$j < $numkeys} {incr j} {
+        assert_equal $j [R $owner get "{migrateslot}:$j"]
+    }
+    assert_equal 1000 [R $owner llen "{migrateslot}:list"]
+}
+
+test "CLUSTER MIGRATESLOT rejects slots not served by the node" {
+    set owner [slot_owner $slot]
+    set other [expr {($owner+1) % 3}]
+    set owner_id [dict get [get_myself $owner] id]
+    catch {R $other cluster migrateslot $slot $owner_id} err
+    assert_match "*not the owner*" $err
+}
@@ -0,0 +1,65 @@
+# Check the keyspace API when keys are split into per-slot dictionaries.
+
+source "../tests/includes/init-tests.tcl"
+
+test "Create a 1 node cluster" {
+    create_cluster 1 0
+}
+
+test "Cluster is up" {
+    assert_cluster_state ok
+}
+
+set numkeys 20000
+
+test "Populate the node" {
+    R 0 debug populate $numkeys
+    assert_equal $numkeys [R 0 dbsize]
+}
+
+test "SCAN returns every key across slots" {
+    set cursor 0
+    set keys {}
+    while 1 {
+        set res [R 0 scan $cursor count 100]
+        set cursor [lindex $res 0]
+        lappend keys {*}[lindex $res 1]
+        if {$cursor == 0} break
+    }
+    assert_equal $numkeys [llength [lsort -unique $keys]]
+}
+
+test "KEYS and RANDOMKEY see the whole keyspace" {
+    assert_equal $numkeys [llength [R 0 keys *]]
+    for {set j 0} {$j < 100} {incr j} {
+        assert_match "key:*" [R 0 randomkey]
+    }
+}
+
+test "COUNTKEYSINSLOT and GETKEYSINSLOT match the keyspace" {
+    set total 0
+    foreach key {key:0 key:1 key:2 key:3 key:4} {
+        set slot [R 0 cluster keyslot $key]
+        set count [R 0 cluster countkeysinslot $slot]
+        set keys [R 0 cluster getkeysinslot $slot 1000]
+        assert_equal $count [llength $keys]
+        assert {[lsearch $keys $key] != -1}
+        foreach k $keys {
+            assert_equal $slot [R 0 cluster keyslot $k]
+        }
+    }
+}
+
+test "DEBUG RELOAD preserves the keyspace" {
+    set digest [R 0 debug digest]
+    R 0 debug reload
+    assert_equal $digest [R 0 debug digest]
+    assert_equal $numkeys [R 0 dbsize]
+}
+
+test "FLUSHALL ASYNC empties all the slots" {
+    R 0 flushall async
+    assert_equal 0 [R 0 dbsize]
+    assert_equal 0 [R 0 cluster countkeysinslot [R 0 cluster keyslot key:0]]
+    assert_equal {} [R 0 randomkey]
+}
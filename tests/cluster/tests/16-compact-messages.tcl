@@ -0,0 +1,55 @@
+# Check that nodes use compact bus messages, and that slots changes are
+# still propagated both with compact and normal messages.
+
+source "../tests/includes/init-tests.tcl"
+
+test "Create a 3 nodes cluster" {
+    create_cluster 3 3
+}
+
+test "Cluster is up" {
+    assert_cluster_state ok
+}
+
+test "Nodes exchange compact messages" {
+    foreach_redis_id id {
+        wait_for_condition 1000 50 {
+            [CI $id cluster_stats_messages_compact_received] > 0
+        } else {
+            fail "Node #$id never received compact messages"
+        }
+    }
+}
+
+# Assign 'slot' to the master with instance ID 'id', and wait for every
+# node to learn about the new owner.
+proc move_slot_and_wait {slot id} {
+    set owner_id [dict get [get_myself $id] id]
+    R $id cluster setslot $slot node $owner_id
+    R $id cluster bumpepoch
+    foreach_redis_id j {
+        wait_for_condition 1000 50 {
+            [lsearch -exact [dict get [get_node_by_id $j $owner_id] slots] $slot] != -1 ||
+            [lsearch -glob [dict get [get_node_by_id $j $owner_id] slots] "$slot-*"] != -1
+        } else {
+            fail "Node #$j does not know that slot $slot moved"
+        }
+    }
+}
+
+test "Slots changes are propagated with compact messages" {
+    move_slot_and_wait 0 1
+}
+
+test "Nodes with compact messages disabled still interoperate" {
+    R 0 config set cluster-compact-messages no
+    # Wait for the other nodes to notice and stop sending compact messages.
+    after 3000
+    set before [CI 0 cluster_stats_messages_compact_received]
+    after 2000
+    assert_equal $before [CI 0 cluster_stats_messages_compact_received]
+
+    move_slot_and_wait 1 2
+    assert_cluster_state ok
+    R 0 config set cluster-compact-messages yes
+}
@@ -0,0 +1,96 @@
+# Test SPUBLISH propagation: shard channel messages should only reach the
+# master and the replicas serving the slot of the channel.
+
+source "../tests/includes/init-tests.tcl"
+
+test "Create a 5 nodes cluster" {
+    create_cluster 5 5
+}
+
+test "Cluster is up" {
+    assert_cluster_state ok
+}
+
+set channel "shardchannel"
+set slot [R 0 cluster keyslot $channel]
+
+# Find the master serving the channel slot and its replicas. SPUBLISH gets
+# a MOVED error from every other master.
+set owner -1
+for {set j 0} {$j < 5} {incr j} {
+    if {![catch {R $j spublish $channel hello}]} {set owner $j}
+}
+set owner_node_id [dict get [get_myself $owner] id]
+set replicas {}
+for {set j 5} {$j < 10} {incr j} {
+    if {[dict get [get_myself $j] slaveof] eq $owner_node_id} {
+        lappend replicas $j
+    }
+}
+
+test "The channel slot is served by one master with replicas" {
+    assert {$owner != -1}
+    assert {[llength $replicas] > 0}
+}
+
+test "SSUBSCRIBE is redirected by nodes not serving the slot" {
+    set other [expr {($owner+1)%5}]
+    catch {R $other ssubscribe $channel} err
+    assert_match "MOVED $slot *" $err
+}
+
+# Return a new deferring client connected to the instance 'id'.
+proc subscriber_client {id} {
+    redis [get_instance_attrib redis $id host] \
+          [get_instance_attrib redis $id port] 1
+}
+
+test "SPUBLISH only reaches the nodes of the shard" {
+    set shard [concat $owner $replicas]
+    foreach id $shard {
+        set sub($id) [subscriber_client $id]
+        $sub($id) ssubscribe $channel
+        assert_equal [list ssubscribe $channel 1] [$sub($id) read]
+    }
+
+    foreach_redis_id id {
+        set received($id) [CI $id cluster_stats_messages_publishshard_received]
+    }
+
+    set data [randomValue]
+    catch {R [lindex $replicas 0] spublish $channel $data} err
+    assert_match "MOVED $slot *" $err
+
+    assert_equal 1 [R $owner spublish $channel $data]
+    foreach id $shard {
+        assert_equal [list smessage $channel $data] [$sub($id) read]
+    }
+
+    foreach_redis_id id {
+        if {$id == $owner} continue
+        if {[lsearch $shard $id] != -1} {
+            wait_for_condition 1000 50 {
+                [CI $id cluster_stats_messages_publishshard_received] ==
+                $received($id)+1
+            } else {
+                fail "Node #$id did not receive the shard message"
+            }
+        } else {
+            assert_equal $received($id) \
+                [CI $id cluster_stats_messages_publishshard_received]
+        }
+    }
+}
+
+test "Subscribers are unsubscribed when the slot moves to another shard" {
+    set target [expr {($owner+1)%5}]
+    set target_node_id [dict get [get_myself $target] id]
+    R $target cluster setslot $slot node $target_node_id
+    R $target cluster bumpepoch
+
+    foreach id [concat $owner $replicas] {
+        assert_equal [list sunsubscribe $channel 0] [$sub($id) read]
+        $sub($id) close
+        assert_equal {} [R $id pubsub shardchannels]
+    }
+}
@@ -0,0 +1,90 @@
+# Check CLUSTER SLOT-STATS and rebalancing the cluster by slots load.
+
+source "../tests/includes/init-tests.tcl"
+
+test "Create a 3 nodes cluster" {
+    create_cluster 3 0
+}
+
+test "Cluster is up" {
+    assert_cluster_state ok
+}
+
+# Return the stats of a slot served by the instance 'id' as a dictionary.
+proc slot_stats {id slot} {
+    set reply [R $id cluster slot-stats slotsrange $slot $slot]
+    assert_equal 1 [llength $reply]
+    lindex $reply 0 1
+}
+
+# Find tags hashing to slots served by instance 0: commands for other
+# slots are redirected.
+set tags {}
+for {set j 0} {[llength $tags] < 10} {incr j} {
+    if {![catch {R 0 exists "{tag$j}"}]} {lappend tags "tag$j"}
+}
+set tag [lindex $tags 0]
+set slot [R 0 cluster keyslot "{$tag}"]
+
+test "SLOT-STATS accounts commands to the slot of their keys" {
+    R 0 config resetstat
+    R 0 set "{$tag}" bar
+    set stats [slot_stats 0 $slot]
+    assert_equal 1 [dict get $stats key-count]
+    assert_equal 1 [dict get $stats commands]
+    # *3 $3 SET $N {tag} $3 bar, and +OK as reply.
+    set keylen [string length "{$tag}"]
+    assert_equal [expr {4+9+3+[string length $keylen]+$keylen+2+9}] \
+        [dict get $stats network-bytes-in]
+    assert_equal 5 [dict get $stats network-bytes-out]
+    assert {[dict get $stats memory-bytes] > 0}
+
+    for {set j 0} {$j < 100} {incr j} {R 0 get "{$tag}"}
+    set stats [slot_stats 0 $slot]
+    assert_equal 101 [dict get $stats commands]
+    assert {[dict get $stats cpu-usec] > 0}
+}
+
+test "SLOT-STATS only reports the slots served by the node" {
+    set reply [R 1 cluster slot-stats slotsrange $slot $slot]
+    assert_equal {} $reply
+    set served 0
+    foreach range [dict get [get_myself 0] slots] {
+        lassign [split $range -] start end
+        if {$end eq {}} {set end $start}
+        incr served [expr {$end-$start+1}]
+    }
+    assert_equal $served [llength [R 0 cluster slot-stats slotsrange 0 16383]]
+}
+
+test "SLOT-STATS ORDERBY returns the hottest slots" {
+    set reply [R 0 cluster slot-stats orderby commands limit 1]
+    assert_equal $slot [lindex $reply 0 0]
+    set reply [R 0 cluster slot-stats orderby commands limit 3 asc]
+    assert_equal 3 [llength $reply]
+    assert_equal 0 [dict get [lindex $reply 0 1] commands]
+    assert_error "*Unknown metric*" {R 0 cluster slot-stats orderby foo}
+}
+
+test "CONFIG RESETSTAT resets the slots stats" {
+    R 0 config resetstat
+    set stats [slot_stats 0 $slot]
+    assert_equal 0 [dict get $stats commands]
+    assert_equal 1 [dict get $stats key-count]
+}
+
+test "Rebalance by key-count moves the loaded slots" {
+    R 0 flushall
+    foreach tag $tags {
+        for {set j 0} {$j < 100} {incr j} {
+            R 0 set "{$tag}:$j" $j
+        }
+    }
+    assert_equal 1000 [R 0 dbsize]
+    exec ../../../src/redis-cli --cluster rebalance \
+        127.0.0.1:[get_instance_attrib redis 0 port] \
+        --cluster-weight-by key-count
+    assert_equal 400 [R 0 dbsize]
+    assert_equal 300 [R 1 dbsize]
+    assert_equal 300 [R 2 dbsize]
+}
@@ -0,0 +1,104 @@
+# Check redis-cli --cluster moving slots in parallel (--cluster-parallel).
+
+source "../tests/includes/init-tests.tcl"
+
+test "Create a 5 nodes cluster" {
+    create_cluster 5 0
+}
+
+test "Cluster is up" {
+    assert_cluster_state ok
+}
+
+set numkeys 10000
+set cluster [redis_cluster 127.0.0.1:[get_instance_attrib redis 0 port]]
+
+test "Populate the cluster" {
+    for {set j 0} {$j < $numkeys} {incr j} {
+        $cluster set key:$j $j
+    }
+}
+
+proc verify_keys {cluster numkeys} {
+    for {set j 0} {$j < $numkeys} {incr j} {
+        assert_equal $j [$cluster get key:$j]
+    }
+}
+
+proc cluster_check {} {
+    exec ../../../src/redis-cli --cluster check \
+        127.0.0.1:[get_instance_attrib redis 0 port]
+}
+
+proc slots_count {id} {
+    set count 0
+    foreach range [dict get [get_myself $id] slots] {
+        lassign [split $range -] start end
+        if {$end eq {}} {set end $start}
+        incr count [expr {$end-$start+1}]
+    }
+    return $count
+}
+
+test "Parallel rebalance" {
+    # Masters #0 and #1 get slots from #2 and #3, up to four of them are
+    # moved at the same time.
+    set weights {}
+    foreach {id w} {0 1.02 1 1.02 2 0.98 3 0.98} {
+        lappend weights [dict get [get_myself $id] id]=$w
+    }
+    set output [exec ../../../src/redis-cli --cluster rebalance \
+        127.0.0.1:[get_instance_attrib redis 0 port] \
+        --cluster-weight {*}$weights \
+        --cluster-threshold 1 \
+        --cluster-parallel 4 \
+        --cluster-pipeline 2]
+    assert_match "*up to 4 at a time*" $output
+    assert {[slots_count 0] > [slots_count 4]}
+    assert {[slots_count 2] < [slots_count 4]}
+    assert_match "*All 16384 slots covered*" [cluster_check]
+}
+
+test "Cluster is up after the parallel rebalance" {
+    assert_cluster_state ok
+    verify_keys $cluster $numkeys
+}
+
+test "Parallel reshard" {
+    set target [dict get [get_myself 0] id]
+    set before [slots_count 0]
+    exec ../../../src/redis-cli --cluster reshard \
+        127.0.0.1:[get_instance_attrib redis 0 port] \
+        --cluster-from all \
+        --cluster-to $target \
+        --cluster-slots 100 \
+        --cluster-parallel 4 \
+        --cluster-yes
+    assert {[slots_count 0] > $before}
+    assert_match "*All 16384 slots covered*" [cluster_check]
+}
+
+test "Cluster is up after the parallel reshard" {
+    assert_cluster_state ok
+    verify_keys $cluster $numkeys
+}
+
+test "Parallel reshard from a single source to a single target" {
+    set source [dict get [get_myself 1] id]
+    set target [dict get [get_myself 4] id]
+    set before [slots_count 4]
+    set output [exec ../../../src/redis-cli --cluster reshard \
+        127.0.0.1:[get_instance_attrib redis 0 port] \
+        --cluster-from $source \
+        --cluster-to $target \
+        --cluster-slots 50 \
+        --cluster-parallel 8 \
+        --cluster-yes]
+    assert_equal [expr {$before+50}] [slots_count 4]
+    assert_match "*All 16384 slots covered*" [cluster_check]
+}
+
+test "Cluster is up after the single source parallel reshard" {
+    assert_cluster_state ok
+    verify_keys $cluster $numkeys
+}
@@ -0,0 +1,31 @@
+# Copy RDB with a quicklist of ziplists (some LZF compressed) to server path
+set server_path [tmpdir "server.convert-ziplist-list-on-load"]
+
+exec cp -f tests/assets/list-quicklist.rdb $server_path
+start_server [list overrides [list "dir" $server_path "dbfilename" "list-quicklist.rdb"]] {
+  test "RDB load ziplist quicklist: converts nodes to listpack" {
+    r select 0
+
+    assert_encoding quicklist list
+    assert_equal 20 [r llen list]
+    assert_match "*ql_nodes:5*" [r debug object list]
+    for {set j 1} {$j <= 20} {incr j} {
+        if {$j % 2 == 0} {
+            assert_equal $j [r lindex list [expr {$j-1}]]
+        } else {
+            assert_equal "[string repeat a 66]$j" [r lindex list [expr {$j-1}]]
+        }
+    }
+  }
+
+  test "RDB load ziplist quicklist: list can be modified and reloaded" {
+    r linsert list before 2 foo
+    r lset list 0 bar
+    r rpush list 21
+    set digest [r debug digest]
+    r debug reload
+    assert_equal $digest [r debug digest]
+    assert_equal {bar foo 2} [r lrange list 0 2]
+    assert_equal 21 [r lindex list -1]
+  }
+}
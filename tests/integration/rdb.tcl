@@ -21,6 +21,18 @@ start_server [list overrides [list "dir" $server_path "dbfilename" "encodings.rd
 "0","zset","zset","a","1","b","2","c","3","aa","10","bb","20","cc","30","aaa","100","bbb","200","ccc","300","aaaa","1000","cccc","123456789","bbbb","5000000000",
 "0","zset_zipped","zset","a","1","b","2","c","3",
 }
+
+  test "RDB load ziplist hash and zset: converts to listpack" {
+    r select 0
+    assert_encoding listpack hash_zipped
+    assert_encoding listpack zset_zipped
+    assert_equal {1 2 3} [r hmget hash_zipped a b c]
+    assert_equal 2 [r zscore zset_zipped b]
+    set digest [r debug digest]
+    r debug reload
+    assert_equal $digest [r debug digest]
+    assert_encoding listpack hash_zipped
+  }
 }
 
 set server_path [tmpdir "server.rdb-startup-test"]
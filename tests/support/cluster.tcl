@@ -203,6 +203,10 @@ proc ::redis_cluster::__dispatch__ {id method args} {
                     # ASK redirection.
                     set node_addr [lindex $e 2]
                     continue
+                } elseif {[string range $e 0 7] eq {TRYAGAIN}} {
+                    # Key locked by an ongoing migration, retry later.
+                    after 10
+                    continue
                 } else {
                     # Non redirecting error.
                     error $e $::errorInfo $::errorCode
@@ -182,6 +182,22 @@ start_server {tags {"bitops"}} {
         }
     }
 
+    foreach op {and or xor} {
+        test "BITOP $op with more than 16 long keys" {
+            r flushall
+            set vec {}
+            set veckeys {}
+            for {set j 0} {$j < 20} {incr j} {
+                set str [randstring 300 400 binary]
+                lappend vec $str
+                lappend veckeys vector_$j
+                r set vector_$j $str
+            }
+            r bitop $op target {*}$veckeys
+            assert_equal [r get target] [simulate_bit_op $op {*}$vec]
+        }
+    }
+
     test {BITOP NOT fuzzing} {
         for {set i 0} {$i < 10} {incr i} {
             r flushall
@@ -348,4 +364,84 @@ start_server {tags {"bitops"}} {
             }
         }
     }
+
+    test {SETBIT at a large offset uses the compressed encoding} {
+        r del sparse
+        r setbit sparse 4000000000 1
+        assert_encoding roaring sparse
+        assert {[r memory usage sparse] < 1024}
+        list [r strlen sparse] [r bitcount sparse] [r bitpos sparse 1] \
+             [r getbit sparse 4000000000] [r getbit sparse 3999999999]
+    } {500000001 1 4000000000 1 0}
+
+    test {Compressed bitmaps reply like plain strings} {
+        r config set bitmap-compress-min-bytes 1024
+        r del sparse plain
+        for {set j 0} {$j < 200} {incr j} {
+            set pos [randomInt 2000000]
+            set bit [randomInt 2]
+            r setbit sparse $pos $bit
+            r setbit plain $pos $bit
+        }
+        r setbit sparse 1999999 1
+        r config set bitmap-compress-min-bytes 0
+        r setbit plain 1999999 1
+        assert_encoding roaring sparse
+        assert_encoding raw plain
+        assert_equal [r get sparse] [r get plain]
+        assert_equal [r bitcount sparse] [r bitcount plain]
+        assert_equal [r bitcount sparse 1000 -1000] [r bitcount plain 1000 -1000]
+        assert_equal [r bitpos sparse 1 100] [r bitpos plain 1 100]
+        assert_equal [r bitpos sparse 0 0 -1] [r bitpos plain 0 0 -1]
+        assert_equal [r getrange sparse 1000 30000] [r getrange plain 1000 30000]
+        assert_equal [r bitfield sparse get u32 1000 get i64 #300] \
+                     [r bitfield plain get u32 1000 get i64 #300]
+        assert_equal [r bitfield sparse set u16 #5000 12345 incrby u8 7 3] \
+                     [r bitfield plain set u16 #5000 12345 incrby u8 7 3]
+        r config set bitmap-compress-min-bytes 4096
+        assert_equal [r get sparse] [r get plain]
+    }
+
+    test {BITOP against compressed bitmaps} {
+        r del a b
+        r setbit a 3000000 1
+        r setbit b 3000000 1
+        r setbit b 10 1
+        assert_encoding roaring a
+        foreach op {and or xor} {
+            r bitop $op dest a b
+            assert_equal [r get dest] [simulate_bit_op $op [r get a] [r get b]]
+        }
+        r bitop not dest a
+        assert_equal [r bitcount dest] 3000007
+    }
+
+    test {Writing a compressed bitmap as a string converts it} {
+        r del sparse
+        r setbit sparse 100000 1
+        r append sparse "foo"
+        assert_encoding raw sparse
+        list [r strlen sparse] [r getbit sparse 100000] [r getrange sparse -3 -1]
+    } {12504 1 foo}
+
+    test {Compressed bitmaps survive DEBUG RELOAD, DUMP/RESTORE and AOF rewrite} {
+        r del sparse
+        r setbit sparse 4000000000 1
+        r setbit sparse 7 1
+        r bitfield sparse set i64 #1000 -12345
+        set digest [r debug digest]
+        r debug reload
+        assert_encoding roaring sparse
+        assert_equal $digest [r debug digest]
+        set dump [r dump sparse]
+        r del sparse
+        r restore sparse 0 $dump
+        assert_encoding roaring sparse
+        assert_equal $digest [r debug digest]
+        r config set appendonly yes
+        waitForBgrewriteaof r
+        r debug loadaof
+        r config set appendonly no
+        assert_equal $digest [r debug digest]
+    }
 }
@@ -251,6 +251,82 @@ start_server {tags {"dump"}} {
         }
     }
 
+    test {MIGRATE does not block the server while the target is busy} {
+        set first [srv 0 client]
+        r set key "Some Value"
+        start_server {tags {"repl"}} {
+            set second [srv 0 client]
+            set second_host [srv 0 host]
+            set second_port [srv 0 port]
+
+            # A transaction queued before the migration starts.
+            set tx [redis_deferring_client -1]
+            $tx multi
+            $tx set other 1
+            $tx set key "New Value"
+            assert_equal {OK QUEUED QUEUED} [list [$tx read] [$tx read] [$tx read]]
+
+            set rd [redis_deferring_client]
+            $rd debug sleep 1.0 ; # Make second server unable to reply.
+            set mig [redis_deferring_client -1]
+            $mig migrate $second_host $second_port key 9 5000
+            wait_for_condition 50 10 {
+                [s -1 blocked_clients] == 1
+            } else {
+                fail "MIGRATE client not blocked"
+            }
+
+            # Other clients are served, reads of the key in transfer are ok
+            # but writes are refused until the target acknowledges it.
+            assert_equal PONG [$first ping]
+            assert_equal {Some Value} [$first get key]
+            catch {$first set key "New Value"} e
+            assert_match {TRYAGAIN*} $e
+
+            # Transactions are refused as a whole, both when the write is
+            # queued and when the migration started after queueing it.
+            $first multi
+            $first set other 1
+            catch {$first set key "New Value"} e
+            assert_match {TRYAGAIN*} $e
+            catch {$first exec} e
+            assert_match {EXECABORT*} $e
+            $tx exec
+            catch {$tx read} e
+            assert_match {TRYAGAIN*} $e
+            assert_equal 0 [$first exists other]
+
+            # Scripts declaring the key are refused before running.
+            catch {$first eval {redis.call('set','other',1); redis.call('set',KEYS[1],2)} 1 key} e
+            assert_match {TRYAGAIN*} $e
+            assert_equal 0 [$first exists other]
+
+            assert_equal OK [$mig read]
+            assert {[$first exists key] == 0}
+            assert {[$second get key] eq {Some Value}}
+            $first set key "New Value"
+            $rd close
+            $mig close
+            $tx close
+        }
+    }
+
+    test {MIGRATE inside MULTI/EXEC is still performed synchronously} {
+        set first [srv 0 client]
+        r set key "Some Value"
+        start_server {tags {"repl"}} {
+            set second [srv 0 client]
+            set second_host [srv 0 host]
+            set second_port [srv 0 port]
+
+            r -1 multi
+            r -1 migrate $second_host $second_port key 9 5000
+            assert_equal {OK} [r -1 exec]
+            assert {[$first exists key] == 0}
+            assert {[$second get key] eq {Some Value}}
+        }
+    }
+
     test {MIGRATE can migrate multiple keys at once} {
         set first [srv 0 client]
         r set key1 "v1"
@@ -305,6 +381,25 @@ start_server {tags {"dump"}} {
         }
     }
 
+    test {MIGRATE with multiple keys: a repeated key is sent once} {
+        set first [srv 0 client]
+        r flushdb
+        r set key1 "v1"
+        r set key2 "v2"
+        start_server {tags {"repl"}} {
+            set second [srv 0 client]
+            set second_host [srv 0 host]
+            set second_port [srv 0 port]
+
+            # Without REPLACE a second RESTORE of key1 would fail.
+            set ret [r -1 migrate $second_host $second_port "" 9 5000 keys key1 key2 key1]
+            assert {$ret eq {OK}}
+            assert {[$first dbsize] == 0}
+            assert {[$second get key1] eq {v1}}
+            assert {[$second get key2] eq {v2}}
+        }
+    }
+
     test {MIGRATE with multiple keys: stress command rewriting} {
         set first [srv 0 client]
         r flushdb
@@ -95,7 +95,7 @@ start_server {tags {"geo"}} {
 
     test {GEORADIUS withdist (sorted)} {
         r georadius nyc -73.9798091 40.7598464 3 km withdist asc
-    } {{{central park n/q/r} 0.7750} {4545 2.3651} {{union square} 2.7697}}
+    } {{{central park n/q/r} 0.775} {4545 2.3651} {{union square} 2.7697}}
 
     test {GEORADIUS with COUNT} {
         r georadius nyc -73.9798091 40.7598464 10 km COUNT 3
@@ -121,7 +121,7 @@ start_server {tags {"geo"}} {
 
     test {GEORADIUSBYMEMBER withdist (sorted)} {
         r georadiusbymember nyc "wtc one" 7 km withdist
-    } {{{wtc one} 0.0000} {{union square} 3.2544} {{central park n/q/r} 6.7000} {4545 6.1975} {{lic market} 6.8969}}
+    } {{{wtc one} 0} {{union square} 3.2544} {{central park n/q/r} 6.7} {4545 6.1975} {{lic market} 6.8969}}
 
     test {GEOHASH is able to return geohash strings} {
         # Example from Wikipedia.
@@ -223,6 +223,49 @@ start_server {tags {"geo"}} {
         assert {[lindex $res 0] eq "Catania"}
     }
 
+    test {GEORADIUS COUNT returns the same points of a full sort} {
+        for {set attempt 0} {$attempt < 20} {incr attempt} {
+            r del mypoints
+            geo_random_point search_lon search_lat
+            # Also search around the 180th meridian from time to time.
+            if {$attempt % 5 == 0} {set search_lon 179.9}
+            set argv {}
+            for {set j 0} {$j < 3000} {incr j} {
+                if {$j % 3} {
+                    # Most points are dense around the search center.
+                    set lon [expr {$search_lon + rand()*2 - 1}]
+                    if {$lon > 180} {set lon [expr {$lon - 360}]}
+                    set lat [expr {$search_lat + rand()*2 - 1}]
+                } else {
+                    geo_random_point lon lat
+                }
+                lappend argv $lon $lat "place:$j"
+            }
+            r geoadd mypoints {*}$argv
+            assert_encoding btree mypoints
+            set radius_km [expr {[randomInt 500]+1}]
+            set all [r georadius mypoints $search_lon $search_lat \
+                     $radius_km km withdist asc]
+            foreach count [list 1 10 [expr {[randomInt 100]+1}] 5000] {
+                foreach sort {asc desc} {
+                    set res [r georadius mypoints $search_lon $search_lat \
+                             $radius_km km withdist $sort count $count]
+                    set expected [lrange $all 0 [expr {$count-1}]]
+                    if {$sort eq {desc}} {
+                        set expected [lrange [lreverse $all] 0 [expr {$count-1}]]
+                    }
+                    # Compare the distances since equally distant points
+                    # may be returned in any order.
+                    set d1 {}
+                    set d2 {}
+                    foreach item $res {lappend d1 [lindex $item 1]}
+                    foreach item $expected {lappend d2 [lindex $item 1]}
+                    assert_equal $d2 $d1
+                }
+            }
+        }
+    }
+
     test {GEOADD + GEORANGE randomized test} {
         set attempt 30
         while {[incr attempt -1]} {
@@ -79,6 +79,29 @@ start_server {tags {"hll"}} {
         }
     }
 
+    test {PFADD of many elements at once is like adding them one by one} {
+        for {set x 0} {$x < 100} {incr x} {
+            r del hll1 hll2
+            set numele [randomInt 2000]
+            set elements {}
+            for {set j 0} {$j < $numele} {incr j} {
+                lappend elements [randomInt 100000000]
+            }
+            set batch [expr {[randomInt 500]+8}]
+            for {set j 0} {$j < $numele} {incr j $batch} {
+                set chunk [lrange $elements $j [expr {$j+$batch-1}]]
+                set added [r pfadd hll1 {*}$chunk]
+                set added2 0
+                foreach ele $chunk {
+                    if {[r pfadd hll2 $ele]} {set added2 1}
+                }
+                assert_equal $added2 $added
+            }
+            assert_equal [r pfdebug getreg hll2] [r pfdebug getreg hll1]
+            assert_equal [r pfcount hll2] [r pfcount hll1]
+        }
+    }
+
     test {Corrupted sparse HyperLogLogs are detected: Additionl at tail} {
         r del hll
         r pfadd hll a b c
@@ -194,6 +217,33 @@ start_server {tags {"hll"}} {
         assert {$err < (double($card)/100)*5}
     }
 
+    test {PFCOUNT and PFMERGE of dense HLLs use the max of the registers} {
+        r del hll1 hll2 hll3 dest sparse
+        for {set j 1} {$j <= 3} {incr j} {
+            set elements {}
+            for {set x 0} {$x < 5000} {incr x} {lappend elements $j-$x}
+            r pfadd hll$j {*}$elements
+            r pfdebug todense hll$j
+        }
+        r pfadd dest a b c
+        r pfdebug todense dest
+        set regs {}
+        foreach key {hll1 hll2 hll3 dest} {lappend regs [r pfdebug getreg $key]}
+        set max {}
+        foreach a [lindex $regs 0] b [lindex $regs 1] \
+                c [lindex $regs 2] d [lindex $regs 3] {
+            lappend max [lindex [lsort -integer [list $a $b $c $d]] end]
+        }
+        set card [r pfcount hll1 hll2 hll3 dest]
+        r pfmerge dest hll1 hll2 hll3
+        assert_equal $max [r pfdebug getreg dest]
+        assert_equal $card [r pfcount dest]
+        # A sparse HLL in the mix takes the generic path.
+        r pfadd sparse a b c
+        assert_equal $card [r pfcount hll1 hll2 hll3 sparse]
+        assert_equal [r pfcount hll1 hll2 hll3 dest] [r pfcount dest]
+    }
+
     test {PFDEBUG GETREG returns the HyperLogLog raw registers} {
         r del hll
         r pfadd hll 1 2 3
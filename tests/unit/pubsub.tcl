@@ -47,6 +47,16 @@ start_server {tags {"pubsub"}} {
         __consume_subscribe_messages $client punsubscribe $channels
     }
 
+    proc ssubscribe {client channels} {
+        $client ssubscribe {*}$channels
+        __consume_subscribe_messages $client ssubscribe $channels
+    }
+
+    proc sunsubscribe {client {channels {}}} {
+        $client sunsubscribe {*}$channels
+        __consume_subscribe_messages $client sunsubscribe $channels
+    }
+
     test "Pub/Sub PING" {
         set rd1 [redis_deferring_client]
         subscribe $rd1 somechannel
@@ -103,6 +113,23 @@ start_server {tags {"pubsub"}} {
         $rd2 close
     }
 
+    test "PUBLISH/SUBSCRIBE of a big message to many clients" {
+        set clients {}
+        for {set j 0} {$j < 10} {incr j} {
+            set rd [redis_deferring_client]
+            assert_equal {1} [subscribe $rd {chan1}]
+            lappend clients $rd
+        }
+        set big [string repeat x 5000]
+        assert_equal 10 [r publish chan1 $big]
+        assert_equal 10 [r publish chan1 small]
+        foreach rd $clients {
+            assert_equal [list message chan1 $big] [$rd read]
+            assert_equal {message chan1 small} [$rd read]
+            $rd close
+        }
+    }
+
     test "PUBLISH/SUBSCRIBE after UNSUBSCRIBE without arguments" {
         set rd1 [redis_deferring_client]
         assert_equal {1 2 3} [subscribe $rd1 {chan1 chan2 chan3}]
@@ -223,6 +250,60 @@ start_server {tags {"pubsub"}} {
         concat $reply1 $reply2
     } {punsubscribe {} 0 unsubscribe {} 0}
 
+    test "SPUBLISH/SSUBSCRIBE basics" {
+        set rd1 [redis_deferring_client]
+
+        # subscribe to two shard channels
+        assert_equal {1 2} [ssubscribe $rd1 {chan1 chan2}]
+        assert_equal 1 [r spublish chan1 hello]
+        assert_equal 1 [r spublish chan2 world]
+        assert_equal {smessage chan1 hello} [$rd1 read]
+        assert_equal {smessage chan2 world} [$rd1 read]
+        assert_equal {chan1 chan2} [lsort [r pubsub shardchannels]]
+        assert_equal {chan1 1 chan3 0} [r pubsub shardnumsub chan1 chan3]
+
+        # unsubscribe from one of the channels
+        sunsubscribe $rd1 {chan1}
+        assert_equal 0 [r spublish chan1 hello]
+        assert_equal 1 [r spublish chan2 world]
+        assert_equal {smessage chan2 world} [$rd1 read]
+
+        # unsubscribe from the remaining channel
+        sunsubscribe $rd1 {chan2}
+        assert_equal 0 [r spublish chan2 world]
+        assert_equal {} [r pubsub shardchannels]
+
+        # clean up clients
+        $rd1 close
+    }
+
+    test "Shard channels and global channels are independent" {
+        set rd1 [redis_deferring_client]
+        assert_equal {1} [subscribe $rd1 {chan1}]
+        assert_equal {1} [ssubscribe $rd1 {chan1}]
+        assert_equal {2} [psubscribe $rd1 {chan*}]
+
+        # Patterns don't match shard channels.
+        assert_equal 1 [r spublish chan1 hello]
+        assert_equal {smessage chan1 hello} [$rd1 read]
+        assert_equal 2 [r publish chan1 world]
+        assert_equal {message chan1 world} [$rd1 read]
+        assert_equal {pmessage chan* chan1 world} [$rd1 read]
+
+        # The client is still in Pub/Sub mode after SUNSUBSCRIBE.
+        assert_equal {0} [sunsubscribe $rd1 {chan1}]
+        $rd1 ping
+        assert_equal {pong {}} [$rd1 read]
+
+        # clean up clients
+        $rd1 close
+    }
+
+    test "SUNSUBSCRIBE should always reply" {
+        r sunsubscribe
+        r sunsubscribe
+    } {sunsubscribe {} 0}
+
     ### Keyspace events notification tests
 
     test "Keyspace notifications: we receive keyspace notifications" {
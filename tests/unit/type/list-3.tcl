@@ -57,6 +57,47 @@ start_server {
         }
     }
 
+    test {Positional access on lists with many nodes} {
+        r del key
+        set mylist {}
+        for {set j 0} {$j < 2000} {incr j} {
+            r rpush key $j
+            lappend mylist $j
+        }
+        for {set j 0} {$j < 5000} {incr j} {
+            set len [llength $mylist]
+            set idx [expr {[randomInt $len]-($len/2)}]
+            set ele [randomInt 100000]
+            switch [randomInt 8] {
+                0 {r lpush key $ele; set mylist [linsert $mylist 0 $ele]}
+                1 {r rpush key $ele; lappend mylist $ele}
+                2 {r lpop key; set mylist [lrange $mylist 1 end]}
+                3 {r rpop key; set mylist [lrange $mylist 0 end-1]}
+                4 {
+                    r lset key $idx $ele
+                    if {$idx < 0} {incr idx $len}
+                    lset mylist $idx $ele
+                }
+                5 {
+                    set pivot [lindex $mylist [randomInt $len]]
+                    r linsert key before $pivot $ele
+                    set mylist [linsert $mylist [lsearch -exact $mylist $pivot] $ele]
+                }
+                default {
+                    set i [expr {$idx < 0 ? $idx+$len : $idx}]
+                    assert_equal [lindex $mylist $i] [r lindex key $idx]
+                    assert_equal [lrange $mylist $i [expr {$i+10}]] \
+                                 [r lrange key $i [expr {$i+10}]]
+                    assert_equal [lrange $mylist end-[expr {$i+10}] end-$i] \
+                                 [r lrange key [expr {-$i-11}] [expr {-$i-1}]]
+                }
+            }
+        }
+        assert_equal $mylist [r lrange key 0 -1]
+        r ltrim key 100 -100
+        assert_equal [lrange $mylist 100 end-99] [r lrange key 0 -1]
+    }
+
     tags {slow} {
         test {ziplist implementation: value encoding and backlink} {
             if {$::accurate} {set iterations 100} else {set iterations 10}
@@ -120,3 +161,79 @@ start_server {
         }
     }
 }
+
+foreach codec {lzf lz4} {
+    start_server [list tags {list} overrides [list \
+        "list-max-ziplist-size" 16 \
+        "list-compress-depth" 1 \
+        "list-compress-codec" $codec]] {
+        test "Compressed list operations - $codec" {
+            r del key
+            set mylist {}
+            for {set j 0} {$j < 1000} {incr j} {
+                set ele "element:[randomInt 100]:$j"
+                r rpush key $ele
+                lappend mylist $ele
+            }
+            for {set j 0} {$j < 2000} {incr j} {
+                set idx [randomInt [llength $mylist]]
+                set ele "element:[randomInt 100]"
+                switch [randomInt 4] {
+                    0 {
+                        r lset key $idx $ele
+                        lset mylist $idx $ele
+                    }
+                    1 {
+                        set pivot [lindex $mylist $idx]
+                        r linsert key after $pivot $ele
+                        set mylist [linsert $mylist [expr {[lsearch -exact $mylist $pivot]+1}] $ele]
+                    }
+                    default {
+                        # Read the same interior nodes more than once.
+                        assert_equal [lrange $mylist $idx [expr {$idx+20}]] \
+                                     [r lrange key $idx [expr {$idx+20}]]
+                        assert_equal [lindex $mylist $idx] [r lindex key $idx]
+                    }
+                }
+            }
+            assert_equal $mylist [r lrange key 0 -1]
+        }
+
+        test "Compressed list survives codec change and reload - $codec" {
+            set other [expr {$codec eq {lzf} ? {lz4} : {lzf}}]
+            r config set list-compress-codec $other
+            assert_equal $other [lindex [r config get list-compress-codec] 1]
+            r lset key 500 changed
+            set mylist [r lrange key 0 -1]
+            set digest [r debug digest]
+            r debug reload
+            assert_equal $digest [r debug digest]
+            assert_equal $mylist [r lrange key 0 -1]
+            r config set list-compress-codec $codec
+        }
+
+        test "Decompressed nodes cache is bounded and reported - $codec" {
+            r flushall
+            for {set k 0} {$k < 50} {incr k} {
+                for {set j 0} {$j < 2000} {incr j} {
+                    r rpush list:$k "element:[string repeat x 20]:$j"
+                }
+                for {set j 100} {$j < 2000} {incr j 100} {
+                    r lindex list:$k $j
+                }
+            }
+            set cache [s mem_quicklist_node_cache]
+            assert {$cache > 0 && $cache <= 32*9216}
+            assert_equal $cache [dict get [r memory stats] quicklist.node.cache]
+            for {set k 0} {$k < 50} {incr k} {
+                r unlink list:$k
+            }
+            assert_equal 0 [s mem_quicklist_node_cache]
+        }
+
+        test "Invalid list-compress-codec is rejected - $codec" {
+            catch {r config set list-compress-codec zstd} e
+            set e
+        } {*ERR*}
+    }
+}
@@ -273,6 +273,39 @@ start_server {
         lsort [r sinter set1 set2]
     } {1 2 3}
 
+    test "SINTER and SINTERSTORE of intsets of very different sizes" {
+        r del set1 set2 set3 setres
+        r config set set-max-intset-entries 5000
+        set big {}
+        for {set j 0} {$j < 4000} {incr j} {
+            set e [expr {$j*3-6000}]
+            lappend big $e
+        }
+        r sadd set1 {*}$big
+        # A small set, to take the galloping path, and a set of similar
+        # size, to take the merge path.
+        r sadd set2 -6000 -3 0 3 4 5 900 5997 6000 100000
+        set mid {}
+        for {set j 0} {$j < 3000} {incr j} {lappend mid [expr {$j*2-5000}]}
+        r sadd set3 {*}$mid
+        assert_encoding intset set1
+        assert_encoding intset set3
+        assert_equal {-6000 -3 0 3 900 5997} [lsort -integer [r sinter set1 set2]]
+        set expected {}
+        foreach e $big {if {$e % 2 == 0 && $e >= -5000 && $e <= 998} {lappend expected $e}}
+        assert_equal $expected [lsort -integer [r sinter set1 set3]]
+        assert_equal [llength $expected] [r sinterstore setres set3 set1]
+        assert_encoding intset setres
+        assert_equal $expected [lsort -integer [r smembers setres]]
+        assert_equal {0 900} [lsort -integer [r sinter set1 set2 set3]]
+        # A result over set-max-intset-entries is stored as an hash table.
+        r config set set-max-intset-entries 100
+        assert_equal [llength $expected] [r sinterstore setres set3 set1]
+        assert_encoding hashtable setres
+        assert_equal $expected [lsort -integer [r smembers setres]]
+        r config set set-max-intset-entries 512
+    }
+
     test "SINTERSTORE against non existing keys should delete dstkey" {
         r set setres xxx
         assert_equal 0 [r sinterstore setres foo111 bar222]
@@ -563,6 +596,109 @@ start_server {
         lsort [r smembers set]
     } {a b c}
 
+    test {Set operations computed in background reply like in foreground} {
+        r del s1 s2 s3 dst
+        for {set j 0} {$j < 200} {incr j} {
+            r sadd s1 $j
+            r sadd s2 [expr {$j*2}] "e$j"
+        }
+        r sadd s3 1 2 3 foo
+        set cmds {
+            {sunion s1 s2 s3} {sinter s1 s2} {sinter s1 s2 s3}
+            {sdiff s1 s2 s3} {sdiff s2 s1} {sunion s1 nokey}
+            {sinter s1 nokey} {sdiff s1 s1}
+        }
+        unset -nocomplain opres
+        foreach cmd $cmds {set opres($cmd) [lsort [r {*}$cmd]]}
+        set offloaded [s setops_offloaded]
+        r config set setops-offload-threshold 1
+        foreach cmd $cmds {
+            assert_equal $opres($cmd) [lsort [r {*}$cmd]]
+            set storecmd [lreplace $cmd 0 0 "[lindex $cmd 0]store" dst]
+            assert_equal [llength $opres($cmd)] [r {*}$storecmd]
+            assert_equal $opres($cmd) [lsort [r smembers dst]]
+        }
+        r config set setops-offload-threshold 1000000
+        assert {[s setops_offloaded] > $offloaded}
+    }
+
+    test {Set operations in background are computed again if a key changes} {
+        r del s1 s2
+        r sadd s1 a b c
+        r sadd s2 c d
+        r config set setops-offload-threshold 1
+        r debug setops-delay 300
+        r config resetstat
+        set rd [redis_deferring_client]
+        $rd sunion s1 s2
+        wait_for_condition 50 10 {
+            [s blocked_clients] == 1
+        } else {
+            fail "SUNION client not blocked"
+        }
+        # The other clients are served meanwhile, and modifying a source
+        # cancels the job instead of waiting for it.
+        set start [clock milliseconds]
+        assert_equal 1 [r sadd s1 e]
+        assert {[clock milliseconds]-$start < 200}
+        assert_equal {a b c d e} [lsort [$rd read]]
+        assert {[s setops_recomputed] > 0}
+        assert_equal {a b c e} [lsort [r smembers s1]]
+        # The command is accounted once, when it is executed again.
+        assert_match {*cmdstat_sunion:calls=1,*} [r info commandstats]
+        $rd close
+        r debug setops-delay 0
+        r config set setops-offload-threshold 1000000
+    } {OK}
+
+    test {Set operations in background survive the client and the keys} {
+        r del s1 s2 dst
+        r sadd s1 a b c
+        r sadd s2 c d
+        r config set setops-offload-threshold 1
+        r debug setops-delay 200
+        set rd [redis_deferring_client]
+        $rd sinter s1 s2
+        wait_for_condition 50 10 {
+            [s blocked_clients] == 1
+        } else {
+            fail "SINTER client not blocked"
+        }
+        $rd close
+
+        set rd [redis_deferring_client]
+        $rd sunionstore dst s1 s2
+        wait_for_condition 50 10 {
+            [s blocked_clients] == 1
+        } else {
+            fail "SUNIONSTORE client not blocked"
+        }
+        r flushall async
+        assert_equal 0 [$rd read]
+        assert_equal 0 [r exists dst]
+        $rd close
+        r debug setops-delay 0
+        r config set setops-offload-threshold 1000000
+        r ping
+    } {PONG}
+
+    test {Set operations inside MULTI/EXEC are computed synchronously} {
+        r del s1 s2
+        r sadd s1 a b c
+        r sadd s2 c d
+        r config set setops-offload-threshold 1
+        set offloaded [s setops_offloaded]
+        r multi
+        r sinter s1 s2
+        r sadd s1 d
+        r sinter s1 s2
+        set res [r exec]
+        r config set setops-offload-threshold 1000000
+        assert_equal $offloaded [s setops_offloaded]
+        lassign $res inter1 added inter2
+        list $inter1 $added [lsort $inter2]
+    } {c 1 {c d}}
+
     tags {slow} {
         test {intsets implementation stress testing} {
             for {set j 0} {$j < 20} {incr j} {
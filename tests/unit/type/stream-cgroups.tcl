@@ -238,6 +238,152 @@ start_server {
         assert {[lindex $reply 0 3] == 2}
     }
 
+    # Check the group PEL against the model 'pel', a dictionary mapping
+    # the sequence of every pending ID to its consumer and delivery count.
+    proc check_pel_model {pel} {
+        set expected {}
+        foreach seq [lsort -integer [dict keys $pel]] {
+            lassign [dict get $pel $seq] consumer count
+            lappend expected [list 1-$seq $consumer $count]
+        }
+        set got {}
+        foreach e [r XPENDING mystream mygroup - + 1000000] {
+            lappend got [list [lindex $e 0] [lindex $e 1] [lindex $e 3]]
+        }
+        assert_equal $expected $got
+
+        # Per consumer PELs and the summary form.
+        set summary [r XPENDING mystream mygroup]
+        assert_equal [dict size $pel] [lindex $summary 0]
+        set consumers {}
+        foreach e $expected {dict incr consumers [lindex $e 1]}
+        foreach c [lindex $summary 3] {
+            assert_equal [dict get $consumers [lindex $c 0]] [lindex $c 1]
+            set got {}
+            foreach e [r XPENDING mystream mygroup - + 1000000 [lindex $c 0]] {
+                lappend got [list [lindex $e 0] [lindex $e 1] [lindex $e 3]]
+            }
+            set mine {}
+            foreach e $expected {
+                if {[lindex $e 1] eq [lindex $c 0]} {lappend mine $e}
+            }
+            assert_equal $mine $got
+        }
+        assert_equal [dict size $consumers] [llength [lindex $summary 3]]
+    }
+
+    test {PEL fuzzing with XREADGROUP, XACK, XCLAIM and XGROUP} {
+        r del mystream
+        for {set j 1} {$j <= 2000} {incr j} {r XADD mystream 1-$j item $j}
+        r XGROUP CREATE mystream mygroup 0
+        set pel {}
+        set consumers {alice bob carol dave}
+        for {set i 0} {$i < 500} {incr i} {
+            set c [lindex $consumers [randomInt 4]]
+            switch [randomInt 7] {
+                0 - 1 {
+                    # Deliver new entries: the ones already pending after
+                    # an XGROUP SETID are reassigned.
+                    set res [r XREADGROUP GROUP mygroup $c \
+                             COUNT [randomInt 300] STREAMS mystream >]
+                    foreach e [lindex $res 0 1] {
+                        set seq [lindex [split [lindex $e 0] -] 1]
+                        dict set pel $seq [list $c 1]
+                    }
+                }
+                2 {
+                    # Deliver again the history of the consumer.
+                    set res [r XREADGROUP GROUP mygroup $c \
+                             COUNT [randomInt 50] STREAMS mystream 0]
+                    foreach e [lindex $res 0 1] {
+                        set seq [lindex [split [lindex $e 0] -] 1]
+                        lassign [dict get $pel $seq] owner count
+                        assert_equal $c $owner
+                        dict set pel $seq [list $c [incr count]]
+                    }
+                }
+                3 {
+                    set ids {}
+                    for {set k 0} {$k < [randomInt 100]} {incr k} {
+                        set seq [expr {1+[randomInt 2000]}]
+                        if {[lsearch -exact $ids 1-$seq] != -1} continue
+                        lappend ids 1-$seq
+                        if {[dict exists $pel $seq]} {dict unset pel $seq}
+                    }
+                    if {$ids ne {}} {r XACK mystream mygroup {*}$ids}
+                }
+                4 {
+                    set ids {}
+                    set justid [randomInt 2]
+                    for {set k 0} {$k < [randomInt 20]} {incr k} {
+                        set seq [expr {1+[randomInt 2000]}]
+                        if {[lsearch -exact $ids 1-$seq] != -1} continue
+                        lappend ids 1-$seq
+                        if {[dict exists $pel $seq]} {
+                            set count [lindex [dict get $pel $seq] 1]
+                            if {!$justid} {incr count}
+                            dict set pel $seq [list $c $count]
+                        }
+                    }
+                    if {$ids eq {}} continue
+                    if {$justid} {
+                        r XCLAIM mystream mygroup $c 0 {*}$ids JUSTID
+                    } else {
+                        r XCLAIM mystream mygroup $c 0 {*}$ids
+                    }
+                }
+                5 {
+                    if {[randomInt 5] == 0} {
+                        r XGROUP DELCONSUMER mystream mygroup $c
+                        dict for {seq e} $pel {
+                            if {[lindex $e 0] eq $c} {dict unset pel $seq}
+                        }
+                    }
+                }
+                6 {
+                    if {[randomInt 5] == 0} {
+                        r XGROUP SETID mystream mygroup 1-[randomInt 2000]
+                    }
+                }
+            }
+            if {$i % 50 == 0} {check_pel_model $pel}
+        }
+        check_pel_model $pel
+        r debug reload
+        check_pel_model $pel
+        r config set appendonly yes
+        waitForBgrewriteaof r
+        r debug loadaof
+        r config set appendonly no
+        check_pel_model $pel
+    }
+
+    test {Almost empty PEL blocks are merged on XACK} {
+        foreach key {sparse dense} {
+            r del $key
+            for {set j 1} {$j <= 6400} {incr j} {r XADD $key 1-$j item $j}
+            r XGROUP CREATE $key mygroup 0
+            r XREADGROUP GROUP mygroup alice COUNT 6400 STREAMS $key >
+        }
+        # Leave 50 pending messages in both the streams: the first of every
+        # 128 IDs in 'sparse', that would leave 50 blocks without merging,
+        # and the first 50 IDs in 'dense'.
+        set sparse_ids {}
+        set dense_ids {}
+        for {set j 1} {$j <= 6400} {incr j} {
+            if {($j-1) % 128 != 0} {lappend sparse_ids 1-$j}
+            if {$j > 50} {lappend dense_ids 1-$j}
+        }
+        r XACK sparse mygroup {*}$sparse_ids
+        r XACK dense mygroup {*}$dense_ids
+        assert_equal 50 [lindex [r XPENDING sparse mygroup] 0]
+        set pending [r XPENDING sparse mygroup - + 2]
+        assert_equal {1-1 1-129} [list [lindex $pending 0 0] [lindex $pending 1 0]]
+        set sparse_mem [r MEMORY USAGE sparse SAMPLES 0]
+        set dense_mem [r MEMORY USAGE dense SAMPLES 0]
+        assert {$sparse_mem < $dense_mem+1000}
+    }
+
     start_server {} {
         set master [srv -1 client]
         set master_host [srv -1 host]
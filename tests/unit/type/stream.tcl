@@ -246,6 +246,39 @@ start_server {
         assert {[lindex $res 0 1 1 1] eq {field two}}
     }
 
+    test {Blocking XREAD: many clients waiting for the same key} {
+        r del s3
+        r XADD s3 * old abcd1234
+        set clients {}
+        for {set j 0} {$j < 10} {incr j} {
+            set rd [redis_deferring_client]
+            if {$j % 2} {
+                $rd XREAD COUNT 1 BLOCK 20000 STREAMS s3 $
+            } else {
+                $rd XREAD BLOCK 20000 STREAMS s3 $
+            }
+            lappend clients $rd
+        }
+        set big [string repeat x 5000]
+        r MULTI
+        r XADD s3 * field $big
+        r XADD s3 * field small
+        r EXEC
+        set j 0
+        foreach rd $clients {
+            set res [$rd read]
+            assert {[lindex $res 0 0] eq {s3}}
+            assert {[lindex $res 0 1 0 1] eq [list field $big]}
+            if {$j % 2} {
+                assert {[llength [lindex $res 0 1]] == 1}
+            } else {
+                assert {[lindex $res 0 1 1 1] eq {field small}}
+            }
+            $rd close
+            incr j
+        }
+    }
+
     test {XDEL basic test} {
         r del somestream
         r xadd somestream * foo value0
@@ -376,6 +409,94 @@ start_server {tags {"stream"} overrides {appendonly yes stream-node-max-entries
     }
 }
 
+start_server {tags {"stream"}} {
+    proc stream_compact_populate {key} {
+        set ids {}
+        for {set j 0} {$j < 1000} {incr j} {
+            # Mix entries with the same fields of the master entry and
+            # entries with different fields.
+            if {$j % 3} {
+                lappend ids [r XADD $key * item $j]
+            } else {
+                lappend ids [r XADD $key * item $j other $j]
+            }
+        }
+        return $ids
+    }
+
+    test {XDEL compacts the nodes with many deleted entries} {
+        set plain_ids [stream_compact_populate plain]
+        set compact_ids [stream_compact_populate compact]
+        r config set stream-node-compact-percent 0
+        for {set j 0} {$j < 1000} {incr j} {
+            if {$j % 4} {r XDEL plain [lindex $plain_ids $j]}
+        }
+        assert_equal 0 [s stream_nodes_compacted]
+        r config set stream-node-compact-percent 50
+        for {set j 0} {$j < 1000} {incr j} {
+            if {$j % 4} {r XDEL compact [lindex $compact_ids $j]}
+        }
+        assert {[s stream_nodes_compacted] > 0}
+        assert {[s stream_compacted_bytes] > 0}
+        assert {[r MEMORY USAGE compact SAMPLES 0] <
+                [r MEMORY USAGE plain SAMPLES 0]}
+        r XLEN compact
+    } {250}
+
+    test {XRANGE, XREVRANGE and XREAD of compacted nodes} {
+        set plain {}
+        foreach e [r XRANGE plain - +] {lappend plain [lindex $e 1]}
+        set compact {}
+        foreach e [r XRANGE compact - +] {lappend compact [lindex $e 1]}
+        assert_equal $plain $compact
+        set compact {}
+        foreach e [r XREVRANGE compact + -] {
+            set compact [linsert $compact 0 [lindex $e 1]]
+        }
+        assert_equal $plain $compact
+        set res [r XREAD COUNT 1000 STREAMS compact 0-0]
+        assert_equal [lindex $res 0 1] [r XRANGE compact - +]
+        lindex $plain 1
+    } {item 4}
+
+    test {XTRIM with exact MAXLEN compacts the head node} {
+        r del mystream
+        r config set stream-node-max-entries 100
+        for {set j 0} {$j < 150} {incr j} {r XADD mystream * item $j}
+        r config resetstat
+        r XTRIM mystream MAXLEN 100
+        assert_equal 1 [s stream_nodes_compacted]
+        assert_equal 100 [r XLEN mystream]
+        assert_equal 50 [dict get [lindex [r XRANGE mystream - + COUNT 1] 0 1] item]
+        assert_equal 149 [dict get [lindex [r XREVRANGE mystream + - COUNT 1] 0 1] item]
+        r XADD mystream * item 150
+        assert_equal 101 [llength [r XRANGE mystream - +]]
+    }
+
+    test {Consumer groups work across compacted nodes} {
+        r del mystream
+        set ids {}
+        for {set j 0} {$j < 100} {incr j} {lappend ids [r XADD mystream * item $j]}
+        r XGROUP CREATE mystream mygroup 0
+        r XREADGROUP GROUP mygroup alice COUNT 10 STREAMS mystream >
+        for {set j 10} {$j < 90} {incr j} {r XDEL mystream [lindex $ids $j]}
+        assert {[s stream_nodes_compacted] > 1}
+        set res [r XREADGROUP GROUP mygroup bob STREAMS mystream >]
+        set got {}
+        foreach e [lindex $res 0 1] {lappend got [dict get [lindex $e 1] item]}
+        assert_equal {90 91 92 93 94 95 96 97 98 99} $got
+        assert_equal 20 [lindex [r XPENDING mystream mygroup] 0]
+        set res [r XREADGROUP GROUP mygroup alice STREAMS mystream 0]
+        llength [lindex $res 0 1]
+    } {10}
+
+    test {Compacted streams survive DEBUG RELOAD} {
+        set digest [r debug digest-value compact]
+        r debug reload
+        assert_equal $digest [r debug digest-value compact]
+    }
+}
+
 start_server {tags {"xsetid"}} {
     test {XADD can CREATE an empty stream} {
         r XADD mystream MAXLEN 0 * a b
@@ -7,10 +7,10 @@ start_server {tags {"zset"}} {
     }
 
     proc basics {encoding} {
-        if {$encoding == "ziplist"} {
+        if {$encoding == "listpack"} {
             r config set zset-max-ziplist-entries 128
             r config set zset-max-ziplist-value 64
-        } elseif {$encoding == "skiplist"} {
+        } elseif {$encoding == "btree"} {
             r config set zset-max-ziplist-entries 0
             r config set zset-max-ziplist-value 0
         } else {
@@ -735,8 +735,8 @@ start_server {tags {"zset"}} {
         }
     }
 
-    basics ziplist
-    basics skiplist
+    basics listpack
+    basics btree
 
     test {ZINTERSTORE regression with two sets, intset+hashtable} {
         r del seta setb setc
@@ -751,7 +751,7 @@ start_server {tags {"zset"}} {
         r zrange out 0 -1 withscores
     } {neginf 0}
 
-    test {ZINTERSTORE #516 regression, mixed sets and ziplist zsets} {
+    test {ZINTERSTORE #516 regression, mixed sets and listpack zsets} {
         r sadd one 100 101 102 103
         r sadd two 100 200 201 202
         r zadd three 1 500 1 501 1 502 1 503 1 100
@@ -781,17 +781,57 @@ start_server {tags {"zset"}} {
         }
     }
 
+    test {ZUNIONSTORE/ZINTERSTORE computed in background} {
+        r del one two three dest
+        for {set j 0} {$j < 300} {incr j} {
+            r zadd one $j ele-$j
+            r zadd two [expr {$j*2}] ele-[expr {$j*2}]
+        }
+        r sadd three ele-1 ele-2 ele-4 foo
+        set cmds {
+            {zunionstore dest 3 one two three}
+            {zinterstore dest 2 one two weights 2 3 aggregate max}
+            {zinterstore dest 3 one two three aggregate min}
+            {zunionstore dest 2 one one weights 1 -1}
+        }
+        unset -nocomplain opres
+        foreach cmd $cmds {
+            r {*}$cmd
+            set opres($cmd) [r zrange dest 0 -1 withscores]
+        }
+        set offloaded [s setops_offloaded]
+        r config set setops-offload-threshold 1
+        foreach cmd $cmds {
+            assert_equal [expr {[llength $opres($cmd)]/2}] [r {*}$cmd]
+            assert_equal $opres($cmd) [r zrange dest 0 -1 withscores]
+        }
+        r config set setops-offload-threshold 1000000
+        assert {[s setops_offloaded] > $offloaded}
+    }
+
     test "ZSET commands don't accept the empty strings as valid score" {
         assert_error "*not*float*" {r zadd myzset "" abc}
     }
 
+    test "ZADD and ZRANGEBYSCORE parse scores like strtod()" {
+        r del myzset
+        r zadd myzset 0x10 a 1e3 b .5 c 5. d -inf e 123456789012345678901 f
+        assert_equal {e -inf c 0.5 d 5 a 16 b 1000 f 1.2345678901234568e+20} \
+            [r zrange myzset 0 -1 withscores]
+        assert_equal {c d} [r zrangebyscore myzset (0.25 5.0]
+        assert_error "*not*float*" {r zadd myzset 1e x}
+        assert_error "*not*float*" {r zadd myzset " 1" x}
+        assert_error "*not*float*" {r zadd myzset 1.5x x}
+        assert_error "*not*float*" {r zrangebyscore myzset 1e 2}
+    }
+
     proc stressers {encoding} {
-        if {$encoding == "ziplist"} {
+        if {$encoding == "listpack"} {
             # Little extra to allow proper fuzzing in the sorting stresser
             r config set zset-max-ziplist-entries 256
             r config set zset-max-ziplist-value 64
             set elements 128
-        } elseif {$encoding == "skiplist"} {
+        } elseif {$encoding == "btree"} {
             r config set zset-max-ziplist-entries 0
             r config set zset-max-ziplist-value 0
             if {$::accurate} {set elements 1000} else {set elements 100}
@@ -811,7 +851,7 @@ start_server {tags {"zset"}} {
 
             assert_encoding $encoding zscoretest
             for {set i 0} {$i < $elements} {incr i} {
-                assert_equal [lindex $aux $i] [r zscore zscoretest $i]
+                assert {[r zscore zscoretest $i] == [lindex $aux $i]}
             }
         }
 
@@ -827,10 +867,22 @@ start_server {tags {"zset"}} {
             r debug reload
             assert_encoding $encoding zscoretest
             for {set i 0} {$i < $elements} {incr i} {
-                assert_equal [lindex $aux $i] [r zscore zscoretest $i]
+                assert {[r zscore zscoretest $i] == [lindex $aux $i]}
             }
         }
 
+        test "ZSCORE uses the shortest representation - $encoding" {
+            r del zscoretest
+            r zadd zscoretest 0.1 a 1e-5 b 2.5 c
+            assert_equal {0.1 1e-05 2.5} [list [r zscore zscoretest a] \
+                [r zscore zscoretest b] [r zscore zscoretest c]]
+            r config set shortest-double-format no
+            set legacy [r zscore zscoretest a]
+            r config set shortest-double-format yes
+            assert_equal 0.10000000000000001 $legacy
+            assert_equal {a 0.1} [r zrange zscoretest 1 1 withscores]
+        }
+
         test "ZSET sorting stresser - $encoding" {
             set delta 0
             for {set test 0} {$test < 2} {incr test} {
@@ -1066,7 +1118,7 @@ start_server {tags {"zset"}} {
             }
         }
 
-        test "ZSETs skiplist implementation backlink consistency test - $encoding" {
+        test "ZSETs btree implementation backlink consistency test - $encoding" {
             set diff 0
             for {set j 0} {$j < $elements} {incr j} {
                 r zadd myzset [expr rand()] "Element-$j"
@@ -1084,7 +1136,7 @@ start_server {tags {"zset"}} {
             assert_equal 0 $diff
         }
 
-        test "ZSETs ZRANK augmented skip list stress testing - $encoding" {
+        test "ZSETs ZRANK augmented B+tree stress testing - $encoding" {
             set err {}
             r del myzset
             for {set k 0} {$k < 2000} {incr k} {
@@ -1198,11 +1250,11 @@ start_server {tags {"zset"}} {
     }
 
     tags {"slow"} {
-        stressers ziplist
-        stressers skiplist
+        stressers listpack
+        stressers btree
     }
 
-    test {ZSET skiplist order consistency when elements are moved} {
+    test {ZSET btree order consistency when elements are moved} {
         set original_max [lindex [r config get zset-max-ziplist-entries] 1]
         r config set zset-max-ziplist-entries 0
         for {set times 0} {$times < 10} {incr times} {
@@ -1227,4 +1279,80 @@ start_server {tags {"zset"}} {
         }
         r config set zset-max-ziplist-entries $original_max
     }
+
+    test {ZSET btree consistency with a multi level tree} {
+        set original_max [lindex [r config get zset-max-ziplist-entries] 1]
+        r config set zset-max-ziplist-entries 0
+        r del zset
+        unset -nocomplain model
+        set n 20000
+
+        # Populate the tree with many equal scores, then update and delete
+        # random elements, keeping track of the expected content.
+        for {set j 0} {$j < $n} {incr j 500} {
+            set args {}
+            for {set k $j} {$k < $j+500} {incr k} {
+                set score [randomInt 1000]
+                lappend args $score ele:$k
+                set model(ele:$k) $score
+            }
+            r zadd zset {*}$args
+        }
+        for {set j 0} {$j < 5000} {incr j} {
+            set ele ele:[randomInt $n]
+            switch [randomInt 3] {
+                0 {
+                    set score [randomInt 1000]
+                    r zadd zset $score $ele
+                    set model($ele) $score
+                }
+                1 {set model($ele) [r zincrby zset 1 $ele]}
+                2 {
+                    r zrem zset $ele
+                    unset -nocomplain model($ele)
+                }
+            }
+        }
+        r zremrangebyscore zset 100 199
+        foreach ele [array names model] {
+            if {$model($ele) >= 100 && $model($ele) <= 199} {
+                unset model($ele)
+            }
+        }
+
+        set pairs {}
+        foreach ele [array names model] {lappend pairs [list $model($ele) $ele]}
+        set pairs [lsort -real -index 0 [lsort -index 1 $pairs]]
+        r zremrangebyrank zset 1000 2999
+        set pairs [lreplace $pairs 1000 2999]
+
+        set expected {}
+        set elements {}
+        foreach pair $pairs {
+            lappend expected [lindex $pair 1] [lindex $pair 0]
+            lappend elements [lindex $pair 1]
+        }
+        assert_encoding btree zset
+        assert_equal [llength $pairs] [r zcard zset]
+        assert_equal $expected [r zrange zset 0 -1 withscores]
+        assert_equal [lreverse $elements] [r zrevrange zset 0 -1]
+
+        for {set j 0} {$j < 100} {incr j} {
+            set rank [randomInt [llength $elements]]
+            assert_equal $rank [r zrank zset [lindex $elements $rank]]
+
+            # Ranges with an offset, and counts, for a random score.
+            set min [randomInt 1100]
+            set inrange {}
+            foreach pair $pairs {
+                if {[lindex $pair 0] >= $min} {lappend inrange [lindex $pair 1]}
+            }
+            assert_equal [llength $inrange] [r zcount zset $min +inf]
+            assert_equal [lrange $inrange 37 46] \
+                [r zrangebyscore zset $min +inf limit 37 10]
+            assert_equal [lrange [lreverse $inrange] 37 46] \
+                [r zrevrangebyscore zset +inf $min limit 37 10]
+        }
+        r config set zset-max-ziplist-entries $original_max
+    }
 }